@@ -18,6 +18,9 @@ namespace GVFS.Common
         public const string WorkingDirectoryRootName = "src";
         public const string UnattendedEnvironmentVariable = "GVFS_UNATTENDED";
 
+        // Set on the git processes GVFS launches so the native hooks they run can skip enlistment discovery
+        public const string PipeNameEnvironmentVariable = "GVFS_PIPE_NAME";
+
         public const string GVFSExecutableName = "GVFS.exe";
         public const string GVFSHooksExecutableName = "GVFS.Hooks.exe";
         public const string GVFSReadObjectHookExecutableName = "GVFS.ReadObjectHook.exe";
@@ -4,6 +4,7 @@ using System;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.IO;
+using System.Linq;
 using System.Net;
 using System.Threading;
 
@@ -94,6 +95,54 @@ namespace GVFS.Common.Git
             return this.TryDownloadAndSaveObject(objectId, CancellationToken.None, requestSource, retryOnFailure: true);
         }
 
+        /// <summary>
+        /// Downloads several objects with one request to the objects endpoint where possible.
+        /// Objects that the batch could not provide are retried one at a time, so each
+        /// result is the same as <see cref="TryDownloadAndSaveObject(string, RequestSource)"/> would give.
+        /// With preferPackfile the batch is kept as a single packfile and index instead of being
+        /// written out as loose objects.
+        /// </summary>
+        public Dictionary<string, DownloadAndSaveObjectResult> TryDownloadAndSaveObjects(IEnumerable<string> objectIds, RequestSource requestSource, bool preferPackfile)
+        {
+            Dictionary<string, DownloadAndSaveObjectResult> results = new Dictionary<string, DownloadAndSaveObjectResult>(StringComparer.OrdinalIgnoreCase);
+            List<string> batchObjectIds = new List<string>();
+            foreach (string objectId in objectIds)
+            {
+                if (results.ContainsKey(objectId) || batchObjectIds.Contains(objectId, StringComparer.OrdinalIgnoreCase))
+                {
+                    continue;
+                }
+
+                // Objects that git asks for even though they are on disk are presumed corrupt and have
+                // to be overwritten, which only the single object download does
+                if (objectId == GVFSConstants.AllZeroSha ||
+                    this.objectNegativeCache.ContainsKey(objectId) ||
+                    (requestSource == RequestSource.NamedPipeMessage && this.Context.Repository.ObjectExists(objectId)))
+                {
+                    results[objectId] = this.TryDownloadAndSaveObject(objectId, requestSource);
+                }
+                else
+                {
+                    batchObjectIds.Add(objectId);
+                }
+            }
+
+            if (batchObjectIds.Count > 1)
+            {
+                this.TryDownloadAndSaveObjects(batchObjectIds, preferBatchedLooseObjects: !preferPackfile);
+            }
+
+            foreach (string objectId in batchObjectIds)
+            {
+                results[objectId] =
+                    batchObjectIds.Count > 1 && this.Context.Repository.ObjectExists(objectId)
+                    ? DownloadAndSaveObjectResult.Success
+                    : this.TryDownloadAndSaveObject(objectId, requestSource);
+            }
+
+            return results;
+        }
+
         public bool TryGetBlobSizeLocally(string sha, out long length)
         {
             return this.Context.Repository.TryGetBlobLength(sha, out length);
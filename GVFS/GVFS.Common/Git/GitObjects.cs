@@ -45,11 +45,19 @@ namespace GVFS.Common.Git
         public virtual bool TryDownloadCommit(string commitSha)
         {
             const bool PreferLooseObjects = false;
-            IEnumerable<string> objectIds = new[] { commitSha };
+            return this.TryDownloadAndSaveObjects(new[] { commitSha }, PreferLooseObjects);
+        }
 
+        /// <summary>
+        /// Downloads the given objects with a single objects endpoint request (plus retries).
+        /// The server omits objects it does not have, so callers that need every object
+        /// should check for them afterwards.
+        /// </summary>
+        public virtual bool TryDownloadAndSaveObjects(IEnumerable<string> objectIds, bool preferBatchedLooseObjects)
+        {
             RetryWrapper<GitObjectsHttpRequestor.GitObjectTaskResult>.InvocationResult output = this.GitObjectRequestor.TryDownloadObjects(
                 objectIds,
-                onSuccess: (tryCount, response) => this.TrySavePackOrLooseObject(objectIds, PreferLooseObjects, response),
+                onSuccess: (tryCount, response) => this.TrySavePackOrLooseObject(objectIds, preferBatchedLooseObjects, response),
                 onFailure: (eArgs) =>
                 {
                     EventMetadata metadata = CreateEventMetadata(eArgs.Error);
@@ -65,7 +73,7 @@ namespace GVFS.Common.Git
                         this.Tracer.RelatedError(metadata, eArgs.Error.ToString(), Keywords.Network);
                     }
                 },
-                preferBatchedLooseObjects: PreferLooseObjects);
+                preferBatchedLooseObjects: preferBatchedLooseObjects);
 
             return output.Succeeded && output.Result.Success;
         }
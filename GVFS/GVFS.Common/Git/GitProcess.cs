@@ -21,6 +21,7 @@ namespace GVFS.Common.Git
         private string workingDirectoryRoot;
         private string dotGitRoot;
         private string gvfsHooksRoot;
+        private string namedPipeName;
 
         static GitProcess()
         {
@@ -35,6 +36,8 @@ namespace GVFS.Common.Git
         public GitProcess(Enlistment enlistment)
             : this(enlistment.GitBinPath, enlistment.WorkingDirectoryRoot, enlistment.GVFSHooksRoot)
         {
+            // Null while the base Enlistment constructor is still running
+            this.namedPipeName = (enlistment as GVFSEnlistment)?.NamedPipeName;
         }
 
         public GitProcess(string gitBinPath, string workingDirectoryRoot, string gvfsHooksRoot)
@@ -391,6 +394,15 @@ namespace GVFS.Common.Git
                     this.gitBinPath,
                     this.gvfsHooksRoot ?? string.Empty);
 
+            if (!string.IsNullOrEmpty(this.namedPipeName))
+            {
+                processInfo.EnvironmentVariables[GVFSConstants.PipeNameEnvironmentVariable] = this.namedPipeName;
+            }
+            else
+            {
+                processInfo.EnvironmentVariables.Remove(GVFSConstants.PipeNameEnvironmentVariable);
+            }
+
             if (!useReadObjectHook)
             {
                 command = "-c " + GitConfigSetting.CoreVirtualizeObjectsName + "=false " + command;
@@ -15,10 +15,16 @@ namespace GVFS.Common
     {
         private ConcurrentHashSet<string> modifiedPaths;
 
+        // Paths are only ever added, so the position of a path in this list is a sequence number
+        // that lets a caller ask for just the paths added after the ones it already has
+        private List<string> pathsInAddOrder;
+
         protected ModifiedPathsDatabase(ITracer tracer, PhysicalFileSystem fileSystem, string dataFilePath) 
             : base(tracer, fileSystem, dataFilePath, collectionAppendsDirectlyToFile: true)
         {
             this.modifiedPaths = new ConcurrentHashSet<string>(StringComparer.OrdinalIgnoreCase);
+            this.pathsInAddOrder = new List<string>();
+            this.Generation = Guid.NewGuid().ToString("N");
         }
 
         public int Count
@@ -26,6 +32,12 @@ namespace GVFS.Common
             get { return this.modifiedPaths.Count; }
         }
 
+        /// <summary>
+        /// Identifies this instance of the database. Sequence numbers from
+        /// GetModifiedPathsAddedSince are only meaningful for the same generation.
+        /// </summary>
+        public string Generation { get; }
+
         public static bool TryLoadOrCreate(ITracer tracer, string dataDirectory, PhysicalFileSystem fileSystem, out ModifiedPathsDatabase output, out string error)
         {
             ModifiedPathsDatabase temp = new ModifiedPathsDatabase(tracer, fileSystem, dataDirectory);
@@ -33,7 +45,7 @@ namespace GVFS.Common
             if (!temp.TryLoadFromDisk<string, string>(
                 temp.TryParseAddLine,
                 temp.TryParseRemoveLine,
-                (key, value) => temp.modifiedPaths.Add(key),
+                (key, value) => temp.AddEntry(key),
                 out error))
             {
                 temp = null;
@@ -63,6 +75,23 @@ namespace GVFS.Common
             return this.modifiedPaths;
         }
 
+        /// <summary>
+        /// Appends the paths added after the first <paramref name="sequence"/> paths to
+        /// <paramref name="addedPaths"/> and returns the sequence number to pass next time.
+        /// </summary>
+        public int GetModifiedPathsAddedSince(int sequence, List<string> addedPaths)
+        {
+            lock (this.pathsInAddOrder)
+            {
+                for (int i = Math.Max(sequence, 0); i < this.pathsInAddOrder.Count; ++i)
+                {
+                    addedPaths.Add(this.pathsInAddOrder[i]);
+                }
+
+                return this.pathsInAddOrder.Count;
+            }
+        }
+
         public bool TryAdd(string path, bool isFolder, out bool isRetryable)
         {
             isRetryable = true;
@@ -71,7 +100,7 @@ namespace GVFS.Common
             {
                 try
                 {
-                    this.WriteAddEntry(entry, () => this.modifiedPaths.Add(entry));
+                    this.WriteAddEntry(entry, () => this.AddEntry(entry));
                 }
                 catch (IOException e)
                 {
@@ -107,6 +136,17 @@ namespace GVFS.Common
             return true;
         }
 
+        private void AddEntry(string entry)
+        {
+            if (this.modifiedPaths.Add(entry))
+            {
+                lock (this.pathsInAddOrder)
+                {
+                    this.pathsInAddOrder.Add(entry);
+                }
+            }
+        }
+
         private bool TryParseAddLine(string line, out string key, out string value, out string error)
         {
             key = line;
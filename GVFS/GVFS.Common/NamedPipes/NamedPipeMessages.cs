@@ -71,14 +71,28 @@ namespace GVFS.Common.NamedPipes
             public const string InvalidVersion = "InvalidVersion";
             public const string SuccessResult = "S";
 
+            // Version 2 requests are "2|<generation>|<sequence>" and the response data is
+            // "<generation>|<sequence>|<I or F>|<paths>", where I means only the paths added since
+            // the requested sequence follow and F means the generation changed and all paths follow
+            public const char IncrementalFieldSeparator = '|';
+            public const string IncrementalResult = "I";
+            public const string FullListResult = "F";
+
             public class Request
             {
                 public Request(Message message)
                 {
-                    this.Version = message.Body;
+                    string[] fields = (message.Body ?? string.Empty).Split(IncrementalFieldSeparator);
+                    this.Version = fields[0];
+                    this.Generation = fields.Length > 1 ? fields[1] : null;
+
+                    int sequence;
+                    this.Sequence = (fields.Length > 2 && int.TryParse(fields[2], out sequence)) ? sequence : 0;
                 }
 
                 public string Version { get; }
+                public string Generation { get; }
+                public int Sequence { get; }
             }
 
             public class Response
@@ -102,10 +116,16 @@ namespace GVFS.Common.NamedPipes
         public static class DownloadObject
         {
             public const string DownloadRequest = "DLO";
+            public const string DownloadBatchRequest = "DLOB";
+            public const string DownloadWithContentRequest = "DLOC";
+            public const string DownloadPackBatchRequest = "DLOP";
             public const string SuccessResult = "S";
             public const string DownloadFailed = "F";
+            public const string PartialSuccessResult = "P";
             public const string InvalidSHAResult = "InvalidSHA";
 
+            public const char BatchShaSeparator = ',';
+
             public class Request
             {
                 public Request(Message message)
@@ -121,18 +141,69 @@ namespace GVFS.Common.NamedPipes
                 }
             }
 
+            /// <summary>
+            /// Request for several objects at once. A <see cref="DownloadBatchRequest"/> is answered with
+            /// one <see cref="Response"/> per requested SHA, in request order, and a
+            /// <see cref="DownloadPackBatchRequest"/> with a single <see cref="BatchResponse"/>.
+            /// </summary>
+            public class BatchRequest
+            {
+                public BatchRequest(Message message)
+                {
+                    this.Header = message.Header;
+                    this.RequestShas = string.IsNullOrEmpty(message.Body) ? new string[0] : message.Body.Split(BatchShaSeparator);
+                }
+
+                public string Header { get; }
+                public string[] RequestShas { get; }
+
+                public Message CreateMessage()
+                {
+                    return new Message(this.Header, string.Join(BatchShaSeparator.ToString(), this.RequestShas));
+                }
+            }
+
+            /// <summary>
+            /// Response to a <see cref="DownloadPackBatchRequest"/>: <see cref="SuccessResult"/> when every
+            /// object was downloaded, otherwise <see cref="PartialSuccessResult"/> with one
+            /// <see cref="SuccessResult"/> or <see cref="DownloadFailed"/> character per requested SHA.
+            /// </summary>
+            public class BatchResponse
+            {
+                public BatchResponse(string result, string objectResults = null)
+                {
+                    this.Result = result;
+                    this.ObjectResults = objectResults;
+                }
+
+                public string Result { get; }
+                public string ObjectResults { get; }
+
+                public Message CreateMessage()
+                {
+                    return new Message(this.Result, this.ObjectResults);
+                }
+            }
+
+            /// <summary>
+            /// Response to a request. A successful <see cref="DownloadWithContentRequest"/> can carry
+            /// the length of the object's contents, which are then written to the pipe, unencoded,
+            /// right after the response line. Without a length the object is only on disk.
+            /// </summary>
             public class Response
             {
-                public Response(string result)
+                public Response(string result, long? contentLength = null)
                 {
                     this.Result = result;
+                    this.ContentLength = contentLength;
                 }
 
                 public string Result { get; }
+                public long? ContentLength { get; }
 
                 public Message CreateMessage()
                 {
-                    return new Message(this.Result, null);
+                    return new Message(this.Result, this.ContentLength?.ToString());
                 }
             }
         }
@@ -2,6 +2,7 @@
 using System;
 using System.IO;
 using System.IO.Pipes;
+using System.Text;
 using System.Threading;
 
 namespace GVFS.Common.NamedPipes
@@ -141,14 +142,14 @@ namespace GVFS.Common.NamedPipes
 
                     if (!connectionBroken)
                     {
-                        try
-                        {
-                            this.handleConnection(new Connection(pipe, () => this.isStopping));
-                        }
-                        catch (Exception e)
-                        {
-                            this.LogErrorAndExit("Unhandled exception in connection handler", e);
-                        }
+                        try
+                        {
+                            this.handleConnection(new Connection(pipe, () => this.isStopping));
+                        }
+                        catch (Exception e)
+                        {
+                            this.LogErrorAndExit("Unhandled exception in connection handler", e);
+                        }
                     }
                 }
             }
@@ -177,6 +178,12 @@ namespace GVFS.Common.NamedPipes
 
         public class Connection
         {
+            // Large enough that responses like the modified paths list go out in a few big pipe
+            // writes instead of one write per 1K characters
+            private const int WriteBufferSize = 64 * 1024;
+
+            private static readonly Encoding UTF8NoBOM = new UTF8Encoding(false);
+
             private NamedPipeServerStream serverStream;
             private StreamReader reader;
             private StreamWriter writer;
@@ -187,7 +194,7 @@ namespace GVFS.Common.NamedPipes
                 this.serverStream = serverStream;
                 this.isStopping = isStopping;
                 this.reader = new StreamReader(this.serverStream);
-                this.writer = new StreamWriter(this.serverStream);
+                this.writer = new StreamWriter(this.serverStream, UTF8NoBOM, WriteBufferSize);
             }
 
             public bool IsConnected
@@ -231,6 +238,53 @@ namespace GVFS.Common.NamedPipes
             {
                 return this.TrySendResponse(message.ToString());
             }
+
+            /// <summary>
+            /// Sends the response line followed by exactly contentLength bytes copied from content.
+            /// The client has to know from the response how many raw bytes follow it.
+            /// </summary>
+            public bool TrySendResponse(NamedPipeMessages.Message message, Stream content, long contentLength)
+            {
+                try
+                {
+                    this.writer.WriteLine(message.ToString());
+                    this.writer.Flush();
+
+                    byte[] buffer = new byte[WriteBufferSize];
+                    long remaining = contentLength;
+                    while (remaining > 0)
+                    {
+                        // The client is already waiting for contentLength bytes, so if they can't
+                        // all be sent the connection can't be used any more
+                        int read;
+                        try
+                        {
+                            read = content.Read(buffer, 0, (int)Math.Min(buffer.Length, remaining));
+                        }
+                        catch (Exception)
+                        {
+                            this.serverStream.Disconnect();
+                            throw;
+                        }
+
+                        if (read <= 0)
+                        {
+                            this.serverStream.Disconnect();
+                            return false;
+                        }
+
+                        this.serverStream.Write(buffer, 0, read);
+                        remaining -= read;
+                    }
+
+                    this.serverStream.Flush();
+                    return true;
+                }
+                catch (IOException)
+                {
+                    return false;
+                }
+            }
         }
     }
 }
@@ -0,0 +1,65 @@
+﻿using GVFS.FunctionalTests.Tools;
+using GVFS.Tests.Should;
+using NUnit.Framework;
+using System.IO;
+using System.Reflection;
+using System.Runtime.InteropServices;
+
+namespace GVFS.FunctionalTests.Windows.Tests
+{
+    [TestFixture]
+    [Category(Categories.Windows)]
+    public class NativeBenchmarkRegressionTests
+    {
+        private const string BaselineFileName = "Baseline.Windows.json";
+
+        // The hydration and write benchmarks use up the placeholders they measure, so every run gets a
+        // freshly cloned enlistment.  See BenchmarkRegressionGate for the environment variables that
+        // control the number of runs, the threshold and where the results go.
+        [TestCase]
+        [Explicit]
+        public void NativeBenchmarksHaveNotRegressed()
+        {
+            string baselinePath = Path.Combine(
+                Path.GetDirectoryName(Assembly.GetExecutingAssembly().Location),
+                "Windows",
+                "TestData",
+                "NativeBenchmarks",
+                BaselineFileName);
+
+            BenchmarkRegressionGate gate = new BenchmarkRegressionGate(baselinePath);
+            string report;
+            gate.RunAndCompare(RunNativeBenchmarks, out report).ShouldBeTrue(report);
+        }
+
+        private static void RunNativeBenchmarks(string resultsPath)
+        {
+            GVFSFunctionalTestEnlistment enlistment = GVFSFunctionalTestEnlistment.CloneAndMount(GVFSTestConfig.PathToGVFS);
+            try
+            {
+                // Enumeration goes first, while the folder has not been enumerated in this mount, and the
+                // write benchmark uses a different folder so that it finds placeholders that aren't hydrated
+                string folder = Path.Combine("GVFS", "GVFS.Common");
+                NativeBenchmarks.NtQueryDirectoryFile_EnumerationBenchmark(enlistment.GetVirtualPathTo(folder), 5, resultsPath).ShouldEqual(true);
+                NativeBenchmarks.ProjFS_HydrationBenchmark(enlistment.RepoRoot, folder, 8, resultsPath).ShouldEqual(true);
+                NativeBenchmarks.ProjFS_WriteBenchmark(enlistment.RepoRoot, Path.Combine("GVFS", "GVFS"), resultsPath).ShouldEqual(true);
+            }
+            finally
+            {
+                enlistment.UnmountAndDeleteAll();
+            }
+        }
+
+        private static class NativeBenchmarks
+        {
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool ProjFS_HydrationBenchmark(string virtualRootPath, string relativeFolder, uint maxThreadCount, string resultsPath);
+
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool NtQueryDirectoryFile_EnumerationBenchmark(string folderPath, uint repeatCount, string resultsPath);
+
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool ProjFS_WriteBenchmark(string virtualRootPath, string relativeFolder, string resultsPath);
+        }
+    }
+}
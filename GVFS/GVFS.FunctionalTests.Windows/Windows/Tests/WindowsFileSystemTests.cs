@@ -1238,6 +1238,41 @@ namespace GVFS.FunctionalTests.Windows.Windows.Tests
             ProjFS_MultiThreadTest.ProjFS_OpenForWritesSameTime(this.Enlistment.RepoRoot).ShouldEqual(true);
         }
 
+        // Hydrates every file it measures, so it only runs when asked for explicitly
+        [TestCase]
+        [Explicit]
+        public void Native_ProjFS_HydrationBenchmark()
+        {
+            ProjFS_Benchmarks.ProjFS_HydrationBenchmark(this.Enlistment.RepoRoot, Path.Combine("GVFS", "GVFS.Common"), 8, string.Empty).ShouldEqual(true);
+        }
+
+        // The first enumeration of each folder is only measured once per mount, so run this against a freshly
+        // cloned enlistment.  Folders with 100k and 1M entries are not part of the functional test repo, set
+        // GVFS_ENUMERATION_BENCHMARK_FOLDERS to a ';' separated list of relative folders to measure others.
+        [TestCase]
+        [Explicit]
+        public void Native_NtQueryDirectoryFile_EnumerationBenchmark()
+        {
+            string folders = Environment.GetEnvironmentVariable("GVFS_ENUMERATION_BENCHMARK_FOLDERS");
+            if (string.IsNullOrEmpty(folders))
+            {
+                folders = string.Join(";", "EnumerateAndReadTestFiles", Path.Combine("GVFS", "GVFS.Common"), Path.Combine("GVFS", "GVFS"));
+            }
+
+            foreach (string folder in folders.Split(new[] { ';' }, StringSplitOptions.RemoveEmptyEntries))
+            {
+                ProjFS_Benchmarks.NtQueryDirectoryFile_EnumerationBenchmark(this.Enlistment.GetVirtualPathTo(folder), 5, string.Empty).ShouldEqual(true);
+            }
+        }
+
+        // Overwrites the placeholders it measures, so it only runs when asked for explicitly
+        [TestCase]
+        [Explicit]
+        public void Native_ProjFS_WriteBenchmark()
+        {
+            ProjFS_Benchmarks.ProjFS_WriteBenchmark(this.Enlistment.RepoRoot, Path.Combine("GVFS", "GVFS.Common"), string.Empty).ShouldEqual(true);
+        }
+
         [TestCase]
         public void Native_ProjFS_SetLink_ToVirtualFile()
         {
@@ -1597,6 +1632,18 @@ namespace GVFS.FunctionalTests.Windows.Windows.Tests
             public static extern bool ProjFS_OpenMultipleFilesForReadsSameTime(string virtualRootPath);
         }
 
+        private class ProjFS_Benchmarks
+        {
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool ProjFS_HydrationBenchmark(string virtualRootPath, string relativeFolder, uint maxThreadCount, string resultsPath);
+
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool NtQueryDirectoryFile_EnumerationBenchmark(string folderPath, uint repeatCount, string resultsPath);
+
+            [DllImport("GVFS.NativeTests.dll")]
+            public static extern bool ProjFS_WriteBenchmark(string virtualRootPath, string relativeFolder, string resultsPath);
+        }
+
         private class ProjFS_SetLinkTest
         {
             [DllImport("GVFS.NativeTests.dll")]
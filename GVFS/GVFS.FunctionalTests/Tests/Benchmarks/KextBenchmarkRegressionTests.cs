@@ -0,0 +1,46 @@
+﻿using GVFS.FunctionalTests.Tools;
+using GVFS.Tests.Should;
+using NUnit.Framework;
+using System;
+using System.IO;
+using System.Reflection;
+
+namespace GVFS.FunctionalTests.Tests.Benchmarks
+{
+    [TestFixture]
+    public class KextBenchmarkRegressionTests
+    {
+        // Path to the PrjFSKextBenchmarks tool, which isn't part of the published build
+        private const string BenchmarksPathEnvironmentVariable = "GVFS_KEXT_BENCHMARKS_PATH";
+        private const string BaselineFileName = "Baseline.Mac.json";
+
+        // See BenchmarkRegressionGate for the environment variables that control the number of runs,
+        // the threshold and where the results go
+        [TestCase]
+        [Explicit]
+        public void KextBenchmarksHaveNotRegressed()
+        {
+            string benchmarksPath = Environment.GetEnvironmentVariable(BenchmarksPathEnvironmentVariable);
+            if (string.IsNullOrEmpty(benchmarksPath))
+            {
+                Assert.Ignore(BenchmarksPathEnvironmentVariable + " is not set");
+            }
+
+            string baselinePath = Path.Combine(
+                Path.GetDirectoryName(Assembly.GetExecutingAssembly().Location),
+                "Tests",
+                "Benchmarks",
+                BaselineFileName);
+
+            BenchmarkRegressionGate gate = new BenchmarkRegressionGate(baselinePath);
+            string report;
+            gate.RunAndCompare(
+                resultsPath =>
+                {
+                    ProcessResult result = ProcessHelper.Run(benchmarksPath, "--results \"" + resultsPath + "\"");
+                    result.ExitCode.ShouldEqual(0, result.Errors);
+                },
+                out report).ShouldBeTrue(report);
+        }
+    }
+}
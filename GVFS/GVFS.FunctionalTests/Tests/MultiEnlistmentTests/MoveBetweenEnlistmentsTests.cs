@@ -0,0 +1,68 @@
+﻿using GVFS.FunctionalTests.FileSystemRunners;
+using GVFS.FunctionalTests.Should;
+using GVFS.FunctionalTests.Tools;
+using GVFS.Tests.Should;
+using NUnit.Framework;
+using System.IO;
+
+namespace GVFS.FunctionalTests.Tests.MultiEnlistmentTests
+{
+    [TestFixture]
+    [Category(Categories.Mac.M1)]
+    public class MoveBetweenEnlistmentsTests : TestsWithMultiEnlistment
+    {
+        private const string TestFileContents = "Moved between enlistments";
+
+        private FileSystemRunner fileSystem;
+
+        public MoveBetweenEnlistmentsTests()
+        {
+            this.fileSystem = new SystemIORunner();
+        }
+
+        [TestCase]
+        public void FileMovedToOtherEnlistmentIsTrackedByIt()
+        {
+            GVFSFunctionalTestEnlistment source = this.CreateNewEnlistment();
+            GVFSFunctionalTestEnlistment target = this.CreateNewEnlistment();
+
+            string fileName = "FileMovedToOtherEnlistmentIsTrackedByIt.txt";
+            string sourcePath = Path.Combine(source.RepoRoot, fileName);
+            string targetPath = Path.Combine(target.RepoRoot, fileName);
+
+            this.fileSystem.WriteAllText(sourcePath, TestFileContents);
+            this.fileSystem.MoveFile(sourcePath, targetPath);
+            this.fileSystem.AppendAllText(targetPath, TestFileContents);
+            targetPath.ShouldBeAFile(this.fileSystem).WithContents(TestFileContents + TestFileContents);
+
+            source.WaitForBackgroundOperations().ShouldEqual(true, "Background operations failed to complete.");
+            target.WaitForBackgroundOperations().ShouldEqual(true, "Background operations failed to complete.");
+            GVFSHelpers.ModifiedPathsShouldContain(this.fileSystem, target.DotGVFSRoot, fileName);
+        }
+
+        [TestCase]
+        public void FolderMovedToOtherEnlistmentIsTrackedByIt()
+        {
+            GVFSFunctionalTestEnlistment source = this.CreateNewEnlistment();
+            GVFSFunctionalTestEnlistment target = this.CreateNewEnlistment();
+
+            string folderName = "FolderMovedToOtherEnlistmentIsTrackedByIt";
+            string sourceFolder = Path.Combine(source.RepoRoot, folderName);
+            string targetFolder = Path.Combine(target.RepoRoot, folderName);
+
+            // Creating the first file has the kext remember which root the folder is in
+            this.fileSystem.CreateDirectory(sourceFolder);
+            this.fileSystem.WriteAllText(Path.Combine(sourceFolder, "CreatedBeforeMove.txt"), TestFileContents);
+            this.fileSystem.MoveDirectory(sourceFolder, targetFolder);
+
+            string fileCreatedAfterMove = Path.Combine(targetFolder, "CreatedAfterMove.txt");
+            this.fileSystem.WriteAllText(fileCreatedAfterMove, TestFileContents);
+            fileCreatedAfterMove.ShouldBeAFile(this.fileSystem).WithContents(TestFileContents);
+
+            source.WaitForBackgroundOperations().ShouldEqual(true, "Background operations failed to complete.");
+            target.WaitForBackgroundOperations().ShouldEqual(true, "Background operations failed to complete.");
+            GVFSHelpers.ModifiedPathsShouldContain(this.fileSystem, target.DotGVFSRoot, folderName + "/");
+            GVFSHelpers.ModifiedPathsShouldNotContain(this.fileSystem, source.DotGVFSRoot, folderName + "/CreatedAfterMove.txt");
+        }
+    }
+}
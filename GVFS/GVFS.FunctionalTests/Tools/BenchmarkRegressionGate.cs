@@ -0,0 +1,327 @@
+﻿using Newtonsoft.Json;
+using Newtonsoft.Json.Linq;
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.Linq;
+using System.Text;
+
+namespace GVFS.FunctionalTests.Tools
+{
+    /// <summary>
+    /// Compares the results of several runs of the native benchmark suites against a checked in
+    /// baseline. Each run is a file of JSON results, one per line, as written by the suites.
+    /// </summary>
+    /// <remarks>
+    /// The baseline file is a JSON object:
+    ///
+    /// thresholdPercent -> How much worse than the baseline a metric's median may get
+    /// metrics          -> Names of the members compared, metrics ending in "PerSecond" are better
+    ///                     when higher, all others when lower
+    /// results          -> Baseline results, each with the members that identify it and the
+    ///                     baseline value of each metric
+    ///
+    /// A metric fails the gate when its median is worse than the baseline by more than the
+    /// threshold and the baseline is also outside the median's 95% confidence interval, so that a
+    /// single noisy run can't fail it. Results without a baseline are reported but never fail,
+    /// while baseline results that are missing from every run do. So does a baseline without any
+    /// results: record one with GVFS_BENCHMARK_WRITE_BASELINE and check it in first.
+    /// </remarks>
+    public class BenchmarkRegressionGate
+    {
+        public const string RunCountEnvironmentVariable = "GVFS_BENCHMARK_RUNS";
+        public const string ThresholdEnvironmentVariable = "GVFS_BENCHMARK_THRESHOLD_PERCENT";
+        public const string ResultsFolderEnvironmentVariable = "GVFS_BENCHMARK_RESULTS_DIR";
+        public const string WriteBaselineEnvironmentVariable = "GVFS_BENCHMARK_WRITE_BASELINE";
+
+        private const int DefaultRunCount = 5;
+        private const double ConfidenceLevel = 0.95;
+
+        // Members that vary from run to run, everything else in a result identifies it
+        private static readonly HashSet<string> MeasurementMembers = new HashSet<string>
+        {
+            "operations", "wallMs", "opsPerSecond", "meanUs", "p50Us", "p95Us", "p99Us", "maxUs",
+            "medianNs", "minNs", "maxNs",
+        };
+
+        private string baselinePath;
+        private double thresholdPercent;
+        private List<string> metrics;
+        private Dictionary<string, JObject> baselineResults;
+
+        public BenchmarkRegressionGate(string baselinePath)
+        {
+            this.baselinePath = baselinePath;
+
+            JObject baseline = JObject.Parse(File.ReadAllText(baselinePath));
+            this.thresholdPercent = baseline.Value<double>("thresholdPercent");
+            this.metrics = baseline["metrics"].Values<string>().ToList();
+            this.baselineResults = new Dictionary<string, JObject>();
+            foreach (JObject result in baseline["results"].Children<JObject>())
+            {
+                this.baselineResults[GetResultKey(result)] = result;
+            }
+
+            string threshold = Environment.GetEnvironmentVariable(ThresholdEnvironmentVariable);
+            if (!string.IsNullOrEmpty(threshold))
+            {
+                this.thresholdPercent = double.Parse(threshold, CultureInfo.InvariantCulture);
+            }
+        }
+
+        /// <summary>
+        /// Calls runSuites once per run, GVFS_BENCHMARK_RUNS times (5 by default), with the path of
+        /// the file that run's results should go to, and then compares the runs against the baseline.
+        /// The results and the report are kept in GVFS_BENCHMARK_RESULTS_DIR if it is set. If
+        /// GVFS_BENCHMARK_WRITE_BASELINE is set, the medians are also written there as a new baseline.
+        /// </summary>
+        /// <returns>True if no metric regressed and no baseline result is missing</returns>
+        public bool RunAndCompare(Action<string> runSuites, out string report)
+        {
+            int runCount = DefaultRunCount;
+            string runs = Environment.GetEnvironmentVariable(RunCountEnvironmentVariable);
+            if (!string.IsNullOrEmpty(runs))
+            {
+                runCount = int.Parse(runs, CultureInfo.InvariantCulture);
+            }
+
+            string resultsFolder = Environment.GetEnvironmentVariable(ResultsFolderEnvironmentVariable);
+            if (string.IsNullOrEmpty(resultsFolder))
+            {
+                resultsFolder = Path.Combine(Path.GetTempPath(), "GVFSBenchmarks", Guid.NewGuid().ToString("N"));
+            }
+
+            Directory.CreateDirectory(resultsFolder);
+
+            List<string> runResultsPaths = new List<string>();
+            for (int run = 0; run < runCount; ++run)
+            {
+                string runResultsPath = Path.Combine(resultsFolder, "run" + run + ".jsonl");
+                File.Delete(runResultsPath);
+                runSuites(runResultsPath);
+                runResultsPaths.Add(runResultsPath);
+            }
+
+            Dictionary<string, List<JObject>> results = ReadRuns(runResultsPaths);
+
+            string newBaselinePath = Environment.GetEnvironmentVariable(WriteBaselineEnvironmentVariable);
+            if (!string.IsNullOrEmpty(newBaselinePath))
+            {
+                this.WriteBaseline(results, newBaselinePath);
+            }
+
+            bool passed = this.Compare(results, out report);
+            File.WriteAllText(Path.Combine(resultsFolder, "report.txt"), report);
+            Console.WriteLine(report);
+            return passed;
+        }
+
+        private static Dictionary<string, List<JObject>> ReadRuns(IEnumerable<string> runResultsPaths)
+        {
+            Dictionary<string, List<JObject>> results = new Dictionary<string, List<JObject>>();
+            foreach (string runResultsPath in runResultsPaths)
+            {
+                foreach (string line in File.ReadAllLines(runResultsPath))
+                {
+                    if (string.IsNullOrWhiteSpace(line))
+                    {
+                        continue;
+                    }
+
+                    JObject result = JObject.Parse(line);
+                    string key = GetResultKey(result);
+
+                    List<JObject> keyResults;
+                    if (!results.TryGetValue(key, out keyResults))
+                    {
+                        keyResults = new List<JObject>();
+                        results.Add(key, keyResults);
+                    }
+
+                    keyResults.Add(result);
+                }
+            }
+
+            return results;
+        }
+
+        private static string GetResultKey(JObject result)
+        {
+            IEnumerable<string> parameters = result.Properties()
+                .Where(property => property.Name != "suite" && property.Name != "benchmark" && !MeasurementMembers.Contains(property.Name))
+                .Select(property => property.Name + "=" + property.Value.ToString(Formatting.None));
+
+            return string.Format(
+                "{0}/{1} {2}",
+                result.Value<string>("suite"),
+                result.Value<string>("benchmark"),
+                string.Join(", ", parameters)).TrimEnd();
+        }
+
+        private static List<double> GetSortedValues(List<JObject> results, string metric)
+        {
+            return results
+                .Where(result => result[metric] != null)
+                .Select(result => result.Value<double>(metric))
+                .OrderBy(value => value)
+                .ToList();
+        }
+
+        private static double Median(List<double> sortedValues)
+        {
+            int middle = sortedValues.Count / 2;
+            return sortedValues.Count % 2 == 1 ? sortedValues[middle] : (sortedValues[middle - 1] + sortedValues[middle]) / 2;
+        }
+
+        // Distribution free interval from order statistics: the median lies between the k-th smallest
+        // and the k-th largest of n values with probability 1 - 2 * P(Binomial(n, 0.5) < k). With
+        // fewer than 6 runs no k reaches the confidence level and the interval is the whole range.
+        private static void MedianConfidenceInterval(List<double> sortedValues, out double lower, out double upper)
+        {
+            int count = sortedValues.Count;
+            double tailProbability = (1 - ConfidenceLevel) / 2;
+            double probabilityBelowK = 0;
+            double probabilityOfK = Math.Pow(0.5, count);
+            int k = 0;
+            while (k < count / 2 && probabilityBelowK + probabilityOfK <= tailProbability)
+            {
+                probabilityBelowK += probabilityOfK;
+                ++k;
+                probabilityOfK = probabilityOfK * (count - k + 1) / k;
+            }
+
+            k = Math.Max(k, 1);
+            lower = sortedValues[k - 1];
+            upper = sortedValues[count - k];
+        }
+
+        private static bool HigherIsBetter(string metric)
+        {
+            return metric.EndsWith("PerSecond", StringComparison.Ordinal);
+        }
+
+        private bool Compare(Dictionary<string, List<JObject>> results, out string report)
+        {
+            StringBuilder reportBuilder = new StringBuilder();
+            reportBuilder.AppendFormat(
+                CultureInfo.InvariantCulture,
+                "Benchmark results compared to {0} (threshold {1}%)\n",
+                this.baselinePath,
+                this.thresholdPercent);
+
+            int regressionCount = 0;
+            int missingCount = 0;
+            foreach (KeyValuePair<string, List<JObject>> keyResults in results.OrderBy(pair => pair.Key, StringComparer.Ordinal))
+            {
+                JObject baselineResult;
+                this.baselineResults.TryGetValue(keyResults.Key, out baselineResult);
+
+                foreach (string metric in this.metrics)
+                {
+                    List<double> values = GetSortedValues(keyResults.Value, metric);
+                    if (values.Count == 0)
+                    {
+                        continue;
+                    }
+
+                    double median = Median(values);
+                    double lower;
+                    double upper;
+                    MedianConfidenceInterval(values, out lower, out upper);
+
+                    string status;
+                    string delta = string.Empty;
+                    if (baselineResult == null || baselineResult[metric] == null)
+                    {
+                        status = "NEW";
+                    }
+                    else
+                    {
+                        double baseline = baselineResult.Value<double>(metric);
+                        double deltaPercent = baseline != 0 ? (median - baseline) * 100 / baseline : 0;
+                        double regressionPercent = HigherIsBetter(metric) ? -deltaPercent : deltaPercent;
+                        bool baselineInInterval = baseline >= lower && baseline <= upper;
+
+                        if (regressionPercent > this.thresholdPercent && !baselineInInterval)
+                        {
+                            status = "REGRESSED";
+                            ++regressionCount;
+                        }
+                        else if (regressionPercent < -this.thresholdPercent && !baselineInInterval)
+                        {
+                            status = "IMPROVED";
+                        }
+                        else
+                        {
+                            status = "OK";
+                        }
+
+                        delta = string.Format(CultureInfo.InvariantCulture, ", baseline {0:0.###}, delta {1:+0.0;-0.0;0.0}%", baseline, deltaPercent);
+                    }
+
+                    reportBuilder.AppendFormat(
+                        CultureInfo.InvariantCulture,
+                        "{0,-10} {1} {2}: median {3:0.###} (95% CI {4:0.###} - {5:0.###}, {6} runs){7}\n",
+                        status,
+                        keyResults.Key,
+                        metric,
+                        median,
+                        lower,
+                        upper,
+                        values.Count,
+                        delta);
+                }
+            }
+
+            foreach (string missingKey in this.baselineResults.Keys.Where(key => !results.ContainsKey(key)).OrderBy(key => key, StringComparer.Ordinal))
+            {
+                reportBuilder.AppendFormat("{0,-10} {1}: in the baseline but not in any run\n", "MISSING", missingKey);
+                ++missingCount;
+            }
+
+            bool baselineIsEmpty = this.baselineResults.Count == 0;
+            if (baselineIsEmpty)
+            {
+                reportBuilder.AppendFormat(
+                    "{0} has no results to compare against. Record a baseline by setting {1} to the path to write it to, and check it in.\n",
+                    this.baselinePath,
+                    WriteBaselineEnvironmentVariable);
+            }
+
+            reportBuilder.AppendFormat("{0} metric(s) regressed, {1} result(s) missing\n", regressionCount, missingCount);
+            report = reportBuilder.ToString();
+            return regressionCount == 0 && missingCount == 0 && !baselineIsEmpty;
+        }
+
+        private void WriteBaseline(Dictionary<string, List<JObject>> results, string path)
+        {
+            JArray baselineResults = new JArray();
+            foreach (KeyValuePair<string, List<JObject>> keyResults in results.OrderBy(pair => pair.Key, StringComparer.Ordinal))
+            {
+                JObject baselineResult = new JObject();
+                foreach (JProperty property in keyResults.Value[0].Properties().Where(property => !MeasurementMembers.Contains(property.Name)))
+                {
+                    baselineResult.Add(property.Name, property.Value);
+                }
+
+                foreach (string metric in this.metrics)
+                {
+                    List<double> values = GetSortedValues(keyResults.Value, metric);
+                    if (values.Count > 0)
+                    {
+                        baselineResult.Add(metric, Math.Round(Median(values), 3));
+                    }
+                }
+
+                baselineResults.Add(baselineResult);
+            }
+
+            JObject baseline = new JObject();
+            baseline.Add("thresholdPercent", this.thresholdPercent);
+            baseline.Add("metrics", new JArray(this.metrics));
+            baseline.Add("results", baselineResults);
+            File.WriteAllText(path, baseline.ToString(Formatting.Indented));
+        }
+    }
+}
@@ -12,6 +12,8 @@ using System;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.IO;
+using System.Linq;
+using System.Text;
 using System.Threading;
 
 namespace GVFS.Mount
@@ -22,6 +24,7 @@ namespace GVFS.Mount
         private const int MaxPipeNameLength = 250;
         private const int MutexMaxWaitTimeMS = 500;
         private const string ModifiedPathsVersion = "1";
+        private const string ModifiedPathsIncrementalVersion = "2";
 
         private readonly bool showDebugWindow;
 
@@ -34,8 +37,15 @@ namespace GVFS.Mount
 
         private GVFSContext context;
         private GVFSGitObjects gitObjects;
+        private RecentObjectIndex recentObjects;
 
         private MountState currentState;
+
+        // The version 1 response, extended as paths are added rather than rebuilt for every request
+        private object modifiedPathsDataLock = new object();
+        private StringBuilder modifiedPathsData = new StringBuilder();
+        private string modifiedPathsDataGeneration;
+        private int modifiedPathsDataSequence;
         private HeartbeatThread heartbeat;
         private ManualResetEvent unmountEvent;
 
@@ -245,7 +255,16 @@ namespace GVFS.Mount
                     break;
 
                 case NamedPipeMessages.DownloadObject.DownloadRequest:
-                    this.HandleDownloadObjectRequest(message, connection);
+                    this.HandleDownloadObjectRequest(message, connection, sendContent: false);
+                    break;
+
+                case NamedPipeMessages.DownloadObject.DownloadWithContentRequest:
+                    this.HandleDownloadObjectRequest(message, connection, sendContent: true);
+                    break;
+
+                case NamedPipeMessages.DownloadObject.DownloadBatchRequest:
+                case NamedPipeMessages.DownloadObject.DownloadPackBatchRequest:
+                    this.HandleDownloadObjectBatchRequest(message, connection);
                     break;
 
                 case NamedPipeMessages.ModifiedPaths.ListRequest:
@@ -352,21 +371,78 @@ namespace GVFS.Mount
             }
             else
             {
-                if (request.Version != ModifiedPathsVersion)
+                if (request.Version == ModifiedPathsVersion)
                 {
-                    response = new NamedPipeMessages.ModifiedPaths.Response(NamedPipeMessages.ModifiedPaths.InvalidVersion);
+                    response = new NamedPipeMessages.ModifiedPaths.Response(NamedPipeMessages.ModifiedPaths.SuccessResult, this.GetModifiedPathsData());
+                }
+                else if (request.Version == ModifiedPathsIncrementalVersion)
+                {
+                    response = new NamedPipeMessages.ModifiedPaths.Response(
+                        NamedPipeMessages.ModifiedPaths.SuccessResult,
+                        this.GetModifiedPathsDelta(request.Generation, request.Sequence));
                 }
                 else
                 {
-                    string data = string.Join("\0", this.fileSystemCallbacks.GetAllModifiedPaths()) + "\0";
-                    response = new NamedPipeMessages.ModifiedPaths.Response(NamedPipeMessages.ModifiedPaths.SuccessResult, data);
+                    response = new NamedPipeMessages.ModifiedPaths.Response(NamedPipeMessages.ModifiedPaths.InvalidVersion);
                 }
             }
 
             connection.TrySendResponse(response.CreateMessage());
         }
 
-        private void HandleDownloadObjectRequest(NamedPipeMessages.Message message, NamedPipeServer.Connection connection)
+        private string GetModifiedPathsData()
+        {
+            lock (this.modifiedPathsDataLock)
+            {
+                string generation = this.fileSystemCallbacks.ModifiedPathsGeneration;
+                if (generation != this.modifiedPathsDataGeneration)
+                {
+                    this.modifiedPathsData.Clear();
+                    this.modifiedPathsDataGeneration = generation;
+                    this.modifiedPathsDataSequence = 0;
+                }
+
+                List<string> addedPaths = new List<string>();
+                this.modifiedPathsDataSequence = this.fileSystemCallbacks.GetModifiedPathsAddedSince(this.modifiedPathsDataSequence, addedPaths);
+                foreach (string path in addedPaths)
+                {
+                    this.modifiedPathsData.Append(path).Append('\0');
+                }
+
+                return this.modifiedPathsData.ToString();
+            }
+        }
+
+        private string GetModifiedPathsDelta(string generation, int sequence)
+        {
+            string currentGeneration = this.fileSystemCallbacks.ModifiedPathsGeneration;
+            string listType = NamedPipeMessages.ModifiedPaths.IncrementalResult;
+            if (generation != currentGeneration)
+            {
+                listType = NamedPipeMessages.ModifiedPaths.FullListResult;
+                sequence = 0;
+            }
+
+            List<string> addedPaths = new List<string>();
+            int nextSequence = this.fileSystemCallbacks.GetModifiedPathsAddedSince(sequence, addedPaths);
+
+            StringBuilder data = new StringBuilder();
+            data.Append(currentGeneration).Append(NamedPipeMessages.ModifiedPaths.IncrementalFieldSeparator);
+            data.Append(nextSequence).Append(NamedPipeMessages.ModifiedPaths.IncrementalFieldSeparator);
+            data.Append(listType).Append(NamedPipeMessages.ModifiedPaths.IncrementalFieldSeparator);
+            foreach (string path in addedPaths)
+            {
+                data.Append(path).Append('\0');
+            }
+
+            return data.ToString();
+        }
+
+        /// <summary>
+        /// Downloads the object to disk. With sendContent, a blob's contents also go back over the
+        /// pipe, so that the read-object hook can hand them straight to git.
+        /// </summary>
+        private void HandleDownloadObjectRequest(NamedPipeMessages.Message message, NamedPipeServer.Connection connection, bool sendContent)
         {
             NamedPipeMessages.DownloadObject.Response response;
 
@@ -385,8 +461,10 @@ namespace GVFS.Mount
                 else
                 {
                     Stopwatch downloadTime = Stopwatch.StartNew();
-                    if (this.gitObjects.TryDownloadAndSaveObject(objectSha, GVFSGitObjects.RequestSource.NamedPipeMessage) == GitObjects.DownloadAndSaveObjectResult.Success)
+                    bool downloaded = this.gitObjects.TryDownloadAndSaveObject(objectSha, GVFSGitObjects.RequestSource.NamedPipeMessage) == GitObjects.DownloadAndSaveObjectResult.Success;
+                    if (downloaded)
                     {
+                        this.recentObjects?.Add(objectSha);
                         response = new NamedPipeMessages.DownloadObject.Response(NamedPipeMessages.DownloadObject.SuccessResult);
                     }
                     else
@@ -397,12 +475,128 @@ namespace GVFS.Mount
                     bool isBlob;
                     this.context.Repository.TryGetIsBlob(objectSha, out isBlob);
                     this.context.Repository.GVFSLock.Stats.RecordObjectDownload(isBlob, downloadTime.ElapsedMilliseconds);
+
+                    if (downloaded && sendContent && isBlob)
+                    {
+                        // Other object types, and blobs that can't be read back, are left for git to
+                        // read from disk, which a response without a content length tells the hook
+                        bool responseSent = false;
+                        this.context.Repository.TryCopyBlobContentStream(
+                            objectSha,
+                            (stream, length) =>
+                            {
+                                responseSent = true;
+                                connection.TrySendResponse(
+                                    new NamedPipeMessages.DownloadObject.Response(NamedPipeMessages.DownloadObject.SuccessResult, length).CreateMessage(),
+                                    stream,
+                                    length);
+                            });
+
+                        if (responseSent)
+                        {
+                            return;
+                        }
+                    }
                 }
             }
 
             connection.TrySendResponse(response.CreateMessage());
         }
 
+        private void HandleDownloadObjectBatchRequest(NamedPipeMessages.Message message, NamedPipeServer.Connection connection)
+        {
+            NamedPipeMessages.DownloadObject.BatchRequest request = new NamedPipeMessages.DownloadObject.BatchRequest(message);
+            bool packBatch = request.Header == NamedPipeMessages.DownloadObject.DownloadPackBatchRequest;
+            Dictionary<string, GitObjects.DownloadAndSaveObjectResult> results = null;
+            long averageDownloadMilliseconds = 0;
+            if (this.currentState == MountState.Ready)
+            {
+                List<string> validShas = request.RequestShas.Where(sha => SHA1Util.IsValidShaFormat(sha)).ToList();
+
+                Stopwatch downloadTime = Stopwatch.StartNew();
+                results = this.gitObjects.TryDownloadAndSaveObjects(validShas, GVFSGitObjects.RequestSource.NamedPipeMessage, preferPackfile: packBatch);
+                averageDownloadMilliseconds = validShas.Count > 0 ? downloadTime.ElapsedMilliseconds / validShas.Count : 0;
+            }
+
+            if (packBatch)
+            {
+                connection.TrySendResponse(this.CreatePackBatchResponse(request, results, averageDownloadMilliseconds).CreateMessage());
+                return;
+            }
+
+            // One response per requested SHA, in the order they were requested
+            foreach (string objectSha in request.RequestShas)
+            {
+                NamedPipeMessages.DownloadObject.Response response;
+                GitObjects.DownloadAndSaveObjectResult result;
+                if (results == null)
+                {
+                    response = new NamedPipeMessages.DownloadObject.Response(NamedPipeMessages.MountNotReadyResult);
+                }
+                else if (!results.TryGetValue(objectSha, out result))
+                {
+                    response = new NamedPipeMessages.DownloadObject.Response(NamedPipeMessages.DownloadObject.InvalidSHAResult);
+                }
+                else
+                {
+                    response = new NamedPipeMessages.DownloadObject.Response(
+                        result == GitObjects.DownloadAndSaveObjectResult.Success
+                        ? NamedPipeMessages.DownloadObject.SuccessResult
+                        : NamedPipeMessages.DownloadObject.DownloadFailed);
+
+                    if (result == GitObjects.DownloadAndSaveObjectResult.Success)
+                    {
+                        this.recentObjects?.Add(objectSha);
+                    }
+
+                    bool isBlob;
+                    this.context.Repository.TryGetIsBlob(objectSha, out isBlob);
+                    this.context.Repository.GVFSLock.Stats.RecordObjectDownload(isBlob, averageDownloadMilliseconds);
+                }
+
+                if (!connection.TrySendResponse(response.CreateMessage()))
+                {
+                    break;
+                }
+            }
+        }
+
+        private NamedPipeMessages.DownloadObject.BatchResponse CreatePackBatchResponse(
+            NamedPipeMessages.DownloadObject.BatchRequest request,
+            Dictionary<string, GitObjects.DownloadAndSaveObjectResult> results,
+            long averageDownloadMilliseconds)
+        {
+            if (results == null)
+            {
+                return new NamedPipeMessages.DownloadObject.BatchResponse(NamedPipeMessages.MountNotReadyResult);
+            }
+
+            StringBuilder objectResults = new StringBuilder(request.RequestShas.Length);
+            bool allSucceeded = true;
+            foreach (string objectSha in request.RequestShas)
+            {
+                GitObjects.DownloadAndSaveObjectResult result;
+                if (results.TryGetValue(objectSha, out result) && result == GitObjects.DownloadAndSaveObjectResult.Success)
+                {
+                    objectResults.Append(NamedPipeMessages.DownloadObject.SuccessResult);
+                    this.recentObjects?.Add(objectSha);
+
+                    bool isBlob;
+                    this.context.Repository.TryGetIsBlob(objectSha, out isBlob);
+                    this.context.Repository.GVFSLock.Stats.RecordObjectDownload(isBlob, averageDownloadMilliseconds);
+                }
+                else
+                {
+                    objectResults.Append(NamedPipeMessages.DownloadObject.DownloadFailed);
+                    allSucceeded = false;
+                }
+            }
+
+            return allSucceeded
+                ? new NamedPipeMessages.DownloadObject.BatchResponse(NamedPipeMessages.DownloadObject.SuccessResult)
+                : new NamedPipeMessages.DownloadObject.BatchResponse(NamedPipeMessages.DownloadObject.PartialSuccessResult, objectResults.ToString());
+        }
+
         private void HandlePostFetchJobRequest(NamedPipeMessages.Message message, NamedPipeServer.Connection connection)
         {
             NamedPipeMessages.RunPostFetchJob.Request request = new NamedPipeMessages.RunPostFetchJob.Request(message);
@@ -506,6 +700,7 @@ namespace GVFS.Mount
 
             GitObjectsHttpRequestor objectRequestor = new GitObjectsHttpRequestor(this.context.Tracer, this.context.Enlistment, cache, this.retryConfig);
             this.gitObjects = new GVFSGitObjects(this.context, objectRequestor);
+            this.recentObjects = RecentObjectIndex.TryCreate(this.tracer, this.enlistment.NamedPipeName);
             FileSystemVirtualizer virtualizer = this.CreateOrReportAndExit(() => GVFSPlatformLoader.CreateFileSystemVirtualizer(this.context, this.gitObjects), "Failed to create src folder virtualizer");
             this.fileSystemCallbacks = this.CreateOrReportAndExit(() => new FileSystemCallbacks(this.context, this.gitObjects, RepoMetadata.Instance, virtualizer), "Failed to create src folder callback listener");
 
@@ -554,6 +749,12 @@ namespace GVFS.Mount
                 this.fileSystemCallbacks.Dispose();
                 this.fileSystemCallbacks = null;
             }
+
+            if (this.recentObjects != null)
+            {
+                this.recentObjects.Dispose();
+                this.recentObjects = null;
+            }
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+﻿using GVFS.Common.Tracing;
+using System;
+using System.IO.MemoryMappedFiles;
+using System.Text;
+
+namespace GVFS.Mount
+{
+    /// <summary>
+    /// Shared memory table of the objects that were recently downloaded for git, which only the mount
+    /// writes. The read-object hook checks it before asking the mount for an object, so that git
+    /// processes missing an object another process has just downloaded don't each make a request.
+    /// </summary>
+    /// <remarks>
+    /// The layout has to match GVFS.ReadObjectHook. After a header of two uint32s, the version and
+    /// the slot count, come slots of a 40 character lowercase SHA followed by the UTC FILETIME it was
+    /// downloaded at. A SHA goes in the slot picked by its first 8 hex digits, replacing whatever
+    /// was there. Readers aren't synchronized with the writer, but the timestamp is cleared before
+    /// a slot's SHA is written and set afterwards, and readers compare the whole SHA, so a partial
+    /// write can only make a reader miss.
+    /// </remarks>
+    public class RecentObjectIndex : IDisposable
+    {
+        public const int Version = 1;
+
+        private const int SlotCount = 16 * 1024;
+        private const int ShaLength = 40;
+        private const int HeaderSize = 2 * sizeof(uint);
+        private const int SlotSize = ShaLength + sizeof(long);
+
+        private readonly object writeLock = new object();
+
+        private MemoryMappedFile mapping;
+        private MemoryMappedViewAccessor view;
+
+        private RecentObjectIndex(MemoryMappedFile mapping)
+        {
+            this.mapping = mapping;
+            this.view = mapping.CreateViewAccessor();
+            this.view.Write(0, (uint)Version);
+            this.view.Write(sizeof(uint), (uint)SlotCount);
+        }
+
+        public static string GetMappingName(string namedPipeName)
+        {
+            return "Local\\" + namedPipeName.Replace('\\', '_') + "_RecentObjects";
+        }
+
+        /// <summary>
+        /// Returns null if the index can't be created, in which case the hook always asks the mount.
+        /// </summary>
+        public static RecentObjectIndex TryCreate(ITracer tracer, string namedPipeName)
+        {
+            string mappingName = GetMappingName(namedPipeName);
+            try
+            {
+                return new RecentObjectIndex(
+                    MemoryMappedFile.CreateNew(mappingName, HeaderSize + ((long)SlotCount * SlotSize), MemoryMappedFileAccess.ReadWrite));
+            }
+            catch (Exception e)
+            {
+                EventMetadata metadata = new EventMetadata();
+                metadata.Add("MappingName", mappingName);
+                metadata.Add("Exception", e.ToString());
+                tracer.RelatedWarning(metadata, nameof(RecentObjectIndex) + ": Failed to create recent object index", Keywords.Telemetry);
+                return null;
+            }
+        }
+
+        public void Add(string objectSha)
+        {
+            if (objectSha == null || objectSha.Length != ShaLength)
+            {
+                return;
+            }
+
+            byte[] shaBytes = Encoding.ASCII.GetBytes(objectSha.ToLowerInvariant());
+            long slotOffset = HeaderSize + ((long)(Convert.ToUInt32(objectSha.Substring(0, 8), 16) % SlotCount) * SlotSize);
+
+            lock (this.writeLock)
+            {
+                if (this.view == null)
+                {
+                    return;
+                }
+
+                this.view.Write(slotOffset + ShaLength, 0L);
+                this.view.WriteArray(slotOffset, shaBytes, 0, shaBytes.Length);
+                this.view.Write(slotOffset + ShaLength, DateTime.UtcNow.ToFileTimeUtc());
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (this.writeLock)
+            {
+                if (this.view != null)
+                {
+                    this.view.Dispose();
+                    this.view = null;
+                }
+
+                if (this.mapping != null)
+                {
+                    this.mapping.Dispose();
+                    this.mapping = null;
+                }
+            }
+        }
+    }
+}
@@ -13,8 +13,9 @@ enum ReturnCode
 	PipeReadFailed = 8,
 	FailureToDownload = 9,
 	PathNameError = 10,
+	PipeTimeout = 11,
 
-	LastError = PathNameError,	
+	LastError = PipeTimeout,	
 };
 
 inline void die(int err, const char *fmt, ...)
@@ -26,6 +27,47 @@ inline void die(int err, const char *fmt, ...)
 	exit(err);
 }
 
+inline std::wstring GetEnvironmentVariableString(const wchar_t* name)
+{
+	DWORD bufferLength = GetEnvironmentVariableW(name, NULL, 0);
+	if (bufferLength == 0)
+	{
+		return std::wstring();
+	}
+
+	std::wstring value(bufferLength, L'\0');
+	DWORD valueLength = GetEnvironmentVariableW(name, &value[0], bufferLength);
+	if (valueLength == 0 || valueLength >= bufferLength)
+	{
+		return std::wstring();
+	}
+
+	value.resize(valueLength);
+	return value;
+}
+
+// Adds the "\\?\" (or "\\?\UNC\") prefix that lets the wide file APIs accept paths longer than MAX_PATH
+inline std::wstring GetLongPath(const std::wstring& path)
+{
+	if (path.length() < MAX_PATH || path.compare(0, 4, L"\\\\?\\") == 0)
+	{
+		return path;
+	}
+
+	if (path.compare(0, 2, L"\\\\") == 0)
+	{
+		return L"\\\\?\\UNC\\" + path.substr(2);
+	}
+
+	return L"\\\\?\\" + path;
+}
+
+inline bool IsDirectory(const std::wstring& path)
+{
+	DWORD attributes = GetFileAttributesW(GetLongPath(path).c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
 inline std::wstring GetFinalPathName(const std::wstring& path)
 {
 	HANDLE fileHandle;
@@ -34,7 +76,7 @@ inline std::wstring GetFinalPathName(const std::wstring& path)
 	// According to MSDN, https://msdn.microsoft.com/en-us/library/windows/desktop/aa363858(v=vs.85).aspx,
 	// we must set this flag to obtain a handle to a directory
 	fileHandle = CreateFileW(
-		path.c_str(),
+		GetLongPath(path).c_str(),
 		FILE_READ_ATTRIBUTES,
 		FILE_SHARE_READ | FILE_SHARE_WRITE,
 		NULL,
@@ -47,14 +89,23 @@ inline std::wstring GetFinalPathName(const std::wstring& path)
 		die(ReturnCode::PathNameError, "Could not open oppen handle to %ls to determine final path name, Error: %d\n", path.c_str(), GetLastError());
 	}
 
-	wchar_t finalPathByHandle[MAX_PATH] = { 0 };
-	DWORD finalPathSize = GetFinalPathNameByHandleW(fileHandle, finalPathByHandle, MAX_PATH, FILE_NAME_NORMALIZED);
-	if (finalPathSize == 0)
+	std::wstring finalPath(MAX_PATH, L'\0');
+	DWORD finalPathSize = GetFinalPathNameByHandleW(fileHandle, &finalPath[0], MAX_PATH, FILE_NAME_NORMALIZED);
+	if (finalPathSize >= MAX_PATH)
+	{
+		// The return value is the required buffer size, including the terminating null
+		finalPath.resize(finalPathSize);
+		finalPathSize = GetFinalPathNameByHandleW(fileHandle, &finalPath[0], finalPathSize, FILE_NAME_NORMALIZED);
+	}
+
+	CloseHandle(fileHandle);
+
+	if (finalPathSize == 0 || finalPathSize >= finalPath.length())
 	{
 		die(ReturnCode::PathNameError, "Could not get final path name by handle for %ls, Error: %d\n", path.c_str(), GetLastError());
 	}
 
-	std::wstring finalPath(finalPathByHandle);
+	finalPath.resize(finalPathSize);
 
 	// The remarks section of GetFinalPathNameByHandle mentions the return being prefixed with "\\?\" or "\\?\UNC\"
 	// More information the prefixes is here http://msdn.microsoft.com/en-us/library/aa365247(v=VS.85).aspx
@@ -73,75 +124,102 @@ inline std::wstring GetFinalPathName(const std::wstring& path)
 	return finalPath;
 }
 
-inline std::wstring GetGVFSPipeName(const char *appName)
+// Returns true and sets pipeName if the process was started with GVFS_PIPE_NAME, which GVFS
+// sets on the git processes it launches. A cached name only has to be used, never rediscovered.
+inline bool TryGetCachedGVFSPipeName(std::wstring& pipeName)
 {
-	// The pipe name is build using the path of the GVFS enlistment root.
-	// Start in the current directory and walk up the directory tree
-	// until we find a folder that contains the ".gvfs" folder
+	std::wstring cachedName(GetEnvironmentVariableString(L"GVFS_PIPE_NAME"));
+	if (cachedName.empty())
+	{
+		return false;
+	}
 
-	const size_t dotGVFSRelativePathLength = sizeof(L"\\.gvfs") / sizeof(wchar_t);
+	pipeName = L"\\\\.\\pipe\\" + cachedName;
+	return true;
+}
 
-	// TODO 640838: Support paths longer than MAX_PATH
-	wchar_t enlistmentRoot[MAX_PATH];
-	DWORD currentDirResult = GetCurrentDirectoryW(MAX_PATH - dotGVFSRelativePathLength, enlistmentRoot);
-	if (currentDirResult == 0 || currentDirResult > MAX_PATH - dotGVFSRelativePathLength)
+// The directory to start looking for the enlistment root from: git's GIT_DIR when it has
+// exported one (the .git folder sits one level below the root), otherwise the current directory
+inline std::wstring GetDiscoveryStartDirectory()
+{
+	std::wstring startDirectory(GetEnvironmentVariableString(L"GIT_DIR"));
+	if (startDirectory.empty())
 	{
-		die(ReturnCode::GetCurrentDirectoryFailure, "GetCurrentDirectory failed (%d)\n", GetLastError());
+		DWORD bufferLength = GetCurrentDirectoryW(0, NULL);
+		std::wstring currentDirectory(bufferLength, L'\0');
+		DWORD currentDirResult = bufferLength == 0 ? 0 : GetCurrentDirectoryW(bufferLength, &currentDirectory[0]);
+		if (currentDirResult == 0 || currentDirResult >= bufferLength)
+		{
+			die(ReturnCode::GetCurrentDirectoryFailure, "GetCurrentDirectory failed (%d)\n", GetLastError());
+		}
+
+		currentDirectory.resize(currentDirResult);
+		return currentDirectory;
 	}
 
-	std::wstring finalRootPath(GetFinalPathName(enlistmentRoot));
-	errno_t copyResult = wcscpy_s(enlistmentRoot, finalRootPath.c_str());
-	if (copyResult != 0)
+	// GIT_DIR may be relative to the current directory
+	DWORD bufferLength = GetFullPathNameW(startDirectory.c_str(), 0, NULL, NULL);
+	std::wstring fullPath(bufferLength, L'\0');
+	DWORD fullPathLength = bufferLength == 0 ? 0 : GetFullPathNameW(startDirectory.c_str(), bufferLength, &fullPath[0], NULL);
+	if (fullPathLength == 0 || fullPathLength >= bufferLength)
 	{
-		die(ReturnCode::PipeConnectError, "Could not copy finalRootPath: %ls. Error: %d\n", finalRootPath.c_str(), copyResult);
+		die(ReturnCode::PathNameError, "Could not get full path of GIT_DIR %ls, Error: %d\n", startDirectory.c_str(), GetLastError());
 	}
 
-	size_t enlistmentRootLength = wcslen(enlistmentRoot);
-	if ('\\' != enlistmentRoot[enlistmentRootLength - 1])
+	fullPath.resize(fullPathLength);
+	return fullPath;
+}
+
+inline std::wstring GetGVFSPipeName(const char *appName)
+{
+	std::wstring cachedPipeName;
+	if (TryGetCachedGVFSPipeName(cachedPipeName))
 	{
-		wcscat_s(enlistmentRoot, L"\\");
-		enlistmentRootLength++;
+		return cachedPipeName;
 	}
 
-	// Walk up enlistmentRoot looking for a folder named .gvfs
-	wchar_t* lastslash = enlistmentRoot + enlistmentRootLength - 1;
-	WIN32_FIND_DATAW findFileData;
-	HANDLE dotGVFSHandle;
-	while (1)
+	// The pipe name is build using the path of the GVFS enlistment root.
+	// An explicit GVFS_ENLISTMENT_ROOT is used as is, otherwise walk up the directory tree
+	// until we find a folder that contains the ".gvfs" folder
+	std::wstring enlistmentRoot(GetEnvironmentVariableString(L"GVFS_ENLISTMENT_ROOT"));
+	if (!enlistmentRoot.empty() && IsDirectory(enlistmentRoot + L"\\.gvfs"))
 	{
-		wcscat_s(lastslash, MAX_PATH - (lastslash - enlistmentRoot), L".gvfs");
-		dotGVFSHandle = FindFirstFileW(enlistmentRoot, &findFileData);
-		if (dotGVFSHandle != INVALID_HANDLE_VALUE)
+		enlistmentRoot = GetFinalPathName(enlistmentRoot);
+		if (!enlistmentRoot.empty() && '\\' == enlistmentRoot.back())
 		{
-			FindClose(dotGVFSHandle);
-			if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				break;
-			}
+			enlistmentRoot.pop_back();
 		}
-
-		lastslash--;
-		while ((enlistmentRoot != lastslash) && (*lastslash != '\\'))
+	}
+	else
+	{
+		enlistmentRoot = GetFinalPathName(GetDiscoveryStartDirectory());
+		if ('\\' != enlistmentRoot.back())
 		{
-			lastslash--;
+			enlistmentRoot += L"\\";
 		}
 
-		if (enlistmentRoot == lastslash)
+		// enlistmentRoot always ends with a '\' inside the loop
+		while (!IsDirectory(enlistmentRoot + L".gvfs"))
 		{
-			die(ReturnCode::NotInGVFSEnlistment, "%s must be run from inside a GVFS enlistment\n", appName);
-		}
+			size_t lastslash = enlistmentRoot.rfind(L'\\', enlistmentRoot.length() - 2);
+			if (lastslash == std::wstring::npos || lastslash == 0)
+			{
+				die(ReturnCode::NotInGVFSEnlistment, "%s must be run from inside a GVFS enlistment\n", appName);
+			}
 
-		*(lastslash + 1) = 0;
-	};
+			enlistmentRoot.resize(lastslash + 1);
+		}
 
-	*(lastslash) = 0;
+		enlistmentRoot.pop_back();
+	}
 
-	std::wstring namedPipe(CharUpperW(enlistmentRoot));
+	std::wstring namedPipe(enlistmentRoot);
+	CharUpperBuffW(&namedPipe[0], static_cast<DWORD>(namedPipe.length()));
 	std::replace(namedPipe.begin(), namedPipe.end(), L':', L'_');
 	return L"\\\\.\\pipe\\GVFS_" + namedPipe;
 }
 
-inline HANDLE CreatePipeToGVFS(const std::wstring& pipeName)
+inline HANDLE OpenPipeToGVFS(const std::wstring& pipeName, DWORD flagsAndAttributes)
 {
 	HANDLE pipeHandle;
 	while (1)
@@ -153,7 +231,7 @@ inline HANDLE CreatePipeToGVFS(const std::wstring& pipeName)
 			0,                 // no sharing 
 			NULL,              // default security attributes
 			OPEN_EXISTING,     // opens existing pipe 
-			0,                 // default attributes 
+			flagsAndAttributes, // attributes 
 			NULL);             // no template file 
 
 		if (pipeHandle != INVALID_HANDLE_VALUE)
@@ -173,4 +251,100 @@ inline HANDLE CreatePipeToGVFS(const std::wstring& pipeName)
 	}
 
 	return pipeHandle;
+}
+
+inline HANDLE CreatePipeToGVFS(const std::wstring& pipeName)
+{
+	return OpenPipeToGVFS(pipeName, 0);
+}
+
+// A pipe to GVFS opened for overlapped I/O, so that every read and write has a deadline
+// and a stuck mount process fails the hook instead of hanging git. Reads and writes each
+// have their own OVERLAPPED, so further requests can be written while the response to an
+// earlier one is still being read.
+struct GVFSPipe
+{
+	HANDLE handle;
+	OVERLAPPED readOverlapped;
+	OVERLAPPED writeOverlapped;
+};
+
+inline GVFSPipe CreateOverlappedPipeToGVFS(const std::wstring& pipeName)
+{
+	GVFSPipe pipe = {};
+	pipe.handle = OpenPipeToGVFS(pipeName, FILE_FLAG_OVERLAPPED);
+	pipe.readOverlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	pipe.writeOverlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (pipe.readOverlapped.hEvent == NULL || pipe.writeOverlapped.hEvent == NULL)
+	{
+		die(ReturnCode::PipeConnectError, "Could not create pipe events: %ls, Error: %d\n", pipeName.c_str(), GetLastError());
+	}
+
+	return pipe;
+}
+
+// Deadline in milliseconds for a single pipe operation. GVFS_PIPE_TIMEOUT_MS overrides the
+// default, and 0 means wait forever.
+inline DWORD GetPipeTimeoutMs(DWORD defaultTimeoutMs)
+{
+	std::wstring timeout(GetEnvironmentVariableString(L"GVFS_PIPE_TIMEOUT_MS"));
+	if (timeout.empty())
+	{
+		return defaultTimeoutMs;
+	}
+
+	DWORD timeoutMs = wcstoul(timeout.c_str(), NULL, 10);
+	return timeoutMs == 0 ? INFINITE : timeoutMs;
+}
+
+// Returns false if the operation failed, with the error available from GetLastError. Dies if
+// the operation has not finished by the deadline.
+inline bool WaitForPipeOperation(GVFSPipe& pipe, OVERLAPPED* overlapped, BOOL completed, DWORD timeoutMs, DWORD* bytesTransferred)
+{
+	if (!completed)
+	{
+		DWORD error = GetLastError();
+		if (error != ERROR_IO_PENDING && error != ERROR_MORE_DATA)
+		{
+			return false;
+		}
+	}
+
+	if (WaitForSingleObject(overlapped->hEvent, timeoutMs) != WAIT_OBJECT_0)
+	{
+		// The OVERLAPPED must not be reused until the cancelled operation has finished
+		CancelIoEx(pipe.handle, overlapped);
+		GetOverlappedResult(pipe.handle, overlapped, bytesTransferred, TRUE);
+		die(ReturnCode::PipeTimeout, "Timed out after %u ms waiting for GVFS\n", timeoutMs);
+	}
+
+	if (!GetOverlappedResult(pipe.handle, overlapped, bytesTransferred, FALSE))
+	{
+		return GetLastError() == ERROR_MORE_DATA;
+	}
+
+	return true;
+}
+
+inline void WriteToGVFSPipe(GVFSPipe& pipe, const char* data, DWORD dataLength, DWORD timeoutMs)
+{
+	DWORD bytesWritten = 0;
+	BOOL completed = WriteFile(pipe.handle, data, dataLength, NULL, &pipe.writeOverlapped);
+	if (!WaitForPipeOperation(pipe, &pipe.writeOverlapped, completed, timeoutMs, &bytesWritten) || bytesWritten != dataLength)
+	{
+		die(ReturnCode::PipeWriteFailed, "Failed to write to pipe (%d)\n", GetLastError());
+	}
+}
+
+// Returns the number of bytes read, which is at least 1
+inline DWORD ReadFromGVFSPipe(GVFSPipe& pipe, char* buffer, DWORD bufferSize, DWORD timeoutMs)
+{
+	DWORD bytesRead = 0;
+	BOOL completed = ReadFile(pipe.handle, buffer, bufferSize, NULL, &pipe.readOverlapped);
+	if (!WaitForPipeOperation(pipe, &pipe.readOverlapped, completed, timeoutMs, &bytesRead) || bytesRead == 0)
+	{
+		die(ReturnCode::PipeReadFailed, "Read response from pipe failed (%d)\n", GetLastError());
+	}
+
+	return bytesRead;
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#pragma once
+
+// Timing, latency summaries and JSON result output shared by the benchmark suites.
+// Every result is written as one JSON object per line so runs can be collected and compared.
+
+#include <algorithm>
+
+namespace BenchmarkHelpers
+{
+
+struct LatencySummary
+{
+    size_t Count = 0;
+    double TotalMicroseconds = 0;
+    double MeanMicroseconds = 0;
+    double P50Microseconds = 0;
+    double P95Microseconds = 0;
+    double P99Microseconds = 0;
+    double MaxMicroseconds = 0;
+};
+
+inline double NowMicroseconds()
+{
+    static LARGE_INTEGER frequency = { 0 };
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000000.0 / frequency.QuadPart;
+}
+
+// Nearest-rank percentile
+inline double Percentile(const std::vector<double>& sortedLatencies, double percentile)
+{
+    size_t rank = static_cast<size_t>(percentile * sortedLatencies.size() + 0.5);
+    size_t index = rank == 0 ? 0 : (std::min)(rank - 1, sortedLatencies.size() - 1);
+    return sortedLatencies[index];
+}
+
+inline LatencySummary Summarize(std::vector<double> latenciesMicroseconds)
+{
+    LatencySummary summary;
+    if (latenciesMicroseconds.empty())
+    {
+        return summary;
+    }
+
+    std::sort(latenciesMicroseconds.begin(), latenciesMicroseconds.end());
+    summary.Count = latenciesMicroseconds.size();
+    for (double latency : latenciesMicroseconds)
+    {
+        summary.TotalMicroseconds += latency;
+    }
+
+    summary.MeanMicroseconds = summary.TotalMicroseconds / summary.Count;
+    summary.P50Microseconds = Percentile(latenciesMicroseconds, 0.50);
+    summary.P95Microseconds = Percentile(latenciesMicroseconds, 0.95);
+    summary.P99Microseconds = Percentile(latenciesMicroseconds, 0.99);
+    summary.MaxMicroseconds = latenciesMicroseconds.back();
+    return summary;
+}
+
+// Appends results to the file at resultsPath, or writes them to stdout if resultsPath is null or empty
+class BenchmarkResultWriter
+{
+public:
+    BenchmarkResultWriter(const char* resultsPath);
+    ~BenchmarkResultWriter();
+
+    // parameters is a (possibly empty) list of extra JSON members, e.g. "\"threads\":4"
+    void Write(const char* suite, const char* benchmark, const std::string& parameters, const LatencySummary& latencies, double wallMicroseconds);
+
+private:
+    FILE* output;
+    bool ownsOutput;
+};
+
+inline BenchmarkResultWriter::BenchmarkResultWriter(const char* resultsPath)
+    : output(stdout), ownsOutput(false)
+{
+    if (resultsPath != nullptr && resultsPath[0] != '\0')
+    {
+        FILE* resultsFile = nullptr;
+        if (fopen_s(&resultsFile, resultsPath, "a") == 0 && resultsFile != nullptr)
+        {
+            this->output = resultsFile;
+            this->ownsOutput = true;
+        }
+    }
+}
+
+inline BenchmarkResultWriter::~BenchmarkResultWriter()
+{
+    if (this->ownsOutput)
+    {
+        fclose(this->output);
+    }
+    else
+    {
+        fflush(this->output);
+    }
+}
+
+inline void BenchmarkResultWriter::Write(const char* suite, const char* benchmark, const std::string& parameters, const LatencySummary& latencies, double wallMicroseconds)
+{
+    fprintf(
+        this->output,
+        "{\"suite\":\"%s\",\"benchmark\":\"%s\",%s%s\"operations\":%zu,\"wallMs\":%.3f,\"opsPerSecond\":%.1f,"
+        "\"meanUs\":%.1f,\"p50Us\":%.1f,\"p95Us\":%.1f,\"p99Us\":%.1f,\"maxUs\":%.1f}\n",
+        suite,
+        benchmark,
+        parameters.c_str(),
+        parameters.empty() ? "" : ",",
+        latencies.Count,
+        wallMicroseconds / 1000.0,
+        wallMicroseconds > 0 ? latencies.Count * 1000000.0 / wallMicroseconds : 0.0,
+        latencies.MeanMicroseconds,
+        latencies.P50Microseconds,
+        latencies.P95Microseconds,
+        latencies.P99Microseconds,
+        latencies.MaxMicroseconds);
+}
+
+} // namespace BenchmarkHelpers
@@ -0,0 +1,14 @@
+#pragma once
+
+extern "C"
+{
+    // Measures enumerating folderPath with NtQueryDirectoryFile (FileBothDirectoryInformation) and
+    // writes one JSON result per line to resultsPath (or stdout when it is empty):
+    //
+    // first_enumeration  -> The first full enumeration of the folder, which is when ProjFS asks the
+    //                       provider for the projected entries
+    // repeat_enumeration -> Later full enumerations, once for each buffer size
+    //
+    // Each enumeration opens a new handle to the folder, as tools such as dir do.
+    NATIVE_TESTS_EXPORT bool NtQueryDirectoryFile_EnumerationBenchmark(const char* folderPath, unsigned int repeatCount, const char* resultsPath);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+extern "C"
+{
+    // Measures how long ProjFS takes to hydrate and reopen files under relativeFolder (searched
+    // recursively), and writes one JSON result per line to resultsPath (or stdout when it is empty):
+    //
+    // first_open          -> Opening and reading files that have never been hydrated, one at a time
+    // concurrent_distinct -> 1..maxThreadCount threads each hydrating different files at the same time
+    // concurrent_same     -> 1..maxThreadCount threads opening and reading the same hydrated file
+    // repeat_open         -> Opening and closing a file that is already hydrated
+    //
+    // Files are hydrated as they are measured, so the benchmark needs a freshly mounted
+    // enlistment with enough unhydrated files under relativeFolder for every thread count.
+    NATIVE_TESTS_EXPORT bool ProjFS_HydrationBenchmark(const char* virtualRootPath, const char* relativeFolder, unsigned int maxThreadCount, const char* resultsPath);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+extern "C"
+{
+    // Measures writes to files under relativeFolder (searched recursively), in size buckets from 4 KB
+    // to 1 GB, and writes one JSON result per line to resultsPath (or stdout when it is empty):
+    //
+    // first_write    -> Opening a placeholder, writing to its start and closing it, which hydrates
+    //                   it and converts it to a full file
+    // repeated_write -> Further writes through one handle to the file first_write converted
+    //
+    // Both are measured with synchronous and with overlapped I/O, each on a different placeholder,
+    // and again on a newly created full file of the same size as the baseline that ProjFS adds to.
+    // Size buckets without a placeholder under relativeFolder only get the baseline.
+    //
+    // The placeholders measured are overwritten, so the benchmark needs a freshly mounted
+    // enlistment that can be thrown away afterwards.
+    NATIVE_TESTS_EXPORT bool ProjFS_WriteBenchmark(const char* virtualRootPath, const char* relativeFolder, const char* resultsPath);
+}
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "NtQueryDirectoryFileBenchmark.h"
+#include "BenchmarkHelpers.h"
+#include "SafeHandle.h"
+#include "TestException.h"
+#include "Should.h"
+
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    const char* SUITE_NAME = "NtQueryDirectoryFile_Enumeration";
+    const ULONG FIRST_ENUMERATION_BUFFER_SIZE = 64 * 1024;
+    const ULONG BUFFER_SIZES[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+    // EnumerateFolder: Open folderPath and read all of its entries with NtQueryDirectoryFile
+    //
+    // buffer -> Buffer to pass as FileInformation
+    // bufferSize -> Size of buffer in bytes
+    // entryCount -> [Out] Number of entries returned, including "." and ".."
+    // queryCount -> [Out] Number of NtQueryDirectoryFile calls made
+    //
+    // Returns -> Microseconds taken, including opening and closing the folder
+    double EnumerateFolder(const char* folderPath, void* buffer, ULONG bufferSize, size_t* entryCount, size_t* queryCount);
+
+    std::string EnumerationParameters(ULONG bufferSize, size_t entryCount, size_t queryCount);
+}
+
+bool NtQueryDirectoryFile_EnumerationBenchmark(const char* folderPath, unsigned int repeatCount, const char* resultsPath)
+{
+    try
+    {
+        SHOULD_BE_TRUE(PathIsDirectory(folderPath));
+
+        BenchmarkResultWriter results(resultsPath);
+        std::vector<char> buffer(BUFFER_SIZES[ARRAYSIZE(BUFFER_SIZES) - 1]);
+
+        size_t entryCount;
+        size_t queryCount;
+        {
+            double latency = EnumerateFolder(folderPath, buffer.data(), FIRST_ENUMERATION_BUFFER_SIZE, &entryCount, &queryCount);
+            results.Write(
+                SUITE_NAME,
+                "first_enumeration",
+                EnumerationParameters(FIRST_ENUMERATION_BUFFER_SIZE, entryCount, queryCount),
+                Summarize({ latency }),
+                latency);
+        }
+
+        for (ULONG bufferSize : BUFFER_SIZES)
+        {
+            std::vector<double> latencies;
+            double start = NowMicroseconds();
+            for (unsigned int i = 0; i < repeatCount; ++i)
+            {
+                latencies.push_back(EnumerateFolder(folderPath, buffer.data(), bufferSize, &entryCount, &queryCount));
+            }
+
+            results.Write(
+                SUITE_NAME,
+                "repeat_enumeration",
+                EnumerationParameters(bufferSize, entryCount, queryCount),
+                Summarize(latencies),
+                NowMicroseconds() - start);
+        }
+    }
+    catch (TestException&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+namespace
+{
+    double EnumerateFolder(const char* folderPath, void* buffer, ULONG bufferSize, size_t* entryCount, size_t* queryCount)
+    {
+        *entryCount = 0;
+        *queryCount = 0;
+
+        double start = NowMicroseconds();
+        SafeHandle folderHandle(CreateFile(
+            folderPath,                              // lpFileName
+            (GENERIC_READ),                          // dwDesiredAccess
+            FILE_SHARE_READ,                         // dwShareMode
+            NULL,                                    // lpSecurityAttributes
+            OPEN_EXISTING,                           // dwCreationDisposition
+            FILE_FLAG_BACKUP_SEMANTICS,              // dwFlagsAndAttributes
+            NULL));                                  // hTemplateFile
+        SHOULD_NOT_EQUAL(folderHandle.GetHandle(), INVALID_HANDLE_VALUE);
+
+        NTSTATUS status;
+        do
+        {
+            IO_STATUS_BLOCK ioStatus;
+            status = NtQueryDirectoryFile(
+                folderHandle.GetHandle(),      // FileHandle
+                NULL,                          // Event
+                NULL,                          // ApcRoutine
+                NULL,                          // ApcContext
+                &ioStatus,                     // IoStatusBlock
+                buffer,                        // FileInformation
+                bufferSize,                    // Length
+                FileBothDirectoryInformation,  // FileInformationClass
+                FALSE,                         // ReturnSingleEntry
+                NULL,                          // FileName
+                FALSE);                        // RestartScan
+
+            ++(*queryCount);
+            if (status == STATUS_SUCCESS)
+            {
+                PFILE_BOTH_DIR_INFORMATION entry = static_cast<PFILE_BOTH_DIR_INFORMATION>(buffer);
+                while (true)
+                {
+                    ++(*entryCount);
+                    if (entry->NextEntryOffset == 0)
+                    {
+                        break;
+                    }
+
+                    entry = reinterpret_cast<PFILE_BOTH_DIR_INFORMATION>(reinterpret_cast<char*>(entry) + entry->NextEntryOffset);
+                }
+            }
+        } while (status == STATUS_SUCCESS);
+
+        SHOULD_EQUAL(status, STATUS_NO_MORE_FILES);
+        folderHandle.CloseHandle();
+
+        return NowMicroseconds() - start;
+    }
+
+    std::string EnumerationParameters(ULONG bufferSize, size_t entryCount, size_t queryCount)
+    {
+        return
+            "\"bufferSize\":" + std::to_string(bufferSize) +
+            ",\"entries\":" + std::to_string(entryCount) +
+            ",\"queries\":" + std::to_string(queryCount);
+    }
+}
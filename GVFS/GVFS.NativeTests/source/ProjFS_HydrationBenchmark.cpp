@@ -0,0 +1,278 @@
+#include "stdafx.h"
+#include "ProjFS_HydrationBenchmark.h"
+#include "BenchmarkHelpers.h"
+#include "TestException.h"
+#include "Should.h"
+#include <functional>
+
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    const char* SUITE_NAME = "ProjFS_Hydration";
+
+    const size_t MAX_FILES_TO_COLLECT = 8192;
+    const size_t FIRST_OPEN_SAMPLES = 32;
+    const size_t DISTINCT_FILES_PER_THREAD = 8;
+    const size_t SAME_FILE_OPENS_PER_THREAD = 64;
+    const size_t REPEAT_OPEN_COUNT = 1000;
+
+    // CollectFiles: Find the files under folder (and its subfolders) without opening them,
+    // so that they stay unhydrated
+    //
+    // folder -> Path to the folder, ending in '\'
+    // files -> [Out] Full paths of the files found
+    void CollectFiles(const std::string& folder, std::vector<std::string>* files);
+
+    // OpenAndReadFile: Open the file at path and read all of its content, which hydrates it
+    //
+    // Returns -> Microseconds taken
+    double OpenAndReadFile(const std::string& path);
+
+    // OpenAndCloseFile: Open the file at path for read and close it without reading
+    //
+    // Returns -> Microseconds taken
+    double OpenAndCloseFile(const std::string& path);
+
+    // RunOnThreads: Run operation on threadCount threads that all start at the same time
+    //
+    // operation -> Called with the thread's index, returns that thread's latencies
+    // wallMicroseconds -> [Out] Time from starting the threads until the last one finished
+    //
+    // Returns -> The latencies of every thread
+    std::vector<double> RunOnThreads(
+        unsigned int threadCount,
+        const std::function<std::vector<double>(unsigned int)>& operation,
+        double* wallMicroseconds);
+
+    std::string ThreadsParameter(unsigned int threadCount);
+}
+
+bool ProjFS_HydrationBenchmark(const char* virtualRootPath, const char* relativeFolder, unsigned int maxThreadCount, const char* resultsPath)
+{
+    try
+    {
+        std::string folder = std::string(virtualRootPath) + "\\" + relativeFolder + "\\";
+        std::vector<std::string> files;
+        CollectFiles(folder, &files);
+        SHOULD_BE_TRUE(files.size() > FIRST_OPEN_SAMPLES);
+
+        BenchmarkResultWriter results(resultsPath);
+        size_t nextUnhydratedFile = 0;
+
+        // first_open
+        {
+            std::vector<double> latencies;
+            double start = NowMicroseconds();
+            for (size_t i = 0; i < FIRST_OPEN_SAMPLES; ++i)
+            {
+                latencies.push_back(OpenAndReadFile(files[nextUnhydratedFile++]));
+            }
+
+            results.Write(SUITE_NAME, "first_open", "", Summarize(latencies), NowMicroseconds() - start);
+        }
+
+        // concurrent_distinct, stopping at the first thread count that would run out of unhydrated files
+        for (unsigned int threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2)
+        {
+            size_t firstFile = nextUnhydratedFile;
+            if (firstFile + threadCount * DISTINCT_FILES_PER_THREAD > files.size())
+            {
+                break;
+            }
+
+            nextUnhydratedFile += threadCount * DISTINCT_FILES_PER_THREAD;
+
+            double wallMicroseconds;
+            std::vector<double> latencies = RunOnThreads(
+                threadCount,
+                [&](unsigned int thread)
+                {
+                    std::vector<double> threadLatencies;
+                    for (size_t i = 0; i < DISTINCT_FILES_PER_THREAD; ++i)
+                    {
+                        threadLatencies.push_back(OpenAndReadFile(files[firstFile + thread * DISTINCT_FILES_PER_THREAD + i]));
+                    }
+
+                    return threadLatencies;
+                },
+                &wallMicroseconds);
+
+            results.Write(SUITE_NAME, "concurrent_distinct", ThreadsParameter(threadCount), Summarize(latencies), wallMicroseconds);
+        }
+
+        // concurrent_same, against a file first_open has already hydrated
+        const std::string& hydratedFile = files[0];
+        for (unsigned int threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2)
+        {
+            double wallMicroseconds;
+            std::vector<double> latencies = RunOnThreads(
+                threadCount,
+                [&](unsigned int)
+                {
+                    std::vector<double> threadLatencies;
+                    for (size_t i = 0; i < SAME_FILE_OPENS_PER_THREAD; ++i)
+                    {
+                        threadLatencies.push_back(OpenAndReadFile(hydratedFile));
+                    }
+
+                    return threadLatencies;
+                },
+                &wallMicroseconds);
+
+            results.Write(SUITE_NAME, "concurrent_same", ThreadsParameter(threadCount), Summarize(latencies), wallMicroseconds);
+        }
+
+        // repeat_open
+        {
+            std::vector<double> latencies;
+            double start = NowMicroseconds();
+            for (size_t i = 0; i < REPEAT_OPEN_COUNT; ++i)
+            {
+                latencies.push_back(OpenAndCloseFile(hydratedFile));
+            }
+
+            results.Write(SUITE_NAME, "repeat_open", "", Summarize(latencies), NowMicroseconds() - start);
+        }
+    }
+    catch (TestException&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+namespace
+{
+    void CollectFiles(const std::string& folder, std::vector<std::string>* files)
+    {
+        WIN32_FIND_DATA ffd;
+        HANDLE hFind = FindFirstFile((folder + "*").c_str(), &ffd);
+        SHOULD_NOT_EQUAL(hFind, INVALID_HANDLE_VALUE);
+
+        std::vector<std::string> subfolders;
+        do
+        {
+            if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                if (strcmp(ffd.cFileName, ".") != 0 && strcmp(ffd.cFileName, "..") != 0)
+                {
+                    subfolders.push_back(folder + ffd.cFileName + "\\");
+                }
+            }
+            else if (files->size() < MAX_FILES_TO_COLLECT)
+            {
+                files->push_back(folder + ffd.cFileName);
+            }
+        } while (FindNextFile(hFind, &ffd) != 0);
+
+        FindClose(hFind);
+
+        for (const std::string& subfolder : subfolders)
+        {
+            if (files->size() >= MAX_FILES_TO_COLLECT)
+            {
+                break;
+            }
+
+            CollectFiles(subfolder, files);
+        }
+    }
+
+    double OpenAndReadFile(const std::string& path)
+    {
+        static thread_local std::vector<char> buffer(64 * 1024);
+
+        double start = NowMicroseconds();
+        HANDLE hFile = CreateFile(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+        SHOULD_NOT_EQUAL(hFile, INVALID_HANDLE_VALUE);
+
+        DWORD bytesRead;
+        BOOL success;
+        do
+        {
+            success = ReadFile(hFile, buffer.data(), static_cast<DWORD>(buffer.size()), &bytesRead, NULL);
+        } while (success && bytesRead > 0);
+
+        CloseHandle(hFile);
+        SHOULD_BE_TRUE(success);
+
+        return NowMicroseconds() - start;
+    }
+
+    double OpenAndCloseFile(const std::string& path)
+    {
+        double start = NowMicroseconds();
+        HANDLE hFile = CreateFile(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+        SHOULD_NOT_EQUAL(hFile, INVALID_HANDLE_VALUE);
+        CloseHandle(hFile);
+
+        return NowMicroseconds() - start;
+    }
+
+    std::vector<double> RunOnThreads(
+        unsigned int threadCount,
+        const std::function<std::vector<double>(unsigned int)>& operation,
+        double* wallMicroseconds)
+    {
+        std::promise<void> mainThreadReadyPromise;
+        std::shared_future<void> mainThreadReadyFuture(mainThreadReadyPromise.get_future());
+        std::vector<std::promise<void>> threadReadyPromises(threadCount);
+        std::vector<std::future<std::vector<double>>> threadCompleteFutures;
+
+        for (unsigned int i = 0; i < threadCount; ++i)
+        {
+            std::promise<void>& threadReadyPromise = threadReadyPromises[i];
+            threadCompleteFutures.push_back(std::async(
+                std::launch::async,
+                [&operation, &threadReadyPromise, mainThreadReadyFuture, i]()
+                {
+                    threadReadyPromise.set_value();
+                    mainThreadReadyFuture.wait();
+                    return operation(i);
+                }));
+        }
+
+        // Wait for all threads to become ready
+        for (std::promise<void>& promise : threadReadyPromises)
+        {
+            promise.get_future().wait();
+        }
+
+        double start = NowMicroseconds();
+        mainThreadReadyPromise.set_value();
+
+        // get() rethrows a TestException from any of the threads
+        std::vector<double> latencies;
+        for (std::future<std::vector<double>>& threadFuture : threadCompleteFutures)
+        {
+            std::vector<double> threadLatencies = threadFuture.get();
+            latencies.insert(latencies.end(), threadLatencies.begin(), threadLatencies.end());
+        }
+
+        *wallMicroseconds = NowMicroseconds() - start;
+        return latencies;
+    }
+
+    std::string ThreadsParameter(unsigned int threadCount)
+    {
+        return "\"threads\":" + std::to_string(threadCount);
+    }
+}
@@ -0,0 +1,245 @@
+#include "stdafx.h"
+#include "ProjFS_WriteBenchmark.h"
+#include "BenchmarkHelpers.h"
+#include "SafeHandle.h"
+#include "SafeOverlapped.h"
+#include "TestException.h"
+#include "Should.h"
+
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    const char* SUITE_NAME = "ProjFS_Write";
+
+    // Size buckets grow by a factor of 4, from [4 KB, 16 KB) up to [1 GB, 4 GB)
+    const unsigned long long MIN_FILE_BYTES = 4 * 1024;
+    const unsigned long long MAX_FILE_BYTES = 1024 * 1024 * 1024;
+    const size_t MAX_FILES_TO_COLLECT = 65536;
+    const DWORD WRITE_BYTES = 4 * 1024;
+    const size_t REPEATED_WRITE_COUNT = 256;
+    const char* BASELINE_FILE_NAME = "ProjFS_WriteBenchmark.tmp";
+
+    struct SizedFile
+    {
+        std::string path;
+        unsigned long long bytes;
+    };
+
+    // CollectFiles: Find the files under folder (and its subfolders) without opening them,
+    // so that they stay placeholders
+    //
+    // folder -> Path to the folder, ending in '\'
+    // files -> [Out] Full paths and sizes of the files found
+    void CollectFiles(const std::string& folder, std::vector<SizedFile>* files);
+
+    // BenchmarkFile: Time the first write to the file at path and then repeated writes to it, and
+    // write both results
+    //
+    // fileBytes -> Size of the file, the repeated writes stay within it
+    // overlapped -> Whether to use overlapped I/O
+    // placeholder -> Whether the file is a placeholder, only used to label the results
+    void BenchmarkFile(
+        BenchmarkResultWriter& results,
+        const std::string& path,
+        unsigned long long fileBytes,
+        bool overlapped,
+        bool placeholder);
+
+    // OpenForWrite: Open the existing file at path for writing
+    HANDLE OpenForWrite(const std::string& path, bool overlapped);
+
+    // WriteAt: Write WRITE_BYTES from buffer to the file at offset, and wait for the write to complete
+    void WriteAt(HANDLE file, bool overlapped, const char* buffer, unsigned long long offset);
+
+    // CreateFullFile: Create a file at path that is fileBytes long, without writing its content
+    void CreateFullFile(const std::string& path, unsigned long long fileBytes);
+
+    std::string Parameters(unsigned long long fileBytes, bool overlapped, bool placeholder);
+}
+
+bool ProjFS_WriteBenchmark(const char* virtualRootPath, const char* relativeFolder, const char* resultsPath)
+{
+    try
+    {
+        std::string folder = std::string(virtualRootPath) + "\\" + relativeFolder + "\\";
+        std::vector<SizedFile> files;
+        CollectFiles(folder, &files);
+
+        BenchmarkResultWriter results(resultsPath);
+        std::string baselinePath = folder + BASELINE_FILE_NAME;
+        for (unsigned long long bucketBytes = MIN_FILE_BYTES; bucketBytes <= MAX_FILE_BYTES; bucketBytes *= 4)
+        {
+            for (bool overlapped : { false, true })
+            {
+                // Each placeholder is only converted once, so every I/O mode needs its own
+                std::vector<SizedFile>::iterator placeholder = std::find_if(
+                    files.begin(),
+                    files.end(),
+                    [bucketBytes](const SizedFile& file) { return file.bytes >= bucketBytes && file.bytes < bucketBytes * 4; });
+
+                unsigned long long fileBytes = bucketBytes;
+                if (placeholder != files.end())
+                {
+                    fileBytes = placeholder->bytes;
+                    BenchmarkFile(results, placeholder->path, fileBytes, overlapped, true);
+                    files.erase(placeholder);
+                }
+
+                CreateFullFile(baselinePath, fileBytes);
+                BenchmarkFile(results, baselinePath, fileBytes, overlapped, false);
+                SHOULD_NOT_EQUAL(DeleteFile(baselinePath.c_str()), 0);
+            }
+        }
+    }
+    catch (TestException&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+namespace
+{
+    void CollectFiles(const std::string& folder, std::vector<SizedFile>* files)
+    {
+        WIN32_FIND_DATA ffd;
+        HANDLE hFind = FindFirstFile((folder + "*").c_str(), &ffd);
+        SHOULD_NOT_EQUAL(hFind, INVALID_HANDLE_VALUE);
+
+        std::vector<std::string> subfolders;
+        do
+        {
+            if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                if (strcmp(ffd.cFileName, ".") != 0 && strcmp(ffd.cFileName, "..") != 0)
+                {
+                    subfolders.push_back(folder + ffd.cFileName + "\\");
+                }
+            }
+            else if (files->size() < MAX_FILES_TO_COLLECT)
+            {
+                SizedFile file;
+                file.path = folder + ffd.cFileName;
+                file.bytes = (static_cast<unsigned long long>(ffd.nFileSizeHigh) << 32) | ffd.nFileSizeLow;
+                files->push_back(file);
+            }
+        } while (FindNextFile(hFind, &ffd) != 0);
+
+        FindClose(hFind);
+
+        for (const std::string& subfolder : subfolders)
+        {
+            if (files->size() >= MAX_FILES_TO_COLLECT)
+            {
+                break;
+            }
+
+            CollectFiles(subfolder, files);
+        }
+    }
+
+    void BenchmarkFile(
+        BenchmarkResultWriter& results,
+        const std::string& path,
+        unsigned long long fileBytes,
+        bool overlapped,
+        bool placeholder)
+    {
+        std::vector<char> buffer(WRITE_BYTES, 'x');
+        std::string parameters = Parameters(fileBytes, overlapped, placeholder);
+
+        // first_write, including the open and close that ProjFS does its work in
+        {
+            double start = NowMicroseconds();
+            SafeHandle file(OpenForWrite(path, overlapped));
+            WriteAt(file.GetHandle(), overlapped, buffer.data(), 0);
+            file.CloseHandle();
+            double elapsed = NowMicroseconds() - start;
+
+            results.Write(SUITE_NAME, "first_write", parameters, Summarize(std::vector<double>(1, elapsed)), elapsed);
+        }
+
+        // repeated_write, stepping through the file and wrapping around at its end
+        {
+            SafeHandle file(OpenForWrite(path, overlapped));
+            unsigned long long writeSlots = fileBytes >= WRITE_BYTES ? fileBytes / WRITE_BYTES : 1;
+            std::vector<double> latencies;
+            double start = NowMicroseconds();
+            for (size_t i = 0; i < REPEATED_WRITE_COUNT; ++i)
+            {
+                double writeStart = NowMicroseconds();
+                WriteAt(file.GetHandle(), overlapped, buffer.data(), (i % writeSlots) * WRITE_BYTES);
+                latencies.push_back(NowMicroseconds() - writeStart);
+            }
+
+            results.Write(SUITE_NAME, "repeated_write", parameters, Summarize(latencies), NowMicroseconds() - start);
+        }
+    }
+
+    HANDLE OpenForWrite(const std::string& path, bool overlapped)
+    {
+        HANDLE file = CreateFile(
+            path.c_str(),                                                      // lpFileName
+            GENERIC_WRITE,                                                     // dwDesiredAccess
+            FILE_SHARE_READ,                                                   // dwShareMode
+            NULL,                                                              // lpSecurityAttributes
+            OPEN_EXISTING,                                                     // dwCreationDisposition
+            (FILE_ATTRIBUTE_NORMAL | (overlapped ? FILE_FLAG_OVERLAPPED : 0)), // dwFlagsAndAttributes
+            NULL);                                                             // hTemplateFile
+
+        SHOULD_NOT_EQUAL(file, INVALID_HANDLE_VALUE);
+        return file;
+    }
+
+    void WriteAt(HANDLE file, bool overlapped, const char* buffer, unsigned long long offset)
+    {
+        SafeOverlapped overlappedWrite;
+        overlappedWrite.overlapped.Offset = static_cast<DWORD>(offset);
+        overlappedWrite.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        if (overlapped)
+        {
+            overlappedWrite.overlapped.hEvent = CreateEvent(
+                NULL,  // lpEventAttributes
+                true,  // bManualReset
+                false, // bInitialState
+                NULL); // lpName
+        }
+
+        unsigned long bytesWritten = 0;
+        if (!WriteFile(file, buffer, WRITE_BYTES, &bytesWritten, &overlappedWrite.overlapped))
+        {
+            SHOULD_EQUAL(GetLastError(), ERROR_IO_PENDING);
+            SHOULD_NOT_EQUAL(GetOverlappedResult(file, &overlappedWrite.overlapped, &bytesWritten, true), FALSE);
+        }
+
+        SHOULD_EQUAL(bytesWritten, WRITE_BYTES);
+    }
+
+    void CreateFullFile(const std::string& path, unsigned long long fileBytes)
+    {
+        SafeHandle file(CreateFile(
+            path.c_str(),          // lpFileName
+            GENERIC_WRITE,         // dwDesiredAccess
+            0,                     // dwShareMode
+            NULL,                  // lpSecurityAttributes
+            CREATE_ALWAYS,         // dwCreationDisposition
+            FILE_ATTRIBUTE_NORMAL, // dwFlagsAndAttributes
+            NULL));                // hTemplateFile
+
+        SHOULD_NOT_EQUAL(file.GetHandle(), INVALID_HANDLE_VALUE);
+
+        LARGE_INTEGER endOfFile;
+        endOfFile.QuadPart = static_cast<LONGLONG>(fileBytes);
+        SHOULD_NOT_EQUAL(SetFilePointerEx(file.GetHandle(), endOfFile, NULL, FILE_BEGIN), FALSE);
+        SHOULD_NOT_EQUAL(SetEndOfFile(file.GetHandle()), FALSE);
+    }
+
+    std::string Parameters(unsigned long long fileBytes, bool overlapped, bool placeholder)
+    {
+        return "\"fileBytes\":" + std::to_string(fileBytes) +
+            ",\"io\":\"" + (overlapped ? "overlapped" : "synchronous") + "\"" +
+            ",\"placeholder\":" + (placeholder ? "true" : "false");
+    }
+}
@@ -243,6 +243,8 @@ namespace GVFS.Platform.Mac
         private Result OnEnumerateDirectory(
             ulong commandId,
             string relativePath,
+            byte[] providerId,
+            byte[] contentId,
             int triggeringProcessId,
             string triggeringProcessName)
         {
@@ -8,6 +8,13 @@
 // See Git Documentation/Technical/read-object-protocol.txt for details.
 // GVFS.ReadObjectHook decides which GVFS instance to connect to based on it's path.
 // It then connects to GVFS and asks GVFS to download the requested object (to the .git\objects folder).
+// If git has already written further get commands by the time one is read, they are read ahead and
+// sent to GVFS as a single batch request, so GVFS can download all of the objects with one request
+// and keep them as one packfile instead of a loose object each.
+// Objects GVFS downloaded for another git process within the last minute are found in a table GVFS
+// shares, and succeed without asking GVFS at all.
+// If git offers the "content" capability, a single blob's contents are returned to git after its
+// status, so git doesn't have to find and inflate the loose object GVFS just wrote.
 
 #include "stdafx.h"
 #include "packet.h"
@@ -16,13 +23,204 @@
 #define MAX_PACKET_LENGTH 512
 #define SHA1_LENGTH 40
 #define MESSAGE_LENGTH (4 + SHA1_LENGTH + 1)
+#define CONTENT_MESSAGE_LENGTH (5 + SHA1_LENGTH + 1)
+#define MAX_RESPONSE_LINE_LENGTH 64
+#define MAX_BATCH_SIZE 64
+#define BATCH_MESSAGE_LENGTH (5 + MAX_BATCH_SIZE * (SHA1_LENGTH + 1))
+
+// Deadlines for requests to GVFS. Downloads go to the network, so they get much longer than
+// writing a request, and GVFS_PIPE_TIMEOUT_MS can override the download deadline.
+#define PIPE_WRITE_TIMEOUT_MS (30 * 1000)
+#define DEFAULT_DOWNLOAD_TIMEOUT_MS (10 * 60 * 1000)
+
+// Layout of the table of recently downloaded objects, see GVFS.Mount\RecentObjectIndex.cs. Entries
+// older than the lifetime (in 100ns FILETIME units) are asked for again, in case git is asking
+// because its copy is corrupt.
+#define RECENT_OBJECT_INDEX_VERSION 1
+#define RECENT_OBJECT_HEADER_SIZE (2 * sizeof(UINT32))
+#define RECENT_OBJECT_SLOT_SIZE (SHA1_LENGTH + sizeof(LONGLONG))
+#define RECENT_OBJECT_LIFETIME (60ULL * 10 * 1000 * 1000)
 
 enum ReadObjectHookErrorReturnCode
 {
 	ErrorReadObjectProtocol = ReturnCode::LastError + 1,
 };
 
-int DownloadSHA(HANDLE pipeHandle, const char *sha1)
+// GVFS answers each requested SHA with one line, the first character of which is 'S' on success.
+// A batch request gets several lines back, which can arrive in a single read. A content request
+// that succeeds with "S|<length>" is followed by that many bytes of blob contents.
+struct ResponseReader
+{
+	char buffer[256];
+	DWORD start;
+	DWORD end;
+	DWORD timeoutMs;
+};
+
+static char contentBuffer[LARGE_PACKET_DATA_MAX];
+
+// Reads the next response line, without its newline. Lines too long for the buffer are truncated.
+void ReadResponseLine(GVFSPipe &pipe, ResponseReader *reader, char *line, size_t lineSize)
+{
+	size_t length = 0;
+	while (1)
+	{
+		if (reader->start == reader->end)
+		{
+			reader->start = 0;
+			reader->end = ReadFromGVFSPipe(pipe, reader->buffer, sizeof(reader->buffer), reader->timeoutMs);
+		}
+
+		char c = reader->buffer[reader->start++];
+		if (c == '\n')
+		{
+			line[length] = 0;
+			return;
+		}
+
+		if (length + 1 < lineSize)
+		{
+			line[length++] = c;
+		}
+	}
+}
+
+bool ReadResponseSucceeded(GVFSPipe &pipe, ResponseReader *reader)
+{
+	char line[MAX_RESPONSE_LINE_LENGTH];
+	ReadResponseLine(pipe, reader, line, sizeof(line));
+	return line[0] == 'S';
+}
+
+// Copies the blob contents following a response to git, as binary packets. Whatever the response
+// read already buffered comes first.
+void ForwardResponseContent(GVFSPipe &pipe, ResponseReader *reader, unsigned long long length)
+{
+	while (length > 0)
+	{
+		DWORD chunkLength;
+		if (reader->start != reader->end)
+		{
+			chunkLength = static_cast<DWORD>(min(static_cast<unsigned long long>(reader->end - reader->start), length));
+			packet_bin_write(reader->buffer + reader->start, chunkLength);
+			reader->start += chunkLength;
+		}
+		else
+		{
+			DWORD readLength = static_cast<DWORD>(min(static_cast<unsigned long long>(sizeof(contentBuffer)), length));
+			chunkLength = ReadFromGVFSPipe(pipe, contentBuffer, readLength, reader->timeoutMs);
+			packet_bin_write(contentBuffer, chunkLength);
+		}
+
+		length -= chunkLength;
+	}
+}
+
+// Only reports input that is already waiting, either read ahead by the packet reader or still
+// in the pipe, so it never blocks.
+bool IsGitInputAvailable()
+{
+	if (packet_read_pending())
+	{
+		return true;
+	}
+
+	DWORD bytesAvailable = 0;
+	return PeekNamedPipe(GetStdHandle(STD_INPUT_HANDLE), NULL, 0, NULL, &bytesAvailable, NULL) && bytesAvailable > 0;
+}
+
+struct RecentObjectIndex
+{
+	const char *view;
+	UINT32 slotCount;
+};
+
+// Returns an index with no view if GVFS hasn't published one, and every object is then asked for
+RecentObjectIndex OpenRecentObjectIndex(const std::wstring &pipeName)
+{
+	RecentObjectIndex index = {};
+
+	// Named after the pipe, without its "\\.\pipe\" prefix and with no other '\'
+	std::wstring mappingName(pipeName.substr(wcslen(L"\\\\.\\pipe\\")));
+	std::replace(mappingName.begin(), mappingName.end(), L'\\', L'_');
+	mappingName = L"Local\\" + mappingName + L"_RecentObjects";
+
+	HANDLE mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, mappingName.c_str());
+	if (mapping == NULL)
+	{
+		return index;
+	}
+
+	// The view keeps the mapping open
+	const char *view = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (view == NULL)
+	{
+		return index;
+	}
+
+	const UINT32 *header = reinterpret_cast<const UINT32 *>(view);
+	if (header[0] != RECENT_OBJECT_INDEX_VERSION || header[1] == 0)
+	{
+		UnmapViewOfFile(view);
+		return index;
+	}
+
+	index.view = view;
+	index.slotCount = header[1];
+	return index;
+}
+
+bool IsRecentlyDownloaded(const RecentObjectIndex &index, const char *sha1)
+{
+	if (index.view == NULL)
+	{
+		return false;
+	}
+
+	char slotPrefix[9];
+	memcpy(slotPrefix, sha1, 8);
+	slotPrefix[8] = 0;
+	UINT32 slot = strtoul(slotPrefix, NULL, 16) % index.slotCount;
+
+	// GVFS clears the timestamp while it writes a slot's SHA, and the whole SHA is compared, so
+	// reading a slot while it is being written can only miss
+	const char *entry = index.view + RECENT_OBJECT_HEADER_SIZE + static_cast<size_t>(slot) * RECENT_OBJECT_SLOT_SIZE;
+	if (memcmp(entry, sha1, SHA1_LENGTH))
+	{
+		return false;
+	}
+
+	ULONGLONG downloadTime = *reinterpret_cast<volatile const ULONGLONG *>(entry + SHA1_LENGTH);
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	ULONGLONG nowTime = (static_cast<ULONGLONG>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+	return downloadTime != 0 && nowTime - downloadTime < RECENT_OBJECT_LIFETIME;
+}
+
+void ReadGetCommand(char *packet_buffer, char *sha1)
+{
+	packet_txt_read(packet_buffer, MAX_PACKET_LENGTH);
+	if (strcmp(packet_buffer, "command=get"))
+	{
+		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad command\n");
+	}
+
+	size_t len = packet_txt_read(packet_buffer, MAX_PACKET_LENGTH);
+	if ((len != SHA1_LENGTH + 5) || strncmp(packet_buffer, "sha1=", 5))
+	{
+		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad sha1 in get command\n");
+	}
+
+	memcpy(sha1, packet_buffer + 5, SHA1_LENGTH + 1);
+
+	if (packet_txt_read(packet_buffer, MAX_PACKET_LENGTH))
+	{
+		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad command end\n");
+	}
+}
+
+int DownloadSHA(GVFSPipe &pipe, ResponseReader *reader, const char *sha1)
 {
 	// Construct download request message
 	// Format:  "DLO|<40 character SHA>"
@@ -33,47 +231,102 @@ int DownloadSHA(HANDLE pipeHandle, const char *sha1)
 		die(ReturnCode::InvalidSHA, "First argument must be a 40 character SHA, actual value: %s\n", sha1);
 	}
 
-	DWORD bytesWritten;
-	BOOL success = WriteFile(
-		pipeHandle,             // pipe handle 
-		message,				// message 
-		MESSAGE_LENGTH,			// message length 
-		&bytesWritten,          // bytes written 
-		NULL);                  // not overlapped 
+	WriteToGVFSPipe(pipe, message, MESSAGE_LENGTH, PIPE_WRITE_TIMEOUT_MS);
+	return ReadResponseSucceeded(pipe, reader) ? ReturnCode::Success : ReturnCode::FailureToDownload;
+}
 
-	if (!success || bytesWritten != MESSAGE_LENGTH)
+// Answers git's get command itself. A blob GVFS returned the contents of is sent to git as
+// "status=success", "size=<length>" and the contents in binary packets, in one flush group.
+// Anything else gets the same response as DownloadSHA, and git reads the object from disk.
+void DownloadSHAWithContent(GVFSPipe &pipe, ResponseReader *reader, const char *sha1)
+{
+	// Format:  "DLOC|<40 character SHA>"
+	char message[CONTENT_MESSAGE_LENGTH + 1];
+	if (_snprintf_s(message, _TRUNCATE, "DLOC|%s\n", sha1) < 0)
 	{
-		die(ReturnCode::PipeWriteFailed, "Failed to write to pipe (%d)\n", GetLastError());
+		die(ReturnCode::InvalidSHA, "First argument must be a 40 character SHA, actual value: %s\n", sha1);
 	}
 
-	DWORD bytesRead;
-	do
+	WriteToGVFSPipe(pipe, message, CONTENT_MESSAGE_LENGTH, PIPE_WRITE_TIMEOUT_MS);
+
+	char line[MAX_RESPONSE_LINE_LENGTH];
+	ReadResponseLine(pipe, reader, line, sizeof(line));
+	if (line[0] != 'S')
+	{
+		packet_txt_write("status=error");
+	}
+	else
 	{
-		// Read from the pipe. 
-		success = ReadFile(
-			pipeHandle,			// pipe handle 
-			message,			// buffer to receive reply 
-			sizeof(message),	// size of buffer 
-			&bytesRead,         // number of bytes read 
-			NULL);              // not overlapped 
+		packet_txt_write("status=success");
+		if (line[1] == '|')
+		{
+			unsigned long long length = _strtoui64(line + 2, NULL, 10);
 
-		if (!success && GetLastError() != ERROR_MORE_DATA)
+			char sizePacket[MAX_RESPONSE_LINE_LENGTH];
+			_snprintf_s(sizePacket, _TRUNCATE, "size=%llu", length);
+			packet_txt_write(sizePacket);
+			ForwardResponseContent(pipe, reader, length);
+		}
+	}
+
+	packet_flush();
+}
+
+// Asks GVFS for all of the SHAs that weren't recently downloaded at once and answers git's get
+// commands, in order. GVFS responds once for the whole batch, with "S" if every object was
+// downloaded, or otherwise "P|" followed by an 'S' or 'F' per requested SHA. Any other response
+// fails the whole batch.
+void DownloadSHABatch(GVFSPipe &pipe, ResponseReader *reader, const RecentObjectIndex &recentObjects, char (*sha1s)[SHA1_LENGTH + 1], int count)
+{
+	bool recent[MAX_BATCH_SIZE];
+	int requestCount = 0;
+
+	// Format:  "DLOP|<SHA>,<SHA>,...,<SHA>"
+	char message[BATCH_MESSAGE_LENGTH + 1];
+	char *next = message;
+	memcpy(next, "DLOP|", 5);
+	next += 5;
+	for (int i = 0; i < count; ++i)
+	{
+		recent[i] = IsRecentlyDownloaded(recentObjects, sha1s[i]);
+		if (!recent[i])
 		{
-			break;
+			memcpy(next, sha1s[i], SHA1_LENGTH);
+			next += SHA1_LENGTH;
+			*next++ = ',';
+			++requestCount;
 		}
-	} while (!success);  // repeat loop if ERROR_MORE_DATA 
-	if (!success)
+	}
+
+	char line[MAX_BATCH_SIZE + 3] = "S";
+	if (requestCount > 0)
 	{
-		die(ReturnCode::PipeReadFailed, "Read response from pipe failed (%d)\n", GetLastError());
+		next[-1] = '\n';
+		WriteToGVFSPipe(pipe, message, static_cast<DWORD>(next - message), PIPE_WRITE_TIMEOUT_MS);
+		ReadResponseLine(pipe, reader, line, sizeof(line));
 	}
 
-	return *message == 'S' ? ReturnCode::Success : ReturnCode::FailureToDownload;
+	bool allSucceeded = !strcmp(line, "S");
+	bool partial = !strncmp(line, "P|", 2) && strlen(line + 2) == static_cast<size_t>(requestCount);
+
+	const char *nextResult = line + 2;
+	for (int i = 0; i < count; ++i)
+	{
+		bool succeeded = recent[i] || allSucceeded || (partial && *nextResult == 'S');
+		if (!recent[i])
+		{
+			++nextResult;
+		}
+
+		packet_txt_write(succeeded ? "status=success" : "status=error");
+		packet_flush();
+	}
 }
 
 int main(int, char *argv[])
 {
 	char packet_buffer[MAX_PACKET_LENGTH];
-	size_t len;
+	char sha1s[MAX_BATCH_SIZE][SHA1_LENGTH + 1];
 	int err;
 
 	// set the mode to binary so we don't get CRLF translation
@@ -101,46 +354,68 @@ int main(int, char *argv[])
 	packet_txt_write("version=1");
 	packet_flush();
 
-	packet_txt_read(packet_buffer, sizeof(packet_buffer));
-	if (strcmp(packet_buffer, "capability=get"))
+	// Capabilities other than the ones below are ignored, and not advertised back
+	bool getCapability = false;
+	bool contentCapability = false;
+	while (packet_txt_read(packet_buffer, sizeof(packet_buffer)))
 	{
-		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad capability\n");
+		if (!strcmp(packet_buffer, "capability=get"))
+		{
+			getCapability = true;
+		}
+		else if (!strcmp(packet_buffer, "capability=content"))
+		{
+			contentCapability = true;
+		}
 	}
 
-	if (packet_txt_read(packet_buffer, sizeof(packet_buffer)))
+	if (!getCapability)
 	{
-		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad capability end\n");
+		die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad capability\n");
 	}
 
 	packet_txt_write("capability=get");
+	if (contentCapability)
+	{
+		packet_txt_write("capability=content");
+	}
+
 	packet_flush();
 
 	std::wstring pipeName(GetGVFSPipeName(argv[0]));
 
-	HANDLE pipeHandle = CreatePipeToGVFS(pipeName);
+	GVFSPipe pipe = CreateOverlappedPipeToGVFS(pipeName);
+	RecentObjectIndex recentObjects = OpenRecentObjectIndex(pipeName);
+	ResponseReader reader = {};
+	reader.timeoutMs = GetPipeTimeoutMs(DEFAULT_DOWNLOAD_TIMEOUT_MS);
 
 	while (1)
 	{
-		packet_txt_read(packet_buffer, sizeof(packet_buffer));
-		if (strcmp(packet_buffer, "command=get"))
+		int count = 0;
+		do
 		{
-			die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad command\n");
-		}
+			ReadGetCommand(packet_buffer, sha1s[count++]);
+		} while (count < MAX_BATCH_SIZE && IsGitInputAvailable());
 
-		len = packet_txt_read(packet_buffer, sizeof(packet_buffer));
-		if ((len != SHA1_LENGTH + 5) || strncmp(packet_buffer, "sha1=", 5))
+		if (count == 1 && IsRecentlyDownloaded(recentObjects, sha1s[0]))
 		{
-			die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad sha1 in get command\n");
+			packet_txt_write("status=success");
+			packet_flush();
 		}
-
-		if (packet_txt_read(packet_buffer, sizeof(packet_buffer)))
+		else if (count == 1 && contentCapability)
 		{
-			die(ReadObjectHookErrorReturnCode::ErrorReadObjectProtocol, "Bad command end\n");
+			DownloadSHAWithContent(pipe, &reader, sha1s[0]);
+		}
+		else if (count == 1)
+		{
+			err = DownloadSHA(pipe, &reader, sha1s[0]);
+			packet_txt_write(err ? "status=error" : "status=success");
+			packet_flush();
+		}
+		else
+		{
+			DownloadSHABatch(pipe, &reader, recentObjects, sha1s, count);
 		}
-
-		err = DownloadSHA(pipeHandle, packet_buffer + 5);
-		packet_txt_write(err ? "status=error" : "status=success");
-		packet_flush();
 	}
 
 	// we'll never reach here as the signal to exit is having stdin closed which is handled in packet_bin_read
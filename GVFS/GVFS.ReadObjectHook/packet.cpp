@@ -2,104 +2,146 @@
 #include "packet.h"
 #include "common.h"
 
-static void set_packet_header(char *buf, const size_t size)
+// Input and output buffers hold a full packet plus a read's worth of the next one
+#define PACKET_BUFFER_SIZE (2 * LARGE_PACKET_MAX)
+
+static char input_buffer[PACKET_BUFFER_SIZE];
+static size_t input_start;
+static size_t input_end;
+
+static char output_buffer[PACKET_BUFFER_SIZE];
+static size_t output_length;
+
+static inline char hex_digit(unsigned int nibble)
 {
-	static char hexchar[] = "0123456789abcdef";
-
-#define hex(a) (hexchar[(a) & 15])
-	buf[0] = hex(size >> 12);
-	buf[1] = hex(size >> 8);
-	buf[2] = hex(size >> 4);
-	buf[3] = hex(size);
-#undef hex
+	nibble &= 15;
+	return (char)(nibble < 10 ? '0' + nibble : 'a' + nibble - 10);
 }
 
-const signed char hexval_table[256] = {
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 00-07 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 08-0f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 10-17 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 18-1f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 20-27 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 28-2f */
-	0,  1,  2,  3,  4,  5,  6,  7,		/* 30-37 */
-	8,  9, -1, -1, -1, -1, -1, -1,		/* 38-3f */
-	-1, 10, 11, 12, 13, 14, 15, -1,		/* 40-47 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 48-4f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 50-57 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 58-5f */
-	-1, 10, 11, 12, 13, 14, 15, -1,		/* 60-67 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 68-67 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 70-77 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 78-7f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 80-87 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 88-8f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 90-97 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* 98-9f */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* a0-a7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* a8-af */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* b0-b7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* b8-bf */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* c0-c7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* c8-cf */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* d0-d7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* d8-df */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* e0-e7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* e8-ef */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* f0-f7 */
-	-1, -1, -1, -1, -1, -1, -1, -1,		/* f8-ff */
-};
-
-static inline unsigned int hexval(unsigned char c)
+static void set_packet_header(char *buf, const size_t size)
 {
-	return hexval_table[c];
+	buf[0] = hex_digit((unsigned int)(size >> 12));
+	buf[1] = hex_digit((unsigned int)(size >> 8));
+	buf[2] = hex_digit((unsigned int)(size >> 4));
+	buf[3] = hex_digit((unsigned int)size);
 }
 
-static inline int hex2chr(const char *s)
+static inline int hexval(unsigned char c)
 {
-	int val = hexval(s[0]);
-	return (val < 0) ? val : (val << 4) | hexval(s[1]);
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+
+	// Folding to lower case maps 'A'-'F' onto 'a'-'f' and nothing else onto that range
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+
+	return -1;
 }
 
 static int packet_length(const char *packetlen)
 {
-	int val = hex2chr(packetlen);
-	return (val < 0) ? val : (val << 8) | hex2chr(packetlen + 2);
+	int val = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		int digit = hexval(packetlen[i]);
+		if (digit < 0)
+		{
+			return -1;
+		}
+
+		val = (val << 4) | digit;
+	}
+
+	return val;
 }
 
-static size_t packet_bin_read(void *buf, size_t count, FILE *stream)
+// Makes at least count bytes available at input_buffer + input_start. Returns false if the
+// stream ended first.
+static bool fill_input(size_t count, FILE *stream)
 {
-	char packetlen[4];
-	size_t len, ret;
+	if (input_end - input_start >= count)
+	{
+		return true;
+	}
 
-	/* if we timeout waiting for input, exit and git will restart us if needed */
-	size_t bytes_read = fread(packetlen, 1, 4, stream);
-	if (0 == bytes_read)
+	if (input_start + count > PACKET_BUFFER_SIZE)
 	{
-		exit(0);
+		memmove(input_buffer, input_buffer + input_start, input_end - input_start);
+		input_end -= input_start;
+		input_start = 0;
+	}
+
+	while (input_end - input_start < count)
+	{
+		int bytes_read = _read(_fileno(stream), input_buffer + input_end, (unsigned int)(PACKET_BUFFER_SIZE - input_end));
+		if (bytes_read <= 0)
+		{
+			return false;
+		}
+
+		input_end += bytes_read;
 	}
-	if (4 != bytes_read)
+
+	return true;
+}
+
+bool packet_read_pending()
+{
+	return input_end != input_start;
+}
+
+size_t packet_bin_read(void *buf, size_t count, FILE *stream)
+{
+	size_t len;
+
+	/* if we timeout waiting for input, exit and git will restart us if needed */
+	if (!fill_input(4, stream))
 	{
+		if (input_end == input_start)
+		{
+			exit(0);
+		}
+
 		die(-1, "invalid packet length");
 	}
 
-	len = packet_length(packetlen);
+	int packetlen = packet_length(input_buffer + input_start);
+	if (packetlen < 0)
+	{
+		die(-1, "protocol error: bad line length character: %.4s", input_buffer + input_start);
+	}
+
+	input_start += 4;
+	len = packetlen;
 	if (!len)
 	{
 		return 0;
 	}
-	if (len < 4)
+	if (len < 4 || len > LARGE_PACKET_MAX)
 	{
-		die(-1, "protocol error: bad line length character: %.4s", packetlen);
+		die(-1, "protocol error: bad line length %d", len);
 	}
 	len -= 4;
 	if (len >= count)
 	{
 		die(-1, "protocol error: bad line length %d", len);
 	}
-	ret = fread(buf, 1, len, stream);
-	if (ret != len)
+	if (!fill_input(len, stream))
 	{
-		die(-1, "invalid packet (%d bytes expected; %d bytes read)", len, ret);
+		die(-1, "invalid packet (%d bytes expected; %d bytes read)", len, input_end - input_start);
+	}
+
+	memcpy(buf, input_buffer + input_start, len);
+	input_start += len;
+	if (input_start == input_end)
+	{
+		input_start = 0;
+		input_end = 0;
 	}
 
 	return len;
@@ -119,38 +161,64 @@ size_t packet_txt_read(char *buf, size_t count, FILE *stream)
 	return len;
 }
 
-void packet_txt_write(const char *buf, FILE *stream)
+static void write_output(FILE *stream)
 {
-	char packetlen[4];
-	size_t len, count = strlen(buf);
+	const char *next = output_buffer;
+	while (output_length > 0)
+	{
+		int written = _write(_fileno(stream), next, (unsigned int)output_length);
+		if (written <= 0)
+		{
+			die(-1, "error writing packet");
+		}
+
+		next += written;
+		output_length -= written;
+	}
+}
 
-	set_packet_header(packetlen, count + 5);
-	len = fwrite(packetlen, 1, 4, stream);
-	if (len != 4)
+static void reserve_output(size_t count, FILE *stream)
+{
+	if (output_length + count > PACKET_BUFFER_SIZE)
 	{
-		die(-1, "error writing packet length");
+		write_output(stream);
 	}
-	len = fwrite(buf, 1, count, stream);
-	if (len != count)
+}
+
+void packet_bin_write(const void *buf, size_t count, FILE *stream)
+{
+	if (count > LARGE_PACKET_DATA_MAX)
 	{
-		die(-1, "error writing packet");
+		die(-1, "protocol error: packet of %d bytes is too large", count);
 	}
-	len = fwrite("\n", 1, 1, stream);
-	if (len != 1)
+
+	reserve_output(count + 4, stream);
+	set_packet_header(output_buffer + output_length, count + 4);
+	memcpy(output_buffer + output_length + 4, buf, count);
+	output_length += count + 4;
+}
+
+void packet_txt_write(const char *buf, FILE *stream)
+{
+	size_t count = strlen(buf);
+	if (count + 1 > LARGE_PACKET_DATA_MAX)
 	{
-		die(-1, "error writing packet");
+		die(-1, "protocol error: packet of %d bytes is too large", count + 1);
 	}
-	fflush(stream);
+
+	reserve_output(count + 5, stream);
+	set_packet_header(output_buffer + output_length, count + 5);
+	memcpy(output_buffer + output_length + 4, buf, count);
+	output_buffer[output_length + 4 + count] = '\n';
+	output_length += count + 5;
 }
 
 void packet_flush(FILE *stream)
 {
-	size_t len;
+	reserve_output(4, stream);
+	memcpy(output_buffer + output_length, "0000", 4);
+	output_length += 4;
 
-	len = fwrite("0000", 1, 4, stream);
-	if (len != 4)
-	{
-		die(-1, "error writing flush packet");
-	}
 	fflush(stream);
+	write_output(stream);
 }
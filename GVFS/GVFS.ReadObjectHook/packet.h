@@ -1,6 +1,18 @@
 #pragma once
 #include <stdio.h>
 
+// pkt-line limits from git's protocol: a packet is at most 65520 bytes including its
+// 4 byte length header
+#define LARGE_PACKET_MAX 65520
+#define LARGE_PACKET_DATA_MAX (LARGE_PACKET_MAX - 4)
+
+// Reads are served from a buffer that is refilled with one read at a time, and writes are
+// collected in a buffer until packet_flush, which sends the whole flush group in one write.
+size_t packet_bin_read(void *buf, size_t count, FILE *stream = stdin);
 size_t packet_txt_read(char *buf, size_t count, FILE *stream = stdin);
+void packet_bin_write(const void *buf, size_t count, FILE *stream = stdout);
 void packet_txt_write(const char *buf, FILE *stream = stdout);
 void packet_flush(FILE *stream = stdout);
+
+// True if input has already been read into the buffer and not yet consumed
+bool packet_read_pending();
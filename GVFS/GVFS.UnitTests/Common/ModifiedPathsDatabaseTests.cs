@@ -4,6 +4,7 @@ using GVFS.UnitTests.Mock;
 using GVFS.UnitTests.Mock.FileSystem;
 using NUnit.Framework;
 using System;
+using System.Collections.Generic;
 using System.IO;
 
 namespace GVFS.UnitTests.Common
@@ -74,6 +75,24 @@ A dir1/dir2/file3.txt
             TestAddingPath(pathToAdd: Path.Combine("dir", "subdir"), pathInList: Path.Combine("dir", "subdir") + Path.DirectorySeparatorChar, isFolder: true);
         }
 
+        [TestCase]
+        public void GetModifiedPathsAddedSinceReturnsOnlyNewPaths()
+        {
+            ModifiedPathsDatabase mpd = CreateModifiedPathsDatabase(ExistingEntries);
+            List<string> addedPaths = new List<string>();
+            int sequence = mpd.GetModifiedPathsAddedSince(0, addedPaths);
+            sequence.ShouldEqual(3);
+            addedPaths.Count.ShouldEqual(3);
+
+            bool isRetryable;
+            mpd.TryAdd("newfile.txt", isFolder: false, isRetryable: out isRetryable).ShouldBeTrue();
+            mpd.TryAdd("file.txt", isFolder: false, isRetryable: out isRetryable).ShouldBeTrue();
+
+            addedPaths.Clear();
+            mpd.GetModifiedPathsAddedSince(sequence, addedPaths).ShouldEqual(4);
+            addedPaths.ShouldContainSingle(x => x == "newfile.txt");
+        }
+
         private static void TestAddingPath(string path, bool isFolder = false)
         {
             TestAddingPath(path, path, isFolder);
@@ -33,7 +33,8 @@ namespace GVFS.UnitTests.Mock.Mac
 
         public override Result StartVirtualizationInstance(
             string virtualizationRootFullPath,
-            uint poolThreadCount)
+            uint poolThreadCount,
+            InstanceFlags flags = InstanceFlags.None)
         {
             poolThreadCount.ShouldBeAtLeast(1U, "poolThreadCount must be greater than 0");
             return Result.Success;
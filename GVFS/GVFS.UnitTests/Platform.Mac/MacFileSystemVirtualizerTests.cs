@@ -180,7 +180,7 @@ namespace GVFS.UnitTests.Platform.Mac
 
                 Guid enumerationGuid = Guid.NewGuid();
                 gitIndexProjection.EnumerationInMemory = false;
-                mockVirtualization.OnEnumerateDirectory(1, "test", triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
+                mockVirtualization.OnEnumerateDirectory(1, "test", providerId: new byte[VirtualizationInstance.PlaceholderIdLength], contentId: new byte[VirtualizationInstance.PlaceholderIdLength], triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
                 mockVirtualization.CreatedPlaceholders.ShouldContain(
                     kvp => kvp.Key.Equals(Path.Combine("test", "test.txt"), StringComparison.OrdinalIgnoreCase) && kvp.Value == FileMode644);
                 fileSystemCallbacks.Stop();
@@ -210,7 +210,7 @@ namespace GVFS.UnitTests.Platform.Mac
 
                 Guid enumerationGuid = Guid.NewGuid();
                 gitIndexProjection.EnumerationInMemory = true;
-                mockVirtualization.OnEnumerateDirectory(1, "test", triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
+                mockVirtualization.OnEnumerateDirectory(1, "test", providerId: new byte[VirtualizationInstance.PlaceholderIdLength], contentId: new byte[VirtualizationInstance.PlaceholderIdLength], triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
                 mockVirtualization.CreatedPlaceholders.ShouldContain(
                     kvp => kvp.Key.Equals(Path.Combine("test", "test.txt"), StringComparison.OrdinalIgnoreCase) && kvp.Value == FileMode644);
                 fileSystemCallbacks.Stop();
@@ -242,7 +242,7 @@ namespace GVFS.UnitTests.Platform.Mac
 
                 Guid enumerationGuid = Guid.NewGuid();
                 gitIndexProjection.EnumerationInMemory = true;
-                mockVirtualization.OnEnumerateDirectory(1, "test", triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
+                mockVirtualization.OnEnumerateDirectory(1, "test", providerId: new byte[VirtualizationInstance.PlaceholderIdLength], contentId: new byte[VirtualizationInstance.PlaceholderIdLength], triggeringProcessId: 1, triggeringProcessName: "UnitTests").ShouldEqual(Result.Success);
                 mockVirtualization.CreatedPlaceholders.ShouldContain(
                     kvp => kvp.Key.Equals(Path.Combine("test", "test644.txt"), StringComparison.OrdinalIgnoreCase) && kvp.Value == FileMode644);
                 mockVirtualization.CreatedPlaceholders.ShouldContain(
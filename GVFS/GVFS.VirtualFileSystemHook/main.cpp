@@ -6,6 +6,21 @@ enum VirtualFileSystemErrorReturnCode
 	ErrorVirtualFileSystemProtocol = ReturnCode::LastError + 1,
 };
 
+void WriteToStdout(HANDLE stdoutHandle, const char *data, DWORD dataLength)
+{
+    while (dataLength > 0)
+    {
+        DWORD bytesWritten;
+        if (!WriteFile(stdoutHandle, data, dataLength, &bytesWritten, NULL))
+        {
+            die(ErrorVirtualFileSystemProtocol, "Failed to write to stdout (%d)\n", GetLastError());
+        }
+
+        data += bytesWritten;
+        dataLength -= bytesWritten;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 2)
@@ -40,25 +55,31 @@ int main(int argc, char *argv[])
         die(ReturnCode::PipeWriteFailed, "Failed to write to pipe (%d)\n", GetLastError());
     }
 
-    char message[1024];
+    // The response is the whole modified paths list, so read it in large chunks and hand
+    // each one straight to git with WriteFile rather than through the CRT's stdout buffer
+    const DWORD bufferSize = 64 * 1024;
+    char *message = new char[bufferSize];
+    HANDLE stdoutHandle = GetStdHandle(STD_OUTPUT_HANDLE);
     DWORD bytesRead;
-    DWORD lastError;
     BOOL finishedReading = false;
     BOOL firstRead = true;
+
+    // A '\r' at the end of a read is held back until the next read shows whether the CRLF
+    // that terminates the response has been split across the two reads
+    BOOL pendingCarriageReturn = false;
     do
     {
-        char *pMessage = &message[0];
+        char *pMessage = message;
 
         // Read from the pipe. 
         success = ReadFile(
             pipeHandle,         // pipe handle 
             message,            // buffer to receive reply 
-            sizeof(message),    // size of buffer 
+            bufferSize,         // size of buffer 
             &bytesRead,         // number of bytes read 
             NULL);              // not overlapped 
 
-        lastError = GetLastError();
-        if (!success && lastError != ERROR_MORE_DATA)
+        if ((!success && GetLastError() != ERROR_MORE_DATA) || bytesRead == 0)
         {
             break;
         }
@@ -67,37 +88,53 @@ int main(int argc, char *argv[])
         if (firstRead)
         {
             firstRead = false;
-            if (message[0] != 'S')
+            if (messageLength < 2 || message[0] != 'S')
             {
-                die(ReturnCode::PipeReadFailed, "Read response from pipe failed (%s)\n", message);
+                die(ReturnCode::PipeReadFailed, "Read response from pipe failed (%.*s)\n", messageLength, message);
             }
 
             pMessage += 2;
             messageLength -= 2;
         }
 
-        // minus 2 to remove the CRLF at the end
-        if (*(pMessage + messageLength - 1) == '\n')
+        if (pendingCarriageReturn)
         {
-            finishedReading = true;
-            messageLength -= 1;
+            pendingCarriageReturn = false;
+            if (messageLength > 0 && *pMessage == '\n')
+            {
+                finishedReading = true;
+                break;
+            }
+
+            WriteToStdout(stdoutHandle, "\r", 1);
         }
 
-        if (*(pMessage + messageLength - 1) == '\r')
+        if (messageLength > 0 && *(pMessage + messageLength - 1) == '\n')
         {
+            // minus 2 to remove the CRLF at the end
             finishedReading = true;
             messageLength -= 1;
+            if (messageLength > 0 && *(pMessage + messageLength - 1) == '\r')
+            {
+                messageLength -= 1;
+            }
+        }
+        else if (messageLength > 0 && *(pMessage + messageLength - 1) == '\r')
+        {
+            pendingCarriageReturn = true;
+            messageLength -= 1;
         }
 
-        fwrite(pMessage, 1, messageLength, stdout);
+        WriteToStdout(stdoutHandle, pMessage, messageLength);
 
-    } while (success && !finishedReading);  // repeat loop if ERROR_MORE_DATA 
+    } while (!finishedReading);  // repeat until the terminating CRLF 
 
-    if (!success)
+    if (!finishedReading)
     {
         die(ReturnCode::PipeReadFailed, "Read response from pipe failed (%d)\n", GetLastError());
     }
 
+    delete[] message;
     return 0;
 }
 
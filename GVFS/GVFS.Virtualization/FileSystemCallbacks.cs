@@ -285,6 +285,16 @@ namespace GVFS.Virtualization
             return this.modifiedPaths.GetAllModifiedPaths();
         }
 
+        public string ModifiedPathsGeneration
+        {
+            get { return this.modifiedPaths.Generation; }
+        }
+
+        public int GetModifiedPathsAddedSince(int sequence, List<string> addedPaths)
+        {
+            return this.modifiedPaths.GetModifiedPathsAddedSince(sequence, addedPaths);
+        }
+
         public virtual void OnIndexFileChange()
         {
             string lockedGitCommand = this.context.Repository.GVFSLock.GetLockedGitCommand();
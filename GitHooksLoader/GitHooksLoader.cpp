@@ -4,15 +4,73 @@
 #include "stdafx.h"
 #include <fstream>
 #include <string>
+#include <vector>
 
-int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[]);
+// Performance counter readings taken while running one hook
+struct HookTiming
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER processCreated;
+    LARGE_INTEGER processExited;
+};
+
+// A line in the .hooks file can start with one of these to change how the hook is run.
+// Consecutive "parallel:" hooks are started together and all waited for before the next
+// hook runs, and the first of their non-zero exit codes (in file order) is the result.
+// "detached:" hooks are started and never waited for, so their exit codes are ignored.
+enum HookMode
+{
+    HookMode_Sequential,
+    HookMode_Parallel,
+    HookMode_Detached,
+};
+
+struct RunningHook
+{
+    std::wstring application;
+    HANDLE process;
+    HookTiming timing;
+};
+
+// A line can also start with a verb filter, before any mode prefix. "only(<verb>,<verb>,...):"
+// runs the hook just for the listed git verbs and "except(<verb>,...):" for every other verb, so
+// hooks that have nothing to do for a verb don't cost a process launch. Verbs are compared
+// exactly, without spaces around them.
+bool HookAppliesToVerb(std::wstring &hookApplication, const std::wstring &verb);
+HookMode ParseHookMode(std::wstring &hookApplication);
+int WaitForParallelHooks(std::vector<RunningHook> &hooks, HANDLE timingLog, wchar_t *hookName, const LARGE_INTEGER &tickFrequency);
+void LogHookTiming(HANDLE timingLog, wchar_t *hookName, const std::wstring &hookApplication, const HookTiming &timing, const LARGE_INTEGER &tickFrequency, const int *exitCode);
+// Hooks listed as a .dll are loaded into the loader and this export is called with the same
+// arguments a hook process would get: the hook path, the hook name, then the git arguments.
+// If the DLL or its export can't be loaded, the .exe with the same name is run instead.
+typedef int (__cdecl *InProcessHookEntryPoint)(int argc, wchar_t *argv[]);
+#define InProcessHookEntryPointName "GitHookMain"
+
+int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing);
+bool IsInProcessHook(const std::wstring &applicationName);
+bool TryExecuteInProcessHook(const std::wstring &expandedPath, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing, int *exitCode);
+std::wstring ExpandHookPath(const std::wstring &applicationName);
+HANDLE StartHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing);
+int WaitForHook(HANDLE process);
+HANDLE OpenTimingLog();
+void WriteTimingRecord(HANDLE timingLog, const std::wstring &record);
+std::wstring JsonString(const std::wstring &value);
+std::wstring CurrentTimeAsString();
+double ElapsedMilliseconds(const LARGE_INTEGER &start, const LARGE_INTEGER &end, const LARGE_INTEGER &tickFrequency);
 
 int wmain(int argc, WCHAR *argv[])
 {
 	LARGE_INTEGER tickFrequency = { 0 };
 	LARGE_INTEGER startTime = { 0 }, endTime = { 0 };
+    LARGE_INTEGER loaderStartTime = { 0 };
     bool perfTraceEnabled = false;
 
+    // GITHOOKSLOADER_TIMINGLOG names a file that gets one JSON record per hook and one for
+    // the whole run appended to it, without writing anything to git's output
+    QueryPerformanceFrequency(&tickFrequency);
+    QueryPerformanceCounter(&loaderStartTime);
+    HANDLE timingLog = OpenTimingLog();
+
     size_t requiredCount = 0;
     if (getenv_s(&requiredCount, NULL, 0, "GITHOOKSLOADER_PERFTRACE") != 0)
     {
@@ -51,7 +109,12 @@ int wmain(int argc, WCHAR *argv[])
     }
 
     std::wifstream hooksList(executingLoader + L".hooks");
+    std::wstring verb(argv[1]);
+    int numHooksListed = 0;
     int numHooksExecuted = 0;
+    int exitCode = 0;
+    double totalHookWaitMilliseconds = 0;
+    std::vector<RunningHook> parallelHooks;
     for (std::wstring hookApplication; std::getline(hooksList, hookApplication); )
     {
         // Skip comments and empty lines.
@@ -60,17 +123,64 @@ int wmain(int argc, WCHAR *argv[])
             continue;
         }
 
+        numHooksListed++;
+        if (!HookAppliesToVerb(hookApplication, verb))
+        {
+            continue;
+        }
+
+        HookMode mode = ParseHookMode(hookApplication);
         numHooksExecuted++;
 
+        // In-process hooks run on the loader's thread, so they are always run in order
+        if (IsInProcessHook(hookApplication))
+        {
+            mode = HookMode_Sequential;
+        }
+
+        if ((mode != HookMode_Parallel && !parallelHooks.empty()) || parallelHooks.size() == MAXIMUM_WAIT_OBJECTS)
+        {
+            LARGE_INTEGER waitStart, waitEnd;
+            QueryPerformanceCounter(&waitStart);
+            exitCode = WaitForParallelHooks(parallelHooks, timingLog, hookName, tickFrequency);
+            QueryPerformanceCounter(&waitEnd);
+            totalHookWaitMilliseconds += ElapsedMilliseconds(waitStart, waitEnd, tickFrequency);
+            if (0 != exitCode)
+            {
+                break;
+            }
+        }
+
+        if (mode == HookMode_Parallel)
+        {
+            RunningHook hook = { hookApplication, NULL, { 0 } };
+            hook.process = StartHook(hookApplication, hookName, argc, argv, &hook.timing);
+            parallelHooks.push_back(hook);
+            continue;
+        }
+
+        if (mode == HookMode_Detached)
+        {
+            HookTiming timing = { 0 };
+            CloseHandle(StartHook(hookApplication, hookName, argc, argv, &timing));
+            LogHookTiming(timingLog, hookName, hookApplication, timing, tickFrequency, NULL);
+            continue;
+        }
+
         if (perfTraceEnabled)
         {
             QueryPerformanceCounter(&startTime);
         }
 
-        int hookExitCode = ExecuteHook(hookApplication, hookName, argc, argv);
+        HookTiming timing = { 0 };
+        int hookExitCode = ExecuteHook(hookApplication, hookName, argc, argv, &timing);
+        totalHookWaitMilliseconds += ElapsedMilliseconds(timing.processCreated, timing.processExited, tickFrequency);
+        LogHookTiming(timingLog, hookName, hookApplication, timing, tickFrequency, &hookExitCode);
+
         if (0 != hookExitCode)
         {
-            return hookExitCode;
+            exitCode = hookExitCode;
+            break;
         }
 
         if (perfTraceEnabled)
@@ -82,16 +192,358 @@ int wmain(int argc, WCHAR *argv[])
         }
     }
 
-    if (0 == numHooksExecuted)
+    if (!parallelHooks.empty())
+    {
+        LARGE_INTEGER waitStart, waitEnd;
+        QueryPerformanceCounter(&waitStart);
+        exitCode = WaitForParallelHooks(parallelHooks, timingLog, hookName, tickFrequency);
+        QueryPerformanceCounter(&waitEnd);
+        totalHookWaitMilliseconds += ElapsedMilliseconds(waitStart, waitEnd, tickFrequency);
+    }
+
+    if (timingLog != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER loaderEndTime;
+        QueryPerformanceCounter(&loaderEndTime);
+        double totalMilliseconds = ElapsedMilliseconds(loaderStartTime, loaderEndTime, tickFrequency);
+
+        // Overhead is everything the loader adds on top of waiting for the hooks to run,
+        // including reading the .hooks file and creating the hook processes
+        wchar_t timings[160];
+        swprintf_s(
+            timings,
+            L"\"hookCount\":%d,\"totalMs\":%.3f,\"loaderOverheadMs\":%.3f,\"exitCode\":%d",
+            numHooksExecuted,
+            totalMilliseconds,
+            totalMilliseconds - totalHookWaitMilliseconds,
+            exitCode);
+
+        WriteTimingRecord(
+            timingLog,
+            L"{\"time\":" + JsonString(CurrentTimeAsString()) +
+            L",\"pid\":" + std::to_wstring(GetCurrentProcessId()) +
+            L",\"loader\":" + JsonString(hookName) +
+            L"," + timings + L"}");
+
+        CloseHandle(timingLog);
+    }
+
+    if (0 == numHooksListed)
     {
         fwprintf(stderr, L"No hooks found to execute\n");
         exit(5);
     }
 
+    return exitCode;
+}
+
+bool HookAppliesToVerb(std::wstring &hookApplication, const std::wstring &verb)
+{
+    const std::wstring onlyPrefix(L"only(");
+    const std::wstring exceptPrefix(L"except(");
+
+    bool isOnly = hookApplication.compare(0, onlyPrefix.length(), onlyPrefix) == 0;
+    bool isExcept = !isOnly && hookApplication.compare(0, exceptPrefix.length(), exceptPrefix) == 0;
+    if (!isOnly && !isExcept)
+    {
+        return true;
+    }
+
+    size_t listStart = isOnly ? onlyPrefix.length() : exceptPrefix.length();
+    size_t listEnd = hookApplication.find(L"):", listStart);
+    if (listEnd == std::wstring::npos)
+    {
+        fwprintf(stderr, L"Verb filter is missing its closing \"):\" in '%s'\n", hookApplication.c_str());
+        exit(7);
+    }
+
+    bool isListed = false;
+    for (size_t verbStart = listStart; verbStart <= listEnd && !isListed; )
+    {
+        size_t verbEnd = hookApplication.find(L',', verbStart);
+        if (verbEnd == std::wstring::npos || verbEnd > listEnd)
+        {
+            verbEnd = listEnd;
+        }
+
+        isListed = hookApplication.compare(verbStart, verbEnd - verbStart, verb) == 0;
+        verbStart = verbEnd + 1;
+    }
+
+    size_t applicationStart = hookApplication.find_first_not_of(L" \t", listEnd + 2);
+    hookApplication.erase(0, applicationStart == std::wstring::npos ? hookApplication.length() : applicationStart);
+    return isOnly == isListed;
+}
+
+HookMode ParseHookMode(std::wstring &hookApplication)
+{
+    const std::wstring parallelPrefix(L"parallel:");
+    const std::wstring detachedPrefix(L"detached:");
+
+    HookMode mode = HookMode_Sequential;
+    size_t prefixLength = 0;
+    if (hookApplication.compare(0, parallelPrefix.length(), parallelPrefix) == 0)
+    {
+        mode = HookMode_Parallel;
+        prefixLength = parallelPrefix.length();
+    }
+    else if (hookApplication.compare(0, detachedPrefix.length(), detachedPrefix) == 0)
+    {
+        mode = HookMode_Detached;
+        prefixLength = detachedPrefix.length();
+    }
+
+    size_t applicationStart = hookApplication.find_first_not_of(L" \t", prefixLength);
+    hookApplication.erase(0, applicationStart == std::wstring::npos ? hookApplication.length() : applicationStart);
+    return mode;
+}
+
+// Waits for all of the hooks and clears the list. Returns the first non-zero exit code in
+// the order the hooks were listed.
+int WaitForParallelHooks(std::vector<RunningHook> &hooks, HANDLE timingLog, wchar_t *hookName, const LARGE_INTEGER &tickFrequency)
+{
+    std::vector<int> exitCodes(hooks.size(), 0);
+    std::vector<size_t> remaining;
+    for (size_t i = 0; i < hooks.size(); ++i)
+    {
+        remaining.push_back(i);
+    }
+
+    while (!remaining.empty())
+    {
+        std::vector<HANDLE> processes;
+        for (size_t index : remaining)
+        {
+            processes.push_back(hooks[index].process);
+        }
+
+        DWORD waitResult = WaitForMultipleObjects(static_cast<DWORD>(processes.size()), processes.data(), FALSE, INFINITE);
+        if (waitResult >= WAIT_OBJECT_0 + processes.size())
+        {
+            fwprintf(stderr, L"WaitForMultipleObjects failed (%d).\n", GetLastError());
+            exit(4);
+        }
+
+        size_t index = remaining[waitResult - WAIT_OBJECT_0];
+        remaining.erase(remaining.begin() + (waitResult - WAIT_OBJECT_0));
+
+        RunningHook &hook = hooks[index];
+        QueryPerformanceCounter(&hook.timing.processExited);
+        exitCodes[index] = WaitForHook(hook.process);
+        LogHookTiming(timingLog, hookName, hook.application, hook.timing, tickFrequency, &exitCodes[index]);
+    }
+
+    hooks.clear();
+    for (int exitCode : exitCodes)
+    {
+        if (0 != exitCode)
+        {
+            return exitCode;
+        }
+    }
+
     return 0;
 }
 
-int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[])
+// exitCode is NULL for detached hooks, which are never waited for
+void LogHookTiming(HANDLE timingLog, wchar_t *hookName, const std::wstring &hookApplication, const HookTiming &timing, const LARGE_INTEGER &tickFrequency, const int *exitCode)
+{
+    if (timingLog == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    wchar_t timings[128];
+    if (exitCode != NULL)
+    {
+        swprintf_s(
+            timings,
+            L"\"createProcessMs\":%.3f,\"runMs\":%.3f,\"exitCode\":%d",
+            ElapsedMilliseconds(timing.start, timing.processCreated, tickFrequency),
+            ElapsedMilliseconds(timing.processCreated, timing.processExited, tickFrequency),
+            *exitCode);
+    }
+    else
+    {
+        swprintf_s(
+            timings,
+            L"\"createProcessMs\":%.3f,\"detached\":true",
+            ElapsedMilliseconds(timing.start, timing.processCreated, tickFrequency));
+    }
+
+    WriteTimingRecord(
+        timingLog,
+        L"{\"time\":" + JsonString(CurrentTimeAsString()) +
+        L",\"pid\":" + std::to_wstring(GetCurrentProcessId()) +
+        L",\"loader\":" + JsonString(hookName) +
+        L",\"hook\":" + JsonString(hookApplication) +
+        L"," + timings + L"}");
+}
+
+HANDLE OpenTimingLog()
+{
+    wchar_t logPath[MAX_PATH + 1];
+    DWORD length = GetEnvironmentVariableW(L"GITHOOKSLOADER_TIMINGLOG", logPath, MAX_PATH + 1);
+    if (length == 0 || length > MAX_PATH)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // FILE_APPEND_DATA without FILE_WRITE_DATA makes every write an append, so records
+    // from concurrently running loaders don't overwrite each other
+    return CreateFileW(
+        logPath,
+        FILE_APPEND_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+}
+
+void WriteTimingRecord(HANDLE timingLog, const std::wstring &record)
+{
+    // Written as UTF-8 with a single WriteFile so that each record is one atomic append
+    std::wstring line = record + L"\n";
+    int utf8Length = WideCharToMultiByte(CP_UTF8, 0, line.c_str(), static_cast<int>(line.length()), NULL, 0, NULL, NULL);
+    if (utf8Length <= 0)
+    {
+        return;
+    }
+
+    std::string utf8Line(utf8Length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, line.c_str(), static_cast<int>(line.length()), &utf8Line[0], utf8Length, NULL, NULL);
+
+    // Failing to log must never fail the git command
+    DWORD bytesWritten;
+    WriteFile(timingLog, utf8Line.c_str(), utf8Length, &bytesWritten, NULL);
+}
+
+std::wstring JsonString(const std::wstring &value)
+{
+    std::wstring escaped = L"\"";
+    for (wchar_t c : value)
+    {
+        if (c == L'"' || c == L'\\')
+        {
+            escaped += L'\\';
+            escaped += c;
+        }
+        else if (c < 0x20)
+        {
+            wchar_t control[7];
+            swprintf_s(control, L"\\u%04x", c);
+            escaped += control;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+
+    return escaped + L"\"";
+}
+
+std::wstring CurrentTimeAsString()
+{
+    SYSTEMTIME now;
+    GetSystemTime(&now);
+
+    wchar_t time[32];
+    swprintf_s(
+        time,
+        L"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+        now.wYear,
+        now.wMonth,
+        now.wDay,
+        now.wHour,
+        now.wMinute,
+        now.wSecond,
+        now.wMilliseconds);
+
+    return time;
+}
+
+double ElapsedMilliseconds(const LARGE_INTEGER &start, const LARGE_INTEGER &end, const LARGE_INTEGER &tickFrequency)
+{
+    if (tickFrequency.QuadPart == 0)
+    {
+        return 0;
+    }
+
+    return (end.QuadPart - start.QuadPart) * 1000.0 / tickFrequency.QuadPart;
+}
+
+int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing)
+{
+    std::wstring applicationToStart = applicationName;
+    if (IsInProcessHook(applicationName))
+    {
+        std::wstring expandedPath = ExpandHookPath(applicationName);
+        int exitCode;
+        if (TryExecuteInProcessHook(expandedPath, hookName, argc, argv, timing, &exitCode))
+        {
+            return exitCode;
+        }
+
+        applicationToStart = expandedPath.substr(0, expandedPath.length() - 4) + L".exe";
+    }
+
+    HANDLE process = StartHook(applicationToStart, hookName, argc, argv, timing);
+
+    // Wait until child process exits.
+    WaitForSingleObject(process, INFINITE);
+    QueryPerformanceCounter(&timing->processExited);
+
+    return WaitForHook(process);
+}
+
+bool IsInProcessHook(const std::wstring &applicationName)
+{
+    const std::wstring dllExtension(L".dll");
+    return applicationName.length() > dllExtension.length() &&
+        _wcsicmp(applicationName.c_str() + applicationName.length() - dllExtension.length(), dllExtension.c_str()) == 0;
+}
+
+// Returns false, without running anything, if the DLL or its entry point could not be loaded
+bool TryExecuteInProcessHook(const std::wstring &expandedPath, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing, int *exitCode)
+{
+    QueryPerformanceCounter(&timing->start);
+
+    // The DLL is left loaded, it is only used once before the loader exits
+    HMODULE hookModule = LoadLibraryExW(expandedPath.c_str(), NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+    if (hookModule == NULL)
+    {
+        return false;
+    }
+
+    InProcessHookEntryPoint entryPoint = reinterpret_cast<InProcessHookEntryPoint>(GetProcAddress(hookModule, InProcessHookEntryPointName));
+    if (entryPoint == NULL)
+    {
+        FreeLibrary(hookModule);
+        return false;
+    }
+
+    std::vector<wchar_t *> hookArgv;
+    hookArgv.push_back(const_cast<wchar_t *>(expandedPath.c_str()));
+    hookArgv.push_back(hookName);
+    for (int x = 1; x < argc; x++)
+    {
+        hookArgv.push_back(argv[x]);
+    }
+
+    hookArgv.push_back(NULL);
+
+    QueryPerformanceCounter(&timing->processCreated);
+    *exitCode = entryPoint(static_cast<int>(hookArgv.size() - 1), hookArgv.data());
+    QueryPerformanceCounter(&timing->processExited);
+
+    fflush(stdout);
+    fflush(stderr);
+    return true;
+}
+
+std::wstring ExpandHookPath(const std::wstring &applicationName)
 {
     wchar_t expandedPath[MAX_PATH + 1];
     DWORD length = ExpandEnvironmentStrings(applicationName.c_str(), expandedPath, MAX_PATH);
@@ -100,8 +552,14 @@ int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc
         fwprintf(stderr, L"Unable to expand '%s'", applicationName.c_str());
         exit(6);
     }
-    
-    std::wstring commandLine = std::wstring(expandedPath) + L" " + hookName;
+
+    return std::wstring(expandedPath);
+}
+
+// Returns the hook's process handle, which WaitForHook or the caller closes
+HANDLE StartHook(const std::wstring &applicationName, wchar_t *hookName, int argc, WCHAR *argv[], HookTiming *timing)
+{
+    std::wstring commandLine = ExpandHookPath(applicationName) + L" " + hookName;
     for (int x = 1; x < argc; x++)
     {
         commandLine += L" " + std::wstring(argv[x]);
@@ -117,6 +575,7 @@ int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc
     si.dwFlags = STARTF_USESTDHANDLES;
 
     ZeroMemory(&pi, sizeof(pi));
+    QueryPerformanceCounter(&timing->start);
     if (!CreateProcess(
         NULL,           // Application name
         const_cast<LPWSTR>(commandLine.c_str()),
@@ -134,20 +593,27 @@ int ExecuteHook(const std::wstring &applicationName, wchar_t *hookName, int argc
         exit(3);
     }
 
-    // Wait until child process exits.
-    WaitForSingleObject(pi.hProcess, INFINITE);
+    QueryPerformanceCounter(&timing->processCreated);
+
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+// Waits for the hook's process to exit, closes its handle and returns its exit code
+int WaitForHook(HANDLE process)
+{
+    WaitForSingleObject(process, INFINITE);
 
     // Get process exit code to pass along
     DWORD exitCode;
-    if (!GetExitCodeProcess(pi.hProcess, &exitCode))
+    if (!GetExitCodeProcess(process, &exitCode))
     {
         fwprintf(stderr, L"GetExitCodeProcess failed (%d).\n", GetLastError());
         exit(4);
     }
 
-    // Close process and thread handles. 
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+    // Close process handle. 
+    CloseHandle(process);
 
     return (int)exitCode;
 }
\ No newline at end of file
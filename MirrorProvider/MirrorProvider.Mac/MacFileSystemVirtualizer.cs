@@ -39,6 +39,8 @@ namespace MirrorProvider.Mac
         private Result OnEnumerateDirectory(
             ulong commandId,
             string relativePath,
+            byte[] providerId,
+            byte[] contentId,
             int triggeringProcessId,
             string triggeringProcessName)
         {
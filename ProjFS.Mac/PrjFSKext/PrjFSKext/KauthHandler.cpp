@@ -1,20 +1,41 @@
 #include <kern/debug.h>
 #include <sys/kauth.h>
 #include <sys/proc.h>
+#include <sys/signal.h>
+#include <sys/sysctl.h>
 #include <libkern/OSAtomic.h>
 #include <kern/assert.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
 #include <stdatomic.h>
 
 #include "PrjFSCommon.h"
+#include "KextTesting.hpp"
 #include "VirtualizationRoots.hpp"
 #include "KauthHandler.hpp"
 #include "KextLog.hpp"
 #include "Message.h"
 #include "Locks.hpp"
 #include "PrjFSProviderUserClient.hpp"
+#include "VnodeCache.hpp"
+#include "ProcessPolicy.hpp"
+#include "ProcessAttribution.hpp"
+#include "Memory.hpp"
+#include "VnodeUtilities.hpp"
+#include "PrjFSXattrs.h"
+#include "../public/PrjFSProviderClientShared.h"
 
 // Function prototypes
-static int HandleVnodeOperation(
+KEXT_STATIC int HandleVnodeOperation(
+    kauth_cred_t    credential,
+    void*           idata,
+    kauth_action_t  action,
+    uintptr_t       arg0,
+    uintptr_t       arg1,
+    uintptr_t       arg2,
+    uintptr_t       arg3);
+
+KEXT_STATIC int HandleFileOpOperation(
     kauth_cred_t    credential,
     void*           idata,
     kauth_action_t  action,
@@ -26,48 +47,317 @@ static int HandleVnodeOperation(
 static int GetPid(vfs_context_t context);
 
 static uint32_t ReadVNodeFileFlags(vnode_t vn, vfs_context_t context);
-static bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit);
-static bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask);
-static bool ActionBitsNotSet(kauth_action_t action, kauth_action_t mask);
+KEXT_STATIC uint32_t ReadCachedVNodeFileFlags(vnode_t vn, vfs_context_t context);
+KEXT_STATIC bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit);
+KEXT_STATIC bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask);
+KEXT_STATIC bool ActionBitsNotSet(kauth_action_t action, kauth_action_t mask);
 
-static bool IsFileSystemCrawler(char* procname);
-
-static const char* GetRelativePath(const char* path, const char* root);
+KEXT_STATIC const char* GetRelativePath(const char* path, const char* root, uint32_t rootLength);
+static const char* GetRelativePathIfWithinRoot(const char* path, const char* root, uint32_t rootLength);
 
 static void Sleep(int seconds, void* channel);
 static bool TrySendRequestAndWaitForResponse(
-    const VirtualizationRoot* root,
+    VirtualizationRoot* root,
     MessageType messageType,
     const vnode_t vnode,
+    vfs_context_t context,
     int pid,
     const char* procname,
     int* kauthResult,
     int* kauthError);
+static void SendNotification(
+    VirtualizationRoot* root,
+    MessageType messageType,
+    const vnode_t vnode,
+    vfs_context_t context,
+    int pid,
+    const char* procname,
+    const char* path,
+    const char* fromPath);
+static void RecordModifiedFile(VirtualizationRoot* root, const vnode_t vnode, vfs_context_t context, const char* path);
+static void SendPrefetchHintIfDue(VirtualizationRoot* root, const vnode_t vnode, vfs_context_t context, int pid, const char* procname);
+static bool TryAddPendingOverwrite(vnode_t vnode);
+static bool IsPendingOverwrite(vnode_t vnode);
+static void RemovePendingOverwrite(vnode_t vnode);
+static bool FileIsZeroBytes(vnode_t vnode, vfs_context_t context);
+static bool TryAcquireRequestToken(VirtualizationRoot* root, int pid, int* kauthResult, int* kauthError);
+static uint32_t NotificationFlagForMessageType(MessageType messageType);
+static uint64_t GetUptimeNanoseconds();
 static void AbortAllOutstandingEvents();
-static bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode);
+KEXT_STATIC bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode);
 
 
 // Structs
+
+// Allocated by the first thread requesting a given operation on a vnode; later
+// requests for the same vnode and message type attach to it while it is in
+// flight, so the provider only sees one message. Freed by the last waiter.
 typedef struct OutstandingMessage
 {
     MessageHeader request;
     MessageType response;
     bool    receivedResponse;
+    // When the provider last reported progress on the request; the timeout
+    // restarts from there
+    uint64_t lastProgressNanoseconds;
+    
+    int32_t rootIndex;
+    // Set if the provider went away before responding
+    bool    providerDisconnected;
+    // Non-zero if the message could not be sent to the provider at all
+    errno_t sendError;
+    // Set once an enumeration or hydration request is in the provider's queue;
+    // if its last waiter gives up before the response, the provider is told
+    // to cancel it
+    bool    isCancellable;
+    
+    vnode_t vnode;
+    uint32_t vnodeVid;
+    
+    // Number of threads waiting on this message, and whether it is still in
+    // the shard's lists (i.e. new requests may attach to it)
+    uint32_t waiterCount;
+    bool    isLinked;
     
     LIST_ENTRY(OutstandingMessage) _list_privates;
+    LIST_ENTRY(OutstandingMessage) _vnode_list_privates;
     
 } OutstandingMessage;
 
+LIST_HEAD(OutstandingMessage_Head, OutstandingMessage);
+static_assert(sizeof(OutstandingMessage) <= MemoryZoneRequestRecordSize, "OutstandingMessage must fit in a request record zone element");
+static_assert(sizeof(PrjFSFileXAttrCompactData) <= MemoryZoneRequestRecordSize, "File xattrs are read into request record zone elements");
+
+// Outstanding messages are kept in hash tables indexed by message ID and by
+// vnode, which are split into shards that each have their own mutex. A message
+// is placed in the shard selected by its vnode, and that shard's index is
+// encoded in the low bits of the message ID, so both lookups use the same shard.
+// Both counts must be powers of 2.
+static const uint32_t OutstandingMessageShardCount = 16;
+static const uint32_t OutstandingMessageBucketsPerShard = 64;
+
+struct OutstandingMessageShard
+{
+    Mutex mutex;
+    OutstandingMessage_Head buckets[OutstandingMessageBucketsPerShard];
+    OutstandingMessage_Head vnodeBuckets[OutstandingMessageBucketsPerShard];
+};
+
+KEXT_STATIC uint32_t HashVnode(vnode_t vnode);
+static OutstandingMessageShard& GetOutstandingMessageShard(uint64_t messageId);
+static OutstandingMessage_Head* GetOutstandingMessageBucket_Locked(OutstandingMessageShard& shard, uint64_t messageId);
+static OutstandingMessage_Head* GetOutstandingMessageVnodeBucket_Locked(OutstandingMessageShard& shard, vnode_t vnode);
+static OutstandingMessage* FindInFlightMessage_Locked(OutstandingMessageShard& shard, vnode_t vnode, uint32_t vid, MessageType messageType);
+static void UnlinkMessage_Locked(OutstandingMessage* message);
+static void ReleaseMessage(OutstandingMessageShard& shard, OutstandingMessage* message, VirtualizationRoot* root);
+static void SendCancelMessage(VirtualizationRoot* root, const OutstandingMessage* message);
+static RequestWaitOutcome WaitForResponse_Locked(OutstandingMessageShard& shard, OutstandingMessage* message, VirtualizationRoot* root, int pid, uint64_t waitStartNanoseconds, uint32_t timeoutMilliseconds);
+static bool ProcessIsTerminating(int pid);
+static bool SpinWaitForResponse(const OutstandingMessage* message, uint32_t spinNanoseconds);
+static void UncacheAuthorizedActions(vnode_t vnode);
+static void CpuRelax();
+static int GetActiveCpuCount();
+
+// Directories a prefetch hint was recently sent for, in a direct-mapped table
+// indexed by vnode hash. A collision forgets the older directory, which at worst
+// gets another hint before its interval is up. Must be a power of 2.
+static const uint32_t PrefetchHintRecordCount = 256;
+// Cap on hints across all roots, e.g. for tree walks that read one file per directory
+static const uint32_t MaxPrefetchHintsPerSecond = 100;
+
+// 0 byte empty files in roots with ProviderRoot_SkipOverwriteHydration that were
+// opened for writing only, and which are converted to full files once the open
+// has happened. In a direct-mapped table indexed by vnode hash; an entry only
+// gives way once its vnode has been recycled, as xnu may already have cached the
+// write right it was granted, so a file that doesn't get a slot is hydrated
+// right away instead. Must be a power of 2.
+static const uint32_t PendingOverwriteCount = 256;
+
+struct PendingOverwrite
+{
+    vnode_t vnode;
+    uint32_t vnodeVid;
+};
+
+// How often threads waiting for the provider check that it is still responding
+static const uint64_t ProviderHealthCheckIntervalNanoseconds = 1000000000ull;
+
+// Signals which abandon a request when sent to the waiting process. Any other
+// signal (SIGALRM, SIGCHLD, SIGWINCH, ...) is delivered once the request is
+// done: processes rarely retry an open() or stat() that fails with EINTR.
+static const uint32_t ProcessTerminatingSignals =
+    sigmask(SIGKILL) | sigmask(SIGTERM) | sigmask(SIGINT) | sigmask(SIGHUP) | sigmask(SIGQUIT);
+// Once another signal is pending, interruptible sleeps return straight away, so
+// waits poll for the terminating ones at this interval instead
+static const uint64_t TerminatingSignalPollIntervalNanoseconds = 100000000ull;
+
+struct PrefetchHintRecord
+{
+    vnode_t directory;
+    uint32_t directoryVid;
+    uint64_t sentNanoseconds;
+};
+
+// Token buckets for the processes causing hydration and enumeration requests in
+// roots with a rate limit (ProviderSelector_SetRequestRateLimit), in a set-associative
+// table indexed by a hash of root index and pid. A process without a bucket takes
+// over one that has filled up again, so the table only has to hold the processes
+// currently making requests. If every bucket in its set is still in use, it takes
+// over the fullest one together with its tokens: starting it out with a full bucket
+// would let processes that keep evicting each other escape the limit. Must be
+// powers of 2.
+static const uint32_t RequestRateBucketCount = 256;
+static const uint32_t RequestRateBucketWays = 4;
+static const uint32_t RequestRateBucketLockStripes = 16;
+
+struct RequestRateBucket
+{
+    int32_t rootIndex;
+    int pid;
+    // The tokens are tracked as the time at which the bucket will be full again:
+    // each request moves it one token interval later, and may go ahead while that
+    // leaves it less than the bucket's size in intervals ahead of the current time.
+    uint64_t fullNanoseconds;
+};
+
+// What the kext decides by itself, without asking the provider, about vnode
+// actions in a root by processes other than its provider. Actions with any of the deniedWriteActions bits are denied
+// (unless they only ask whether access would be allowed, KAUTH_VNODE_ACCESS);
+// if denyUnlessAllowed is set, so are actions with none of the allowedActions
+// bits. Anything not denied is passed on to the provider, if there is one, and
+// otherwise deferred.
+struct VnodeAccessPolicy
+{
+    kauth_action_t  deniedWriteActions;
+    bool            denyUnlessAllowed;
+    kauth_action_t  allowedActions;
+};
+
+enum RootAccessState
+{
+    RootAccessState_Online,
+    // Online, with ProviderRoot_ReadOnly
+    RootAccessState_ReadOnly,
+    RootAccessState_Offline,
+    
+    RootAccessState_Count
+};
+
+// Index into a row of s_vnodeAccessPolicies, see GetVnodeAccessPolicy()
+enum VnodeAccessKind
+{
+    VnodeAccessKind_HydratedFile,
+    VnodeAccessKind_HydratedDirectory,
+    VnodeAccessKind_EmptyFile,
+    VnodeAccessKind_EmptyDirectory,
+    
+    VnodeAccessKind_Count
+};
+
+// Empty file placeholders already have their final size and mode, so reading
+// their attributes (stat, ls -l, find, make) doesn't need the contents. Attribute
+// writes still hydrate, so that e.g. a new modification time isn't overwritten
+// by a later hydration.
+static const kauth_action_t EmptyFileHydratingActions =
+    KAUTH_VNODE_WRITE_ATTRIBUTES |
+    KAUTH_VNODE_WRITE_EXTATTRIBUTES |
+    KAUTH_VNODE_READ_DATA |
+    KAUTH_VNODE_WRITE_DATA |
+    KAUTH_VNODE_EXECUTE;
+
+// Lookups need a directory's children to exist, but kauth doesn't say which
+// child is being looked up, so searching an empty directory enumerates all of
+// it. With ProviderRoot_AttributeOnlyDirectoryReads, reading its attributes
+// doesn't.
+static const kauth_action_t EmptyDirectoryEnumeratingActions =
+    KAUTH_VNODE_LIST_DIRECTORY |
+    KAUTH_VNODE_SEARCH;
+static const kauth_action_t EmptyDirectoryAttributeReadActions =
+    KAUTH_VNODE_READ_SECURITY |
+    KAUTH_VNODE_READ_ATTRIBUTES |
+    KAUTH_VNODE_READ_EXTATTRIBUTES;
+
+static const kauth_action_t OfflineDeniedWriteActions =
+    KAUTH_VNODE_WRITE_ATTRIBUTES |
+    KAUTH_VNODE_WRITE_EXTATTRIBUTES |
+    KAUTH_VNODE_WRITE_DATA |
+    KAUTH_VNODE_APPEND_DATA |
+    KAUTH_VNODE_WRITE_SECURITY |
+    KAUTH_VNODE_LINKTARGET;
+// Read-only roots don't allow deletions either. Creating and renaming into a
+// directory need KAUTH_VNODE_ADD_FILE/ADD_SUBDIRECTORY, which are the same bits
+// as WRITE_DATA/APPEND_DATA, and renaming away needs DELETE.
+static const kauth_action_t ReadOnlyDeniedWriteActions =
+    OfflineDeniedWriteActions | KAUTH_VNODE_DELETE | KAUTH_VNODE_DELETE_CHILD;
+// Empty placeholders in an offline root may only be queried or deleted
+static const kauth_action_t OfflineEmptyFileAllowedActions =
+    KAUTH_VNODE_ACCESS | KAUTH_VNODE_DELETE_CHILD | KAUTH_VNODE_DELETE |
+    KAUTH_VNODE_READ_ATTRIBUTES | KAUTH_VNODE_READ_EXTATTRIBUTES | KAUTH_VNODE_READ_SECURITY;
+// Empty directories may additionally have their contents listed/searched
+// (otherwise rm -r doesn't work)
+static const kauth_action_t OfflineEmptyDirectoryAllowedActions =
+    OfflineEmptyFileAllowedActions | KAUTH_VNODE_LIST_DIRECTORY | KAUTH_VNODE_SEARCH;
+
+// Read-only roots pass reads on to the provider as usual. Offline roots allow
+// read-only access to hydrated files, deny any writes except deletions, and
+// prevent most read accesses to empty files.
+static const VnodeAccessPolicy s_vnodeAccessPolicies[RootAccessState_Count][VnodeAccessKind_Count] =
+{
+    [RootAccessState_Online] = {},
+    [RootAccessState_ReadOnly] =
+    {
+        [VnodeAccessKind_HydratedFile]      = { ReadOnlyDeniedWriteActions, false, 0 },
+        [VnodeAccessKind_HydratedDirectory] = { ReadOnlyDeniedWriteActions, false, 0 },
+        [VnodeAccessKind_EmptyFile]         = { ReadOnlyDeniedWriteActions, false, 0 },
+        [VnodeAccessKind_EmptyDirectory]    = { ReadOnlyDeniedWriteActions, false, 0 },
+    },
+    [RootAccessState_Offline] =
+    {
+        [VnodeAccessKind_HydratedFile]      = { OfflineDeniedWriteActions, false, 0 },
+        [VnodeAccessKind_HydratedDirectory] = { OfflineDeniedWriteActions, false, 0 },
+        [VnodeAccessKind_EmptyFile]         = { OfflineDeniedWriteActions, true, OfflineEmptyFileAllowedActions },
+        [VnodeAccessKind_EmptyDirectory]    = { OfflineDeniedWriteActions, true, OfflineEmptyDirectoryAllowedActions },
+    },
+};
+
+static RootAccessState GetRootAccessState(const VirtualizationRoot* root);
+static const VnodeAccessPolicy& GetVnodeAccessPolicy(RootAccessState rootState, bool vnodeIsDir, bool vnodeIsEmpty);
+static bool VnodeAccessPolicyDenies(const VnodeAccessPolicy& policy, kauth_action_t action);
+static void LogAccessDenied(VirtualizationRoot* root, RootAccessState rootState, const vnode_t vnode, kauth_action_t action, int pid, const char* procname, bool vnodeIsDir, bool vnodeIsEmpty);
+
+// Denials are logged at most once per interval per root, so that a tool
+// retrying against an offline root doesn't also keep the kext busy logging.
+// The ones in between are counted and reported with the next logged one.
+static const uint64_t AccessDeniedLogIntervalNanoseconds = 1000000000ull;
+
 // State
 static kauth_listener_t s_vnodeListener = nullptr;
+static kauth_listener_t s_fileOpListener = nullptr;
 
-static LIST_HEAD(OutstandingMessage_Head, OutstandingMessage) s_outstandingMessages = LIST_HEAD_INITIALIZER(OutstandingMessage_Head);
-static Mutex s_outstandingMessagesMutex = {};
-static volatile int s_nextMessageId;
+static OutstandingMessageShard s_outstandingMessageShards[OutstandingMessageShardCount] = {};
+static volatile SInt64 s_nextMessageSequenceNumber;
 
 static atomic_int s_numActiveKauthEvents;
 static volatile bool s_isShuttingDown;
 
+// Protects the following prefetch hint rate limiting state
+static Mutex s_prefetchHintMutex = {};
+static PrefetchHintRecord s_prefetchHintRecords[PrefetchHintRecordCount] = {};
+static uint64_t s_prefetchHintWindowStartNanoseconds;
+static uint32_t s_prefetchHintWindowCount;
+
+// Protects the pending overwrite table. The count of occupied entries (which
+// may include some whose vnode has been recycled since) lets file opens skip it.
+static Mutex s_pendingOverwriteMutex = {};
+static PendingOverwrite s_pendingOverwrites[PendingOverwriteCount] = {};
+static atomic_int s_pendingOverwriteCount;
+
+static RequestRateBucket s_requestRateBuckets[RequestRateBucketCount] = {};
+static Mutex s_requestRateBucketLocks[RequestRateBucketLockStripes] = {};
+
+// Spinning for a response only helps if the provider can run meanwhile
+static bool s_spinWaitForResponses;
+
 // Public functions
 kern_return_t KauthHandler_Init()
 {
@@ -76,17 +366,76 @@ kern_return_t KauthHandler_Init()
         goto CleanupAndFail;
     }
     
-    LIST_INIT(&s_outstandingMessages);
-    s_nextMessageId = 1;
+    s_nextMessageSequenceNumber = 1;
     
     s_isShuttingDown = false;
     
-    s_outstandingMessagesMutex = Mutex_Alloc();
-    if (!Mutex_IsValid(s_outstandingMessagesMutex))
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
+    {
+        OutstandingMessageShard& shard = s_outstandingMessageShards[i];
+        shard.mutex = Mutex_Alloc(LockProfile_OutstandingMessages);
+        if (!Mutex_IsValid(shard.mutex))
+        {
+            goto CleanupAndFail;
+        }
+        
+        for (uint32_t bucket = 0; bucket < OutstandingMessageBucketsPerShard; ++bucket)
+        {
+            LIST_INIT(&shard.buckets[bucket]);
+            LIST_INIT(&shard.vnodeBuckets[bucket]);
+        }
+    }
+    
+    s_prefetchHintMutex = Mutex_Alloc(LockProfile_PrefetchHints);
+    if (!Mutex_IsValid(s_prefetchHintMutex))
+    {
+        goto CleanupAndFail;
+    }
+    
+    memset(s_prefetchHintRecords, 0, sizeof(s_prefetchHintRecords));
+    s_prefetchHintWindowStartNanoseconds = 0;
+    s_prefetchHintWindowCount = 0;
+    
+    s_pendingOverwriteMutex = Mutex_Alloc(LockProfile_PendingOverwrites);
+    if (!Mutex_IsValid(s_pendingOverwriteMutex))
     {
         goto CleanupAndFail;
     }
+    
+    memset(s_pendingOverwrites, 0, sizeof(s_pendingOverwrites));
+    atomic_store(&s_pendingOverwriteCount, 0);
+    
+    for (uint32_t i = 0; i < RequestRateBucketLockStripes; ++i)
+    {
+        s_requestRateBucketLocks[i] = Mutex_Alloc(LockProfile_RequestRateLimits);
+        if (!Mutex_IsValid(s_requestRateBucketLocks[i]))
+        {
+            goto CleanupAndFail;
+        }
+    }
+    
+    for (uint32_t i = 0; i < RequestRateBucketCount; ++i)
+    {
+        s_requestRateBuckets[i] = RequestRateBucket { -1, 0, 0 };
+    }
+    
+    s_spinWaitForResponses = GetActiveCpuCount() > 1;
         
+    if (VnodeCache_Init())
+    {
+        goto CleanupAndFail;
+    }
+    
+    if (ProcessPolicy_Init())
+    {
+        goto CleanupAndFail;
+    }
+    
+    if (ProcessAttribution_Init())
+    {
+        goto CleanupAndFail;
+    }
+    
     if (VirtualizationRoots_Init())
     {
         goto CleanupAndFail;
@@ -98,6 +447,12 @@ kern_return_t KauthHandler_Init()
         goto CleanupAndFail;
     }
     
+    s_fileOpListener = kauth_listen_scope(KAUTH_SCOPE_FILEOP, HandleFileOpOperation, nullptr);
+    if (nullptr == s_fileOpListener)
+    {
+        goto CleanupAndFail;
+    }
+    
     return KERN_SUCCESS;
     
 CleanupAndFail:
@@ -119,6 +474,16 @@ kern_return_t KauthHandler_Cleanup()
     {
         result = KERN_FAILURE;
     }
+    
+    if (nullptr != s_fileOpListener)
+    {
+        kauth_unlisten_scope(s_fileOpListener);
+        s_fileOpListener = nullptr;
+    }
+    else
+    {
+        result = KERN_FAILURE;
+    }
 
     // Then, ensure there are no more callbacks in flight.
     AbortAllOutstandingEvents();
@@ -127,21 +492,70 @@ kern_return_t KauthHandler_Cleanup()
     {
         result = KERN_FAILURE;
     }
+    
+    if (VnodeCache_Cleanup())
+    {
+        result = KERN_FAILURE;
+    }
+    
+    if (ProcessPolicy_Cleanup())
+    {
+        result = KERN_FAILURE;
+    }
+    
+    if (ProcessAttribution_Cleanup())
+    {
+        result = KERN_FAILURE;
+    }
         
-    if (Mutex_IsValid(s_outstandingMessagesMutex))
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
+    {
+        OutstandingMessageShard& shard = s_outstandingMessageShards[i];
+        if (Mutex_IsValid(shard.mutex))
+        {
+            Mutex_FreeMemory(&shard.mutex);
+        }
+        else
+        {
+            result = KERN_FAILURE;
+        }
+    }
+    
+    if (Mutex_IsValid(s_prefetchHintMutex))
     {
-        Mutex_FreeMemory(&s_outstandingMessagesMutex);
+        Mutex_FreeMemory(&s_prefetchHintMutex);
     }
     else
     {
         result = KERN_FAILURE;
     }
     
+    if (Mutex_IsValid(s_pendingOverwriteMutex))
+    {
+        Mutex_FreeMemory(&s_pendingOverwriteMutex);
+    }
+    else
+    {
+        result = KERN_FAILURE;
+    }
+    
+    for (uint32_t i = 0; i < RequestRateBucketLockStripes; ++i)
+    {
+        if (Mutex_IsValid(s_requestRateBucketLocks[i]))
+        {
+            Mutex_FreeMemory(&s_requestRateBucketLocks[i]);
+        }
+        else
+        {
+            result = KERN_FAILURE;
+        }
+    }
+    
     return result;
 }
 
 // Private functions
-static int HandleVnodeOperation(
+KEXT_STATIC int HandleVnodeOperation(
     kauth_cred_t    credential,
     void*           idata,
     kauth_action_t  action,
@@ -151,6 +565,7 @@ static int HandleVnodeOperation(
     uintptr_t       arg3)
 {
     atomic_fetch_add(&s_numActiveKauthEvents, 1);
+    KextLog_SignpostStart(PrjFSSignpost_HandleVnodeOperation, action, 0);
 
     int kauthResult = KAUTH_RESULT_DEFER;
     
@@ -158,8 +573,8 @@ static int HandleVnodeOperation(
     vtype vnodeType;
     char procname[MAXCOMLEN + 1];
     VirtualizationRoot* root = nullptr;
-    int16_t rootIndex;
     uint32_t currentVnodeFileFlags;
+    uint32_t processPolicyFlags = ProcessPolicy_None;
     
     vfs_context_t context = reinterpret_cast<vfs_context_t>(arg0);
     vnode_t currentVnode =  reinterpret_cast<vnode_t>(arg1);
@@ -181,7 +596,19 @@ static int HandleVnodeOperation(
     
     pid = GetPid(context);
     
-    currentVnodeFileFlags = ReadVNodeFileFlags(currentVnode, context);
+    if (VDIR == vnodeType && ActionBitIsSet(action, KAUTH_VNODE_WRITE_EXTATTRIBUTES))
+    {
+        // The directory may be about to become a virtualization root
+        // (PrjFS_ConvertDirectoryToVirtualizationRoot sets the root xattr).
+        VnodeCache_InvalidateKnownNonRoot(currentVnode);
+    }
+    
+    // Cached flags are dropped once they have changed: after the provider's
+    // response to a request, or when it reports a change it made by itself
+    // (ProviderSelector_FileFlagsChanged). Authorizing a change is too early,
+    // the old flags could be cached again before it lands.
+    currentVnodeFileFlags = ReadCachedVNodeFileFlags(currentVnode, context);
+    
     if (!FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsInVirtualizationRoot))
     {
         // This vnode is not part of ANY virtualization root, so exit now before doing any more work.
@@ -198,7 +625,8 @@ static int HandleVnodeOperation(
         // This vnode is not yet hydrated, so do not allow a file system crawler to force hydration.
         // Once a vnode is hydrated, it's fine to allow crawlers to access those contents.
         
-        if (IsFileSystemCrawler(procname))
+        processPolicyFlags = ProcessPolicy_GetFlags(pid, procname);
+        if (processPolicyFlags & ProcessPolicy_DenyHydration)
         {
             // We must DENY file system crawlers rather than DEFER.
             // If we allow the crawler's access to succeed without hydrating, the kauth result will be cached and we won't
@@ -211,7 +639,6 @@ static int HandleVnodeOperation(
     }
     
     root = VirtualizationRoots_FindForVnode(currentVnode);
-    rootIndex = nullptr == root ? -1 : root->index;
     
     if (nullptr == root)
     {
@@ -220,81 +647,76 @@ static int HandleVnodeOperation(
         kauthResult = KAUTH_RESULT_DEFER;
         goto CleanupAndReturn;
     }
-    else if (nullptr == root->providerUserClient)
-    {
-        if (rootIndex >= 0)
-        {
-            bool vnodeIsDir = (vnodeType == VDIR);
-            // File/directory is within an offline virtualization root (no provider)
-            // Allow read-only access to hydrated files, deny any writes except
-            // deletions, and prevent most read accesses to empty files.
-            // Empty directories need to be read/searched in order for them to
-            // be deleted by rm -r
-            if (ActionBitsNotSet(action, KAUTH_VNODE_ACCESS)
-                && ActionBitIsSet(
-                    action,
-                    KAUTH_VNODE_WRITE_ATTRIBUTES |
-                    KAUTH_VNODE_WRITE_EXTATTRIBUTES |
-                    KAUTH_VNODE_WRITE_DATA |
-                    KAUTH_VNODE_APPEND_DATA |
-                    KAUTH_VNODE_WRITE_SECURITY |
-                    KAUTH_VNODE_LINKTARGET))
-            {
-                KextLog_FileNote(currentVnode, "HandleVnodeOperation - write action 0x%x by process %u (%s) DENIED  on %s with offline provider.", action, pid, procname, vnodeIsDir ? "directory" : "file");
-                kauthResult = KAUTH_RESULT_DENY;
-                goto CleanupAndReturn;
-            }
-            
-            if (FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
-            {
-                // Empty files/directories with offline provider may only be queried or deleted
-                if (ActionBitIsSet(action, (KAUTH_VNODE_ACCESS | KAUTH_VNODE_DELETE_CHILD | KAUTH_VNODE_DELETE | KAUTH_VNODE_READ_EXTATTRIBUTES)))
-                {
-                    kauthResult = KAUTH_RESULT_DEFER;
-                    goto CleanupAndReturn;
-                }
-                
-                // Empty directories may additionally have their attributes and security read, and contents listed/searched (otherwise rm -r doesn't work)
-                if (vnodeIsDir && ActionBitIsSet(action, (KAUTH_VNODE_READ_ATTRIBUTES | KAUTH_VNODE_READ_SECURITY | KAUTH_VNODE_LIST_DIRECTORY | KAUTH_VNODE_SEARCH)))
-                {
-                    kauthResult = KAUTH_RESULT_DEFER;
-                    goto CleanupAndReturn;
-                }
-                
-                // Disallow any other operations on empty placeholders
-                KextLog_FileNote(currentVnode, "HandleVnodeOperation - action 0x%x by process %u (%s) DENIED on empty %s with offline provider.", action, pid, procname, vnodeIsDir ? "directory" : "file");
-                kauthResult = KAUTH_RESULT_DENY;
-                goto CleanupAndReturn;
-            }
-        }
-        
+    
+    atomic_fetch_add(&root->requestStats.kauthCallbackCount, 1);
+    
+    // If the calling process is the provider, or one of its helpers, we must exit right away to avoid deadlocks.
+    // The provider is also exempt from the access policy, e.g. to hydrate files in a read-only root.
+    if (VirtualizationRoot_IsProviderProcess(root, pid, context))
+    {
+        atomic_fetch_add(&root->requestStats.providerPidDeferCount, 1);
         kauthResult = KAUTH_RESULT_DEFER;
         goto CleanupAndReturn;
     }
     
-    // If the calling process is the provider, we must exit right away to avoid deadlocks
-    if (pid == root->providerPid)
     {
-        kauthResult = KAUTH_RESULT_DEFER;
-        goto CleanupAndReturn;
+        RootAccessState rootState = GetRootAccessState(root);
+        bool vnodeIsDir = (VDIR == vnodeType);
+        bool vnodeIsEmpty = FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty);
+        if (VnodeAccessPolicyDenies(GetVnodeAccessPolicy(rootState, vnodeIsDir, vnodeIsEmpty), action))
+        {
+            LogAccessDenied(root, rootState, currentVnode, action, pid, procname, vnodeIsDir, vnodeIsEmpty);
+            kauthResult = KAUTH_RESULT_DENY;
+            goto CleanupAndReturn;
+        }
+        
+        if (RootAccessState_Offline == rootState)
+        {
+            kauthResult = KAUTH_RESULT_DEFER;
+            goto CleanupAndReturn;
+        }
+    }
+    
+    if (ActionBitIsSet(action, KAUTH_VNODE_DELETE) &&
+        VirtualizationRoot_MayWantNotification(root, ProviderNotification_PreDelete))
+    {
+        // The provider may veto the deletion by failing the notification
+        if (!TrySendRequestAndWaitForResponse(
+                root,
+                VDIR == vnodeType ? MessageType_KtoU_NotifyDirectoryPreDelete : MessageType_KtoU_NotifyFilePreDelete,
+                currentVnode,
+                context,
+                pid,
+                procname,
+                &kauthResult,
+                kauthError))
+        {
+            goto CleanupAndReturn;
+        }
     }
     
     if (VDIR == vnodeType)
     {
-        if (ActionBitIsSet(
-                action,
-                KAUTH_VNODE_LIST_DIRECTORY |
-                KAUTH_VNODE_SEARCH |
-                KAUTH_VNODE_READ_SECURITY |
-                KAUTH_VNODE_READ_ATTRIBUTES |
-                KAUTH_VNODE_READ_EXTATTRIBUTES))
+        kauth_action_t enumeratingActions =
+            (root->providerRootFlags & ProviderRoot_AttributeOnlyDirectoryReads)
+            ? EmptyDirectoryEnumeratingActions
+            : EmptyDirectoryEnumeratingActions | EmptyDirectoryAttributeReadActions;
+        if (ActionBitIsSet(action, enumeratingActions))
         {
             if (FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
             {
+                if (!TryAcquireRequestToken(root, pid, &kauthResult, kauthError))
+                {
+                    goto CleanupAndReturn;
+                }
+                
                 if (!TrySendRequestAndWaitForResponse(
                         root,
-                        MessageType_KtoU_EnumerateDirectory,
+                        (processPolicyFlags & ProcessPolicy_EnumerateRecursively)
+                        ? MessageType_KtoU_EnumerateDirectoryRecursively
+                        : MessageType_KtoU_EnumerateDirectory,
                         currentVnode,
+                        context,
                         pid,
                         procname,
                         &kauthResult,
@@ -307,22 +729,48 @@ static int HandleVnodeOperation(
     }
     else
     {
-        if (ActionBitIsSet(
-                action,
-                KAUTH_VNODE_READ_ATTRIBUTES |
-                KAUTH_VNODE_WRITE_ATTRIBUTES |
-                KAUTH_VNODE_READ_EXTATTRIBUTES |
-                KAUTH_VNODE_WRITE_EXTATTRIBUTES |
-                KAUTH_VNODE_READ_DATA |
-                KAUTH_VNODE_WRITE_DATA |
-                KAUTH_VNODE_EXECUTE))
+        if (ActionBitIsSet(action, EmptyFileHydratingActions))
         {
             if (FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
             {
+                // An open for writing only needs no contents if it truncates the file,
+                // but kauth doesn't tell, and once the open has happened it can't be
+                // denied any more. So only a file without contents, whose conversion
+                // at that point can't lose any data, waits for the open (see
+                // HandleFileOpOperation); any other is hydrated here, as usual.
+                if ((root->providerRootFlags & ProviderRoot_SkipOverwriteHydration) &&
+                    KAUTH_VNODE_WRITE_DATA == (action & EmptyFileHydratingActions) &&
+                    FileIsZeroBytes(currentVnode, context) &&
+                    TryAddPendingOverwrite(currentVnode))
+                {
+                    kauthResult = KAUTH_RESULT_DEFER;
+                    goto CleanupAndReturn;
+                }
+                
+                // Any other access to a file whose open is still pending, e.g. after
+                // truncate(2), settles it the same way. It stays pending until that
+                // has succeeded.
+                bool isPendingOverwrite = IsPendingOverwrite(currentVnode);
+                MessageType messageType =
+                    isPendingOverwrite
+                    ? MessageType_KtoU_ConvertFileToFull
+                    : MessageType_KtoU_HydrateFile;
+                
+                if (!TryAcquireRequestToken(root, pid, &kauthResult, kauthError))
+                {
+                    goto CleanupAndReturn;
+                }
+                
+                if (MessageType_KtoU_HydrateFile == messageType && 0 != root->prefetchHintIntervalMilliseconds)
+                {
+                    SendPrefetchHintIfDue(root, currentVnode, context, pid, procname);
+                }
+                
                 if (!TrySendRequestAndWaitForResponse(
                         root,
-                        MessageType_KtoU_HydrateFile,
+                        messageType,
                         currentVnode,
+                        context,
                         pid,
                         procname,
                         &kauthResult,
@@ -330,147 +778,1323 @@ static int HandleVnodeOperation(
                 {
                     goto CleanupAndReturn;
                 }
+                
+                if (isPendingOverwrite)
+                {
+                    RemovePendingOverwrite(currentVnode);
+                }
             }
         }
     }
     
 CleanupAndReturn:
+    KextLog_SignpostEnd(PrjFSSignpost_HandleVnodeOperation, action, kauthResult);
     atomic_fetch_sub(&s_numActiveKauthEvents, 1);
     return kauthResult;
 }
 
-void KauthHandler_HandleKernelMessageResponse(uint64_t messageId, MessageType responseType)
-{
-    switch (responseType)
-    {
-        case MessageType_Response_Success:
-        case MessageType_Response_Fail:
-        {
-            Mutex_Acquire(s_outstandingMessagesMutex);
-            {
-                OutstandingMessage* outstandingMessage;
-                LIST_FOREACH(outstandingMessage, &s_outstandingMessages, _list_privates)
-                {
-                    if (outstandingMessage->request.messageId == messageId)
-                    {
-                        // Save the response for the blocked thread.
-                        outstandingMessage->response = responseType;
-                        outstandingMessage->receivedResponse = true;
-                        
-                        wakeup(outstandingMessage);
-                        
-                        break;
-                    }
-                }
-            }
-            Mutex_Release(s_outstandingMessagesMutex);
-            
-        }
-    }
-    
-    return;
-}
-
-static bool TrySendRequestAndWaitForResponse(
-    const VirtualizationRoot* root,
-    MessageType messageType,
-    const vnode_t vnode,
-    int pid,
-    const char* procname,
-    int* kauthResult,
-    int* kauthError)
+// Only used for notifications, the result of file operation callbacks is ignored.
+KEXT_STATIC int HandleFileOpOperation(
+    kauth_cred_t    credential,
+    void*           idata,
+    kauth_action_t  action,
+    uintptr_t       arg0,
+    uintptr_t       arg1,
+    uintptr_t       arg2,
+    uintptr_t       arg3)
 {
-    bool result = false;
-    
-    OutstandingMessage message;
-    message.receivedResponse = false;
-    
-    char vnodePath[PrjFSMaxPath];
-    int vnodePathLength = PrjFSMaxPath;
-    if (vn_getpath(vnode, vnodePath, &vnodePathLength))
-    {
-        KextLog_Error("Unable to resolve a vnode to its path");
-        *kauthResult = KAUTH_RESULT_DENY;
-        return false;
-    }
+    atomic_fetch_add(&s_numActiveKauthEvents, 1);
     
-    const char* relativePath = GetRelativePath(vnodePath, root->path);
+    vfs_context_t context = nullptr;
+    vnode_t currentVnode = NULLVP;
+    bool putVnode = false;
+    const char* path = nullptr;
+    const char* fromPath = nullptr;
+    int closeFlags = 0;
     
-    int nextMessageId = OSIncrementAtomic(&s_nextMessageId);
+    int pid;
+    vtype vnodeType;
+    char procname[MAXCOMLEN + 1];
+    uint32_t currentVnodeFileFlags;
+    bool isInVirtualizationRoot;
+    VirtualizationRoot* root = nullptr;
+    MessageType messageType;
     
-    Message messageSpec = {};
-    Message_Init(&messageSpec, &(message.request), nextMessageId, messageType, pid, procname, relativePath);
-
-    bool isShuttingDown = false;
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    // Opens and closes of files outside of any root are by far the most common
+    // operations, so rule out as much as possible before looking at the vnode.
+    // Opens only matter while some empty file's open for writing is pending.
+    // Renames matter whenever there are roots, see below.
+    if (KAUTH_FILEOP_OPEN == action)
     {
-        // Only read s_isShuttingDown once so we either insert & send message, or neither.
-        isShuttingDown = s_isShuttingDown;
-        if (!isShuttingDown)
+        if (0 == atomic_load(&s_pendingOverwriteCount))
         {
-            LIST_INSERT_HEAD(&s_outstandingMessages, &message, _list_privates);
+            goto CleanupAndReturn;
+        }
+    }
+    else if (KAUTH_FILEOP_RENAME == action)
+    {
+        if (!VirtualizationRoots_AnyExist())
+        {
+            goto CleanupAndReturn;
+        }
+    }
+    else if (KAUTH_FILEOP_RENAME != action && !VirtualizationRoots_AnyWantNotifications())
+    {
+        goto CleanupAndReturn;
+    }
+    
+    switch (action)
+    {
+    case KAUTH_FILEOP_OPEN:
+        currentVnode = reinterpret_cast<vnode_t>(arg0);
+        path = reinterpret_cast<const char*>(arg1);
+        break;
+    case KAUTH_FILEOP_CLOSE:
+        currentVnode = reinterpret_cast<vnode_t>(arg0);
+        path = reinterpret_cast<const char*>(arg1);
+        closeFlags = static_cast<int>(arg2);
+        break;
+    case KAUTH_FILEOP_DELETE:
+        currentVnode = reinterpret_cast<vnode_t>(arg0);
+        path = reinterpret_cast<const char*>(arg1);
+        break;
+    case KAUTH_FILEOP_RENAME:
+        fromPath = reinterpret_cast<const char*>(arg0);
+        path = reinterpret_cast<const char*>(arg1);
+        
+        // Anything else neither moves into or out of a root nor is reported,
+        // so the roots cached for it stay valid
+        if (!VirtualizationRoots_PathIsInOrAboveAnyRoot(fromPath) &&
+            !VirtualizationRoots_PathIsInOrAboveAnyRoot(path))
+        {
+            goto CleanupAndReturn;
+        }
+        
+        break;
+    default:
+        goto CleanupAndReturn;
+    }
+    
+    context = vfs_context_create(nullptr);
+    
+    if (KAUTH_FILEOP_RENAME == action)
+    {
+        // Renames only pass paths, the item is now at the destination
+        if (0 != vnode_lookup(path, 0 /* flags */, &currentVnode, context))
+        {
+            // Already gone again; it may have been a directory
+            VirtualizationRoots_HandleDirectoryRenamed();
+            goto CleanupAndReturn;
+        }
+        
+        putVnode = true;
+        
+        // The roots cached for the directory's subtree may be wrong now, whether
+        // or not anyone wants to be told about the rename
+        if (vnode_isdir(currentVnode))
+        {
+            VirtualizationRoots_HandleDirectoryRenamed();
+        }
+        
+        if (!VirtualizationRoots_AnyWantNotifications())
+        {
+            goto CleanupAndReturn;
+        }
+    }
+    
+    if (!VirtualizationRoot_VnodeIsOnAllowedFilesystem(currentVnode))
+    {
+        goto CleanupAndReturn;
+    }
+    
+    vnodeType = vnode_vtype(currentVnode);
+    if (ShouldIgnoreVnodeType(vnodeType, currentVnode))
+    {
+        goto CleanupAndReturn;
+    }
+    
+    currentVnodeFileFlags = ReadCachedVNodeFileFlags(currentVnode, context);
+    isInVirtualizationRoot = FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsInVirtualizationRoot);
+    
+    switch (action)
+    {
+    case KAUTH_FILEOP_OPEN:
+        if (VREG != vnodeType || !FileFlagsBitIsSet(currentVnodeFileFlags, FileFlags_IsEmpty))
+        {
+            goto CleanupAndReturn;
+        }
+        
+        // Settled below, once it's clear the provider isn't the one opening it
+        messageType = MessageType_KtoU_HydrateFile;
+        break;
+    case KAUTH_FILEOP_CLOSE:
+        if (VREG != vnodeType)
+        {
+            goto CleanupAndReturn;
+        }
+        
+        // Files created below a root don't have the flag until the provider
+        // has been told about them and set it.
+        if (!isInVirtualizationRoot)
+        {
+            messageType = MessageType_KtoU_NotifyFileCreated;
+        }
+        else if (closeFlags & KAUTH_FILEOP_CLOSE_MODIFIED)
+        {
+            messageType = MessageType_KtoU_NotifyFileModified;
+        }
+        else
+        {
+            goto CleanupAndReturn;
+        }
+        
+        break;
+    case KAUTH_FILEOP_DELETE:
+        if (VDIR == vnodeType || !isInVirtualizationRoot)
+        {
+            goto CleanupAndReturn;
+        }
+        
+        messageType = MessageType_KtoU_NotifyFileDeleted;
+        break;
+    default:
+        assert(KAUTH_FILEOP_RENAME == action);
+        messageType = VDIR == vnodeType ? MessageType_KtoU_NotifyDirectoryRenamed : MessageType_KtoU_NotifyFileRenamed;
+        break;
+    }
+    
+    root = VirtualizationRoots_FindForVnode(currentVnode);
+    if (nullptr == root ||
+        nullptr == root->providerUserClient ||
+        (KAUTH_FILEOP_OPEN != action &&
+         !VirtualizationRoot_MayWantNotification(root, NotificationFlagForMessageType(messageType) | ProviderNotification_RecordModifiedFile)))
+    {
+        goto CleanupAndReturn;
+    }
+    
+    pid = GetPid(context);
+    if (VirtualizationRoot_IsProviderProcess(root, pid, context))
+    {
+        // The provider knows what it is doing itself
+        goto CleanupAndReturn;
+    }
+    
+    if (KAUTH_FILEOP_OPEN == action)
+    {
+        if (IsPendingOverwrite(currentVnode))
+        {
+            // Only files without contents are pending, so there's nothing to fetch.
+            // If the conversion fails, the file stays pending: its next access
+            // converts it too, rather than hydrating it over what the process
+            // writes meanwhile.
+            int kauthResult = KAUTH_RESULT_DEFER;
+            int kauthError = 0;
+            proc_name(pid, procname, sizeof(procname));
+            if (TrySendRequestAndWaitForResponse(
+                    root,
+                    MessageType_KtoU_ConvertFileToFull,
+                    currentVnode,
+                    context,
+                    pid,
+                    procname,
+                    &kauthResult,
+                    &kauthError))
+            {
+                RemovePendingOverwrite(currentVnode);
+            }
+            else
+            {
+                KextLog_FileError(currentVnode, "HandleFileOpOperation: provider failed to convert file opened for writing, error %d", kauthError);
+                
+                // xnu may have cached the write right granted to the open
+                UncacheAuthorizedActions(currentVnode);
+            }
+        }
+        
+        goto CleanupAndReturn;
+    }
+    
+    if (KAUTH_FILEOP_CLOSE == action && (closeFlags & KAUTH_FILEOP_CLOSE_MODIFIED) &&
+        VirtualizationRoot_MayWantNotification(root, ProviderNotification_RecordModifiedFile))
+    {
+        RecordModifiedFile(root, currentVnode, context, path);
+    }
+    
+    if (!VirtualizationRoot_MayWantNotification(root, NotificationFlagForMessageType(messageType)))
+    {
+        goto CleanupAndReturn;
+    }
+    
+    proc_name(pid, procname, sizeof(procname));
+    
+    // Nothing waits for the provider, not even to mark a new file as part of
+    // the root: until it has, further closes just report the file as created again.
+    SendNotification(root, messageType, currentVnode, context, pid, procname, path, fromPath);
+    
+CleanupAndReturn:
+    if (putVnode)
+    {
+        vnode_put(currentVnode);
+    }
+    
+    if (nullptr != context)
+    {
+        vfs_context_rele(context);
+    }
+    
+    atomic_fetch_sub(&s_numActiveKauthEvents, 1);
+    return KAUTH_RESULT_DEFER;
+}
+
+void KauthHandler_HandleKernelMessageResponse(uint64_t messageId, MessageType responseType)
+{
+    switch (responseType)
+    {
+        case MessageType_Response_Success:
+        case MessageType_Response_Fail:
+        {
+            OutstandingMessageShard& shard = GetOutstandingMessageShard(messageId);
+            Mutex_Acquire(shard.mutex);
+            {
+                OutstandingMessage* outstandingMessage;
+                LIST_FOREACH(outstandingMessage, GetOutstandingMessageBucket_Locked(shard, messageId), _list_privates)
+                {
+                    if (outstandingMessage->request.messageId == messageId)
+                    {
+                        // Save the response for the blocked threads. Any later request
+                        // for the vnode needs to check its state again, so stop others
+                        // from attaching to this message.
+                        outstandingMessage->response = responseType;
+                        outstandingMessage->receivedResponse = true;
+                        UnlinkMessage_Locked(outstandingMessage);
+                        
+                        wakeup(outstandingMessage);
+                        
+                        break;
+                    }
+                }
+            }
+            Mutex_Release(shard.mutex);
+            
+            break;
+        }
+        
+        case MessageType_Response_Progress:
+        {
+            uint64_t nowNanoseconds = GetUptimeNanoseconds();
+            OutstandingMessageShard& shard = GetOutstandingMessageShard(messageId);
+            Mutex_Acquire(shard.mutex);
+            {
+                OutstandingMessage* outstandingMessage;
+                LIST_FOREACH(outstandingMessage, GetOutstandingMessageBucket_Locked(shard, messageId), _list_privates)
+                {
+                    if (outstandingMessage->request.messageId == messageId)
+                    {
+                        // The waiters only need to move their deadline, which they do
+                        // whenever they wake up anyway
+                        outstandingMessage->lastProgressNanoseconds = nowNanoseconds;
+                        break;
+                    }
+                }
+            }
+            Mutex_Release(shard.mutex);
+            
+            break;
+        }
+        
+        default:
+            break;
+    }
+    
+    return;
+}
+
+void KauthHandler_HandleProviderDisconnect(int32_t rootIndex)
+{
+    // The root no longer has a provider, so no new requests will be sent to
+    // it; wake up everyone still waiting on the old one.
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
+    {
+        OutstandingMessageShard& shard = s_outstandingMessageShards[i];
+        Mutex_Acquire(shard.mutex);
+        {
+            for (uint32_t bucket = 0; bucket < OutstandingMessageBucketsPerShard; ++bucket)
+            {
+                OutstandingMessage* outstandingMessage;
+                LIST_FOREACH(outstandingMessage, &shard.buckets[bucket], _list_privates)
+                {
+                    if (outstandingMessage->rootIndex == rootIndex)
+                    {
+                        outstandingMessage->providerDisconnected = true;
+                        wakeup(outstandingMessage);
+                    }
+                }
+            }
+        }
+        Mutex_Release(shard.mutex);
+    }
+}
+
+void KauthHandler_HandleFileFlagsChanged(vnode_t vnode)
+{
+    // A placeholder that has become empty again must not stay covered by rights
+    // xnu cached while it had contents.
+    VnodeCache_InvalidateFileFlags(vnode);
+    UncacheAuthorizedActions(vnode);
+}
+
+static bool TrySendRequestAndWaitForResponse(
+    VirtualizationRoot* root,
+    MessageType messageType,
+    const vnode_t vnode,
+    vfs_context_t context,
+    int pid,
+    const char* procname,
+    int* kauthResult,
+    int* kauthError)
+{
+    bool result = false;
+    
+    if (!VirtualizationRoot_MaySendRequest(root))
+    {
+        // Rather than have every thread touching the root wait on a provider that
+        // has stopped responding
+        atomic_fetch_add(&root->requestStats.unresponsiveRejectedCount, 1);
+        *kauthError = ETIMEDOUT;
+        *kauthResult = KAUTH_RESULT_DENY;
+        return false;
+    }
+    
+    uint32_t vnodeHash = HashVnode(vnode);
+    uint32_t shardIndex = vnodeHash & (OutstandingMessageShardCount - 1);
+    OutstandingMessageShard& shard = s_outstandingMessageShards[shardIndex];
+    uint32_t vid = vnode_vid(vnode);
+    
+    RequestWaitOutcome waitOutcome;
+    uint64_t waitStartNanoseconds = GetUptimeNanoseconds();
+    uint64_t waitNanoseconds;
+    uint32_t spinNanoseconds;
+    
+    bool isShuttingDown = false;
+    bool sentMessage = false;
+    OutstandingMessage* message = nullptr;
+    Mutex_Acquire(shard.mutex);
+    {
+        isShuttingDown = s_isShuttingDown;
+        if (!isShuttingDown)
+        {
+            message = FindInFlightMessage_Locked(shard, vnode, vid, messageType);
+            if (nullptr != message)
+            {
+                message->waiterCount++;
+                atomic_fetch_add(&root->requestStats.coalescedWaitCount, 1);
+            }
+        }
+    }
+    Mutex_Release(shard.mutex);
+    
+    if (isShuttingDown)
+    {
+        *kauthResult = KAUTH_RESULT_DENY;
+        return false;
+    }
+    
+    if (nullptr == message)
+    {
+        // The path only needs to live until the message has been sent
+        char* vnodePath = static_cast<char*>(Memory_AllocFromZone(MemoryZone_PathBuffer));
+        if (nullptr == vnodePath)
+        {
+            *kauthResult = KAUTH_RESULT_DENY;
+            return false;
+        }
+        
+        int vnodePathLength = PrjFSMaxPath;
+        if (vn_getpath(vnode, vnodePath, &vnodePathLength))
+        {
+            KextLog_Error("Unable to resolve a vnode to its path");
+            Memory_FreeToZone(MemoryZone_PathBuffer, vnodePath);
+            *kauthResult = KAUTH_RESULT_DENY;
+            return false;
+        }
+        
+        const char* relativePath = GetRelativePath(vnodePath, root->path, root->pathLength);
+        
+        uint32_t notificationFlag = NotificationFlagForMessageType(messageType);
+        if (ProviderNotification_None != notificationFlag &&
+            0 == (VirtualizationRoot_GetNotificationFlags(root, relativePath) & notificationFlag))
+        {
+            // Not covered by the provider's notification mappings
+            atomic_fetch_add(&root->requestStats.notificationsFilteredCount, 1);
+            Memory_FreeToZone(MemoryZone_PathBuffer, vnodePath);
+            *kauthResult = KAUTH_RESULT_DEFER;
+            return true;
+        }
+        
+        OutstandingMessage* newMessage = static_cast<OutstandingMessage*>(Memory_AllocFromZone(MemoryZone_RequestRecord));
+        if (nullptr == newMessage)
+        {
+            Memory_FreeToZone(MemoryZone_PathBuffer, vnodePath);
+            *kauthResult = KAUTH_RESULT_DENY;
+            return false;
+        }
+        
+        memset(newMessage, 0, sizeof(*newMessage));
+        newMessage->rootIndex = root->index;
+        newMessage->vnode = vnode;
+        newMessage->vnodeVid = vid;
+        newMessage->waiterCount = 1;
+        
+        uint64_t messageId = static_cast<uint64_t>(OSIncrementAtomic64(&s_nextMessageSequenceNumber)) * OutstandingMessageShardCount + shardIndex;
+        
+        // Sent alongside the path so the provider can open the file without another
+        // lookup, and for requests about the placeholder's contents, also what it
+        // would otherwise read from the file itself before choosing how to fetch them
+        bool isPlaceholderRequest =
+            MessageType_KtoU_HydrateFile == messageType ||
+            MessageType_KtoU_EnumerateDirectory == messageType ||
+            MessageType_KtoU_EnumerateDirectoryRecursively == messageType ||
+            MessageType_KtoU_ConvertFileToFull == messageType;
+        SizeOrError fileSize = {};
+        VnodeFsidInode vnodeIds = isPlaceholderRequest ? Vnode_GetFsidInodeAndSize(vnode, context, &fileSize) : Vnode_GetFsidAndInode(vnode, context);
+        
+        Message messageSpec = {};
+        Message_Init(&messageSpec, &(newMessage->request), messageId, messageType, pid, procname, vnodeIds.fsid, vnodeIds.inode, relativePath, nullptr);
+        
+        void* fileXattr = nullptr;
+        if (isPlaceholderRequest && 0 == fileSize.error)
+        {
+            // Whatever is missing, the provider reads from the file itself
+            SizeOrError xattrResult = { 0, ENOMEM };
+            fileXattr = Memory_AllocFromZone(MemoryZone_RequestRecord);
+            if (nullptr != fileXattr)
+            {
+                xattrResult = Vnode_ReadXattr(vnode, PrjFSFileXAttrName, fileXattr, sizeof(PrjFSFileXAttrCompactData), context);
+            }
+            
+            Message_SetPlaceholderInfo(
+                &messageSpec,
+                &(newMessage->request),
+                VDIR == vnode_vtype(vnode) ? MessageFileType_Directory : MessageFileType_File,
+                fileSize.size,
+                0 == xattrResult.error ? fileXattr : nullptr,
+                static_cast<uint16_t>(xattrResult.size));
+        }
+        
+        Mutex_Acquire(shard.mutex);
+        {
+            // Only read s_isShuttingDown once so we either insert & send message, or neither.
+            isShuttingDown = s_isShuttingDown;
+            if (!isShuttingDown)
+            {
+                // Another thread may have started the same request while we were building ours
+                message = FindInFlightMessage_Locked(shard, vnode, vid, messageType);
+                if (nullptr != message)
+                {
+                    message->waiterCount++;
+                    atomic_fetch_add(&root->requestStats.coalescedWaitCount, 1);
+                }
+                else
+                {
+                    LIST_INSERT_HEAD(GetOutstandingMessageBucket_Locked(shard, messageId), newMessage, _list_privates);
+                    LIST_INSERT_HEAD(GetOutstandingMessageVnodeBucket_Locked(shard, vnode), newMessage, _vnode_list_privates);
+                    newMessage->isLinked = true;
+                }
+            }
+        }
+        Mutex_Release(shard.mutex);
+        
+        if (isShuttingDown || nullptr != message)
+        {
+            Memory_FreeToZone(MemoryZone_RequestRecord, newMessage);
+        }
+        
+        if (isShuttingDown)
+        {
+            if (nullptr != fileXattr)
+            {
+                Memory_FreeToZone(MemoryZone_RequestRecord, fileXattr);
+            }
+            
+            Memory_FreeToZone(MemoryZone_PathBuffer, vnodePath);
+            *kauthResult = KAUTH_RESULT_DENY;
+            return false;
+        }
+        
+        if (nullptr == message)
+        {
+            message = newMessage;
+            
+            errno_t sendError = ActiveProvider_SendMessage(root->index, messageSpec);
+            if (0 == sendError)
+            {
+                sentMessage = true;
+                message->isCancellable = isPlaceholderRequest;
+                KextLog_Trace(KextLog_TraceEvent_RequestSent, messageId, messageType, root->index, pid, relativePath);
+                atomic_fetch_add(
+                    MessageType_KtoU_EnumerateDirectory == messageType ||
+                    MessageType_KtoU_EnumerateDirectoryRecursively == messageType ? &root->requestStats.enumerationsSentCount :
+                    MessageType_KtoU_HydrateFile == messageType ?                   &root->requestStats.hydrationsSentCount :
+                                                                                    &root->requestStats.notificationsSentCount,
+                    1);
+            }
+            else
+            {
+                Mutex_Acquire(shard.mutex);
+                {
+                    // Anyone who attached in the meantime gives up along with us
+                    message->sendError = sendError;
+                    UnlinkMessage_Locked(message);
+                    wakeup(message);
+                }
+                Mutex_Release(shard.mutex);
+            }
+        }
+        
+        if (nullptr != fileXattr)
+        {
+            Memory_FreeToZone(MemoryZone_RequestRecord, fileXattr);
+        }
+        
+        Memory_FreeToZone(MemoryZone_PathBuffer, vnodePath);
+    }
+    
+    // Every exit from here on passes CleanupAndReturn, which ends the interval
+    KextLog_SignpostStart(PrjFSSignpost_WaitForResponse, message->request.messageId, messageType);
+    
+    // Fast providers (e.g. hydrations from a local cache) often respond sooner
+    // than a sleep and wakeup would take
+    spinNanoseconds = s_spinWaitForResponses ? VirtualizationRoot_GetResponseSpinNanoseconds(root) : 0;
+    if (0 != spinNanoseconds && SpinWaitForResponse(message, spinNanoseconds))
+    {
+        atomic_fetch_add(&root->requestStats.spinWaitResponseCount, 1);
+    }
+    
+    Mutex_Acquire(shard.mutex);
+    {
+        waitOutcome = WaitForResponse_Locked(shard, message, root, pid, waitStartNanoseconds, root->requestTimeoutMilliseconds[messageType]);
+    }
+    Mutex_Release(shard.mutex);
+    
+    if (RequestWaitOutcome_TimedOut == waitOutcome)
+    {
+        // The provider may have written the response to its ring without the
+        // doorbell getting through; collect it before giving up on the request.
+        ActiveProvider_DrainResponseRing(root->index);
+    
+        Mutex_Acquire(shard.mutex);
+        {
+            if (message->receivedResponse)
+            {
+                waitOutcome = RequestWaitOutcome_Response;
+            }
+        }
+        Mutex_Release(shard.mutex);
+    }
+    
+    if (s_isShuttingDown)
+    {
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+    
+    if (ENOBUFS == message->sendError)
+    {
+        // The provider is alive but its queue stayed full; let the caller retry
+        // rather than exposing an empty placeholder.
+        *kauthError = EAGAIN;
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+    else if (0 != message->sendError)
+    {
+        *kauthResult = KAUTH_RESULT_DEFER;
+        goto CleanupAndReturn;
+    }
+    
+    waitNanoseconds = GetUptimeNanoseconds() - waitStartNanoseconds;
+    VirtualizationRoot_RecordRequestWait(root, waitOutcome, waitNanoseconds);
+    if (sentMessage && RequestWaitOutcome_Response == waitOutcome)
+    {
+        VirtualizationRoot_RecordResponseLatency(root, waitNanoseconds);
+    }
+    
+    if (MessageType_KtoU_EnumerateDirectory == messageType ||
+        MessageType_KtoU_EnumerateDirectoryRecursively == messageType ||
+        MessageType_KtoU_HydrateFile == messageType)
+    {
+        // PrjFSLib only reports a hydration as successful once the file has the
+        // placeholder's size, which is what the request carried
+        bool hydrated =
+            sentMessage &&
+            MessageType_KtoU_HydrateFile == messageType &&
+            RequestWaitOutcome_Response == waitOutcome &&
+            MessageType_Response_Success == message->response;
+        ProcessAttribution_RecordRequest(
+            procname,
+            root->index,
+            MessageType_KtoU_HydrateFile == messageType ? MessageType_KtoU_HydrateFile : MessageType_KtoU_EnumerateDirectory,
+            sentMessage,
+            hydrated ? message->request.fileSize : 0,
+            waitNanoseconds);
+    }
+    
+    if (sentMessage)
+    {
+        KextLog_Trace(
+            KextLog_TraceEvent_RequestCompleted,
+            message->request.messageId,
+            messageType,
+            root->index,
+            RequestWaitOutcome_TimedOut == waitOutcome ?             TraceRequestOutcome_TimedOut :
+            RequestWaitOutcome_ProviderDisconnected == waitOutcome ? TraceRequestOutcome_ProviderDisconnected :
+            RequestWaitOutcome_Interrupted == waitOutcome ?          TraceRequestOutcome_Interrupted :
+            MessageType_Response_Success == message->response ?     TraceRequestOutcome_Success :
+                                                                     TraceRequestOutcome_Fail,
+            nullptr);
+    }
+    
+    if (RequestWaitOutcome_TimedOut == waitOutcome)
+    {
+        KextLog_FileError(vnode, "TrySendRequestAndWaitForResponse: provider did not respond to message type %u within %u ms", messageType, root->requestTimeoutMilliseconds[messageType]);
+        *kauthError = ETIMEDOUT;
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+    else if (RequestWaitOutcome_ProviderDisconnected == waitOutcome)
+    {
+        *kauthError = EIO;
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+    else if (RequestWaitOutcome_Interrupted == waitOutcome)
+    {
+        // Not ERESTART: a restarted syscall would just send the request again
+        *kauthError = EINTR;
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+
+    if (MessageType_Response_Success == message->response)
+    {
+        // The provider has changed the vnode's flags (cleared FileFlags_IsEmpty)
+        // before responding, so any cached flags are now stale. From now on xnu
+        // may cache the rights it grants on the vnode.
+        VnodeCache_InvalidateFileFlags(vnode);
+        UncacheAuthorizedActions(vnode);
+        
+        *kauthResult = KAUTH_RESULT_DEFER;
+        result = true;
+        goto CleanupAndReturn;
+    }
+    else
+    {
+        // Default error code is EACCES. See errno.h for more codes.
+        // Failed hydrations and enumerations may succeed when retried, but a
+        // provider vetoing a deletion should look like a permission problem.
+        if (ProviderNotification_None == NotificationFlagForMessageType(messageType))
+        {
+            *kauthError = EAGAIN;
+        }
+        
+        *kauthResult = KAUTH_RESULT_DENY;
+        goto CleanupAndReturn;
+    }
+    
+CleanupAndReturn:
+    KextLog_SignpostEnd(PrjFSSignpost_WaitForResponse, message->request.messageId, waitOutcome);
+    ReleaseMessage(shard, message, root);
+    
+    return result;
+}
+
+// Sends a notification which nothing waits for, if the provider's mappings
+// cover either of the (absolute) paths. fromPath is only set for renames.
+static void SendNotification(
+    VirtualizationRoot* root,
+    MessageType messageType,
+    const vnode_t vnode,
+    vfs_context_t context,
+    int pid,
+    const char* procname,
+    const char* path,
+    const char* fromPath)
+{
+    const char* relativePath = GetRelativePathIfWithinRoot(path, root->path, root->pathLength);
+    if (nullptr == relativePath)
+    {
+        return;
+    }
+    
+    uint32_t notificationFlags = VirtualizationRoot_GetNotificationFlags(root, relativePath);
+    
+    const char* fromRelativePath = nullptr;
+    if (nullptr != fromPath)
+    {
+        fromRelativePath = GetRelativePathIfWithinRoot(fromPath, root->path, root->pathLength);
+        if (nullptr == fromRelativePath)
+        {
+            // Moved in from outside the root
+            fromRelativePath = "";
+        }
+        else
+        {
+            notificationFlags |= VirtualizationRoot_GetNotificationFlags(root, fromRelativePath);
+        }
+    }
+    
+    if (0 == (notificationFlags & NotificationFlagForMessageType(messageType)))
+    {
+        atomic_fetch_add(&root->requestStats.notificationsFilteredCount, 1);
+        return;
+    }
+    
+    // No response is expected, so the message doesn't need an outstanding
+    // message record; its ID only has to be unique.
+    uint64_t messageId = static_cast<uint64_t>(OSIncrementAtomic64(&s_nextMessageSequenceNumber)) * OutstandingMessageShardCount;
+    VnodeFsidInode vnodeIds = Vnode_GetFsidAndInode(vnode, context);
+    
+    MessageHeader header = {};
+    Message messageSpec = {};
+    Message_Init(&messageSpec, &header, messageId, messageType, pid, procname, vnodeIds.fsid, vnodeIds.inode, relativePath, fromRelativePath);
+    
+    if (0 == ActiveProvider_SendMessage(root->index, messageSpec))
+    {
+        atomic_fetch_add(&root->requestStats.notificationsSentCount, 1);
+    }
+}
+
+// Writes are only tracked per file and drained by the provider in bulk, so
+// their cost doesn't depend on how often files are written.
+static void RecordModifiedFile(VirtualizationRoot* root, const vnode_t vnode, vfs_context_t context, const char* path)
+{
+    const char* relativePath = GetRelativePathIfWithinRoot(path, root->path, root->pathLength);
+    if (nullptr == relativePath ||
+        0 == (VirtualizationRoot_GetNotificationFlags(root, relativePath) & ProviderNotification_RecordModifiedFile))
+    {
+        return;
+    }
+    
+    VirtualizationRoot_RecordModifiedFile(root, Vnode_GetFsidAndInode(vnode, context));
+}
+
+// Lets the provider start fetching the contents of the file's siblings while it
+// is still hydrating the first one. Hints are dropped rather than delaying the
+// hydration when the rate limit is reached or the message queue is full.
+static void SendPrefetchHintIfDue(VirtualizationRoot* root, const vnode_t vnode, vfs_context_t context, int pid, const char* procname)
+{
+    char* directoryPath = nullptr;
+    vnode_t directory = vnode_getparent(vnode);
+    if (NULLVP == directory)
+    {
+        return;
+    }
+    
+    uint32_t directoryVid = vnode_vid(directory);
+    uint64_t nowNanoseconds = GetUptimeNanoseconds();
+    uint64_t intervalNanoseconds = root->prefetchHintIntervalMilliseconds * 1000000ull;
+    bool isDue;
+    
+    Mutex_Acquire(s_prefetchHintMutex);
+    {
+        PrefetchHintRecord& record = s_prefetchHintRecords[HashVnode(directory) & (PrefetchHintRecordCount - 1)];
+        isDue =
+            record.directory != directory ||
+            record.directoryVid != directoryVid ||
+            nowNanoseconds - record.sentNanoseconds >= intervalNanoseconds;
+        
+        if (isDue)
+        {
+            if (nowNanoseconds - s_prefetchHintWindowStartNanoseconds >= 1000000000ull)
+            {
+                s_prefetchHintWindowStartNanoseconds = nowNanoseconds;
+                s_prefetchHintWindowCount = 0;
+            }
+            
+            if (s_prefetchHintWindowCount < MaxPrefetchHintsPerSecond)
+            {
+                s_prefetchHintWindowCount++;
+                record = PrefetchHintRecord { directory, directoryVid, nowNanoseconds };
+            }
+            else
+            {
+                isDue = false;
+            }
+        }
+    }
+    Mutex_Release(s_prefetchHintMutex);
+    
+    if (!isDue)
+    {
+        goto CleanupAndReturn;
+    }
+    
+    {
+        directoryPath = static_cast<char*>(Memory_AllocFromZone(MemoryZone_PathBuffer));
+        int directoryPathLength = PrjFSMaxPath;
+        if (nullptr == directoryPath || 0 != vn_getpath(directory, directoryPath, &directoryPathLength))
+        {
+            goto CleanupAndReturn;
+        }
+        
+        const char* relativePath = GetRelativePathIfWithinRoot(directoryPath, root->path, root->pathLength);
+        if (nullptr == relativePath)
+        {
+            goto CleanupAndReturn;
+        }
+        
+        // No response is expected, the ID only has to be unique
+        uint64_t messageId = static_cast<uint64_t>(OSIncrementAtomic64(&s_nextMessageSequenceNumber)) * OutstandingMessageShardCount;
+        VnodeFsidInode directoryIds = Vnode_GetFsidAndInode(directory, context);
+        
+        MessageHeader header = {};
+        Message messageSpec = {};
+        Message_Init(&messageSpec, &header, messageId, MessageType_KtoU_PrefetchHint, pid, procname, directoryIds.fsid, directoryIds.inode, relativePath, nullptr);
+        
+        if (0 == ActiveProvider_SendMessage(root->index, messageSpec, false /* waitIfQueueFull */))
+        {
+            atomic_fetch_add(&root->requestStats.prefetchHintsSentCount, 1);
+        }
+        else
+        {
+            atomic_fetch_add(&root->requestStats.prefetchHintsDroppedCount, 1);
         }
     }
-    Mutex_Release(s_outstandingMessagesMutex);
     
-    if (!isShuttingDown && 0 != ActiveProvider_SendMessage(root->index, messageSpec))
+CleanupAndReturn:
+    if (nullptr != directoryPath)
     {
-        // TODO: appropriately handle unresponsive providers
-        
-        *kauthResult = KAUTH_RESULT_DEFER;
-        goto CleanupAndReturn;
+        Memory_FreeToZone(MemoryZone_PathBuffer, directoryPath);
     }
     
-    while (!message.receivedResponse &&
-           !s_isShuttingDown)
+    vnode_put(directory);
+}
+
+// Returns true if the file is now pending, including if it already was
+static bool TryAddPendingOverwrite(vnode_t vnode)
+{
+    uint32_t vnodeVid = vnode_vid(vnode);
+    bool added = false;
+    
+    Mutex_Acquire(s_pendingOverwriteMutex);
     {
-        Sleep(5, &message);
+        PendingOverwrite& entry = s_pendingOverwrites[HashVnode(vnode) & (PendingOverwriteCount - 1)];
+        if (nullptr == entry.vnode)
+        {
+            atomic_fetch_add(&s_pendingOverwriteCount, 1);
+            entry = PendingOverwrite { vnode, vnodeVid };
+            added = true;
+        }
+        else if (entry.vnode == vnode)
+        {
+            // Either the same file, or one whose vnode has been recycled since
+            entry.vnodeVid = vnodeVid;
+            added = true;
+        }
+        else if (vnode_vid(entry.vnode) != entry.vnodeVid)
+        {
+            // vnodes are only ever recycled, never freed, so the old one can still be read
+            entry = PendingOverwrite { vnode, vnodeVid };
+            added = true;
+        }
     }
+    Mutex_Release(s_pendingOverwriteMutex);
     
-    if (s_isShuttingDown)
+    return added;
+}
+
+static bool IsPendingOverwrite(vnode_t vnode)
+{
+    bool isPending;
+    
+    Mutex_Acquire(s_pendingOverwriteMutex);
     {
-        *kauthResult = KAUTH_RESULT_DENY;
-        goto CleanupAndReturn;
+        PendingOverwrite& entry = s_pendingOverwrites[HashVnode(vnode) & (PendingOverwriteCount - 1)];
+        isPending = entry.vnode == vnode && entry.vnodeVid == vnode_vid(vnode);
+    }
+    Mutex_Release(s_pendingOverwriteMutex);
+    
+    return isPending;
+}
+
+// Once the file has been converted; its rights were uncached on the way
+static void RemovePendingOverwrite(vnode_t vnode)
+{
+    Mutex_Acquire(s_pendingOverwriteMutex);
+    {
+        PendingOverwrite& entry = s_pendingOverwrites[HashVnode(vnode) & (PendingOverwriteCount - 1)];
+        if (entry.vnode == vnode && entry.vnodeVid == vnode_vid(vnode))
+        {
+            atomic_fetch_sub(&s_pendingOverwriteCount, 1);
+            entry = PendingOverwrite {};
+        }
     }
+    Mutex_Release(s_pendingOverwriteMutex);
+}
+
+static bool FileIsZeroBytes(vnode_t vnode, vfs_context_t context)
+{
+    SizeOrError fileSize = {};
+    Vnode_GetFsidInodeAndSize(vnode, context, &fileSize);
+    return 0 == fileSize.error && 0 == fileSize.size;
+}
 
-    if (MessageType_Response_Success == message.response)
+// Takes a token from the process's bucket for the root, if the root has a rate
+// limit. If the bucket is empty, either sleeps until the next token is due or,
+// if that is too far off or the process is being killed meanwhile, returns
+// false with the operation denied.
+static bool TryAcquireRequestToken(VirtualizationRoot* root, int pid, int* kauthResult, int* kauthError)
+{
+    uint32_t requestsPerSecond = root->requestRateLimitPerSecond;
+    if (0 == requestsPerSecond)
     {
-        *kauthResult = KAUTH_RESULT_DEFER;
-        result = true;
-        goto CleanupAndReturn;
+        return true;
     }
-    else
+    
+    uint64_t tokenIntervalNanoseconds = 1000000000ull / requestsPerSecond;
+    uint64_t bucketNanoseconds = root->requestRateLimitBurst * tokenIntervalNanoseconds;
+    uint64_t maxDelayNanoseconds = root->requestRateLimitMaxDelayMilliseconds * 1000000ull;
+    uint64_t nowNanoseconds = GetUptimeNanoseconds();
+    uint64_t delayNanoseconds = 0;
+    bool mayProceed;
+    
+    uint32_t setIndex = (static_cast<uint32_t>(pid) * 31 + static_cast<uint32_t>(root->index)) & (RequestRateBucketCount / RequestRateBucketWays - 1);
+    RequestRateBucket* set = &s_requestRateBuckets[setIndex * RequestRateBucketWays];
+    RequestRateBucket* bucket = nullptr;
+    Mutex lock = s_requestRateBucketLocks[setIndex & (RequestRateBucketLockStripes - 1)];
+    Mutex_Acquire(lock);
     {
-        // Default error code is EACCES. See errno.h for more codes.
-        *kauthError = EAGAIN;
+        RequestRateBucket* fullestBucket = &set[0];
+        for (uint32_t way = 0; way < RequestRateBucketWays; ++way)
+        {
+            if (set[way].rootIndex == root->index && set[way].pid == pid)
+            {
+                bucket = &set[way];
+                break;
+            }
+            
+            if (set[way].fullNanoseconds < fullestBucket->fullNanoseconds)
+            {
+                fullestBucket = &set[way];
+            }
+        }
+        
+        if (nullptr == bucket)
+        {
+            bucket = fullestBucket;
+            bucket->rootIndex = root->index;
+            bucket->pid = pid;
+        }
+        
+        if (bucket->fullNanoseconds < nowNanoseconds)
+        {
+            bucket->fullNanoseconds = nowNanoseconds;
+        }
+        
+        // Less than a token left: the request must wait until the bucket is one
+        // token short of full, less than the bucket's size ahead of now.
+        uint64_t fullInNanoseconds = bucket->fullNanoseconds - nowNanoseconds;
+        if (fullInNanoseconds + tokenIntervalNanoseconds > bucketNanoseconds)
+        {
+            delayNanoseconds = fullInNanoseconds + tokenIntervalNanoseconds - bucketNanoseconds;
+        }
+        
+        mayProceed = delayNanoseconds <= maxDelayNanoseconds;
+        if (mayProceed)
+        {
+            bucket->fullNanoseconds += tokenIntervalNanoseconds;
+        }
+    }
+    Mutex_Release(lock);
+    
+    if (!mayProceed)
+    {
+        atomic_fetch_add(&root->requestStats.rateLimitDeniedCount, 1);
         *kauthResult = KAUTH_RESULT_DENY;
-        goto CleanupAndReturn;
+        *kauthError = EAGAIN;
+        return false;
     }
     
-CleanupAndReturn:
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    if (0 != delayNanoseconds)
     {
-        LIST_REMOVE(&message, _list_privates);
+        atomic_fetch_add(&root->requestStats.rateLimitDelayedCount, 1);
+        
+        // Nothing wakes the channel, each sleep runs until its timeout. The delay
+        // is sliced so that a process being killed doesn't have to sit it out.
+        uint64_t remainingNanoseconds = delayNanoseconds;
+        while (0 != remainingNanoseconds)
+        {
+            if (ProcessIsTerminating(pid))
+            {
+                *kauthResult = KAUTH_RESULT_DENY;
+                *kauthError = EINTR;
+                return false;
+            }
+            
+            uint64_t sliceNanoseconds =
+                remainingNanoseconds < TerminatingSignalPollIntervalNanoseconds
+                ? remainingNanoseconds
+                : TerminatingSignalPollIntervalNanoseconds;
+            struct timespec timeout;
+            timeout.tv_sec  = static_cast<long>(sliceNanoseconds / 1000000000ull);
+            timeout.tv_nsec = static_cast<long>(sliceNanoseconds % 1000000000ull);
+            msleep(bucket, nullptr, PUSER, "io.gvfs.PrjFSKext.RequestRateLimit", &timeout);
+            remainingNanoseconds -= sliceNanoseconds;
+        }
     }
-    Mutex_Release(s_outstandingMessagesMutex);
     
-    return result;
+    return true;
 }
 
-static void AbortAllOutstandingEvents()
+// Returns ProviderNotification_None for requests which aren't notifications
+static uint32_t NotificationFlagForMessageType(MessageType messageType)
+{
+    switch (messageType)
+    {
+    case MessageType_KtoU_NotifyFilePreDelete:
+    case MessageType_KtoU_NotifyDirectoryPreDelete:
+        return ProviderNotification_PreDelete;
+    case MessageType_KtoU_NotifyFileCreated:
+        return ProviderNotification_NewFileCreated;
+    case MessageType_KtoU_NotifyFileModified:
+        return ProviderNotification_FileModified;
+    case MessageType_KtoU_NotifyFileDeleted:
+        return ProviderNotification_FileDeleted;
+    case MessageType_KtoU_NotifyFileRenamed:
+    case MessageType_KtoU_NotifyDirectoryRenamed:
+        return ProviderNotification_FileRenamed;
+    default:
+        return ProviderNotification_None;
+    }
+}
+
+// Waits until the message receives a response, the provider disconnects, the
+// kext shuts down, the timeout (if non-zero) elapses, or the waiting process is
+// sent one of ProcessTerminatingSignals (e.g. it is being killed). The timeout
+// restarts whenever the provider reports progress, so large hydrations only
+// time out once they stall. The shard mutex is held except while sleeping, so a
+// wakeup can't be missed. Wakes up at least every ProviderHealthCheckIntervalNanoseconds
+// to check whether the provider has stopped responding altogether.
+static RequestWaitOutcome WaitForResponse_Locked(OutstandingMessageShard& shard, OutstandingMessage* message, VirtualizationRoot* root, int pid, uint64_t waitStartNanoseconds, uint32_t timeoutMilliseconds)
+{
+    uint64_t timeoutStartNanoseconds = GetUptimeNanoseconds();
+    bool otherSignalPending = false;
+    while (!message->receivedResponse && !message->providerDisconnected && 0 == message->sendError && !s_isShuttingDown)
+    {
+        uint64_t deadlineNanoseconds = UINT64_MAX;
+        if (0 != timeoutMilliseconds)
+        {
+            if (message->lastProgressNanoseconds > timeoutStartNanoseconds)
+            {
+                timeoutStartNanoseconds = message->lastProgressNanoseconds;
+            }
+            
+            deadlineNanoseconds = timeoutStartNanoseconds + timeoutMilliseconds * 1000000ull;
+        }
+        
+        uint64_t now = GetUptimeNanoseconds();
+        if (now >= deadlineNanoseconds)
+        {
+            return RequestWaitOutcome_TimedOut;
+        }
+        
+        uint64_t remaining = deadlineNanoseconds - now;
+        if (remaining > ProviderHealthCheckIntervalNanoseconds)
+        {
+            remaining = ProviderHealthCheckIntervalNanoseconds;
+        }
+        
+        if (otherSignalPending && remaining > TerminatingSignalPollIntervalNanoseconds)
+        {
+            remaining = TerminatingSignalPollIntervalNanoseconds;
+        }
+        
+        struct timespec timeout;
+        timeout.tv_sec = remaining / 1000000000;
+        timeout.tv_nsec = remaining % 1000000000;
+        int sleepResult = otherSignalPending ?
+            Mutex_Sleep(shard.mutex, message, "io.gvfs.PrjFSKext.WaitForResponse", &timeout) :
+            Mutex_SleepInterruptible(shard.mutex, message, "io.gvfs.PrjFSKext.WaitForResponse", &timeout);
+        bool interrupted = 0 != sleepResult && EWOULDBLOCK != sleepResult;
+        if ((interrupted || otherSignalPending) && !message->receivedResponse)
+        {
+            if (ProcessIsTerminating(pid))
+            {
+                return RequestWaitOutcome_Interrupted;
+            }
+            
+            otherSignalPending = true;
+        }
+        
+        if (!message->receivedResponse)
+        {
+            VirtualizationRoot_CheckProviderResponsive(root, waitStartNanoseconds);
+        }
+    }
+    
+    if (message->receivedResponse)
+    {
+        return RequestWaitOutcome_Response;
+    }
+    
+    return RequestWaitOutcome_ProviderDisconnected;
+}
+
+static bool ProcessIsTerminating(int pid)
+{
+    return 0 != proc_issignal(pid, ProcessTerminatingSignals);
+}
+
+// xnu caches the rights it has granted on a vnode, and lookups through a
+// directory whose search right is cached don't call kauth at all: deferring for
+// hydrated vnodes lets those lookups skip the kext entirely. An empty placeholder
+// directory that got cached, though, would never be enumerated, so the cache is
+// cleared whenever a vnode's placeholder state changes.
+static void UncacheAuthorizedActions(vnode_t vnode)
+{
+    vnode_uncache_authorized_action(vnode, KAUTH_INVALIDATE_CACHED_RIGHTS);
+}
+
+// Polls for the message's response without taking the shard mutex. Returns true
+// if it arrived within the time; the caller still has to take the mutex before
+// looking at the response.
+static bool SpinWaitForResponse(const OutstandingMessage* message, uint32_t spinNanoseconds)
 {
-    // Wake up all sleeping threads so they can see that that we're shutting down and return an error
-    Mutex_Acquire(s_outstandingMessagesMutex);
+    uint64_t deadlineNanoseconds = GetUptimeNanoseconds() + spinNanoseconds;
+    do
     {
-        s_isShuttingDown = true;
+        if (__atomic_load_n(&message->receivedResponse, __ATOMIC_ACQUIRE))
+        {
+            return true;
+        }
+        
+        // No response is coming, WaitForResponse_Locked sorts out why
+        if (__atomic_load_n(&message->providerDisconnected, __ATOMIC_RELAXED) ||
+            0 != __atomic_load_n(&message->sendError, __ATOMIC_RELAXED) ||
+            s_isShuttingDown)
+        {
+            return false;
+        }
         
-        OutstandingMessage* outstandingMessage;
-        LIST_FOREACH(outstandingMessage, &s_outstandingMessages, _list_privates)
+        CpuRelax();
+    } while (GetUptimeNanoseconds() < deadlineNanoseconds);
+    
+    return false;
+}
+
+// Stops a spinning thread from starving its hyperthread sibling
+static void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("pause");
+#elif defined(__arm64__) || defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static int GetActiveCpuCount()
+{
+    int cpuCount = 1;
+    size_t cpuCountSize = sizeof(cpuCount);
+    if (0 != sysctlbyname("hw.activecpu", &cpuCount, &cpuCountSize, nullptr, 0))
+    {
+        return 1;
+    }
+    
+    return cpuCount;
+}
+
+static RootAccessState GetRootAccessState(const VirtualizationRoot* root)
+{
+    if (nullptr == root->providerUserClient)
+    {
+        return RootAccessState_Offline;
+    }
+    
+    if ((root->providerRootFlags & ProviderRoot_OfflineWhenUnresponsive) && VirtualizationRoot_IsProviderUnresponsive(root))
+    {
+        return RootAccessState_Offline;
+    }
+    
+    return (root->providerRootFlags & ProviderRoot_ReadOnly) ? RootAccessState_ReadOnly : RootAccessState_Online;
+}
+
+static const VnodeAccessPolicy& GetVnodeAccessPolicy(RootAccessState rootState, bool vnodeIsDir, bool vnodeIsEmpty)
+{
+    static_assert(VnodeAccessKind_HydratedDirectory == 1 && VnodeAccessKind_EmptyFile == 2, "Kinds are indexed by (isEmpty, isDir) bits");
+    return s_vnodeAccessPolicies[rootState][(vnodeIsEmpty ? 2 : 0) | (vnodeIsDir ? 1 : 0)];
+}
+
+static bool VnodeAccessPolicyDenies(const VnodeAccessPolicy& policy, kauth_action_t action)
+{
+    if (ActionBitsNotSet(action, KAUTH_VNODE_ACCESS) && ActionBitIsSet(action, policy.deniedWriteActions))
+    {
+        return true;
+    }
+    
+    return policy.denyUnlessAllowed && ActionBitsNotSet(action, policy.allowedActions);
+}
+
+static void LogAccessDenied(VirtualizationRoot* root, RootAccessState rootState, const vnode_t vnode, kauth_action_t action, int pid, const char* procname, bool vnodeIsDir, bool vnodeIsEmpty)
+{
+    if (!KextLog_LevelIsEnabled(KEXTLOG_NOTE))
+    {
+        return;
+    }
+    
+    uint64_t nowNanoseconds = GetUptimeNanoseconds();
+    unsigned long long lastLogNanoseconds = atomic_load_explicit(&root->lastAccessDeniedLogNanoseconds, memory_order_relaxed);
+    if (nowNanoseconds - lastLogNanoseconds < AccessDeniedLogIntervalNanoseconds ||
+        // Another thread got to log this interval's denial
+        !atomic_compare_exchange_strong(&root->lastAccessDeniedLogNanoseconds, &lastLogNanoseconds, nowNanoseconds))
+    {
+        atomic_fetch_add_explicit(&root->accessDeniedLogsSuppressedCount, 1, memory_order_relaxed);
+        return;
+    }
+    
+    uint32_t suppressedCount = atomic_exchange(&root->accessDeniedLogsSuppressedCount, 0);
+    KextLog_FileNote(
+        vnode,
+        "HandleVnodeOperation - action 0x%x by process %u (%s) DENIED on %s %s in %s root (%u more since the last one logged).",
+        action,
+        pid,
+        procname,
+        vnodeIsEmpty ? "empty" : "hydrated",
+        vnodeIsDir ? "directory" : "file",
+        RootAccessState_ReadOnly == rootState ? "read-only" : "offline",
+        suppressedCount);
+}
+
+static uint64_t GetUptimeNanoseconds()
+{
+    uint64_t nanoseconds;
+    absolutetime_to_nanoseconds(mach_absolute_time(), &nanoseconds);
+    return nanoseconds;
+}
+
+static void AbortAllOutstandingEvents()
+{
+    // Wake up all sleeping threads so they can see that that we're shutting down and return an error.
+    // The flag is set before visiting any shard, so a message inserted into a shard after
+    // we've been through it will see the flag instead.
+    s_isShuttingDown = true;
+    
+    for (uint32_t i = 0; i < OutstandingMessageShardCount; ++i)
+    {
+        OutstandingMessageShard& shard = s_outstandingMessageShards[i];
+        Mutex_Acquire(shard.mutex);
         {
-            wakeup(outstandingMessage);
+            for (uint32_t bucket = 0; bucket < OutstandingMessageBucketsPerShard; ++bucket)
+            {
+                OutstandingMessage* outstandingMessage;
+                LIST_FOREACH(outstandingMessage, &shard.buckets[bucket], _list_privates)
+                {
+                    wakeup(outstandingMessage);
+                }
+            }
         }
+        Mutex_Release(shard.mutex);
     }
-    Mutex_Release(s_outstandingMessagesMutex);
     
     // ... and wait until all kauth events have noticed and returned.
     // Always sleeping at least once reduces the likelihood of a race condition
@@ -486,6 +2110,105 @@ static void AbortAllOutstandingEvents()
     } while (atomic_load(&s_numActiveKauthEvents) > 0);
 }
 
+KEXT_STATIC uint32_t HashVnode(vnode_t vnode)
+{
+    // Fibonacci hashing of the pointer value, as vnode pointers are aligned
+    uint64_t hash = reinterpret_cast<uintptr_t>(vnode) * 0x9E3779B97F4A7C15ull;
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+static OutstandingMessageShard& GetOutstandingMessageShard(uint64_t messageId)
+{
+    return s_outstandingMessageShards[messageId & (OutstandingMessageShardCount - 1)];
+}
+
+static OutstandingMessage_Head* GetOutstandingMessageBucket_Locked(OutstandingMessageShard& shard, uint64_t messageId)
+{
+    // The low bits select the shard, so use the next ones (the sequence number) for the bucket
+    return &shard.buckets[(messageId / OutstandingMessageShardCount) & (OutstandingMessageBucketsPerShard - 1)];
+}
+
+static OutstandingMessage_Head* GetOutstandingMessageVnodeBucket_Locked(OutstandingMessageShard& shard, vnode_t vnode)
+{
+    return &shard.vnodeBuckets[(HashVnode(vnode) / OutstandingMessageShardCount) & (OutstandingMessageBucketsPerShard - 1)];
+}
+
+static OutstandingMessage* FindInFlightMessage_Locked(OutstandingMessageShard& shard, vnode_t vnode, uint32_t vid, MessageType messageType)
+{
+    OutstandingMessage* outstandingMessage;
+    LIST_FOREACH(outstandingMessage, GetOutstandingMessageVnodeBucket_Locked(shard, vnode), _vnode_list_privates)
+    {
+        if (outstandingMessage->vnode == vnode &&
+            outstandingMessage->vnodeVid == vid &&
+            outstandingMessage->request.messageType == messageType)
+        {
+            return outstandingMessage;
+        }
+    }
+    
+    return nullptr;
+}
+
+static void UnlinkMessage_Locked(OutstandingMessage* message)
+{
+    if (message->isLinked)
+    {
+        LIST_REMOVE(message, _list_privates);
+        LIST_REMOVE(message, _vnode_list_privates);
+        message->isLinked = false;
+    }
+}
+
+static void ReleaseMessage(OutstandingMessageShard& shard, OutstandingMessage* message, VirtualizationRoot* root)
+{
+    bool isLastWaiter;
+    bool cancelRequest = false;
+    Mutex_Acquire(shard.mutex);
+    {
+        assert(message->waiterCount > 0);
+        isLastWaiter = (0 == --message->waiterCount);
+        if (isLastWaiter)
+        {
+            UnlinkMessage_Locked(message);
+            
+            // Nobody is left to use the result, so the provider may as well stop
+            cancelRequest =
+                message->isCancellable &&
+                !message->receivedResponse &&
+                !message->providerDisconnected &&
+                !s_isShuttingDown;
+        }
+    }
+    Mutex_Release(shard.mutex);
+    
+    if (isLastWaiter)
+    {
+        if (cancelRequest)
+        {
+            SendCancelMessage(root, message);
+        }
+        
+        Memory_FreeToZone(MemoryZone_RequestRecord, message);
+    }
+}
+
+// Best effort: if the provider's queue is full, the provider simply finishes
+// the request as usual.
+static void SendCancelMessage(VirtualizationRoot* root, const OutstandingMessage* message)
+{
+    // The request's file id, so that it goes to the same queue and arrives after the request
+    const MessageHeader& request = message->request;
+    MessageHeader header = {};
+    Message messageSpec = {};
+    Message_Init(&messageSpec, &header, request.messageId, MessageType_KtoU_Cancel, request.pid, request.procname, request.fsid, request.fileId, nullptr, nullptr);
+    header.threadId = request.threadId;
+    
+    if (0 == ActiveProvider_SendMessage(message->rootIndex, messageSpec, false /* waitIfQueueFull */))
+    {
+        atomic_fetch_add(&root->requestStats.cancelsSentCount, 1);
+    }
+}
+
 static void Sleep(int seconds, void* channel)
 {
     struct timespec timeout;
@@ -519,51 +2242,71 @@ static uint32_t ReadVNodeFileFlags(vnode_t vn, vfs_context_t context)
     return attributes.va_flags;
 }
 
-static bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit)
+KEXT_STATIC uint32_t ReadCachedVNodeFileFlags(vnode_t vn, vfs_context_t context)
+{
+    uint32_t vid = vnode_vid(vn);
+    uint32_t fileFlags;
+    uint32_t changeCount;
+    if (VnodeCache_TryGetFileFlags(vn, vid, &fileFlags, &changeCount))
+    {
+        return fileFlags;
+    }
+    
+    fileFlags = ReadVNodeFileFlags(vn, context);
+    
+    // Only vnodes inside virtualization roots are cached, so unrelated I/O
+    // elsewhere on the machine can't evict the entries we care about.
+    if (FileFlagsBitIsSet(fileFlags, FileFlags_IsInVirtualizationRoot))
+    {
+        VnodeCache_SetFileFlags(vn, vid, fileFlags, changeCount);
+    }
+    
+    return fileFlags;
+}
+
+KEXT_STATIC bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit)
 {
     // Note: if multiple bits are set in 'bit', this will return true if ANY are set in fileFlags
     return 0 != (fileFlags & bit);
 }
 
-static bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask)
+KEXT_STATIC bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask)
 {
     return action & mask;
 }
 
-static bool ActionBitsNotSet(kauth_action_t action, kauth_action_t mask)
+KEXT_STATIC bool ActionBitsNotSet(kauth_action_t action, kauth_action_t mask)
 {
     return 0 == (action & mask);
 }
 
-static bool IsFileSystemCrawler(char* procname)
+// rootLength is strlen(root), which callers have precomputed (VirtualizationRoot::pathLength)
+KEXT_STATIC const char* GetRelativePath(const char* path, const char* root, uint32_t rootLength)
 {
-    // These process will crawl the file system and force a full hydration
-    if (!strcmp(procname, "mds") ||
-        !strcmp(procname, "mdworker") ||
-        !strcmp(procname, "mds_stores") ||
-        !strcmp(procname, "fseventsd") ||
-        !strcmp(procname, "Spotlight"))
+    assert(strlen(root) == rootLength);
+    assert(strlen(path) >= rootLength);
+    
+    const char* relativePath = path + rootLength;
+    if (relativePath[0] == '/')
     {
-        return true;
+        relativePath++;
     }
     
-    return false;
+    return relativePath;
 }
 
-static const char* GetRelativePath(const char* path, const char* root)
+// Returns nullptr if the path is not the root itself or below it
+static const char* GetRelativePathIfWithinRoot(const char* path, const char* root, uint32_t rootLength)
 {
-    assert(strlen(path) >= strlen(root));
-    
-    const char* relativePath = path + strlen(root);
-    if (relativePath[0] == '/')
+    if (0 != strncmp(path, root, rootLength) || ('\0' != path[rootLength] && '/' != path[rootLength]))
     {
-        relativePath++;
+        return nullptr;
     }
     
-    return relativePath;
+    return GetRelativePath(path, root, rootLength);
 }
 
-static bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode)
+KEXT_STATIC bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode)
 {
     switch (vnodeType)
     {
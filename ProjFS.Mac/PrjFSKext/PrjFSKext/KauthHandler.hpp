@@ -1,11 +1,15 @@
 #ifndef KauthHandler_h
 #define KauthHandler_h
 
+#include <sys/kernel_types.h>
 #include "Message.h"
 
 kern_return_t KauthHandler_Init();
 kern_return_t KauthHandler_Cleanup();
 
 void KauthHandler_HandleKernelMessageResponse(uint64_t messageId, MessageType responseType);
+void KauthHandler_HandleProviderDisconnect(int32_t rootIndex);
+// Drops what was cached about the vnode's FileFlags once they have changed
+void KauthHandler_HandleFileFlagsChanged(vnode_t vnode);
 
 #endif /* KauthHandler_h */
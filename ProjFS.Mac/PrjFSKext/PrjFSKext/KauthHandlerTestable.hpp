@@ -0,0 +1,36 @@
+#pragma once
+
+#include "KextTesting.hpp"
+
+#ifdef KEXT_UNIT_TESTING
+
+#include <sys/kauth.h>
+#include "kernel-header-wrappers/vnode.h"
+
+int HandleVnodeOperation(
+    kauth_cred_t    credential,
+    void*           idata,
+    kauth_action_t  action,
+    uintptr_t       arg0,
+    uintptr_t       arg1,
+    uintptr_t       arg2,
+    uintptr_t       arg3);
+
+int HandleFileOpOperation(
+    kauth_cred_t    credential,
+    void*           idata,
+    kauth_action_t  action,
+    uintptr_t       arg0,
+    uintptr_t       arg1,
+    uintptr_t       arg2,
+    uintptr_t       arg3);
+
+uint32_t ReadCachedVNodeFileFlags(vnode_t vn, vfs_context_t context);
+bool FileFlagsBitIsSet(uint32_t fileFlags, uint32_t bit);
+bool ActionBitIsSet(kauth_action_t action, kauth_action_t mask);
+bool ActionBitsNotSet(kauth_action_t action, kauth_action_t mask);
+const char* GetRelativePath(const char* path, const char* root, uint32_t rootLength);
+bool ShouldIgnoreVnodeType(vtype vnodeType, vnode_t vnode);
+uint32_t HashVnode(vnode_t vnode);
+
+#endif
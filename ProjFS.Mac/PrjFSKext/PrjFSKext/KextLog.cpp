@@ -11,6 +11,7 @@
 #include "PrjFSLogClientShared.h"
 
 os_log_t __prjfs_log;
+atomic_uint __prjfs_logLevelMask;
 
 static PrjFSLogUserClient* s_currentUserClient;
 static RWLock s_kextLogRWLock = {};
@@ -21,12 +22,20 @@ struct KextLog_StackMessageBuffer
     char logString[128];
 };
 
+struct KextLog_StackTraceEventBuffer
+{
+    KextLog_MessageHeader header;
+    KextLog_TraceEvent event;
+    char string[256];
+};
+
 bool KextLog_Init()
 {
     // TODO: The subsystem and category values are not currently working. Our events get logged, but are missing these fields.
     __prjfs_log = os_log_create("io.gvfs.PrjFS", "Kext");
+    atomic_store(&__prjfs_logLevelMask, KextLog_DefaultLevelMask);
 
-    s_kextLogRWLock = RWLock_Alloc();
+    s_kextLogRWLock = RWLock_Alloc(LockProfile_KextLog);
     if (!RWLock_IsValid(s_kextLogRWLock))
     {
         os_release(__prjfs_log);
@@ -74,11 +83,32 @@ void KextLog_DeregisterUserClient(PrjFSLogUserClient* userClient)
         if (userClient == s_currentUserClient)
         {
             s_currentUserClient = nullptr;
+            
+            // Trace events have nowhere else to go, and any other changes
+            // were made for the benefit of this client.
+            atomic_store(&__prjfs_logLevelMask, KextLog_DefaultLevelMask);
         }
     }
     RWLock_ReleaseExclusive(s_kextLogRWLock);
 }
 
+bool KextLog_SetLevelMask(PrjFSLogUserClient* userClient, uint32_t levelMask)
+{
+    bool success = false;
+    
+    RWLock_AcquireExclusive(s_kextLogRWLock);
+    {
+        if (userClient == s_currentUserClient)
+        {
+            atomic_store(&__prjfs_logLevelMask, levelMask);
+            success = true;
+        }
+    }
+    RWLock_ReleaseExclusive(s_kextLogRWLock);
+    
+    return success;
+}
+
 void KextLog_Printf(KextLog_Level loglevel, const char* fmt, ...)
 {
     // Stack-allocated message with 128-character string buffer for fast path
@@ -95,7 +125,7 @@ void KextLog_Printf(KextLog_Level loglevel, const char* fmt, ...)
     bool messageAllocated = false;
     if (messageLength >= sizeof(message.logString))
     {
-        messagePtr = static_cast<KextLog_MessageHeader*>(Memory_Alloc(messageSize));
+        messagePtr = static_cast<KextLog_MessageHeader*>(Memory_Alloc(KernelMemory_Logging, messageSize));
         if (nullptr != messagePtr)
         {
             messageAllocated = true;
@@ -131,6 +161,46 @@ void KextLog_Printf(KextLog_Level loglevel, const char* fmt, ...)
 
     if (messageAllocated)
     {
-        Memory_Free(messagePtr, messageSize);
+        Memory_Free(KernelMemory_Logging, messagePtr, messageSize);
     }
 }
+
+void KextLog_SendTraceEvent(KextLog_TraceEventId eventId, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, const char* string)
+{
+    struct KextLog_StackTraceEventBuffer message = {};
+    uint32_t messageFlags = 0;
+    
+    uint32_t stringLength = 0;
+    if (nullptr != string)
+    {
+        // Keep the end of overlong strings (paths), which identifies them best
+        stringLength = static_cast<uint32_t>(strlen(string));
+        if (stringLength >= sizeof(message.string))
+        {
+            string += stringLength - (sizeof(message.string) - 1);
+            stringLength = sizeof(message.string) - 1;
+            messageFlags |= LogMessageFlag_LogMessageTruncated;
+        }
+        
+        memcpy(message.string, string, stringLength);
+    }
+    
+    message.event.eventId = eventId;
+    message.event.args[0] = arg0;
+    message.event.args[1] = arg1;
+    message.event.args[2] = arg2;
+    message.event.args[3] = arg3;
+    uint32_t messageSize = sizeof(KextLog_MessageHeader) + sizeof(KextLog_TraceEvent) + stringLength + 1 /* null terminator */;
+    
+    RWLock_AcquireShared(s_kextLogRWLock);
+    {
+        if (s_currentUserClient != nullptr)
+        {
+            message.header.flags = messageFlags;
+            message.header.level = KEXTLOG_TRACE;
+            message.header.machAbsoluteTimestamp = mach_absolute_time();
+            s_currentUserClient->sendLogMessage(&message.header, messageSize);
+        }
+    }
+    RWLock_ReleaseShared(s_kextLogRWLock);
+}
@@ -5,20 +5,42 @@
 #include "PrjFSClasses.hpp"
 #include "PrjFSLogClientShared.h"
 #include <os/log.h>
+#include <sys/kdebug.h>
+#include <stdatomic.h>
 
 extern os_log_t __prjfs_log;
+// Bit mask of enabled KextLog_Level values, see KextLog_LevelMaskBit()
+extern atomic_uint __prjfs_logLevelMask;
 
 bool KextLog_Init();
 void KextLog_Cleanup();
 
-#define KextLog_Error(format, ...) KextLog_Printf(KEXTLOG_ERROR, format, ##__VA_ARGS__)
-#define KextLog_Info(format, ...) KextLog_Printf(KEXTLOG_INFO, format, ##__VA_ARGS__)
-#define KextLog_Note(format, ...) KextLog_Printf(KEXTLOG_NOTE, format, ##__VA_ARGS__)
+inline bool KextLog_LevelIsEnabled(KextLog_Level loglevel)
+{
+    return 0 != (atomic_load_explicit(&__prjfs_logLevelMask, memory_order_relaxed) & KextLog_LevelMaskBit(loglevel));
+}
+
+#define KextLog_Error(format, ...) ({ if (KextLog_LevelIsEnabled(KEXTLOG_ERROR)) KextLog_Printf(KEXTLOG_ERROR, format, ##__VA_ARGS__); })
+#define KextLog_Info(format, ...) ({ if (KextLog_LevelIsEnabled(KEXTLOG_INFO)) KextLog_Printf(KEXTLOG_INFO, format, ##__VA_ARGS__); })
+#define KextLog_Note(format, ...) ({ if (KextLog_LevelIsEnabled(KEXTLOG_NOTE)) KextLog_Printf(KEXTLOG_NOTE, format, ##__VA_ARGS__); })
 
 bool KextLog_RegisterUserClient(PrjFSLogUserClient* userClient);
 void KextLog_DeregisterUserClient(PrjFSLogUserClient* userClient);
+// The mask is global, so only the registered client may change it; it is
+// reset to KextLog_DefaultLevelMask when that client deregisters.
+bool KextLog_SetLevelMask(PrjFSLogUserClient* userClient, uint32_t levelMask);
 void KextLog_Printf(KextLog_Level loglevel, const char* fmt, ...)  __printflike(2,3);
 
+// Binary trace events are only produced while a log client has enabled
+// KEXTLOG_TRACE; they are never formatted in the kernel.
+void KextLog_SendTraceEvent(KextLog_TraceEventId eventId, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, const char* string);
+#define KextLog_Trace(eventId, arg0, arg1, arg2, arg3, string) ({ if (KextLog_LevelIsEnabled(KEXTLOG_TRACE)) KextLog_SendTraceEvent(eventId, arg0, arg1, arg2, arg3, string); })
+
+// Signpost intervals (see PrjFSSignpostCode) cost a check of kdebug_enable unless
+// Instruments or another kdebug client is tracing.
+#define KextLog_SignpostStart(code, arg1, arg2) KERNEL_DEBUG_CONSTANT(APPSDBG_CODE(DBG_APP_SIGNPOST, code) | DBG_FUNC_START, arg1, arg2, 0, 0, 0)
+#define KextLog_SignpostEnd(code, arg1, arg2) KERNEL_DEBUG_CONSTANT(APPSDBG_CODE(DBG_APP_SIGNPOST, code) | DBG_FUNC_END, arg1, arg2, 0, 0, 0)
+
 
 // Helper macros/function for logging with file paths. Note that the path must
 // be the last % format code in the format string, but the vnode is the first
@@ -28,6 +50,11 @@ extern "C" int vn_getpath(struct vnode *vp, char *pathbuf, int *len);
 template <typename... args>
     void KextLogFile_Printf(KextLog_Level loglevel, struct vnode* vnode, const char* fmt, args... a)
     {
+        if (!KextLog_LevelIsEnabled(loglevel))
+        {
+            return;
+        }
+        
         char vnodePath[PrjFSMaxPath] = "";
         int vnodePathLength = PrjFSMaxPath;
         vn_getpath(vnode, vnodePath, &vnodePathLength);
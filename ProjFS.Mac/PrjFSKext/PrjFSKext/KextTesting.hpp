@@ -0,0 +1,11 @@
+#pragma once
+
+// The user space benchmark build (PrjFSKextBenchmarks) compiles the kext's
+// sources with KEXT_UNIT_TESTING defined. Internal helpers which it calls
+// directly are declared KEXT_STATIC, so they only get external linkage in that
+// build; their declarations for the benchmarks live in the *Testable.hpp headers.
+#ifdef KEXT_UNIT_TESTING
+#define KEXT_STATIC
+#else
+#define KEXT_STATIC static
+#endif
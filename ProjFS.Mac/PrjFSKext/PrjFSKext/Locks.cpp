@@ -3,12 +3,57 @@
 #include <kern/thread.h>
 #include <kern/assert.h>
 #include <libkern/OSAtomic.h>
+#include <libkern/libkern.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <mach/mach_time.h>
+#include <stdatomic.h>
 
 #include "PrjFSCommon.h"
+#include "PrjFSLogClientShared.h"
 #include "Locks.hpp"
 
 static lck_grp_t* s_lockGroup = nullptr;
 
+#if PRJFS_LOCK_PROFILING
+// Counters are in mach absolute time units. Hold times are accumulated by
+// subtracting the acquire time and adding the release time, which works for
+// shared holders without remembering when each one acquired the lock.
+struct LockProfile
+{
+    atomic_ullong acquireCount;
+    atomic_ullong contendedCount;
+    atomic_ullong totalWaitTime;
+    atomic_ullong maxWaitTime;
+    atomic_ullong totalHoldTime;
+};
+
+static const char* const s_lockProfileNames[] =
+{
+    "Unprofiled",
+    "OutstandingMessages",
+    "VirtualizationRoots",
+    "KextLog",
+    "ProviderDataQueueWriter",
+    "LogDataQueueWriter",
+    "ModifiedFiles",
+    "PrefetchHints",
+    "ProviderResponseRing",
+    "RequestRateLimits",
+    "ProcessAttribution",
+    "PendingOverwrites",
+};
+static_assert(sizeof(s_lockProfileNames) / sizeof(s_lockProfileNames[0]) == LockProfile_Count, "Every lock profile needs a name");
+static_assert(LockProfile_Count <= KextLog_MaxLockProfiles, "Too many lock profiles for KextLog_LockProfiles");
+
+static LockProfile s_lockProfiles[LockProfile_Count];
+
+static void Profile_Acquired(LockProfileId profileId, uint64_t requestTime, bool contended);
+static void Profile_Released(LockProfileId profileId);
+#endif
+
+static int Mutex_SleepWithPriority(Mutex mutex, void* channel, int priority, const char* waitMessage, struct timespec* timeout);
+
 kern_return_t Locks_Init()
 {
     if (nullptr != s_lockGroup)
@@ -22,6 +67,17 @@ kern_return_t Locks_Init()
         return KERN_FAILURE;
     }
     
+#if PRJFS_LOCK_PROFILING
+    for (uint32_t i = 0; i < LockProfile_Count; ++i)
+    {
+        atomic_store(&s_lockProfiles[i].acquireCount, 0);
+        atomic_store(&s_lockProfiles[i].contendedCount, 0);
+        atomic_store(&s_lockProfiles[i].totalWaitTime, 0);
+        atomic_store(&s_lockProfiles[i].maxWaitTime, 0);
+        atomic_store(&s_lockProfiles[i].totalHoldTime, 0);
+    }
+#endif
+    
     return KERN_SUCCESS;
 }
 
@@ -38,11 +94,38 @@ kern_return_t Locks_Cleanup()
     return KERN_FAILURE;
 }
 
+bool Locks_GetProfiles(KextLog_LockProfiles* profiles)
+{
+#if PRJFS_LOCK_PROFILING
+    *profiles = KextLog_LockProfiles{};
+    profiles->profileCount = LockProfile_Count;
+    for (uint32_t i = 0; i < LockProfile_Count; ++i)
+    {
+        KextLog_LockProfile& out = profiles->profiles[i];
+        strlcpy(out.name, s_lockProfileNames[i], sizeof(out.name));
+        out.acquireCount = atomic_load(&s_lockProfiles[i].acquireCount);
+        out.contendedCount = atomic_load(&s_lockProfiles[i].contendedCount);
+        absolutetime_to_nanoseconds(atomic_load(&s_lockProfiles[i].totalWaitTime), &out.totalWaitNanoseconds);
+        absolutetime_to_nanoseconds(atomic_load(&s_lockProfiles[i].maxWaitTime), &out.maxWaitNanoseconds);
+        // Inaccurate while a lock of this class is held
+        absolutetime_to_nanoseconds(atomic_load(&s_lockProfiles[i].totalHoldTime), &out.totalHoldNanoseconds);
+    }
+    
+    return true;
+#else
+    return false;
+#endif
+}
+
 // Mutex implementation functions
 
-Mutex Mutex_Alloc()
+Mutex Mutex_Alloc(LockProfileId profileId)
 {
+#if PRJFS_LOCK_PROFILING
+    return (Mutex){ lck_mtx_alloc_init(s_lockGroup, LCK_ATTR_NULL), profileId };
+#else
     return (Mutex){ lck_mtx_alloc_init(s_lockGroup, LCK_ATTR_NULL) };
+#endif
 }
 
 void Mutex_FreeMemory(Mutex* mutex)
@@ -58,19 +141,70 @@ bool Mutex_IsValid(Mutex mutex)
 
 void Mutex_Acquire(Mutex mutex)
 {
+#if PRJFS_LOCK_PROFILING
+    if (LockProfile_None != mutex.profileId)
+    {
+        uint64_t requestTime = mach_absolute_time();
+        bool contended = !lck_mtx_try_lock(mutex.p);
+        if (contended)
+        {
+            lck_mtx_lock(mutex.p);
+        }
+        
+        Profile_Acquired(mutex.profileId, requestTime, contended);
+        return;
+    }
+#endif
+
     lck_mtx_lock(mutex.p);
 }
 
 void Mutex_Release(Mutex mutex)
 {
+#if PRJFS_LOCK_PROFILING
+    Profile_Released(mutex.profileId);
+#endif
+
     lck_mtx_unlock(mutex.p);
 }
 
+static int Mutex_SleepWithPriority(Mutex mutex, void* channel, int priority, const char* waitMessage, struct timespec* timeout)
+{
+#if PRJFS_LOCK_PROFILING
+    // The mutex isn't held while sleeping, and reacquiring it isn't counted as a wait.
+    Profile_Released(mutex.profileId);
+    int result = msleep(channel, mutex.p, priority, waitMessage, timeout);
+    if (LockProfile_None != mutex.profileId)
+    {
+        atomic_fetch_sub(&s_lockProfiles[mutex.profileId].totalHoldTime, mach_absolute_time());
+    }
+    
+    return result;
+#else
+    return msleep(channel, mutex.p, priority, waitMessage, timeout);
+#endif
+}
+
+int Mutex_Sleep(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout)
+{
+    return Mutex_SleepWithPriority(mutex, channel, PUSER, waitMessage, timeout);
+}
+
+int Mutex_SleepInterruptible(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout)
+{
+    return Mutex_SleepWithPriority(mutex, channel, PUSER | PCATCH, waitMessage, timeout);
+}
+
 // RWLock implementation functions
 
-RWLock RWLock_Alloc()
+RWLock RWLock_Alloc(LockProfileId profileId)
 {
-    return (RWLock){ lck_rw_alloc_init(s_lockGroup, LCK_ATTR_NULL) };
+    RWLock rwLock = {};
+    rwLock.p = lck_rw_alloc_init(s_lockGroup, LCK_ATTR_NULL);
+#if PRJFS_LOCK_PROFILING
+    rwLock.profileId = profileId;
+#endif
+    return rwLock;
 }
 
 bool RWLock_IsValid(RWLock rwLock)
@@ -86,7 +220,23 @@ void RWLock_FreeMemory(RWLock* rwLock)
 
 void RWLock_AcquireShared(RWLock& rwLock)
 {
-    lck_rw_lock_shared(rwLock.p);
+#if PRJFS_LOCK_PROFILING
+    if (LockProfile_None != rwLock.profileId)
+    {
+        uint64_t requestTime = mach_absolute_time();
+        bool contended = !lck_rw_try_lock(rwLock.p, LCK_RW_TYPE_SHARED);
+        if (contended)
+        {
+            lck_rw_lock_shared(rwLock.p);
+        }
+        
+        Profile_Acquired(rwLock.profileId, requestTime, contended);
+    }
+    else
+#endif
+    {
+        lck_rw_lock_shared(rwLock.p);
+    }
 
 #if PRJFS_LOCK_CORRECTNESS_CHECKS
     assert(rwLock.exclOwner == nullptr);
@@ -104,13 +254,32 @@ void RWLock_ReleaseShared(RWLock& rwLock)
     OSAddAtomic(-1, &rwLock.sharedOwnersCount);
     assert(rwLock.exclOwner == nullptr);
 #endif
+#if PRJFS_LOCK_PROFILING
+    Profile_Released(rwLock.profileId);
+#endif
 
     lck_rw_unlock_shared(rwLock.p);
 }
 
 void RWLock_AcquireExclusive(RWLock& rwLock)
 {
-    lck_rw_lock_exclusive(rwLock.p);
+#if PRJFS_LOCK_PROFILING
+    if (LockProfile_None != rwLock.profileId)
+    {
+        uint64_t requestTime = mach_absolute_time();
+        bool contended = !lck_rw_try_lock(rwLock.p, LCK_RW_TYPE_EXCLUSIVE);
+        if (contended)
+        {
+            lck_rw_lock_exclusive(rwLock.p);
+        }
+        
+        Profile_Acquired(rwLock.profileId, requestTime, contended);
+    }
+    else
+#endif
+    {
+        lck_rw_lock_exclusive(rwLock.p);
+    }
 
 #if PRJFS_LOCK_CORRECTNESS_CHECKS
     assert(rwLock.sharedOwnersCount == 0);
@@ -127,6 +296,9 @@ void RWLock_ReleaseExclusive(RWLock& rwLock)
     assert(rwLock.exclOwner == current_thread());
     rwLock.exclOwner = nullptr;
 #endif
+#if PRJFS_LOCK_PROFILING
+    Profile_Released(rwLock.profileId);
+#endif
 
     lck_rw_unlock_exclusive(rwLock.p);
 }
@@ -142,6 +314,14 @@ bool RWLock_AcquireSharedToExclusive(RWLock& rwLock)
 
     bool success = lck_rw_lock_shared_to_exclusive(rwLock.p);
     
+#if PRJFS_LOCK_PROFILING
+    // The lock continues to be held if the upgrade succeeds, and is dropped otherwise
+    if (!success)
+    {
+        Profile_Released(rwLock.profileId);
+    }
+#endif
+    
 #if PRJFS_LOCK_CORRECTNESS_CHECKS
     if (success)
     {
@@ -154,4 +334,32 @@ bool RWLock_AcquireSharedToExclusive(RWLock& rwLock)
     return success;
 }
 
+#if PRJFS_LOCK_PROFILING
+static void Profile_Acquired(LockProfileId profileId, uint64_t requestTime, bool contended)
+{
+    LockProfile& profile = s_lockProfiles[profileId];
+    uint64_t acquireTime = contended ? mach_absolute_time() : requestTime;
+    
+    atomic_fetch_add(&profile.acquireCount, 1);
+    atomic_fetch_sub(&profile.totalHoldTime, acquireTime);
+    if (contended)
+    {
+        uint64_t waitTime = acquireTime - requestTime;
+        atomic_fetch_add(&profile.contendedCount, 1);
+        atomic_fetch_add(&profile.totalWaitTime, waitTime);
+        
+        unsigned long long maxWaitTime = atomic_load(&profile.maxWaitTime);
+        while (waitTime > maxWaitTime && !atomic_compare_exchange_weak(&profile.maxWaitTime, &maxWaitTime, waitTime))
+        {
+        }
+    }
+}
 
+static void Profile_Released(LockProfileId profileId)
+{
+    if (LockProfile_None != profileId)
+    {
+        atomic_fetch_add(&s_lockProfiles[profileId].totalHoldTime, mach_absolute_time());
+    }
+}
+#endif
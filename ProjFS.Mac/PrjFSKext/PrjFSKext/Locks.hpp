@@ -6,22 +6,65 @@
 #define PRJFS_LOCK_CORRECTNESS_CHECKS 1
 #endif
 
+// Build with PRJFS_LOCK_PROFILING=1 to record how long acquisitions wait and how
+// long locks are held, for each of the lock classes below. The kext log client
+// can read the totals with LogSelector_GetLockProfiles.
+
 #include <mach/kern_return.h>
 #include <stdint.h>
 
+// Locks allocated with the same id share one set of profiling counters
+enum LockProfileId : uint32_t
+{
+    LockProfile_None = 0,
+    
+    LockProfile_OutstandingMessages,
+    LockProfile_VirtualizationRoots,
+    LockProfile_KextLog,
+    LockProfile_ProviderDataQueueWriter,
+    LockProfile_LogDataQueueWriter,
+    LockProfile_ModifiedFiles,
+    LockProfile_PrefetchHints,
+    LockProfile_ProviderResponseRing,
+    LockProfile_RequestRateLimits,
+    LockProfile_ProcessAttribution,
+    LockProfile_PendingOverwrites,
+    
+    LockProfile_Count
+};
+
 typedef struct __lck_mtx_t__ lck_mtx_t;
-typedef struct { lck_mtx_t* p; } Mutex;
+typedef struct
+{
+    lck_mtx_t* p;
+#if PRJFS_LOCK_PROFILING
+    LockProfileId profileId;
+#endif
+} Mutex;
 
 kern_return_t Locks_Init();
 kern_return_t Locks_Cleanup();
 
-Mutex Mutex_Alloc();
+// Returns false if the kext was built without PRJFS_LOCK_PROFILING
+struct KextLog_LockProfiles;
+bool Locks_GetProfiles(KextLog_LockProfiles* profiles);
+
+Mutex Mutex_Alloc(LockProfileId profileId = LockProfile_None);
 void Mutex_FreeMemory(Mutex* mutex);
 bool Mutex_IsValid(Mutex mutex);
 
 void Mutex_Acquire(Mutex mutex);
 void Mutex_Release(Mutex mutex);
 
+// Atomically releases the (held) mutex and waits for a wakeup() on channel or
+// for the timeout to elapse; a null timeout waits indefinitely. The mutex is
+// reacquired before returning. Returns 0 on wakeup, EWOULDBLOCK on timeout.
+struct timespec;
+int Mutex_Sleep(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout);
+// As Mutex_Sleep, but a signal to the sleeping thread also ends the wait, in
+// which case it returns EINTR or ERESTART.
+int Mutex_SleepInterruptible(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout);
+
 typedef struct __lck_rw_t__ lck_rw_t;
 struct thread;
 
@@ -33,9 +76,12 @@ struct RWLock
     uint32_t sharedOwnersXor;
     uint32_t sharedOwnersCount;
 #endif
+#if PRJFS_LOCK_PROFILING
+    LockProfileId profileId;
+#endif
 };
 
-RWLock RWLock_Alloc();
+RWLock RWLock_Alloc(LockProfileId profileId = LockProfile_None);
 bool RWLock_IsValid(RWLock rwLock);
 
 void RWLock_FreeMemory(RWLock* rwLock);
@@ -1,11 +1,93 @@
 #include <kern/debug.h>
+#include <kern/assert.h>
 #include <libkern/libkern.h>
 #include <libkern/OSMalloc.h>
+#include <stdatomic.h>
 
 #include "PrjFSCommon.h"
+#include "Locks.hpp"
 #include "Memory.hpp"
 
+// Structs
+
+struct FreeElement
+{
+    FreeElement* next;
+};
+
+// Each slab starts with this header, followed by the elements
+struct Slab
+{
+    Slab* next;
+    uint64_t reserved;
+};
+
+struct Zone
+{
+    const char* name;
+    uint32_t elementSize;
+    uint32_t elementsPerSlab;
+    
+    // Protects all of the fields below
+    Mutex mutex;
+    FreeElement* freeList;
+    Slab* slabs;
+    uint32_t slabCount;
+    uint32_t elementsInUse;
+    uint32_t peakElementsInUse;
+    uint64_t allocationCount;
+    uint64_t failedAllocationCount;
+};
+
+struct Subsystem
+{
+    atomic_ullong bytesInUse;
+    atomic_ullong peakBytesInUse;
+    atomic_ullong budgetBytes;
+    atomic_ullong overBudgetCount;
+    // Index of the root whose provider set the budget, -1 while it's the default
+    atomic_int budgetOwnerRootIndex;
+};
+
+// Function prototypes
+
+static void* HeapAlloc(uint32_t size);
+static void HeapFree(void* buffer, uint32_t size);
+static bool InitZone(Zone* zone, const char* name, uint32_t elementSize);
+static void CleanupZone(Zone* zone);
+static void AddSlab_Locked(Zone* zone, Slab* slab);
+static void UpdatePeak(atomic_ullong* peak, uint64_t value);
+static uint64_t GetDefaultBudgetBytes(KernelMemorySubsystem subsystem);
+
+// State
+
+static const uint32_t SlabSizeBytes = 16 * 1024;
+static const uint32_t ZoneElementAlignment = 16;
+
 static OSMallocTag s_mallocTag = nullptr;
+static Zone s_zones[MemoryZone_Count];
+
+static atomic_ullong s_heapBytesInUse;
+static atomic_ullong s_heapPeakBytesInUse;
+static atomic_ullong s_heapAllocationCount;
+static atomic_ullong s_heapFailedAllocationCount;
+
+// The queues are the only large consumers and user space chooses their sizes,
+// so by default they are kept to a few percent of a 16 GB machine.
+static const uint64_t DefaultMessageQueuesBudgetBytes = 256 * 1024 * 1024;
+static const uint64_t DefaultLoggingBudgetBytes = 96 * 1024 * 1024;
+
+static Subsystem s_subsystems[KernelMemory_Count];
+static const char* const s_subsystemNames[KernelMemory_Count] =
+{
+    [KernelMemory_VirtualizationRoots] =    "VirtualizationRoots",
+    [KernelMemory_ProcessPolicies] =        "ProcessPolicies",
+    [KernelMemory_Logging] =                "Logging",
+    [KernelMemory_Zones] =                  "Zones",
+    [KernelMemory_MessageQueues] =          "MessageQueues",
+};
+
+// Public functions
 
 kern_return_t Memory_Init()
 {
@@ -20,6 +102,27 @@ kern_return_t Memory_Init()
         return KERN_FAILURE;
     }
     
+    atomic_store(&s_heapBytesInUse, 0);
+    atomic_store(&s_heapPeakBytesInUse, 0);
+    atomic_store(&s_heapAllocationCount, 0);
+    atomic_store(&s_heapFailedAllocationCount, 0);
+    
+    for (uint32_t i = 0; i < KernelMemory_Count; ++i)
+    {
+        atomic_store(&s_subsystems[i].bytesInUse, 0);
+        atomic_store(&s_subsystems[i].peakBytesInUse, 0);
+        atomic_store(&s_subsystems[i].budgetBytes, GetDefaultBudgetBytes(static_cast<KernelMemorySubsystem>(i)));
+        atomic_store(&s_subsystems[i].overBudgetCount, 0);
+        atomic_store(&s_subsystems[i].budgetOwnerRootIndex, -1);
+    }
+    
+    if (!InitZone(&s_zones[MemoryZone_PathBuffer], "PathBuffer", PrjFSMaxPath) ||
+        !InitZone(&s_zones[MemoryZone_RequestRecord], "RequestRecord", MemoryZoneRequestRecordSize))
+    {
+        Memory_Cleanup();
+        return KERN_FAILURE;
+    }
+    
     return KERN_SUCCESS;
 }
 
@@ -27,6 +130,11 @@ kern_return_t Memory_Cleanup()
 {
     if (nullptr != s_mallocTag)
     {
+        for (uint32_t i = 0; i < MemoryZone_Count; ++i)
+        {
+            CleanupZone(&s_zones[i]);
+        }
+        
         OSMalloc_Tagfree(s_mallocTag);
         s_mallocTag = nullptr;
         
@@ -36,12 +144,290 @@ kern_return_t Memory_Cleanup()
     return KERN_FAILURE;
 }
 
-void* Memory_Alloc(uint32_t size)
+void* Memory_Alloc(KernelMemorySubsystem subsystem, uint32_t size)
+{
+    if (!Memory_Reserve(subsystem, size))
+    {
+        return nullptr;
+    }
+    
+    void* buffer = HeapAlloc(size);
+    if (nullptr == buffer)
+    {
+        Memory_Unreserve(subsystem, size);
+    }
+    
+    return buffer;
+}
+
+void Memory_Free(KernelMemorySubsystem subsystem, void* buffer, uint32_t size)
+{
+    HeapFree(buffer, size);
+    Memory_Unreserve(subsystem, size);
+}
+
+bool Memory_Reserve(KernelMemorySubsystem subsystem, uint64_t size)
+{
+    assert(subsystem < KernelMemory_Count);
+    Subsystem* s = &s_subsystems[subsystem];
+    
+    // Charge first, so that racing reservations can't both fit under the budget
+    uint64_t budget = atomic_load(&s->budgetBytes);
+    uint64_t bytesInUse = atomic_fetch_add(&s->bytesInUse, size) + size;
+    if (0 != budget && bytesInUse > budget)
+    {
+        atomic_fetch_sub(&s->bytesInUse, size);
+        atomic_fetch_add(&s->overBudgetCount, 1);
+        return false;
+    }
+    
+    UpdatePeak(&s->peakBytesInUse, bytesInUse);
+    return true;
+}
+
+void Memory_Unreserve(KernelMemorySubsystem subsystem, uint64_t size)
+{
+    assert(subsystem < KernelMemory_Count);
+    assert(atomic_load(&s_subsystems[subsystem].bytesInUse) >= size);
+    atomic_fetch_sub(&s_subsystems[subsystem].bytesInUse, size);
+}
+
+errno_t Memory_SetBudget(int32_t ownerRootIndex, KernelMemorySubsystem subsystem, uint64_t budgetBytes)
+{
+    assert(subsystem < KernelMemory_Count);
+    assert(ownerRootIndex >= 0);
+    Subsystem* s = &s_subsystems[subsystem];
+    
+    int expectedOwner = -1;
+    if (!atomic_compare_exchange_strong(&s->budgetOwnerRootIndex, &expectedOwner, ownerRootIndex) &&
+        ownerRootIndex != expectedOwner)
+    {
+        return EBUSY;
+    }
+    
+    atomic_store(&s->budgetBytes, budgetBytes);
+    return 0;
+}
+
+void Memory_ReleaseBudgetOwnership(int32_t ownerRootIndex)
+{
+    for (uint32_t i = 0; i < KernelMemory_Count; ++i)
+    {
+        Subsystem* s = &s_subsystems[i];
+        if (ownerRootIndex == atomic_load(&s->budgetOwnerRootIndex))
+        {
+            // Restored while still owned, so that nobody else's budget is overwritten
+            atomic_store(&s->budgetBytes, GetDefaultBudgetBytes(static_cast<KernelMemorySubsystem>(i)));
+            atomic_store(&s->budgetOwnerRootIndex, -1);
+        }
+    }
+}
+
+void* Memory_AllocFromZone(MemoryZone zone)
+{
+    assert(zone < MemoryZone_Count);
+    Zone* z = &s_zones[zone];
+    
+    FreeElement* element = nullptr;
+    bool triedToGrow = false;
+    while (true)
+    {
+        Mutex_Acquire(z->mutex);
+        {
+            element = z->freeList;
+            if (nullptr != element)
+            {
+                z->freeList = element->next;
+                z->elementsInUse++;
+                z->allocationCount++;
+                if (z->elementsInUse > z->peakElementsInUse)
+                {
+                    z->peakElementsInUse = z->elementsInUse;
+                }
+            }
+            else if (triedToGrow)
+            {
+                z->failedAllocationCount++;
+            }
+        }
+        Mutex_Release(z->mutex);
+        
+        if (nullptr != element || triedToGrow)
+        {
+            return element;
+        }
+        
+        // OSMalloc may block, so grow the zone without holding its mutex. If
+        // several threads race to do so the zone simply ends up a little larger.
+        triedToGrow = true;
+        Slab* slab = static_cast<Slab*>(Memory_Alloc(KernelMemory_Zones, SlabSizeBytes));
+        if (nullptr != slab)
+        {
+            Mutex_Acquire(z->mutex);
+            {
+                AddSlab_Locked(z, slab);
+            }
+            Mutex_Release(z->mutex);
+        }
+    }
+}
+
+void Memory_FreeToZone(MemoryZone zone, void* element)
 {
-    return OSMalloc(size, s_mallocTag);
+    assert(zone < MemoryZone_Count);
+    if (nullptr == element)
+    {
+        return;
+    }
+    
+    Zone* z = &s_zones[zone];
+    FreeElement* freeElement = static_cast<FreeElement*>(element);
+    Mutex_Acquire(z->mutex);
+    {
+        assert(z->elementsInUse > 0);
+        z->elementsInUse--;
+        freeElement->next = z->freeList;
+        z->freeList = freeElement;
+    }
+    Mutex_Release(z->mutex);
+}
+
+uint32_t Memory_GetZoneElementSize(MemoryZone zone)
+{
+    assert(zone < MemoryZone_Count);
+    return s_zones[zone].elementSize;
 }
 
-void Memory_Free(void* buffer, uint32_t size)
+void Memory_GetZoneStats(MemoryZone zone, MemoryZoneStats* stats)
 {
+    assert(zone < MemoryZone_Count);
+    Zone* z = &s_zones[zone];
+    
+    Mutex_Acquire(z->mutex);
+    {
+        stats->name = z->name;
+        stats->elementSize = z->elementSize;
+        stats->slabCount = z->slabCount;
+        stats->elementsInUse = z->elementsInUse;
+        stats->peakElementsInUse = z->peakElementsInUse;
+        stats->allocationCount = z->allocationCount;
+        stats->failedAllocationCount = z->failedAllocationCount;
+    }
+    Mutex_Release(z->mutex);
+}
+
+void Memory_GetHeapStats(MemoryHeapStats* stats)
+{
+    stats->bytesInUse = atomic_load(&s_heapBytesInUse);
+    stats->peakBytesInUse = atomic_load(&s_heapPeakBytesInUse);
+    stats->allocationCount = atomic_load(&s_heapAllocationCount);
+    stats->failedAllocationCount = atomic_load(&s_heapFailedAllocationCount);
+}
+
+void Memory_GetSubsystemStats(KernelMemorySubsystem subsystem, MemorySubsystemStats* stats)
+{
+    assert(subsystem < KernelMemory_Count);
+    Subsystem* s = &s_subsystems[subsystem];
+    
+    stats->name = s_subsystemNames[subsystem];
+    stats->bytesInUse = atomic_load(&s->bytesInUse);
+    stats->peakBytesInUse = atomic_load(&s->peakBytesInUse);
+    stats->budgetBytes = atomic_load(&s->budgetBytes);
+    stats->overBudgetCount = atomic_load(&s->overBudgetCount);
+}
+
+// Private functions
+
+static uint64_t GetDefaultBudgetBytes(KernelMemorySubsystem subsystem)
+{
+    switch (subsystem)
+    {
+    case KernelMemory_MessageQueues:
+        return DefaultMessageQueuesBudgetBytes;
+    case KernelMemory_Logging:
+        return DefaultLoggingBudgetBytes;
+    default:
+        return 0;
+    }
+}
+
+static void* HeapAlloc(uint32_t size)
+{
+    void* buffer = OSMalloc(size, s_mallocTag);
+    if (nullptr == buffer)
+    {
+        atomic_fetch_add(&s_heapFailedAllocationCount, 1);
+        return nullptr;
+    }
+    
+    atomic_fetch_add(&s_heapAllocationCount, 1);
+    uint64_t bytesInUse = atomic_fetch_add(&s_heapBytesInUse, size) + size;
+    UpdatePeak(&s_heapPeakBytesInUse, bytesInUse);
+    
+    return buffer;
+}
+
+static void HeapFree(void* buffer, uint32_t size)
+{
+    atomic_fetch_sub(&s_heapBytesInUse, size);
     OSFree(buffer, size, s_mallocTag);
 }
+
+static bool InitZone(Zone* zone, const char* name, uint32_t elementSize)
+{
+    uint32_t alignedSize = (elementSize + ZoneElementAlignment - 1) & ~(ZoneElementAlignment - 1);
+    
+    *zone = Zone{};
+    zone->name = name;
+    zone->elementSize = alignedSize;
+    zone->elementsPerSlab = (SlabSizeBytes - sizeof(Slab)) / alignedSize;
+    assert(zone->elementsPerSlab > 0);
+    
+    zone->mutex = Mutex_Alloc();
+    return Mutex_IsValid(zone->mutex);
+}
+
+static void CleanupZone(Zone* zone)
+{
+    if (!Mutex_IsValid(zone->mutex))
+    {
+        return;
+    }
+    
+    // Everything must have been returned to the zone by now
+    assert(0 == zone->elementsInUse);
+    
+    while (nullptr != zone->slabs)
+    {
+        Slab* slab = zone->slabs;
+        zone->slabs = slab->next;
+        Memory_Free(KernelMemory_Zones, slab, SlabSizeBytes);
+    }
+    
+    zone->freeList = nullptr;
+    zone->slabCount = 0;
+    Mutex_FreeMemory(&zone->mutex);
+}
+
+static void AddSlab_Locked(Zone* zone, Slab* slab)
+{
+    slab->next = zone->slabs;
+    zone->slabs = slab;
+    zone->slabCount++;
+    
+    uint8_t* elements = reinterpret_cast<uint8_t*>(slab) + sizeof(Slab);
+    for (uint32_t i = 0; i < zone->elementsPerSlab; ++i)
+    {
+        FreeElement* element = reinterpret_cast<FreeElement*>(elements + i * zone->elementSize);
+        element->next = zone->freeList;
+        zone->freeList = element;
+    }
+}
+
+static void UpdatePeak(atomic_ullong* peak, uint64_t value)
+{
+    unsigned long long currentPeak = atomic_load(peak);
+    while (value > currentPeak && !atomic_compare_exchange_weak(peak, &currentPeak, value))
+    {
+    }
+}
@@ -1,10 +1,83 @@
 #ifndef Memory_h
 #define Memory_h
 
+#include <mach/kern_return.h>
+#include <sys/kernel_types.h>
+#include <stdint.h>
+#include "../public/PrjFSProviderClientShared.h"
+
 kern_return_t Memory_Init();
 kern_return_t Memory_Cleanup();
 
-void* Memory_Alloc(uint32_t size);
-void Memory_Free(void* buffer, uint32_t size);
+// Fails, returning nullptr, if the allocation would take the subsystem over its budget
+void* Memory_Alloc(KernelMemorySubsystem subsystem, uint32_t size);
+void Memory_Free(KernelMemorySubsystem subsystem, void* buffer, uint32_t size);
+
+// Accounts for wired memory that doesn't come from Memory_Alloc, such as shared
+// data queues. Reserve before allocating it; returns false if that would take
+// the subsystem over its budget. Unreserve once it has been freed.
+bool Memory_Reserve(KernelMemorySubsystem subsystem, uint64_t size);
+void Memory_Unreserve(KernelMemorySubsystem subsystem, uint64_t size);
+
+// 0 removes the subsystem's budget. Budgets apply to every root, so each has a
+// single owner: the provider of the root that set it, until it disconnects and
+// the default budget is restored. Returns EBUSY while another root's provider
+// owns the subsystem's budget.
+errno_t Memory_SetBudget(int32_t ownerRootIndex, KernelMemorySubsystem subsystem, uint64_t budgetBytes);
+
+// Restores the default budgets of the subsystems the root's provider owns
+void Memory_ReleaseBudgetOwnership(int32_t ownerRootIndex);
+
+// Fixed-size element zones for buffers that are allocated and freed on every
+// request. Elements are carved out of slabs which are kept until the kext is
+// unloaded, so the hot path neither fragments the kernel heap nor needs large
+// buffers on the kernel stack.
+enum MemoryZone
+{
+    // PrjFSMaxPath bytes, e.g. for vn_getpath()
+    MemoryZone_PathBuffer,
+    // Small per-request bookkeeping records of up to MemoryZoneRequestRecordSize bytes
+    MemoryZone_RequestRecord,
+    
+    MemoryZone_Count
+};
+
+static const uint32_t MemoryZoneRequestRecordSize = 512;
+
+void* Memory_AllocFromZone(MemoryZone zone);
+void Memory_FreeToZone(MemoryZone zone, void* element);
+uint32_t Memory_GetZoneElementSize(MemoryZone zone);
+
+struct MemoryZoneStats
+{
+    const char* name;
+    uint32_t elementSize;
+    uint32_t slabCount;
+    uint32_t elementsInUse;
+    uint32_t peakElementsInUse;
+    uint64_t allocationCount;
+    uint64_t failedAllocationCount;
+};
+
+struct MemoryHeapStats
+{
+    uint64_t bytesInUse;
+    uint64_t peakBytesInUse;
+    uint64_t allocationCount;
+    uint64_t failedAllocationCount;
+};
+
+struct MemorySubsystemStats
+{
+    const char* name;
+    uint64_t bytesInUse;
+    uint64_t peakBytesInUse;
+    uint64_t budgetBytes;
+    uint64_t overBudgetCount;
+};
+
+void Memory_GetZoneStats(MemoryZone zone, MemoryZoneStats* stats);
+void Memory_GetHeapStats(MemoryHeapStats* stats);
+void Memory_GetSubsystemStats(KernelMemorySubsystem subsystem, MemorySubsystemStats* stats);
 
 #endif /* Memory_h */
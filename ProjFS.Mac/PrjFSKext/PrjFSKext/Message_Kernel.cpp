@@ -1,4 +1,6 @@
 #include <kern/debug.h>
+#include <kern/thread.h>
+#include <libkern/libkern.h>
 #include "Message.h"
 
 void Message_Init(
@@ -8,10 +10,29 @@ void Message_Init(
     MessageType messageType,
     int32_t pid,
     const char* procname,
-    const char* path)
+    fsid_t fsid,
+    uint64_t fileId,
+    const char* path,
+    const char* fromPath)
 {
     header->messageId = messageId;
     header->messageType = messageType;
+    header->pid = pid;
+    header->threadId = thread_tid(current_thread());
+    header->fsid = fsid;
+    header->fileId = fileId;
+    header->fileSize = 0;
+    header->fileType = MessageFileType_Unknown;
+    header->fileXattrSizeBytes = 0;
+    
+    if (nullptr != procname)
+    {
+        strlcpy(header->procname, procname, sizeof(header->procname));
+    }
+    else
+    {
+        header->procname[0] = '\0';
+    }
     
     if (nullptr != path)
     {
@@ -22,6 +43,31 @@ void Message_Init(
         header->pathSizeBytes = 0;
     }
     
+    if (nullptr != fromPath)
+    {
+        header->fromPathSizeBytes = strlen(fromPath) + 1;
+    }
+    else
+    {
+        header->fromPathSizeBytes = 0;
+    }
+    
     spec->messageHeader = header;
     spec->path = path;
+    spec->fromPath = fromPath;
+    spec->fileXattr = nullptr;
+}
+
+void Message_SetPlaceholderInfo(
+    Message* spec,
+    MessageHeader* header,
+    MessageFileType fileType,
+    uint64_t fileSize,
+    const void* fileXattr,
+    uint16_t fileXattrSizeBytes)
+{
+    header->fileType = fileType;
+    header->fileSize = fileSize;
+    header->fileXattrSizeBytes = nullptr != fileXattr ? fileXattrSizeBytes : 0;
+    spec->fileXattr = fileXattr;
 }
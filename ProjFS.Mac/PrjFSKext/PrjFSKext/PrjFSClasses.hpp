@@ -7,3 +7,5 @@ class PrjFSService;
 class PrjFSProviderUserClient;
 #define PrjFSLogUserClient      io_gvfs_PrjFSLogUserClient
 class PrjFSLogUserClient;
+#define ProviderMessageDataQueue io_gvfs_PrjFSProviderMessageDataQueue
+class ProviderMessageDataQueue;
@@ -1,13 +1,54 @@
 #include "PrjFSLogUserClient.hpp"
 #include "PrjFSLogClientShared.h"
 #include "KextLog.hpp"
+#include "ProcessAttribution.hpp"
 #include "PrjFSCommon.h"
+#include "Memory.hpp"
 #include <IOKit/IOSharedDataQueue.h>
 
 
 OSDefineMetaClassAndStructors(PrjFSLogUserClient, IOUserClient);
 // Amount of memory to set aside for kernel -> userspace log messages.
 static const uint32_t LogMessageQueueCapacityBytes = 1024 * 1024;
+// Limits for a log client-selected queue size, to bound wired memory use
+static const uint32_t LogMessageQueueMinCapacityBytes = 64 * 1024;
+static const uint32_t LogMessageQueueMaxCapacityBytes = 64 * 1024 * 1024;
+
+static const IOExternalMethodDispatch LogUserClientDispatch[] =
+{
+    [LogSelector_SetLevelMask] =
+        {
+            .function =                 &PrjFSLogUserClient::setLevelMask,
+            .checkScalarInputCount =    1, // mask of KextLog_LevelMaskBit() values
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0
+        },
+    [LogSelector_SetMessageQueueCapacity] =
+        {
+            .function =                 &PrjFSLogUserClient::setMessageQueueCapacity,
+            .checkScalarInputCount =    1, // capacity in bytes
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [LogSelector_GetLockProfiles] =
+        {
+            .function =                 &PrjFSLogUserClient::getLockProfiles,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = sizeof(KextLog_LockProfiles)
+        },
+    [LogSelector_GetProcessAttributions] =
+        {
+            .function =                 &PrjFSLogUserClient::getProcessAttributions,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = sizeof(KextLog_ProcessAttributions)
+        },
+};
 
 bool PrjFSLogUserClient::initWithTask(
     task_t owningTask,
@@ -20,30 +61,61 @@ bool PrjFSLogUserClient::initWithTask(
         return false;
     }
     
-    this->dataQueueWriterMutex = Mutex_Alloc();
+    this->dataQueueWriterMutex = Mutex_Alloc(LockProfile_LogDataQueueWriter);
     if (!Mutex_IsValid(this->dataQueueWriterMutex))
     {
         this->cleanUp();
         return false;
     }
     
-    this->dataQueue = IOSharedDataQueue::withCapacity(LogMessageQueueCapacityBytes);
-    if (nullptr == this->dataQueue)
+    if (!this->createDataQueue_Locked(LogMessageQueueCapacityBytes))
     {
         this->cleanUp();
         return false;
     }
     
-    this->dataQueueMemory = this->dataQueue->getMemoryDescriptor();
-    if (nullptr == this->dataQueueMemory)
+    this->dataQueueInUse = false;
+    this->droppedMessageCount = 0;
+    this->droppedByteCount = 0;
+    return true;
+    
+}
+
+bool PrjFSLogUserClient::createDataQueue_Locked(uint32_t capacityBytes)
+{
+    if (!Memory_Reserve(KernelMemory_Logging, capacityBytes))
+    {
+        return false;
+    }
+    
+    IOSharedDataQueue* newQueue = IOSharedDataQueue::withCapacity(capacityBytes);
+    if (nullptr == newQueue)
     {
-        this->cleanUp();
+        Memory_Unreserve(KernelMemory_Logging, capacityBytes);
         return false;
     }
     
-    this->logMessageDropped = false;
-    return true;
+    IOMemoryDescriptor* newQueueMemory = newQueue->getMemoryDescriptor();
+    if (nullptr == newQueueMemory)
+    {
+        newQueue->release();
+        Memory_Unreserve(KernelMemory_Logging, capacityBytes);
+        return false;
+    }
     
+    this->freeDataQueue_Locked();
+    this->dataQueue = newQueue;
+    this->dataQueueMemory = newQueueMemory;
+    this->dataQueueCapacityBytes = capacityBytes;
+    return true;
+}
+
+void PrjFSLogUserClient::freeDataQueue_Locked()
+{
+    OSSafeReleaseNULL(this->dataQueueMemory);
+    OSSafeReleaseNULL(this->dataQueue);
+    Memory_Unreserve(KernelMemory_Logging, this->dataQueueCapacityBytes);
+    this->dataQueueCapacityBytes = 0;
 }
 
 void PrjFSLogUserClient::cleanUp()
@@ -56,8 +128,7 @@ void PrjFSLogUserClient::cleanUp()
         Mutex_FreeMemory(&this->dataQueueWriterMutex);
     }
     
-    OSSafeReleaseNULL(this->dataQueueMemory);
-    OSSafeReleaseNULL(this->dataQueue);
+    this->freeDataQueue_Locked();
 }
 
 void PrjFSLogUserClient::free()
@@ -77,15 +148,20 @@ IOReturn PrjFSLogUserClient::clientMemoryForType(UInt32 type, IOOptionBits* opti
 {
     if (type == LogMemoryType_MessageQueue)
     {
-        IOMemoryDescriptor* queueMemory = this->dataQueueMemory;
-        if (queueMemory != nullptr)
+        IOReturn result = kIOReturnError;
+        Mutex_Acquire(this->dataQueueWriterMutex);
         {
-            queueMemory->retain();
-            *memory = queueMemory;
-            return kIOReturnSuccess;
+            IOMemoryDescriptor* queueMemory = this->dataQueueMemory;
+            if (queueMemory != nullptr)
+            {
+                this->dataQueueInUse = true;
+                queueMemory->retain();
+                *memory = queueMemory;
+                result = kIOReturnSuccess;
+            }
         }
-        
-        return kIOReturnError;
+        Mutex_Release(this->dataQueueWriterMutex);
+        return result;
     }
     
     return this->super::clientMemoryForType(type, options, memory);
@@ -95,13 +171,18 @@ IOReturn PrjFSLogUserClient::registerNotificationPort(mach_port_t port, UInt32 t
 {
     if (type == LogPortType_MessageQueue)
     {
-        assert(nullptr != this->dataQueue);
         if (port == MACH_PORT_NULL)
         {
             return kIOReturnError;
         }
         
-        this->dataQueue->setNotificationPort(port);
+        Mutex_Acquire(this->dataQueueWriterMutex);
+        {
+            assert(nullptr != this->dataQueue);
+            this->dataQueueInUse = true;
+            this->dataQueue->setNotificationPort(port);
+        }
+        Mutex_Release(this->dataQueueWriterMutex);
         return kIOReturnSuccess;
     }
     else
@@ -110,20 +191,118 @@ IOReturn PrjFSLogUserClient::registerNotificationPort(mach_port_t port, UInt32 t
     }
 }
 
+IOReturn PrjFSLogUserClient::externalMethod(
+    uint32_t selector,
+    IOExternalMethodArguments* arguments,
+    IOExternalMethodDispatch* dispatch,
+    OSObject* target,
+    void* reference)
+{
+    IOExternalMethodDispatch local_dispatch = {};
+    if (selector < sizeof(LogUserClientDispatch) / sizeof(LogUserClientDispatch[0]))
+    {
+        if (nullptr != LogUserClientDispatch[selector].function)
+        {
+            local_dispatch = LogUserClientDispatch[selector];
+            dispatch = &local_dispatch;
+            target = this;
+        }
+    }
+    return this->super::externalMethod(selector, arguments, dispatch, target, reference);
+}
+
+IOReturn PrjFSLogUserClient::setLevelMask(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    bool isCurrentClient = KextLog_SetLevelMask(
+        static_cast<PrjFSLogUserClient*>(target),
+        static_cast<uint32_t>(arguments->scalarInput[0]));
+    return isCurrentClient ? kIOReturnSuccess : kIOReturnNotPermitted;
+}
+
+IOReturn PrjFSLogUserClient::setMessageQueueCapacity(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSLogUserClient*>(target)->setMessageQueueCapacity(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSLogUserClient::getLockProfiles(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    KextLog_LockProfiles* profiles = static_cast<KextLog_LockProfiles*>(arguments->structureOutput);
+    return Locks_GetProfiles(profiles) ? kIOReturnSuccess : kIOReturnUnsupported;
+}
+
+IOReturn PrjFSLogUserClient::getProcessAttributions(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    KextLog_ProcessAttributions* attributions = static_cast<KextLog_ProcessAttributions*>(arguments->structureOutput);
+    ProcessAttribution_Get(attributions);
+    return kIOReturnSuccess;
+}
+
+// Must be called before the queue is mapped or its notification port is set.
+// Any messages already in the old queue are discarded.
+IOReturn PrjFSLogUserClient::setMessageQueueCapacity(uint64_t capacityBytes, uint64_t* outError)
+{
+    if (capacityBytes < LogMessageQueueMinCapacityBytes || capacityBytes > LogMessageQueueMaxCapacityBytes)
+    {
+        *outError = EINVAL;
+        return kIOReturnSuccess;
+    }
+    
+    Mutex_Acquire(this->dataQueueWriterMutex);
+    {
+        if (this->dataQueueInUse)
+        {
+            *outError = EBUSY;
+        }
+        else
+        {
+            *outError = this->createDataQueue_Locked(static_cast<uint32_t>(capacityBytes)) ? 0 : ENOMEM;
+        }
+    }
+    Mutex_Release(this->dataQueueWriterMutex);
+    
+    return kIOReturnSuccess;
+}
+
 void PrjFSLogUserClient::sendLogMessage(KextLog_MessageHeader* message, uint32_t size)
 {
     Mutex_Acquire(this->dataQueueWriterMutex);
     {
-        if (this->logMessageDropped)
+        if (this->droppedMessageCount > 0)
         {
-            this->logMessageDropped = false;
             message->flags |= LogMessageFlag_LogMessagesDropped;
         }
+        
+        message->droppedMessageCount = this->droppedMessageCount;
+        message->droppedByteCount = this->droppedByteCount;
  
         bool ok = this->dataQueue->enqueue(message, size);
-        if (!ok)
+        if (ok)
+        {
+            this->droppedMessageCount = 0;
+            this->droppedByteCount = 0;
+        }
+        else
         {
-            this->logMessageDropped = true;
+            if (this->droppedMessageCount < UINT32_MAX)
+            {
+                this->droppedMessageCount++;
+            }
+            
+            this->droppedByteCount += size;
         }
     }
     Mutex_Release(this->dataQueueWriterMutex);
@@ -15,9 +15,18 @@ private:
     typedef IOUserClient super;
     IOSharedDataQueue* dataQueue;
     IOMemoryDescriptor* dataQueueMemory;
+    // Reserved from the KernelMemory_Logging budget while there is a queue
+    uint32_t dataQueueCapacityBytes;
+    // The queue can only be resized until user space starts using it
+    bool dataQueueInUse;
+    // Protects the fields above and below
     Mutex dataQueueWriterMutex;
-    bool logMessageDropped;
+    // Messages which could not be enqueued since the last one that was
+    uint32_t droppedMessageCount;
+    uint64_t droppedByteCount;
     void cleanUp();
+    bool createDataQueue_Locked(uint32_t capacityBytes);
+    void freeDataQueue_Locked();
 public:
     virtual bool initWithTask(task_t owningTask, void* securityToken, UInt32 type, OSDictionary* properties) override;
     
@@ -25,6 +34,34 @@ public:
     virtual IOReturn clientClose() override;
     virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) override;
     virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon) override;
+    virtual IOReturn externalMethod(
+        uint32_t selector,
+        IOExternalMethodArguments* arguments,
+        IOExternalMethodDispatch* dispatch = 0,
+        OSObject* target = 0,
+        void* reference = 0) override;
     
     void sendLogMessage(KextLog_MessageHeader* message, uint32_t size);
+
+    // External methods:
+    static IOReturn setLevelMask(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+
+    static IOReturn setMessageQueueCapacity(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setMessageQueueCapacity(uint64_t capacityBytes, uint64_t* outError);
+
+    static IOReturn getLockProfiles(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+
+    static IOReturn getProcessAttributions(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
 };
@@ -3,23 +3,63 @@
 #include "../public/PrjFSProviderClientShared.h"
 #include "Message.h"
 #include "KauthHandler.hpp"
+#include "ProcessPolicy.hpp"
 #include "VirtualizationRoots.hpp"
+#include "KextLog.hpp"
+#include "Locks.hpp"
+#include "Memory.hpp"
 
 #include <IOKit/IOSharedDataQueue.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <sys/proc.h>
+#include <sys/file.h>
+
+// An IOSharedDataQueue whose entries can be written in place: reserveEntry()
+// finds room for an entry without making it visible to user space, and
+// commitEntry() publishes it, so a message goes straight from its parts into
+// the queue. Entries are laid out, and published, as IOSharedDataQueue::enqueue()
+// does it, so user space reads them with IODataQueueDequeue() as before.
+class ProviderMessageDataQueue : public IOSharedDataQueue
+{
+    OSDeclareDefaultStructors(ProviderMessageDataQueue);
+private:
+    typedef IOSharedDataQueue super;
+    
+public:
+    static ProviderMessageDataQueue* withCapacity(uint32_t capacityBytes);
+    
+    // Returns where the entry's dataSize bytes go, or nullptr if the queue is
+    // full. The caller must hold the queue's writer mutex until it has called
+    // commitEntry() with outNewTail.
+    void* reserveEntry(uint32_t dataSize, uint32_t* outNewTail);
+    void commitEntry(uint32_t newTail);
+};
 
 OSDefineMetaClassAndStructors(PrjFSProviderUserClient, IOUserClient);
+OSDefineMetaClassAndStructors(ProviderMessageDataQueue, IOSharedDataQueue);
 
-// Amount of memory to set aside for kernel -> userspace messages.
+// Amount of memory to set aside for kernel -> userspace messages, per queue.
 // Should be chosen to comfortably hold "enough" Message structs and associated path strings.
 static const uint32_t ProviderMessageQueueCapacityBytes = 100 * 1024;
+// Limits for a provider-selected queue size and for all of a provider's queues
+// together, to bound wired memory use
+static const uint32_t ProviderMessageQueueMinCapacityBytes = 16 * 1024;
+static const uint32_t ProviderMessageQueueMaxCapacityBytes = 16 * 1024 * 1024;
+static const uint64_t ProviderMessageQueuesMaxTotalBytes = 32 * 1024 * 1024;
+
+// When the queue is full, writers sleep until user space signals that it has
+// drained the queue, re-checking at least this often, and give up after the
+// total time limit.
+static const uint32_t ProviderMessageQueueFullRetryMilliseconds = 10;
+static const uint32_t ProviderMessageQueueFullMaxWaitMilliseconds = 5000;
 
+static void SetNumberInDictionary(OSDictionary* dictionary, const char* key, uint64_t value);
 
 static const IOExternalMethodDispatch ProviderUserClientDispatch[] =
 {
     [ProviderSelector_RegisterVirtualizationRootPath] =
         {
-            &PrjFSProviderUserClient::registerVirtualizationRoot, 0, kIOUCVariableStructureSize, 1, 0
+            &PrjFSProviderUserClient::registerVirtualizationRoot, 1 /* ProviderRootFlags */, kIOUCVariableStructureSize, 1, 0
         },
     [ProviderSelector_KernelMessageResponse] =
         {
@@ -29,6 +69,134 @@ static const IOExternalMethodDispatch ProviderUserClientDispatch[] =
             .checkScalarOutputCount =   0,
             .checkStructureOutputSize = 0
         },
+    [ProviderSelector_SetRequestTimeout] =
+        {
+            .function =                 &PrjFSProviderUserClient::setRequestTimeout,
+            .checkScalarInputCount =    2, // message type, timeout in milliseconds
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetMessageQueueCapacity] =
+        {
+            .function =                 &PrjFSProviderUserClient::setMessageQueueCapacity,
+            .checkScalarInputCount =    1, // capacity in bytes
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_MessageQueueDrained] =
+        {
+            .function =                 &PrjFSProviderUserClient::messageQueueDrained,
+            .checkScalarInputCount =    1, // queue index
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_KernelMessageResponseBatch] =
+        {
+            .function =                 &PrjFSProviderUserClient::kernelMessageResponseBatch,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  kIOUCVariableStructureSize, // array of KernelMessageResponse
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetProcessPolicies] =
+        {
+            .function =                 &PrjFSProviderUserClient::setProcessPolicies,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  kIOUCVariableStructureSize, // array of ProcessPolicyEntry, may be empty
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetNotificationMappings] =
+        {
+            .function =                 &PrjFSProviderUserClient::setNotificationMappings,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  kIOUCVariableStructureSize, // packed NotificationMappingEntry list, may be empty
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_DrainModifiedFiles] =
+        {
+            .function =                 &PrjFSProviderUserClient::drainModifiedFiles,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   3, // error, entries remaining, overflowed
+            .checkStructureOutputSize = kIOUCVariableStructureSize // array of ModifiedFileEntry
+        },
+    [ProviderSelector_SetPrefetchHintInterval] =
+        {
+            .function =                 &PrjFSProviderUserClient::setPrefetchHintInterval,
+            .checkScalarInputCount =    1, // interval in milliseconds, 0 disables hints
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_ReattachVirtualizationRoot] =
+        {
+            .function =                 &PrjFSProviderUserClient::reattachVirtualizationRoot,
+            .checkScalarInputCount =    1, // ProviderRootFlags
+            .checkStructureInputSize =  sizeof(VirtualizationRootIdentity),
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_ResponseRingDoorbell] =
+        {
+            .function =                 &PrjFSProviderUserClient::responseRingDoorbell,
+            .checkScalarInputCount =    0,
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   0,
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetMessageQueueCount] =
+        {
+            .function =                 &PrjFSProviderUserClient::setMessageQueueCount,
+            .checkScalarInputCount =    1, // queue count
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetHelperProcesses] =
+        {
+            .function =                 &PrjFSProviderUserClient::setHelperProcesses,
+            .checkScalarInputCount =    1, // process group id, 0 for none
+            .checkStructureInputSize =  kIOUCVariableStructureSize, // array of int32_t pids, may be empty
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetRequestRateLimit] =
+        {
+            .function =                 &PrjFSProviderUserClient::setRequestRateLimit,
+            .checkScalarInputCount =    3, // requests per second (0 for no limit), burst, max delay in milliseconds
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_NegotiateCapabilities] =
+        {
+            .function =                 &PrjFSProviderUserClient::negotiateCapabilities,
+            .checkScalarInputCount =    1, // ProviderCapabilityFlags known to user space
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // ProviderCapabilityFlags to use
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_SetMemoryBudget] =
+        {
+            .function =                 &PrjFSProviderUserClient::setMemoryBudget,
+            .checkScalarInputCount =    2, // KernelMemorySubsystem, budget in bytes (0 for none)
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
+    [ProviderSelector_FileFlagsChanged] =
+        {
+            .function =                 &PrjFSProviderUserClient::fileFlagsChanged,
+            .checkScalarInputCount =    1, // file descriptor
+            .checkStructureInputSize =  0,
+            .checkScalarOutputCount =   1, // error
+            .checkStructureOutputSize = 0
+        },
 };
 
 bool PrjFSProviderUserClient::initWithTask(
@@ -39,64 +207,240 @@ bool PrjFSProviderUserClient::initWithTask(
 {
     this->virtualizationRootIndex = -1;
     this->pid = proc_selfpid();
+    this->messageQueueCount = 1;
+    this->messageQueueCapacityBytes = ProviderMessageQueueCapacityBytes;
+    atomic_store(&this->queueFullCount, 0);
+    atomic_store(&this->droppedMessageCount, 0);
+    this->responseRingHead = 0;
+    this->responseRingOverrunCount = 0;
+    this->negotiatedCapabilities = ProviderCapability_None;
 
     if (!this->super::initWithTask(owningTask, securityToken, type, properties))
     {
         return false;
     }
     
-    this->dataQueueWriterMutex = Mutex_Alloc();
-    if (!Mutex_IsValid(this->dataQueueWriterMutex))
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        this->messageQueues[i].writerMutex = Mutex_Alloc(LockProfile_ProviderDataQueueWriter);
+        if (!Mutex_IsValid(this->messageQueues[i].writerMutex))
+        {
+            goto CleanupAndFail;
+        }
+    }
+    
+    if (!this->createDataQueue_Locked(this->messageQueues[0], ProviderMessageQueueCapacityBytes))
     {
         goto CleanupAndFail;
     }
     
-    this->dataQueue = IOSharedDataQueue::withCapacity(ProviderMessageQueueCapacityBytes);
-    if (nullptr == this->dataQueue)
+    this->responseRingMutex = Mutex_Alloc(LockProfile_ProviderResponseRing);
+    if (!Mutex_IsValid(this->responseRingMutex))
     {
         goto CleanupAndFail;
     }
     
-    this->dataQueueMemory = this->dataQueue->getMemoryDescriptor();
-    if (nullptr == this->dataQueueMemory)
+    if (!Memory_Reserve(KernelMemory_MessageQueues, sizeof(ResponseRing)))
     {
         goto CleanupAndFail;
     }
     
+    this->responseRingMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(ResponseRing), PAGE_SIZE);
+    if (nullptr == this->responseRingMemory)
+    {
+        Memory_Unreserve(KernelMemory_MessageQueues, sizeof(ResponseRing));
+        goto CleanupAndFail;
+    }
+    
+    this->responseRing = static_cast<ResponseRing*>(this->responseRingMemory->getBytesNoCopy());
+    memset(this->responseRing, 0, sizeof(ResponseRing));
+    this->responseRing->doorbellArmed = 1;
+    
     return true;
     
 CleanupAndFail:
-    if (Mutex_IsValid(this->dataQueueWriterMutex))
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        this->freeDataQueue_Locked(this->messageQueues[i]);
+        if (Mutex_IsValid(this->messageQueues[i].writerMutex))
+        {
+            Mutex_FreeMemory(&this->messageQueues[i].writerMutex);
+        }
+    }
+    
+    if (Mutex_IsValid(this->responseRingMutex))
     {
-        Mutex_FreeMemory(&this->dataQueueWriterMutex);
+        Mutex_FreeMemory(&this->responseRingMutex);
     }
     
-    OSSafeReleaseNULL(this->dataQueueMemory);
-    OSSafeReleaseNULL(this->dataQueue);
+    this->responseRing = nullptr;
+    if (nullptr != this->responseRingMemory)
+    {
+        this->responseRingMemory->release();
+        this->responseRingMemory = nullptr;
+        Memory_Unreserve(KernelMemory_MessageQueues, sizeof(ResponseRing));
+    }
     return false;
 }
 
 void PrjFSProviderUserClient::free()
 {
-    OSSafeReleaseNULL(this->dataQueueMemory);
-    OSSafeReleaseNULL(this->dataQueue);
-    if (Mutex_IsValid(this->dataQueueWriterMutex))
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        this->freeDataQueue_Locked(this->messageQueues[i]);
+        if (Mutex_IsValid(this->messageQueues[i].writerMutex))
+        {
+            Mutex_FreeMemory(&this->messageQueues[i].writerMutex);
+        }
+    }
+    
+    this->responseRing = nullptr;
+    if (nullptr != this->responseRingMemory)
+    {
+        this->responseRingMemory->release();
+        this->responseRingMemory = nullptr;
+        Memory_Unreserve(KernelMemory_MessageQueues, sizeof(ResponseRing));
+    }
+    if (Mutex_IsValid(this->responseRingMutex))
     {
-        Mutex_FreeMemory(&this->dataQueueWriterMutex);
+        Mutex_FreeMemory(&this->responseRingMutex);
     }
     
     this->super::free();
 }
 
+// Refreshes the statistics property so that tools such as ioreg see current
+// values without the kext having to update the registry on every request.
+bool PrjFSProviderUserClient::serializeProperties(OSSerialize* serialize) const
+{
+    int32_t rootIndex = this->virtualizationRootIndex;
+    if (-1 != rootIndex)
+    {
+        OSDictionary* statistics = nullptr;
+        OSArray* histogram = nullptr;
+        VirtualizationRootRequestStatsSnapshot stats = {};
+        VirtualizationRoot_GetRequestStats(rootIndex, &stats);
+        
+        statistics = OSDictionary::withCapacity(16);
+        histogram = OSArray::withCapacity(VirtualizationRootWaitHistogramBucketCount);
+        if (nullptr == statistics || nullptr == histogram)
+        {
+            goto CleanupStatistics;
+        }
+        
+        SetNumberInDictionary(statistics, "KauthCallbacks", stats.kauthCallbackCount);
+        SetNumberInDictionary(statistics, "ProviderPidDefers", stats.providerPidDeferCount);
+        SetNumberInDictionary(statistics, "EnumerationsSent", stats.enumerationsSentCount);
+        SetNumberInDictionary(statistics, "HydrationsSent", stats.hydrationsSentCount);
+        SetNumberInDictionary(statistics, "CoalescedWaits", stats.coalescedWaitCount);
+        SetNumberInDictionary(statistics, "CancelsSent", stats.cancelsSentCount);
+        SetNumberInDictionary(statistics, "NotificationsSent", stats.notificationsSentCount);
+        SetNumberInDictionary(statistics, "NotificationsFiltered", stats.notificationsFilteredCount);
+        SetNumberInDictionary(statistics, "ModifiedFilesRecorded", stats.modifiedFilesRecordedCount);
+        SetNumberInDictionary(statistics, "ModifiedFilesDuplicate", stats.modifiedFilesDuplicateCount);
+        SetNumberInDictionary(statistics, "PrefetchHintsSent", stats.prefetchHintsSentCount);
+        SetNumberInDictionary(statistics, "PrefetchHintsDropped", stats.prefetchHintsDroppedCount);
+        SetNumberInDictionary(statistics, "RateLimitDelays", stats.rateLimitDelayedCount);
+        SetNumberInDictionary(statistics, "RateLimitDenials", stats.rateLimitDeniedCount);
+        SetNumberInDictionary(statistics, "Responses", stats.responseCount);
+        SetNumberInDictionary(statistics, "Timeouts", stats.timeoutCount);
+        SetNumberInDictionary(statistics, "ProviderDisconnects", stats.providerDisconnectedCount);
+        SetNumberInDictionary(statistics, "Interrupts", stats.interruptedCount);
+        SetNumberInDictionary(statistics, "TotalWaitNanoseconds", stats.totalWaitNanoseconds);
+        SetNumberInDictionary(statistics, "MaxWaitNanoseconds", stats.maxWaitNanoseconds);
+        SetNumberInDictionary(statistics, "SpinWaitResponses", stats.spinWaitResponseCount);
+        SetNumberInDictionary(statistics, "UnresponsiveEpisodes", stats.unresponsiveCount);
+        SetNumberInDictionary(statistics, "UnresponsiveRejections", stats.unresponsiveRejectedCount);
+        SetNumberInDictionary(statistics, "MessageQueues", this->messageQueueCount);
+        SetNumberInDictionary(statistics, "QueueFullEvents", atomic_load(&this->queueFullCount));
+        SetNumberInDictionary(statistics, "DroppedMessages", atomic_load(&this->droppedMessageCount));
+        SetNumberInDictionary(statistics, "ResponseRingOverruns", this->responseRingOverrunCount);
+        SetNumberInDictionary(statistics, "NegotiatedCapabilities", this->negotiatedCapabilities);
+        
+        // Queue sizes only change while user space isn't using the queues, so
+        // reading them without the writer mutexes is good enough for reporting
+        uint64_t messageQueueBytes = nullptr != this->responseRingMemory ? sizeof(ResponseRing) : 0;
+        for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+        {
+            messageQueueBytes += this->messageQueues[i].capacityBytes;
+        }
+        
+        SetNumberInDictionary(statistics, "MessageQueueBytes", messageQueueBytes);
+        SetNumberInDictionary(statistics, "WiredBytes", messageQueueBytes + VirtualizationRoot_GetWiredBytes(rootIndex));
+        
+        // Element i counts waits of [2^i, 2^(i+1)) microseconds
+        for (uint32_t i = 0; i < VirtualizationRootWaitHistogramBucketCount; ++i)
+        {
+            OSNumber* bucket = OSNumber::withNumber(stats.waitHistogram[i], 64);
+            if (nullptr == bucket)
+            {
+                goto CleanupStatistics;
+            }
+            
+            histogram->setObject(bucket);
+            bucket->release();
+        }
+        
+        statistics->setObject("WaitMicrosecondsLog2Histogram", histogram);
+        
+        // setProperty only modifies the property table, which has its own lock
+        const_cast<PrjFSProviderUserClient*>(this)->setProperty(PrjFSProviderStatisticsKey, statistics);
+        
+    CleanupStatistics:
+        OSSafeReleaseNULL(histogram);
+        OSSafeReleaseNULL(statistics);
+    }
+    
+    return this->super::serializeProperties(serialize);
+}
+
+static void SetNumberInDictionary(OSDictionary* dictionary, const char* key, uint64_t value)
+{
+    OSNumber* number = OSNumber::withNumber(value, 64);
+    if (nullptr != number)
+    {
+        dictionary->setObject(key, number);
+        number->release();
+    }
+}
+
 // Called when the user process explicitly or implicitly (process death) closes
 // the connection.
 IOReturn PrjFSProviderUserClient::clientClose()
 {
+    // Release any writers blocked on a full queue
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        ProviderMessageQueue& queue = this->messageQueues[i];
+        Mutex_Acquire(queue.writerMutex);
+        {
+            queue.isClosing = true;
+            wakeup(&queue);
+        }
+        Mutex_Release(queue.writerMutex);
+    }
+    
+    uint64_t queueFullCount = atomic_load(&this->queueFullCount);
+    if (queueFullCount > 0)
+    {
+        KextLog_Info(
+            "PrjFSProviderUserClient::clientClose: provider pid %d: message queues were full %llu times, %llu messages dropped",
+            this->pid, queueFullCount, atomic_load(&this->droppedMessageCount));
+    }
+    
     int32_t root = this->virtualizationRootIndex;
     this->virtualizationRootIndex = -1;
     if (-1 != root)
     {
+        // Responses written before closing still count
+        this->drainResponseRing();
+        
         ActiveProvider_Disconnect(root);
+        ProcessPolicy_ReleaseOwnership(root);
+        Memory_ReleaseBudgetOwnership(root);
+        
+        // Nobody is going to respond to requests that are still pending
+        KauthHandler_HandleProviderDisconnect(root);
     }
     
     this->terminate(0);
@@ -110,19 +454,34 @@ IOReturn PrjFSProviderUserClient::clientMemoryForType(
     IOOptionBits* options,
     IOMemoryDescriptor** memory)
 {
-    switch (type)
+    ProviderMessageQueue* queue = this->getMessageQueueForMemoryOrPortType(type, ProviderMemoryType_MessageQueue);
+    if (nullptr != queue)
     {
-    case ProviderMemoryType_MessageQueue:
+        IOReturn result = kIOReturnError;
+        Mutex_Acquire(queue->writerMutex);
         {
-            IOMemoryDescriptor* queueMemory = this->dataQueueMemory;
+            IOMemoryDescriptor* queueMemory = queue->dataQueueMemory;
             if (queueMemory != nullptr)
             {
+                queue->inUse = true;
                 queueMemory->retain(); // Matched internally in IOUserClient
                 *memory = queueMemory;
-                return kIOReturnSuccess;
+                result = kIOReturnSuccess;
             }
         }
-        break;
+        Mutex_Release(queue->writerMutex);
+        return result;
+    }
+    
+    switch (type)
+    {
+    case ProviderMemoryType_ResponseRing:
+        {
+            // The ring exists for the whole lifetime of the user client
+            this->responseRingMemory->retain(); // Matched internally in IOUserClient
+            *memory = this->responseRingMemory;
+            return kIOReturnSuccess;
+        }
     }
     
     return kIOReturnError;
@@ -133,16 +492,27 @@ IOReturn PrjFSProviderUserClient::registerNotificationPort(
     UInt32 type,
     io_user_reference_t refCon)
 {
-    if (type == ProviderPortType_MessageQueue)
+    ProviderMessageQueue* queue = this->getMessageQueueForMemoryOrPortType(type, ProviderPortType_MessageQueue);
+    if (nullptr != queue)
     {
-        assert(nullptr != this->dataQueue);
         if(port == MACH_PORT_NULL)
         {
             return kIOReturnError;
         }
         
-        this->dataQueue->setNotificationPort(port);
-        return kIOReturnSuccess;
+        IOReturn result = kIOReturnError;
+        Mutex_Acquire(queue->writerMutex);
+        {
+            // The queue count may have been lowered since we looked it up
+            if (nullptr != queue->dataQueue)
+            {
+                queue->inUse = true;
+                queue->dataQueue->setNotificationPort(port);
+                result = kIOReturnSuccess;
+            }
+        }
+        Mutex_Release(queue->writerMutex);
+        return result;
     }
     else
     {
@@ -183,66 +553,930 @@ IOReturn PrjFSProviderUserClient::kernelMessageResponse(
 IOReturn PrjFSProviderUserClient::kernelMessageResponse(uint64_t messageId, MessageType responseType)
 {
     KauthHandler_HandleKernelMessageResponse(messageId, responseType);
+    this->recordResponses();
     return kIOReturnSuccess;
 }
 
-IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(
+IOReturn PrjFSProviderUserClient::kernelMessageResponseBatch(
     OSObject* target,
     void* reference,
     IOExternalMethodArguments* arguments)
 {
-    // We don't support larger strings, including those large enough to warrant a memory descriptor
-    if (arguments->structureInputSize > PrjFSMaxPath || nullptr == arguments->structureInput)
+    uint32_t size = arguments->structureInputSize;
+    if (nullptr == arguments->structureInput ||
+        0 == size ||
+        0 != size % sizeof(KernelMessageResponse) ||
+        size / sizeof(KernelMessageResponse) > MaxKernelMessageResponsesPerBatch)
     {
         return kIOReturnBadArgument;
     }
     
-    return static_cast<PrjFSProviderUserClient*>(target)->registerVirtualizationRoot(
-        static_cast<const char*>(arguments->structureInput),
-        arguments->structureInputSize,
+    return static_cast<PrjFSProviderUserClient*>(target)->kernelMessageResponseBatch(
+        static_cast<const KernelMessageResponse*>(arguments->structureInput),
+        size / sizeof(KernelMessageResponse));
+}
+
+IOReturn PrjFSProviderUserClient::kernelMessageResponseBatch(const KernelMessageResponse* responses, uint32_t responseCount)
+{
+    for (uint32_t i = 0; i < responseCount; ++i)
+    {
+        KauthHandler_HandleKernelMessageResponse(responses[i].messageId, static_cast<MessageType>(responses[i].responseType));
+    }
+    
+    this->recordResponses();
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setRequestTimeout(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setRequestTimeout(
+        static_cast<MessageType>(arguments->scalarInput[0]),
+        arguments->scalarInput[1],
         &arguments->scalarOutput[0]);
 }
 
-IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(const char* rootPath, size_t rootPathSize, uint64_t* outError)
+IOReturn PrjFSProviderUserClient::setRequestTimeout(MessageType messageType, uint64_t timeoutMilliseconds, uint64_t* outError)
 {
-    if (rootPathSize == 0 || strnlen(rootPath, rootPathSize) != rootPathSize - 1)
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else if (timeoutMilliseconds > UINT32_MAX)
     {
         *outError = EINVAL;
-        return kIOReturnSuccess;
     }
-    else if (this->virtualizationRootIndex != -1)
+    else
     {
-        // Already set
-        *outError = EBUSY;
+        *outError = ActiveProvider_SetRequestTimeout(this->virtualizationRootIndex, messageType, static_cast<uint32_t>(timeoutMilliseconds));
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setMessageQueueCapacity(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setMessageQueueCapacity(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+// Sets the capacity of each queue. Must be called before any queue is mapped or
+// has its notification port set.
+IOReturn PrjFSProviderUserClient::setMessageQueueCapacity(uint64_t capacityBytes, uint64_t* outError)
+{
+    if (capacityBytes < ProviderMessageQueueMinCapacityBytes || capacityBytes > ProviderMessageQueueMaxCapacityBytes)
+    {
+        *outError = EINVAL;
         return kIOReturnSuccess;
     }
     
-    VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(this, this->pid, rootPath);
-    if (0 == result.error)
+    this->acquireAllMessageQueues();
     {
-        this->virtualizationRootIndex = result.rootIndex;
+        if (this->anyMessageQueueInUse_Locked())
+        {
+            *outError = EBUSY;
+        }
+        else if (capacityBytes * this->messageQueueCount > ProviderMessageQueuesMaxTotalBytes)
+        {
+            *outError = EINVAL;
+        }
+        else
+        {
+            *outError = 0;
+            this->messageQueueCapacityBytes = static_cast<uint32_t>(capacityBytes);
+            for (uint32_t i = 0; i < this->messageQueueCount; ++i)
+            {
+                // A queue we fail to replace keeps its old capacity
+                if (!this->createDataQueue_Locked(this->messageQueues[i], static_cast<uint32_t>(capacityBytes)))
+                {
+                    *outError = ENOMEM;
+                }
+            }
+        }
+    }
+    this->releaseAllMessageQueues();
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setMessageQueueCount(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setMessageQueueCount(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
 
-        // Sets the root index in the IORegistry for diagnostic purposes
-        char location[5] = "";
-        snprintf(location, sizeof(location), "%d", result.rootIndex);
-        this->setLocation(location);
+// Must be called before registering a root, and before any queue is mapped or
+// has its notification port set.
+IOReturn PrjFSProviderUserClient::setMessageQueueCount(uint64_t queueCount, uint64_t* outError)
+{
+    if (0 == queueCount || queueCount > MaxProviderMessageQueues)
+    {
+        *outError = EINVAL;
+        return kIOReturnSuccess;
     }
     
-    *outError = result.error;
+    this->acquireAllMessageQueues();
+    {
+        if (this->virtualizationRootIndex != -1 || this->anyMessageQueueInUse_Locked())
+        {
+            *outError = EBUSY;
+        }
+        else if (queueCount * this->messageQueueCapacityBytes > ProviderMessageQueuesMaxTotalBytes)
+        {
+            *outError = EINVAL;
+        }
+        else
+        {
+            *outError = 0;
+            uint32_t newCount = static_cast<uint32_t>(queueCount);
+            for (uint32_t i = this->messageQueueCount; i < newCount; ++i)
+            {
+                if (!this->createDataQueue_Locked(this->messageQueues[i], this->messageQueueCapacityBytes))
+                {
+                    *outError = ENOMEM;
+                    newCount = i;
+                    break;
+                }
+            }
+            
+            if (0 != *outError)
+            {
+                // Leave the count as it was
+                for (uint32_t i = this->messageQueueCount; i < newCount; ++i)
+                {
+                    this->freeDataQueue_Locked(this->messageQueues[i]);
+                }
+            }
+            else
+            {
+                for (uint32_t i = newCount; i < this->messageQueueCount; ++i)
+                {
+                    this->freeDataQueue_Locked(this->messageQueues[i]);
+                }
+                
+                this->messageQueueCount = newCount;
+            }
+        }
+    }
+    this->releaseAllMessageQueues();
     
     return kIOReturnSuccess;
 }
 
-void PrjFSProviderUserClient::sendMessage(const void* message, uint32_t size)
+IOReturn PrjFSProviderUserClient::setProcessPolicies(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    uint32_t size = arguments->structureInputSize;
+    if ((0 != size && nullptr == arguments->structureInput) ||
+        0 != size % sizeof(ProcessPolicyEntry))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    return static_cast<PrjFSProviderUserClient*>(target)->setProcessPolicies(
+        static_cast<const ProcessPolicyEntry*>(arguments->structureInput),
+        size / sizeof(ProcessPolicyEntry),
+        &arguments->scalarOutput[0]);
+}
+
+// The policies apply to kauth decisions for all virtualization roots, so only
+// one root's provider may set them at a time.
+IOReturn PrjFSProviderUserClient::setProcessPolicies(const ProcessPolicyEntry* entries, uint32_t entryCount, uint64_t* outError)
 {
-    Mutex_Acquire(this->dataQueueWriterMutex);
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else
     {
-        // IOSharedDataQueue::enqueue() only reads (memcpy source), but doesn't take a const pointer for some reason
-        bool ok = this->dataQueue->enqueue(const_cast<void*>(message), size);
-        assert(ok);
+        *outError = ProcessPolicy_SetEntries(this->virtualizationRootIndex, entries, entryCount);
+    }
+    
+    return kIOReturnSuccess;
+}
 
-        // TODO: block here and try again when space has cleared if enqueueing fails
+IOReturn PrjFSProviderUserClient::setNotificationMappings(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    // Larger inputs arrive as a memory descriptor, which we don't support
+    if ((0 != arguments->structureInputSize && nullptr == arguments->structureInput) ||
+        arguments->structureInputSize > MaxNotificationMappingsSizeBytes)
+    {
+        return kIOReturnBadArgument;
     }
-    Mutex_Release(this->dataQueueWriterMutex);
+    
+    return static_cast<PrjFSProviderUserClient*>(target)->setNotificationMappings(
+        arguments->structureInput,
+        arguments->structureInputSize,
+        &arguments->scalarOutput[0]);
 }
 
+IOReturn PrjFSProviderUserClient::setNotificationMappings(const void* mappings, uint32_t mappingsSize, uint64_t* outError)
+{
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else
+    {
+        *outError = ActiveProvider_SetNotificationMappings(this->virtualizationRootIndex, mappings, mappingsSize);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setPrefetchHintInterval(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setPrefetchHintInterval(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::setPrefetchHintInterval(uint64_t intervalMilliseconds, uint64_t* outError)
+{
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else if (intervalMilliseconds > UINT32_MAX)
+    {
+        *outError = EINVAL;
+    }
+    else
+    {
+        *outError = ActiveProvider_SetPrefetchHintInterval(this->virtualizationRootIndex, static_cast<uint32_t>(intervalMilliseconds));
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setRequestRateLimit(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setRequestRateLimit(
+        arguments->scalarInput[0],
+        arguments->scalarInput[1],
+        arguments->scalarInput[2],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::setRequestRateLimit(uint64_t requestsPerSecond, uint64_t burst, uint64_t maxDelayMilliseconds, uint64_t* outError)
+{
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else if (requestsPerSecond > UINT32_MAX || burst > UINT32_MAX || maxDelayMilliseconds > UINT32_MAX)
+    {
+        *outError = EINVAL;
+    }
+    else
+    {
+        *outError = ActiveProvider_SetRequestRateLimit(
+            this->virtualizationRootIndex,
+            static_cast<uint32_t>(requestsPerSecond),
+            static_cast<uint32_t>(burst),
+            static_cast<uint32_t>(maxDelayMilliseconds));
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setHelperProcesses(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    uint32_t size = arguments->structureInputSize;
+    if ((0 != size && nullptr == arguments->structureInput) ||
+        size % sizeof(int32_t) != 0 ||
+        size > MaxProviderHelperProcesses * sizeof(int32_t))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    return static_cast<PrjFSProviderUserClient*>(target)->setHelperProcesses(
+        static_cast<const int32_t*>(arguments->structureInput),
+        size / sizeof(int32_t),
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::setHelperProcesses(const int32_t* pids, uint32_t pidCount, uint64_t processGroupId, uint64_t* outError)
+{
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else if (processGroupId > INT32_MAX)
+    {
+        *outError = EINVAL;
+    }
+    else
+    {
+        *outError = ActiveProvider_SetHelperProcesses(this->virtualizationRootIndex, pids, pidCount, static_cast<int32_t>(processGroupId));
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::drainModifiedFiles(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    // Larger outputs would need a memory descriptor, which we don't support
+    uint32_t size = arguments->structureOutputSize;
+    if (nullptr == arguments->structureOutput || size > MaxModifiedFileEntriesPerDrain * sizeof(ModifiedFileEntry))
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    uint32_t entryCount = 0;
+    IOReturn result = static_cast<PrjFSProviderUserClient*>(target)->drainModifiedFiles(
+        static_cast<ModifiedFileEntry*>(arguments->structureOutput),
+        size / sizeof(ModifiedFileEntry),
+        &entryCount,
+        &arguments->scalarOutput[0],
+        &arguments->scalarOutput[1],
+        &arguments->scalarOutput[2]);
+    arguments->structureOutputSize = entryCount * sizeof(ModifiedFileEntry);
+    return result;
+}
+
+IOReturn PrjFSProviderUserClient::drainModifiedFiles(
+    ModifiedFileEntry* outEntries,
+    uint32_t maxEntryCount,
+    uint32_t* outEntryCount,
+    uint64_t* outError,
+    uint64_t* outRemainingCount,
+    uint64_t* outOverflowed)
+{
+    uint32_t remainingCount = 0;
+    bool overflowed = false;
+    
+    if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outEntryCount = 0;
+        *outError = ENODEV;
+    }
+    else
+    {
+        *outError = ActiveProvider_DrainModifiedFiles(
+            this->virtualizationRootIndex,
+            outEntries,
+            maxEntryCount,
+            outEntryCount,
+            &remainingCount,
+            &overflowed);
+    }
+    
+    *outRemainingCount = remainingCount;
+    *outOverflowed = overflowed;
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::messageQueueDrained(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->messageQueueDrained(arguments->scalarInput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::messageQueueDrained(uint64_t queueIndex)
+{
+    if (queueIndex >= this->messageQueueCount)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    ProviderMessageQueue& queue = this->messageQueues[queueIndex];
+    Mutex_Acquire(queue.writerMutex);
+    {
+        wakeup(&queue);
+    }
+    Mutex_Release(queue.writerMutex);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::responseRingDoorbell(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    static_cast<PrjFSProviderUserClient*>(target)->drainResponseRing();
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::negotiateCapabilities(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->negotiateCapabilities(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+// Unknown flags are newer features of user space, which this kext doesn't have
+IOReturn PrjFSProviderUserClient::negotiateCapabilities(uint64_t userCapabilities, uint64_t* outCapabilities)
+{
+    this->negotiatedCapabilities = userCapabilities & ProviderCapability_All;
+    *outCapabilities = this->negotiatedCapabilities;
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::setMemoryBudget(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->setMemoryBudget(
+        arguments->scalarInput[0],
+        arguments->scalarInput[1],
+        &arguments->scalarOutput[0]);
+}
+
+// Like the process policies, budgets apply to the whole kext, so only one root's
+// provider may set each of them at a time, and only until it disconnects.
+IOReturn PrjFSProviderUserClient::setMemoryBudget(uint64_t subsystem, uint64_t budgetBytes, uint64_t* outError)
+{
+    if (subsystem >= KernelMemory_Count)
+    {
+        *outError = EINVAL;
+    }
+    else if (this->virtualizationRootIndex == -1)
+    {
+        // Must register a root first
+        *outError = ENODEV;
+    }
+    else
+    {
+        *outError = Memory_SetBudget(this->virtualizationRootIndex, static_cast<KernelMemorySubsystem>(subsystem), budgetBytes);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::fileFlagsChanged(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->fileFlagsChanged(
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+// External methods run on the calling thread, so the descriptor is looked up in
+// the provider's own file table
+IOReturn PrjFSProviderUserClient::fileFlagsChanged(uint64_t fileDescriptor, uint64_t* outError)
+{
+    vnode_t vnode;
+    if (fileDescriptor > INT_MAX)
+    {
+        *outError = EBADF;
+    }
+    else
+    {
+        int fd = static_cast<int>(fileDescriptor);
+        *outError = file_vnode(fd, &vnode);
+        if (0 == *outError)
+        {
+            KauthHandler_HandleFileFlagsChanged(vnode);
+            file_drop(fd);
+        }
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    // We don't support larger strings, including those large enough to warrant a memory descriptor
+    if (arguments->structureInputSize > PrjFSMaxPath || nullptr == arguments->structureInput)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    return static_cast<PrjFSProviderUserClient*>(target)->registerVirtualizationRoot(
+        static_cast<const char*>(arguments->structureInput),
+        arguments->structureInputSize,
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::registerVirtualizationRoot(const char* rootPath, size_t rootPathSize, uint64_t rootFlags, uint64_t* outError)
+{
+    if (rootPathSize == 0 || strnlen(rootPath, rootPathSize) != rootPathSize - 1 || 0 != (rootFlags & ~ProviderRoot_All))
+    {
+        *outError = EINVAL;
+        return kIOReturnSuccess;
+    }
+    else if (this->virtualizationRootIndex != -1)
+    {
+        // Already set
+        *outError = EBUSY;
+        return kIOReturnSuccess;
+    }
+    
+    VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(this, this->pid, rootPath, static_cast<uint32_t>(rootFlags));
+    if (0 == result.error)
+    {
+        this->setVirtualizationRootIndex(result.rootIndex);
+    }
+    
+    *outError = result.error;
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::reattachVirtualizationRoot(
+    OSObject* target,
+    void* reference,
+    IOExternalMethodArguments* arguments)
+{
+    return static_cast<PrjFSProviderUserClient*>(target)->reattachVirtualizationRoot(
+        static_cast<const VirtualizationRootIdentity*>(arguments->structureInput),
+        arguments->scalarInput[0],
+        &arguments->scalarOutput[0]);
+}
+
+IOReturn PrjFSProviderUserClient::reattachVirtualizationRoot(const VirtualizationRootIdentity* rootIdentity, uint64_t rootFlags, uint64_t* outError)
+{
+    if (0 != (rootFlags & ~ProviderRoot_All))
+    {
+        *outError = EINVAL;
+        return kIOReturnSuccess;
+    }
+    else if (this->virtualizationRootIndex != -1)
+    {
+        // Already set
+        *outError = EBUSY;
+        return kIOReturnSuccess;
+    }
+    
+    VnodeFsidInode rootIds = { rootIdentity->fsid, rootIdentity->inode };
+    VirtualizationRootResult result = VirtualizationRoot_ReattachProvider(this, this->pid, rootIds, rootIdentity->rootToken, static_cast<uint32_t>(rootFlags));
+    if (0 == result.error)
+    {
+        this->setVirtualizationRootIndex(result.rootIndex);
+    }
+    
+    *outError = result.error;
+    
+    return kIOReturnSuccess;
+}
+
+void PrjFSProviderUserClient::setVirtualizationRootIndex(int32_t rootIndex)
+{
+    this->virtualizationRootIndex = rootIndex;
+    
+    // Sets the root index in the IORegistry for diagnostic purposes
+    char location[5] = "";
+    snprintf(location, sizeof(location), "%d", rootIndex);
+    this->setLocation(location);
+}
+
+// Returns the queue the memory or port type is for, if it is one of the queues
+// currently in use
+ProviderMessageQueue* PrjFSProviderUserClient::getMessageQueueForMemoryOrPortType(UInt32 type, UInt32 firstType)
+{
+    if (type < firstType || type - firstType >= this->messageQueueCount)
+    {
+        return nullptr;
+    }
+    
+    return &this->messageQueues[type - firstType];
+}
+
+void PrjFSProviderUserClient::acquireAllMessageQueues()
+{
+    // Always in index order, and senders only ever hold one
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        Mutex_Acquire(this->messageQueues[i].writerMutex);
+    }
+}
+
+void PrjFSProviderUserClient::releaseAllMessageQueues()
+{
+    for (uint32_t i = MaxProviderMessageQueues; i > 0; --i)
+    {
+        Mutex_Release(this->messageQueues[i - 1].writerMutex);
+    }
+}
+
+bool PrjFSProviderUserClient::anyMessageQueueInUse_Locked() const
+{
+    for (uint32_t i = 0; i < MaxProviderMessageQueues; ++i)
+    {
+        if (this->messageQueues[i].inUse)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool PrjFSProviderUserClient::createDataQueue_Locked(ProviderMessageQueue& queue, uint32_t capacityBytes)
+{
+    if (!Memory_Reserve(KernelMemory_MessageQueues, capacityBytes))
+    {
+        return false;
+    }
+    
+    ProviderMessageDataQueue* newQueue = ProviderMessageDataQueue::withCapacity(capacityBytes);
+    if (nullptr == newQueue)
+    {
+        Memory_Unreserve(KernelMemory_MessageQueues, capacityBytes);
+        return false;
+    }
+    
+    IOMemoryDescriptor* newQueueMemory = newQueue->getMemoryDescriptor();
+    if (nullptr == newQueueMemory)
+    {
+        newQueue->release();
+        Memory_Unreserve(KernelMemory_MessageQueues, capacityBytes);
+        return false;
+    }
+    
+    this->freeDataQueue_Locked(queue);
+    queue.dataQueue = newQueue;
+    queue.dataQueueMemory = newQueueMemory;
+    queue.capacityBytes = capacityBytes;
+    return true;
+}
+
+void PrjFSProviderUserClient::freeDataQueue_Locked(ProviderMessageQueue& queue)
+{
+    OSSafeReleaseNULL(queue.dataQueueMemory);
+    OSSafeReleaseNULL(queue.dataQueue);
+    Memory_Unreserve(KernelMemory_MessageQueues, queue.capacityBytes);
+    queue.capacityBytes = 0;
+}
+
+// The header's file id selects the queue.
+bool PrjFSProviderUserClient::sendMessage(const Message& message, bool waitIfQueueFull)
+{
+    const MessageHeader* header = message.messageHeader;
+    if (MessageType_KtoU_Cancel == header->messageType && !(this->negotiatedCapabilities & ProviderCapability_CancelMessages))
+    {
+        // Older user space wouldn't know what to make of it
+        return false;
+    }
+    
+    uint32_t size = sizeof(*header) + header->pathSizeBytes + header->fromPathSizeBytes + header->fileXattrSizeBytes;
+    
+    // The count can't change once a root is registered (see setMessageQueueCount)
+    uint32_t queueIndex = static_cast<uint32_t>((header->fileId * 0x9e3779b97f4a7c15ull) >> 32) % this->messageQueueCount;
+    ProviderMessageQueue& queue = this->messageQueues[queueIndex];
+    
+    bool ok;
+    Mutex_Acquire(queue.writerMutex);
+    {
+        uint32_t newTail;
+        uint8_t* entry = static_cast<uint8_t*>(queue.dataQueue->reserveEntry(size, &newTail));
+        if (nullptr == entry && size + DATA_QUEUE_ENTRY_HEADER_SIZE > queue.capacityBytes)
+        {
+            // Will never fit, no point waiting
+            atomic_fetch_add(&this->droppedMessageCount, 1);
+        }
+        else if (nullptr == entry && waitIfQueueFull)
+        {
+            atomic_fetch_add(&this->queueFullCount, 1);
+            
+            uint32_t waitedMilliseconds = 0;
+            while (nullptr == entry && !queue.isClosing && waitedMilliseconds < ProviderMessageQueueFullMaxWaitMilliseconds)
+            {
+                struct timespec timeout = { 0, ProviderMessageQueueFullRetryMilliseconds * 1000000 };
+                Mutex_Sleep(queue.writerMutex, &queue, "io.gvfs.PrjFSKext.MessageQueueFull", &timeout);
+                waitedMilliseconds += ProviderMessageQueueFullRetryMilliseconds;
+                
+                entry = static_cast<uint8_t*>(queue.dataQueue->reserveEntry(size, &newTail));
+            }
+            
+            if (nullptr == entry)
+            {
+                atomic_fetch_add(&this->droppedMessageCount, 1);
+            }
+        }
+        
+        ok = nullptr != entry;
+        if (ok)
+        {
+            // The only copy the message's parts get; none of it is visible to
+            // user space until the entry is committed
+            memcpy(entry, header, sizeof(*header));
+            entry += sizeof(*header);
+            if (header->pathSizeBytes > 0)
+            {
+                memcpy(entry, message.path, header->pathSizeBytes);
+                entry += header->pathSizeBytes;
+            }
+            
+            if (header->fromPathSizeBytes > 0)
+            {
+                memcpy(entry, message.fromPath, header->fromPathSizeBytes);
+                entry += header->fromPathSizeBytes;
+            }
+            
+            if (header->fileXattrSizeBytes > 0)
+            {
+                memcpy(entry, message.fileXattr, header->fileXattrSizeBytes);
+            }
+            
+            queue.dataQueue->commitEntry(newTail);
+        }
+    }
+    Mutex_Release(queue.writerMutex);
+    
+    return ok;
+}
+
+// Returns once the ring is empty, or once user space has disarmed the doorbell
+// again for responses it added since, in which case its doorbell call takes
+// over. Only one drain runs at a time so that each entry is handled once.
+void PrjFSProviderUserClient::drainResponseRing()
+{
+    ResponseRing* ring = this->responseRing;
+    bool drainedResponses;
+    
+    Mutex_Acquire(this->responseRingMutex);
+    {
+        uint32_t head = this->responseRingHead;
+        while (true)
+        {
+            uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if (tail - head > ResponseRingCapacity)
+            {
+                // User space claims to have written entries it can't have had
+                // room for; skip ahead rather than handle entries twice.
+                this->responseRingOverrunCount++;
+                KextLog_Error(
+                    "PrjFSProviderUserClient::drainResponseRing: provider pid %d: invalid tail %u for head %u, skipping",
+                    this->pid, tail, head);
+                head = tail;
+            }
+            
+            for (; head != tail; ++head)
+            {
+                // Copy the entry, user space could still change it under us
+                KernelMessageResponse response;
+                memcpy(&response, &ring->entries[head % ResponseRingCapacity], sizeof(response));
+                KauthHandler_HandleKernelMessageResponse(response.messageId, static_cast<MessageType>(response.responseType));
+            }
+            
+            // User space may reuse the slots once it sees the new head
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+            
+            // Re-arm, then check for responses added before user space could
+            // have seen that. If it has disarmed the doorbell itself in the
+            // meantime, its doorbell call will drain them.
+            __atomic_store_n(&ring->doorbellArmed, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head ||
+                0 == __atomic_exchange_n(&ring->doorbellArmed, 0, __ATOMIC_SEQ_CST))
+            {
+                break;
+            }
+        }
+        
+        drainedResponses = head != this->responseRingHead;
+        this->responseRingHead = head;
+    }
+    Mutex_Release(this->responseRingMutex);
+    
+    if (drainedResponses)
+    {
+        this->recordResponses();
+    }
+}
+
+// Lets the kext know the provider is responding, see ActiveProvider_RecordResponses
+void PrjFSProviderUserClient::recordResponses()
+{
+    int32_t rootIndex = this->virtualizationRootIndex;
+    if (-1 != rootIndex)
+    {
+        ActiveProvider_RecordResponses(rootIndex);
+    }
+}
+
+ProviderMessageDataQueue* ProviderMessageDataQueue::withCapacity(uint32_t capacityBytes)
+{
+    ProviderMessageDataQueue* queue = new ProviderMessageDataQueue();
+    if (nullptr != queue && !queue->initWithCapacity(capacityBytes))
+    {
+        queue->release();
+        queue = nullptr;
+    }
+    
+    return queue;
+}
+
+void* ProviderMessageDataQueue::reserveEntry(uint32_t dataSize, uint32_t* outNewTail)
+{
+    // User space may have written anything to head, so it is only trusted once
+    // checked against the queue size, as enqueue() does.
+    uint32_t queueSize = this->getQueueSize();
+    uint32_t head = __atomic_load_n(&this->dataQueue->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&this->dataQueue->tail, __ATOMIC_RELAXED);
+    if (dataSize > UINT32_MAX - DATA_QUEUE_ENTRY_HEADER_SIZE || queueSize < tail || queueSize < head)
+    {
+        return nullptr;
+    }
+    
+    uint32_t entrySize = dataSize + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    IODataQueueEntry* entry;
+    if (tail >= head)
+    {
+        if (entrySize <= queueSize - tail)
+        {
+            entry = reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(this->dataQueue->queue) + tail);
+            *outNewTail = tail + entrySize;
+        }
+        else if (head > entrySize)
+        {
+            // Wrap around to the start, without letting the tail catch up with the
+            // head. The reader looks for the entry at the start if the size at the
+            // end says it doesn't fit there, or if there is no room for a size.
+            if (queueSize - tail >= DATA_QUEUE_ENTRY_HEADER_SIZE)
+            {
+                reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(this->dataQueue->queue) + tail)->size = dataSize;
+            }
+            
+            entry = this->dataQueue->queue;
+            *outNewTail = entrySize;
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+    else if (head - tail > entrySize)
+    {
+        entry = reinterpret_cast<IODataQueueEntry*>(reinterpret_cast<uint8_t*>(this->dataQueue->queue) + tail);
+        *outNewTail = tail + entrySize;
+    }
+    else
+    {
+        return nullptr;
+    }
+    
+    entry->size = dataSize;
+    return entry->data;
+}
+
+void ProviderMessageDataQueue::commitEntry(uint32_t newTail)
+{
+    uint32_t tail = __atomic_load_n(&this->dataQueue->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&this->dataQueue->head, __ATOMIC_RELAXED);
+    
+    // Publishes the entry's contents along with it
+    __atomic_store_n(&this->dataQueue->tail, newTail, __ATOMIC_RELEASE);
+    
+    if (tail != head)
+    {
+        // Pairs with the barrier in the reader's dequeue, so that either it sees
+        // the new tail, or we see it emptying the queue and notify it.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&this->dataQueue->head, __ATOMIC_RELAXED);
+    }
+    
+    if (tail == head)
+    {
+        this->sendDataAvailableNotification();
+    }
+}
@@ -3,19 +3,67 @@
 #include "PrjFSClasses.hpp"
 #include "Locks.hpp"
 #include "Message.h"
+#include "../public/PrjFSProviderClientShared.h"
 #include <IOKit/IOUserClient.h>
+#include <stdatomic.h>
 
 struct MessageHeader;
 struct VirtualizationRoot;
-class IOSharedDataQueue;
+struct KernelMessageResponse;
+struct ProcessPolicyEntry;
+struct ModifiedFileEntry;
+struct VirtualizationRootIdentity;
+struct ResponseRing;
+class IOBufferMemoryDescriptor;
+
+struct ProviderMessageQueue
+{
+    ProviderMessageDataQueue* dataQueue;
+    IOMemoryDescriptor* dataQueueMemory;
+    uint32_t capacityBytes;
+    // The queue can only be resized until user space starts using it
+    bool inUse;
+    bool isClosing;
+    // Protects the fields above; writers wait on the ProviderMessageQueue for space
+    Mutex writerMutex;
+};
+
 class PrjFSProviderUserClient : public IOUserClient
 {
     OSDeclareDefaultStructors(PrjFSProviderUserClient);
 private:
     typedef IOUserClient super;
-    IOSharedDataQueue* dataQueue;
-    IOMemoryDescriptor* dataQueueMemory;
-    Mutex dataQueueWriterMutex;
+    // Each has its writer mutex allocated, but only the first messageQueueCount
+    // have a data queue. The count and capacity can only be changed with all
+    // writer mutexes held, before a root is registered (and so before anything
+    // sends messages).
+    ProviderMessageQueue messageQueues[MaxProviderMessageQueues];
+    uint32_t messageQueueCount;
+    uint32_t messageQueueCapacityBytes;
+    
+    // Flow control statistics, over all queues
+    atomic_ullong queueFullCount;
+    atomic_ullong droppedMessageCount;
+    
+    // Shared with user space, which may write anything there, so the kext
+    // keeps its own copy of the ring's head.
+    IOBufferMemoryDescriptor* responseRingMemory;
+    ResponseRing* responseRing;
+    uint32_t responseRingHead;
+    // Serializes drains of the response ring
+    Mutex responseRingMutex;
+    uint64_t responseRingOverrunCount;
+    
+    // ProviderCapabilityFlags agreed on with user space, for diagnostics
+    uint64_t negotiatedCapabilities;
+    
+    bool createDataQueue_Locked(ProviderMessageQueue& queue, uint32_t capacityBytes);
+    void freeDataQueue_Locked(ProviderMessageQueue& queue);
+    void acquireAllMessageQueues();
+    void releaseAllMessageQueues();
+    bool anyMessageQueueInUse_Locked() const;
+    ProviderMessageQueue* getMessageQueueForMemoryOrPortType(UInt32 type, UInt32 firstType);
+    void setVirtualizationRootIndex(int32_t rootIndex);
 public:
     pid_t pid;
     // The root for which this is the provider; -1 prior to registration
@@ -43,22 +91,134 @@ public:
     
     virtual IOReturn clientClose() override;
 
+    // IORegistryEntry methods:
+    virtual bool serializeProperties(OSSerialize* serialize) const override;
+
     // OSObject methods:
     virtual void free() override;
 
 
-    void sendMessage(const void* message, uint32_t size);
+    // Writes the message's header and strings straight into a queue entry.
+    // Blocks for a bounded time while the queue is full; returns false if the
+    // message could not be enqueued.
+    bool sendMessage(const Message& message, bool waitIfQueueFull);
+    
+    // Hands any responses user space has added to the response ring to the
+    // kauth handler.
+    void drainResponseRing();
+    void recordResponses();
 
     // External methods:
     static IOReturn registerVirtualizationRoot(
         OSObject* target,
         void* reference,
         IOExternalMethodArguments* arguments);
-    IOReturn registerVirtualizationRoot(const char* rootPath, size_t rootPathSize, uint64_t* outError);
+    IOReturn registerVirtualizationRoot(const char* rootPath, size_t rootPathSize, uint64_t rootFlags, uint64_t* outError);
+
+    static IOReturn reattachVirtualizationRoot(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn reattachVirtualizationRoot(const VirtualizationRootIdentity* rootIdentity, uint64_t rootFlags, uint64_t* outError);
 
     static IOReturn kernelMessageResponse(
         OSObject* target,
         void* reference,
         IOExternalMethodArguments* arguments);
     IOReturn kernelMessageResponse(uint64_t messageId, MessageType responseType);
+
+    static IOReturn kernelMessageResponseBatch(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn kernelMessageResponseBatch(const KernelMessageResponse* responses, uint32_t responseCount);
+
+    static IOReturn setRequestTimeout(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setRequestTimeout(MessageType messageType, uint64_t timeoutMilliseconds, uint64_t* outError);
+
+    static IOReturn setMessageQueueCapacity(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setMessageQueueCapacity(uint64_t capacityBytes, uint64_t* outError);
+
+    static IOReturn setMessageQueueCount(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setMessageQueueCount(uint64_t queueCount, uint64_t* outError);
+
+    static IOReturn setProcessPolicies(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setProcessPolicies(const ProcessPolicyEntry* entries, uint32_t entryCount, uint64_t* outError);
+
+    static IOReturn setNotificationMappings(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setNotificationMappings(const void* mappings, uint32_t mappingsSize, uint64_t* outError);
+
+    static IOReturn setPrefetchHintInterval(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setPrefetchHintInterval(uint64_t intervalMilliseconds, uint64_t* outError);
+
+    static IOReturn setRequestRateLimit(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setRequestRateLimit(uint64_t requestsPerSecond, uint64_t burst, uint64_t maxDelayMilliseconds, uint64_t* outError);
+
+    static IOReturn setHelperProcesses(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setHelperProcesses(const int32_t* pids, uint32_t pidCount, uint64_t processGroupId, uint64_t* outError);
+
+    static IOReturn negotiateCapabilities(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn negotiateCapabilities(uint64_t userCapabilities, uint64_t* outCapabilities);
+
+    static IOReturn setMemoryBudget(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn setMemoryBudget(uint64_t subsystem, uint64_t budgetBytes, uint64_t* outError);
+
+    static IOReturn fileFlagsChanged(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn fileFlagsChanged(uint64_t fileDescriptor, uint64_t* outError);
+
+    static IOReturn drainModifiedFiles(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn drainModifiedFiles(
+        ModifiedFileEntry* outEntries,
+        uint32_t maxEntryCount,
+        uint32_t* outEntryCount,
+        uint64_t* outError,
+        uint64_t* outRemainingCount,
+        uint64_t* outOverflowed);
+
+    static IOReturn messageQueueDrained(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
+    IOReturn messageQueueDrained(uint64_t queueIndex);
+
+    static IOReturn responseRingDoorbell(
+        OSObject* target,
+        void* reference,
+        IOExternalMethodArguments* arguments);
 };
@@ -5,6 +5,7 @@
 #include "PrjFSLogUserClient.hpp"
 #include "KextLog.hpp"
 #include "VirtualizationRoots.hpp"
+#include "Memory.hpp"
 
 #include <IOKit/IOLib.h>
 #include <libkern/OSAtomic.h>
@@ -13,6 +14,8 @@
 
 OSDefineMetaClassAndStructors(PrjFSService, IOService);
 
+static void SetNumberInDictionary(OSDictionary* dictionary, const char* key, uint64_t value);
+
 // We really only want one instance of this class
 static PrjFSService* service_singleton = nullptr;
 
@@ -40,6 +43,10 @@ bool PrjFSService::start(IOService* provider)
     this->setProperty(PrjFSKextVersionKey, kextVersion);
     OSSafeReleaseNULL(kextVersion);
     
+    OSNumber* capabilities = OSNumber::withNumber(ProviderCapability_All, 64);
+    this->setProperty(PrjFSKextCapabilitiesKey, capabilities);
+    OSSafeReleaseNULL(capabilities);
+    
     // Publishes the service, ready for matching
     this->registerService();
     
@@ -58,6 +65,82 @@ void PrjFSService::stop(IOService* provider)
     this->super::stop(provider);
 }
 
+// Refreshes the memory statistics property each time the registry is read.
+bool PrjFSService::serializeProperties(OSSerialize* serialize) const
+{
+    OSDictionary* statistics = OSDictionary::withCapacity(6);
+    OSDictionary* zones = OSDictionary::withCapacity(MemoryZone_Count);
+    OSDictionary* subsystems = OSDictionary::withCapacity(KernelMemory_Count);
+    if (nullptr != statistics && nullptr != zones && nullptr != subsystems)
+    {
+        MemoryHeapStats heapStats = {};
+        Memory_GetHeapStats(&heapStats);
+        SetNumberInDictionary(statistics, "HeapBytesInUse", heapStats.bytesInUse);
+        SetNumberInDictionary(statistics, "HeapPeakBytesInUse", heapStats.peakBytesInUse);
+        SetNumberInDictionary(statistics, "HeapAllocations", heapStats.allocationCount);
+        SetNumberInDictionary(statistics, "HeapFailedAllocations", heapStats.failedAllocationCount);
+        
+        for (uint32_t i = 0; i < MemoryZone_Count; ++i)
+        {
+            MemoryZoneStats zoneStats = {};
+            Memory_GetZoneStats(static_cast<MemoryZone>(i), &zoneStats);
+            
+            OSDictionary* zone = OSDictionary::withCapacity(6);
+            if (nullptr != zone)
+            {
+                SetNumberInDictionary(zone, "ElementSize", zoneStats.elementSize);
+                SetNumberInDictionary(zone, "Slabs", zoneStats.slabCount);
+                SetNumberInDictionary(zone, "ElementsInUse", zoneStats.elementsInUse);
+                SetNumberInDictionary(zone, "PeakElementsInUse", zoneStats.peakElementsInUse);
+                SetNumberInDictionary(zone, "Allocations", zoneStats.allocationCount);
+                SetNumberInDictionary(zone, "FailedAllocations", zoneStats.failedAllocationCount);
+                zones->setObject(zoneStats.name, zone);
+                zone->release();
+            }
+        }
+        
+        statistics->setObject("Zones", zones);
+        
+        for (uint32_t i = 0; i < KernelMemory_Count; ++i)
+        {
+            MemorySubsystemStats subsystemStats = {};
+            Memory_GetSubsystemStats(static_cast<KernelMemorySubsystem>(i), &subsystemStats);
+            
+            OSDictionary* subsystem = OSDictionary::withCapacity(4);
+            if (nullptr != subsystem)
+            {
+                SetNumberInDictionary(subsystem, "BytesInUse", subsystemStats.bytesInUse);
+                SetNumberInDictionary(subsystem, "PeakBytesInUse", subsystemStats.peakBytesInUse);
+                SetNumberInDictionary(subsystem, "BudgetBytes", subsystemStats.budgetBytes);
+                SetNumberInDictionary(subsystem, "OverBudgetFailures", subsystemStats.overBudgetCount);
+                subsystems->setObject(subsystemStats.name, subsystem);
+                subsystem->release();
+            }
+        }
+        
+        statistics->setObject("Subsystems", subsystems);
+        
+        // setProperty only modifies the property table, which has its own lock
+        const_cast<PrjFSService*>(this)->setProperty(PrjFSMemoryStatisticsKey, statistics);
+    }
+    
+    OSSafeReleaseNULL(subsystems);
+    OSSafeReleaseNULL(zones);
+    OSSafeReleaseNULL(statistics);
+    
+    return this->super::serializeProperties(serialize);
+}
+
+static void SetNumberInDictionary(OSDictionary* dictionary, const char* key, uint64_t value)
+{
+    OSNumber* number = OSNumber::withNumber(value, 64);
+    if (nullptr != number)
+    {
+        dictionary->setObject(key, number);
+        number->release();
+    }
+}
+
 static bool InitAttachAndStartUserClient(
     PrjFSService* service, IOUserClient* client, task_t owningTask,
     void* securityID, UInt32 type, OSDictionary* properties)
@@ -0,0 +1,172 @@
+#include <kern/debug.h>
+#include <kern/assert.h>
+#include <libkern/libkern.h>
+
+#include "ProcessAttribution.hpp"
+#include "PrjFSLogClientShared.h"
+#include "Locks.hpp"
+
+struct ProcessAttributionEntry
+{
+    // Of the process name and root index, so that lookups only compare names on a likely match
+    uint32_t                    keyHash;
+    KextLog_ProcessAttribution  counts;
+};
+
+static ProcessAttributionEntry s_entries[KextLog_MaxProcessAttributions] = {};
+static uint32_t s_entryCount = 0;
+static uint64_t s_evictedCount = 0;
+static KextLog_ProcessAttribution s_evictedCounts = {};
+// Protects all of the above
+static Mutex s_mutex = {};
+
+static uint32_t HashKey(const char* procname, int32_t rootIndex);
+static ProcessAttributionEntry* FindOrAddEntry_Locked(const char* procname, int32_t rootIndex, uint32_t keyHash);
+static void AddCounts(KextLog_ProcessAttribution* total, const KextLog_ProcessAttribution& counts);
+
+kern_return_t ProcessAttribution_Init()
+{
+    if (Mutex_IsValid(s_mutex))
+    {
+        return KERN_FAILURE;
+    }
+    
+    s_mutex = Mutex_Alloc(LockProfile_ProcessAttribution);
+    if (!Mutex_IsValid(s_mutex))
+    {
+        return KERN_FAILURE;
+    }
+    
+    s_entryCount = 0;
+    s_evictedCount = 0;
+    s_evictedCounts = KextLog_ProcessAttribution{};
+    s_evictedCounts.rootIndex = -1;
+    return KERN_SUCCESS;
+}
+
+kern_return_t ProcessAttribution_Cleanup()
+{
+    if (!Mutex_IsValid(s_mutex))
+    {
+        return KERN_FAILURE;
+    }
+    
+    Mutex_FreeMemory(&s_mutex);
+    return KERN_SUCCESS;
+}
+
+void ProcessAttribution_RecordRequest(
+    const char* procname,
+    int32_t rootIndex,
+    MessageType messageType,
+    bool sentRequest,
+    uint64_t hydratedBytes,
+    uint64_t waitNanoseconds)
+{
+    assert(MessageType_KtoU_EnumerateDirectory == messageType || MessageType_KtoU_HydrateFile == messageType);
+    
+    uint32_t keyHash = HashKey(procname, rootIndex);
+    Mutex_Acquire(s_mutex);
+    {
+        ProcessAttributionEntry* entry = FindOrAddEntry_Locked(procname, rootIndex, keyHash);
+        if (sentRequest)
+        {
+            if (MessageType_KtoU_HydrateFile == messageType)
+            {
+                entry->counts.hydrationCount++;
+            }
+            else
+            {
+                entry->counts.enumerationCount++;
+            }
+        }
+        
+        entry->counts.hydratedBytes += hydratedBytes;
+        entry->counts.waitCount++;
+        entry->counts.totalWaitNanoseconds += waitNanoseconds;
+    }
+    Mutex_Release(s_mutex);
+}
+
+void ProcessAttribution_Get(KextLog_ProcessAttributions* attributions)
+{
+    *attributions = KextLog_ProcessAttributions{};
+    Mutex_Acquire(s_mutex);
+    {
+        attributions->entryCount = s_entryCount;
+        attributions->evictedCount = s_evictedCount;
+        attributions->evicted = s_evictedCounts;
+        for (uint32_t i = 0; i < s_entryCount; ++i)
+        {
+            attributions->entries[i] = s_entries[i].counts;
+        }
+    }
+    Mutex_Release(s_mutex);
+}
+
+// FNV-1a
+static uint32_t HashKey(const char* procname, int32_t rootIndex)
+{
+    uint32_t hash = 2166136261u ^ static_cast<uint32_t>(rootIndex);
+    for (const char* c = procname; *c != '\0'; ++c)
+    {
+        hash = (hash ^ static_cast<unsigned char>(*c)) * 16777619u;
+    }
+    
+    return hash;
+}
+
+// The table is small and only touched once per request, so it is searched linearly
+static ProcessAttributionEntry* FindOrAddEntry_Locked(const char* procname, int32_t rootIndex, uint32_t keyHash)
+{
+    for (uint32_t i = 0; i < s_entryCount; ++i)
+    {
+        ProcessAttributionEntry& entry = s_entries[i];
+        if (entry.keyHash == keyHash &&
+            entry.counts.rootIndex == rootIndex &&
+            0 == strncmp(entry.counts.procname, procname, sizeof(entry.counts.procname)))
+        {
+            return &entry;
+        }
+    }
+    
+    ProcessAttributionEntry* newEntry;
+    if (s_entryCount < KextLog_MaxProcessAttributions)
+    {
+        newEntry = &s_entries[s_entryCount++];
+    }
+    else
+    {
+        // Evict the lightest entry; ties go to the one with the fewest requests
+        newEntry = &s_entries[0];
+        for (uint32_t i = 1; i < s_entryCount; ++i)
+        {
+            const KextLog_ProcessAttribution& counts = s_entries[i].counts;
+            const KextLog_ProcessAttribution& lightest = newEntry->counts;
+            if (counts.hydratedBytes < lightest.hydratedBytes ||
+                (counts.hydratedBytes == lightest.hydratedBytes &&
+                 counts.hydrationCount + counts.enumerationCount < lightest.hydrationCount + lightest.enumerationCount))
+            {
+                newEntry = &s_entries[i];
+            }
+        }
+        
+        AddCounts(&s_evictedCounts, newEntry->counts);
+        s_evictedCount++;
+    }
+    
+    *newEntry = ProcessAttributionEntry{};
+    newEntry->keyHash = keyHash;
+    newEntry->counts.rootIndex = rootIndex;
+    strlcpy(newEntry->counts.procname, procname, sizeof(newEntry->counts.procname));
+    return newEntry;
+}
+
+static void AddCounts(KextLog_ProcessAttribution* total, const KextLog_ProcessAttribution& counts)
+{
+    total->hydrationCount += counts.hydrationCount;
+    total->enumerationCount += counts.enumerationCount;
+    total->hydratedBytes += counts.hydratedBytes;
+    total->waitCount += counts.waitCount;
+    total->totalWaitNanoseconds += counts.totalWaitNanoseconds;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <mach/kern_return.h>
+#include <stdint.h>
+#include "../public/Message.h"
+
+// Totals of the enumeration and hydration requests each process caused, per
+// virtualization root, for working out which tools drive hydration. The table
+// holds KextLog_MaxProcessAttributions entries; when a new (process, root)
+// shows up in a full table, the entry with the fewest hydrated bytes is
+// evicted and its counts are added to the evicted totals, so the heaviest
+// processes stay listed individually. The log client reads the table with
+// LogSelector_GetProcessAttributions.
+
+kern_return_t ProcessAttribution_Init();
+kern_return_t ProcessAttribution_Cleanup();
+
+// Records one thread's wait for an EnumerateDirectory or HydrateFile request.
+// Only the thread that sent the request counts it; threads that waited on a
+// request already in flight only add their wait time. hydratedBytes is the size
+// of a file whose hydration the provider reported as successful.
+void ProcessAttribution_RecordRequest(
+    const char* procname,
+    int32_t rootIndex,
+    MessageType messageType,
+    bool sentRequest,
+    uint64_t hydratedBytes,
+    uint64_t waitNanoseconds);
+
+struct KextLog_ProcessAttributions;
+void ProcessAttribution_Get(KextLog_ProcessAttributions* attributions);
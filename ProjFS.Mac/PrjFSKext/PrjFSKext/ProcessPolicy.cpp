@@ -0,0 +1,276 @@
+#include <kern/debug.h>
+#include <kern/assert.h>
+#include <libkern/libkern.h>
+#include <stdatomic.h>
+
+#include "ProcessPolicy.hpp"
+#include "Locks.hpp"
+#include "Memory.hpp"
+
+struct ProcessPolicyCacheEntry
+{
+    int         pid;
+    // Entries from older generations of the policy table are ignored
+    uint32_t    generation;
+    uint32_t    policyFlags;
+    char        procname[MAXCOMLEN + 1];
+};
+
+struct BuiltInProcessPolicy
+{
+    const char* processName;
+    uint32_t    policyFlags;
+};
+
+// These processes will crawl the file system and force a full hydration
+static const BuiltInProcessPolicy s_builtInPolicies[] =
+{
+    { "mds",            ProcessPolicy_DenyHydration },
+    { "mdworker",       ProcessPolicy_DenyHydration },
+    { "mds_stores",     ProcessPolicy_DenyHydration },
+    { "fseventsd",      ProcessPolicy_DenyHydration },
+    { "Spotlight",      ProcessPolicy_DenyHydration },
+};
+
+// Must be powers of 2. Direct-mapped by pid, like the vnode cache.
+static const uint32_t ProcessPolicyCacheCapacity = 256;
+static const uint32_t ProcessPolicyCacheLockStripes = 16;
+
+static ProcessPolicyCacheEntry s_cacheEntries[ProcessPolicyCacheCapacity] = {};
+static Mutex s_cacheLocks[ProcessPolicyCacheLockStripes] = {};
+
+// Protects the provider-supplied entries
+static RWLock s_policyRWLock = {};
+static ProcessPolicyEntry* s_policyEntries = nullptr;
+static uint32_t s_policyEntryCount = 0;
+// The root whose provider set the entries, -1 while there are none
+static int32_t s_policyOwnerRootIndex = -1;
+// Incremented (under the exclusive lock) whenever the entries change
+static atomic_uint s_policyGeneration;
+
+static uint32_t LookUpPolicyFlags_Locked(const char* procname);
+
+kern_return_t ProcessPolicy_Init()
+{
+    if (RWLock_IsValid(s_policyRWLock))
+    {
+        goto CleanupAndFail;
+    }
+    
+    s_policyRWLock = RWLock_Alloc();
+    if (!RWLock_IsValid(s_policyRWLock))
+    {
+        goto CleanupAndFail;
+    }
+    
+    for (uint32_t i = 0; i < ProcessPolicyCacheLockStripes; ++i)
+    {
+        s_cacheLocks[i] = Mutex_Alloc();
+        if (!Mutex_IsValid(s_cacheLocks[i]))
+        {
+            goto CleanupAndFail;
+        }
+    }
+    
+    // Generation 0 is never current, so the zeroed cache starts out empty
+    atomic_store(&s_policyGeneration, 1);
+    return KERN_SUCCESS;
+    
+CleanupAndFail:
+    ProcessPolicy_Cleanup();
+    return KERN_FAILURE;
+}
+
+kern_return_t ProcessPolicy_Cleanup()
+{
+    kern_return_t result = KERN_SUCCESS;
+    
+    for (uint32_t i = 0; i < ProcessPolicyCacheLockStripes; ++i)
+    {
+        if (Mutex_IsValid(s_cacheLocks[i]))
+        {
+            Mutex_FreeMemory(&s_cacheLocks[i]);
+        }
+        else
+        {
+            result = KERN_FAILURE;
+        }
+    }
+    
+    if (nullptr != s_policyEntries)
+    {
+        Memory_Free(KernelMemory_ProcessPolicies, s_policyEntries, s_policyEntryCount * sizeof(s_policyEntries[0]));
+        s_policyEntries = nullptr;
+        s_policyEntryCount = 0;
+    }
+    
+    s_policyOwnerRootIndex = -1;
+    
+    if (RWLock_IsValid(s_policyRWLock))
+    {
+        RWLock_FreeMemory(&s_policyRWLock);
+    }
+    else
+    {
+        result = KERN_FAILURE;
+    }
+    
+    return result;
+}
+
+errno_t ProcessPolicy_SetEntries(int32_t ownerRootIndex, const ProcessPolicyEntry* entries, uint32_t entryCount)
+{
+    assert(ownerRootIndex >= 0);
+    
+    if (entryCount > MaxProcessPolicyEntries)
+    {
+        return EINVAL;
+    }
+    
+    for (uint32_t i = 0; i < entryCount; ++i)
+    {
+        if (0 == entries[i].processName[0] ||
+            strnlen(entries[i].processName, sizeof(entries[i].processName)) == sizeof(entries[i].processName) ||
+            0 != (entries[i].policyFlags & ~ProcessPolicy_All))
+        {
+            return EINVAL;
+        }
+    }
+    
+    ProcessPolicyEntry* newEntries = nullptr;
+    if (entryCount > 0)
+    {
+        newEntries = static_cast<ProcessPolicyEntry*>(Memory_Alloc(KernelMemory_ProcessPolicies, entryCount * sizeof(newEntries[0])));
+        if (nullptr == newEntries)
+        {
+            return ENOMEM;
+        }
+        
+        memcpy(newEntries, entries, entryCount * sizeof(newEntries[0]));
+    }
+    
+    errno_t error = 0;
+    ProcessPolicyEntry* oldEntries = nullptr;
+    uint32_t oldEntryCount = 0;
+    RWLock_AcquireExclusive(s_policyRWLock);
+    {
+        if (-1 != s_policyOwnerRootIndex && ownerRootIndex != s_policyOwnerRootIndex)
+        {
+            error = EBUSY;
+        }
+        else
+        {
+            oldEntries = s_policyEntries;
+            oldEntryCount = s_policyEntryCount;
+            s_policyEntries = newEntries;
+            s_policyEntryCount = entryCount;
+            s_policyOwnerRootIndex = entryCount > 0 ? ownerRootIndex : -1;
+            atomic_fetch_add(&s_policyGeneration, 1);
+        }
+    }
+    RWLock_ReleaseExclusive(s_policyRWLock);
+    
+    if (0 != error)
+    {
+        oldEntries = newEntries;
+        oldEntryCount = entryCount;
+    }
+    
+    if (nullptr != oldEntries)
+    {
+        Memory_Free(KernelMemory_ProcessPolicies, oldEntries, oldEntryCount * sizeof(oldEntries[0]));
+    }
+    
+    return error;
+}
+
+void ProcessPolicy_ReleaseOwnership(int32_t ownerRootIndex)
+{
+    ProcessPolicyEntry* oldEntries = nullptr;
+    uint32_t oldEntryCount = 0;
+    RWLock_AcquireExclusive(s_policyRWLock);
+    {
+        if (ownerRootIndex == s_policyOwnerRootIndex)
+        {
+            oldEntries = s_policyEntries;
+            oldEntryCount = s_policyEntryCount;
+            s_policyEntries = nullptr;
+            s_policyEntryCount = 0;
+            s_policyOwnerRootIndex = -1;
+            atomic_fetch_add(&s_policyGeneration, 1);
+        }
+    }
+    RWLock_ReleaseExclusive(s_policyRWLock);
+    
+    if (nullptr != oldEntries)
+    {
+        Memory_Free(KernelMemory_ProcessPolicies, oldEntries, oldEntryCount * sizeof(oldEntries[0]));
+    }
+}
+
+uint32_t ProcessPolicy_GetFlags(int pid, const char* procname)
+{
+    uint32_t index = static_cast<uint32_t>(pid) & (ProcessPolicyCacheCapacity - 1);
+    Mutex lock = s_cacheLocks[index & (ProcessPolicyCacheLockStripes - 1)];
+    uint32_t generation = atomic_load(&s_policyGeneration);
+    bool found = false;
+    uint32_t policyFlags = ProcessPolicy_None;
+    
+    Mutex_Acquire(lock);
+    {
+        ProcessPolicyCacheEntry& entry = s_cacheEntries[index];
+        if (entry.pid == pid && entry.generation == generation && 0 == strcmp(entry.procname, procname))
+        {
+            policyFlags = entry.policyFlags;
+            found = true;
+        }
+    }
+    Mutex_Release(lock);
+    
+    if (found)
+    {
+        return policyFlags;
+    }
+    
+    RWLock_AcquireShared(s_policyRWLock);
+    {
+        // Read again, as the table may have changed since the cache lookup
+        generation = atomic_load(&s_policyGeneration);
+        policyFlags = LookUpPolicyFlags_Locked(procname);
+    }
+    RWLock_ReleaseShared(s_policyRWLock);
+    
+    Mutex_Acquire(lock);
+    {
+        ProcessPolicyCacheEntry& entry = s_cacheEntries[index];
+        entry.pid = pid;
+        entry.generation = generation;
+        entry.policyFlags = policyFlags;
+        strlcpy(entry.procname, procname, sizeof(entry.procname));
+    }
+    Mutex_Release(lock);
+    
+    return policyFlags;
+}
+
+// Provider-supplied entries take precedence over the built-in ones.
+static uint32_t LookUpPolicyFlags_Locked(const char* procname)
+{
+    for (uint32_t i = 0; i < s_policyEntryCount; ++i)
+    {
+        if (0 == strcmp(s_policyEntries[i].processName, procname))
+        {
+            return s_policyEntries[i].policyFlags;
+        }
+    }
+    
+    for (const BuiltInProcessPolicy& policy : s_builtInPolicies)
+    {
+        if (0 == strcmp(policy.processName, procname))
+        {
+            return policy.policyFlags;
+        }
+    }
+    
+    return ProcessPolicy_None;
+}
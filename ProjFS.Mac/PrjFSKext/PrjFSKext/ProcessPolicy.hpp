@@ -0,0 +1,26 @@
+#pragma once
+
+#include <mach/kern_return.h>
+#include <sys/kernel_types.h>
+#include <stdint.h>
+#include "../public/PrjFSProviderClientShared.h"
+
+// Per-process policy lookups for the kauth handler. A built-in list covers the
+// system's file system crawlers; providers can add entries or override the
+// built-in ones. Decisions are cached per pid, and validated against the
+// process name so that exec or pid reuse can't return a stale decision.
+
+kern_return_t ProcessPolicy_Init();
+kern_return_t ProcessPolicy_Cleanup();
+
+// Replaces all provider-supplied entries. The table applies to every root, so it
+// has a single owner: the provider of the root that set a non-empty table, until
+// it sets an empty one or disconnects. Returns EINVAL for malformed entries or
+// unknown policy flags, EBUSY while another root's provider owns the table.
+errno_t ProcessPolicy_SetEntries(int32_t ownerRootIndex, const ProcessPolicyEntry* entries, uint32_t entryCount);
+
+// Drops the provider-supplied entries if the root's provider owns them
+void ProcessPolicy_ReleaseOwnership(int32_t ownerRootIndex);
+
+// Returns the ProcessPolicyFlags for the process
+uint32_t ProcessPolicy_GetFlags(int pid, const char* procname);
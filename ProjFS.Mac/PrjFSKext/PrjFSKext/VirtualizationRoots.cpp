@@ -1,8 +1,14 @@
 #include <kern/debug.h>
 #include <kern/assert.h>
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
+#include <sys/proc.h>
 
 #include "PrjFSCommon.h"
+#include "KextTesting.hpp"
 #include "PrjFSXattrs.h"
+#include "../public/PrjFSProviderClientShared.h"
 #include "VirtualizationRoots.hpp"
 #include "Memory.hpp"
 #include "Locks.hpp"
@@ -10,19 +16,102 @@
 #include "PrjFSProviderUserClient.hpp"
 #include "kernel-header-wrappers/mount.h"
 #include "VnodeUtilities.hpp"
+#include "VnodeCache.hpp"
+
+#ifdef KEXT_UNIT_TESTING
+#include <new>
+#else
+// The kernel defines placement new, but none of its headers declare it
+void* operator new(size_t size, void* pointer) noexcept;
+#endif
 
 
 static RWLock s_rwLock = {};
 
 // Arbitrary choice, but prevents user space attacker from causing
 // allocation of too much wired kernel memory.
-static const size_t MaxVirtualizationRoots = 64;
+static const uint16_t MaxVirtualizationRoots = 4096;
+// The root array starts out at this size and doubles whenever it fills up.
+static const uint16_t InitialVirtualizationRootCapacity = 64;
+
+// Roots are allocated individually so that pointers to them remain valid when
+// the array of pointers is reallocated. Roots are never removed, so indices
+// below s_virtualizationRootCount are always in use.
+// The array may be read without holding s_rwLock (see GetRootForIndex): a
+// replacement array is fully populated before it is published, and replaced
+// arrays are kept until cleanup, so readers holding an old pointer can still
+// use it for any index they could have obtained.
+static VirtualizationRoot** volatile s_virtualizationRoots = nullptr;
+static uint16_t s_virtualizationRootCapacity = 0;
+static uint16_t s_virtualizationRootCount = 0;
+
+// Capacity doubles from InitialVirtualizationRootCapacity up to
+// MaxVirtualizationRoots, so this many replaced arrays at most. Their total
+// size is less than that of the current array.
+static const uint32_t MaxRetiredRootArrays = 8;
+static VirtualizationRoot** s_retiredRootArrays[MaxRetiredRootArrays] = {};
+static uint16_t s_retiredRootArrayCapacities[MaxRetiredRootArrays] = {};
+static uint32_t s_retiredRootArrayCount = 0;
+
+// Open-addressed (linear probing) hash table mapping a root's (fsid, inode) to
+// its index in s_virtualizationRoots; -1 marks an empty slot. It is kept at
+// twice the root array capacity, so there is always an empty slot to end a probe.
+static int16_t* s_rootIndexTable = nullptr;
+static uint32_t s_rootIndexTableCapacity = 0;
+
+// Incremented whenever a root is registered or a directory is renamed, either of
+// which may change the owning root of vnodes below it; invalidates all root
+// indices and known non-root directories held in the vnode cache.
+static volatile uint32_t s_rootGeneration = 0;
+
+// Filesystem type numbers (vfs_typenum) that have been checked so far, and
+// which of those are supported. Type numbers identify the file system
+// implementation rather than the mount, so the bits never go stale. They are
+// small in practice; any beyond the range of the bit masks are checked by name
+// every time.
+static atomic_ullong s_checkedFilesystemTypes;
+static atomic_ullong s_allowedFilesystemTypes;
+
+// Number of roots whose notificationFlags are non-zero, so that the file
+// operation listener can ignore everything while no provider wants notifications.
+static atomic_uint s_notifyingRootCount;
+
+// Protects every root's set of modified files, which is updated on each close
+// of a written file, so it is kept separate from s_rwLock. When both are held,
+// s_rwLock is acquired first.
+static Mutex s_modifiedFilesMutex = {};
 
-static VirtualizationRoot s_virtualizationRoots[MaxVirtualizationRoots] = {};
+// Slots in each root's set of modified files. Insertions fail once it is 3/4
+// full, which keeps probes short and guarantees an empty slot to end them.
+static const uint32_t ModifiedFileSetCapacity = 8192;
+static const uint32_t ModifiedFileSetMaxCount = ModifiedFileSetCapacity / 4 * 3;
+static const uint32_t ModifiedFileSetSizeBytes = ModifiedFileSetCapacity * sizeof(VnodeFsidInode);
 
-static int16_t FindRootForVnode_Locked(vnode_t vnode, uint32_t vid, VnodeFsidInode fileId);
-static int16_t FindUnusedIndex_Locked();
-static int16_t InsertVirtualizationRoot_Locked(PrjFSProviderUserClient* userClient, pid_t clientPID, vnode_t vnode, uint32_t vid, VnodeFsidInode persistentIds, const char* path);
+// Upper limit for VirtualizationRoot_GetResponseSpinNanoseconds
+static const uint32_t MaxResponseSpinNanoseconds = 100 * 1000;
+
+// See ProviderRoot_OfflineWhenUnresponsive
+static const uint64_t ProviderUnresponsiveNanoseconds = 10 * 1000000000ull;
+static const uint64_t UnresponsiveProbeIntervalNanoseconds = 1000000000ull;
+
+static bool FilesystemTypeNameIsAllowed(const char* typeName, size_t typeNameSize);
+static VirtualizationRoot* GetRootForIndex(int32_t rootIndex);
+KEXT_STATIC int16_t FindRootForVnode_Locked(vnode_t vnode, uint32_t vid, VnodeFsidInode fileId);
+static int16_t FindRootIndex_Locked(VnodeFsidInode fileId);
+static errno_t ReadRootToken(vnode_t vnode, vfs_context_t context, uint64_t* outRootToken);
+static void AttachProvider_Locked(VirtualizationRoot* root, PrjFSProviderUserClient* userClient, pid_t clientPID, uint32_t rootFlags);
+static bool EnsureRootCapacity_Locked(uint32_t requiredCount);
+KEXT_STATIC uint32_t HashFsidInode(VnodeFsidInode fileId);
+static void InsertIntoRootIndexTable(int16_t* table, uint32_t tableCapacity, VnodeFsidInode fileId, int16_t rootIndex);
+static int16_t InsertVirtualizationRoot_Locked(PrjFSProviderUserClient* userClient, pid_t clientPID, vnode_t vnode, uint32_t vid, VnodeFsidInode persistentIds, uint64_t rootToken, const char* path);
+static errno_t ValidateNotificationMappings(const uint8_t* mappings, uint32_t mappingsSize, uint32_t* outNotificationFlags);
+static void SetNotificationFlags_Locked(VirtualizationRoot* root, uint32_t notificationFlags);
+static void SetHelperProcesses_Locked(VirtualizationRoot* root, const int32_t* pids, uint32_t pidCount, int32_t processGroupId);
+static bool PathIsWithinMapping(const char* relativePath, const char* mappingPath, uint32_t mappingPathLength);
+static bool PathIsSameOrBelow(const char* path, const char* ancestorPath, size_t ancestorPathLength);
+static VnodeFsidInode* ReplaceModifiedFileSet_Locked(VirtualizationRoot* root, VnodeFsidInode* newSet);
+static void RemoveModifiedFileAtSlot_Locked(VnodeFsidInode* set, uint32_t slot);
+static uint64_t GetUptimeNanoseconds();
 
 kern_return_t VirtualizationRoots_Init()
 {
@@ -31,15 +120,24 @@ kern_return_t VirtualizationRoots_Init()
         return KERN_FAILURE;
     }
     
-    s_rwLock = RWLock_Alloc();
+    s_rwLock = RWLock_Alloc(LockProfile_VirtualizationRoots);
     if (!RWLock_IsValid(s_rwLock))
     {
         return KERN_FAILURE;
     }
     
-    for (uint32_t i = 0; i < MaxVirtualizationRoots; ++i)
+    s_modifiedFilesMutex = Mutex_Alloc(LockProfile_ModifiedFiles);
+    if (!Mutex_IsValid(s_modifiedFilesMutex))
+    {
+        VirtualizationRoots_Cleanup();
+        return KERN_FAILURE;
+    }
+    
+    s_virtualizationRootCount = 0;
+    if (!EnsureRootCapacity_Locked(InitialVirtualizationRootCapacity))
     {
-        s_virtualizationRoots[i].index = i;
+        VirtualizationRoots_Cleanup();
+        return KERN_FAILURE;
     }
     
     return KERN_SUCCESS;
@@ -47,6 +145,49 @@ kern_return_t VirtualizationRoots_Init()
 
 kern_return_t VirtualizationRoots_Cleanup()
 {
+    for (uint16_t i = 0; i < s_virtualizationRootCount; ++i)
+    {
+        VirtualizationRoot* root = s_virtualizationRoots[i];
+        if (nullptr != root->notificationMappings)
+        {
+            Memory_Free(KernelMemory_VirtualizationRoots, root->notificationMappings, root->notificationMappingsSize);
+        }
+        
+        if (nullptr != root->modifiedFiles)
+        {
+            Memory_Free(KernelMemory_VirtualizationRoots, root->modifiedFiles, ModifiedFileSetSizeBytes);
+        }
+        
+        Memory_Free(KernelMemory_VirtualizationRoots, root, sizeof(VirtualizationRoot));
+    }
+    s_virtualizationRootCount = 0;
+    
+    if (nullptr != s_virtualizationRoots)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, s_virtualizationRoots, s_virtualizationRootCapacity * sizeof(s_virtualizationRoots[0]));
+        s_virtualizationRoots = nullptr;
+        s_virtualizationRootCapacity = 0;
+    }
+    
+    for (uint32_t i = 0; i < s_retiredRootArrayCount; ++i)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, s_retiredRootArrays[i], s_retiredRootArrayCapacities[i] * sizeof(s_retiredRootArrays[i][0]));
+        s_retiredRootArrays[i] = nullptr;
+    }
+    s_retiredRootArrayCount = 0;
+    
+    if (nullptr != s_rootIndexTable)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, s_rootIndexTable, s_rootIndexTableCapacity * sizeof(s_rootIndexTable[0]));
+        s_rootIndexTable = nullptr;
+        s_rootIndexTableCapacity = 0;
+    }
+    
+    if (Mutex_IsValid(s_modifiedFilesMutex))
+    {
+        Mutex_FreeMemory(&s_modifiedFilesMutex);
+    }
+    
     if (RWLock_IsValid(s_rwLock))
     {
         RWLock_FreeMemory(&s_rwLock);
@@ -58,17 +199,46 @@ kern_return_t VirtualizationRoots_Cleanup()
 
 VirtualizationRoot* VirtualizationRoots_FindForVnode(vnode_t vnode)
 {
-    VirtualizationRoot* root = nullptr;
+    // Directories visited on the way up are remembered so the result can be
+    // cached for them as well; siblings and children then resolve in one step.
+    // That includes finding no root at all, as for most files on the machine.
+    // Files are not cached: only directory renames invalidate the cache, and a
+    // file's own lookup goes through its current parent anyway.
+    static const uint32_t MaxVisitedVnodesToCache = 16;
+    struct { vnode_t vnode; uint32_t vid; } visited[MaxVisitedVnodesToCache];
+    uint32_t visitedCount = 0;
+    
+    // Read the generation before searching: if a root is registered while we
+    // walk, the entries cached below will be stale and won't be used.
+    uint32_t rootGeneration = s_rootGeneration;
+    int16_t rootIndex = -1;
+    bool lookupFailed = false;
     
     vnode_get(vnode);
     // Search up the tree until we hit a known virtualization root or THE root of the file system
-    while (nullptr == root && NULLVP != vnode && !vnode_isvroot(vnode))
+    while (NULLVP != vnode && !vnode_isvroot(vnode))
     {
-        int16_t rootIndex = VirtualizationRoots_LookupVnode(vnode, nullptr);
-        if (rootIndex >= 0)
+        // Only directories can be roots
+        if (vnode_isdir(vnode))
         {
-            root = &s_virtualizationRoots[rootIndex];
-            break;
+            uint32_t vid = vnode_vid(vnode);
+            if (VnodeCache_TryGetRootIndex(vnode, vid, rootGeneration, &rootIndex))
+            {
+                break;
+            }
+            
+            if (visitedCount < MaxVisitedVnodesToCache)
+            {
+                visited[visitedCount].vnode = vnode;
+                visited[visitedCount].vid = vid;
+                ++visitedCount;
+            }
+            
+            rootIndex = VirtualizationRoots_LookupVnode(vnode, nullptr, &lookupFailed);
+            if (rootIndex >= 0 || lookupFailed)
+            {
+                break;
+            }
         }
         
         vnode_t parent = vnode_getparent(vnode);
@@ -76,17 +246,77 @@ VirtualizationRoot* VirtualizationRoots_FindForVnode(vnode_t vnode)
         vnode = parent;
     }
     
+    // Without a parent the search stopped short of the file system root, so
+    // not having found a root doesn't mean there is none.
+    bool searchCompleted = NULLVP != vnode;
     if (NULLVP != vnode)
     {
         vnode_put(vnode);
     }
-    return root;
+    
+    // A root that couldn't be added to the table is treated as no root for now,
+    // but is looked up again next time.
+    if (!lookupFailed && (rootIndex >= 0 || searchCompleted))
+    {
+        // The visited vnodes may have been recycled since we dropped their iocount,
+        // but then their vid will have changed and the cache entry won't match.
+        for (uint32_t i = 0; i < visitedCount; ++i)
+        {
+            VnodeCache_SetRootIndex(visited[i].vnode, visited[i].vid, rootGeneration, rootIndex >= 0 ? rootIndex : VnodeCache_NotInAnyRoot);
+        }
+    }
+    
+    return rootIndex >= 0 ? GetRootForIndex(rootIndex) : nullptr;
 }
 
-int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context)
+void VirtualizationRoots_HandleDirectoryRenamed()
+{
+    OSIncrementAtomic(reinterpret_cast<volatile SInt32*>(&s_rootGeneration));
+}
+
+bool VirtualizationRoots_AnyExist()
+{
+    return 0 != __atomic_load_n(&s_virtualizationRootCount, __ATOMIC_RELAXED);
+}
+
+bool VirtualizationRoots_PathIsInOrAboveAnyRoot(const char* path)
+{
+    size_t pathLength = strlen(path);
+    bool found = false;
+    
+    RWLock_AcquireShared(s_rwLock);
+    {
+        for (uint16_t i = 0; i < s_virtualizationRootCount && !found; ++i)
+        {
+            VirtualizationRoot* root = s_virtualizationRoots[i];
+            found =
+                PathIsSameOrBelow(path, root->path, root->pathLength) ||
+                PathIsSameOrBelow(root->path, path, pathLength);
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return found;
+}
+
+// Lock-free; rootIndex must have been obtained from the root table or vnode
+// cache, which guarantees the root has been published.
+static VirtualizationRoot* GetRootForIndex(int32_t rootIndex)
+{
+    VirtualizationRoot** roots = s_virtualizationRoots;
+    return roots[rootIndex];
+}
+
+int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context, bool* outLookupFailed)
 {
-    VnodeFsidInode fsidInode = Vnode_GetFsidAndInode(vnode, context);
     uint32_t vid = vnode_vid(vnode);
+    uint32_t rootGeneration = s_rootGeneration;
+    if (VnodeCache_IsKnownNonRoot(vnode, vid, rootGeneration))
+    {
+        return -1;
+    }
+    
+    VnodeFsidInode fsidInode = Vnode_GetFsidAndInode(vnode, context);
     
     int16_t rootIndex;
     
@@ -98,13 +328,10 @@ int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context)
     
     if (rootIndex < 0)
     {
-        PrjFSVirtualizationRootXAttrData rootXattr = {};
-        SizeOrError xattrResult = Vnode_ReadXattr(vnode, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr), context);
-        if (xattrResult.error == 0)
+        uint64_t rootToken;
+        errno_t xattrError = ReadRootToken(vnode, context, &rootToken);
+        if (0 == xattrError)
         {
-            // TODO: check xattr contents
-            
-            
             char path[PrjFSMaxPath] = "";
             int pathLength = sizeof(path);
             vn_getpath(vnode, path, &pathLength);
@@ -117,88 +344,235 @@ int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context)
                 if (rootIndex < 0)
                 {
                     // Insert new offline root
-                    rootIndex = InsertVirtualizationRoot_Locked(nullptr, 0, vnode, vid, fsidInode, path);
-                    
-                    // TODO: error handling
-                    assert(rootIndex >= 0);
+                    rootIndex = InsertVirtualizationRoot_Locked(nullptr, 0, vnode, vid, fsidInode, rootToken, path);
                 }
-
             }
             RWLock_ReleaseExclusive(s_rwLock);
+            
+            if (rootIndex < 0)
+            {
+                // Too many roots, or out of memory (or over the roots' memory budget)
+                KextLog_Error("VirtualizationRoots_LookupVnode: failed to insert offline root. path '%s'", path);
+                if (nullptr != outLookupFailed)
+                {
+                    *outLookupFailed = true;
+                }
+            }
+        }
+        else if (ENOATTR == xattrError)
+        {
+            VnodeCache_SetKnownNonRoot(vnode, vid, rootGeneration);
+        }
+    }
+    
+    return rootIndex;
+}
+
+static bool FsidsAreEqual(fsid_t a, fsid_t b)
+{
+    return a.val[0] == b.val[0] && a.val[1] == b.val[1];
+}
+
+KEXT_STATIC uint32_t HashFsidInode(VnodeFsidInode fileId)
+{
+    uint64_t key =
+        fileId.inode
+        ^ (static_cast<uint64_t>(static_cast<uint32_t>(fileId.fsid.val[0])) << 32)
+        ^ static_cast<uint32_t>(fileId.fsid.val[1]);
+    
+    // Fibonacci hashing: inode numbers are frequently sequential, so mix them
+    // into the high bits before masking.
+    return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+KEXT_STATIC int16_t FindRootForVnode_Locked(vnode_t vnode, uint32_t vid, VnodeFsidInode fileId)
+{
+    int16_t rootIndex = FindRootIndex_Locked(fileId);
+    if (rootIndex >= 0)
+    {
+        VirtualizationRoot* rootEntry = s_virtualizationRoots[rootIndex];
+        if (rootEntry->rootVNode != vnode || rootEntry->rootVNodeVid != vid)
+        {
+            // root vnode must be stale, update it
+            rootEntry->rootVNode = vnode;
+            rootEntry->rootVNodeVid = vid;
         }
     }
     
     return rootIndex;
 }
 
-static int16_t FindUnusedIndex_Locked()
+static int16_t FindRootIndex_Locked(VnodeFsidInode fileId)
 {
-    for (int16_t i = 0; i < MaxVirtualizationRoots; ++i)
+    uint32_t mask = s_rootIndexTableCapacity - 1;
+    for (uint32_t slot = HashFsidInode(fileId) & mask; ; slot = (slot + 1) & mask)
     {
-        if (!s_virtualizationRoots[i].inUse)
+        int16_t rootIndex = s_rootIndexTable[slot];
+        if (rootIndex < 0)
+        {
+            return -1;
+        }
+        
+        VirtualizationRoot* rootEntry = s_virtualizationRoots[rootIndex];
+        if (FsidsAreEqual(rootEntry->rootFsid, fileId.fsid) && rootEntry->rootInode == fileId.inode)
         {
-            return i;
+            return rootIndex;
         }
     }
+}
+
+// Return values:
+// 0:        The vnode is a virtualization root
+// ENOATTR:  The vnode is not a virtualization root
+// EINVAL:   The root xattr is not in a format we understand
+// Other errors from reading the xattr
+static errno_t ReadRootToken(vnode_t vnode, vfs_context_t context, uint64_t* outRootToken)
+{
+    PrjFSVirtualizationRootXAttrData rootXattr = {};
+    SizeOrError xattrResult = Vnode_ReadXattr(vnode, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr), context);
+    if (0 != xattrResult.error)
+    {
+        return xattrResult.error;
+    }
     
-    return -1;
+    if (xattrResult.size < sizeof(rootXattr.header) || PlaceholderMagicNumber != rootXattr.header.magicNumber)
+    {
+        KextLog_FileError(vnode, "ReadRootToken: invalid virtualization root xattr (%lu bytes, magic 0x%x)", xattrResult.size, rootXattr.header.magicNumber);
+        return EINVAL;
+    }
+    
+    *outRootToken = xattrResult.size >= sizeof(rootXattr) ? rootXattr.rootToken : 0;
+    return 0;
 }
 
-static bool FsidsAreEqual(fsid_t a, fsid_t b)
+static void InsertIntoRootIndexTable(int16_t* table, uint32_t tableCapacity, VnodeFsidInode fileId, int16_t rootIndex)
 {
-    return a.val[0] == b.val[0] && a.val[1] == b.val[1];
+    uint32_t mask = tableCapacity - 1;
+    uint32_t slot = HashFsidInode(fileId) & mask;
+    while (table[slot] >= 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    
+    table[slot] = rootIndex;
 }
 
-static int16_t FindRootForVnode_Locked(vnode_t vnode, uint32_t vid, VnodeFsidInode fileId)
+// Grows the root array (and rebuilds the index table) so that it can hold at
+// least requiredCount roots. Returns false if the limit was reached or memory
+// could not be allocated, in which case the existing arrays are left untouched.
+static bool EnsureRootCapacity_Locked(uint32_t requiredCount)
 {
-    for (int16_t i = 0; i < MaxVirtualizationRoots; ++i)
+    if (requiredCount <= s_virtualizationRootCapacity)
+    {
+        return true;
+    }
+    
+    if (requiredCount > MaxVirtualizationRoots)
+    {
+        return false;
+    }
+    
+    uint32_t newCapacity = s_virtualizationRootCapacity > 0 ? s_virtualizationRootCapacity : InitialVirtualizationRootCapacity;
+    while (newCapacity < requiredCount)
+    {
+        newCapacity *= 2;
+    }
+    
+    if (newCapacity > MaxVirtualizationRoots)
+    {
+        newCapacity = MaxVirtualizationRoots;
+    }
+    
+    uint32_t newTableCapacity = newCapacity * 2;
+    
+    VirtualizationRoot** newRoots = static_cast<VirtualizationRoot**>(Memory_Alloc(KernelMemory_VirtualizationRoots, newCapacity * sizeof(newRoots[0])));
+    int16_t* newTable = static_cast<int16_t*>(Memory_Alloc(KernelMemory_VirtualizationRoots, newTableCapacity * sizeof(newTable[0])));
+    if (nullptr == newRoots || nullptr == newTable)
     {
-        VirtualizationRoot& rootEntry = s_virtualizationRoots[i];
-        if (!rootEntry.inUse)
+        if (nullptr != newRoots)
         {
-            continue;
+            Memory_Free(KernelMemory_VirtualizationRoots, newRoots, newCapacity * sizeof(newRoots[0]));
         }
         
-        if (rootEntry.rootVNode == vnode && rootEntry.rootVNodeVid == vid)
+        if (nullptr != newTable)
         {
-            assert(fileId.fsid.val[0] == rootEntry.rootFsid.val[0]);
-            return i;
+            Memory_Free(KernelMemory_VirtualizationRoots, newTable, newTableCapacity * sizeof(newTable[0]));
         }
         
-        if (FsidsAreEqual(rootEntry.rootFsid, fileId.fsid) && rootEntry.rootInode == fileId.inode)
-        {
-            // root vnode must be stale, update it
-            rootEntry.rootVNode = vnode;
-            rootEntry.rootVNodeVid = vid;
-            return i;
-        }
+        return false;
+    }
+    
+    memset(newRoots, 0, newCapacity * sizeof(newRoots[0]));
+    memset(newTable, 0xff, newTableCapacity * sizeof(newTable[0]));
+    
+    for (uint16_t i = 0; i < s_virtualizationRootCount; ++i)
+    {
+        VirtualizationRoot* root = s_virtualizationRoots[i];
+        newRoots[i] = root;
+        InsertIntoRootIndexTable(newTable, newTableCapacity, VnodeFsidInode { root->rootFsid, root->rootInode }, i);
     }
-    return -1;
+    
+    // Lock-free readers may still be using the old array
+    if (nullptr != s_virtualizationRoots)
+    {
+        assert(s_retiredRootArrayCount < MaxRetiredRootArrays);
+        s_retiredRootArrays[s_retiredRootArrayCount] = s_virtualizationRoots;
+        s_retiredRootArrayCapacities[s_retiredRootArrayCount] = s_virtualizationRootCapacity;
+        ++s_retiredRootArrayCount;
+    }
+    
+    if (nullptr != s_rootIndexTable)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, s_rootIndexTable, s_rootIndexTableCapacity * sizeof(s_rootIndexTable[0]));
+    }
+    
+    // Make sure the contents of the new array are visible before the pointer
+    OSMemoryBarrier();
+    s_virtualizationRoots = newRoots;
+    s_virtualizationRootCapacity = newCapacity;
+    s_rootIndexTable = newTable;
+    s_rootIndexTableCapacity = newTableCapacity;
+    
+    return true;
 }
 
 // Returns negative value if it failed, or inserted index on success
-static int16_t InsertVirtualizationRoot_Locked(PrjFSProviderUserClient* userClient, pid_t clientPID, vnode_t vnode, uint32_t vid, VnodeFsidInode persistentIds, const char* path)
+static int16_t InsertVirtualizationRoot_Locked(PrjFSProviderUserClient* userClient, pid_t clientPID, vnode_t vnode, uint32_t vid, VnodeFsidInode persistentIds, uint64_t rootToken, const char* path)
 {
-    // New root
-    int16_t rootIndex = FindUnusedIndex_Locked();
+    if (!EnsureRootCapacity_Locked(s_virtualizationRootCount + 1u))
+    {
+        return -1;
+    }
     
-    if (rootIndex >= 0)
+    VirtualizationRoot* root = static_cast<VirtualizationRoot*>(Memory_Alloc(KernelMemory_VirtualizationRoots, sizeof(VirtualizationRoot)));
+    if (nullptr == root)
     {
-        assert(rootIndex < MaxVirtualizationRoots);
-        VirtualizationRoot* root = &s_virtualizationRoots[rootIndex];
-        
-        root->providerUserClient = userClient;
-        root->providerPid = clientPID;
-        root->inUse = true;
-        root->index = rootIndex;
-
-        root->rootVNode = vnode;
-        root->rootVNodeVid = vid;
-        root->rootFsid = persistentIds.fsid;
-        root->rootInode = persistentIds.inode;
-        strlcpy(root->path, path, sizeof(root->path));
+        return -1;
     }
     
+    int16_t rootIndex = s_virtualizationRootCount;
+    assert(rootIndex < s_virtualizationRootCapacity);
+    
+    // Placement new, as the atomic members make the struct non-assignable
+    new (root) VirtualizationRoot {};
+    root->providerUserClient = userClient;
+    root->providerPid = clientPID;
+    root->inUse = true;
+    root->index = rootIndex;
+
+    root->rootVNode = vnode;
+    root->rootVNodeVid = vid;
+    root->rootFsid = persistentIds.fsid;
+    root->rootInode = persistentIds.inode;
+    root->rootToken = rootToken;
+    strlcpy(root->path, path, sizeof(root->path));
+    root->pathLength = static_cast<uint32_t>(strlen(root->path));
+    
+    s_virtualizationRoots[rootIndex] = root;
+    ++s_virtualizationRootCount;
+    InsertIntoRootIndexTable(s_rootIndexTable, s_rootIndexTableCapacity, persistentIds, rootIndex);
+    OSIncrementAtomic(reinterpret_cast<volatile SInt32*>(&s_rootGeneration));
+    
     return rootIndex;
 }
 
@@ -208,7 +582,7 @@ static int16_t InsertVirtualizationRoot_Locked(PrjFSProviderUserClient* userClie
 // ENOTDIR:  Selected virtualization root path does not resolve to a directory.
 // EBUSY:    Already a provider for this virtualization root.
 // ENOENT,…: Error returned by vnode_lookup.
-VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProviderUserClient* userClient, pid_t clientPID, const char* virtualizationRootPath)
+VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProviderUserClient* userClient, pid_t clientPID, const char* virtualizationRootPath, uint32_t rootFlags)
 {
     assert(nullptr != virtualizationRootPath);
     assert(nullptr != userClient);
@@ -233,13 +607,17 @@ VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProvide
             VnodeFsidInode vnodeIds = Vnode_GetFsidAndInode(virtualizationRootVNode, vfsContext);
             uint32_t rootVid = vnode_vid(virtualizationRootVNode);
             
+            // The provider may have only just added a token to the xattr
+            uint64_t rootToken = 0;
+            ReadRootToken(virtualizationRootVNode, vfsContext, &rootToken);
+            
             RWLock_AcquireExclusive(s_rwLock);
             {
                 rootIndex = FindRootForVnode_Locked(virtualizationRootVNode, rootVid, vnodeIds);
                 if (rootIndex >= 0)
                 {
                     // Reattaching to existing root
-                    if (nullptr != s_virtualizationRoots[rootIndex].providerUserClient)
+                    if (nullptr != s_virtualizationRoots[rootIndex]->providerUserClient)
                     {
                         // Only one provider per root
                         err = EBUSY;
@@ -247,28 +625,29 @@ VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProvide
                     }
                     else
                     {
-                        VirtualizationRoot& root = s_virtualizationRoots[rootIndex];
-                        root.providerUserClient = userClient;
-                        root.providerPid = clientPID;
+                        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+                        root->rootToken = rootToken;
+                        AttachProvider_Locked(root, userClient, clientPID, rootFlags);
                         virtualizationRootVNode = NULLVP; // transfer ownership
                     }
                 }
                 else
                 {
-                    rootIndex = InsertVirtualizationRoot_Locked(userClient, clientPID, virtualizationRootVNode, rootVid, vnodeIds, virtualizationRootPath);
+                    rootIndex = InsertVirtualizationRoot_Locked(userClient, clientPID, virtualizationRootVNode, rootVid, vnodeIds, rootToken, virtualizationRootPath);
                     if (rootIndex >= 0)
                     {
-                        assert(rootIndex < MaxVirtualizationRoots);
-                        VirtualizationRoot* root = &s_virtualizationRoots[rootIndex];
+                        assert(rootIndex < s_virtualizationRootCount);
+                        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
                     
-                        strlcpy(root->path, virtualizationRootPath, sizeof(root->path));
+                        root->providerRootFlags = rootFlags;
                         virtualizationRootVNode = NULLVP; // prevent vnode_put later; active provider should hold vnode reference
                     
                         KextLog_Note("VirtualizationRoot_RegisterProviderForPath: new root not found in offline roots, inserted as new root with index %d. path '%s'", rootIndex, virtualizationRootPath);
                     }
                     else
                     {
-                        // TODO: scan the array for roots on mounts which have disappeared, or grow the array
+                        // TODO: scan the array for roots on mounts which have disappeared
+                        err = ENOMEM;
                         KextLog_Error("VirtualizationRoot_RegisterProviderForPath: failed to insert new root");
                     }
                 }
@@ -287,14 +666,112 @@ VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProvide
     return VirtualizationRootResult { err, rootIndex };
 }
 
+// Return values:
+// 0:        Provider attached to the root
+// ENOENT:   No root with these ids and token is known, e.g. since the kext was loaded
+// ESTALE:   The root's vnode has been recycled since it was last seen
+// EBUSY:    Already a provider for this virtualization root
+// In the first two cases, the provider should register the root by path instead.
+VirtualizationRootResult VirtualizationRoot_ReattachProvider(PrjFSProviderUserClient* userClient, pid_t clientPID, VnodeFsidInode rootIds, uint64_t rootToken, uint32_t rootFlags)
+{
+    assert(nullptr != userClient);
+    
+    if (0 == rootToken)
+    {
+        return VirtualizationRootResult { ENOENT, -1 };
+    }
+    
+    errno_t err = 0;
+    int16_t rootIndex;
+    vnode_t rootVnode = NULLVP;
+    uint32_t rootVid = 0;
+    
+    RWLock_AcquireShared(s_rwLock);
+    {
+        rootIndex = FindRootIndex_Locked(rootIds);
+        if (rootIndex < 0 || s_virtualizationRoots[rootIndex]->rootToken != rootToken)
+        {
+            err = ENOENT;
+        }
+        else if (nullptr != s_virtualizationRoots[rootIndex]->providerUserClient)
+        {
+            err = EBUSY;
+        }
+        else
+        {
+            rootVnode = s_virtualizationRoots[rootIndex]->rootVNode;
+            rootVid = s_virtualizationRoots[rootIndex]->rootVNodeVid;
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    // Offline roots hold no iocount on their vnode. Taking one can block, so it
+    // is done without the lock and the root is checked again afterwards.
+    if (0 == err && 0 != vnode_getwithvid(rootVnode, rootVid))
+    {
+        err = ESTALE;
+        rootVnode = NULLVP;
+    }
+    
+    if (0 == err)
+    {
+        RWLock_AcquireExclusive(s_rwLock);
+        {
+            VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+            if (nullptr != root->providerUserClient)
+            {
+                err = EBUSY;
+            }
+            else if (root->rootVNode != rootVnode || root->rootVNodeVid != rootVid)
+            {
+                err = ESTALE;
+            }
+            else
+            {
+                AttachProvider_Locked(root, userClient, clientPID, rootFlags);
+                rootVnode = NULLVP; // transfer ownership
+            }
+        }
+        RWLock_ReleaseExclusive(s_rwLock);
+    }
+    
+    if (NULLVP != rootVnode)
+    {
+        vnode_put(rootVnode);
+    }
+    
+    return VirtualizationRootResult { err, 0 == err ? rootIndex : -1 };
+}
+
+// The root's vnode must already have an iocount, which becomes the provider's
+static void AttachProvider_Locked(VirtualizationRoot* root, PrjFSProviderUserClient* userClient, pid_t clientPID, uint32_t rootFlags)
+{
+    root->providerUserClient = userClient;
+    root->providerPid = clientPID;
+    root->providerRootFlags = rootFlags;
+    // Timeouts are chosen by each provider, don't inherit the previous one's
+    memset(root->requestTimeoutMilliseconds, 0, sizeof(root->requestTimeoutMilliseconds));
+    root->prefetchHintIntervalMilliseconds = 0;
+    root->requestRateLimitPerSecond = 0;
+    SetHelperProcesses_Locked(root, nullptr, 0, 0);
+    // Nor how quickly the previous one responded
+    atomic_store(&root->averageResponseNanoseconds, 0);
+    atomic_store(&root->lastResponseNanoseconds, GetUptimeNanoseconds());
+    atomic_store(&root->providerUnresponsive, false);
+}
+
 void ActiveProvider_Disconnect(int32_t rootIndex)
 {
     assert(rootIndex >= 0);
-    assert(rootIndex <= MaxVirtualizationRoots);
 
+    uint8_t* notificationMappings;
+    uint32_t notificationMappingsSize;
+    VnodeFsidInode* modifiedFiles;
+    
     RWLock_AcquireExclusive(s_rwLock);
     {
-        VirtualizationRoot* root = &s_virtualizationRoots[rootIndex];
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
         assert(nullptr != root->providerUserClient);
         
         assert(NULLVP != root->rootVNode);
@@ -302,52 +779,836 @@ void ActiveProvider_Disconnect(int32_t rootIndex)
         root->providerPid = 0;
         
         root->providerUserClient = nullptr;
+        root->providerRootFlags = ProviderRoot_None;
+        SetHelperProcesses_Locked(root, nullptr, 0, 0);
+        
+        // Mappings are chosen by each provider, don't pass them on to the next one
+        notificationMappings = root->notificationMappings;
+        notificationMappingsSize = root->notificationMappingsSize;
+        root->notificationMappings = nullptr;
+        root->notificationMappingsSize = 0;
+        SetNotificationFlags_Locked(root, ProviderNotification_None);
+        modifiedFiles = ReplaceModifiedFileSet_Locked(root, nullptr);
+        
+        VirtualizationRootRequestStats& stats = root->requestStats;
+        KextLog_Info(
+            "ActiveProvider_Disconnect: root %d: %llu responses, %llu timeouts, %llu aborted, %llu ms total wait, %llu ms max wait",
+            rootIndex,
+            atomic_load(&stats.responseCount),
+            atomic_load(&stats.timeoutCount),
+            atomic_load(&stats.providerDisconnectedCount),
+            atomic_load(&stats.totalWaitNanoseconds) / 1000000,
+            atomic_load(&stats.maxWaitNanoseconds) / 1000000);
     }
     RWLock_ReleaseExclusive(s_rwLock);
+    
+    if (nullptr != notificationMappings)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, notificationMappings, notificationMappingsSize);
+    }
+    
+    if (nullptr != modifiedFiles)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, modifiedFiles, ModifiedFileSetSizeBytes);
+    }
 }
 
-errno_t ActiveProvider_SendMessage(int32_t rootIndex, const Message message)
+// Return values:
+// 0:        Timeout set
+// EINVAL:   Not a message type the kernel sends to providers
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_SetRequestTimeout(int32_t rootIndex, MessageType messageType, uint32_t timeoutMilliseconds)
 {
     assert(rootIndex >= 0);
-    assert(rootIndex < MaxVirtualizationRoots);
-
-    PrjFSProviderUserClient* userClient = nullptr;
     
-    RWLock_AcquireExclusive(s_rwLock);
+    // Only messages the kernel waits on can time out
+    switch (messageType)
     {
-        userClient = s_virtualizationRoots[rootIndex].providerUserClient;
-        if (nullptr != userClient)
-        {
-            userClient->retain();
-        }
+    case MessageType_KtoU_EnumerateDirectory:
+    case MessageType_KtoU_HydrateFile:
+    case MessageType_KtoU_NotifyFilePreDelete:
+    case MessageType_KtoU_NotifyDirectoryPreDelete:
+        break;
+    default:
+        return EINVAL;
     }
-    RWLock_ReleaseExclusive(s_rwLock);
     
-    if (nullptr != userClient)
+    errno_t error = 0;
+    RWLock_AcquireShared(s_rwLock);
     {
-        uint32_t messageSize = sizeof(*message.messageHeader) + message.messageHeader->pathSizeBytes;
-        uint8_t messageMemory[messageSize];
-        memcpy(messageMemory, message.messageHeader, sizeof(*message.messageHeader));
-        if (message.messageHeader->pathSizeBytes > 0)
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
         {
-            memcpy(messageMemory + sizeof(*message.messageHeader), message.path, message.messageHeader->pathSizeBytes);
+            error = ENODEV;
+        }
+        else
+        {
+            root->requestTimeoutMilliseconds[messageType] = timeoutMilliseconds;
         }
-        
-        userClient->sendMessage(messageMemory, messageSize);
-        userClient->release();
-        return 0;
-    }
-    else
-    {
-        return EIO;
     }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return error;
 }
 
-bool VirtualizationRoot_VnodeIsOnAllowedFilesystem(vnode_t vnode)
+// Return values:
+// 0:        Interval set
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_SetPrefetchHintInterval(int32_t rootIndex, uint32_t intervalMilliseconds)
 {
-    vfsstatfs* vfsStat = vfs_statfs(vnode_mount(vnode));
-    return
-        0 == strncmp("hfs", vfsStat->f_fstypename, sizeof(vfsStat->f_fstypename))
-        || 0 == strncmp("apfs", vfsStat->f_fstypename, sizeof(vfsStat->f_fstypename));
+    assert(rootIndex >= 0);
+    
+    errno_t error = 0;
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
+        {
+            error = ENODEV;
+        }
+        else
+        {
+            root->prefetchHintIntervalMilliseconds = intervalMilliseconds;
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return error;
 }
 
+// Return values:
+// 0:        Limit set
+// EINVAL:   A burst of 0 for a non-zero rate, or a delay over MaxRequestRateLimitDelayMilliseconds
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_SetRequestRateLimit(int32_t rootIndex, uint32_t requestsPerSecond, uint32_t burst, uint32_t maxDelayMilliseconds)
+{
+    assert(rootIndex >= 0);
+    
+    if ((0 != requestsPerSecond && 0 == burst) || maxDelayMilliseconds > MaxRequestRateLimitDelayMilliseconds)
+    {
+        return EINVAL;
+    }
+    
+    errno_t error = 0;
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
+        {
+            error = ENODEV;
+        }
+        else
+        {
+            root->requestRateLimitBurst = burst;
+            root->requestRateLimitMaxDelayMilliseconds = maxDelayMilliseconds;
+            root->requestRateLimitPerSecond = requestsPerSecond;
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return error;
+}
+
+// Replaces the root's helper processes.
+// Return values:
+// 0:        Helpers set
+// EINVAL:   Too many pids, or an invalid pid or process group
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_SetHelperProcesses(int32_t rootIndex, const int32_t* pids, uint32_t pidCount, int32_t processGroupId)
+{
+    assert(rootIndex >= 0);
+    
+    if (pidCount > MaxProviderHelperProcesses || processGroupId < 0)
+    {
+        return EINVAL;
+    }
+    
+    for (uint32_t i = 0; i < pidCount; ++i)
+    {
+        if (pids[i] <= 0)
+        {
+            return EINVAL;
+        }
+    }
+    
+    errno_t error = 0;
+    RWLock_AcquireExclusive(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
+        {
+            error = ENODEV;
+        }
+        else
+        {
+            SetHelperProcesses_Locked(root, pids, pidCount, processGroupId);
+        }
+    }
+    RWLock_ReleaseExclusive(s_rwLock);
+    
+    return error;
+}
+
+bool VirtualizationRoot_IsProviderProcess(VirtualizationRoot* root, int pid, vfs_context_t context)
+{
+    if (nullptr == root->providerUserClient)
+    {
+        return false;
+    }
+    
+    if (pid == root->providerPid)
+    {
+        return true;
+    }
+    
+    // Usually there are none, or only a handful
+    uint32_t helperCount = atomic_load_explicit(&root->helperPidCount, memory_order_acquire);
+    for (uint32_t i = 0; i < helperCount; ++i)
+    {
+        if (pid == atomic_load_explicit(&root->helperPids[i], memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    
+    int processGroupId = atomic_load_explicit(&root->helperProcessGroupId, memory_order_relaxed);
+    return 0 != processGroupId && processGroupId == proc_pgrpid(vfs_context_proc(context));
+}
+
+// Replaces the root's notification mappings with a copy of the given ones.
+// Return values:
+// 0:        Mappings set
+// EINVAL:   Malformed mappings
+// ENOMEM:   Unable to allocate memory for the mappings
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_SetNotificationMappings(int32_t rootIndex, const void* mappings, uint32_t mappingsSize)
+{
+    assert(rootIndex >= 0);
+    
+    uint32_t notificationFlags;
+    errno_t error = ValidateNotificationMappings(static_cast<const uint8_t*>(mappings), mappingsSize, &notificationFlags);
+    if (0 != error)
+    {
+        return error;
+    }
+    
+    uint8_t* newMappings = nullptr;
+    if (0 != mappingsSize)
+    {
+        newMappings = static_cast<uint8_t*>(Memory_Alloc(KernelMemory_VirtualizationRoots, mappingsSize));
+        if (nullptr == newMappings)
+        {
+            return ENOMEM;
+        }
+        
+        memcpy(newMappings, mappings, mappingsSize);
+    }
+    
+    // An existing set of modified files is kept, so this is only used if the
+    // root doesn't have one yet.
+    VnodeFsidInode* newModifiedFiles = nullptr;
+    if (notificationFlags & ProviderNotification_RecordModifiedFile)
+    {
+        newModifiedFiles = static_cast<VnodeFsidInode*>(Memory_Alloc(KernelMemory_VirtualizationRoots, ModifiedFileSetSizeBytes));
+        if (nullptr == newModifiedFiles)
+        {
+            if (nullptr != newMappings)
+            {
+                Memory_Free(KernelMemory_VirtualizationRoots, newMappings, mappingsSize);
+            }
+            
+            return ENOMEM;
+        }
+        
+        memset(newModifiedFiles, 0, ModifiedFileSetSizeBytes);
+    }
+    
+    // Whichever set of mappings is not in use afterwards
+    uint8_t* unusedMappings = newMappings;
+    uint32_t unusedMappingsSize = mappingsSize;
+    VnodeFsidInode* unusedModifiedFiles = newModifiedFiles;
+    
+    RWLock_AcquireExclusive(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
+        {
+            error = ENODEV;
+        }
+        else
+        {
+            unusedMappings = root->notificationMappings;
+            unusedMappingsSize = root->notificationMappingsSize;
+            root->notificationMappings = newMappings;
+            root->notificationMappingsSize = mappingsSize;
+            SetNotificationFlags_Locked(root, notificationFlags);
+            
+            if (nullptr == newModifiedFiles)
+            {
+                unusedModifiedFiles = ReplaceModifiedFileSet_Locked(root, nullptr);
+            }
+            else if (nullptr == root->modifiedFiles)
+            {
+                unusedModifiedFiles = ReplaceModifiedFileSet_Locked(root, newModifiedFiles);
+            }
+        }
+    }
+    RWLock_ReleaseExclusive(s_rwLock);
+    
+    if (nullptr != unusedMappings)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, unusedMappings, unusedMappingsSize);
+    }
+    
+    if (nullptr != unusedModifiedFiles)
+    {
+        Memory_Free(KernelMemory_VirtualizationRoots, unusedModifiedFiles, ModifiedFileSetSizeBytes);
+    }
+    
+    return error;
+}
+
+bool VirtualizationRoots_AnyWantNotifications()
+{
+    return 0 != atomic_load_explicit(&s_notifyingRootCount, memory_order_relaxed);
+}
+
+bool VirtualizationRoot_MayWantNotification(VirtualizationRoot* root, uint32_t notificationFlags)
+{
+    return 0 != (atomic_load_explicit(&root->notificationFlags, memory_order_relaxed) & notificationFlags);
+}
+
+uint32_t VirtualizationRoot_GetNotificationFlags(VirtualizationRoot* root, const char* relativePath)
+{
+    uint32_t notificationFlags = ProviderNotification_None;
+    
+    RWLock_AcquireShared(s_rwLock);
+    {
+        // The entries were validated when they were set
+        int32_t longestMatchLength = -1;
+        uint32_t offset = 0;
+        while (offset < root->notificationMappingsSize)
+        {
+            const NotificationMappingEntry* entry = reinterpret_cast<const NotificationMappingEntry*>(root->notificationMappings + offset);
+            const char* mappingPath = reinterpret_cast<const char*>(entry + 1);
+            uint32_t mappingPathLength = entry->pathSizeBytes - 1u;
+            if (static_cast<int32_t>(mappingPathLength) > longestMatchLength &&
+                PathIsWithinMapping(relativePath, mappingPath, mappingPathLength))
+            {
+                longestMatchLength = mappingPathLength;
+                notificationFlags = entry->notificationFlags;
+            }
+            
+            offset += NotificationMappingEntry_GetSize(entry->pathSizeBytes);
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return notificationFlags;
+}
+
+void VirtualizationRoot_RecordModifiedFile(VirtualizationRoot* root, VnodeFsidInode fileId)
+{
+    // Inode 0 marks empty slots; no file system hands it out
+    if (0 == fileId.inode)
+    {
+        return;
+    }
+    
+    Mutex_Acquire(s_modifiedFilesMutex);
+    {
+        VnodeFsidInode* set = root->modifiedFiles;
+        if (nullptr != set)
+        {
+            uint32_t mask = ModifiedFileSetCapacity - 1;
+            uint32_t slot = HashFsidInode(fileId) & mask;
+            while (0 != set[slot].inode &&
+                   (set[slot].inode != fileId.inode || !FsidsAreEqual(set[slot].fsid, fileId.fsid)))
+            {
+                slot = (slot + 1) & mask;
+            }
+            
+            if (0 != set[slot].inode)
+            {
+                atomic_fetch_add(&root->requestStats.modifiedFilesDuplicateCount, 1);
+            }
+            else if (root->modifiedFilesCount >= ModifiedFileSetMaxCount)
+            {
+                root->modifiedFilesOverflowed = true;
+            }
+            else
+            {
+                set[slot] = fileId;
+                root->modifiedFilesCount++;
+                atomic_fetch_add(&root->requestStats.modifiedFilesRecordedCount, 1);
+            }
+        }
+    }
+    Mutex_Release(s_modifiedFilesMutex);
+}
+
+// Moves up to maxEntryCount files from the root's set of modified files to
+// outEntries, and clears the overflow flag once it has been reported.
+// Return values:
+// 0:        Entries drained (possibly none)
+// EINVAL:   The provider's notification mappings don't ask for modified files
+// ENODEV:   The root has no active provider
+errno_t ActiveProvider_DrainModifiedFiles(
+    int32_t rootIndex,
+    ModifiedFileEntry* outEntries,
+    uint32_t maxEntryCount,
+    uint32_t* outEntryCount,
+    uint32_t* outRemainingCount,
+    bool* outOverflowed)
+{
+    assert(rootIndex >= 0);
+    
+    *outEntryCount = 0;
+    *outRemainingCount = 0;
+    *outOverflowed = false;
+    
+    errno_t error = 0;
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr == root->providerUserClient)
+        {
+            error = ENODEV;
+        }
+        else if (nullptr == root->modifiedFiles)
+        {
+            error = EINVAL;
+        }
+        else
+        {
+            Mutex_Acquire(s_modifiedFilesMutex);
+            {
+                // Removal shifts later entries of a probe sequence back into the
+                // freed slot, so re-examine the slot before moving on. Entries
+                // that wrap around to slots already passed stay for the next drain.
+                VnodeFsidInode* set = root->modifiedFiles;
+                uint32_t slot = 0;
+                while (slot < ModifiedFileSetCapacity && *outEntryCount < maxEntryCount && 0 != root->modifiedFilesCount)
+                {
+                    if (0 == set[slot].inode)
+                    {
+                        slot++;
+                        continue;
+                    }
+                    
+                    outEntries[*outEntryCount] = ModifiedFileEntry { set[slot].fsid, set[slot].inode };
+                    (*outEntryCount)++;
+                    RemoveModifiedFileAtSlot_Locked(set, slot);
+                    root->modifiedFilesCount--;
+                }
+                
+                *outRemainingCount = root->modifiedFilesCount;
+                *outOverflowed = root->modifiedFilesOverflowed;
+                root->modifiedFilesOverflowed = false;
+            }
+            Mutex_Release(s_modifiedFilesMutex);
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return error;
+}
+
+void VirtualizationRoot_RecordRequestWait(VirtualizationRoot* root, RequestWaitOutcome outcome, uint64_t waitNanoseconds)
+{
+    VirtualizationRootRequestStats& stats = root->requestStats;
+    switch (outcome)
+    {
+    case RequestWaitOutcome_Response:
+        atomic_fetch_add(&stats.responseCount, 1);
+        break;
+    case RequestWaitOutcome_TimedOut:
+        atomic_fetch_add(&stats.timeoutCount, 1);
+        break;
+    case RequestWaitOutcome_ProviderDisconnected:
+        atomic_fetch_add(&stats.providerDisconnectedCount, 1);
+        break;
+    case RequestWaitOutcome_Interrupted:
+        atomic_fetch_add(&stats.interruptedCount, 1);
+        break;
+    }
+    
+    atomic_fetch_add(&stats.totalWaitNanoseconds, waitNanoseconds);
+    
+    uint64_t waitMicroseconds = waitNanoseconds / 1000;
+    uint32_t bucket = 0;
+    while (waitMicroseconds > 1 && bucket < VirtualizationRootWaitHistogramBucketCount - 1)
+    {
+        waitMicroseconds >>= 1;
+        ++bucket;
+    }
+    atomic_fetch_add(&stats.waitHistogram[bucket], 1);
+    
+    unsigned long long maxWait = atomic_load(&stats.maxWaitNanoseconds);
+    while (waitNanoseconds > maxWait &&
+           !atomic_compare_exchange_weak(&stats.maxWaitNanoseconds, &maxWait, waitNanoseconds))
+    {
+    }
+}
+
+void VirtualizationRoot_RecordResponseLatency(VirtualizationRoot* root, uint64_t latencyNanoseconds)
+{
+    uint32_t latency = latencyNanoseconds > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(latencyNanoseconds);
+    uint32_t average = atomic_load(&root->averageResponseNanoseconds);
+    
+    // Weighs each response by 1/8. Concurrent updates may lose a sample, which
+    // doesn't matter for an estimate.
+    uint32_t newAverage = (0 == average) ? latency : static_cast<uint32_t>(average + (static_cast<int64_t>(latency) - average) / 8);
+    atomic_store(&root->averageResponseNanoseconds, newAverage);
+}
+
+void ActiveProvider_RecordResponses(int32_t rootIndex)
+{
+    assert(rootIndex >= 0);
+    
+    VirtualizationRoot* root = GetRootForIndex(rootIndex);
+    atomic_store(&root->lastResponseNanoseconds, GetUptimeNanoseconds());
+    if (atomic_load(&root->providerUnresponsive) && atomic_exchange(&root->providerUnresponsive, false))
+    {
+        KextLog_Info("ActiveProvider_RecordResponses: root %d: provider pid %d is responding again", rootIndex, root->providerPid);
+    }
+}
+
+void VirtualizationRoot_CheckProviderResponsive(VirtualizationRoot* root, uint64_t waitStartNanoseconds)
+{
+    uint64_t nowNanoseconds = GetUptimeNanoseconds();
+    if (atomic_load(&root->providerUnresponsive) ||
+        nowNanoseconds - waitStartNanoseconds < ProviderUnresponsiveNanoseconds ||
+        nowNanoseconds - atomic_load(&root->lastResponseNanoseconds) < ProviderUnresponsiveNanoseconds)
+    {
+        return;
+    }
+    
+    if (!atomic_exchange(&root->providerUnresponsive, true))
+    {
+        atomic_store(&root->lastUnresponsiveProbeNanoseconds, nowNanoseconds);
+        atomic_fetch_add(&root->requestStats.unresponsiveCount, 1);
+        KextLog_Error(
+            "VirtualizationRoot_CheckProviderResponsive: root %d: provider pid %d has not responded for %llu ms",
+            root->index,
+            root->providerPid,
+            (nowNanoseconds - atomic_load(&root->lastResponseNanoseconds)) / 1000000);
+    }
+}
+
+bool VirtualizationRoot_IsProviderUnresponsive(const VirtualizationRoot* root)
+{
+    return atomic_load(&root->providerUnresponsive);
+}
+
+bool VirtualizationRoot_MaySendRequest(VirtualizationRoot* root)
+{
+    if (!atomic_load(&root->providerUnresponsive))
+    {
+        return true;
+    }
+    
+    // Only one of the threads that find the probe due gets to send it
+    uint64_t nowNanoseconds = GetUptimeNanoseconds();
+    unsigned long long lastProbeNanoseconds = atomic_load(&root->lastUnresponsiveProbeNanoseconds);
+    return
+        nowNanoseconds - lastProbeNanoseconds >= UnresponsiveProbeIntervalNanoseconds &&
+        atomic_compare_exchange_strong(&root->lastUnresponsiveProbeNanoseconds, &lastProbeNanoseconds, nowNanoseconds);
+}
+
+uint32_t VirtualizationRoot_GetResponseSpinNanoseconds(VirtualizationRoot* root)
+{
+    // A sleep and wakeup costs some tens of microseconds, so spinning only helps
+    // if responses typically arrive within about that. Spinning for twice the
+    // average catches most of them when response times vary.
+    uint32_t average = atomic_load(&root->averageResponseNanoseconds);
+    if (0 == average || average > MaxResponseSpinNanoseconds)
+    {
+        return 0;
+    }
+    
+    return 2 * average < MaxResponseSpinNanoseconds ? 2 * average : MaxResponseSpinNanoseconds;
+}
+
+void VirtualizationRoot_GetRequestStats(int32_t rootIndex, VirtualizationRootRequestStatsSnapshot* outStats)
+{
+    assert(rootIndex >= 0);
+    
+    // The counters are atomics, so no lock is needed
+    VirtualizationRootRequestStats& stats = GetRootForIndex(rootIndex)->requestStats;
+    
+    outStats->responseCount =               atomic_load(&stats.responseCount);
+    outStats->timeoutCount =                atomic_load(&stats.timeoutCount);
+    outStats->providerDisconnectedCount =   atomic_load(&stats.providerDisconnectedCount);
+    outStats->interruptedCount =            atomic_load(&stats.interruptedCount);
+    outStats->totalWaitNanoseconds =        atomic_load(&stats.totalWaitNanoseconds);
+    outStats->maxWaitNanoseconds =          atomic_load(&stats.maxWaitNanoseconds);
+    for (uint32_t i = 0; i < VirtualizationRootWaitHistogramBucketCount; ++i)
+    {
+        outStats->waitHistogram[i] =        atomic_load(&stats.waitHistogram[i]);
+    }
+    
+    outStats->kauthCallbackCount =          atomic_load(&stats.kauthCallbackCount);
+    outStats->providerPidDeferCount =       atomic_load(&stats.providerPidDeferCount);
+    outStats->enumerationsSentCount =       atomic_load(&stats.enumerationsSentCount);
+    outStats->hydrationsSentCount =         atomic_load(&stats.hydrationsSentCount);
+    outStats->coalescedWaitCount =          atomic_load(&stats.coalescedWaitCount);
+    outStats->cancelsSentCount =            atomic_load(&stats.cancelsSentCount);
+    outStats->notificationsSentCount =      atomic_load(&stats.notificationsSentCount);
+    outStats->notificationsFilteredCount =  atomic_load(&stats.notificationsFilteredCount);
+    outStats->modifiedFilesRecordedCount =  atomic_load(&stats.modifiedFilesRecordedCount);
+    outStats->modifiedFilesDuplicateCount = atomic_load(&stats.modifiedFilesDuplicateCount);
+    outStats->prefetchHintsSentCount =      atomic_load(&stats.prefetchHintsSentCount);
+    outStats->prefetchHintsDroppedCount =   atomic_load(&stats.prefetchHintsDroppedCount);
+    outStats->rateLimitDelayedCount =       atomic_load(&stats.rateLimitDelayedCount);
+    outStats->rateLimitDeniedCount =        atomic_load(&stats.rateLimitDeniedCount);
+    outStats->spinWaitResponseCount =       atomic_load(&stats.spinWaitResponseCount);
+    outStats->unresponsiveCount =           atomic_load(&stats.unresponsiveCount);
+    outStats->unresponsiveRejectedCount =   atomic_load(&stats.unresponsiveRejectedCount);
+}
+
+uint64_t VirtualizationRoot_GetWiredBytes(int32_t rootIndex)
+{
+    assert(rootIndex >= 0);
+    
+    uint64_t wiredBytes = sizeof(VirtualizationRoot);
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        VirtualizationRoot* root = s_virtualizationRoots[rootIndex];
+        if (nullptr != root->notificationMappings)
+        {
+            wiredBytes += root->notificationMappingsSize;
+        }
+        
+        if (nullptr != root->modifiedFiles)
+        {
+            wiredBytes += ModifiedFileSetSizeBytes;
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    return wiredBytes;
+}
+
+errno_t ActiveProvider_SendMessage(int32_t rootIndex, const Message message, bool waitIfQueueFull)
+{
+    assert(rootIndex >= 0);
+
+    PrjFSProviderUserClient* userClient = nullptr;
+    
+    // retain() is atomic, so the shared lock suffices to stop the provider
+    // from being disconnected (and released) while we take our reference.
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        userClient = GetRootForIndex(rootIndex)->providerUserClient;
+        if (nullptr != userClient)
+        {
+            userClient->retain();
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    if (nullptr != userClient)
+    {
+        bool sent = userClient->sendMessage(message, waitIfQueueFull);
+        userClient->release();
+        return sent ? 0 : ENOBUFS;
+    }
+    else
+    {
+        return EIO;
+    }
+}
+
+void ActiveProvider_DrainResponseRing(int32_t rootIndex)
+{
+    assert(rootIndex >= 0);
+
+    PrjFSProviderUserClient* userClient = nullptr;
+    
+    RWLock_AcquireShared(s_rwLock);
+    {
+        assert(rootIndex < s_virtualizationRootCount);
+        userClient = GetRootForIndex(rootIndex)->providerUserClient;
+        if (nullptr != userClient)
+        {
+            userClient->retain();
+        }
+    }
+    RWLock_ReleaseShared(s_rwLock);
+    
+    if (nullptr != userClient)
+    {
+        userClient->drainResponseRing();
+        userClient->release();
+    }
+}
+
+// Called for every kauth vnode event on the system, so the common case must
+// not touch any locks or compare strings.
+bool VirtualizationRoot_VnodeIsOnAllowedFilesystem(vnode_t vnode)
+{
+    mount_t mount = vnode_mount(vnode);
+    int typeNumber = vfs_typenum(mount);
+    uint64_t typeBit = (typeNumber >= 0 && typeNumber < 64) ? (1ull << typeNumber) : 0;
+    
+    if (0 != (atomic_load_explicit(&s_checkedFilesystemTypes, memory_order_acquire) & typeBit))
+    {
+        return 0 != (atomic_load_explicit(&s_allowedFilesystemTypes, memory_order_relaxed) & typeBit);
+    }
+    
+    vfsstatfs* vfsStat = vfs_statfs(mount);
+    bool isAllowed = FilesystemTypeNameIsAllowed(vfsStat->f_fstypename, sizeof(vfsStat->f_fstypename));
+    if (0 != typeBit)
+    {
+        // Publish the result before marking the type as checked
+        if (isAllowed)
+        {
+            atomic_fetch_or(&s_allowedFilesystemTypes, typeBit);
+        }
+        
+        atomic_fetch_or(&s_checkedFilesystemTypes, typeBit);
+    }
+    
+    return isAllowed;
+}
+
+static bool FilesystemTypeNameIsAllowed(const char* typeName, size_t typeNameSize)
+{
+    return
+        0 == strncmp("hfs", typeName, typeNameSize)
+        || 0 == strncmp("apfs", typeName, typeNameSize);
+}
+
+static errno_t ValidateNotificationMappings(const uint8_t* mappings, uint32_t mappingsSize, uint32_t* outNotificationFlags)
+{
+    *outNotificationFlags = ProviderNotification_None;
+    if (mappingsSize > MaxNotificationMappingsSizeBytes || (0 != mappingsSize && nullptr == mappings))
+    {
+        return EINVAL;
+    }
+    
+    uint32_t offset = 0;
+    while (offset < mappingsSize)
+    {
+        if (mappingsSize - offset < sizeof(NotificationMappingEntry))
+        {
+            return EINVAL;
+        }
+        
+        const NotificationMappingEntry* entry = reinterpret_cast<const NotificationMappingEntry*>(mappings + offset);
+        uint32_t entrySize = NotificationMappingEntry_GetSize(entry->pathSizeBytes);
+        if (0 == entry->pathSizeBytes ||
+            entrySize > mappingsSize - offset ||
+            0 != (entry->notificationFlags & ~ProviderNotification_All))
+        {
+            return EINVAL;
+        }
+        
+        // Path must fit exactly, with the nul terminator in the end position
+        const char* mappingPath = reinterpret_cast<const char*>(entry + 1);
+        if (strnlen(mappingPath, entry->pathSizeBytes) != entry->pathSizeBytes - 1u)
+        {
+            return EINVAL;
+        }
+        
+        *outNotificationFlags |= entry->notificationFlags;
+        offset += entrySize;
+    }
+    
+    return 0;
+}
+
+static void SetNotificationFlags_Locked(VirtualizationRoot* root, uint32_t notificationFlags)
+{
+    uint32_t previousFlags = atomic_exchange(&root->notificationFlags, notificationFlags);
+    if (0 == previousFlags && 0 != notificationFlags)
+    {
+        atomic_fetch_add(&s_notifyingRootCount, 1);
+    }
+    else if (0 != previousFlags && 0 == notificationFlags)
+    {
+        atomic_fetch_sub(&s_notifyingRootCount, 1);
+    }
+}
+
+static bool PathIsSameOrBelow(const char* path, const char* ancestorPath, size_t ancestorPathLength)
+{
+    return
+        0 == strncmp(path, ancestorPath, ancestorPathLength)
+        && ('\0' == path[ancestorPathLength] || '/' == path[ancestorPathLength]);
+}
+
+static bool PathIsWithinMapping(const char* relativePath, const char* mappingPath, uint32_t mappingPathLength)
+{
+    // The empty path covers the whole root
+    return
+        0 == mappingPathLength
+        || (0 == strncmp(relativePath, mappingPath, mappingPathLength)
+            && ('\0' == relativePath[mappingPathLength] || '/' == relativePath[mappingPathLength]));
+}
+
+// Lock-free readers may be scanning the pids meanwhile, see VirtualizationRoot::helperPids
+static void SetHelperProcesses_Locked(VirtualizationRoot* root, const int32_t* pids, uint32_t pidCount, int32_t processGroupId)
+{
+    atomic_store_explicit(&root->helperPidCount, 0, memory_order_release);
+    for (uint32_t i = 0; i < pidCount; ++i)
+    {
+        atomic_store_explicit(&root->helperPids[i], pids[i], memory_order_relaxed);
+    }
+    
+    atomic_store_explicit(&root->helperPidCount, pidCount, memory_order_release);
+    atomic_store_explicit(&root->helperProcessGroupId, processGroupId, memory_order_relaxed);
+}
+
+// Installs newSet (which may be nullptr) as the root's set of modified files,
+// starting out empty, and returns the previous one for the caller to free.
+static VnodeFsidInode* ReplaceModifiedFileSet_Locked(VirtualizationRoot* root, VnodeFsidInode* newSet)
+{
+    VnodeFsidInode* previousSet;
+    Mutex_Acquire(s_modifiedFilesMutex);
+    {
+        previousSet = root->modifiedFiles;
+        root->modifiedFiles = newSet;
+        root->modifiedFilesCount = 0;
+        root->modifiedFilesOverflowed = false;
+    }
+    Mutex_Release(s_modifiedFilesMutex);
+    
+    return previousSet;
+}
+
+// Backward shift deletion: moves later entries of the probe sequence into the
+// gap, so that every remaining entry can still be found from its home slot.
+static void RemoveModifiedFileAtSlot_Locked(VnodeFsidInode* set, uint32_t slot)
+{
+    uint32_t mask = ModifiedFileSetCapacity - 1;
+    uint32_t gap = slot;
+    for (uint32_t next = (gap + 1) & mask; 0 != set[next].inode; next = (next + 1) & mask)
+    {
+        // The entry may fill the gap unless its home slot lies cyclically in (gap, next]
+        uint32_t home = HashFsidInode(set[next]) & mask;
+        if (((next - home) & mask) >= ((next - gap) & mask))
+        {
+            set[gap] = set[next];
+            gap = next;
+        }
+    }
+    
+    set[gap] = VnodeFsidInode {};
+}
+
+static uint64_t GetUptimeNanoseconds()
+{
+    uint64_t nanoseconds;
+    absolutetime_to_nanoseconds(mach_absolute_time(), &nanoseconds);
+    return nanoseconds;
+}
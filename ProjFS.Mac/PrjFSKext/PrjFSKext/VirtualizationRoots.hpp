@@ -1,7 +1,98 @@
 #pragma once
 
 #include "PrjFSClasses.hpp"
+#include "Message.h"
+#include "../public/PrjFSProviderClientShared.h"
 #include "kernel-header-wrappers/vnode.h"
+#include "VnodeUtilities.hpp"
+#include <stdatomic.h>
+
+// How kernel -> provider requests ended, for the wait statistics below
+enum RequestWaitOutcome
+{
+    RequestWaitOutcome_Response,
+    RequestWaitOutcome_TimedOut,
+    RequestWaitOutcome_ProviderDisconnected,
+    // A signal woke the waiting thread, which gave up on the request
+    RequestWaitOutcome_Interrupted,
+};
+
+// Bucket i counts waits of [2^i, 2^(i+1)) microseconds; bucket 0 also holds
+// anything shorter, the last bucket anything longer.
+static const uint32_t VirtualizationRootWaitHistogramBucketCount = 24;
+
+struct VirtualizationRootRequestStats
+{
+    atomic_ullong               responseCount;
+    atomic_ullong               timeoutCount;
+    atomic_ullong               providerDisconnectedCount;
+    atomic_ullong               interruptedCount;
+    // Over all requests, regardless of outcome
+    atomic_ullong               totalWaitNanoseconds;
+    atomic_ullong               maxWaitNanoseconds;
+    atomic_ullong               waitHistogram[VirtualizationRootWaitHistogramBucketCount];
+    
+    // Kauth callbacks for vnodes in this root, and how many of them were
+    // deferred straight away because they came from the provider itself
+    atomic_ullong               kauthCallbackCount;
+    atomic_ullong               providerPidDeferCount;
+    // Requests actually sent to the provider, and requests which instead
+    // waited for an identical one already in flight
+    atomic_ullong               enumerationsSentCount;
+    atomic_ullong               hydrationsSentCount;
+    atomic_ullong               coalescedWaitCount;
+    // Requests whose last waiter gave up before the response, so the provider
+    // was told to stop working on them
+    atomic_ullong               cancelsSentCount;
+    // Notifications sent to the provider, and those skipped because no
+    // notification mapping asked for them
+    atomic_ullong               notificationsSentCount;
+    atomic_ullong               notificationsFilteredCount;
+    // Modified files added to the root's set, and those already in it
+    atomic_ullong               modifiedFilesRecordedCount;
+    atomic_ullong               modifiedFilesDuplicateCount;
+    // Prefetch hints sent, and those dropped rather than waiting for queue space
+    atomic_ullong               prefetchHintsSentCount;
+    atomic_ullong               prefetchHintsDroppedCount;
+    // Requests held back, and operations denied, by the per-process rate limit
+    atomic_ullong               rateLimitDelayedCount;
+    atomic_ullong               rateLimitDeniedCount;
+    // Responses that arrived while the waiting thread was still spinning
+    atomic_ullong               spinWaitResponseCount;
+    // Times the provider was found unresponsive, and requests failed meanwhile
+    // without being sent
+    atomic_ullong               unresponsiveCount;
+    atomic_ullong               unresponsiveRejectedCount;
+};
+
+// Plain copy of VirtualizationRootRequestStats for reporting
+struct VirtualizationRootRequestStatsSnapshot
+{
+    uint64_t                    responseCount;
+    uint64_t                    timeoutCount;
+    uint64_t                    providerDisconnectedCount;
+    uint64_t                    interruptedCount;
+    uint64_t                    totalWaitNanoseconds;
+    uint64_t                    maxWaitNanoseconds;
+    uint64_t                    waitHistogram[VirtualizationRootWaitHistogramBucketCount];
+    uint64_t                    kauthCallbackCount;
+    uint64_t                    providerPidDeferCount;
+    uint64_t                    enumerationsSentCount;
+    uint64_t                    hydrationsSentCount;
+    uint64_t                    coalescedWaitCount;
+    uint64_t                    cancelsSentCount;
+    uint64_t                    notificationsSentCount;
+    uint64_t                    notificationsFilteredCount;
+    uint64_t                    modifiedFilesRecordedCount;
+    uint64_t                    modifiedFilesDuplicateCount;
+    uint64_t                    prefetchHintsSentCount;
+    uint64_t                    prefetchHintsDroppedCount;
+    uint64_t                    rateLimitDelayedCount;
+    uint64_t                    rateLimitDeniedCount;
+    uint64_t                    spinWaitResponseCount;
+    uint64_t                    unresponsiveCount;
+    uint64_t                    unresponsiveRejectedCount;
+};
 
 struct VirtualizationRoot
 {
@@ -17,28 +108,158 @@ struct VirtualizationRoot
     // identify it if the vnode of an offline root gets recycled.
     fsid_t                      rootFsid;
     uint64_t                    rootInode;
+    // From the root's xattr; 0 if it has none, in which case the root can't be reattached by token
+    uint64_t                    rootToken;
     
     // TODO: this should eventually be entirely diagnostic and not used for decisions
     char                        path[PrjFSMaxPath];
+    // strlen(path), so that paths can be made relative to the root without measuring it again
+    uint32_t                    pathLength;
 
     int32_t                     index;
+    
+    // Set by the active provider when it attaches, ProviderRootFlags
+    uint32_t                    providerRootFlags;
+    
+    // Set by the active provider, indexed by MessageType. Maximum time to wait
+    // for the provider to respond to a request; 0 means no deadline.
+    uint32_t                    requestTimeoutMilliseconds[MessageType_Count];
+    
+    // Set by the active provider: a directory gets at most one
+    // MessageType_KtoU_PrefetchHint per interval; 0 means none are sent.
+    uint32_t                    prefetchHintIntervalMilliseconds;
+    
+    // Set by the active provider, see ProviderSelector_SetRequestRateLimit; a rate
+    // of 0 means hydration and enumeration requests aren't limited.
+    uint32_t                    requestRateLimitPerSecond;
+    uint32_t                    requestRateLimitBurst;
+    uint32_t                    requestRateLimitMaxDelayMilliseconds;
+    
+    // Set by the active provider, in the ProviderSelector_SetNotificationMappings
+    // format; protected by the roots lock. notificationFlags is the union of the
+    // mappings' flags and may be read without the lock, so that roots (and
+    // operations) nobody asked to be notified about cost as little as possible.
+    uint8_t*                    notificationMappings;
+    uint32_t                    notificationMappingsSize;
+    atomic_uint                 notificationFlags;
+    
+    // Allocated while notificationFlags includes ProviderNotification_RecordModifiedFile:
+    // an open-addressed (linear probing) set of the files modified since the
+    // provider last drained it, in which a zero inode marks an empty slot. The
+    // pointer changes under both the roots lock and the modified files mutex,
+    // the contents only under the latter. Drains report modifiedFilesOverflowed
+    // if an insertion failed because the set was full.
+    VnodeFsidInode*             modifiedFiles;
+    uint32_t                    modifiedFilesCount;
+    bool                        modifiedFilesOverflowed;
+    
+    // Set by the active provider, see ProviderSelector_SetHelperProcesses. Only
+    // written with the roots lock held exclusively, but read without it: the count is
+    // cleared before the pids are replaced, so a concurrent lookup only ever sees
+    // pids that were helpers at some point during the update.
+    atomic_int                  helperPids[MaxProviderHelperProcesses];
+    atomic_uint                 helperPidCount;
+    atomic_int                  helperProcessGroupId;
+    
+    VirtualizationRootRequestStats requestStats;
+    
+    // Moving average of how long the current provider has taken to respond to
+    // requests, from which VirtualizationRoot_GetResponseSpinNanoseconds works out
+    // how long waiters should spin; 0 until the first response.
+    atomic_uint                 averageResponseNanoseconds;
+    
+    // Health of the current provider, see VirtualizationRoot_CheckProviderResponsive.
+    // While it is unresponsive, one request per probe interval is still sent.
+    atomic_ullong               lastResponseNanoseconds;
+    atomic_bool                 providerUnresponsive;
+    atomic_ullong               lastUnresponsiveProbeNanoseconds;
+    
+    // Rate limiting of the kauth handler's access denied messages
+    atomic_ullong               lastAccessDeniedLogNanoseconds;
+    atomic_uint                 accessDeniedLogsSuppressedCount;
 };
 
 kern_return_t VirtualizationRoots_Init(void);
 kern_return_t VirtualizationRoots_Cleanup(void);
 
 VirtualizationRoot* VirtualizationRoots_FindForVnode(vnode_t vnode);
+// Must be called once a directory has been renamed: the owning root of anything
+// below it may have changed, and its vid hasn't.
+void VirtualizationRoots_HandleDirectoryRenamed();
+// Whether any roots are registered (or have been found offline), without taking locks
+bool VirtualizationRoots_AnyExist();
+// Whether the absolute path is a root's, or a path inside or above one. Renames
+// of anything else can't change which root a vnode belongs to.
+bool VirtualizationRoots_PathIsInOrAboveAnyRoot(const char* path);
 
 struct VirtualizationRootResult
 {
     errno_t error;
     int32_t rootIndex;
 };
-VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProviderUserClient* userClient, pid_t clientPID, const char* virtualizationRootPath);
+VirtualizationRootResult VirtualizationRoot_RegisterProviderForPath(PrjFSProviderUserClient* userClient, pid_t clientPID, const char* virtualizationRootPath, uint32_t rootFlags);
+// Attaches the provider to a root the kext already knows, without looking up its path or
+// invalidating anything cached for its vnodes while it was offline
+VirtualizationRootResult VirtualizationRoot_ReattachProvider(PrjFSProviderUserClient* userClient, pid_t clientPID, VnodeFsidInode rootIds, uint64_t rootToken, uint32_t rootFlags);
 void ActiveProvider_Disconnect(int32_t rootIndex);
+errno_t ActiveProvider_SetRequestTimeout(int32_t rootIndex, MessageType messageType, uint32_t timeoutMilliseconds);
+errno_t ActiveProvider_SetNotificationMappings(int32_t rootIndex, const void* mappings, uint32_t mappingsSize);
+errno_t ActiveProvider_SetPrefetchHintInterval(int32_t rootIndex, uint32_t intervalMilliseconds);
+errno_t ActiveProvider_SetRequestRateLimit(int32_t rootIndex, uint32_t requestsPerSecond, uint32_t burst, uint32_t maxDelayMilliseconds);
+errno_t ActiveProvider_SetHelperProcesses(int32_t rootIndex, const int32_t* pids, uint32_t pidCount, int32_t processGroupId);
+// Whether the process is the root's active provider or one of its helpers, which
+// must not be blocked on the provider. Doesn't take the roots lock.
+bool VirtualizationRoot_IsProviderProcess(VirtualizationRoot* root, int pid, vfs_context_t context);
+void VirtualizationRoot_RecordRequestWait(VirtualizationRoot* root, RequestWaitOutcome outcome, uint64_t waitNanoseconds);
+// For requests that were sent to the provider and answered, not those that joined one in flight
+void VirtualizationRoot_RecordResponseLatency(VirtualizationRoot* root, uint64_t latencyNanoseconds);
+// How long a thread waiting for the provider's response should poll for it
+// before sleeping; 0 if the provider isn't usually quick enough for that to pay off.
+uint32_t VirtualizationRoot_GetResponseSpinNanoseconds(VirtualizationRoot* root);
+// Called for each batch of responses the provider passes to the kext, whether or
+// not any request is still waiting for them; makes an unresponsive provider
+// responsive again.
+void ActiveProvider_RecordResponses(int32_t rootIndex);
+// The watchdog: called periodically by threads waiting for a response. Marks the
+// provider unresponsive if the thread has been waiting, and the provider hasn't
+// responded to anything, for the last ProviderUnresponsiveNanoseconds.
+void VirtualizationRoot_CheckProviderResponsive(VirtualizationRoot* root, uint64_t waitStartNanoseconds);
+bool VirtualizationRoot_IsProviderUnresponsive(const VirtualizationRoot* root);
+// Whether a new request may be sent: always while the provider is responsive,
+// otherwise only as a periodic probe.
+bool VirtualizationRoot_MaySendRequest(VirtualizationRoot* root);
+void VirtualizationRoot_GetRequestStats(int32_t rootIndex, VirtualizationRootRequestStatsSnapshot* outStats);
+// Bytes of KernelMemory_VirtualizationRoots held by the root itself: its record,
+// notification mappings and set of modified files
+uint64_t VirtualizationRoot_GetWiredBytes(int32_t rootIndex);
 
 struct Message;
-errno_t ActiveProvider_SendMessage(int32_t rootIndex, const Message message);
+// Messages that are only worth sending if there is room in the queue straight
+// away (e.g. hints) pass waitIfQueueFull = false.
+errno_t ActiveProvider_SendMessage(int32_t rootIndex, const Message message, bool waitIfQueueFull = true);
+// Processes responses the provider has left in its response ring without ringing the doorbell
+void ActiveProvider_DrainResponseRing(int32_t rootIndex);
 bool VirtualizationRoot_VnodeIsOnAllowedFilesystem(vnode_t vnode);
 
-int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context);
+// Cheap checks, without taking any locks, for whether any root or this root may
+// want a notification of one of the given ProviderNotificationFlags.
+bool VirtualizationRoots_AnyWantNotifications();
+bool VirtualizationRoot_MayWantNotification(VirtualizationRoot* root, uint32_t notificationFlags);
+// Returns the ProviderNotificationFlags of the mapping covering the root-relative path
+uint32_t VirtualizationRoot_GetNotificationFlags(VirtualizationRoot* root, const char* relativePath);
+
+// Adds the file to the root's set of modified files, if the provider asked for one
+void VirtualizationRoot_RecordModifiedFile(VirtualizationRoot* root, VnodeFsidInode fileId);
+struct ModifiedFileEntry;
+errno_t ActiveProvider_DrainModifiedFiles(
+    int32_t rootIndex,
+    ModifiedFileEntry* outEntries,
+    uint32_t maxEntryCount,
+    uint32_t* outEntryCount,
+    uint32_t* outRemainingCount,
+    bool* outOverflowed);
+
+// Returns the index of the root the directory is, or -1 if it isn't one. A root
+// that couldn't be added to the table is also -1, with *outLookupFailed (if not
+// null) set: it isn't known not to be a root, so that mustn't be cached.
+int16_t VirtualizationRoots_LookupVnode(vnode_t vnode, vfs_context_t context, bool* outLookupFailed);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "KextTesting.hpp"
+
+#ifdef KEXT_UNIT_TESTING
+
+#include "VnodeUtilities.hpp"
+
+// Caller must hold the virtualization root lock (or be single-threaded)
+int16_t FindRootForVnode_Locked(vnode_t vnode, uint32_t vid, VnodeFsidInode fileId);
+uint32_t HashFsidInode(VnodeFsidInode fileId);
+
+#endif
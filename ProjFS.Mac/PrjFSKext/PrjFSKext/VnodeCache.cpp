@@ -0,0 +1,261 @@
+#include <kern/debug.h>
+#include <kern/assert.h>
+#include <libkern/libkern.h>
+
+#include "VnodeCache.hpp"
+#include "Locks.hpp"
+
+struct VnodeCacheEntry
+{
+    vnode_t     vnode;
+    uint32_t    vid;
+    
+    bool        hasFileFlags;
+    uint32_t    fileFlags;
+    
+    // rootIndex is -1 if the owning root is not cached, VnodeCache_NotInAnyRoot
+    // if it is known there is none
+    int16_t     rootIndex;
+    uint32_t    rootGeneration;
+    
+    bool        isKnownNonRoot;
+    uint32_t    nonRootGeneration;
+};
+
+// Must be powers of 2. The table is direct-mapped: a colliding insert simply
+// evicts the previous occupant of the slot.
+static const uint32_t VnodeCacheCapacity = 4096;
+static const uint32_t VnodeCacheLockStripes = 64;
+
+static VnodeCacheEntry s_entries[VnodeCacheCapacity] = {};
+static Mutex s_entryLocks[VnodeCacheLockStripes] = {};
+// Per slot rather than per entry, so that they survive eviction: incremented
+// whenever the flags of a vnode hashing to the slot are invalidated.
+static uint32_t s_fileFlagsChangeCounts[VnodeCacheCapacity] = {};
+
+static uint32_t GetEntryIndex(vnode_t vnode);
+static Mutex GetEntryLock(uint32_t entryIndex);
+static VnodeCacheEntry& ClaimEntry_Locked(uint32_t entryIndex, vnode_t vnode, uint32_t vid);
+
+kern_return_t VnodeCache_Init()
+{
+    for (uint32_t i = 0; i < VnodeCacheLockStripes; ++i)
+    {
+        if (Mutex_IsValid(s_entryLocks[i]))
+        {
+            goto CleanupAndFail;
+        }
+
+        s_entryLocks[i] = Mutex_Alloc();
+        if (!Mutex_IsValid(s_entryLocks[i]))
+        {
+            goto CleanupAndFail;
+        }
+    }
+
+    VnodeCache_InvalidateAll();
+    return KERN_SUCCESS;
+
+CleanupAndFail:
+    VnodeCache_Cleanup();
+    return KERN_FAILURE;
+}
+
+kern_return_t VnodeCache_Cleanup()
+{
+    kern_return_t result = KERN_SUCCESS;
+
+    for (uint32_t i = 0; i < VnodeCacheLockStripes; ++i)
+    {
+        if (Mutex_IsValid(s_entryLocks[i]))
+        {
+            Mutex_FreeMemory(&s_entryLocks[i]);
+        }
+        else
+        {
+            result = KERN_FAILURE;
+        }
+    }
+
+    return result;
+}
+
+bool VnodeCache_TryGetFileFlags(vnode_t vnode, uint32_t vid, uint32_t* outFileFlags, uint32_t* outChangeCount)
+{
+    bool found = false;
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        VnodeCacheEntry& entry = s_entries[index];
+        if (entry.vnode == vnode && entry.vid == vid && entry.hasFileFlags)
+        {
+            *outFileFlags = entry.fileFlags;
+            found = true;
+        }
+        
+        *outChangeCount = s_fileFlagsChangeCounts[index];
+    }
+    Mutex_Release(lock);
+
+    return found;
+}
+
+void VnodeCache_SetFileFlags(vnode_t vnode, uint32_t vid, uint32_t fileFlags, uint32_t changeCount)
+{
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        // Otherwise the flags may have been read before a change that has been
+        // reported since
+        if (s_fileFlagsChangeCounts[index] == changeCount)
+        {
+            VnodeCacheEntry& entry = ClaimEntry_Locked(index, vnode, vid);
+            entry.fileFlags = fileFlags;
+            entry.hasFileFlags = true;
+        }
+    }
+    Mutex_Release(lock);
+}
+
+bool VnodeCache_TryGetRootIndex(vnode_t vnode, uint32_t vid, uint32_t rootGeneration, int16_t* outRootIndex)
+{
+    bool found = false;
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        VnodeCacheEntry& entry = s_entries[index];
+        if (entry.vnode == vnode && entry.vid == vid && entry.rootIndex != -1 && entry.rootGeneration == rootGeneration)
+        {
+            *outRootIndex = entry.rootIndex;
+            found = true;
+        }
+    }
+    Mutex_Release(lock);
+
+    return found;
+}
+
+void VnodeCache_SetRootIndex(vnode_t vnode, uint32_t vid, uint32_t rootGeneration, int16_t rootIndex)
+{
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        VnodeCacheEntry& entry = ClaimEntry_Locked(index, vnode, vid);
+        entry.rootIndex = rootIndex;
+        entry.rootGeneration = rootGeneration;
+    }
+    Mutex_Release(lock);
+}
+
+bool VnodeCache_IsKnownNonRoot(vnode_t vnode, uint32_t vid, uint32_t rootGeneration)
+{
+    bool isKnownNonRoot = false;
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        VnodeCacheEntry& entry = s_entries[index];
+        isKnownNonRoot =
+            entry.vnode == vnode && entry.vid == vid &&
+            entry.isKnownNonRoot && entry.nonRootGeneration == rootGeneration;
+    }
+    Mutex_Release(lock);
+
+    return isKnownNonRoot;
+}
+
+void VnodeCache_SetKnownNonRoot(vnode_t vnode, uint32_t vid, uint32_t rootGeneration)
+{
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        VnodeCacheEntry& entry = ClaimEntry_Locked(index, vnode, vid);
+        entry.isKnownNonRoot = true;
+        entry.nonRootGeneration = rootGeneration;
+    }
+    Mutex_Release(lock);
+}
+
+void VnodeCache_InvalidateKnownNonRoot(vnode_t vnode)
+{
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        if (s_entries[index].vnode == vnode)
+        {
+            s_entries[index].isKnownNonRoot = false;
+        }
+    }
+    Mutex_Release(lock);
+}
+
+void VnodeCache_InvalidateFileFlags(vnode_t vnode)
+{
+    uint32_t index = GetEntryIndex(vnode);
+    Mutex lock = GetEntryLock(index);
+
+    Mutex_Acquire(lock);
+    {
+        if (s_entries[index].vnode == vnode)
+        {
+            s_entries[index].hasFileFlags = false;
+        }
+        
+        ++s_fileFlagsChangeCounts[index];
+    }
+    Mutex_Release(lock);
+}
+
+void VnodeCache_InvalidateAll()
+{
+    for (uint32_t stripe = 0; stripe < VnodeCacheLockStripes; ++stripe)
+    {
+        Mutex_Acquire(s_entryLocks[stripe]);
+        {
+            for (uint32_t index = stripe; index < VnodeCacheCapacity; index += VnodeCacheLockStripes)
+            {
+                s_entries[index] = VnodeCacheEntry { nullptr, 0, false, 0, -1, 0, false, 0 };
+            }
+        }
+        Mutex_Release(s_entryLocks[stripe]);
+    }
+}
+
+static uint32_t GetEntryIndex(vnode_t vnode)
+{
+    // Fibonacci hashing of the pointer value; the low bits of vnode pointers
+    // are mostly zero due to allocation alignment, so they must be mixed in.
+    uint64_t hash = reinterpret_cast<uintptr_t>(vnode) * 0x9E3779B97F4A7C15ull;
+    return static_cast<uint32_t>(hash >> 32) & (VnodeCacheCapacity - 1);
+}
+
+static Mutex GetEntryLock(uint32_t entryIndex)
+{
+    return s_entryLocks[entryIndex & (VnodeCacheLockStripes - 1)];
+}
+
+// Returns the entry at entryIndex, evicting its previous occupant if it was for
+// a different vnode.
+static VnodeCacheEntry& ClaimEntry_Locked(uint32_t entryIndex, vnode_t vnode, uint32_t vid)
+{
+    VnodeCacheEntry& entry = s_entries[entryIndex];
+    if (entry.vnode != vnode || entry.vid != vid)
+    {
+        entry = VnodeCacheEntry { vnode, vid, false, 0, -1, 0, false, 0 };
+    }
+    
+    return entry;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <mach/kern_return.h>
+#include <sys/kernel_types.h>
+#include <stdint.h>
+
+// Small, fixed-size cache of per-vnode state that is expensive to recompute on
+// every kauth callback. Entries are identified by the (vnode, vid) pair, so a
+// recycled vnode can never alias a stale entry.
+
+kern_return_t VnodeCache_Init();
+kern_return_t VnodeCache_Cleanup();
+
+// Returns true and fills *outFileFlags if valid flags are cached for the vnode.
+// Otherwise the flags read from the file system are passed to SetFileFlags along
+// with *outChangeCount, which doesn't store them if they have been invalidated
+// meanwhile.
+bool VnodeCache_TryGetFileFlags(vnode_t vnode, uint32_t vid, uint32_t* outFileFlags, uint32_t* outChangeCount);
+void VnodeCache_SetFileFlags(vnode_t vnode, uint32_t vid, uint32_t fileFlags, uint32_t changeCount);
+
+// Owning virtualization root of the vnode, or VnodeCache_NotInAnyRoot. Entries
+// record the root registry generation they were computed in and are ignored
+// once it has moved on.
+static const int16_t VnodeCache_NotInAnyRoot = -2;
+bool VnodeCache_TryGetRootIndex(vnode_t vnode, uint32_t vid, uint32_t rootGeneration, int16_t* outRootIndex);
+void VnodeCache_SetRootIndex(vnode_t vnode, uint32_t vid, uint32_t rootGeneration, int16_t rootIndex);
+
+// Directories known not to be virtualization roots themselves, so lookups can
+// skip reading the root xattr. Also tied to the root registry generation.
+bool VnodeCache_IsKnownNonRoot(vnode_t vnode, uint32_t vid, uint32_t rootGeneration);
+void VnodeCache_SetKnownNonRoot(vnode_t vnode, uint32_t vid, uint32_t rootGeneration);
+void VnodeCache_InvalidateKnownNonRoot(vnode_t vnode);
+
+void VnodeCache_InvalidateFileFlags(vnode_t vnode);
+void VnodeCache_InvalidateAll();
@@ -14,16 +14,36 @@
 extern "C" int mac_vnop_getxattr(struct vnode *, const char *, char *, size_t, size_t *);
 
 VnodeFsidInode Vnode_GetFsidAndInode(vnode_t vnode, vfs_context_t context)
+{
+    return Vnode_GetFsidInodeAndSize(vnode, context, nullptr);
+}
+
+VnodeFsidInode Vnode_GetFsidInodeAndSize(vnode_t vnode, vfs_context_t context, SizeOrError* outSize)
 {
     vnode_attr attrs;
     VATTR_INIT(&attrs);
     // TODO: check this is correct for hardlinked files
     VATTR_WANTED(&attrs, va_fileid);
+    if (nullptr != outSize)
+    {
+        VATTR_WANTED(&attrs, va_data_size);
+    }
 
-    vnode_getattr(vnode, &attrs, context);
+    uint64_t inode = 0;
+    errno_t error = vnode_getattr(vnode, &attrs, context);
+    if (0 == error && VATTR_IS_SUPPORTED(&attrs, va_fileid))
+    {
+        inode = attrs.va_fileid;
+    }
+    
+    if (nullptr != outSize)
+    {
+        bool hasSize = 0 == error && VATTR_IS_SUPPORTED(&attrs, va_data_size);
+        *outSize = SizeOrError { hasSize ? static_cast<size_t>(attrs.va_data_size) : 0, hasSize ? 0 : (0 != error ? error : ENOTSUP) };
+    }
     
     vfsstatfs* statfs = vfs_statfs(vnode_mount(vnode));
-    return { statfs->f_fsid, attrs.va_fileid };
+    return { statfs->f_fsid, inode };
 }
 
 SizeOrError Vnode_ReadXattr(vnode_t vnode, const char* xattrName, void* buffer, size_t bufferSize, vfs_context_t context)
@@ -17,3 +17,5 @@ struct VnodeFsidInode
     uint64_t inode;
 };
 VnodeFsidInode Vnode_GetFsidAndInode(vnode_t vnode, vfs_context_t context);
+// Also reads the size of the file's data, with the same vnode_getattr
+VnodeFsidInode Vnode_GetFsidInodeAndSize(vnode_t vnode, vfs_context_t context, SizeOrError* outSize);
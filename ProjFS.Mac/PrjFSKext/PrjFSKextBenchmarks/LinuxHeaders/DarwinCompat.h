@@ -0,0 +1,59 @@
+#pragma once
+
+// The headers in LinuxHeaders stand in for the Darwin user space headers which
+// MockKernelHeaders and the benchmarks rely on, so that PrjFSKextBenchmarks can
+// also be built and run on Linux with Scripts/BuildKextBenchmarksOnLinux.sh.
+// This one is included ahead of every source file: definitions which the Darwin
+// system headers provide beyond their glibc counterparts.
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/cdefs.h>
+
+// Keeps glibc's own fsid_t out of the way of the Darwin one
+#define fsid_t glibc_fsid_t
+#include <sys/types.h>
+#undef fsid_t
+#include <sys/_types/_fsid_t.h>
+
+#ifndef __printflike
+#define __printflike(formatArg, firstVarArg) __attribute__((__format__(__printf__, formatArg, firstVarArg)))
+#endif
+
+// <sys/param.h>
+#define MAXCOMLEN 16
+#define PUSER 50
+
+// <sys/signal.h>; glibc's is deprecated
+#undef sigmask
+#define sigmask(signal) (1U << ((signal) - 1))
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+static inline size_t strlcpy(char* destination, const char* source, size_t size)
+{
+    size_t sourceLength = strlen(source);
+    if (size > 0)
+    {
+        size_t copyLength = sourceLength < size - 1 ? sourceLength : size - 1;
+        memcpy(destination, source, copyLength);
+        destination[copyLength] = '\0';
+    }
+    
+    return sourceLength;
+}
+#endif
+
+// pthread_t is unique among live threads, which is all thread_tid() promises
+static inline int pthread_threadid_np(pthread_t thread, uint64_t* threadId)
+{
+    *threadId = static_cast<uint64_t>(thread);
+    return 0;
+}
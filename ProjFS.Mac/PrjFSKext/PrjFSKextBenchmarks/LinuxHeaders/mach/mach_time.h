@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Absolute time is counted in nanoseconds, as on Apple silicon's numer == denom
+struct mach_timebase_info
+{
+    uint32_t numer;
+    uint32_t denom;
+};
+typedef struct mach_timebase_info* mach_timebase_info_t;
+typedef struct mach_timebase_info mach_timebase_info_data_t;
+
+static inline uint64_t mach_absolute_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+}
+
+static inline int mach_timebase_info(mach_timebase_info_t info)
+{
+    info->numer = 1;
+    info->denom = 1;
+    return 0;
+}
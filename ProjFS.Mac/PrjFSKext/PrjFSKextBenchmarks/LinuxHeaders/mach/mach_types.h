@@ -0,0 +1,6 @@
+#pragma once
+
+#include <mach/kern_return.h>
+
+typedef unsigned int mach_port_t;
+typedef mach_port_t task_t;
@@ -0,0 +1,3 @@
+#pragma once
+
+typedef int errno_t;
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// glibc's fsid_t names its member __val, see DarwinCompat.h
+typedef struct fsid { int32_t val[2]; } fsid_t;
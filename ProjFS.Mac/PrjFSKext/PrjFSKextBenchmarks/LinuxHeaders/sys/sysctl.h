@@ -0,0 +1,18 @@
+#pragma once
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Only what the kext sources ask for
+static inline int sysctlbyname(const char* name, void* oldValue, size_t* oldValueSize, void* newValue, size_t newValueSize)
+{
+    if (0 == strcmp(name, "hw.activecpu") && nullptr != oldValue && sizeof(int) == *oldValueSize && nullptr == newValue)
+    {
+        *static_cast<int*>(oldValue) = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
+    
+    errno = ENOENT;
+    return -1;
+}
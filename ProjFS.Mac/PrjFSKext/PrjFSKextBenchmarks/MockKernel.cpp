@@ -0,0 +1,462 @@
+#include <kern/debug.h>
+#include <kern/assert.h>
+#include <kern/clock.h>
+#include <kern/thread.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <sys/kauth.h>
+#include <sys/proc.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "PrjFSCommon.h"
+#include "PrjFSXattrs.h"
+#include "kernel-header-wrappers/vnode.h"
+#include "kernel-header-wrappers/mount.h"
+#include "MockKernel.hpp"
+
+struct mount
+{
+    vfsstatfs   statfs;
+    int         typeNumber;
+};
+
+struct vnode
+{
+    mount_t     mount;
+    vnode_t     parent;
+    vtype       type;
+    uint32_t    vid;
+    uint64_t    inode;
+    uint64_t    dataSize;
+    uint32_t    fileFlags;
+    bool        isFileSystemRoot;
+    bool        isVirtualizationRoot;
+    std::string path;
+};
+
+struct proc
+{
+    int         pid;
+    int         processGroupId;
+};
+
+struct vfs_context
+{
+    proc        process;
+};
+
+struct kauth_listener
+{
+    kauth_scope_callback_t callback;
+    void*       idata;
+};
+
+extern "C" int mac_vnop_getxattr(struct vnode* vnode, const char* name, char* buffer, size_t bufferSize, size_t* outSize);
+
+static std::vector<std::unique_ptr<mount>> s_mounts;
+static std::vector<std::unique_ptr<vnode>> s_vnodes;
+static std::vector<std::unique_ptr<vfs_context>> s_contexts;
+static std::map<std::string, vnode_t> s_vnodesByPath;
+static std::map<int, std::string> s_processNames;
+static uint64_t s_nextInode = 2;
+
+static pthread_mutex_t s_wakeupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wakeupCondition = PTHREAD_COND_INITIALIZER;
+static uint64_t s_wakeupGeneration = 0;
+
+// Benchmark-side control
+mount_t MockMount_Create(const char* fileSystemTypeName, int typeNumber, fsid_t fsid)
+{
+    std::unique_ptr<mount> newMount(new mount());
+    newMount->typeNumber = typeNumber;
+    newMount->statfs.f_fsid = fsid;
+    strlcpy(newMount->statfs.f_fstypename, fileSystemTypeName, sizeof(newMount->statfs.f_fstypename));
+    strlcpy(newMount->statfs.f_mntonname, "/", sizeof(newMount->statfs.f_mntonname));
+
+    s_mounts.push_back(std::move(newMount));
+    return s_mounts.back().get();
+}
+
+static vnode_t CreateVnode(mount_t mount, vnode_t parent, const std::string& path, vtype type, uint32_t fileFlags)
+{
+    std::unique_ptr<vnode> newVnode(new vnode());
+    newVnode->mount = mount;
+    newVnode->parent = parent;
+    newVnode->type = type;
+    newVnode->vid = 1;
+    newVnode->inode = s_nextInode++;
+    newVnode->dataSize = 0;
+    newVnode->fileFlags = fileFlags;
+    newVnode->isFileSystemRoot = (nullptr == parent);
+    newVnode->isVirtualizationRoot = false;
+    newVnode->path = path;
+
+    vnode_t result = newVnode.get();
+    s_vnodes.push_back(std::move(newVnode));
+    s_vnodesByPath[path] = result;
+    return result;
+}
+
+vnode_t MockVnode_CreateFileSystemRoot(mount_t mount)
+{
+    return CreateVnode(mount, NULLVP, "/", VDIR, 0);
+}
+
+vnode_t MockVnode_Create(vnode_t parent, const char* name, vtype type, uint32_t fileFlags)
+{
+    std::string path = parent->isFileSystemRoot ? "/" : parent->path + "/";
+    path += name;
+    return CreateVnode(parent->mount, parent, path, type, fileFlags);
+}
+
+void MockVnode_SetFileFlags(vnode_t vnode, uint32_t fileFlags)
+{
+    vnode->fileFlags = fileFlags;
+}
+
+void MockVnode_SetDataSize(vnode_t vnode, uint64_t dataSize)
+{
+    vnode->dataSize = dataSize;
+}
+
+void MockVnode_SetIsVirtualizationRoot(vnode_t vnode)
+{
+    vnode->isVirtualizationRoot = true;
+}
+
+void MockVnode_Recycle(vnode_t vnode)
+{
+    vnode->vid++;
+}
+
+vfs_context_t MockContext_Create(int pid, const char* procname)
+{
+    std::unique_ptr<vfs_context> context(new vfs_context());
+    context->process.pid = pid;
+    context->process.processGroupId = pid;
+    s_processNames[pid] = procname;
+
+    s_contexts.push_back(std::move(context));
+    return s_contexts.back().get();
+}
+
+void MockKernel_Reset()
+{
+    s_vnodesByPath.clear();
+    s_vnodes.clear();
+    s_mounts.clear();
+    s_contexts.clear();
+    s_processNames.clear();
+    s_nextInode = 2;
+}
+
+int MockKernel_WaitForWakeup(pthread_mutex_t* heldMutex, const struct timespec* timeout)
+{
+    struct timespec deadline = {};
+    if (nullptr != timeout)
+    {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        uint64_t deadlineNanoseconds =
+            now.tv_sec * 1000000000ull + now.tv_usec * 1000ull +
+            timeout->tv_sec * 1000000000ull + timeout->tv_nsec;
+        deadline.tv_sec = deadlineNanoseconds / 1000000000ull;
+        deadline.tv_nsec = deadlineNanoseconds % 1000000000ull;
+    }
+
+    // wakeup() takes s_wakeupMutex, so it can't slip in between dropping
+    // heldMutex and starting to wait.
+    pthread_mutex_lock(&s_wakeupMutex);
+    if (nullptr != heldMutex)
+    {
+        pthread_mutex_unlock(heldMutex);
+    }
+
+    uint64_t generation = s_wakeupGeneration;
+    int waitResult = 0;
+    while (generation == s_wakeupGeneration && 0 == waitResult)
+    {
+        waitResult =
+            nullptr == timeout ?
+            pthread_cond_wait(&s_wakeupCondition, &s_wakeupMutex) :
+            pthread_cond_timedwait(&s_wakeupCondition, &s_wakeupMutex, &deadline);
+    }
+
+    bool wokenUp = (generation != s_wakeupGeneration);
+    pthread_mutex_unlock(&s_wakeupMutex);
+
+    if (nullptr != heldMutex)
+    {
+        pthread_mutex_lock(heldMutex);
+    }
+
+    return wokenUp ? 0 : EWOULDBLOCK;
+}
+
+// Kernel KPIs
+void panic(const char* format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+    fputc('\n', stderr);
+    abort();
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+    static mach_timebase_info_data_t timebase = {};
+    if (0 == timebase.denom)
+    {
+        mach_timebase_info(&timebase);
+    }
+
+    *result = abstime * timebase.numer / timebase.denom;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+    static mach_timebase_info_data_t timebase = {};
+    if (0 == timebase.denom)
+    {
+        mach_timebase_info(&timebase);
+    }
+
+    *result = nanoseconds * timebase.denom / timebase.numer;
+}
+
+SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+    return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+    return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt64 OSIncrementAtomic64(volatile SInt64* address)
+{
+    return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+void OSMemoryBarrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+kauth_listener_t kauth_listen_scope(const char* identifier, kauth_scope_callback_t callback, void* idata)
+{
+    return new kauth_listener { callback, idata };
+}
+
+void kauth_unlisten_scope(kauth_listener_t listener)
+{
+    delete listener;
+}
+
+int proc_pid(proc_t process)
+{
+    return process->pid;
+}
+
+int proc_pgrpid(proc_t process)
+{
+    return process->processGroupId;
+}
+
+void proc_name(int pid, char* buffer, int size)
+{
+    std::map<int, std::string>::const_iterator found = s_processNames.find(pid);
+    strlcpy(buffer, found == s_processNames.end() ? "" : found->second.c_str(), size);
+}
+
+// Mock processes never receive signals
+int proc_issignal(int pid, uint32_t mask)
+{
+    return 0;
+}
+
+thread_t current_thread(void)
+{
+    return reinterpret_cast<thread_t>(pthread_self());
+}
+
+uint64_t thread_tid(thread_t thread)
+{
+    uint64_t threadId = 0;
+    pthread_threadid_np(reinterpret_cast<pthread_t>(thread), &threadId);
+    return threadId;
+}
+
+int msleep(void* channel, void* mutex, int priority, const char* waitMessage, struct timespec* timeout)
+{
+    assert(nullptr == mutex);
+    return MockKernel_WaitForWakeup(nullptr, timeout);
+}
+
+void wakeup(void* channel)
+{
+    // Wakes every sleeper rather than just those on the channel; they all
+    // re-check their condition, so that only costs some spurious wakeups.
+    pthread_mutex_lock(&s_wakeupMutex);
+    {
+        s_wakeupGeneration++;
+        pthread_cond_broadcast(&s_wakeupCondition);
+    }
+    pthread_mutex_unlock(&s_wakeupMutex);
+}
+
+vtype vnode_vtype(vnode_t vnode)
+{
+    return vnode->type;
+}
+
+uint32_t vnode_vid(vnode_t vnode)
+{
+    return vnode->vid;
+}
+
+// Mock vnodes are never reclaimed, so no iocounts are tracked
+int vnode_get(vnode_t vnode)
+{
+    return 0;
+}
+
+int vnode_getwithvid(vnode_t vnode, uint32_t vid)
+{
+    return vnode->vid == vid ? 0 : ENOENT;
+}
+
+int vnode_put(vnode_t vnode)
+{
+    return 0;
+}
+
+int vnode_isvroot(vnode_t vnode)
+{
+    return vnode->isFileSystemRoot;
+}
+
+int vnode_isdir(vnode_t vnode)
+{
+    return VDIR == vnode->type;
+}
+
+vnode_t vnode_getparent(vnode_t vnode)
+{
+    return vnode->parent;
+}
+
+mount_t vnode_mount(vnode_t vnode)
+{
+    return vnode->mount;
+}
+
+int vnode_lookup(const char* path, int flags, vnode_t* outVnode, vfs_context_t context)
+{
+    std::map<std::string, vnode_t>::const_iterator found = s_vnodesByPath.find(path);
+    if (found == s_vnodesByPath.end())
+    {
+        return ENOENT;
+    }
+
+    *outVnode = found->second;
+    return 0;
+}
+
+int vnode_getattr(vnode_t vnode, struct vnode_attr* attributes, vfs_context_t context)
+{
+    if (VATTR_IS_ACTIVE(attributes, va_flags))
+    {
+        attributes->va_flags = vnode->fileFlags;
+        VATTR_SET_SUPPORTED(attributes, va_flags);
+    }
+
+    if (VATTR_IS_ACTIVE(attributes, va_fileid))
+    {
+        attributes->va_fileid = vnode->inode;
+        VATTR_SET_SUPPORTED(attributes, va_fileid);
+    }
+
+    if (VATTR_IS_ACTIVE(attributes, va_data_size))
+    {
+        attributes->va_data_size = vnode->dataSize;
+        VATTR_SET_SUPPORTED(attributes, va_data_size);
+    }
+
+    return 0;
+}
+
+int vn_getpath(struct vnode* vnode, char* pathBuffer, int* length)
+{
+    if (vnode->path.size() + 1 > static_cast<size_t>(*length))
+    {
+        return ENOSPC;
+    }
+
+    memcpy(pathBuffer, vnode->path.c_str(), vnode->path.size() + 1);
+    *length = static_cast<int>(vnode->path.size() + 1);
+    return 0;
+}
+
+// Nothing is cached, as if every authorization were checked in full
+void vnode_uncache_authorized_action(vnode_t vnode, kauth_action_t action)
+{
+}
+
+int mac_vnop_getxattr(struct vnode* vnode, const char* name, char* buffer, size_t bufferSize, size_t* outSize)
+{
+    if (!vnode->isVirtualizationRoot || 0 != strcmp(name, PrjFSVirtualizationRootXAttrName))
+    {
+        return ENOATTR;
+    }
+
+    // Any non-zero token that differs between roots will do
+    PrjFSVirtualizationRootXAttrData rootXattr = { { PlaceholderMagicNumber, PlaceholderFormatVersion }, vnode->inode };
+    if (bufferSize < sizeof(rootXattr))
+    {
+        return ERANGE;
+    }
+
+    memcpy(buffer, &rootXattr, sizeof(rootXattr));
+    *outSize = sizeof(rootXattr);
+    return 0;
+}
+
+vfs_context_t vfs_context_create(vfs_context_t context)
+{
+    vfs_context_t newContext = new vfs_context();
+    newContext->process.pid = nullptr == context ? 0 : context->process.pid;
+    newContext->process.processGroupId = nullptr == context ? 0 : context->process.processGroupId;
+    return newContext;
+}
+
+int vfs_context_rele(vfs_context_t context)
+{
+    delete context;
+    return 0;
+}
+
+proc_t vfs_context_proc(vfs_context_t context)
+{
+    return &context->process;
+}
+
+struct vfsstatfs* vfs_statfs(mount_t mount)
+{
+    return &mount->statfs;
+}
+
+int vfs_typenum(mount_t mount)
+{
+    return mount->typeNumber;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+#include <sys/_types/_fsid_t.h>
+#include <pthread.h>
+#include "kernel-header-wrappers/vnode.h"
+
+// Benchmark-side control of the in-memory file system behind the mocked vnode,
+// mount and process KPIs. Everything created here lives until MockKernel_Reset().
+
+mount_t MockMount_Create(const char* fileSystemTypeName, int typeNumber, fsid_t fsid);
+
+// The vnode for "/", for which vnode_isvroot() is true
+vnode_t MockVnode_CreateFileSystemRoot(mount_t mount);
+vnode_t MockVnode_Create(vnode_t parent, const char* name, vtype type, uint32_t fileFlags);
+void MockVnode_SetFileFlags(vnode_t vnode, uint32_t fileFlags);
+// Files are created 0 bytes long; placeholders keep their full size
+void MockVnode_SetDataSize(vnode_t vnode, uint64_t dataSize);
+// Sets the virtualization root xattr, as PrjFS_ConvertDirectoryToVirtualizationRoot does
+void MockVnode_SetIsVirtualizationRoot(vnode_t vnode);
+// Simulates the vnode being reclaimed and reused for the same file: any state
+// the kext cached under the old vid no longer matches.
+void MockVnode_Recycle(vnode_t vnode);
+
+vfs_context_t MockContext_Create(int pid, const char* procname);
+
+void MockKernel_Reset();
+
+// Backs msleep() and the mocked Mutex_Sleep(). Drops heldMutex (if any) while
+// waiting for any wakeup() or for the timeout to elapse, and reacquires it
+// before returning. Returns 0 on wakeup, EWOULDBLOCK on timeout.
+int MockKernel_WaitForWakeup(pthread_mutex_t* heldMutex, const struct timespec* timeout);
@@ -0,0 +1,73 @@
+#pragma once
+
+// Just enough of the IOKit class hierarchy to compile PrjFSProviderUserClient.hpp.
+// Reference counting works like OSObject's, but nothing is ever freed through it.
+
+#include <mach/mach_types.h>
+#include <libkern/OSTypes.h>
+#include <atomic>
+
+typedef kern_return_t IOReturn;
+typedef UInt32 IOOptionBits;
+typedef uint64_t io_user_reference_t;
+
+#define kIOReturnSuccess KERN_SUCCESS
+
+class OSDictionary;
+class OSSerialize;
+class IOMemoryDescriptor;
+struct IOExternalMethodArguments;
+struct IOExternalMethodDispatch;
+
+#define OSDeclareDefaultStructors(className) \
+    public: \
+        className(); \
+        virtual ~className()
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() {} \
+    className::~className() {}
+
+class OSObject
+{
+public:
+    OSObject() : retainCount(1) {}
+    virtual ~OSObject() {}
+    
+    void retain() const { this->retainCount.fetch_add(1, std::memory_order_relaxed); }
+    void release() const { this->retainCount.fetch_sub(1, std::memory_order_acq_rel); }
+    int getRetainCount() const { return this->retainCount.load(); }
+    
+    virtual void free() {}
+
+private:
+    mutable std::atomic<int> retainCount;
+};
+
+class IORegistryEntry : public OSObject
+{
+public:
+    virtual bool serializeProperties(OSSerialize* serialize) const { return false; }
+};
+
+class IOService : public IORegistryEntry
+{
+};
+
+class IOUserClient : public IOService
+{
+public:
+    virtual bool initWithTask(task_t owningTask, void* securityToken, UInt32 type, OSDictionary* properties) { return true; }
+    virtual IOReturn externalMethod(
+        uint32_t selector,
+        IOExternalMethodArguments* arguments,
+        IOExternalMethodDispatch* dispatch = 0,
+        OSObject* target = 0,
+        void* reference = 0)
+    {
+        return kIOReturnSuccess;
+    }
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory) { return kIOReturnSuccess; }
+    virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon) { return kIOReturnSuccess; }
+    virtual IOReturn clientClose() { return kIOReturnSuccess; }
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+// The kext is built with MACH_ASSERT=1 in all configurations, so keep the
+// assertions enabled here too.
+#include <assert.h>
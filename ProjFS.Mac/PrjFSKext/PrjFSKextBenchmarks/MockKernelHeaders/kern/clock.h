@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C" void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+extern "C" void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
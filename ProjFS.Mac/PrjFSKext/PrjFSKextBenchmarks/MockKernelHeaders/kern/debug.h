@@ -0,0 +1,13 @@
+#pragma once
+
+// The headers in MockKernelHeaders shadow the Kernel.framework headers which
+// the kext sources include, declaring just enough of each KPI for the user space
+// PrjFSKextBenchmarks build. The KPIs themselves are implemented in MockKernel.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <mach/kern_return.h>
+
+extern "C" void panic(const char* format, ...) __printflike(1, 2) __attribute__((noreturn));
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+
+extern "C"
+{
+    thread_t current_thread(void);
+    uint64_t thread_tid(thread_t thread);
+}
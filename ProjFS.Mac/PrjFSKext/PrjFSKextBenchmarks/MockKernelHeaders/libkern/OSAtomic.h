@@ -0,0 +1,11 @@
+#pragma once
+
+#include <libkern/OSTypes.h>
+
+extern "C"
+{
+    SInt32 OSIncrementAtomic(volatile SInt32* address);
+    SInt32 OSDecrementAtomic(volatile SInt32* address);
+    SInt64 OSIncrementAtomic64(volatile SInt64* address);
+    void OSMemoryBarrier(void);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <string.h>
+#include <stdio.h>
+#include <sys/param.h>
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdio.h>
+
+typedef struct os_log_s* os_log_t;
+
+// printf() is never evaluated inside sizeof; this only keeps the compile time
+// format string checking which KextLog.hpp relies on.
+#define _os_log_verify_format_str(format, ...) ((void)sizeof(printf(format, ##__VA_ARGS__)))
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+#include <sys/queue.h>
+
+typedef int kauth_action_t;
+typedef struct kauth_listener* kauth_listener_t;
+typedef int (*kauth_scope_callback_t)(
+    kauth_cred_t credential,
+    void* idata,
+    kauth_action_t action,
+    uintptr_t arg0,
+    uintptr_t arg1,
+    uintptr_t arg2,
+    uintptr_t arg3);
+
+#define KAUTH_SCOPE_VNODE               "com.apple.kauth.vnode"
+#define KAUTH_SCOPE_FILEOP              "com.apple.kauth.fileop"
+
+#define KAUTH_RESULT_ALLOW              (1)
+#define KAUTH_RESULT_DENY               (2)
+#define KAUTH_RESULT_DEFER              (3)
+
+#define KAUTH_VNODE_READ_DATA           (1 << 1)
+#define KAUTH_VNODE_LIST_DIRECTORY      KAUTH_VNODE_READ_DATA
+#define KAUTH_VNODE_WRITE_DATA          (1 << 2)
+#define KAUTH_VNODE_ADD_FILE            KAUTH_VNODE_WRITE_DATA
+#define KAUTH_VNODE_EXECUTE             (1 << 3)
+#define KAUTH_VNODE_SEARCH              KAUTH_VNODE_EXECUTE
+#define KAUTH_VNODE_DELETE              (1 << 4)
+#define KAUTH_VNODE_APPEND_DATA         (1 << 5)
+#define KAUTH_VNODE_ADD_SUBDIRECTORY    KAUTH_VNODE_APPEND_DATA
+#define KAUTH_VNODE_DELETE_CHILD        (1 << 6)
+#define KAUTH_VNODE_READ_ATTRIBUTES     (1 << 7)
+#define KAUTH_VNODE_WRITE_ATTRIBUTES    (1 << 8)
+#define KAUTH_VNODE_READ_EXTATTRIBUTES  (1 << 9)
+#define KAUTH_VNODE_WRITE_EXTATTRIBUTES (1 << 10)
+#define KAUTH_VNODE_READ_SECURITY       (1 << 11)
+#define KAUTH_VNODE_WRITE_SECURITY      (1 << 12)
+#define KAUTH_VNODE_TAKE_OWNERSHIP      (1 << 13)
+#define KAUTH_VNODE_SYNCHRONIZE         (1 << 20)
+#define KAUTH_VNODE_LINKTARGET          (1 << 25)
+#define KAUTH_VNODE_CHECKIMMUTABLE      (1 << 26)
+#define KAUTH_VNODE_SEARCHBYANYONE      (1 << 29)
+#define KAUTH_VNODE_NOIMMUTABLE         (1 << 30)
+#define KAUTH_VNODE_ACCESS              (1U << 31)
+
+#define KAUTH_INVALIDATE_CACHED_RIGHTS  ((kauth_action_t)~0)
+
+#define KAUTH_FILEOP_OPEN               1
+#define KAUTH_FILEOP_CLOSE              2
+#define KAUTH_FILEOP_RENAME             3
+#define KAUTH_FILEOP_EXCHANGE           4
+#define KAUTH_FILEOP_LINK               5
+#define KAUTH_FILEOP_EXEC               6
+#define KAUTH_FILEOP_DELETE             7
+#define KAUTH_FILEOP_WILL_RENAME        8
+
+#define KAUTH_FILEOP_CLOSE_MODIFIED     (1 << 1)
+
+extern "C" kauth_listener_t kauth_listen_scope(const char* identifier, kauth_scope_callback_t callback, void* idata);
+extern "C" void kauth_unlisten_scope(kauth_listener_t listener);
@@ -0,0 +1,13 @@
+#pragma once
+
+#define DBG_APPS            33
+#define DBG_APP_SIGNPOST    10
+
+#define DBG_FUNC_START      1
+#define DBG_FUNC_END        2
+
+#define KDBG_CODE(Class, SubClass, code) (((Class & 0xff) << 24) | ((SubClass & 0xff) << 16) | ((code & 0x3fff) << 2))
+#define APPSDBG_CODE(SubClass, code) KDBG_CODE(DBG_APPS, SubClass, code)
+
+// Benchmarks run as if kdebug tracing were off, as it is outside of Instruments
+#define KERNEL_DEBUG_CONSTANT(debugid, arg1, arg2, arg3, arg4, arg5) do { } while (0)
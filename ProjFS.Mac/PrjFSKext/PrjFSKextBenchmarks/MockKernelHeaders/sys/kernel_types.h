@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/_types/_errno_t.h>
+
+// Opaque kernel types; the mock definitions live in MockKernel.cpp
+struct vnode;
+typedef struct vnode* vnode_t;
+struct mount;
+typedef struct mount* mount_t;
+struct vfs_context;
+typedef struct vfs_context* vfs_context_t;
+struct proc;
+typedef struct proc* proc_t;
+struct ucred;
+typedef struct ucred* kauth_cred_t;
+struct thread;
+typedef struct thread* thread_t;
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+#include <sys/_types/_fsid_t.h>
+#include <sys/param.h>
+
+#define MFSTYPENAMELEN 16
+
+struct vfsstatfs
+{
+    fsid_t  f_fsid;
+    char    f_fstypename[MFSTYPENAMELEN];
+    char    f_mntonname[MAXPATHLEN];
+};
+
+extern "C" struct vfsstatfs* vfs_statfs(mount_t mount);
+extern "C" int vfs_typenum(mount_t mount);
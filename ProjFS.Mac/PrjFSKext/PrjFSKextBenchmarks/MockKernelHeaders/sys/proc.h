@@ -0,0 +1,17 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+#include <sys/param.h>
+#include <time.h>
+
+extern "C"
+{
+    int proc_pid(proc_t process);
+    int proc_pgrpid(proc_t process);
+    void proc_name(int pid, char* buffer, int size);
+    // sigset_t is a 32 bit mask in the kernel
+    int proc_issignal(int pid, uint32_t mask);
+    
+    int msleep(void* channel, void* mutex, int priority, const char* waitMessage, struct timespec* timeout);
+    void wakeup(void* channel);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sys/kernel_types.h>
+#include <sys/kauth.h>
+#include <sys/param.h>
+#include <time.h>
+
+enum vtype { VNON, VREG, VDIR, VBLK, VCHR, VLNK, VSOCK, VFIFO, VBAD, VSTR, VCPLX };
+
+#define NULLVP ((vnode_t)0)
+
+#define VNODE_ATTR_va_data_size     (1ull << 4)
+#define VNODE_ATTR_va_mode          (1ull << 9)
+#define VNODE_ATTR_va_flags         (1ull << 10)
+#define VNODE_ATTR_va_fileid        (1ull << 13)
+
+struct vnode_attr
+{
+    uint64_t    va_supported;
+    uint64_t    va_active;
+    uint64_t    va_data_size;
+    mode_t      va_mode;
+    uint32_t    va_flags;
+    uint64_t    va_fileid;
+};
+
+#define VATTR_INIT(v)               do { (v)->va_supported = (v)->va_active = 0ull; } while (0)
+#define VATTR_WANTED(v, a)          ((v)->va_active |= VNODE_ATTR_ ## a)
+#define VATTR_IS_ACTIVE(v, a)       (0 != ((v)->va_active & VNODE_ATTR_ ## a))
+#define VATTR_SET_SUPPORTED(v, a)   ((v)->va_supported |= VNODE_ATTR_ ## a)
+#define VATTR_IS_SUPPORTED(v, a)    (0 != ((v)->va_supported & VNODE_ATTR_ ## a))
+
+extern "C"
+{
+    enum vtype vnode_vtype(vnode_t vnode);
+    uint32_t vnode_vid(vnode_t vnode);
+    int vnode_get(vnode_t vnode);
+    int vnode_getwithvid(vnode_t vnode, uint32_t vid);
+    int vnode_put(vnode_t vnode);
+    int vnode_isvroot(vnode_t vnode);
+    int vnode_isdir(vnode_t vnode);
+    vnode_t vnode_getparent(vnode_t vnode);
+    mount_t vnode_mount(vnode_t vnode);
+    int vnode_lookup(const char* path, int flags, vnode_t* vnode, vfs_context_t context);
+    int vnode_getattr(vnode_t vnode, struct vnode_attr* attributes, vfs_context_t context);
+    int vn_getpath(struct vnode* vnode, char* pathBuffer, int* length);
+    void vnode_uncache_authorized_action(vnode_t vnode, kauth_action_t action);
+    
+    vfs_context_t vfs_context_create(vfs_context_t context);
+    int vfs_context_rele(vfs_context_t context);
+    proc_t vfs_context_proc(vfs_context_t context);
+}
@@ -0,0 +1,284 @@
+#include <kern/debug.h>
+#include <kern/assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include "KextLog.hpp"
+#include "Locks.hpp"
+#include "Memory.hpp"
+#include "PrjFSProviderUserClient.hpp"
+#include "MockKernel.hpp"
+#include "MockKextSupport.hpp"
+
+static MockProvider_MessageHandler s_messageHandler = nullptr;
+static std::atomic<uint64_t> s_sentMessageCount(0);
+
+// Locks: pthread primitives in place of lck_mtx_t/lck_rw_t
+kern_return_t Locks_Init()
+{
+    return KERN_SUCCESS;
+}
+
+kern_return_t Locks_Cleanup()
+{
+    return KERN_SUCCESS;
+}
+
+bool Locks_GetProfiles(KextLog_LockProfiles* profiles)
+{
+    return false;
+}
+
+static pthread_mutex_t* GetPthreadMutex(Mutex mutex)
+{
+    return reinterpret_cast<pthread_mutex_t*>(mutex.p);
+}
+
+static pthread_rwlock_t* GetPthreadRWLock(const RWLock& rwLock)
+{
+    return reinterpret_cast<pthread_rwlock_t*>(rwLock.p);
+}
+
+Mutex Mutex_Alloc(LockProfileId profileId)
+{
+    Mutex mutex = {};
+    pthread_mutex_t* pthreadMutex = new pthread_mutex_t;
+    pthread_mutex_init(pthreadMutex, nullptr);
+    mutex.p = reinterpret_cast<lck_mtx_t*>(pthreadMutex);
+    return mutex;
+}
+
+void Mutex_FreeMemory(Mutex* mutex)
+{
+    pthread_mutex_destroy(GetPthreadMutex(*mutex));
+    delete GetPthreadMutex(*mutex);
+    mutex->p = nullptr;
+}
+
+bool Mutex_IsValid(Mutex mutex)
+{
+    return nullptr != mutex.p;
+}
+
+void Mutex_Acquire(Mutex mutex)
+{
+    pthread_mutex_lock(GetPthreadMutex(mutex));
+}
+
+void Mutex_Release(Mutex mutex)
+{
+    pthread_mutex_unlock(GetPthreadMutex(mutex));
+}
+
+int Mutex_Sleep(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout)
+{
+    return MockKernel_WaitForWakeup(GetPthreadMutex(mutex), timeout);
+}
+
+// Mock threads never receive signals
+int Mutex_SleepInterruptible(Mutex mutex, void* channel, const char* waitMessage, struct timespec* timeout)
+{
+    return MockKernel_WaitForWakeup(GetPthreadMutex(mutex), timeout);
+}
+
+RWLock RWLock_Alloc(LockProfileId profileId)
+{
+    RWLock rwLock = {};
+    pthread_rwlock_t* pthreadRWLock = new pthread_rwlock_t;
+    pthread_rwlock_init(pthreadRWLock, nullptr);
+    rwLock.p = reinterpret_cast<lck_rw_t*>(pthreadRWLock);
+    return rwLock;
+}
+
+bool RWLock_IsValid(RWLock rwLock)
+{
+    return nullptr != rwLock.p;
+}
+
+void RWLock_FreeMemory(RWLock* rwLock)
+{
+    pthread_rwlock_destroy(GetPthreadRWLock(*rwLock));
+    delete GetPthreadRWLock(*rwLock);
+    rwLock->p = nullptr;
+}
+
+void RWLock_AcquireShared(RWLock& rwLock)
+{
+    pthread_rwlock_rdlock(GetPthreadRWLock(rwLock));
+}
+
+void RWLock_ReleaseShared(RWLock& rwLock)
+{
+    pthread_rwlock_unlock(GetPthreadRWLock(rwLock));
+}
+
+void RWLock_AcquireExclusive(RWLock& rwLock)
+{
+    pthread_rwlock_wrlock(GetPthreadRWLock(rwLock));
+}
+
+void RWLock_ReleaseExclusive(RWLock& rwLock)
+{
+    pthread_rwlock_unlock(GetPthreadRWLock(rwLock));
+}
+
+// Like lck_rw_lock_shared_to_exclusive() when the upgrade fails: the shared
+// hold has been dropped and the caller must start over.
+bool RWLock_AcquireSharedToExclusive(RWLock& rwLock)
+{
+    pthread_rwlock_unlock(GetPthreadRWLock(rwLock));
+    return false;
+}
+
+// Memory: malloc in place of the kernel heap and the zone slabs, so allocation
+// costs measured here are those of the user space allocator.
+kern_return_t Memory_Init()
+{
+    return KERN_SUCCESS;
+}
+
+kern_return_t Memory_Cleanup()
+{
+    return KERN_SUCCESS;
+}
+
+void* Memory_Alloc(KernelMemorySubsystem subsystem, uint32_t size)
+{
+    return malloc(size);
+}
+
+void Memory_Free(KernelMemorySubsystem subsystem, void* buffer, uint32_t size)
+{
+    free(buffer);
+}
+
+uint32_t Memory_GetZoneElementSize(MemoryZone zone)
+{
+    switch (zone)
+    {
+    case MemoryZone_PathBuffer:
+        return PrjFSMaxPath;
+    case MemoryZone_RequestRecord:
+        return MemoryZoneRequestRecordSize;
+    default:
+        panic("Memory_GetZoneElementSize: invalid zone %d", zone);
+    }
+}
+
+void* Memory_AllocFromZone(MemoryZone zone)
+{
+    return malloc(Memory_GetZoneElementSize(zone));
+}
+
+void Memory_FreeToZone(MemoryZone zone, void* element)
+{
+    free(element);
+}
+
+// KextLog: messages are formatted, as the kext does for enabled levels, then dropped
+os_log_t __prjfs_log;
+atomic_uint __prjfs_logLevelMask;
+
+bool KextLog_Init()
+{
+    atomic_store(&__prjfs_logLevelMask, KextLog_DefaultLevelMask);
+    return true;
+}
+
+void KextLog_Cleanup()
+{
+}
+
+void KextLog_Printf(KextLog_Level loglevel, const char* fmt, ...)
+{
+    char logString[128];
+    va_list arguments;
+    va_start(arguments, fmt);
+    vsnprintf(logString, sizeof(logString), fmt, arguments);
+    va_end(arguments);
+}
+
+void KextLog_SendTraceEvent(KextLog_TraceEventId eventId, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, const char* string)
+{
+}
+
+// PrjFSProviderUserClient: only sendMessage() does anything
+OSDefineMetaClassAndStructors(PrjFSProviderUserClient, IOUserClient);
+
+PrjFSProviderUserClient* MockProvider_Create(pid_t pid)
+{
+    PrjFSProviderUserClient* provider = new PrjFSProviderUserClient();
+    provider->pid = pid;
+    provider->virtualizationRootIndex = -1;
+    return provider;
+}
+
+void MockProvider_Free(PrjFSProviderUserClient* provider)
+{
+    delete provider;
+}
+
+void MockProvider_SetMessageHandler(MockProvider_MessageHandler handler)
+{
+    s_messageHandler = handler;
+}
+
+uint64_t MockProvider_GetSentMessageCount()
+{
+    return s_sentMessageCount.load();
+}
+
+bool PrjFSProviderUserClient::sendMessage(const Message& message, bool waitIfQueueFull)
+{
+    const char* path = message.messageHeader->pathSizeBytes > 0 ? message.path : nullptr;
+    
+    s_sentMessageCount++;
+    return nullptr == s_messageHandler || s_messageHandler(message.messageHeader, path);
+}
+
+// Mock providers respond directly, never through the response ring
+void PrjFSProviderUserClient::drainResponseRing()
+{
+}
+
+bool PrjFSProviderUserClient::initWithTask(task_t owningTask, void* securityToken, UInt32 type, OSDictionary* properties)
+{
+    return true;
+}
+
+IOReturn PrjFSProviderUserClient::externalMethod(
+    uint32_t selector,
+    IOExternalMethodArguments* arguments,
+    IOExternalMethodDispatch* dispatch,
+    OSObject* target,
+    void* reference)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn PrjFSProviderUserClient::clientClose()
+{
+    return kIOReturnSuccess;
+}
+
+bool PrjFSProviderUserClient::serializeProperties(OSSerialize* serialize) const
+{
+    return false;
+}
+
+void PrjFSProviderUserClient::free()
+{
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sys/types.h>
+#include "Message.h"
+#include "PrjFSClasses.hpp"
+
+// MockKextSupport.cpp replaces the kext's Locks, Memory, KextLog and
+// PrjFSProviderUserClient implementations for the user space build.
+
+// Called for each request the kext sends to a mock provider, on the sending
+// thread and outside any kext locks, so it may respond straight away with
+// KauthHandler_HandleKernelMessageResponse(). Returning false makes the send
+// fail as if the provider's queue was full.
+typedef bool (*MockProvider_MessageHandler)(const MessageHeader* message, const char* path);
+
+PrjFSProviderUserClient* MockProvider_Create(pid_t pid);
+void MockProvider_Free(PrjFSProviderUserClient* provider);
+void MockProvider_SetMessageHandler(MockProvider_MessageHandler handler);
+uint64_t MockProvider_GetSentMessageCount();
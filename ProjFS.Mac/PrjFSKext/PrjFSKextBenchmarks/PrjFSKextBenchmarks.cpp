@@ -0,0 +1,957 @@
+// Microbenchmarks for the code the kext runs on every kauth callback. The kext
+// sources are compiled unchanged into a user space program (KEXT_UNIT_TESTING
+// only widens the linkage of a few helpers), against the mocked kernel KPIs in
+// MockKernel.cpp and MockKextSupport.cpp. The mocks' own costs are nothing like
+// the kernel's, so compare numbers across changes to the kext code rather than
+// reading them as absolute kauth overheads. Besides the Xcode target, the
+// benchmarks build and run on Linux with Scripts/BuildKextBenchmarksOnLinux.sh.
+
+#include <kern/debug.h>
+#include <sys/kauth.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "PrjFSCommon.h"
+#include "PrjFSXattrs.h"
+#include "KauthHandler.hpp"
+#include "KauthHandlerTestable.hpp"
+#include "KextLog.hpp"
+#include "Locks.hpp"
+#include "Memory.hpp"
+#include "Message.h"
+#include "ProcessPolicy.hpp"
+#include "VirtualizationRoots.hpp"
+#include "VirtualizationRootsTestable.hpp"
+#include "VnodeUtilities.hpp"
+#include "../public/PrjFSProviderClientShared.h"
+#include "MockKernel.hpp"
+#include "MockKextSupport.hpp"
+
+typedef void (*BenchmarkBody)(uint64_t iterations);
+
+struct Benchmark
+{
+    const char*     name;
+    BenchmarkBody   body;
+};
+
+static const int UserPid = 501;
+static const int CrawlerPid = 502;
+static const int ProviderPid = 400;
+static const int HelperPid = 600;
+static const uint32_t OfflineRootCount = 63;
+static const uint32_t DirectoryDepth = 8;
+static const char ActiveRootPath[] = "/Users/dev/repo";
+static const uint32_t ActiveRootPathLength = sizeof(ActiveRootPath) - 1;
+
+// Results are accumulated here so the compiler can't drop the calls
+static volatile uint64_t s_sink;
+
+static vfs_context_t s_userContext;
+static vfs_context_t s_crawlerContext;
+static vfs_context_t s_providerContext;
+static vfs_context_t s_helperContext;
+
+static vnode_t s_fileOutsideRoots;
+static vnode_t s_rootVnode;
+static VnodeFsidInode s_rootIds;
+// s_directoryChain[0] is a child of the root, s_deepDirectory the last element
+static vnode_t s_directoryChain[DirectoryDepth];
+static vnode_t s_deepDirectory;
+static vnode_t s_hydratedFile;
+static vnode_t s_emptyFile;
+static vnode_t s_emptyDirectory;
+static char s_hydratedFilePath[PrjFSMaxPath];
+// In the first offline root
+static vnode_t s_offlineHydratedFile;
+static vnode_t s_offlineEmptyFile;
+
+static PrjFSProviderUserClient* s_provider;
+static int32_t s_activeRootIndex;
+
+static bool RespondImmediately(const MessageHeader* message, const char* path)
+{
+    KauthHandler_HandleKernelMessageResponse(message->messageId, MessageType_Response_Success);
+    return true;
+}
+
+// Handed from DeferResponse to the responder thread in
+// Benchmark_KauthHydrationAsyncResponse; 0 when nothing is pending.
+static std::atomic<uint64_t> s_pendingResponseMessageId;
+
+static bool DeferResponse(const MessageHeader* message, const char* path)
+{
+    s_pendingResponseMessageId.store(message->messageId, std::memory_order_release);
+    return true;
+}
+
+static int CallKauthHandler(vfs_context_t context, vnode_t vnode, kauth_action_t action)
+{
+    int kauthError = 0;
+    return HandleVnodeOperation(
+        nullptr,
+        nullptr,
+        action,
+        reinterpret_cast<uintptr_t>(context),
+        reinterpret_cast<uintptr_t>(vnode),
+        0,
+        reinterpret_cast<uintptr_t>(&kauthError));
+}
+
+static bool SetUp()
+{
+    if (Locks_Init() || Memory_Init() || !KextLog_Init() || KauthHandler_Init())
+    {
+        fprintf(stderr, "Failed to initialise the kext components\n");
+        return false;
+    }
+
+    s_userContext = MockContext_Create(UserPid, "clang");
+    s_crawlerContext = MockContext_Create(CrawlerPid, "mdworker");
+    s_providerContext = MockContext_Create(ProviderPid, "GVFS.Mount");
+    s_helperContext = MockContext_Create(HelperPid, "GVFS.Hooks");
+
+    fsid_t fsid = { { 0x1000004, 0x1a } };
+    mount_t mount = MockMount_Create("apfs", 0x1a, fsid);
+    vnode_t fileSystemRoot = MockVnode_CreateFileSystemRoot(mount);
+    vnode_t users = MockVnode_Create(fileSystemRoot, "Users", VDIR, 0);
+    vnode_t home = MockVnode_Create(users, "dev", VDIR, 0);
+    vnode_t other = MockVnode_Create(home, "other", VDIR, 0);
+    s_fileOutsideRoots = MockVnode_Create(other, "plain.txt", VREG, 0);
+
+    // Offline roots fill the root table; they are found by the xattr probe in
+    // VirtualizationRoots_LookupVnode, as after a provider has gone away.
+    for (uint32_t i = 0; i < OfflineRootCount; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "offline%02u", i);
+        vnode_t offlineRoot = MockVnode_Create(home, name, VDIR, FileFlags_IsInVirtualizationRoot);
+        MockVnode_SetIsVirtualizationRoot(offlineRoot);
+        if (VirtualizationRoots_LookupVnode(offlineRoot, nullptr, nullptr) < 0)
+        {
+            fprintf(stderr, "Failed to insert offline root %s\n", name);
+            return false;
+        }
+        
+        if (0 == i)
+        {
+            s_offlineHydratedFile = MockVnode_Create(offlineRoot, "hydrated.txt", VREG, FileFlags_IsInVirtualizationRoot);
+            s_offlineEmptyFile = MockVnode_Create(offlineRoot, "empty.txt", VREG, FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty);
+        }
+    }
+
+    const uint32_t inRoot = FileFlags_IsInVirtualizationRoot;
+    s_rootVnode = MockVnode_Create(home, "repo", VDIR, inRoot);
+    MockVnode_SetIsVirtualizationRoot(s_rootVnode);
+    s_rootIds = Vnode_GetFsidAndInode(s_rootVnode, nullptr);
+
+    vnode_t parent = s_rootVnode;
+    for (uint32_t i = 0; i < DirectoryDepth; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "dir%u", i);
+        s_directoryChain[i] = MockVnode_Create(parent, name, VDIR, inRoot);
+        parent = s_directoryChain[i];
+    }
+
+    s_deepDirectory = parent;
+    s_hydratedFile = MockVnode_Create(s_deepDirectory, "hydrated.txt", VREG, inRoot);
+    s_emptyFile = MockVnode_Create(s_deepDirectory, "empty.txt", VREG, inRoot | FileFlags_IsEmpty);
+    s_emptyDirectory = MockVnode_Create(s_deepDirectory, "empty", VDIR, inRoot | FileFlags_IsEmpty);
+
+    int pathLength = sizeof(s_hydratedFilePath);
+    vn_getpath(s_hydratedFile, s_hydratedFilePath, &pathLength);
+
+    s_provider = MockProvider_Create(ProviderPid);
+    VirtualizationRootResult result = VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_None);
+    if (0 != result.error)
+    {
+        fprintf(stderr, "Failed to register the provider for %s: %d\n", ActiveRootPath, result.error);
+        return false;
+    }
+
+    s_activeRootIndex = result.rootIndex;
+    return true;
+}
+
+static void TearDown()
+{
+    KauthHandler_Cleanup();
+    KextLog_Cleanup();
+    Memory_Cleanup();
+    Locks_Cleanup();
+
+    MockProvider_Free(s_provider);
+    MockKernel_Reset();
+}
+
+// Helpers
+static void Benchmark_ActionBitIsSet(uint64_t iterations)
+{
+    static const kauth_action_t actions[] =
+    {
+        KAUTH_VNODE_READ_DATA,
+        KAUTH_VNODE_READ_ATTRIBUTES,
+        KAUTH_VNODE_WRITE_DATA | KAUTH_VNODE_APPEND_DATA,
+        KAUTH_VNODE_READ_SECURITY | KAUTH_VNODE_SYNCHRONIZE,
+    };
+
+    uint64_t setCount = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        setCount += ActionBitIsSet(actions[i % 4], KAUTH_VNODE_READ_DATA | KAUTH_VNODE_READ_ATTRIBUTES | KAUTH_VNODE_EXECUTE);
+    }
+
+    s_sink += setCount;
+}
+
+static void Benchmark_GetRelativePath(uint64_t iterations)
+{
+    uintptr_t pointerSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        pointerSum += reinterpret_cast<uintptr_t>(GetRelativePath(s_hydratedFilePath, ActiveRootPath, ActiveRootPathLength));
+    }
+
+    s_sink += pointerSum;
+}
+
+static void Benchmark_MessageInit(uint64_t iterations)
+{
+    MessageHeader header = {};
+    Message message = {};
+    const char* relativePath = GetRelativePath(s_hydratedFilePath, ActiveRootPath, ActiveRootPathLength);
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        Message_Init(&message, &header, i, MessageType_KtoU_HydrateFile, UserPid, "clang", s_rootIds.fsid, s_rootIds.inode, relativePath, nullptr);
+    }
+
+    s_sink += header.pathSizeBytes;
+}
+
+static void Benchmark_ProcessPolicyRegular(uint64_t iterations)
+{
+    uint64_t flags = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        flags += ProcessPolicy_GetFlags(UserPid, "clang");
+    }
+
+    s_sink += flags;
+}
+
+static void Benchmark_ProcessPolicyCrawler(uint64_t iterations)
+{
+    uint64_t flags = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        flags += ProcessPolicy_GetFlags(CrawlerPid, "mdworker");
+    }
+
+    s_sink += flags;
+}
+
+// Root lookups
+static void Benchmark_VnodeIsOnAllowedFilesystem(uint64_t iterations)
+{
+    uint64_t allowedCount = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        allowedCount += VirtualizationRoot_VnodeIsOnAllowedFilesystem(s_hydratedFile);
+    }
+
+    s_sink += allowedCount;
+}
+
+static void Benchmark_FindRootForVnodeLocked(uint64_t iterations)
+{
+    uint32_t vid = vnode_vid(s_rootVnode);
+    int64_t indexSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        indexSum += FindRootForVnode_Locked(s_rootVnode, vid, s_rootIds);
+    }
+
+    s_sink += indexSum;
+}
+
+static void Benchmark_LookupVnodeKnownNonRoot(uint64_t iterations)
+{
+    int64_t indexSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        indexSum += VirtualizationRoots_LookupVnode(s_deepDirectory, nullptr, nullptr);
+    }
+
+    s_sink += indexSum;
+}
+
+static void Benchmark_FindForVnodeCached(uint64_t iterations)
+{
+    uintptr_t pointerSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        pointerSum += reinterpret_cast<uintptr_t>(VirtualizationRoots_FindForVnode(s_hydratedFile));
+    }
+
+    s_sink += pointerSum;
+}
+
+// Recycling the file and its ancestors invalidates everything the kext cached
+// for them, so every lookup walks up to the root and probes each directory's xattr.
+static void Benchmark_FindForVnodeUncached(uint64_t iterations)
+{
+    uintptr_t pointerSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        MockVnode_Recycle(s_hydratedFile);
+        for (uint32_t depth = 0; depth < DirectoryDepth; ++depth)
+        {
+            MockVnode_Recycle(s_directoryChain[depth]);
+        }
+
+        pointerSum += reinterpret_cast<uintptr_t>(VirtualizationRoots_FindForVnode(s_hydratedFile));
+    }
+
+    s_sink += pointerSum;
+}
+
+// Whole kauth callbacks
+static void Benchmark_KauthOutsideRoots(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_fileOutsideRoots, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthHydratedFile(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_hydratedFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthHydratedDirectory(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_deepDirectory, KAUTH_VNODE_LIST_DIRECTORY);
+    }
+
+    s_sink += resultSum;
+}
+
+// A stat() of an empty placeholder, which is answered from its own attributes
+// rather than by hydrating it
+static void Benchmark_KauthEmptyFileStat(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_ATTRIBUTES);
+    }
+
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthProviderPid(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_providerContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+// A full set of helpers, with the caller last
+static void Benchmark_KauthHelperPid(uint64_t iterations)
+{
+    int32_t helperPids[MaxProviderHelperProcesses];
+    for (uint32_t i = 0; i < MaxProviderHelperProcesses; ++i)
+    {
+        helperPids[i] = HelperPid - MaxProviderHelperProcesses + 1 + i;
+    }
+
+    ActiveProvider_SetHelperProcesses(s_activeRootIndex, helperPids, MaxProviderHelperProcesses, 0);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_helperContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    ActiveProvider_SetHelperProcesses(s_activeRootIndex, nullptr, 0, 0);
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthCrawlerDenied(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_crawlerContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+// A tool hammering a root whose provider has gone away
+static void Benchmark_KauthOfflineWriteDenied(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_offlineHydratedFile, KAUTH_VNODE_WRITE_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthOfflineEmptyFileDenied(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_offlineEmptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+static void Benchmark_KauthOfflineHydratedFileRead(uint64_t iterations)
+{
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_offlineHydratedFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    s_sink += resultSum;
+}
+
+// Writes to an empty file in a read-only root are denied without hydrating it
+static void Benchmark_KauthReadOnlyWriteDenied(uint64_t iterations)
+{
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_ReadOnly);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_WRITE_DATA);
+    }
+
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_None);
+    s_sink += resultSum;
+}
+
+// A stat() of an empty directory in a root that doesn't enumerate directories
+// for attribute reads
+static void Benchmark_KauthEmptyDirectoryStat(uint64_t iterations)
+{
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_AttributeOnlyDirectoryReads);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyDirectory, KAUTH_VNODE_READ_ATTRIBUTES);
+    }
+
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_None);
+    s_sink += resultSum;
+}
+
+// The mock provider answers from within sendMessage(), so this measures the
+// kext's side of a hydration request: path lookup, message construction,
+// bookkeeping and the response handling, without any real wait.
+static void Benchmark_KauthHydrationRoundTrip(uint64_t iterations)
+{
+    MockProvider_SetMessageHandler(RespondImmediately);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    MockProvider_SetMessageHandler(nullptr);
+    s_sink += resultSum;
+}
+
+// As above, with prefetch hints enabled: the directory was hinted in the first
+// iteration, so the others only pay for the rate limit check.
+static void Benchmark_KauthHydrationWithPrefetchHints(uint64_t iterations)
+{
+    MockProvider_SetMessageHandler(RespondImmediately);
+    ActiveProvider_SetPrefetchHintInterval(s_activeRootIndex, 60 * 1000);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    ActiveProvider_SetPrefetchHintInterval(s_activeRootIndex, 0);
+    MockProvider_SetMessageHandler(nullptr);
+    s_sink += resultSum;
+}
+
+// As the round trip, with a rate limit too high to ever hold the loop back,
+// so the difference is the cost of taking a token from the process's bucket.
+static void Benchmark_KauthHydrationRateLimited(uint64_t iterations)
+{
+    MockProvider_SetMessageHandler(RespondImmediately);
+    ActiveProvider_SetRequestRateLimit(s_activeRootIndex, 1000000000, 1000000, 0);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    ActiveProvider_SetRequestRateLimit(s_activeRootIndex, 0, 0, 0);
+    MockProvider_SetMessageHandler(nullptr);
+    s_sink += resultSum;
+}
+
+// A process that has used up its single token, and may not wait for another,
+// has its hydrations denied without a message to the provider.
+static void Benchmark_KauthRateLimitDenied(uint64_t iterations)
+{
+    MockProvider_SetMessageHandler(RespondImmediately);
+    ActiveProvider_SetRequestRateLimit(s_activeRootIndex, 1, 1, 0);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    ActiveProvider_SetRequestRateLimit(s_activeRootIndex, 0, 0, 0);
+    MockProvider_SetMessageHandler(nullptr);
+    s_sink += resultSum;
+}
+
+// While the provider is unresponsive, hydrations fail without a message to it
+// (but for a probe once a second, which the mock provider answers).
+static void Benchmark_KauthUnresponsiveRejected(uint64_t iterations)
+{
+    MockProvider_SetMessageHandler(RespondImmediately);
+    VirtualizationRoot* root = VirtualizationRoots_FindForVnode(s_emptyFile);
+    atomic_store(&root->providerUnresponsive, true);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    ActiveProvider_RecordResponses(s_activeRootIndex);
+    MockProvider_SetMessageHandler(nullptr);
+    s_sink += resultSum;
+}
+
+// A provider thread that answers within a microsecond or so of the request,
+// like one serving hydrations from a local cache. Most of the cost is how long
+// the waiting thread takes to notice the response.
+static void Benchmark_KauthHydrationAsyncResponse(uint64_t iterations)
+{
+    std::atomic<bool> stopResponder(false);
+    std::thread responder(
+        [&stopResponder]()
+        {
+            while (!stopResponder.load(std::memory_order_relaxed))
+            {
+                uint64_t messageId = s_pendingResponseMessageId.exchange(0, std::memory_order_acquire);
+                if (0 != messageId)
+                {
+                    KauthHandler_HandleKernelMessageResponse(messageId, MessageType_Response_Success);
+                }
+            }
+        });
+    MockProvider_SetMessageHandler(DeferResponse);
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += CallKauthHandler(s_userContext, s_emptyFile, KAUTH_VNODE_READ_DATA);
+    }
+
+    MockProvider_SetMessageHandler(nullptr);
+    stopResponder.store(true, std::memory_order_relaxed);
+    responder.join();
+    s_sink += resultSum;
+}
+
+// Every close records the same file, so after the first iteration this measures
+// the path filter and the lookup that finds it already in the modified set.
+static void Benchmark_FileOpCloseModifiedRecorded(uint64_t iterations)
+{
+    struct
+    {
+        NotificationMappingEntry entry;
+        char path[4];
+    } mapping = { { ProviderNotification_RecordModifiedFile, 1, 0 }, "" };
+    ActiveProvider_SetNotificationMappings(s_activeRootIndex, &mapping, sizeof(mapping));
+
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += HandleFileOpOperation(
+            nullptr,
+            nullptr,
+            KAUTH_FILEOP_CLOSE,
+            reinterpret_cast<uintptr_t>(s_hydratedFile),
+            reinterpret_cast<uintptr_t>(s_hydratedFilePath),
+            KAUTH_FILEOP_CLOSE_MODIFIED,
+            0);
+    }
+
+    ActiveProvider_SetNotificationMappings(s_activeRootIndex, nullptr, 0);
+    s_sink += resultSum;
+}
+
+// Renames elsewhere on the machine, e.g. the atomic renames of build steps. They
+// must not get as far as looking up the destination, let alone invalidate the
+// roots cached for every directory.
+static void Benchmark_FileOpRenameOutsideRoots(uint64_t iterations)
+{
+    static const char fromPath[] = "/Users/dev/other/plain.txt.tmp";
+    static const char toPath[] = "/Users/dev/other/plain.txt";
+    
+    uint64_t resultSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        resultSum += HandleFileOpOperation(
+            nullptr,
+            nullptr,
+            KAUTH_FILEOP_RENAME,
+            reinterpret_cast<uintptr_t>(fromPath),
+            reinterpret_cast<uintptr_t>(toPath),
+            0,
+            0);
+    }
+
+    s_sink += resultSum;
+}
+
+// Provider restarts: the root goes offline and the provider attaches to it
+// again. The mocked vnode_lookup is a map lookup, far cheaper than a real path
+// walk, so the by-path numbers understate the difference.
+static void Benchmark_ReattachProviderByPath(uint64_t iterations)
+{
+    int64_t errorSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        ActiveProvider_Disconnect(s_activeRootIndex);
+        errorSum += VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_None).error;
+    }
+
+    s_sink += errorSum;
+}
+
+static void Benchmark_ReattachProviderByToken(uint64_t iterations)
+{
+    PrjFSVirtualizationRootXAttrData rootXattr = {};
+    Vnode_ReadXattr(s_rootVnode, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr), nullptr);
+
+    int64_t errorSum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        ActiveProvider_Disconnect(s_activeRootIndex);
+        errorSum += VirtualizationRoot_ReattachProvider(s_provider, ProviderPid, s_rootIds, rootXattr.rootToken, ProviderRoot_None).error;
+    }
+
+    s_sink += errorSum;
+}
+
+// Checks, run once before the benchmarks, of behaviour the benchmarks don't
+// otherwise exercise
+static MessageType s_lastSentMessageType;
+
+static bool RecordAndRespond(const MessageHeader* message, const char* path)
+{
+    s_lastSentMessageType = static_cast<MessageType>(message->messageType);
+    return RespondImmediately(message, path);
+}
+
+static bool ExpectWriteOpen(vnode_t file, int expectedResult, MessageType expectedMessageType, const char* step)
+{
+    s_lastSentMessageType = MessageType_Invalid;
+    int result = CallKauthHandler(s_userContext, file, KAUTH_VNODE_WRITE_DATA);
+    if (expectedResult != result || expectedMessageType != s_lastSentMessageType)
+    {
+        fprintf(stderr, "Pending overwrites: %s: result %d, message type %d\n", step, result, s_lastSentMessageType);
+        return false;
+    }
+
+    return true;
+}
+
+static bool ExpectOpen(vnode_t file, const char* path, MessageType expectedMessageType, const char* step)
+{
+    s_lastSentMessageType = MessageType_Invalid;
+    HandleFileOpOperation(
+        nullptr,
+        nullptr,
+        KAUTH_FILEOP_OPEN,
+        reinterpret_cast<uintptr_t>(file),
+        reinterpret_cast<uintptr_t>(path),
+        0,
+        0);
+    if (expectedMessageType != s_lastSentMessageType)
+    {
+        fprintf(stderr, "Pending overwrites: %s: message type %d\n", step, s_lastSentMessageType);
+        return false;
+    }
+
+    return true;
+}
+
+// Write-opens of 0 byte placeholders in a ProviderRoot_SkipOverwriteHydration
+// root are let through and the file is converted once the open has happened,
+// while files with contents are hydrated first. Two pending files that share a
+// slot in the kext's table: the second is hydrated as usual, unless the first
+// one's vnode has been recycled since, in which case it takes over the slot.
+static bool CheckPendingOverwrites()
+{
+    // PendingOverwriteCount in KauthHandler.cpp
+    static const uint32_t PendingOverwriteSlotCount = 256;
+
+    const uint32_t placeholderFlags = FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty;
+    vnode_t firstFile = MockVnode_Create(s_deepDirectory, "overwrite0.txt", VREG, placeholderFlags);
+    vnode_t collidingFile = NULLVP;
+    for (uint32_t i = 1; NULLVP == collidingFile && i <= PendingOverwriteSlotCount * 4; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "overwrite%u.txt", i);
+        vnode_t file = MockVnode_Create(s_deepDirectory, name, VREG, placeholderFlags);
+        if (((HashVnode(file) ^ HashVnode(firstFile)) & (PendingOverwriteSlotCount - 1)) == 0)
+        {
+            collidingFile = file;
+        }
+    }
+
+    vnode_t fileWithContents = MockVnode_Create(s_deepDirectory, "overwrite-contents.txt", VREG, placeholderFlags);
+    MockVnode_SetDataSize(fileWithContents, 4096);
+    if (NULLVP == collidingFile)
+    {
+        fprintf(stderr, "Pending overwrites: no two files share a slot\n");
+        return false;
+    }
+
+    char collidingFilePath[PrjFSMaxPath];
+    int pathLength = sizeof(collidingFilePath);
+    vn_getpath(collidingFile, collidingFilePath, &pathLength);
+
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_SkipOverwriteHydration);
+    MockProvider_SetMessageHandler(RecordAndRespond);
+
+    bool passed =
+        ExpectWriteOpen(firstFile, KAUTH_RESULT_DEFER, MessageType_Invalid, "first file deferred") &&
+        ExpectWriteOpen(collidingFile, KAUTH_RESULT_DEFER, MessageType_KtoU_HydrateFile, "live collision hydrated") &&
+        ExpectWriteOpen(fileWithContents, KAUTH_RESULT_DEFER, MessageType_KtoU_HydrateFile, "file with contents hydrated");
+    if (passed)
+    {
+        MockVnode_Recycle(firstFile);
+        passed = ExpectWriteOpen(collidingFile, KAUTH_RESULT_DEFER, MessageType_Invalid, "stale collision replaced");
+    }
+
+    // The open converts the file, after which nothing is left pending (the
+    // recycled first file's entry was taken over, not added to)
+    if (passed)
+    {
+        passed =
+            ExpectOpen(collidingFile, collidingFilePath, MessageType_KtoU_ConvertFileToFull, "open converted") &&
+            ExpectOpen(collidingFile, collidingFilePath, MessageType_Invalid, "converted file no longer pending");
+    }
+
+    MockProvider_SetMessageHandler(nullptr);
+    ActiveProvider_Disconnect(s_activeRootIndex);
+    VirtualizationRoot_RegisterProviderForPath(s_provider, ProviderPid, ActiveRootPath, ProviderRoot_None);
+    return passed;
+}
+
+static const Benchmark s_benchmarks[] =
+{
+    { "ActionBitIsSet",                                 Benchmark_ActionBitIsSet },
+    { "GetRelativePath",                                Benchmark_GetRelativePath },
+    { "Message_Init",                                   Benchmark_MessageInit },
+    { "ProcessPolicy_GetFlags/regular",                 Benchmark_ProcessPolicyRegular },
+    { "ProcessPolicy_GetFlags/crawler",                 Benchmark_ProcessPolicyCrawler },
+    { "VirtualizationRoot_VnodeIsOnAllowedFilesystem",  Benchmark_VnodeIsOnAllowedFilesystem },
+    { "FindRootForVnode_Locked/64-roots",               Benchmark_FindRootForVnodeLocked },
+    { "VirtualizationRoots_LookupVnode/known-non-root", Benchmark_LookupVnodeKnownNonRoot },
+    { "VirtualizationRoots_FindForVnode/cached",        Benchmark_FindForVnodeCached },
+    { "VirtualizationRoots_FindForVnode/uncached",      Benchmark_FindForVnodeUncached },
+    { "HandleVnodeOperation/outside-roots",             Benchmark_KauthOutsideRoots },
+    { "HandleVnodeOperation/hydrated-file",             Benchmark_KauthHydratedFile },
+    { "HandleVnodeOperation/hydrated-directory",        Benchmark_KauthHydratedDirectory },
+    { "HandleVnodeOperation/empty-file-stat",           Benchmark_KauthEmptyFileStat },
+    { "HandleVnodeOperation/empty-directory-stat",      Benchmark_KauthEmptyDirectoryStat },
+    { "HandleVnodeOperation/provider-pid",              Benchmark_KauthProviderPid },
+    { "HandleVnodeOperation/helper-pid",                Benchmark_KauthHelperPid },
+    { "HandleVnodeOperation/crawler-denied",            Benchmark_KauthCrawlerDenied },
+    { "HandleVnodeOperation/offline-write-denied",      Benchmark_KauthOfflineWriteDenied },
+    { "HandleVnodeOperation/offline-empty-denied",      Benchmark_KauthOfflineEmptyFileDenied },
+    { "HandleVnodeOperation/offline-hydrated-read",     Benchmark_KauthOfflineHydratedFileRead },
+    { "HandleVnodeOperation/read-only-write-denied",    Benchmark_KauthReadOnlyWriteDenied },
+    { "HandleVnodeOperation/hydration-round-trip",      Benchmark_KauthHydrationRoundTrip },
+    { "HandleVnodeOperation/hydration-prefetch-hinted", Benchmark_KauthHydrationWithPrefetchHints },
+    { "HandleVnodeOperation/hydration-async-response",  Benchmark_KauthHydrationAsyncResponse },
+    { "HandleVnodeOperation/hydration-rate-limited",    Benchmark_KauthHydrationRateLimited },
+    { "HandleVnodeOperation/rate-limit-denied",         Benchmark_KauthRateLimitDenied },
+    { "HandleVnodeOperation/unresponsive-rejected",     Benchmark_KauthUnresponsiveRejected },
+    { "HandleFileOpOperation/close-modified-recorded",  Benchmark_FileOpCloseModifiedRecorded },
+    { "HandleFileOpOperation/rename-outside-roots",     Benchmark_FileOpRenameOutsideRoots },
+    { "VirtualizationRoot_ReattachProvider/by-path",    Benchmark_ReattachProviderByPath },
+    { "VirtualizationRoot_ReattachProvider/by-token",   Benchmark_ReattachProviderByToken },
+};
+
+static double RunBatch(BenchmarkBody body, uint64_t iterations)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    body(iterations);
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void PrintUsage(const char* programName)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [--iterations <per batch>] [--batches <count>] [--filter <substring>] [--results <path>]\n",
+        programName);
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t iterations = 100000;
+    uint32_t batchCount = 11;
+    const char* filter = nullptr;
+    const char* resultsPath = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--iterations") && i + 1 < argc)
+        {
+            iterations = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argv[i], "--batches") && i + 1 < argc)
+        {
+            batchCount = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--results") && i + 1 < argc)
+        {
+            resultsPath = argv[++i];
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (0 == iterations || 0 == batchCount)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // Results are also appended here as JSON, one per line, in the form the GVFS functional
+    // tests' BenchmarkRegressionGate compares against a baseline
+    FILE* resultsFile = nullptr;
+    if (nullptr != resultsPath)
+    {
+        resultsFile = fopen(resultsPath, "a");
+        if (nullptr == resultsFile)
+        {
+            fprintf(stderr, "Failed to open %s\n", resultsPath);
+            return 1;
+        }
+    }
+
+    if (!SetUp())
+    {
+        return 1;
+    }
+
+    if (!CheckPendingOverwrites())
+    {
+        TearDown();
+        return 1;
+    }
+
+    printf("%-48s %12s %12s %12s\n", "benchmark", "median ns", "min ns", "max ns");
+    for (const Benchmark& benchmark : s_benchmarks)
+    {
+        if (nullptr != filter && nullptr == strstr(benchmark.name, filter))
+        {
+            continue;
+        }
+
+        // Warm up caches (ours and the kext's) before timing
+        benchmark.body(iterations / 10 + 1);
+
+        std::vector<double> nanosecondsPerIteration;
+        for (uint32_t batch = 0; batch < batchCount; ++batch)
+        {
+            nanosecondsPerIteration.push_back(RunBatch(benchmark.body, iterations));
+        }
+
+        std::sort(nanosecondsPerIteration.begin(), nanosecondsPerIteration.end());
+        printf(
+            "%-48s %12.1f %12.1f %12.1f\n",
+            benchmark.name,
+            nanosecondsPerIteration[nanosecondsPerIteration.size() / 2],
+            nanosecondsPerIteration.front(),
+            nanosecondsPerIteration.back());
+
+        if (nullptr != resultsFile)
+        {
+            fprintf(
+                resultsFile,
+                "{\"suite\":\"PrjFSKext\",\"benchmark\":\"%s\",\"iterations\":%llu,\"batches\":%u,\"medianNs\":%.1f,\"minNs\":%.1f,\"maxNs\":%.1f}\n",
+                benchmark.name,
+                static_cast<unsigned long long>(iterations),
+                batchCount,
+                nanosecondsPerIteration[nanosecondsPerIteration.size() / 2],
+                nanosecondsPerIteration.front(),
+                nanosecondsPerIteration.back());
+        }
+    }
+
+    printf("%llu requests sent to the mock provider\n", static_cast<unsigned long long>(MockProvider_GetSentMessageCount()));
+
+    if (nullptr != resultsFile)
+    {
+        fclose(resultsFile);
+    }
+
+    TearDown();
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define Message_h
 
 #include <sys/param.h>
+#include <sys/_types/_fsid_t.h>
 #include "PrjFSCommon.h"
 
 typedef enum
@@ -14,14 +15,69 @@ typedef enum
     
     // Messages from kernel to user mode
     MessageType_KtoU_EnumerateDirectory,
+    
+    // Sent instead of EnumerateDirectory to processes with
+    // ProcessPolicy_EnumerateRecursively. Carries the same placeholder info; the
+    // provider enumerates the directory and every empty directory below it before
+    // responding.
+    MessageType_KtoU_EnumerateDirectoryRecursively,
+    
     MessageType_KtoU_HydrateFile,
     
+    // Sent instead of HydrateFile for a 0 byte empty file opened for writing only,
+    // in roots with ProviderRoot_SkipOverwriteHydration.
+    // Carries the same placeholder info; the provider clears the file's empty flag
+    // without fetching its contents. Only once ProviderCapability_ConvertFileToFull
+    // is negotiated.
+    MessageType_KtoU_ConvertFileToFull,
+    
+    // Notifications, only sent for paths covered by the provider's notification
+    // mappings. Only the pre-operation ones wait for a response; a failure
+    // response to a pre-delete notification vetoes the deletion.
+    MessageType_KtoU_NotifyFilePreDelete,
+    MessageType_KtoU_NotifyDirectoryPreDelete,
+    MessageType_KtoU_NotifyFileCreated,
+    MessageType_KtoU_NotifyFileModified,
+    MessageType_KtoU_NotifyFileDeleted,
+    MessageType_KtoU_NotifyFileRenamed,
+    MessageType_KtoU_NotifyDirectoryRenamed,
+    
+    // Sent (rate-limited, without waiting for a response) before the first
+    // hydration in a directory, which usually means its siblings are about to be
+    // read as well; the path is the directory's. Only while the provider has set
+    // a prefetch hint interval.
+    MessageType_KtoU_PrefetchHint,
+    
+    // Sent, without a path and without waiting for a response, when every
+    // thread waiting on an EnumerateDirectory or HydrateFile request has given
+    // up (e.g. was interrupted by a signal) before the provider responded. The
+    // message id and file are the request's; it follows the request on the
+    // same queue. Any response to the request is ignored from then on. Only
+    // once ProviderCapability_CancelMessages is negotiated.
+    MessageType_KtoU_Cancel,
+    
     // Responses
     MessageType_Response_Success,
     MessageType_Response_Fail,
     
+    // Interim response to a hydration request whose contents are still being
+    // written. Restarts the request's timeout; the requester keeps waiting for
+    // the final response.
+    MessageType_Response_Progress,
+    
+    // Not a message type; number of values above, for sizing per-type tables
+    MessageType_Count
+    
 } MessageType;
 
+typedef enum
+{
+    MessageFileType_Unknown = 0,
+    MessageFileType_File,
+    MessageFileType_Directory,
+    
+} MessageFileType;
+
 struct MessageHeader
 {
     // The message id is used to correlate a response to its request
@@ -32,10 +88,37 @@ struct MessageHeader
     
     // For messages from kernel to user mode, indicates the PID of the process that initiated the I/O
     int32_t             pid;
+    
+    // For messages from kernel to user mode, the id of the thread that initiated the I/O, as
+    // thread_tid reports it, so that user mode can look up its QoS and handle the request at
+    // a matching priority. Cancel messages carry their request's.
+    uint64_t            threadId;
+    
+    // For messages from kernel to user mode, identifies the file or directory the request is
+    // about, so that user mode can open it without resolving the path again. fileId is 0 if
+    // the kernel could not determine it.
+    fsid_t              fsid;
+    uint64_t            fileId;
+    
+    // For EnumerateDirectory and HydrateFile requests, the placeholder's type and size
+    // in bytes as the kernel saw them, so that user mode can choose how to handle the
+    // request without a stat. MessageFileType_Unknown (and a size of 0) for other messages.
+    uint64_t            fileSize;
+    uint32_t            fileType; // values of type MessageFileType
+    
     char                procname[MAXCOMLEN + 1];
 
     // Size of the flexible-length, nul-terminated path following the message body, including the nul character.
     uint16_t            pathSizeBytes;
+    
+    // For rename notifications, size of the previous path, which follows the path; 0 for all
+    // other messages. An empty string if the item was moved in from outside the root.
+    uint16_t            fromPathSizeBytes;
+    
+    // For EnumerateDirectory and HydrateFile requests, size of the placeholder's
+    // PrjFSFileXAttrName xattr, which follows the paths as the kernel read it (in
+    // either format); 0 if it has none or the kernel could not read it.
+    uint16_t            fileXattrSizeBytes;
 };
 
 // Description of a decomposed, in-memory message header plus variable length string field
@@ -43,6 +126,8 @@ struct Message
 {
     const MessageHeader* messageHeader;
     const char*    path;
+    const char*    fromPath;
+    const void*    fileXattr;
 };
 
 void Message_Init(
@@ -52,6 +137,19 @@ void Message_Init(
     MessageType messageType,
     int32_t pid,
     const char* procname,
-    const char* path);
+    fsid_t fsid,
+    uint64_t fileId,
+    const char* path,
+    const char* fromPath);
+
+// For requests about a placeholder, see MessageHeader::fileSize and fileXattrSizeBytes.
+// fileXattr must stay valid until the message has been sent.
+void Message_SetPlaceholderInfo(
+    Message* spec,
+    MessageHeader* header,
+    MessageFileType fileType,
+    uint64_t fileSize,
+    const void* fileXattr,
+    uint16_t fileXattrSizeBytes);
 
 #endif /* Message_h */
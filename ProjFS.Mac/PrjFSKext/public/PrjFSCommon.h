@@ -11,9 +11,22 @@
 #define PrjFSServiceClass       "io_gvfs_PrjFS"
 
 // TODO: move this to an autogenerated header.
-#define PrjFSKextVersion "0.1"
+// <major>.<minor>; user space connects to any kext with the same major version.
+// Only incompatible changes to the basic protocol bump the major version, features
+// added since are negotiated (see ProviderSelector_NegotiateCapabilities).
+#define PrjFSKextVersion "0.3"
 // Name of property on the main PrjFS IOService indicating the kext version, to be checked by user space
 #define PrjFSKextVersionKey "io.gvfs.PrjFSKext.Version"
+// Name of property on the main PrjFS IOService holding the ProviderCapabilityFlags
+// the kext supports, for tools to inspect without connecting
+#define PrjFSKextCapabilitiesKey "io.gvfs.PrjFSKext.Capabilities"
+// Name of property on each provider user client holding a dictionary of request
+// counters for its virtualization root, refreshed whenever the registry is read
+#define PrjFSProviderStatisticsKey "io.gvfs.PrjFSKext.ProviderStatistics"
+// Name of property on the main PrjFS IOService holding a dictionary of kext
+// heap, zone allocator and per-subsystem wired memory usage (see
+// KernelMemorySubsystem), refreshed whenever the registry is read
+#define PrjFSMemoryStatisticsKey "io.gvfs.PrjFSKext.MemoryStatistics"
 
 typedef enum
 {
@@ -24,6 +37,26 @@ typedef enum
     
 } FileFlags;
 
+// Codes of the kdebug signposts (kdebug_signpost_start/end) marking the stages
+// of a request, which Instruments shows as Points of Interest intervals. The
+// kext emits the same events as user space, so their codes must not overlap.
+typedef enum
+{
+    PrjFSSignpost_Invalid = 0,
+    
+    // Kext: arg1 is the kauth action, arg2 the kauth result at the end
+    PrjFSSignpost_HandleVnodeOperation  = 0x1000,
+    // Kext: from sending (or joining) a request until its response; arg1 is the message ID
+    PrjFSSignpost_WaitForResponse       = 0x1001,
+    
+    // PrjFSLib: arg1 is the message ID
+    PrjFSSignpost_DequeueMessage        = 0x1010,
+    PrjFSSignpost_Callback              = 0x1011,
+    // PrjFSLib: arg1 is the first message ID answered, arg2 the number of responses
+    PrjFSSignpost_SendResponses         = 0x1012,
+    
+} PrjFSSignpostCode;
+
 // User client types to be passed to IOServiceOpen.
 enum PrjFSServiceUserClientType
 {
@@ -2,6 +2,17 @@
 
 #include <stdint.h>
 
+// External method selectors for log user clients
+enum PrjFSLogUserClientSelector
+{
+    LogSelector_Invalid = 0,
+    
+    LogSelector_SetLevelMask,
+    LogSelector_SetMessageQueueCapacity,
+    LogSelector_GetLockProfiles,
+    LogSelector_GetProcessAttributions,
+};
+
 enum PrjFSLogUserClientMemoryType
 {
     LogMemoryType_Invalid = 0,
@@ -21,13 +32,26 @@ enum KextLog_Level : uint32_t
     KEXTLOG_ERROR = 0,
     KEXTLOG_INFO = 1,
     KEXTLOG_NOTE,
+    // Binary trace events (KextLog_TraceEvent) rather than text
+    KEXTLOG_TRACE,
 };
 
+// Bits for LogSelector_SetLevelMask; messages of levels not in the mask are
+// discarded before any work is done to produce them.
+#define KextLog_LevelMaskBit(level) (1u << (level))
+static const uint32_t KextLog_DefaultLevelMask =
+    KextLog_LevelMaskBit(KEXTLOG_ERROR) | KextLog_LevelMaskBit(KEXTLOG_INFO) | KextLog_LevelMaskBit(KEXTLOG_NOTE);
+
 struct KextLog_MessageHeader
 {
     uint32_t flags;
     KextLog_Level level;
     uint64_t machAbsoluteTimestamp;
+    // If LogMessageFlag_LogMessagesDropped is set, the number and total size of
+    // messages which did not fit in the queue since the previous delivered one
+    uint32_t droppedMessageCount;
+    uint32_t reserved;
+    uint64_t droppedByteCount;
     char logString[0];
 };
 
@@ -37,3 +61,91 @@ enum KextLog_MessageFlag
     LogMessageFlag_LogMessageTruncated = 0x2,
 };
 
+enum KextLog_TraceEventId : uint32_t
+{
+    KextLog_TraceEvent_Invalid = 0,
+    
+    // args: message id, MessageType, root index, pid; string: relative path
+    KextLog_TraceEvent_RequestSent,
+    // args: message id, MessageType, root index, KextLog_TraceRequestOutcome
+    KextLog_TraceEvent_RequestCompleted,
+};
+
+enum KextLog_TraceRequestOutcome : uint64_t
+{
+    TraceRequestOutcome_Success = 0,
+    TraceRequestOutcome_Fail,
+    TraceRequestOutcome_TimedOut,
+    TraceRequestOutcome_ProviderDisconnected,
+    TraceRequestOutcome_Interrupted,
+};
+
+// Follows the KextLog_MessageHeader of KEXTLOG_TRACE messages in place of the
+// log string. The string is null-terminated (empty if the event has none); if
+// LogMessageFlag_LogMessageTruncated is set, only its end was kept.
+struct KextLog_TraceEvent
+{
+    KextLog_TraceEventId eventId;
+    uint32_t reserved;
+    uint64_t args[4];
+    char string[0];
+};
+
+// Wait and hold time totals for one class of kext locks, since the kext was
+// loaded. Hold times of shared acquisitions are included in the total.
+struct KextLog_LockProfile
+{
+    char name[32];
+    uint64_t acquireCount;
+    // Acquisitions which found the lock held and had to wait for it
+    uint64_t contendedCount;
+    uint64_t totalWaitNanoseconds;
+    uint64_t maxWaitNanoseconds;
+    uint64_t totalHoldNanoseconds;
+};
+
+static const uint32_t KextLog_MaxLockProfiles = 16;
+
+// Structure output of LogSelector_GetLockProfiles, which fails with
+// kIOReturnUnsupported unless the kext was built with lock profiling.
+struct KextLog_LockProfiles
+{
+    uint32_t profileCount;
+    uint32_t reserved;
+    KextLog_LockProfile profiles[KextLog_MaxLockProfiles];
+};
+
+// Enumeration and hydration requests caused by one process in one
+// virtualization root, since the kext was loaded or since the entry was
+// (re-)created after an eviction
+struct KextLog_ProcessAttribution
+{
+    char procname[32];
+    // -1 for the totals of evicted entries
+    int32_t rootIndex;
+    uint32_t reserved;
+    // Requests sent to the provider on behalf of the process
+    uint64_t hydrationCount;
+    uint64_t enumerationCount;
+    // Sizes of the files whose hydration the provider reported as successful
+    uint64_t hydratedBytes;
+    // Every wait of the process's threads for a response, including waits on
+    // requests that another thread had already sent
+    uint64_t waitCount;
+    uint64_t totalWaitNanoseconds;
+};
+
+static const uint32_t KextLog_MaxProcessAttributions = 48;
+
+// Structure output of LogSelector_GetProcessAttributions
+struct KextLog_ProcessAttributions
+{
+    uint32_t entryCount;
+    uint32_t reserved;
+    // Entries evicted to make room for new ones, and the sum of their counts
+    uint64_t evictedCount;
+    KextLog_ProcessAttribution evicted;
+    KextLog_ProcessAttribution entries[KextLog_MaxProcessAttributions];
+};
+
+static_assert(sizeof(KextLog_ProcessAttributions) <= 4096, "Must stay within the size IOKit passes inline (without a memory descriptor)");
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdint.h>
+#include <sys/param.h>
+#include <sys/_types/_fsid_t.h>
+
 // External method selectors for provider user clients
 enum PrjFSProviderUserClientSelector
 {
@@ -7,18 +11,283 @@ enum PrjFSProviderUserClientSelector
     
     ProviderSelector_RegisterVirtualizationRootPath,
     ProviderSelector_KernelMessageResponse,
+    ProviderSelector_SetRequestTimeout,
+    ProviderSelector_SetMessageQueueCapacity,
+    ProviderSelector_MessageQueueDrained,
+    ProviderSelector_KernelMessageResponseBatch,
+    ProviderSelector_SetProcessPolicies,
+    ProviderSelector_SetNotificationMappings,
+    ProviderSelector_DrainModifiedFiles,
+    ProviderSelector_SetPrefetchHintInterval,
+    ProviderSelector_ReattachVirtualizationRoot,
+    ProviderSelector_ResponseRingDoorbell,
+    ProviderSelector_SetMessageQueueCount,
+    ProviderSelector_SetHelperProcesses,
+    ProviderSelector_SetRequestRateLimit,
+    ProviderSelector_NegotiateCapabilities,
+    ProviderSelector_SetMemoryBudget,
+    ProviderSelector_FileFlagsChanged,
+};
+
+// Optional features of the provider protocol. User space passes the ones it
+// knows to ProviderSelector_NegotiateCapabilities, which returns those the kext
+// supports as well, and only uses those. The selectors and messages that
+// belong to a feature may fail or be ignored unless it was negotiated. Kexts
+// that predate negotiation support none of them as far as user space is
+// concerned.
+enum ProviderCapabilityFlags : uint64_t
+{
+    ProviderCapability_None                         = 0,
+    
+    // ProviderSelector_KernelMessageResponseBatch
+    ProviderCapability_KernelMessageResponseBatch   = 0x00000001,
+    // ProviderMemoryType_ResponseRing and ProviderSelector_ResponseRingDoorbell
+    ProviderCapability_ResponseRing                 = 0x00000002,
+    // ProviderSelector_SetMessageQueueCount
+    ProviderCapability_MultipleMessageQueues        = 0x00000004,
+    // ProviderSelector_ReattachVirtualizationRoot
+    ProviderCapability_ReattachVirtualizationRoot   = 0x00000008,
+    // ProviderSelector_SetPrefetchHintInterval and MessageType_KtoU_PrefetchHint
+    ProviderCapability_PrefetchHints                = 0x00000010,
+    // ProviderSelector_SetHelperProcesses
+    ProviderCapability_HelperProcesses              = 0x00000020,
+    // ProviderSelector_SetRequestRateLimit
+    ProviderCapability_RequestRateLimit             = 0x00000040,
+    // MessageType_Response_Progress
+    ProviderCapability_ResponseProgress             = 0x00000080,
+    // MessageType_KtoU_Cancel
+    ProviderCapability_CancelMessages               = 0x00000100,
+    // ProviderRoot_SkipOverwriteHydration and MessageType_KtoU_ConvertFileToFull
+    ProviderCapability_ConvertFileToFull            = 0x00000200,
+    // ProviderSelector_SetMemoryBudget
+    ProviderCapability_MemoryBudgets                = 0x00000400,
+    // ProviderSelector_FileFlagsChanged
+    ProviderCapability_FileFlagsChanged             = 0x00000800,
+    
+    ProviderCapability_All                          = 0x00000fff,
+};
+
+// Messages are spread over up to this many queues (see
+// ProviderSelector_SetMessageQueueCount), by a hash of the file id they are
+// about, so that messages about one file stay in order. Each queue has its own
+// memory (ProviderMemoryType_MessageQueue + queue index) and notification port
+// (ProviderPortType_MessageQueue + queue index), and user space passes the
+// queue index to ProviderSelector_MessageQueueDrained.
+static const uint32_t MaxProviderMessageQueues = 8;
+
+// Scalar input for ProviderSelector_RegisterVirtualizationRootPath and
+// ProviderSelector_ReattachVirtualizationRoot; they apply while the provider
+// stays attached.
+enum ProviderRootFlags : uint32_t
+{
+    ProviderRoot_None               = 0,
+    
+    // Processes other than the provider may not write, create, rename or delete
+    // anything in the root; the kext denies that without asking the provider.
+    ProviderRoot_ReadOnly           = 0x00000001,
+    
+    // Reading the attributes or security of an empty directory doesn't have it
+    // enumerated; only listing and searching it do.
+    ProviderRoot_AttributeOnlyDirectoryReads    = 0x00000002,
+    
+    // While the provider is unresponsive, the root is treated as offline instead
+    // of failing the requests that would have to go to the provider with ETIMEDOUT.
+    // The provider is unresponsive once one of the kext's requests has gone
+    // unanswered for 10 seconds without any response from the provider meanwhile,
+    // and until its next response.
+    ProviderRoot_OfflineWhenUnresponsive        = 0x00000004,
+    
+    // Accesses that only write an empty 0 byte file (e.g. an open with O_WRONLY)
+    // don't wait for a request: once the open has happened, the file is converted
+    // with MessageType_KtoU_ConvertFileToFull. Files with contents are hydrated
+    // first as usual, as the open can't be denied any more by then.
+    ProviderRoot_SkipOverwriteHydration         = 0x00000008,
+    
+    ProviderRoot_All                = 0x0000000f,
 };
 
+// Structure input for ProviderSelector_ReattachVirtualizationRoot: the root
+// directory's mount fsid (statfs f_fsid) and inode, and the token from its
+// virtualization root xattr
+struct VirtualizationRootIdentity
+{
+    fsid_t   fsid;
+    uint64_t inode;
+    uint64_t rootToken;
+};
+
+// Structure input element for ProviderSelector_KernelMessageResponseBatch
+struct KernelMessageResponse
+{
+    uint64_t messageId;
+    uint32_t responseType; // values of type MessageType
+    uint32_t reserved;
+};
+
+// Keeps the batch within the size IOKit passes inline (without a memory descriptor)
+static const uint32_t MaxKernelMessageResponsesPerBatch = 4096 / sizeof(KernelMessageResponse);
+
+// Layout of ProviderMemoryType_ResponseRing, through which user space can pass
+// responses without a call into the kernel for each. User space appends entries
+// at tail and is the only writer of tail; the kext consumes them at head and is
+// the only writer of head. Both only increase, wrapping at 2^32, and index the
+// entries modulo ResponseRingCapacity.
+//
+// The kext drains the ring on ProviderSelector_ResponseRingDoorbell and when a
+// request it was waiting on times out. After appending, user space only rings
+// the doorbell if it atomically changes doorbellArmed from 1 to 0; the kext sets
+// it back to 1 once it has emptied the ring, so responses added while a drain is
+// underway are picked up by that drain.
+static const uint32_t ResponseRingCapacity = 1024;
+
+struct ResponseRing
+{
+    // head and tail are on separate cache lines so that producer and consumer
+    // don't contend on them
+    uint32_t head;
+    uint32_t reserved0[15];
+    uint32_t tail;
+    uint32_t doorbellArmed;
+    uint32_t reserved1[14];
+    KernelMessageResponse entries[ResponseRingCapacity];
+};
+
+enum ProcessPolicyFlags : uint32_t
+{
+    ProcessPolicy_None              = 0,
+    
+    // Access to empty placeholders is denied rather than triggering hydration
+    // or enumeration (file system crawlers, backup agents, etc.)
+    ProcessPolicy_DenyHydration     = 0x00000001,
+    
+    // Enumerating an empty directory expands its whole subtree in one request,
+    // for processes that walk trees (find, grep -r, build systems)
+    ProcessPolicy_EnumerateRecursively = 0x00000002,
+    
+    ProcessPolicy_All               = 0x00000003,
+};
+
+// Structure input element for ProviderSelector_SetProcessPolicies
+struct ProcessPolicyEntry
+{
+    char processName[MAXCOMLEN + 1]; // null-terminated
+    uint8_t reserved[3];
+    uint32_t policyFlags; // ProcessPolicyFlags
+};
+
+static const uint32_t MaxProcessPolicyEntries = 4096 / sizeof(ProcessPolicyEntry);
+
+// Operations the provider can be notified about
+enum ProviderNotificationFlags : uint32_t
+{
+    ProviderNotification_None               = 0,
+    
+    ProviderNotification_NewFileCreated     = 0x00000001,
+    ProviderNotification_PreDelete          = 0x00000002,
+    ProviderNotification_FileRenamed        = 0x00000004,
+    ProviderNotification_FileModified       = 0x00000008,
+    ProviderNotification_FileDeleted        = 0x00000010,
+    // Not a message: files closed after being written are added to the root's
+    // set of modified files, see ProviderSelector_DrainModifiedFiles
+    ProviderNotification_RecordModifiedFile = 0x00000020,
+    
+    ProviderNotification_All                = 0x0000003f,
+};
+
+// The structure input for ProviderSelector_SetNotificationMappings is a sequence of
+// these, each followed by its nul-terminated root-relative path ("" for the whole
+// root) and padded to NotificationMappingEntry_GetSize() bytes. A path gets the
+// flags of the longest mapping that contains it, so subtrees can be excluded by
+// mapping them to ProviderNotification_None. Paths no mapping contains get none.
+struct NotificationMappingEntry
+{
+    uint32_t notificationFlags; // ProviderNotificationFlags
+    uint16_t pathSizeBytes; // including the nul character
+    uint16_t reserved;
+};
+
+// Keeps the mappings within the size IOKit passes inline (without a memory descriptor)
+static const uint32_t MaxNotificationMappingsSizeBytes = 4096;
+
+static inline uint32_t NotificationMappingEntry_GetSize(uint16_t pathSizeBytes)
+{
+    return (sizeof(NotificationMappingEntry) + pathSizeBytes + 3) & ~3u;
+}
+
+// Structure output element for ProviderSelector_DrainModifiedFiles, which
+// removes up to MaxModifiedFileEntriesPerDrain entries from the root's set of
+// modified files. Its scalar outputs are the number of entries still in the set
+// and whether entries were lost because the set was full (since the last drain
+// that reported it), in which case every file must be assumed modified.
+struct ModifiedFileEntry
+{
+    fsid_t fsid;
+    uint64_t inode;
+};
+
+static const uint32_t MaxModifiedFileEntriesPerDrain = 4096 / sizeof(ModifiedFileEntry);
+
+// Structure input for ProviderSelector_SetHelperProcesses: up to this many pids
+// (int32_t) of processes working on the provider's behalf, e.g. ones writing
+// hydrated contents, which the kext exempts just like the provider itself. The
+// scalar input is a process group whose members are also exempt, 0 for none.
+// Each call replaces the previous helpers; they are dropped when the provider
+// disconnects.
+static const uint32_t MaxProviderHelperProcesses = 64;
+
+// The kext's wired memory is accounted to these subsystems, each of which may be
+// given a budget in bytes that its allocations fail rather than exceed. Scalar
+// inputs for ProviderSelector_SetMemoryBudget are the subsystem and the budget,
+// 0 for none. Budgets apply to the whole kext, not just the caller's root, so
+// each has a single owner: the provider that set it, until it disconnects and
+// the default is restored. Meanwhile other providers get EBUSY. Lowering a
+// budget below the current usage only stops growth.
+enum KernelMemorySubsystem : uint32_t
+{
+    // Root records, the root index and each root's notification mappings and
+    // set of modified files
+    KernelMemory_VirtualizationRoots,
+    KernelMemory_ProcessPolicies,
+    // Log messages too long for the stack, and the log client's queue
+    KernelMemory_Logging,
+    // Slabs of the path buffer and request record zones
+    KernelMemory_Zones,
+    // Providers' message queues and response rings
+    KernelMemory_MessageQueues,
+    
+    KernelMemory_Count
+};
+
+// Scalar inputs for ProviderSelector_SetRequestRateLimit, which gives each process
+// a token bucket for the hydration and enumeration requests it causes in the root:
+// the rate at which tokens are added (per second), the bucket's size (at least 1),
+// and how long a process that has run out may be held back until its next token
+// is due, in milliseconds. Operations that would have to wait longer are denied
+// with EAGAIN without asking the provider; with 0 they are denied straight away.
+// A rate of 0 removes the limit, which is where each provider starts.
+// The delay ties up the kauth thread, so it may be at most this long:
+static const uint32_t MaxRequestRateLimitDelayMilliseconds = 10000;
+
+// Scalar input for ProviderSelector_FileFlagsChanged: a file descriptor of the
+// calling process, for a file or directory whose FileFlags it has just changed.
+// The kext caches the flags of vnodes in roots and can't tell when a change it
+// authorized has landed, so providers call this afterwards, at least for files
+// that may have become empty again.
+
 enum PrjFSProviderUserClientMemoryType
 {
     ProviderMemoryType_Invalid = 0,
     
-    ProviderMemoryType_MessageQueue,
+    ProviderMemoryType_ResponseRing,
+    
+    // First of MaxProviderMessageQueues values
+    ProviderMemoryType_MessageQueue = 0x100,
 };
 
 enum PrjFSProviderUserClientPortType
 {
     ProviderPortType_Invalid = 0,
     
+    // First of MaxProviderMessageQueues values
     ProviderPortType_MessageQueue,
 };
@@ -5,11 +5,16 @@
 
 #define PrjFSVirtualizationRootXAttrName "io.gvfs.xattr.virtualizationroot"
 #define PrjFSFileXAttrName "io.gvfs.xattr.file"
+#define PrjFSHydratedFileXAttrName "io.gvfs.xattr.hydrated"
 
 #define PrjFS_PlaceholderIdLength 128
 
 static const int32_t PlaceholderMagicNumber = 0x12345678;
-static const int32_t PlaceholderFormatVersion = 1;
+
+// Version 1 file xattrs are a PrjFSFileXAttrData; from version 2 they are a
+// PrjFSFileXAttrCompactData. Root xattrs are the same in both.
+static const int32_t PlaceholderFormatVersion_FixedLengthIds = 1;
+static const int32_t PlaceholderFormatVersion = 2;
 
 struct PrjFSXattrHeader
 {
@@ -20,6 +25,11 @@ struct PrjFSXattrHeader
 struct PrjFSVirtualizationRootXAttrData
 {
     PrjFSXattrHeader header;
+    
+    // Random and non-zero, chosen when the directory becomes a root, so that a
+    // provider can reattach to the kext's record of the root without a path
+    // lookup. Xattrs written before tokens existed end after the header.
+    uint64_t rootToken;
 };
 
 struct PrjFSFileXAttrData
@@ -29,3 +39,29 @@ struct PrjFSFileXAttrData
     unsigned char providerId[PrjFS_PlaceholderIdLength];
     unsigned char contentId[PrjFS_PlaceholderIdLength];
 };
+
+// Ids are stored without their trailing zero bytes, which come back when they are
+// read into a PrjFSFileXAttrData. Only the used part of ids is written, so the
+// xattr is offsetof(PrjFSFileXAttrCompactData, ids) + providerIdLength + contentIdLength bytes.
+struct PrjFSFileXAttrCompactData
+{
+    PrjFSXattrHeader header;
+    
+    uint8_t providerIdLength;
+    uint8_t contentIdLength;
+    
+    // The provider id immediately followed by the content id
+    unsigned char ids[2 * PrjFS_PlaceholderIdLength];
+};
+
+// Written by the provider once it has hydrated a placeholder. A file whose
+// modification time and size still match has not been written since, so its
+// contents can be dropped and fetched again.
+struct PrjFSHydratedFileXAttrData
+{
+    PrjFSXattrHeader header;
+    
+    int64_t modificationTimeSeconds;
+    int64_t modificationTimeNanoseconds;
+    int64_t fileSize;
+};
@@ -4,12 +4,38 @@ using System.Runtime.InteropServices;
 namespace PrjFSLib.Mac
 {
     // Callbacks
+
+    // providerId and contentId are all zero unless the directory was written with ids
     public delegate Result EnumerateDirectoryCallback(
         ulong commandId,
         string relativePath,
+
+        [MarshalAs(UnmanagedType.LPArray, SizeConst = Interop.PrjFSLib.PlaceholderIdLength)]
+        byte[] providerId,
+
+        [MarshalAs(UnmanagedType.LPArray, SizeConst = Interop.PrjFSLib.PlaceholderIdLength)]
+        byte[] contentId,
+
         int triggeringProcessId,
         string triggeringProcessName);
 
+    // entries points to entryCapacity DirectoryEntry structs owned by PrjFSLib
+    public delegate Result EnumerateDirectoryBulkCallback(
+        ulong commandId,
+        string relativePath,
+
+        [MarshalAs(UnmanagedType.LPArray, SizeConst = Interop.PrjFSLib.PlaceholderIdLength)]
+        byte[] providerId,
+
+        [MarshalAs(UnmanagedType.LPArray, SizeConst = Interop.PrjFSLib.PlaceholderIdLength)]
+        byte[] contentId,
+
+        int triggeringProcessId,
+        string triggeringProcessName,
+        IntPtr entries,
+        uint entryCapacity,
+        out uint entryCount);
+
     public delegate Result GetFileStreamCallback(
         ulong commandId,
         string relativePath,
@@ -24,6 +50,15 @@ namespace PrjFSLib.Mac
         string triggeringProcessName,
         IntPtr fileHandle);
 
+    public delegate void PrefetchHintCallback(
+        string directoryRelativePath,
+        int triggeringProcessId,
+        string triggeringProcessName);
+
+    // Called on PrjFSLib's message thread, so it must return quickly
+    public delegate void CancelCommandCallback(
+        ulong commandId);
+
     // Pre-event notifications
     public delegate Result NotifyPreDeleteEvent(
         string relativePath,
@@ -0,0 +1,63 @@
+﻿using System;
+using System.Runtime.InteropServices;
+using System.Text;
+
+namespace PrjFSLib.Mac
+{
+    // Layout of PrjFS_DirectoryEntry, filled in by EnumerateDirectoryBulkCallback
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct DirectoryEntry
+    {
+        public const int MaxNameLength = 255;
+
+        public fixed byte Name[MaxNameLength + 1];
+        public fixed byte ProviderId[Interop.PrjFSLib.PlaceholderIdLength];
+        public fixed byte ContentId[Interop.PrjFSLib.PlaceholderIdLength];
+        public ulong FileSize;
+        public ushort FileMode;
+        public byte IsDirectory;
+
+        // Stores an entry in the buffer passed to EnumerateDirectoryBulkCallback
+        // without any further allocations. The ids are optional for directories.
+        public static void Write(
+            IntPtr entries,
+            uint index,
+            string name,
+            bool isDirectory,
+            byte[] providerId,
+            byte[] contentId,
+            ulong fileSize,
+            ushort fileMode)
+        {
+            DirectoryEntry* entry = (DirectoryEntry*)entries + index;
+
+            fixed (char* nameChars = name)
+            {
+                int nameLength = Encoding.UTF8.GetBytes(nameChars, name.Length, entry->Name, MaxNameLength);
+                entry->Name[nameLength] = 0;
+            }
+
+            entry->IsDirectory = isDirectory ? (byte)1 : (byte)0;
+            if (isDirectory && providerId == null && contentId == null)
+            {
+                return;
+            }
+
+            if (providerId.Length != Interop.PrjFSLib.PlaceholderIdLength ||
+                contentId.Length != Interop.PrjFSLib.PlaceholderIdLength)
+            {
+                throw new ArgumentException();
+            }
+
+            Marshal.Copy(providerId, 0, (IntPtr)entry->ProviderId, providerId.Length);
+            Marshal.Copy(contentId, 0, (IntPtr)entry->ContentId, contentId.Length);
+            if (isDirectory)
+            {
+                return;
+            }
+
+            entry->FileSize = fileSize;
+            entry->FileMode = fileMode;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+﻿using System;
+
+namespace PrjFSLib.Mac
+{
+    [Flags]
+    public enum InstanceFlags : uint
+    {
+        None            = 0x00000000,
+
+        ReadOnly                    = 0x00000001,
+        AttributeOnlyDirectoryReads = 0x00000002,
+        OfflineWhenUnresponsive     = 0x00000004,
+        SkipOverwriteHydration      = 0x00000008,
+    }
+}
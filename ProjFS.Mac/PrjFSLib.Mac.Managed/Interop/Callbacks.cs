@@ -8,5 +8,8 @@ namespace PrjFSLib.Mac.Interop
         public EnumerateDirectoryCallback OnEnumerateDirectory;
         public GetFileStreamCallback OnGetFileStream;
         public NotifyPreDeleteEvent OnNotifyPreDelete;
+        public PrefetchHintCallback OnPrefetchHint;
+        public EnumerateDirectoryBulkCallback OnEnumerateDirectoryBulk;
+        public CancelCommandCallback OnCancelCommand;
     }
 }
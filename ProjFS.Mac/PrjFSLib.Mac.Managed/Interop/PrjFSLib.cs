@@ -12,18 +12,45 @@ namespace PrjFSLib.Mac.Interop
         public static extern Result StartVirtualizationInstance(
             string virtualizationRootFullPath,
             Callbacks callbacks,
-            uint poolThreadCount);
+            uint poolThreadCount,
+            InstanceFlags flags,
+            out IntPtr instance);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_StopVirtualizationInstance")]
+        public static extern Result StopVirtualizationInstance(
+            IntPtr instance,
+            uint drainTimeoutMilliseconds);
 
         [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_ConvertDirectoryToVirtualizationRoot")]
         public static extern Result ConvertDirectoryToVirtualizationRoot(
             string virtualizationRootFullPath);
 
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_ConvertDirectoryToPlaceholder")]
+        public static extern Result ConvertDirectoryToPlaceholder(
+            IntPtr instance,
+            string relativePath,
+            IntPtr callback,
+            IntPtr callbackContext);
+
         [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_WritePlaceholderDirectory")]
         public static extern Result WritePlaceholderDirectory(
+            IntPtr instance,
             string relativePath);
 
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_WritePlaceholderDirectoryWithIds")]
+        public static extern Result WritePlaceholderDirectoryWithIds(
+            IntPtr instance,
+            string relativePath,
+
+            [MarshalAs(UnmanagedType.LPArray, SizeConst = PlaceholderIdLength)]
+            byte[] providerId,
+
+            [MarshalAs(UnmanagedType.LPArray, SizeConst = PlaceholderIdLength)]
+            byte[] contentId);
+
         [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_WritePlaceholderFile")]
         public static extern Result WritePlaceholderFile(
+            IntPtr instance,
             string relativePath,
         
             [MarshalAs(UnmanagedType.LPArray, SizeConst = PlaceholderIdLength)]
@@ -40,5 +67,43 @@ namespace PrjFSLib.Mac.Interop
             IntPtr fileHandle,
             IntPtr bytes,
             uint byteCount);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_MapFileContents")]
+        public static extern Result MapFileContents(
+            IntPtr fileHandle,
+            ulong offset,
+            uint byteCount,
+            out IntPtr buffer);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_CommitMappedFileContents")]
+        public static extern Result CommitMappedFileContents(
+            IntPtr fileHandle);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_UpdatePlaceholderFileIfNeeded")]
+        public static extern Result UpdatePlaceholderFileIfNeeded(
+            IntPtr instance,
+            string relativePath,
+
+            [MarshalAs(UnmanagedType.LPArray, SizeConst = PlaceholderIdLength)]
+            byte[] providerId,
+
+            [MarshalAs(UnmanagedType.LPArray, SizeConst = PlaceholderIdLength)]
+            byte[] contentId,
+
+            ulong fileSize,
+            UpdateType updateFlags,
+            out UpdateFailureCause failureCause);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_DeleteFile")]
+        public static extern Result DeleteFile(
+            IntPtr instance,
+            string relativePath,
+            UpdateType updateFlags,
+            out UpdateFailureCause failureCause);
+
+        [DllImport(PrjFSLibPath, EntryPoint = "PrjFS_CompleteCommand")]
+        public static extern Result CompleteCommand(
+            ulong commandId,
+            Result result);
     }
 }
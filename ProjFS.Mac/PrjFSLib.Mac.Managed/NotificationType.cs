@@ -13,8 +13,10 @@ namespace PrjFSLib.Mac
         FileRenamed         = 0x00000080,
         PreConvertToFull    = 0x00001000,
 
-        PreModify           = 0x10000001,
-        FileModified        = 0x10000002,
-        FileDeleted         = 0x10000004,
+        FileModified        = 0x00000400,
+        FileDeleted         = 0x00000800,
+        PreModify           = 0x10000000,
+
+        RecordModifiedFiles = 0x20000000,
     }
 }
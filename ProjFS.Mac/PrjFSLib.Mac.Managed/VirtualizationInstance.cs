@@ -6,29 +6,49 @@ namespace PrjFSLib.Mac
     public class VirtualizationInstance
     {
         public const int PlaceholderIdLength = Interop.PrjFSLib.PlaceholderIdLength;
+
+        // How long stopping waits for running callbacks and pending commands to complete
+        public const uint StopDrainTimeoutMilliseconds = 5000;
+
+        // Set by PrjFSLib before it starts invoking callbacks, which may already use it
+        private IntPtr instance;
         
         public virtual EnumerateDirectoryCallback OnEnumerateDirectory { get; set; }
         public virtual GetFileStreamCallback OnGetFileStream { get; set; }
+        public virtual PrefetchHintCallback OnPrefetchHint { get; set; }
+        public virtual EnumerateDirectoryBulkCallback OnEnumerateDirectoryBulk { get; set; }
+        public virtual CancelCommandCallback OnCancelCommand { get; set; }
 
         public virtual Result StartVirtualizationInstance(
             string virtualizationRootFullPath,
-            uint poolThreadCount)
+            uint poolThreadCount,
+            InstanceFlags flags = InstanceFlags.None)
         {
             Interop.Callbacks callbacks = new Interop.Callbacks
             {
                 OnEnumerateDirectory = this.OnEnumerateDirectory,
                 OnGetFileStream = this.OnGetFileStream,
+                OnPrefetchHint = this.OnPrefetchHint,
+                OnEnumerateDirectoryBulk = this.OnEnumerateDirectoryBulk,
+                OnCancelCommand = this.OnCancelCommand,
             };
             
             return Interop.PrjFSLib.StartVirtualizationInstance(
                 virtualizationRootFullPath,
                 callbacks,
-                poolThreadCount);
+                poolThreadCount,
+                flags,
+                out this.instance);
         }
 
         public virtual Result StopVirtualizationInstance()
         {
-            throw new NotImplementedException();
+            Result result = Interop.PrjFSLib.StopVirtualizationInstance(
+                this.instance,
+                StopDrainTimeoutMilliseconds);
+            
+            this.instance = IntPtr.Zero;
+            return result;
         }
 
         public virtual Result WriteFileContents(
@@ -50,18 +70,50 @@ namespace PrjFSLib.Mac
             }
         }
 
+        // The buffer is the file's own memory, so providers can decompress straight
+        // into it (e.g. through an UnmanagedMemoryStream) without a managed copy
+        public virtual Result MapFileContents(
+            IntPtr fileHandle,
+            ulong offset,
+            uint byteCount,
+            out IntPtr buffer)
+        {
+            return Interop.PrjFSLib.MapFileContents(fileHandle, offset, byteCount, out buffer);
+        }
+
+        public virtual Result CommitMappedFileContents(
+            IntPtr fileHandle)
+        {
+            return Interop.PrjFSLib.CommitMappedFileContents(fileHandle);
+        }
+
         public virtual Result DeleteFile(
             string relativePath,
             UpdateType updateFlags,
             out UpdateFailureCause failureCause)
         {
-            throw new NotImplementedException();
+            return Interop.PrjFSLib.DeleteFile(this.instance, relativePath, updateFlags, out failureCause);
         }
 
         public virtual Result WritePlaceholderDirectory(
             string relativePath)
         {
-            return Interop.PrjFSLib.WritePlaceholderDirectory(relativePath);
+            return Interop.PrjFSLib.WritePlaceholderDirectory(this.instance, relativePath);
+        }
+
+        // The ids are passed to OnEnumerateDirectory(Bulk) when the directory is enumerated
+        public virtual Result WritePlaceholderDirectory(
+            string relativePath,
+            byte[] providerId,
+            byte[] contentId)
+        {
+            if (providerId.Length != Interop.PrjFSLib.PlaceholderIdLength ||
+                contentId.Length != Interop.PrjFSLib.PlaceholderIdLength)
+            {
+                throw new ArgumentException();
+            }
+
+            return Interop.PrjFSLib.WritePlaceholderDirectoryWithIds(this.instance, relativePath, providerId, contentId);
         }
 
         public virtual Result WritePlaceholderFile(
@@ -78,6 +130,7 @@ namespace PrjFSLib.Mac
             }
 
             return Interop.PrjFSLib.WritePlaceholderFile(
+                this.instance,
                 relativePath,
                 providerId,
                 contentId,
@@ -93,20 +146,39 @@ namespace PrjFSLib.Mac
             UpdateType updateFlags,
             out UpdateFailureCause failureCause)
         {
-            throw new NotImplementedException();
+            if (providerId.Length != Interop.PrjFSLib.PlaceholderIdLength ||
+                contentId.Length != Interop.PrjFSLib.PlaceholderIdLength)
+            {
+                throw new ArgumentException();
+            }
+
+            return Interop.PrjFSLib.UpdatePlaceholderFileIfNeeded(
+                this.instance,
+                relativePath,
+                providerId,
+                contentId,
+                fileSize,
+                updateFlags,
+                out failureCause);
         }
 
         public virtual Result CompleteCommand(
             ulong commandId,
             Result result)
         {
-            throw new NotImplementedException();
+            return Interop.PrjFSLib.CompleteCommand(commandId, result);
         }
 
+        // Converts the directory and everything in it in place, without ids: files become
+        // full files and the directory needs no enumeration
         public virtual Result ConvertDirectoryToPlaceholder(
             string relativeDirectoryPath)
         {
-            throw new NotImplementedException();
+            return Interop.PrjFSLib.ConvertDirectoryToPlaceholder(
+                this.instance,
+                relativeDirectoryPath,
+                callback: IntPtr.Zero,
+                callbackContext: IntPtr.Zero);
         }
 
         public static Result ConvertDirectoryToVirtualizationRoot(string fullPath)
@@ -1,14 +1,33 @@
 #include <iostream>
 #include <cassert>
+#include <climits>
+#include <algorithm>
 #include <stddef.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <copyfile.h>
+#include <sys/attr.h>
+#include <sys/vnode.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/sys_domain.h>
 #include <sys/xattr.h>
+#include <sys/fsgetpath.h>
+#include <sys/clonefile.h>
+#include <sys/kdebug_signpost.h>
+#include <libproc.h>
 #include <thread>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <condition_variable>
 #include <unistd.h>
 #include <unordered_map>
-#include <set>
+#include <vector>
+#include <atomic>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IODataQueueClient.h>
 #include <mach/mach_port.h>
@@ -21,63 +40,620 @@
 #include "PrjFSKext/public/PrjFSXattrs.h"
 #include "PrjFSKext/public/Message.h"
 #include "PrjFSUser.hpp"
+#include "RequestWorkerPool.hpp"
 
 using std::endl; using std::cerr;
-using std::unordered_map; using std::set; using std::string;
+using std::unordered_map; using std::string;
 using std::mutex;
 typedef std::lock_guard<mutex> mutex_lock;
 
 // Structs
 struct _PrjFS_FileHandle
 {
-    FILE* file;
+    int fd;
+    
+    // Hydration must write exactly the size the placeholder was created with
+    off_t placeholderSize;
+    mutable std::atomic<uint64_t> bytesWritten;
+    
+    // Large hydrations report their progress to the kernel so that the request
+    // doesn't time out while the contents are still being written
+    PrjFS_Instance* instance;
+    uint64_t messageId;
+    mutable std::atomic<uint64_t> bytesReportedToKernel;
+    
+    // Recorded in the content deduplication index once hydration succeeds
+    unsigned char contentId[PrjFS_PlaceholderIdLength];
+    
+    // The region mapped with PrjFS_MapFileContents, if any: the whole pages
+    // mapped, and the requested byte count within them
+    mutable void* mappedPages;
+    mutable size_t mappedPagesLength;
+    mutable unsigned int mappedByteCount;
+};
+
+// A kernel request whose callback has been invoked but which has not yet been
+// answered. Callbacks that return PrjFS_Result_Pending leave the command here
+// until the provider calls PrjFS_CompleteCommand.
+struct PendingCommand
+{
+    PrjFS_Instance* instance;
+    MessageType messageType;
+    
+    // Points into messageMemory, which the command owns until it is finished
+    const char* relativePath;
+    void* messageMemory;
+    
+    // Only set for hydration requests. Owned by the command.
+    PrjFS_FileHandle* fileHandle;
+    
+    // Set once the callback has returned PrjFS_Result_Pending. From then on the
+    // command counts as outstanding work of its instance until it is finished.
+    bool callbackReturned;
+    
+    // Set when the callback is invoked; the callback is in flight until the command is finished
+    std::chrono::steady_clock::time_point callbackStartTime;
+};
+
+// Hashing and comparison of nul-terminated paths, so that maps can be keyed by paths
+// inside message buffers without copying them
+struct PathHash
+{
+    size_t operator()(const char* path) const
+    {
+        // FNV-1a
+        size_t hash = 14695981039346656037ull;
+        for (const char* c = path; *c != '\0'; ++c)
+        {
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+        }
+        
+        return hash;
+    }
+};
+
+struct PathEqual
+{
+    bool operator()(const char* left, const char* right) const
+    {
+        return 0 == strcmp(left, right);
+    }
+};
+
+// IDs of the kernel messages waiting on one path. Almost all paths only ever have a
+// handful of waiters, so those are stored inline rather than in a separate allocation.
+// Also tracks which of them the kernel has cancelled, and the command handling them.
+class PendingMessageIdList
+{
+public:
+    explicit PendingMessageIdList(uint64_t firstMessageId)
+        : inlineCount(1)
+        , cancelledCount(0)
+        , commandId(0)
+    {
+        this->inlineIds[0] = firstMessageId;
+    }
+    
+    void Add(uint64_t messageId)
+    {
+        if (this->heapIds.empty() && this->inlineCount < InlineCapacity)
+        {
+            this->inlineIds[this->inlineCount++] = messageId;
+            return;
+        }
+        
+        if (this->heapIds.empty())
+        {
+            this->heapIds.assign(this->inlineIds, this->inlineIds + this->inlineCount);
+        }
+        
+        this->heapIds.push_back(messageId);
+    }
+    
+    const uint64_t* Data() const { return this->heapIds.empty() ? this->inlineIds : this->heapIds.data(); }
+    size_t Size() const { return this->heapIds.empty() ? this->inlineCount : this->heapIds.size(); }
+    
+    // The kernel cancels each message at most once. Returns false if messageId isn't in the list.
+    bool Cancel(uint64_t messageId)
+    {
+        const uint64_t* ids = this->Data();
+        if (std::find(ids, ids + this->Size(), messageId) == ids + this->Size())
+        {
+            return false;
+        }
+        
+        this->cancelledCount++;
+        return true;
+    }
+    
+    // Once nobody in the kernel waits for the result any more. Replayed requests
+    // are never cancelled.
+    bool IsCancelled() const { return this->cancelledCount == this->Size(); }
+    
+    // 0 until the request is about to be handed to a callback
+    uint64_t CommandId() const { return this->commandId; }
+    void SetCommandId(uint64_t id) { this->commandId = id; }
+    
+private:
+    static const size_t InlineCapacity = 4;
+    
+    uint64_t inlineIds[InlineCapacity];
+    size_t inlineCount;
+    std::vector<uint64_t> heapIds;
+    size_t cancelledCount;
+    uint64_t commandId;
+};
+
+// Map of relative path -> pending message IDs for that path. The key points into the
+// message buffer of the request that is being handled for the path.
+typedef unordered_map<const char*, PendingMessageIdList, PathHash, PathEqual> PendingRequestMessageMap;
+
+// The pending request map is split by path hash so that the dequeue loop and completing
+// workers only contend when they touch paths in the same shard.
+struct PendingRequestShard
+{
+    std::mutex mutex;
+    PendingRequestMessageMap messageIDs;
+};
+
+// An access profile is an AccessProfileHeader followed by one AccessProfileRecord per
+// recorded request, each directly followed by its path without the nul terminator.
+struct AccessProfileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct AccessProfileRecord
+{
+    // Saturates at UINT32_MAX
+    uint32_t microsecondsSincePreviousRecord;
+    uint16_t pathLength;
+    uint8_t  messageType; // MessageType_KtoU_EnumerateDirectory or MessageType_KtoU_HydrateFile
+    uint8_t  reserved;
+};
+
+struct AccessRecorder
+{
+    int fd;
+    bool writeFailed;
+    std::chrono::steady_clock::time_point previousRecordTime;
+    std::vector<char> buffer;
+};
+
+// Replayed hydrations queued for or running in the worker pool; see
+// EnqueueReplayedHydration
+struct ReplayedHydrations
+{
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t queuedCount = 0;
+};
+
+// Counters behind PrjFS_GetStatistics. They are only read for reporting, so they are
+// updated without ordering and read without a consistent snapshot.
+struct LatencyHistogram
+{
+    std::atomic<uint64_t> buckets[PrjFS_LatencyHistogramBucketCount];
+    std::atomic<uint64_t> totalMicroseconds;
+};
+
+struct InstanceStatistics
+{
+    std::atomic<uint64_t> dequeuedMessageCount;
+    std::atomic<uint64_t> coalescedRequestCount;
+    std::atomic<uint64_t> cancelledRequestCount;
+    std::atomic<uint32_t> inFlightCallbackCount;
+    LatencyHistogram enumerateDirectoryLatency;
+    LatencyHistogram getFileStreamLatency;
+};
+
+// Map of contentId -> relative path of the first file hydrated with that content, used
+// with PrjFS_HydrationOptions_DeduplicateContent, plus mutex to protect it. Entries are
+// only checked and dropped when they are used.
+struct ContentDeduplicationIndex
+{
+    std::mutex mutex;
+    unordered_map<string, string> relativePathsByContentId;
+};
+
+// The directory set with PrjFS_SetContentCache. The size is this process's estimate
+// of the cached contents, which is corrected whenever the directory is scanned for
+// eviction; other processes sharing the directory add to it unseen until then.
+struct ContentCache
+{
+    int directoryFd;
+    uint64_t maxSizeBytes;
+    std::atomic<uint64_t> sizeBytes;
+    std::mutex evictionMutex;
+    
+    ~ContentCache()
+    {
+        close(this->directoryFd);
+    }
+};
+
+// A file found by a scan of the content cache
+struct ContentCacheEntry
+{
+    string relativePath;
+    struct timespec lastAccessTime;
+    off_t size;
+};
+
+// One entry of a directory, as read by getattrlistbulk. The name points into the
+// buffer being read into and is only valid while the entry is being visited.
+struct BulkDirectoryEntry
+{
+    const char* name;
+    fsobj_type_t objectType;
+    uint32_t flags;
+    struct timespec modificationTime;
+    
+    // Only set for regular files
+    off_t fileSize;
+};
+
+// Called by WalkTreeInParallel for each batch of entries that one getattrlistbulk
+// call read from a directory, on any of its threads. Any result other than
+// PrjFS_Result_Success stops the walk.
+typedef std::function<PrjFS_Result(int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)> TreeWalkVisitor;
+
+// Directories waiting to be read by the threads of a WalkTreeInParallel, plus mutex
+// to protect them. The walk is done once none are waiting and no thread is busy.
+struct ParallelTreeWalk
+{
+    int rootFd;
+    const TreeWalkVisitor* visitor;
+    std::mutex mutex;
+    std::condition_variable stateChanged;
+    std::vector<string> pendingDirectories;
+    unsigned int busyThreadCount = 0;
+    PrjFS_Result result = PrjFS_Result_Success;
+};
+
+// A hydrated placeholder found by PrjFS_DehydrateTree
+struct DehydrationCandidate
+{
+    string relativePath;
+    time_t lastAccessTime;
+};
+
+static const size_t PendingRequestShardCount = 16;
+
+// One of the queues the kernel spreads an instance's messages over
+struct InstanceMessageQueue
+{
+    uint32_t index;
+    dispatch_queue_t dispatchQueue;
+    DataQueueResources resources;
+};
+
+// A virtualization root served by this process. The worker pool, message buffers,
+// command IDs and process priorities are shared by all instances.
+struct _PrjFS_Instance
+{
+    io_connect_t kernelServiceConnection;
+    
+    // ProviderCapabilityFlags negotiated with the kernel; fast paths it doesn't
+    // have fall back to the basic protocol, other features are not supported
+    uint64_t kernelCapabilities;
+    std::string virtualizationRootFullPath;
+    
+    // Paths relative to the root are opened relative to this, so the kernel doesn't
+    // look up the root's own path for each of them
+    int rootFd;
+    
+    PrjFS_Callbacks callbacks;
+    PrjFS_InstanceFlags flags;
+    uint32_t messageQueueCount;
+    InstanceMessageQueue messageQueues[MaxProviderMessageQueues];
+    
+    PendingRequestShard pendingRequestShards[PendingRequestShardCount];
+    
+    ContentDeduplicationIndex contentDeduplicationIndex;
+    
+    // PrjFS_TempDirectoryName in the root, where placeholders are initialized before
+    // they are moved into place. -1 if it couldn't be opened.
+    int tempDirectoryFd;
+    
+    // Zeroed along with the rest of the instance on creation
+    InstanceStatistics statistics;
+    
+    // Recording is checked on every request without taking the mutex
+    std::atomic<bool> accessRecordingActive;
+    AccessRecorder accessRecorder;
+    std::mutex accessRecorderMutex;
+    
+    // Set by PrjFS_StopVirtualizationInstance. Once stopping, requests are failed
+    // without invoking callbacks; once abandoning, so are callbacks that return
+    // PrjFS_Result_Pending. Abandoning is only changed with s_PendingCommandMutex held.
+    std::atomic<bool> isStopping;
+    bool abandonPendingCommands;
+    std::atomic<bool> isConnectionClosed;
+    
+    // Mapped ProviderMemoryType_ResponseRing, through which responses go when
+    // there is room. Null if it couldn't be mapped or once the connection is
+    // closing, then responses are sent with a call into the kernel each.
+    // Responders append to the ring with the mutex held.
+    ResponseRing* responseRing;
+    mach_vm_address_t responseRingAddress;
+    std::mutex responseRingMutex;
+    
+    // Work queued for or running in the worker pool, plus pending commands whose
+    // callback has returned. If the stop gives up waiting for these, whoever
+    // finishes the last one deletes the instance.
+    std::mutex outstandingWorkMutex;
+    std::condition_variable outstandingWorkDone;
+    unsigned int outstandingWorkCount;
+    bool deleteWhenIdle;
 };
 
 // Function prototypes
-static bool SetBitInFileFlags(const char* path, uint32_t bit, bool value);
-static bool IsBitSetInFileFlags(const char* path, uint32_t bit);
+static bool SetFileFlags(int fd, uint32_t flags);
+static bool SetFileFlagsAt(int directoryFd, const char* name, uint32_t flags);
+static bool UpdateFileFlags(int fd, uint32_t bitsToSet, uint32_t bitsToClear);
+static bool IsBitSetInFileFlags(int directoryFd, const char* path, uint32_t bit);
 
-static bool InitializeEmptyPlaceholder(const char* fullPath);
+static bool InitializeEmptyPlaceholder(int fd);
+template<typename TPlaceholder> static bool InitializeEmptyPlaceholder(int fd, TPlaceholder* data, const char* xattrName);
 template<typename TPlaceholder> static bool InitializeEmptyPlaceholder(const char* fullPath, TPlaceholder* data, const char* xattrName);
-static bool AddXAttr(const char* path, const char* name, const void* value, size_t size);
 static bool GetXAttr(const char* path, const char* name, size_t size, _Out_ void* value);
+static bool IsXAttrHeaderValid(const PrjFSXattrHeader& header);
+static bool ReadFileXAttr(int fd, _Out_ PrjFSFileXAttrData* data);
+static bool ReadFileXAttr(const char* path, _Out_ PrjFSFileXAttrData* data);
+static bool DecodeFileXAttr(const PrjFSFileXAttrCompactData& xattr, ssize_t xattrSize, _Out_ PrjFSFileXAttrData* data);
+static bool ReadRequestFileXAttr(const MessageHeader* request, int fd, _Out_ PrjFSFileXAttrData* data);
+static bool WriteFileXAttr(int fd, const unsigned char* providerId, const unsigned char* contentId);
+static bool IsZeroId(const unsigned char* id);
+static void ReadDirectoryIds(PrjFS_Instance* instance, const MessageHeader* request, const char* path, int directoryFd, _Out_ PrjFSFileXAttrData* data);
+
+static PrjFS_Result WritePlaceholderEntryAt(int tempDirectoryFd, int directoryFd, const PrjFS_PlaceholderEntry& entry);
+static PrjFS_Result WriteFullFileEntryAt(int tempDirectoryFd, int directoryFd, const PrjFS_FullFileEntry& entry);
+static const char* GetEntryCreationName(int tempDirectoryFd, int directoryFd, const char* name, char (&tempName)[32], _Out_ int* createDirectoryFd);
+static PrjFS_Result MoveCreatedEntryIntoPlace(
+    int tempDirectoryFd,
+    int directoryFd,
+    int createDirectoryFd,
+    const char* tempName,
+    const char* name,
+    bool isDirectory,
+    bool initialized);
+static int OpenParentDirectory(PrjFS_Instance* instance, const char* relativePath, _Out_ const char** name);
+static int OpenTempDirectory(int rootFd);
+static PrjFS_PlaceholderDefect GetPlaceholderDefect(int directoryFd, const BulkDirectoryEntry& entry);
+static PrjFS_Result CheckPlaceholderIsUpdatable(
+    int fd,
+    PrjFS_UpdateType updateFlags,
+    _Out_ struct stat* fileAttributes,
+    _Out_ PrjFSFileXAttrData* xattrData,
+    _Out_ bool* isFullFile,
+    _Out_ PrjFS_UpdateFailureCause* failureCause);
+static bool IsReadOnly(const struct stat& fileAttributes);
+static bool ResetToEmptyPlaceholder(
+    int directoryFd,
+    const char* path,
+    int fd,
+    const struct stat& fileAttributes,
+    off_t fileSize,
+    const unsigned char* providerId,
+    const unsigned char* contentId);
+static void WriteHydratedFileXAttr(int fd);
+static bool IsUnmodifiedSinceHydration(int fd, const struct stat& fileAttributes);
+static PrjFS_Result DehydrateFile(PrjFS_Instance* instance, const char* relativePath, _Out_ PrjFS_UpdateFailureCause* failureCause, _Out_ off_t* reclaimedBytes);
+static PrjFS_Result FindDehydrationCandidates(
+    PrjFS_Instance* instance,
+    const string& directoryRelativePath,
+    PrjFS_FileFilterCallback* filter,
+    void* filterContext,
+    time_t idleSince,
+    std::vector<string>* subdirectories,
+    std::vector<DehydrationCandidate>* candidates);
+
+static bool WriteAll(int fd, const void* bytes, size_t byteCount);
+static bool WriteAllVector(int fd, struct iovec* buffers, int bufferCount);
+static void PrepareFileForHydration(int fd, off_t fileSize);
+static void ReportHydrationProgressIfDue(const PrjFS_FileHandle* fileHandle);
+static void UnmapFileContents(const PrjFS_FileHandle* fileHandle);
+static bool IsHydratedSizeValid(const PrjFS_FileHandle* fileHandle, const char* relativePath);
+static bool HydrateFromDuplicateContent(PrjFS_Instance* instance, PrjFS_FileHandle* fileHandle, const char* relativePath);
+static void AddToContentDeduplicationIndex(PrjFS_Instance* instance, const PrjFS_FileHandle* fileHandle, const char* relativePath);
+static bool IsContentDeduplicationCandidate(const PrjFS_FileHandle* fileHandle);
+static bool IsUnmodifiedDuplicate(int sourceFd, const PrjFS_FileHandle* fileHandle);
+static bool HasContentId(const PrjFS_FileHandle* fileHandle);
+static std::shared_ptr<ContentCache> GetContentCache();
+static void GetContentCacheEntryPath(const PrjFS_FileHandle* fileHandle, _Out_ char (&subdirectoryName)[3], _Out_ char (&entryName)[2 * PrjFS_PlaceholderIdLength]);
+static bool HydrateFromContentCache(PrjFS_FileHandle* fileHandle);
+static void AddToContentCache(const PrjFS_FileHandle* fileHandle);
+static uint64_t ScanContentCache(int directoryFd, _Out_ std::vector<ContentCacheEntry>* entries);
+static void EvictFromContentCache(ContentCache* cache);
 
 static bool IsVirtualizationRoot(const char* path);
-static void CombinePaths(const char* root, const char* relative, char (&combined)[PrjFSMaxPath]);
+static bool IsInsideVirtualizationRoot(const char* fullPath);
+static PrjFS_Result ConvertDirectoryContents(const char* rootFullPath);
+static PrjFS_Result ConvertEntryToPlaceholderAt(
+    int directoryFd,
+    const BulkDirectoryEntry& entry,
+    const string& relativePath,
+    PrjFS_ConvertEntryCallback* callback,
+    void* callbackContext);
+static PrjFS_Result WalkTreeInParallel(const char* rootFullPath, const char* startRelativePath, const TreeWalkVisitor& visitor);
+static void RunTreeWalkThread(ParallelTreeWalk* walk);
+static PrjFS_Result VisitDirectoryEntries(
+    ParallelTreeWalk* walk,
+    const string& directoryRelativePath,
+    std::vector<char>& buffer,
+    std::vector<BulkDirectoryEntry>& entries,
+    std::vector<string>* subdirectories);
+static PrjFS_FileState GetFileStateFromFlags(bool isDirectory, uint32_t fileFlags);
+static bool HasPlaceholderFileXAttr(int directoryFd, const char* path);
+template<typename T> static T ReadAttributeField(const char** field);
+static bool ReadRootXAttr(const char* path, _Out_ PrjFSVirtualizationRootXAttrData* data);
+static uint64_t GenerateRootToken();
+static int OpenInRoot(PrjFS_Instance* instance, const char* relativePath, int flags);
+static int OpenRequestTarget(PrjFS_Instance* instance, const MessageHeader* request, const char* relativePath, int flags);
 
-static errno_t SendKernelMessageResponse(uint64_t messageId, MessageType responseType);
-static errno_t RegisterVirtualizationRootPath(const char* path);
+static void MapResponseRing(PrjFS_Instance* instance);
+static void UnmapResponseRing(PrjFS_Instance* instance);
+static size_t QueueKernelMessageResponses(PrjFS_Instance* instance, const uint64_t* messageIds, size_t messageIdCount, MessageType responseType);
+static errno_t SendKernelMessageResponse(PrjFS_Instance* instance, uint64_t messageId, MessageType responseType);
+static errno_t SendKernelMessageResponses(PrjFS_Instance* instance, const uint64_t* messageIds, size_t messageIdCount, MessageType responseType);
+static uint64_t NegotiateKernelCapabilities(io_connect_t connection);
+static errno_t AttachToVirtualizationRoot(io_connect_t connection, uint64_t kernelCapabilities, const char* path, uint64_t rootToken, uint32_t rootFlags);
+static errno_t RegisterVirtualizationRootPath(io_connect_t connection, const char* path, uint32_t rootFlags);
+static errno_t ReattachVirtualizationRoot(io_connect_t connection, const VirtualizationRootIdentity& identity, uint32_t rootFlags);
+static errno_t SetKernelRequestTimeout(io_connect_t connection, MessageType messageType, uint32_t timeoutMilliseconds);
+static errno_t SetKernelMessageQueueCapacity(io_connect_t connection, uint32_t capacityBytes);
+static errno_t SetKernelMessageQueueCount(io_connect_t connection, uint32_t queueCount);
+static errno_t SetKernelProcessPolicies(io_connect_t connection, const ProcessPolicyEntry* entries, uint32_t entryCount);
+static errno_t SetKernelNotificationMappings(io_connect_t connection, const void* mappings, uint32_t mappingsSize);
+static errno_t SetKernelPrefetchHintInterval(io_connect_t connection, uint32_t intervalMilliseconds);
+static errno_t SetKernelRequestRateLimit(io_connect_t connection, uint32_t requestsPerSecond, uint32_t burst, uint32_t maxDelayMilliseconds);
+static errno_t SetKernelMemoryBudget(io_connect_t connection, uint32_t subsystem, uint64_t budgetBytes);
+static errno_t SetKernelHelperProcesses(io_connect_t connection, const int32_t* pids, uint32_t pidCount, int32_t processGroupId);
+static errno_t DrainKernelModifiedFiles(io_connect_t connection, ModifiedFileEntry* entries, uint32_t* entryCount, uint64_t* remainingCount, bool* overflowed);
+static void SignalKernelMessageQueueDrained(io_connect_t connection, uint32_t queueIndex);
+static void SignalKernelFileFlagsChanged(PrjFS_Instance* instance, int fd);
 
-static void HandleKernelRequest(Message requestSpec, void* messageMemory);
-static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* path);
-static PrjFS_Result HandleHydrateFileRequest(const MessageHeader* request, const char* path);
+static void HandleKernelRequest(PrjFS_Instance* instance, Message requestSpec, void* messageMemory);
+static PrjFS_Result HandleEnumerateDirectoryRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path, PendingCommand* command);
+static PrjFS_Result HandleHydrateFileRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path, PendingCommand* command);
+static PrjFS_Result HandleConvertFileToFullRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path);
+static PrjFS_Result EnumerateDirectoryInBulk(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path);
+static void AddPendingCommand(uint64_t commandId, const PendingCommand& command);
+static PrjFS_Result ReclaimPendingCommand(uint64_t commandId, PrjFS_Result callbackResult);
+static PrjFS_Result FinishCommand(const PendingCommand& command, PrjFS_Result result);
+static void BeginInstanceWork(PrjFS_Instance* instance);
+static void EndInstanceWork(PrjFS_Instance* instance);
+static bool InitMessageQueues(PrjFS_Instance* instance);
+static void CleanupMessageQueues(PrjFS_Instance* instance);
+static void HandleMessageQueueEvent(PrjFS_Instance* instance, InstanceMessageQueue* queue);
+static void FailUndeliveredMessages(PrjFS_Instance* instance);
+static void FailPendingCommands(PrjFS_Instance* instance);
+static void HandleKernelNotification(PrjFS_Instance* instance, Message notification, void* messageMemory);
+static void HandlePrefetchHint(PrjFS_Instance* instance, Message hint, void* messageMemory);
+static void HandleCancelMessage(PrjFS_Instance* instance, uint64_t messageId);
+static bool StartPendingRequest(PrjFS_Instance* instance, const char* path, uint64_t commandId);
+static void RecordAccess(PrjFS_Instance* instance, MessageType messageType, const char* relativePath);
+static bool FlushAccessRecorder(AccessRecorder& recorder);
+static bool StartReplayedRequest(PrjFS_Instance* instance, MessageType messageType, const char* relativePath, const char* processName, Message* outRequest, void** outMessageMemory);
+static void EnqueueReplayedHydration(PrjFS_Instance* instance, Message request, void* messageMemory, ReplayedHydrations* hydrations);
+static void WaitForReplayedHydrations(ReplayedHydrations* hydrations);
+static PrjFS_Result HydrateDirectoryEntries(
+    PrjFS_Instance* instance,
+    const string& directoryRelativePath,
+    PrjFS_FileFilterCallback* filter,
+    void* filterContext,
+    std::vector<string>* subdirectories,
+    ReplayedHydrations* hydrations);
+static void EnumerateSubtree(PrjFS_Instance* instance, const char* relativePath, const char* processName);
+static void BeginCallback(PrjFS_Instance* instance, PendingCommand* command);
+static void EndCallback(const PendingCommand& command);
+static void RecordLatency(LatencyHistogram& histogram, uint64_t microseconds);
+static void ReadLatencyHistogram(const LatencyHistogram& histogram, _Out_ PrjFS_LatencyHistogram* result);
+static bool IsNotificationMessageType(MessageType messageType);
+static bool MessageExpectsResponse(MessageType messageType);
+static uint32_t GetKernelNotificationFlags(PrjFS_NotificationType notificationMask);
 
 static Message ParseMessageMemory(const void* messageMemory, uint32_t size);
+static PendingRequestShard& GetPendingRequestShard(PrjFS_Instance* instance, const char* path);
+static void* AllocateMessageBuffer(uint32_t messageSize);
+static void FreeMessageBuffer(void* messageMemory);
+static RequestPriority GetRequestPriority(const MessageHeader* header);
+static RequestPriority GetThreadRequestPriority(int32_t pid, uint64_t threadId);
 
 static void ClearMachNotification(mach_port_t port);
 
 // State
-static io_connect_t s_kernelServiceConnection = IO_OBJECT_NULL;
-static std::string s_virtualizationRootFullPath;
-static PrjFS_Callbacks s_callbacks;
-static dispatch_queue_t s_messageQueueDispatchQueue;
-static dispatch_queue_t s_kernelRequestHandlingConcurrentQueue;
+static uint32_t s_messageQueueCapacityBytes = 0;
+static uint32_t s_messageQueueCount = 0;
+static std::atomic<unsigned int> s_hydrationOptions(PrjFS_HydrationOptions_None);
+static std::atomic<uint64_t> s_noCacheMinimumFileSize(0);
+static const uint32_t DefaultPrefetchHintIntervalMilliseconds = 30 * 1000;
+
+// Set with PrjFS_SetContentCache, plus mutex to protect the pointer. Hydrations hold
+// on to the cache they got, so it can be replaced while they use it.
+static std::shared_ptr<ContentCache> s_contentCache;
+static std::mutex s_contentCacheMutex;
+
+// Eviction brings the cache down to this share of its maximum size, so that it
+// doesn't have to scan the directory again right away
+static const uint64_t ContentCacheEvictionTargetPercent = 90;
+
+// Files being added to the content cache are cloned under a temporary name first.
+// Ones left behind by a process that exited meanwhile are removed by eviction scans
+// once they are this old.
+static const char ContentCacheTempNamePrefix[] = ".incoming-";
+static const time_t ContentCacheStaleTempFileSeconds = 60 * 60;
+
+// Failed flag and xattr syscalls on placeholders, for PrjFS_GetStatistics. The helpers
+// making them don't know the instance, so they are counted for the whole process.
+// Reads of xattrs that don't exist are expected and not counted.
+static std::atomic<uint64_t> s_fileFlagsErrorCount(0);
+static std::atomic<uint64_t> s_xattrErrorCount(0);
+
+// All running instances, plus mutex to protect the list. The worker pool is started
+// along with the first instance.
+static std::vector<PrjFS_Instance*> s_instances;
+static std::mutex s_instancesMutex;
+static bool s_requestWorkerPoolStarted = false;
 
-// Map of relative path -> set of pending message IDs for that path, plus mutex to protect it.
-static unordered_map<string, set<uint64_t>> s_PendingRequestMessageIDs;
-static std::mutex s_PendingRequestMessageMutex;
+// Hydrations tell the kernel they are still making progress each time this much
+// more has been written. At typical download speeds this is well within the
+// hydration timeout.
+static const uint64_t HydrationProgressReportBytes = 64 * 1024 * 1024;
 
+// Message buffers that fit any message with a path of up to PrjFSMaxPath (and a file xattr) are recycled
+// instead of going back to malloc, plus mutex to protect the free list.
+static const uint32_t MessageBufferSize = sizeof(MessageHeader) + PrjFSMaxPath + sizeof(PrjFSFileXAttrCompactData);
+static const size_t MaxFreeMessageBuffers = 256;
+static std::vector<void*> s_freeMessageBuffers;
+static std::mutex s_freeMessageBufferMutex;
 
-// The full API is defined in the header, but only the minimal set of functions needed
-// for the initial MirrorProvider implementation are listed here. Calling any other function
-// will lead to a linker error for now.
+// Map of command ID -> commands awaiting PrjFS_CompleteCommand, plus mutex to protect it.
+static unordered_map<uint64_t, PendingCommand> s_PendingCommands;
+static std::mutex s_PendingCommandMutex;
+static std::atomic<uint64_t> s_nextCommandId(1);
+
+// Names placeholders in the temp directories of all instances while they are initialized
+static std::atomic<uint64_t> s_nextTempEntryId(1);
+
+// Map of process name -> scheduling priority of requests it triggers, plus mutex to protect it.
+static unordered_map<string, RequestPriority> s_processRequestPriorities;
+static std::mutex s_processRequestPriorityMutex;
+
+// Requests invoked by PrjFS_ReplayAccessProfile rather than sent by the kernel use
+// this message ID, which the kernel never assigns. They are always the first to be
+// registered for their path.
+static const uint64_t ReplayedMessageId = 0;
+static const uint32_t AccessProfileMagic = 0x50414650; // "PFAP"
+static const uint32_t AccessProfileVersion = 1;
+static const size_t AccessRecorderFlushSize = 64 * 1024;
+static const size_t MaxQueuedReplayedHydrations = 64;
+static const char* const ReplayProcessName = "prjfs-replay";
+static const char* const HydrateTreeProcessName = "prjfs-hydrate-tree";
+
+// Each enumeration worker fills its own entry buffer, allocated on first use
+static const unsigned int DirectoryEntryBufferCapacity = 256;
+static thread_local std::unique_ptr<PrjFS_DirectoryEntry[]> s_directoryEntryBuffer;
+
+// Directory tree walks read this much of a directory per getattrlistbulk call, on up to
+// this many threads
+static const size_t TreeWalkBufferSize = 64 * 1024;
+static const unsigned int MaxTreeWalkThreadCount = 8;
+
+// openbyid_np needs a privilege most providers don't have; once it has been
+// refused, requests are opened by path without trying it first.
+static std::atomic<bool> s_openByIdUnavailable(false);
 
 // Public functions
 
 PrjFS_Result PrjFS_StartVirtualizationInstance(
     _In_    const char*                             virtualizationRootFullPath,
     _In_    PrjFS_Callbacks                         callbacks,
-    _In_    unsigned int                            poolThreadCount)
+    _In_    unsigned int                            poolThreadCount,
+    _In_    PrjFS_InstanceFlags                     flags,
+    _Out_   PrjFS_Instance**                        instance)
 {
 #ifdef DEBUG
     std::cout
@@ -86,579 +662,5579 @@ PrjFS_Result PrjFS_StartVirtualizationInstance(
         << callbacks.EnumerateDirectory << ", "
         << callbacks.GetFileStream << ", "
         << callbacks.NotifyOperation << ", "
-        << poolThreadCount << ")" << std::endl;
+        << callbacks.PrefetchHint << ", "
+        << callbacks.EnumerateDirectoryBulk << ", "
+        << poolThreadCount << ", "
+        << flags << ")" << std::endl;
 #endif
     
     if (nullptr == virtualizationRootFullPath ||
-        nullptr == callbacks.EnumerateDirectory ||
+        (nullptr == callbacks.EnumerateDirectory && nullptr == callbacks.EnumerateDirectoryBulk) ||
         nullptr == callbacks.GetFileStream)
     {
         return PrjFS_Result_EInvalidArgs;
     }
     
-    if (nullptr != callbacks.NotifyOperation)
+    if (0 == poolThreadCount ||
+        nullptr == instance ||
+        0 != (flags & ~(PrjFS_InstanceFlags_ReadOnly | PrjFS_InstanceFlags_AttributeOnlyDirectoryReads | PrjFS_InstanceFlags_OfflineWhenUnresponsive | PrjFS_InstanceFlags_SkipOverwriteHydration)))
     {
-        return PrjFS_Result_ENotSupported;
+        return PrjFS_Result_EInvalidArgs;
     }
     
-    if (!s_virtualizationRootFullPath.empty())
+    bool isReadOnly = 0 != (flags & PrjFS_InstanceFlags_ReadOnly);
+    
+    PrjFSVirtualizationRootXAttrData rootXattr;
+    if (!ReadRootXAttr(virtualizationRootFullPath, &rootXattr))
     {
-        return PrjFS_Result_EInvalidOperation;
+        return PrjFS_Result_ENotAVirtualizationRoot;
     }
     
-    if (!IsVirtualizationRoot(virtualizationRootFullPath))
+    if (0 == rootXattr.rootToken && !isReadOnly)
     {
-        return PrjFS_Result_ENotAVirtualizationRoot;
+        // Converted before roots had tokens. Not fatal if it can't be added, the
+        // root is then always registered by path.
+        rootXattr.rootToken = GenerateRootToken();
+        if (0 != setxattr(virtualizationRootFullPath, PrjFSVirtualizationRootXAttrName, &rootXattr, sizeof(rootXattr), 0, 0))
+        {
+            rootXattr.rootToken = 0;
+        }
+    }
+    
+    mutex_lock instancesLock(s_instancesMutex);
+    for (const PrjFS_Instance* runningInstance : s_instances)
+    {
+        if (runningInstance->virtualizationRootFullPath == virtualizationRootFullPath)
+        {
+            return PrjFS_Result_EInvalidOperation;
+        }
+    }
+    
+    // Only the first instance's poolThreadCount takes effect, the pool is shared
+    if (!s_requestWorkerPoolStarted)
+    {
+        if (!RequestWorkerPool_Start(poolThreadCount))
+        {
+            cerr << "Failed to start request worker pool.\n";
+            return PrjFS_Result_EOutOfMemory;
+        }
+        
+        s_requestWorkerPoolStarted = true;
     }
     
-    s_kernelServiceConnection = PrjFSService_ConnectToDriver(UserClientType_Provider);
-    if (IO_OBJECT_NULL == s_kernelServiceConnection)
+    io_connect_t connection = PrjFSService_ConnectToDriver(UserClientType_Provider);
+    if (IO_OBJECT_NULL == connection)
     {
         return PrjFS_Result_EDriverNotLoaded;
     }
     
-    DataQueueResources dataQueue;
-    s_messageQueueDispatchQueue = dispatch_queue_create("PrjFS Kernel Message Handling", DISPATCH_QUEUE_SERIAL);
-    if (!PrjFSService_DataQueueInit(&dataQueue, s_kernelServiceConnection, ProviderPortType_MessageQueue, ProviderMemoryType_MessageQueue, s_messageQueueDispatchQueue))
+    uint64_t kernelCapabilities = NegotiateKernelCapabilities(connection);
+    
+    if (0 != s_messageQueueCapacityBytes)
+    {
+        errno_t error = SetKernelMessageQueueCapacity(connection, s_messageQueueCapacityBytes);
+        if (0 != error)
+        {
+            cerr << "Setting message queue capacity failed: " << error << ", " << strerror(error) << endl;
+            IOServiceClose(connection);
+            return ENOMEM == error ? PrjFS_Result_EOutOfMemory : PrjFS_Result_EInvalidArgs;
+        }
+    }
+    
+    uint32_t messageQueueCount = 0 == s_messageQueueCount ? 1 : s_messageQueueCount;
+    if (messageQueueCount > 1 && !(kernelCapabilities & ProviderCapability_MultipleMessageQueues))
+    {
+        // Not fatal, all messages then arrive through one queue
+        cerr << "Kernel does not support multiple message queues, using one\n";
+        messageQueueCount = 1;
+    }
+    
+    if (messageQueueCount > 1)
+    {
+        errno_t error = SetKernelMessageQueueCount(connection, messageQueueCount);
+        if (0 != error)
+        {
+            cerr << "Setting message queue count failed: " << error << ", " << strerror(error) << endl;
+            IOServiceClose(connection);
+            return ENOMEM == error ? PrjFS_Result_EOutOfMemory : PrjFS_Result_EInvalidArgs;
+        }
+    }
+    
+    PrjFS_Instance* newInstance = new PrjFS_Instance();
+    newInstance->kernelServiceConnection = connection;
+    newInstance->kernelCapabilities = kernelCapabilities;
+    newInstance->virtualizationRootFullPath = virtualizationRootFullPath;
+    newInstance->callbacks = callbacks;
+    newInstance->flags = flags;
+    newInstance->accessRecordingActive = false;
+    newInstance->accessRecorder.fd = -1;
+    newInstance->accessRecorder.writeFailed = false;
+    newInstance->isStopping = false;
+    newInstance->abandonPendingCommands = false;
+    newInstance->isConnectionClosed = false;
+    newInstance->responseRing = nullptr;
+    newInstance->responseRingAddress = 0;
+    newInstance->outstandingWorkCount = 0;
+    newInstance->deleteWhenIdle = false;
+    newInstance->messageQueueCount = messageQueueCount;
+    newInstance->tempDirectoryFd = -1;
+    
+    newInstance->rootFd = open(virtualizationRootFullPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (newInstance->rootFd < 0)
+    {
+        cerr << "Opening virtualization root failed: " << errno << ", " << strerror(errno) << endl;
+        IOServiceClose(connection);
+        delete newInstance;
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (!InitMessageQueues(newInstance))
     {
         cerr << "Failed to set up shared data queue.\n";
+        CleanupMessageQueues(newInstance);
+        IOServiceClose(connection);
+        close(newInstance->rootFd);
+        delete newInstance;
         return PrjFS_Result_EInvalidOperation;
     }
     
-    s_virtualizationRootFullPath = virtualizationRootFullPath;
-    s_callbacks = callbacks;
+    uint32_t rootFlags = ProviderRoot_None;
+    if (isReadOnly)
+    {
+        rootFlags |= ProviderRoot_ReadOnly;
+    }
+    
+    if (flags & PrjFS_InstanceFlags_AttributeOnlyDirectoryReads)
+    {
+        rootFlags |= ProviderRoot_AttributeOnlyDirectoryReads;
+    }
+    
+    if (flags & PrjFS_InstanceFlags_OfflineWhenUnresponsive)
+    {
+        rootFlags |= ProviderRoot_OfflineWhenUnresponsive;
+    }
+    
+    if ((flags & PrjFS_InstanceFlags_SkipOverwriteHydration) && (kernelCapabilities & ProviderCapability_ConvertFileToFull))
+    {
+        rootFlags |= ProviderRoot_SkipOverwriteHydration;
+    }
     
-    errno_t error = RegisterVirtualizationRootPath(virtualizationRootFullPath);
+    errno_t error = AttachToVirtualizationRoot(connection, kernelCapabilities, virtualizationRootFullPath, rootXattr.rootToken, rootFlags);
     if (error != 0)
     {
         cerr << "Registering virtualization root failed: " << error << ", " << strerror(error) << endl;
+        // A suspended dispatch object must not be released
+        for (uint32_t i = 0; i < newInstance->messageQueueCount; ++i)
+        {
+            dispatch_source_cancel(newInstance->messageQueues[i].resources.dispatchSource);
+            dispatch_resume(newInstance->messageQueues[i].resources.dispatchSource);
+        }
+        
+        CleanupMessageQueues(newInstance);
+        IOServiceClose(connection);
+        close(newInstance->rootFd);
+        delete newInstance;
         return PrjFS_Result_EInvalidOperation;
     }
     
-    s_kernelRequestHandlingConcurrentQueue = dispatch_queue_create("PrjFS Kernel Request Handling", DISPATCH_QUEUE_CONCURRENT);
+    if (kernelCapabilities & ProviderCapability_ResponseRing)
+    {
+        MapResponseRing(newInstance);
+    }
+    
+    // Not fatal, placeholders are then initialized where they are created
+    newInstance->tempDirectoryFd = OpenTempDirectory(newInstance->rootFd);
+    if (newInstance->tempDirectoryFd < 0)
+    {
+        cerr << "Opening temp directory failed: " << errno << ", " << strerror(errno) << endl;
+    }
     
-    dispatch_source_set_event_handler(dataQueue.dispatchSource, ^{
-        ClearMachNotification(dataQueue.notificationPort);
-        
-        while (1)
+    if (nullptr != callbacks.PrefetchHint && (kernelCapabilities & ProviderCapability_PrefetchHints))
+    {
+        // Not fatal, the provider only misses out on the hints
+        error = SetKernelPrefetchHintInterval(connection, DefaultPrefetchHintIntervalMilliseconds);
+        if (0 != error)
         {
-            IODataQueueEntry* entry = IODataQueuePeek(dataQueue.queueMemory);
-            if (nullptr == entry)
-            {
-                // No more items in queue
-                break;
-            }
-            
-            uint32_t messageSize = entry->size;
-            if (messageSize < sizeof(Message))
-            {
-                cerr << "Bad message size: got " << messageSize << " bytes, expected minimum of " << sizeof(Message) << ", skipping. Kernel/user version mismatch?\n";
-                IODataQueueDequeue(dataQueue.queueMemory, nullptr, nullptr);
-                continue;
-            }
-            
-            void* messageMemory = malloc(messageSize);
-            uint32_t dequeuedSize = messageSize;
-            IOReturn result = IODataQueueDequeue(dataQueue.queueMemory, messageMemory, &dequeuedSize);
-            if (kIOReturnSuccess != result || dequeuedSize != messageSize)
-            {
-                cerr << "Unexpected result dequeueing message - result 0x" << std::hex << result << " dequeued " << dequeuedSize << "/" << messageSize << " bytes\n";
-                abort();
-            }
-            
-            Message message = ParseMessageMemory(messageMemory, messageSize);
-            
-            // At the moment, we expect all messages to include a path
-            assert(message.path != nullptr);
-
-            // Ensure we don't run more than one request handler at once for the same file
-            {
-                mutex_lock lock(s_PendingRequestMessageMutex);
-                typedef unordered_map<string, set<uint64_t>>::iterator PendingMessageIterator;
-                    PendingMessageIterator file_messages_found = s_PendingRequestMessageIDs.find(message.path);
-                if (file_messages_found == s_PendingRequestMessageIDs.end())
-                {
-                    // Not handling this file/dir yet
-                    std::pair<PendingMessageIterator, bool> inserted =
-                        s_PendingRequestMessageIDs.insert(std::make_pair(string(message.path), set<uint64_t>{ message.messageHeader->messageId }));
-                    assert(inserted.second);
-                }
-                else
-                {
-                    // Already a handler running for this path, don't handle it again.
-                    file_messages_found->second.insert(message.messageHeader->messageId);
-                    continue;
-                }
-            }
-            
-
-            dispatch_async(
-                s_kernelRequestHandlingConcurrentQueue,
-                ^{
-                    HandleKernelRequest(message, messageMemory);
-                });
+            cerr << "Enabling prefetch hints failed: " << error << ", " << strerror(error) << endl;
         }
-    });
-    dispatch_resume(dataQueue.dispatchSource);
-	
+    }
+    
+    for (uint32_t i = 0; i < newInstance->messageQueueCount; ++i)
+    {
+        InstanceMessageQueue* queue = &newInstance->messageQueues[i];
+        dispatch_source_set_event_handler(queue->resources.dispatchSource, ^{
+            HandleMessageQueueEvent(newInstance, queue);
+        });
+    }
+    
+    // Callbacks may need the instance as soon as the first request is dequeued
+    s_instances.push_back(newInstance);
+    *instance = newInstance;
+    
+    for (uint32_t i = 0; i < newInstance->messageQueueCount; ++i)
+    {
+        dispatch_resume(newInstance->messageQueues[i].resources.dispatchSource);
+    }
+    
     return PrjFS_Result_Success;
 }
 
-PrjFS_Result PrjFS_ConvertDirectoryToVirtualizationRoot(
-    _In_    const char*                             virtualizationRootFullPath)
+PrjFS_Result PrjFS_StopVirtualizationInstance(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            drainTimeoutMilliseconds)
 {
 #ifdef DEBUG
-    std::cout << "PrjFS_ConvertDirectoryToVirtualizationRoot(" << virtualizationRootFullPath << ")" << std::endl;
+    std::cout << "PrjFS_StopVirtualizationInstance(" << drainTimeoutMilliseconds << ")" << std::endl;
 #endif
     
-    if (nullptr == virtualizationRootFullPath)
+    if (nullptr == instance)
     {
-        return PrjFS_Result_EInvalidArgs;
+        return PrjFS_Result_EInvalidOperation;
     }
     
-    // TODO: walk entire parent chain to root and all child directories to leaf nodes, to make sure we find no other virtualization roots.
-    // It is not allowed to have nested virtualization roots.
-
-    if (IsBitSetInFileFlags(virtualizationRootFullPath, FileFlags_IsInVirtualizationRoot) ||
-        IsVirtualizationRoot(virtualizationRootFullPath))
     {
-        return PrjFS_Result_EVirtualizationRootAlreadyExists;
+        mutex_lock instancesLock(s_instancesMutex);
+        std::vector<PrjFS_Instance*>::iterator found = std::find(s_instances.begin(), s_instances.end(), instance);
+        if (found == s_instances.end())
+        {
+            return PrjFS_Result_EInvalidOperation;
+        }
+        
+        s_instances.erase(found);
     }
-
-    PrjFSVirtualizationRootXAttrData rootXattrData = {};
-    if (!InitializeEmptyPlaceholder(
-            virtualizationRootFullPath,
-            &rootXattrData,
-            PrjFSVirtualizationRootXAttrName))
+    
+    // Stop dequeuing. Once an empty block has run on a serial handler queue, the
+    // event handler has returned and, with the source cancelled, won't run again.
+    instance->isStopping = true;
+    for (uint32_t i = 0; i < instance->messageQueueCount; ++i)
     {
-        return PrjFS_Result_EIOError;
+        dispatch_source_cancel(instance->messageQueues[i].resources.dispatchSource);
     }
     
-    return PrjFS_Result_Success;
-}
-
-PrjFS_Result PrjFS_WritePlaceholderDirectory(
-    _In_    const char*                             relativePath)
-{
-#ifdef DEBUG
-    std::cout << "PrjFS_WritePlaceholderDirectory(" << relativePath << ")" << std::endl;
-#endif
-    
-    if (nullptr == relativePath)
+    for (uint32_t i = 0; i < instance->messageQueueCount; ++i)
     {
-        return PrjFS_Result_EInvalidArgs;
+        dispatch_sync(instance->messageQueues[i].dispatchQueue, ^{});
     }
     
-    char fullPath[PrjFSMaxPath];
-    CombinePaths(s_virtualizationRootFullPath.c_str(), relativePath, fullPath);
-
-    if (mkdir(fullPath, 0777))
+    FailUndeliveredMessages(instance);
+    
+    // Work that was already queued fails its requests without invoking callbacks,
+    // so this mostly waits for callbacks that are running and for pending commands.
     {
-        goto CleanupAndFail;
+        std::unique_lock<mutex> lock(instance->outstandingWorkMutex);
+        instance->outstandingWorkDone.wait_for(
+            lock,
+            std::chrono::milliseconds(drainTimeoutMilliseconds),
+            [instance] { return 0 == instance->outstandingWorkCount; });
     }
     
-    if (!InitializeEmptyPlaceholder(fullPath))
+    FailPendingCommands(instance);
+    
     {
-        goto CleanupAndFail;
+        mutex_lock lock(instance->accessRecorderMutex);
+        if (instance->accessRecorder.fd >= 0)
+        {
+            instance->accessRecordingActive = false;
+            FlushAccessRecorder(instance->accessRecorder);
+            close(instance->accessRecorder.fd);
+            instance->accessRecorder.fd = -1;
+        }
     }
     
-    return PrjFS_Result_Success;
+    // Closing the connection unregisters the root. The kernel fails any requests
+    // that are still waiting, i.e. those of callbacks that outlived the timeout.
+    instance->isConnectionClosed = true;
+    UnmapResponseRing(instance);
+    CleanupMessageQueues(instance);
+    IOServiceClose(instance->kernelServiceConnection);
     
-CleanupAndFail:
-    // TODO: cleanup the directory on disk if needed
-    return PrjFS_Result_EIOError;
-}
+    bool deleteInstance;
+    {
+        mutex_lock lock(instance->outstandingWorkMutex);
+        deleteInstance = (0 == instance->outstandingWorkCount);
+        instance->deleteWhenIdle = !deleteInstance;
+    }
+    
+    if (deleteInstance)
+    {
+        close(instance->tempDirectoryFd);
+        close(instance->rootFd);
+        delete instance;
+    }
+    
+    return PrjFS_Result_Success;
+}
 
-PrjFS_Result PrjFS_WritePlaceholderFile(
-    _In_    const char*                             relativePath,
-    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
-    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
-    _In_    unsigned long                           fileSize,
-    _In_    uint16_t                                fileMode)
+PrjFS_Result PrjFS_SetRequestTimeouts(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            enumerateDirectoryTimeoutMilliseconds,
+    _In_    unsigned int                            getFileStreamTimeoutMilliseconds)
 {
 #ifdef DEBUG
     std::cout
-        << "PrjFS_WritePlaceholderFile("
-        << relativePath << ", " 
-        << (int)providerId[0] << ", "
-        << (int)contentId[0] << ", "
-        << fileSize << ")" << std::endl;
+        << "PrjFS_SetRequestTimeouts("
+        << enumerateDirectoryTimeoutMilliseconds << ", "
+        << getFileStreamTimeoutMilliseconds << ")" << std::endl;
 #endif
     
-    if (nullptr == relativePath)
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (0 != SetKernelRequestTimeout(instance->kernelServiceConnection, MessageType_KtoU_EnumerateDirectory, enumerateDirectoryTimeoutMilliseconds) ||
+        0 != SetKernelRequestTimeout(instance->kernelServiceConnection, MessageType_KtoU_HydrateFile, getFileStreamTimeoutMilliseconds))
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetPrefetchHintInterval(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            intervalMilliseconds)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetPrefetchHintInterval(" << intervalMilliseconds << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance || nullptr == instance->callbacks.PrefetchHint)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (!(instance->kernelCapabilities & ProviderCapability_PrefetchHints))
+    {
+        return PrjFS_Result_ENotSupported;
+    }
+    
+    if (0 != SetKernelPrefetchHintInterval(instance->kernelServiceConnection, intervalMilliseconds))
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetRequestRateLimit(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            requestsPerSecond,
+    _In_    unsigned int                            burst,
+    _In_    unsigned int                            maxDelayMilliseconds)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetRequestRateLimit(" << requestsPerSecond << ", " << burst << ", " << maxDelayMilliseconds << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (0 != requestsPerSecond && 0 == burst)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (!(instance->kernelCapabilities & ProviderCapability_RequestRateLimit))
+    {
+        return PrjFS_Result_ENotSupported;
+    }
+    
+    errno_t error = SetKernelRequestRateLimit(instance->kernelServiceConnection, requestsPerSecond, burst, maxDelayMilliseconds);
+    if (0 != error)
+    {
+        return EINVAL == error ? PrjFS_Result_EInvalidArgs : PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetKernelMemoryBudget(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    PrjFS_KernelMemory                      kind,
+    _In_    unsigned long long                      budgetBytes)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetKernelMemoryBudget(" << kind << ", " << budgetBytes << ")" << std::endl;
+#endif
+    
+    static_assert(PrjFS_KernelMemory_MessageQueues + 1 == KernelMemory_Count, "Kinds must match the kernel's subsystems");
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (static_cast<unsigned int>(kind) > PrjFS_KernelMemory_MessageQueues)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (!(instance->kernelCapabilities & ProviderCapability_MemoryBudgets))
+    {
+        return PrjFS_Result_ENotSupported;
+    }
+    
+    errno_t error = SetKernelMemoryBudget(instance->kernelServiceConnection, kind, budgetBytes);
+    if (0 != error)
+    {
+        return EINVAL == error ? PrjFS_Result_EInvalidArgs : PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetHelperProcesses(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const pid_t*                            pids,
+    _In_    unsigned int                            pidCount,
+    _In_    pid_t                                   processGroupId)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetHelperProcesses(" << pidCount << ", " << processGroupId << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if ((nullptr == pids && pidCount > 0) || pidCount > PrjFS_MaxHelperProcessCount || processGroupId < 0)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (!(instance->kernelCapabilities & ProviderCapability_HelperProcesses))
+    {
+        return PrjFS_Result_ENotSupported;
+    }
+    
+    static_assert(sizeof(pid_t) == sizeof(int32_t), "Helper pids are passed to the kernel as they are");
+    static_assert(PrjFS_MaxHelperProcessCount == MaxProviderHelperProcesses, "Limits must match");
+    errno_t error = SetKernelHelperProcesses(instance->kernelServiceConnection, pids, pidCount, processGroupId);
+    if (0 != error)
+    {
+        return EINVAL == error ? PrjFS_Result_EInvalidArgs : PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetMessageQueueCapacity(
+    _In_    unsigned int                            capacityBytes)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetMessageQueueCapacity(" << capacityBytes << ")" << std::endl;
+#endif
+    
+    s_messageQueueCapacityBytes = capacityBytes;
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetMessageQueueCount(
+    _In_    unsigned int                            queueCount)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetMessageQueueCount(" << queueCount << ")" << std::endl;
+#endif
+    
+    if (queueCount > MaxProviderMessageQueues)
     {
         return PrjFS_Result_EInvalidArgs;
     }
     
-    PrjFSFileXAttrData fileXattrData = {};
+    s_messageQueueCount = queueCount;
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetProcessRequestPriority(
+    _In_    const char*                             processName,
+    _In_    PrjFS_RequestPriority                   priority)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetProcessRequestPriority(" << processName << ", " << priority << ")" << std::endl;
+#endif
+    
+    RequestPriority requestPriority;
+    switch (priority)
+    {
+        case PrjFS_RequestPriority_High:
+            requestPriority = RequestPriority_High;
+            break;
+        case PrjFS_RequestPriority_Normal:
+            requestPriority = RequestPriority_Normal;
+            break;
+        case PrjFS_RequestPriority_Low:
+            requestPriority = RequestPriority_Low;
+            break;
+        default:
+            return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (nullptr == processName || '\0' == processName[0])
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // Match the kernel's truncation of process names
+    string name(processName, strnlen(processName, MAXCOMLEN));
+    
+    mutex_lock lock(s_processRequestPriorityMutex);
+    if (RequestPriority_Normal == requestPriority)
+    {
+        s_processRequestPriorities.erase(name);
+    }
+    else
+    {
+        s_processRequestPriorities[name] = requestPriority;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetRequestPriorityAging(
+    _In_    unsigned int                            agingMilliseconds)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetRequestPriorityAging(" << agingMilliseconds << ")" << std::endl;
+#endif
+    
+    RequestWorkerPool_SetAgingInterval(agingMilliseconds);
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetProcessPolicies(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const PrjFS_ProcessPolicy*              policies,
+    _In_    unsigned int                            policyCount)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetProcessPolicies(" << policies << ", " << policyCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if ((nullptr == policies && 0 != policyCount) || policyCount > MaxProcessPolicyEntries)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    std::vector<ProcessPolicyEntry> entries(policyCount);
+    for (unsigned int i = 0; i < policyCount; ++i)
+    {
+        if (nullptr == policies[i].ProcessName || '\0' == policies[i].ProcessName[0] ||
+            0 != (policies[i].Flags & ~ProcessPolicy_All))
+        {
+            return PrjFS_Result_EInvalidArgs;
+        }
+        
+        // Match the kernel's truncation of process names
+        ProcessPolicyEntry& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        strlcpy(entry.processName, policies[i].ProcessName, sizeof(entry.processName));
+        entry.policyFlags = policies[i].Flags;
+    }
+    
+    errno_t error = SetKernelProcessPolicies(instance->kernelServiceConnection, entries.data(), static_cast<uint32_t>(entries.size()));
+    if (ENOMEM == error)
+    {
+        return PrjFS_Result_EOutOfMemory;
+    }
+    else if (0 != error)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetNotificationMappings(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const PrjFS_NotificationMapping*        mappings,
+    _In_    unsigned int                            mappingCount)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetNotificationMappings(" << mappings << ", " << mappingCount << ")" << std::endl;
+#endif
     
-    char fullPath[PrjFSMaxPath];
-    CombinePaths(s_virtualizationRootFullPath.c_str(), relativePath, fullPath);
+    if (nullptr == instance || nullptr == instance->callbacks.NotifyOperation)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == mappings && 0 != mappingCount)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (instance->flags & PrjFS_InstanceFlags_ReadOnly)
+    {
+        // The kernel denies the operations notifications are about
+        return PrjFS_Result_Success;
+    }
+    
+    // Packed in the format of ProviderSelector_SetNotificationMappings
+    std::vector<uint8_t> packedMappings;
+    for (unsigned int i = 0; i < mappingCount; ++i)
+    {
+        if (nullptr == mappings[i].NotificationRelativeRoot)
+        {
+            return PrjFS_Result_EInvalidArgs;
+        }
+        
+        // The kernel compares against relative paths without leading or trailing slashes
+        string relativeRoot = mappings[i].NotificationRelativeRoot;
+        size_t first = relativeRoot.find_first_not_of('/');
+        relativeRoot = string::npos == first ? string() : relativeRoot.substr(first, relativeRoot.find_last_not_of('/') - first + 1);
+        if (relativeRoot.size() >= PrjFSMaxPath)
+        {
+            return PrjFS_Result_EInvalidArgs;
+        }
+        
+        NotificationMappingEntry entry = {};
+        entry.notificationFlags = GetKernelNotificationFlags(mappings[i].NotificationBitMask);
+        entry.pathSizeBytes = static_cast<uint16_t>(relativeRoot.size() + 1);
+        
+        size_t offset = packedMappings.size();
+        packedMappings.resize(offset + NotificationMappingEntry_GetSize(entry.pathSizeBytes), 0);
+        if (packedMappings.size() > MaxNotificationMappingsSizeBytes)
+        {
+            return PrjFS_Result_EInvalidArgs;
+        }
+        
+        memcpy(&packedMappings[offset], &entry, sizeof(entry));
+        memcpy(&packedMappings[offset + sizeof(entry)], relativeRoot.c_str(), entry.pathSizeBytes);
+    }
+    
+    errno_t error = SetKernelNotificationMappings(instance->kernelServiceConnection, packedMappings.data(), static_cast<uint32_t>(packedMappings.size()));
+    if (ENOMEM == error)
+    {
+        return PrjFS_Result_EOutOfMemory;
+    }
+    else if (0 != error)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_DrainModifiedFiles(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    PrjFS_ModifiedFileCallback*             callback,
+    _In_    void*                                   context,
+    _Out_   bool*                                   overflowed)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_DrainModifiedFiles(" << callback << ", " << context << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == callback || nullptr == overflowed)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    *overflowed = false;
+    if (instance->flags & PrjFS_InstanceFlags_ReadOnly)
+    {
+        return PrjFS_Result_Success;
+    }
+    
+    const string& rootPath = instance->virtualizationRootFullPath;
+    
+    uint64_t remainingCount;
+    do
+    {
+        ModifiedFileEntry entries[MaxModifiedFileEntriesPerDrain];
+        uint32_t entryCount = MaxModifiedFileEntriesPerDrain;
+        bool entriesOverflowed;
+        errno_t error = DrainKernelModifiedFiles(instance->kernelServiceConnection, entries, &entryCount, &remainingCount, &entriesOverflowed);
+        if (0 != error)
+        {
+            return PrjFS_Result_EInvalidOperation;
+        }
+        
+        *overflowed |= entriesOverflowed;
+        
+        for (uint32_t i = 0; i < entryCount; ++i)
+        {
+            // The kernel only knows the file by its ID, which survives renames
+            char fullPath[PrjFSMaxPath];
+            if (fsgetpath(fullPath, sizeof(fullPath), &entries[i].fsid, entries[i].inode) < 0)
+            {
+                continue;
+            }
+            
+            if (0 != strncmp(fullPath, rootPath.c_str(), rootPath.size()) || '/' != fullPath[rootPath.size()])
+            {
+                continue;
+            }
+            
+            callback(fullPath + rootPath.size() + 1, context);
+        }
+    }
+    while (0 != remainingCount);
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_StartAccessRecording(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             profileFullPath)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_StartAccessRecording(" << profileFullPath << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == profileFullPath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    mutex_lock lock(instance->accessRecorderMutex);
+    if (instance->accessRecorder.fd >= 0)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    int fd = open(profileFullPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    AccessProfileHeader header = { AccessProfileMagic, AccessProfileVersion };
+    if (!WriteAll(fd, &header, sizeof(header)))
+    {
+        close(fd);
+        return PrjFS_Result_EIOError;
+    }
+    
+    instance->accessRecorder.fd = fd;
+    instance->accessRecorder.writeFailed = false;
+    instance->accessRecorder.previousRecordTime = std::chrono::steady_clock::now();
+    instance->accessRecorder.buffer.reserve(AccessRecorderFlushSize + sizeof(AccessProfileRecord) + PrjFSMaxPath);
+    instance->accessRecordingActive = true;
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_StopAccessRecording(
+    _In_    PrjFS_Instance*                         instance)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_StopAccessRecording()" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    mutex_lock lock(instance->accessRecorderMutex);
+    if (instance->accessRecorder.fd < 0)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    instance->accessRecordingActive = false;
+    
+    bool succeeded = FlushAccessRecorder(instance->accessRecorder) && !instance->accessRecorder.writeFailed;
+    if (close(instance->accessRecorder.fd))
+    {
+        succeeded = false;
+    }
+    
+    instance->accessRecorder.fd = -1;
+    std::vector<char>().swap(instance->accessRecorder.buffer);
+    
+    return succeeded ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+}
+
+PrjFS_Result PrjFS_ReplayAccessProfile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             profileFullPath)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_ReplayAccessProfile(" << profileFullPath << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == profileFullPath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    std::vector<char> profile;
+    {
+        int fd = open(profileFullPath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return ENOENT == errno ? PrjFS_Result_EFileNotFound : PrjFS_Result_EIOError;
+        }
+        
+        struct stat profileAttributes;
+        if (fstat(fd, &profileAttributes))
+        {
+            close(fd);
+            return PrjFS_Result_EIOError;
+        }
+        
+        profile.resize(profileAttributes.st_size);
+        ssize_t bytesRead = pread(fd, profile.data(), profile.size(), 0);
+        close(fd);
+        if (bytesRead != static_cast<ssize_t>(profile.size()))
+        {
+            return PrjFS_Result_EIOError;
+        }
+    }
+    
+    AccessProfileHeader header;
+    if (profile.size() < sizeof(header))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    memcpy(&header, profile.data(), sizeof(header));
+    if (AccessProfileMagic != header.magic || AccessProfileVersion != header.version)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    ReplayedHydrations hydrations;
+    PrjFS_Result result = PrjFS_Result_Success;
+    size_t offset = sizeof(header);
+    while (offset < profile.size())
+    {
+        AccessProfileRecord record;
+        if (profile.size() - offset < sizeof(record))
+        {
+            result = PrjFS_Result_EInvalidArgs;
+            break;
+        }
+        
+        memcpy(&record, profile.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (profile.size() - offset < record.pathLength || record.pathLength >= PrjFSMaxPath)
+        {
+            result = PrjFS_Result_EInvalidArgs;
+            break;
+        }
+        
+        char relativePath[PrjFSMaxPath];
+        memcpy(relativePath, profile.data() + offset, record.pathLength);
+        relativePath[record.pathLength] = '\0';
+        offset += record.pathLength;
+        
+        MessageType messageType = static_cast<MessageType>(record.messageType);
+        if (MessageType_KtoU_EnumerateDirectory != messageType && MessageType_KtoU_HydrateFile != messageType)
+        {
+            continue;
+        }
+        
+        if (!IsBitSetInFileFlags(instance->rootFd, relativePath, FileFlags_IsEmpty))
+        {
+            // Already enumerated/hydrated, or gone
+            continue;
+        }
+        
+        Message request;
+        void* messageMemory;
+        if (!StartReplayedRequest(instance, messageType, relativePath, ReplayProcessName, &request, &messageMemory))
+        {
+            // The kernel already asked for it
+            continue;
+        }
+        
+        if (MessageType_KtoU_EnumerateDirectory == messageType)
+        {
+            BeginInstanceWork(instance);
+            HandleKernelRequest(instance, request, messageMemory);
+            EndInstanceWork(instance);
+            continue;
+        }
+        
+        EnqueueReplayedHydration(instance, request, messageMemory, &hydrations);
+    }
+    
+    WaitForReplayedHydrations(&hydrations);
+    return result;
+}
+
+PrjFS_Result PrjFS_HydrateTree(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileFilterCallback*               filter,
+    _In_    void*                                   filterContext)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_HydrateTree(" << directoryRelativePath << ", " << filter << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == directoryRelativePath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    ReplayedHydrations hydrations;
+    PrjFS_Result result = PrjFS_Result_Success;
+    
+    // Depth first, so that the hydrations queued at any time are of files close
+    // to each other
+    std::vector<string> directories(1, directoryRelativePath);
+    while (!directories.empty() && !instance->isStopping)
+    {
+        string relativePath = std::move(directories.back());
+        directories.pop_back();
+        
+        result = HydrateDirectoryEntries(instance, relativePath, filter, filterContext, &directories, &hydrations);
+        if (PrjFS_Result_Success != result)
+        {
+            break;
+        }
+    }
+    
+    WaitForReplayedHydrations(&hydrations);
+    return result;
+}
+
+PrjFS_Result PrjFS_ConvertDirectoryToVirtualizationRoot(
+    _In_    const char*                             virtualizationRootFullPath)
+{
+    return PrjFS_ConvertDirectoryToVirtualizationRootWithOptions(virtualizationRootFullPath, PrjFS_ConvertOptions_None);
+}
+
+PrjFS_Result PrjFS_ConvertDirectoryToVirtualizationRootWithOptions(
+    _In_    const char*                             virtualizationRootFullPath,
+    _In_    unsigned int                            options)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_ConvertDirectoryToVirtualizationRootWithOptions(" << virtualizationRootFullPath << ", " << options << ")" << std::endl;
+#endif
+    
+    if (nullptr == virtualizationRootFullPath ||
+        strlen(virtualizationRootFullPath) >= PrjFSMaxPath ||
+        0 != (options & ~PrjFS_ConvertOptions_KeepExistingContents))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // It is not allowed to have nested virtualization roots. Every root and everything
+    // in one has FileFlags_IsInVirtualizationRoot set, so the flags, which getattrlistbulk
+    // reads along with the names, suffice to find them below the directory.
+    if (IsInsideVirtualizationRoot(virtualizationRootFullPath))
+    {
+        return PrjFS_Result_EVirtualizationRootAlreadyExists;
+    }
+    
+    PrjFS_Result result = WalkTreeInParallel(
+        virtualizationRootFullPath,
+        "",
+        [](int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)
+        {
+            for (const BulkDirectoryEntry& entry : entries)
+            {
+                if (entry.flags & FileFlags_IsInVirtualizationRoot)
+                {
+                    return PrjFS_Result_EVirtualizationRootAlreadyExists;
+                }
+            }
+            
+            return PrjFS_Result_Success;
+        });
+    if (PrjFS_Result_Success != result)
+    {
+        return result;
+    }
+
+    PrjFSVirtualizationRootXAttrData rootXattrData = {};
+    rootXattrData.rootToken = GenerateRootToken();
+    if (!InitializeEmptyPlaceholder(
+            virtualizationRootFullPath,
+            &rootXattrData,
+            PrjFSVirtualizationRootXAttrName))
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (options & PrjFS_ConvertOptions_KeepExistingContents)
+    {
+        return ConvertDirectoryContents(virtualizationRootFullPath);
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_ConvertDirectoryToPlaceholder(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    PrjFS_ConvertEntryCallback*             callback,
+    _In_    void*                                   callbackContext)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_ConvertDirectoryToPlaceholder(" << relativePath << ", " << callback << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == relativePath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    bool isRoot = '\0' == relativePath[0];
+    int directoryFd = OpenInRoot(instance, relativePath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (directoryFd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    PrjFS_Result result = WalkTreeInParallel(
+        instance->virtualizationRootFullPath.c_str(),
+        relativePath,
+        [callback, callbackContext](int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)
+        {
+            string entryRelativePath = directoryRelativePath;
+            if (!entryRelativePath.empty())
+            {
+                entryRelativePath += '/';
+            }
+            
+            size_t nameOffset = entryRelativePath.size();
+            for (const BulkDirectoryEntry& entry : entries)
+            {
+                entryRelativePath.resize(nameOffset);
+                entryRelativePath += entry.name;
+                PrjFS_Result entryResult = ConvertEntryToPlaceholderAt(directoryFd, entry, entryRelativePath, callback, callbackContext);
+                if (PrjFS_Result_Success != entryResult)
+                {
+                    return entryResult;
+                }
+            }
+            
+            return PrjFS_Result_Success;
+        });
+    
+    // The root has its own xattr and no ids; any other directory is converted like its
+    // contents, and is also no longer left to the provider to enumerate
+    if (PrjFS_Result_Success == result && !isRoot)
+    {
+        unsigned char providerId[PrjFS_PlaceholderIdLength] = {};
+        unsigned char contentId[PrjFS_PlaceholderIdLength] = {};
+        if (nullptr != callback)
+        {
+            result = callback(relativePath, true, providerId, contentId, callbackContext);
+        }
+        
+        if (PrjFS_Result_Success == result &&
+            (!IsZeroId(providerId) || !IsZeroId(contentId)) &&
+            !WriteFileXAttr(directoryFd, providerId, contentId))
+        {
+            result = PrjFS_Result_EIOError;
+        }
+    }
+    
+    if (PrjFS_Result_Success == result &&
+        !UpdateFileFlags(directoryFd, FileFlags_IsInVirtualizationRoot, FileFlags_IsEmpty))
+    {
+        result = PrjFS_Result_EIOError;
+    }
+    
+    close(directoryFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_WritePlaceholderDirectory(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath)
+{
+    return PrjFS_WritePlaceholderDirectoryWithIds(instance, relativePath, nullptr, nullptr);
+}
+
+PrjFS_Result PrjFS_WritePlaceholderDirectoryWithIds(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength])
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_WritePlaceholderDirectoryWithIds(" << relativePath << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == relativePath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    const char* name;
+    int parentDirectoryFd = OpenParentDirectory(instance, relativePath, &name);
+    if (parentDirectoryFd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    PrjFS_PlaceholderEntry entry = { name, true, providerId, contentId, 0, 0 };
+    PrjFS_Result result = WritePlaceholderEntryAt(instance->tempDirectoryFd, parentDirectoryFd, entry);
+    close(parentDirectoryFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_WritePlaceholderFile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned long                           fileSize,
+    _In_    uint16_t                                fileMode)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_WritePlaceholderFile("
+        << relativePath << ", " 
+        << (int)providerId[0] << ", "
+        << (int)contentId[0] << ", "
+        << fileSize << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == relativePath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    const char* name;
+    int parentDirectoryFd = OpenParentDirectory(instance, relativePath, &name);
+    if (parentDirectoryFd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    PrjFS_PlaceholderEntry entry = { name, false, providerId, contentId, fileSize, fileMode };
+    PrjFS_Result result = WritePlaceholderEntryAt(instance->tempDirectoryFd, parentDirectoryFd, entry);
+    close(parentDirectoryFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_WritePlaceholderBatch(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    const PrjFS_PlaceholderEntry*           entries,
+    _In_    unsigned int                            entryCount,
+    _Out_   PrjFS_Result*                           entryResults)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_WritePlaceholderBatch("
+        << directoryRelativePath << ", "
+        << entries << ", "
+        << entryCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == directoryRelativePath ||
+        (nullptr == entries && entryCount > 0))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    int directoryFd = OpenInRoot(instance, directoryRelativePath, O_RDONLY | O_DIRECTORY);
+    if (directoryFd < 0)
+    {
+        return PrjFS_Result_EPathNotFound;
+    }
+    
+    PrjFS_Result result = PrjFS_Result_Success;
+    for (unsigned int i = 0; i < entryCount; ++i)
+    {
+        PrjFS_Result entryResult = WritePlaceholderEntryAt(instance->tempDirectoryFd, directoryFd, entries[i]);
+        if (nullptr != entryResults)
+        {
+            entryResults[i] = entryResult;
+        }
+        
+        if (PrjFS_Result_Success != entryResult && PrjFS_Result_Success == result)
+        {
+            result = entryResult;
+        }
+    }
+    
+    close(directoryFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_WriteFullFileBatch(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    const PrjFS_FullFileEntry*              entries,
+    _In_    unsigned int                            entryCount,
+    _Out_   PrjFS_Result*                           entryResults)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_WriteFullFileBatch("
+        << directoryRelativePath << ", "
+        << entries << ", "
+        << entryCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == directoryRelativePath ||
+        (nullptr == entries && entryCount > 0))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    int directoryFd = OpenInRoot(instance, directoryRelativePath, O_RDONLY | O_DIRECTORY);
+    if (directoryFd < 0)
+    {
+        return PrjFS_Result_EPathNotFound;
+    }
+    
+    PrjFS_Result result = PrjFS_Result_Success;
+    for (unsigned int i = 0; i < entryCount; ++i)
+    {
+        PrjFS_Result entryResult = WriteFullFileEntryAt(instance->tempDirectoryFd, directoryFd, entries[i]);
+        if (nullptr != entryResults)
+        {
+            entryResults[i] = entryResult;
+        }
+        
+        if (PrjFS_Result_Success != entryResult && PrjFS_Result_Success == result)
+        {
+            result = entryResult;
+        }
+    }
+    
+    close(directoryFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_UpdatePlaceholderFileIfNeeded(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned long                           fileSize,
+    _In_    PrjFS_UpdateType                        updateFlags,
+    _Out_   PrjFS_UpdateFailureCause*               failureCause)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_UpdatePlaceholderFileIfNeeded("
+        << relativePath << ", "
+        << (int)providerId[0] << ", "
+        << (int)contentId[0] << ", "
+        << fileSize << ", "
+        << std::hex << updateFlags << std::dec << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == relativePath ||
+        nullptr == providerId ||
+        nullptr == contentId ||
+        nullptr == failureCause)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    *failureCause = PrjFS_UpdateFailureCause_Invalid;
+    
+    int fd = OpenInRoot(instance, relativePath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EFileNotFound : PrjFS_Result_EIOError;
+    }
+    
+    struct stat fileAttributes;
+    PrjFSFileXAttrData xattrData;
+    bool isFullFile;
+    PrjFS_Result result = CheckPlaceholderIsUpdatable(fd, updateFlags, &fileAttributes, &xattrData, &isFullFile, failureCause);
+    if (PrjFS_Result_Success != result)
+    {
+        close(fd);
+        return result;
+    }
+    
+    if (!isFullFile &&
+        static_cast<unsigned long>(fileAttributes.st_size) == fileSize &&
+        0 == memcmp(xattrData.contentId, contentId, PrjFS_PlaceholderIdLength) &&
+        0 == memcmp(xattrData.providerId, providerId, PrjFS_PlaceholderIdLength))
+    {
+        // Already up to date, whether or not it has been hydrated
+        close(fd);
+        return PrjFS_Result_Success;
+    }
+    
+    result = ResetToEmptyPlaceholder(instance->rootFd, relativePath, fd, fileAttributes, fileSize, providerId, contentId) ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+    // Even if it failed, the flags may have been changed
+    SignalKernelFileFlagsChanged(instance, fd);
+    close(fd);
+    return result;
+}
+
+PrjFS_Result PrjFS_DehydrateFile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _Out_   PrjFS_UpdateFailureCause*               failureCause)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_DehydrateFile(" << relativePath << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == relativePath ||
+        nullptr == failureCause)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (instance->flags & PrjFS_InstanceFlags_ReadOnly)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    off_t reclaimedBytes;
+    return DehydrateFile(instance, relativePath, failureCause, &reclaimedBytes);
+}
+
+PrjFS_Result PrjFS_DehydrateTree(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileFilterCallback*               filter,
+    _In_    void*                                   filterContext,
+    _In_    unsigned long                           minimumIdleSeconds,
+    _In_    unsigned long                           bytesToReclaim,
+    _Out_   unsigned long*                          reclaimedBytes)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_DehydrateTree("
+        << directoryRelativePath << ", "
+        << filter << ", "
+        << minimumIdleSeconds << ", "
+        << bytesToReclaim << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == directoryRelativePath || nullptr == reclaimedBytes)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    *reclaimedBytes = 0;
+    if (instance->flags & PrjFS_InstanceFlags_ReadOnly)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    std::vector<DehydrationCandidate> candidates;
+    std::vector<string> directories(1, directoryRelativePath);
+    time_t idleSince = time(nullptr) - static_cast<time_t>(minimumIdleSeconds);
+    while (!directories.empty())
+    {
+        string relativePath = std::move(directories.back());
+        directories.pop_back();
+        
+        PrjFS_Result result = FindDehydrationCandidates(instance, relativePath, filter, filterContext, idleSince, &directories, &candidates);
+        if (PrjFS_Result_Success != result)
+        {
+            return result;
+        }
+    }
+    
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](const DehydrationCandidate& left, const DehydrationCandidate& right)
+        {
+            return left.lastAccessTime < right.lastAccessTime;
+        });
+    
+    for (const DehydrationCandidate& candidate : candidates)
+    {
+        if (0 != bytesToReclaim && *reclaimedBytes >= bytesToReclaim)
+        {
+            break;
+        }
+        
+        PrjFS_UpdateFailureCause failureCause;
+        off_t fileReclaimedBytes;
+        if (PrjFS_Result_Success == DehydrateFile(instance, candidate.relativePath.c_str(), &failureCause, &fileReclaimedBytes))
+        {
+            *reclaimedBytes += fileReclaimedBytes;
+        }
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_DeleteFile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    PrjFS_UpdateType                        updateFlags,
+    _Out_   PrjFS_UpdateFailureCause*               failureCause)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_DeleteFile("
+        << relativePath << ", "
+        << std::hex << updateFlags << std::dec << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance ||
+        nullptr == relativePath ||
+        nullptr == failureCause)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    *failureCause = PrjFS_UpdateFailureCause_Invalid;
+    
+    int fd = OpenInRoot(instance, relativePath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EFileNotFound : PrjFS_Result_EIOError;
+    }
+    
+    struct stat fileAttributes;
+    if (fstat(fd, &fileAttributes))
+    {
+        close(fd);
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (S_ISDIR(fileAttributes.st_mode))
+    {
+        close(fd);
+        if (!(fileAttributes.st_flags & FileFlags_IsInVirtualizationRoot) &&
+            !(updateFlags & PrjFS_UpdateType_AllowDirtyData))
+        {
+            *failureCause = PrjFS_UpdateFailureCause_FullFile;
+            return PrjFS_Result_EInvalidOperation;
+        }
+        
+        // Only empty directories can be removed
+        return unlinkat(instance->rootFd, relativePath, AT_REMOVEDIR) ? PrjFS_Result_EIOError : PrjFS_Result_Success;
+    }
+    
+    PrjFSFileXAttrData xattrData;
+    bool isFullFile;
+    PrjFS_Result result = CheckPlaceholderIsUpdatable(fd, updateFlags, &fileAttributes, &xattrData, &isFullFile, failureCause);
+    
+    // Empty placeholders are marked UF_NOUNLINK
+    if (PrjFS_Result_Success == result &&
+        !UpdateFileFlags(fd, 0, FileFlags_IsEmpty))
+    {
+        result = PrjFS_Result_EIOError;
+    }
+    
+    close(fd);
+    
+    if (PrjFS_Result_Success == result && unlinkat(instance->rootFd, relativePath, 0))
+    {
+        result = PrjFS_Result_EIOError;
+    }
+    
+    return result;
+}
+
+PrjFS_Result PrjFS_WriteFileContents(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    const void*                             bytes,
+    _In_    unsigned int                            byteCount)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_WriteFile("
+        << fileHandle->fd << ", "
+        << (int)((char*)bytes)[0] << ", "
+        << (int)((char*)bytes)[1] << ", "
+        << (int)((char*)bytes)[2] << ", "
+        << byteCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == fileHandle ||
+        fileHandle->fd < 0 ||
+        nullptr == bytes)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (!WriteAll(fileHandle->fd, bytes, byteCount))
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    fileHandle->bytesWritten += byteCount;
+    ReportHydrationProgressIfDue(fileHandle);
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_WriteFileContentsV(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    const struct iovec*                     buffers,
+    _In_    unsigned int                            bufferCount)
+{
+#ifdef DEBUG
+    std::cout
+        << "PrjFS_WriteFileContentsV("
+        << fileHandle->fd << ", "
+        << buffers << ", "
+        << bufferCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == fileHandle ||
+        fileHandle->fd < 0 ||
+        (nullptr == buffers && bufferCount > 0) ||
+        bufferCount > INT_MAX)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // writev may write only part of the data, so work on a copy that can be advanced
+    std::vector<struct iovec> remainingBuffers(buffers, buffers + bufferCount);
+    if (!WriteAllVector(fileHandle->fd, remainingBuffers.data(), static_cast<int>(bufferCount)))
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    for (unsigned int i = 0; i < bufferCount; ++i)
+    {
+        fileHandle->bytesWritten += buffers[i].iov_len;
+    }
+    
+    ReportHydrationProgressIfDue(fileHandle);
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_WriteFileContentsFromFile(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    int                                     sourceFd)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_WriteFileContentsFromFile(" << fileHandle->fd << ", " << sourceFd << ")" << std::endl;
+#endif
+    
+    if (nullptr == fileHandle ||
+        fileHandle->fd < 0 ||
+        sourceFd < 0)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // clonefile cannot be used here: it always creates a new file, while the kernel is
+    // holding the placeholder's vnode for the I/O that triggered hydration. fcopyfile
+    // copies within libSystem using the file system's preferred block size.
+    struct stat sourceAttributes;
+    if (fstat(sourceFd, &sourceAttributes) ||
+        -1 == lseek(sourceFd, 0, SEEK_SET) ||
+        0 != fcopyfile(sourceFd, fileHandle->fd, nullptr, COPYFILE_DATA))
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    fileHandle->bytesWritten += sourceAttributes.st_size;
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_WriteFileContentsFromPath(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    const char*                             sourceFullPath)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_WriteFileContentsFromPath(" << fileHandle->fd << ", " << sourceFullPath << ")" << std::endl;
+#endif
+    
+    if (nullptr == sourceFullPath)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    int sourceFd = open(sourceFullPath, O_RDONLY);
+    if (sourceFd < 0)
+    {
+        return PrjFS_Result_EFileNotFound;
+    }
+    
+    PrjFS_Result result = PrjFS_WriteFileContentsFromFile(fileHandle, sourceFd);
+    close(sourceFd);
+    return result;
+}
+
+PrjFS_Result PrjFS_MapFileContents(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    unsigned long long                      offset,
+    _In_    unsigned int                            byteCount,
+    _Out_   void**                                  buffer)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_MapFileContents(" << fileHandle << ", " << offset << ", " << byteCount << ")" << std::endl;
+#endif
+    
+    if (nullptr == fileHandle ||
+        fileHandle->fd < 0 ||
+        nullptr == buffer ||
+        0 == byteCount ||
+        offset > static_cast<unsigned long long>(fileHandle->placeholderSize) ||
+        byteCount > static_cast<unsigned long long>(fileHandle->placeholderSize) - offset)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (nullptr != fileHandle->mappedPages)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    // mmap only takes page aligned offsets
+    unsigned long long pageOffset = offset % static_cast<unsigned long long>(getpagesize());
+    size_t mappedPagesLength = static_cast<size_t>(pageOffset) + byteCount;
+    void* mappedPages = mmap(nullptr, mappedPagesLength, PROT_READ | PROT_WRITE, MAP_SHARED, fileHandle->fd, static_cast<off_t>(offset - pageOffset));
+    if (MAP_FAILED == mappedPages)
+    {
+        return ENOMEM == errno ? PrjFS_Result_EOutOfMemory : PrjFS_Result_EIOError;
+    }
+    
+    fileHandle->mappedPages = mappedPages;
+    fileHandle->mappedPagesLength = mappedPagesLength;
+    fileHandle->mappedByteCount = byteCount;
+    *buffer = static_cast<char*>(mappedPages) + pageOffset;
+    return PrjFS_Result_Success;
+}
+
+// The pages are shared with the file's cache, so the contents are visible to
+// readers as soon as the provider has written them; unmapping doesn't copy them.
+PrjFS_Result PrjFS_CommitMappedFileContents(
+    _In_    const PrjFS_FileHandle*                 fileHandle)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_CommitMappedFileContents(" << fileHandle << ")" << std::endl;
+#endif
+    
+    if (nullptr == fileHandle)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (nullptr == fileHandle->mappedPages)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    unsigned int byteCount = fileHandle->mappedByteCount;
+    UnmapFileContents(fileHandle);
+    
+    fileHandle->bytesWritten += byteCount;
+    ReportHydrationProgressIfDue(fileHandle);
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetHydrationOptions(
+    _In_    unsigned int                            options,
+    _In_    unsigned long                           noCacheMinimumFileSize)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetHydrationOptions(" << options << ", " << noCacheMinimumFileSize << ")" << std::endl;
+#endif
+    
+    const unsigned int validOptions =
+        PrjFS_HydrationOptions_Preallocate |
+        PrjFS_HydrationOptions_NoCacheForLargeFiles |
+        PrjFS_HydrationOptions_DeduplicateContent;
+    if (0 != (options & ~validOptions))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    s_noCacheMinimumFileSize = noCacheMinimumFileSize;
+    s_hydrationOptions = options;
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_SetContentCache(
+    _In_    const char*                             cacheDirectoryFullPath,
+    _In_    unsigned long long                      maxSizeBytes)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_SetContentCache(" << (nullptr == cacheDirectoryFullPath ? "(null)" : cacheDirectoryFullPath) << ", " << maxSizeBytes << ")" << std::endl;
+#endif
+    
+    if (nullptr == cacheDirectoryFullPath)
+    {
+        mutex_lock lock(s_contentCacheMutex);
+        s_contentCache.reset();
+        return PrjFS_Result_Success;
+    }
+    
+    if (0 == maxSizeBytes)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // Caching the contents of placeholders inside a root would have them intercepted
+    if (IsInsideVirtualizationRoot(cacheDirectoryFullPath))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    int directoryFd = open(cacheDirectoryFullPath, O_RDONLY | O_DIRECTORY);
+    if (directoryFd < 0)
+    {
+        return PrjFS_Result_EPathNotFound;
+    }
+    
+    std::shared_ptr<ContentCache> cache = std::make_shared<ContentCache>();
+    cache->directoryFd = directoryFd;
+    cache->maxSizeBytes = maxSizeBytes;
+    
+    std::vector<ContentCacheEntry> entries;
+    cache->sizeBytes = ScanContentCache(directoryFd, &entries);
+    if (cache->sizeBytes > maxSizeBytes)
+    {
+        EvictFromContentCache(cache.get());
+    }
+    
+    mutex_lock lock(s_contentCacheMutex);
+    s_contentCache = cache;
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_GetStatistics(
+    _In_    PrjFS_Instance*                         instance,
+    _Out_   PrjFS_Statistics*                       statistics)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_GetStatistics(" << instance << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == statistics)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    const InstanceStatistics& instanceStatistics = instance->statistics;
+    statistics->DequeuedMessageCount = instanceStatistics.dequeuedMessageCount.load(std::memory_order_relaxed);
+    statistics->CoalescedRequestCount = instanceStatistics.coalescedRequestCount.load(std::memory_order_relaxed);
+    statistics->CancelledRequestCount = instanceStatistics.cancelledRequestCount.load(std::memory_order_relaxed);
+    statistics->InFlightCallbackCount = instanceStatistics.inFlightCallbackCount.load(std::memory_order_relaxed);
+    ReadLatencyHistogram(instanceStatistics.enumerateDirectoryLatency, &statistics->EnumerateDirectoryLatency);
+    ReadLatencyHistogram(instanceStatistics.getFileStreamLatency, &statistics->GetFileStreamLatency);
+    statistics->FileFlagsErrorCount = s_fileFlagsErrorCount.load(std::memory_order_relaxed);
+    statistics->XAttrErrorCount = s_xattrErrorCount.load(std::memory_order_relaxed);
+    
+    statistics->PendingRequestPathCount = 0;
+    for (PendingRequestShard& shard : instance->pendingRequestShards)
+    {
+        mutex_lock lock(shard.mutex);
+        statistics->PendingRequestPathCount += static_cast<unsigned int>(shard.messageIDs.size());
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_GetOnDiskFileState(
+    _In_    const char*                             fullPath,
+    _Out_   unsigned int*                           fileState)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_GetOnDiskFileState(" << fullPath << ")" << std::endl;
+#endif
+    
+    if (nullptr == fullPath || nullptr == fileState)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    struct stat fileAttributes;
+    if (lstat(fullPath, &fileAttributes))
+    {
+        return ENOENT == errno ? PrjFS_Result_EFileNotFound : PrjFS_Result_EIOError;
+    }
+    
+    PrjFS_FileState state = GetFileStateFromFlags(S_ISDIR(fileAttributes.st_mode), fileAttributes.st_flags);
+    if (PrjFS_FileState_Invalid == state)
+    {
+        state = HasPlaceholderFileXAttr(AT_FDCWD, fullPath) ? PrjFS_FileState_HydratedPlaceholder : PrjFS_FileState_Full;
+    }
+    
+    *fileState = state;
+    return PrjFS_Result_Success;
+}
+
+PrjFS_Result PrjFS_ScanTreeState(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileStateCallback*                callback,
+    _In_    void*                                   callbackContext)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_ScanTreeState(" << directoryRelativePath << ", " << callback << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == directoryRelativePath || nullptr == callback)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    return WalkTreeInParallel(
+        instance->virtualizationRootFullPath.c_str(),
+        directoryRelativePath,
+        [callback, callbackContext](int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)
+        {
+            // Records point into relativePaths, so it must not reallocate once they are filled in
+            std::vector<string> relativePaths(entries.size(), directoryRelativePath);
+            std::vector<PrjFS_FileStateRecord> records(entries.size());
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                const BulkDirectoryEntry& entry = entries[i];
+                string& relativePath = relativePaths[i];
+                if (!relativePath.empty())
+                {
+                    relativePath += '/';
+                }
+                
+                relativePath += entry.name;
+                
+                bool isDirectory = VDIR == entry.objectType;
+                PrjFS_FileState state = GetFileStateFromFlags(isDirectory, entry.flags);
+                if (PrjFS_FileState_Invalid == state)
+                {
+                    state = HasPlaceholderFileXAttr(directoryFd, entry.name) ? PrjFS_FileState_HydratedPlaceholder : PrjFS_FileState_Full;
+                }
+                
+                records[i] = PrjFS_FileStateRecord
+                {
+                    relativePath.c_str(),
+                    state,
+                    isDirectory,
+                    static_cast<unsigned long>(entry.fileSize),
+                    entry.modificationTime,
+                };
+            }
+            
+            callback(records.data(), static_cast<unsigned int>(records.size()), callbackContext);
+            return PrjFS_Result_Success;
+        });
+}
+
+PrjFS_Result PrjFS_FindIncompletePlaceholders(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_IncompletePlaceholderCallback*    callback,
+    _In_    void*                                   callbackContext)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_FindIncompletePlaceholders(" << directoryRelativePath << ", " << callback << ")" << std::endl;
+#endif
+    
+    if (nullptr == instance)
+    {
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    if (nullptr == directoryRelativePath || nullptr == callback)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    return WalkTreeInParallel(
+        instance->virtualizationRootFullPath.c_str(),
+        directoryRelativePath,
+        [callback, callbackContext](int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)
+        {
+            string relativePath = directoryRelativePath;
+            if (!relativePath.empty())
+            {
+                relativePath += '/';
+            }
+            
+            size_t nameOffset = relativePath.size();
+            for (const BulkDirectoryEntry& entry : entries)
+            {
+                PrjFS_PlaceholderDefect defect = GetPlaceholderDefect(directoryFd, entry);
+                if (PrjFS_PlaceholderDefect_None != defect)
+                {
+                    relativePath.resize(nameOffset);
+                    relativePath += entry.name;
+                    callback(relativePath.c_str(), defect, callbackContext);
+                }
+            }
+            
+            return PrjFS_Result_Success;
+        });
+}
+
+PrjFS_Result PrjFS_CompleteCommand(
+    _In_    unsigned long                           commandId,
+    _In_    PrjFS_Result                            result)
+{
+#ifdef DEBUG
+    std::cout << "PrjFS_CompleteCommand(" << commandId << ", " << result << ")" << std::endl;
+#endif
+    
+    if (PrjFS_Result_Pending == result)
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    PendingCommand command;
+    {
+        mutex_lock lock(s_PendingCommandMutex);
+        unordered_map<uint64_t, PendingCommand>::iterator commandFound = s_PendingCommands.find(commandId);
+        if (commandFound == s_PendingCommands.end())
+        {
+            // Unknown or already completed
+            return PrjFS_Result_EInvalidArgs;
+        }
+        
+        command = std::move(commandFound->second);
+        s_PendingCommands.erase(commandFound);
+    }
+    
+    PrjFS_Result finishResult = FinishCommand(command, result);
+    if (command.callbackReturned)
+    {
+        EndInstanceWork(command.instance);
+    }
+    
+    if (PrjFS_Result_Success == result && PrjFS_Result_Success != finishResult)
+    {
+        // The provider's data could not be committed, the kernel was told the request failed
+        return PrjFS_Result_EFileSizeMismatch == finishResult ? finishResult : PrjFS_Result_EIOError;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+// Private functions
+
+
+static Message ParseMessageMemory(const void* messageMemory, uint32_t size)
+{
+    const MessageHeader* header = static_cast<const MessageHeader*>(messageMemory);
+    if (header->pathSizeBytes + header->fromPathSizeBytes + header->fileXattrSizeBytes + sizeof(*header) != size)
+    {
+        fprintf(stderr, "ParseMessageMemory: invariant failed, bad message? PathSizeBytes = %u, FromPathSizeBytes = %u, FileXattrSizeBytes = %u, message size = %u, expecting %zu\n",
+            header->pathSizeBytes, header->fromPathSizeBytes, header->fileXattrSizeBytes, size, header->pathSizeBytes + header->fromPathSizeBytes + header->fileXattrSizeBytes + sizeof(*header));
+        abort();
+    }
+            
+    const char* path = nullptr;
+    if (header->pathSizeBytes > 0)
+    {
+        path = static_cast<const char*>(messageMemory) + sizeof(*header);
+        
+        // Path string should fit exactly in reserved memory, with nul terminator in end position
+        assert(strnlen(path, header->pathSizeBytes) == header->pathSizeBytes - 1);
+    }
+    
+    const char* fromPath = nullptr;
+    if (header->fromPathSizeBytes > 0)
+    {
+        fromPath = static_cast<const char*>(messageMemory) + sizeof(*header) + header->pathSizeBytes;
+        assert(strnlen(fromPath, header->fromPathSizeBytes) == header->fromPathSizeBytes - 1);
+    }
+    
+    const void* fileXattr = nullptr;
+    if (header->fileXattrSizeBytes > 0)
+    {
+        fileXattr = static_cast<const char*>(messageMemory) + sizeof(*header) + header->pathSizeBytes + header->fromPathSizeBytes;
+    }
+    
+    return Message { header, path, fromPath, fileXattr };
+}
+
+static RequestPriority GetRequestPriority(const MessageHeader* header)
+{
+    {
+        mutex_lock lock(s_processRequestPriorityMutex);
+        if (!s_processRequestPriorities.empty())
+        {
+            unordered_map<string, RequestPriority>::const_iterator found = s_processRequestPriorities.find(header->procname);
+            if (found != s_processRequestPriorities.end())
+            {
+                return found->second;
+            }
+        }
+    }
+    
+    return GetThreadRequestPriority(header->pid, header->threadId);
+}
+
+// Maps the QoS of the thread that triggered a request, which is blocked in the
+// kernel until the request completes, to a request priority. QoS classes set
+// these base priorities: user-interactive 47, user-initiated 37, default 31,
+// utility 20, background 4.
+static RequestPriority GetThreadRequestPriority(int32_t pid, uint64_t threadId)
+{
+    struct proc_threadinfo threadInfo;
+    if (0 == threadId ||
+        sizeof(threadInfo) != proc_pidinfo(pid, PROC_PIDTHREADID64INFO, threadId, &threadInfo, sizeof(threadInfo)))
+    {
+        // The thread is gone, or belongs to another user's process, which we may not inspect
+        return RequestPriority_Normal;
+    }
+    
+    if (threadInfo.pth_priority >= 37)
+    {
+        return RequestPriority_High;
+    }
+    
+    if (threadInfo.pth_priority <= 20)
+    {
+        return RequestPriority_Low;
+    }
+    
+    return RequestPriority_Normal;
+}
+
+static PendingRequestShard& GetPendingRequestShard(PrjFS_Instance* instance, const char* path)
+{
+    // Use the high bits, the maps inside each shard bucket by the low bits
+    size_t hash = PathHash()(path);
+    return instance->pendingRequestShards[(hash >> 32) % PendingRequestShardCount];
+}
+
+static void* AllocateMessageBuffer(uint32_t messageSize)
+{
+    if (messageSize > MessageBufferSize)
+    {
+        return malloc(messageSize);
+    }
+    
+    {
+        mutex_lock lock(s_freeMessageBufferMutex);
+        if (!s_freeMessageBuffers.empty())
+        {
+            void* messageMemory = s_freeMessageBuffers.back();
+            s_freeMessageBuffers.pop_back();
+            return messageMemory;
+        }
+    }
+    
+    return malloc(MessageBufferSize);
+}
+
+static void FreeMessageBuffer(void* messageMemory)
+{
+    // The size was validated against the header when the message was parsed
+    const MessageHeader* header = static_cast<const MessageHeader*>(messageMemory);
+    if (sizeof(*header) + header->pathSizeBytes + header->fromPathSizeBytes + header->fileXattrSizeBytes <= MessageBufferSize)
+    {
+        mutex_lock lock(s_freeMessageBufferMutex);
+        if (s_freeMessageBuffers.size() < MaxFreeMessageBuffers)
+        {
+            s_freeMessageBuffers.push_back(messageMemory);
+            return;
+        }
+    }
+    
+    free(messageMemory);
+}
+
+// Sets up the instance's message queues, each drained on its own serial dispatch
+// queue, with their dispatch sources suspended. On failure, messageQueueCount is
+// lowered to the number of queues that were set up.
+static bool InitMessageQueues(PrjFS_Instance* instance)
+{
+    for (uint32_t i = 0; i < instance->messageQueueCount; ++i)
+    {
+        InstanceMessageQueue& queue = instance->messageQueues[i];
+        queue.index = i;
+        queue.dispatchQueue = dispatch_queue_create("PrjFS Kernel Message Handling", DISPATCH_QUEUE_SERIAL);
+        if (!PrjFSService_DataQueueInit(
+                &queue.resources,
+                instance->kernelServiceConnection,
+                ProviderPortType_MessageQueue + i,
+                ProviderMemoryType_MessageQueue + i,
+                queue.dispatchQueue))
+        {
+            dispatch_release(queue.dispatchQueue);
+            instance->messageQueueCount = i;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// The dispatch sources must already have been cancelled, and their event
+// handlers must no longer be running.
+static void CleanupMessageQueues(PrjFS_Instance* instance)
+{
+    for (uint32_t i = 0; i < instance->messageQueueCount; ++i)
+    {
+        InstanceMessageQueue& queue = instance->messageQueues[i];
+        PrjFSService_DataQueueCleanup(&queue.resources, instance->kernelServiceConnection, ProviderMemoryType_MessageQueue + i);
+        dispatch_release(queue.dispatchQueue);
+    }
+}
+
+// Runs on the queue's serial dispatch queue whenever the kernel signals it
+static void HandleMessageQueueEvent(PrjFS_Instance* instance, InstanceMessageQueue* queue)
+{
+    ClearMachNotification(queue->resources.notificationPort);
+    
+    bool dequeuedAny = false;
+    while (1)
+    {
+        IODataQueueEntry* entry = IODataQueuePeek(queue->resources.queueMemory);
+        if (nullptr == entry)
+        {
+            // No more items in queue
+            if (dequeuedAny)
+            {
+                // Kernel threads may be waiting for space to enqueue
+                SignalKernelMessageQueueDrained(instance->kernelServiceConnection, queue->index);
+            }
+            
+            break;
+        }
+        
+        dequeuedAny = true;
+        instance->statistics.dequeuedMessageCount.fetch_add(1, std::memory_order_relaxed);
+        
+        uint32_t messageSize = entry->size;
+        if (messageSize < sizeof(Message))
+        {
+            cerr << "Bad message size: got " << messageSize << " bytes, expected minimum of " << sizeof(Message) << ", skipping. Kernel/user version mismatch?\n";
+            IODataQueueDequeue(queue->resources.queueMemory, nullptr, nullptr);
+            continue;
+        }
+        
+        void* messageMemory = AllocateMessageBuffer(messageSize);
+        uint32_t dequeuedSize = messageSize;
+        IOReturn result = IODataQueueDequeue(queue->resources.queueMemory, messageMemory, &dequeuedSize);
+        if (kIOReturnSuccess != result || dequeuedSize != messageSize)
+        {
+            cerr << "Unexpected result dequeueing message - result 0x" << std::hex << result << " dequeued " << dequeuedSize << "/" << messageSize << " bytes\n";
+            abort();
+        }
+        
+        Message message = ParseMessageMemory(messageMemory, messageSize);
+        uint64_t messageId = message.messageHeader->messageId;
+        kdebug_signpost_start(PrjFSSignpost_DequeueMessage, messageId, message.messageHeader->messageType, 0, 0);
+        
+        if (MessageType_KtoU_Cancel == message.messageHeader->messageType)
+        {
+            // Handled right here, so that it doesn't wait behind the requests it cancels
+            HandleCancelMessage(instance, messageId);
+            FreeMessageBuffer(messageMemory);
+            kdebug_signpost_end(PrjFSSignpost_DequeueMessage, messageId, 0, 0, 0);
+            continue;
+        }
+        
+        // All other messages include a path
+        assert(message.path != nullptr);
+        
+        if (IsNotificationMessageType(static_cast<MessageType>(message.messageHeader->messageType)))
+        {
+            // Every notification is delivered, even if a request for the same path is in progress
+            BeginInstanceWork(instance);
+            RequestWorkerPool_Enqueue(
+                RequestLane_Hydration,
+                GetRequestPriority(message.messageHeader),
+                [instance, message, messageMemory]
+                {
+                    HandleKernelNotification(instance, message, messageMemory);
+                    EndInstanceWork(instance);
+                });
+            kdebug_signpost_end(PrjFSSignpost_DequeueMessage, messageId, 0, 0, 0);
+            continue;
+        }
+        
+        if (MessageType_KtoU_PrefetchHint == message.messageHeader->messageType)
+        {
+            // Only advisory, so it must not hold up (or be coalesced with) the
+            // requests the kernel is waiting for
+            BeginInstanceWork(instance);
+            RequestWorkerPool_Enqueue(
+                RequestLane_Hydration,
+                RequestPriority_Low,
+                [instance, message, messageMemory]
+                {
+                    HandlePrefetchHint(instance, message, messageMemory);
+                    EndInstanceWork(instance);
+                });
+            kdebug_signpost_end(PrjFSSignpost_DequeueMessage, messageId, 0, 0, 0);
+            continue;
+        }
+
+        // Ensure we don't run more than one request handler at once for the same file
+        {
+            PendingRequestShard& shard = GetPendingRequestShard(instance, message.path);
+            mutex_lock lock(shard.mutex);
+            typedef PendingRequestMessageMap::iterator PendingMessageIterator;
+            PendingMessageIterator file_messages_found = shard.messageIDs.find(message.path);
+            if (file_messages_found == shard.messageIDs.end())
+            {
+                // Not handling this file/dir yet
+                std::pair<PendingMessageIterator, bool> inserted =
+                    shard.messageIDs.insert(std::make_pair(message.path, PendingMessageIdList(message.messageHeader->messageId)));
+                assert(inserted.second);
+            }
+            else
+            {
+                // Already a handler running for this path, don't handle it again.
+                file_messages_found->second.Add(message.messageHeader->messageId);
+                instance->statistics.coalescedRequestCount.fetch_add(1, std::memory_order_relaxed);
+                FreeMessageBuffer(messageMemory);
+                kdebug_signpost_end(PrjFSSignpost_DequeueMessage, messageId, 0, 0, 0);
+                continue;
+            }
+        }
+        
+
+        RequestLane lane =
+            MessageType_KtoU_EnumerateDirectory == message.messageHeader->messageType ||
+            MessageType_KtoU_EnumerateDirectoryRecursively == message.messageHeader->messageType
+            ? RequestLane_Enumeration
+            : RequestLane_Hydration;
+        BeginInstanceWork(instance);
+        RequestWorkerPool_Enqueue(
+            lane,
+            GetRequestPriority(message.messageHeader),
+            [instance, message, messageMemory]
+            {
+                HandleKernelRequest(instance, message, messageMemory);
+                EndInstanceWork(instance);
+            });
+        kdebug_signpost_end(PrjFSSignpost_DequeueMessage, messageId, 0, 0, 0);
+    }
+}
+
+static void HandleKernelRequest(PrjFS_Instance* instance, Message request, void* messageMemory)
+{
+    PrjFS_Result result = PrjFS_Result_EIOError;
+    
+    const MessageHeader* requestHeader = request.messageHeader;
+    PendingCommand command = { instance, static_cast<MessageType>(requestHeader->messageType), request.path, messageMemory, nullptr, false };
+    if (instance->isStopping)
+    {
+        FinishCommand(command, PrjFS_Result_EInvalidOperation);
+        return;
+    }
+    
+    // Conversions don't read anything, so there is nothing to prefetch on replay
+    if (instance->accessRecordingActive &&
+        ReplayedMessageId != requestHeader->messageId &&
+        MessageType_KtoU_ConvertFileToFull != requestHeader->messageType)
+    {
+        // Replay enumerates the subtree again as the process walks it
+        RecordAccess(
+            instance,
+            MessageType_KtoU_EnumerateDirectoryRecursively == requestHeader->messageType
+            ? MessageType_KtoU_EnumerateDirectory
+            : static_cast<MessageType>(requestHeader->messageType),
+            request.path);
+    }
+    
+    uint64_t commandId = s_nextCommandId++;
+    if (!StartPendingRequest(instance, request.path, commandId))
+    {
+        // Nobody in the kernel is waiting for the result any more
+        FinishCommand(command, PrjFS_Result_EInvalidOperation);
+        return;
+    }
+    
+    switch (requestHeader->messageType)
+    {
+        case MessageType_KtoU_EnumerateDirectory:
+        {
+            result = HandleEnumerateDirectoryRequest(instance, commandId, requestHeader, request.path, &command);
+            break;
+        }
+            
+        case MessageType_KtoU_EnumerateDirectoryRecursively:
+        {
+            // The kernel waits until the whole subtree is there. If the provider
+            // completes the directory itself later, its subdirectories are left
+            // to requests of their own.
+            result = HandleEnumerateDirectoryRequest(instance, commandId, requestHeader, request.path, &command);
+            if (PrjFS_Result_Success == result)
+            {
+                EnumerateSubtree(instance, request.path, requestHeader->procname);
+            }
+            
+            break;
+        }
+            
+        case MessageType_KtoU_HydrateFile:
+        {
+            result = HandleHydrateFileRequest(instance, commandId, requestHeader, request.path, &command);
+            break;
+        }
+            
+        case MessageType_KtoU_ConvertFileToFull:
+        {
+            result = HandleConvertFileToFullRequest(instance, commandId, requestHeader, request.path);
+            break;
+        }
+    }
+    
+    if (PrjFS_Result_Pending != result)
+    {
+        FinishCommand(command, result);
+    }
+}
+
+static PrjFS_Result HandleEnumerateDirectoryRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path, PendingCommand* command)
+{
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandleKernelRequest: MessageType_KtoU_EnumerateDirectory" << std::endl;
+#endif
+    
+    if (nullptr != instance->callbacks.EnumerateDirectoryBulk)
+    {
+        BeginCallback(instance, command);
+        return EnumerateDirectoryInBulk(instance, commandId, request, path);
+    }
+    
+    PrjFSFileXAttrData directoryIds;
+    ReadDirectoryIds(instance, request, path, -1, &directoryIds);
+    
+    BeginCallback(instance, command);
+    AddPendingCommand(commandId, *command);
+    kdebug_signpost_start(PrjFSSignpost_Callback, request->messageId, MessageType_KtoU_EnumerateDirectory, 0, 0);
+    PrjFS_Result callbackResult = instance->callbacks.EnumerateDirectory(
+        commandId,
+        path,
+        directoryIds.providerId,
+        directoryIds.contentId,
+        request->pid,
+        request->procname);
+    kdebug_signpost_end(PrjFSSignpost_Callback, request->messageId, callbackResult, 0, 0);
+    return ReclaimPendingCommand(commandId, callbackResult);
+}
+
+static PrjFS_Result HandleHydrateFileRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path, PendingCommand* command)
+{
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandleKernelRequest: MessageType_KtoU_HydrateFile" << std::endl;
+#endif
+    
+    PrjFS_FileHandle* fileHandle = new PrjFS_FileHandle();
+    fileHandle->bytesWritten = 0;
+    fileHandle->instance = instance;
+    fileHandle->messageId = request->messageId;
+    fileHandle->bytesReportedToKernel = 0;
+    fileHandle->mappedPages = nullptr;
+    fileHandle->mappedPagesLength = 0;
+    fileHandle->mappedByteCount = 0;
+    
+    // Without O_CREAT the file must already exist. Writes start at offset 0, so the
+    // provider overwrites the empty contents, and are not buffered in user space.
+    // The kernel sends the xattr and size along with the request; if it couldn't,
+    // they are read through the same fd so the path is resolved at most once.
+    fileHandle->fd = OpenRequestTarget(instance, request, path, O_RDWR);
+    PrjFSFileXAttrData xattrData = {};
+    struct stat fileAttributes = {};
+    fileAttributes.st_size = static_cast<off_t>(request->fileSize);
+    if (fileHandle->fd < 0 ||
+        !ReadRequestFileXAttr(request, fileHandle->fd, &xattrData) ||
+        (MessageFileType_File != request->fileType && fstat(fileHandle->fd, &fileAttributes)))
+    {
+        if (fileHandle->fd >= 0)
+        {
+            close(fileHandle->fd);
+        }
+        
+        delete fileHandle;
+        return PrjFS_Result_EIOError;
+    }
+    
+    fileHandle->placeholderSize = fileAttributes.st_size;
+    memcpy(fileHandle->contentId, xattrData.contentId, PrjFS_PlaceholderIdLength);
+    PrepareFileForHydration(fileHandle->fd, fileHandle->placeholderSize);
+    
+    // The handle must outlive this function if the provider completes the command asynchronously
+    command->fileHandle = fileHandle;
+    
+    if (HydrateFromDuplicateContent(instance, fileHandle, path) ||
+        HydrateFromContentCache(fileHandle))
+    {
+        return PrjFS_Result_Success;
+    }
+    
+    BeginCallback(instance, command);
+    AddPendingCommand(commandId, *command);
+    kdebug_signpost_start(PrjFSSignpost_Callback, request->messageId, MessageType_KtoU_HydrateFile, 0, 0);
+    PrjFS_Result callbackResult = instance->callbacks.GetFileStream(commandId, path, xattrData.providerId, xattrData.contentId, request->pid, request->procname, fileHandle);
+    kdebug_signpost_end(PrjFSSignpost_Callback, request->messageId, callbackResult, 0, 0);
+    return ReclaimPendingCommand(commandId, callbackResult);
+}
+
+// The placeholder is 0 bytes, so there are no contents to fetch, and whatever has
+// been written to it since its open must be kept. Clearing the empty flag is all
+// it takes; the provider is only told afterwards, and can't veto the conversion.
+static PrjFS_Result HandleConvertFileToFullRequest(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path)
+{
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandleKernelRequest: MessageType_KtoU_ConvertFileToFull" << std::endl;
+#endif
+    
+    int fd = OpenRequestTarget(instance, request, path, O_RDONLY);
+    PrjFSFileXAttrData xattrData = {};
+    bool converted =
+        fd >= 0 &&
+        ReadRequestFileXAttr(request, fd, &xattrData) &&
+        UpdateFileFlags(fd, 0, FileFlags_IsEmpty);
+    
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    
+    if (!converted)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (nullptr != instance->callbacks.NotifyOperation)
+    {
+        kdebug_signpost_start(PrjFSSignpost_Callback, request->messageId, MessageType_KtoU_ConvertFileToFull, 0, 0);
+        PrjFS_Result callbackResult = instance->callbacks.NotifyOperation(
+            commandId,
+            path,
+            xattrData.providerId,
+            xattrData.contentId,
+            request->pid,
+            request->procname,
+            false /* isDirectory */,
+            PrjFS_NotificationType_PreConvertToFull,
+            nullptr /* destinationRelativePath */);
+        kdebug_signpost_end(PrjFSSignpost_Callback, request->messageId, callbackResult, 0, 0);
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+// The bulk callback always completes synchronously, so the command is never registered
+static PrjFS_Result EnumerateDirectoryInBulk(PrjFS_Instance* instance, uint64_t commandId, const MessageHeader* request, const char* path)
+{
+    if (nullptr == s_directoryEntryBuffer)
+    {
+        // Value-initialized, so that entries start out with all zero ids
+        s_directoryEntryBuffer.reset(new (std::nothrow) PrjFS_DirectoryEntry[DirectoryEntryBufferCapacity]());
+        if (nullptr == s_directoryEntryBuffer)
+        {
+            return PrjFS_Result_EOutOfMemory;
+        }
+    }
+    
+    int directoryFd = OpenRequestTarget(instance, request, path, O_RDONLY | O_DIRECTORY);
+    if (directoryFd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    PrjFSFileXAttrData directoryIds;
+    ReadDirectoryIds(instance, request, path, directoryFd, &directoryIds);
+    
+    PrjFS_DirectoryEntry* entries = s_directoryEntryBuffer.get();
+    PrjFS_Result result;
+    unsigned int entryCount;
+    do
+    {
+        entryCount = 0;
+        kdebug_signpost_start(PrjFSSignpost_Callback, request->messageId, MessageType_KtoU_EnumerateDirectory, 0, 0);
+        result = instance->callbacks.EnumerateDirectoryBulk(
+            commandId,
+            path,
+            directoryIds.providerId,
+            directoryIds.contentId,
+            request->pid,
+            request->procname,
+            entries,
+            DirectoryEntryBufferCapacity,
+            &entryCount);
+        kdebug_signpost_end(PrjFSSignpost_Callback, request->messageId, result, 0, 0);
+        if (PrjFS_Result_Success != result)
+        {
+            if (PrjFS_Result_Pending == result)
+            {
+                result = PrjFS_Result_EInvalidOperation;
+            }
+            
+            break;
+        }
+        
+        if (entryCount > DirectoryEntryBufferCapacity)
+        {
+            result = PrjFS_Result_EInvalidArgs;
+            break;
+        }
+        
+        for (unsigned int i = 0; i < entryCount && PrjFS_Result_Success == result; ++i)
+        {
+            PrjFS_DirectoryEntry& entry = entries[i];
+            entry.Name[PrjFS_MaxDirectoryEntryNameLength] = '\0';
+            
+            PrjFS_PlaceholderEntry placeholder =
+            {
+                entry.Name,
+                entry.IsDirectory,
+                entry.ProviderId,
+                entry.ContentId,
+                entry.FileSize,
+                entry.FileMode,
+            };
+            result = WritePlaceholderEntryAt(instance->tempDirectoryFd, directoryFd, placeholder);
+        }
+        
+        // Providers only fill in the ids of the directories that have them, so the ids
+        // must not carry over to the next call
+        for (unsigned int i = 0; i < entryCount; ++i)
+        {
+            memset(entries[i].ProviderId, 0, PrjFS_PlaceholderIdLength);
+            memset(entries[i].ContentId, 0, PrjFS_PlaceholderIdLength);
+        }
+    }
+    while (PrjFS_Result_Success == result && DirectoryEntryBufferCapacity == entryCount);
+    
+    close(directoryFd);
+    return result;
+}
+
+// Commands are registered before their callback is invoked so that the provider may
+// complete them from another thread at any time.
+static void AddPendingCommand(uint64_t commandId, const PendingCommand& command)
+{
+    mutex_lock lock(s_PendingCommandMutex);
+    s_PendingCommands.insert(std::make_pair(commandId, command));
+}
+
+// Returns PrjFS_Result_Pending if the command is, or already has been, completed through
+// PrjFS_CompleteCommand. Otherwise the command is removed from the pending set and the
+// caller must finish it with the returned result.
+static PrjFS_Result ReclaimPendingCommand(uint64_t commandId, PrjFS_Result callbackResult)
+{
+    mutex_lock lock(s_PendingCommandMutex);
+    unordered_map<uint64_t, PendingCommand>::iterator commandFound = s_PendingCommands.find(commandId);
+    if (commandFound == s_PendingCommands.end())
+    {
+        // The provider already completed the command, whether or not it returned Pending
+        return PrjFS_Result_Pending;
+    }
+    
+    PendingCommand& command = commandFound->second;
+    if (PrjFS_Result_Pending == callbackResult)
+    {
+        if (!command.instance->abandonPendingCommands)
+        {
+            command.callbackReturned = true;
+            BeginInstanceWork(command.instance);
+            return PrjFS_Result_Pending;
+        }
+        
+        // The instance has stopped waiting for the provider to complete commands
+        callbackResult = PrjFS_Result_EInvalidOperation;
+    }
+    
+    s_PendingCommands.erase(commandFound);
+    return callbackResult;
+}
+
+// Applies the on-disk effects of a completed command and answers all kernel messages that
+// are waiting on its path.
+static PrjFS_Result FinishCommand(const PendingCommand& command, PrjFS_Result result)
+{
+    EndCallback(command);
+    
+    // TODO: how should we handle the scenario where the provider thinks it succeeded, but we were unable to
+    // update placeholder metadata?
+    if (nullptr != command.fileHandle)
+    {
+        // A region the provider didn't commit doesn't count towards the contents
+        UnmapFileContents(command.fileHandle);
+        
+        if (PrjFS_Result_Success == result && !IsHydratedSizeValid(command.fileHandle, command.relativePath))
+        {
+            // Leave an intact empty placeholder behind so that the next access retries hydration
+            ftruncate(command.fileHandle->fd, command.fileHandle->placeholderSize);
+            result = PrjFS_Result_EFileSizeMismatch;
+        }
+        
+        if (PrjFS_Result_Success == result)
+        {
+            WriteHydratedFileXAttr(command.fileHandle->fd);
+            AddToContentDeduplicationIndex(command.instance, command.fileHandle, command.relativePath);
+        }
+        
+        // Clear the flag through the hydration handle rather than by resolving the path again.
+        // Writes are unbuffered, so all contents have already reached the kernel.
+        if (PrjFS_Result_Success == result &&
+            !UpdateFileFlags(command.fileHandle->fd, 0, FileFlags_IsEmpty))
+        {
+            result = PrjFS_Result_EIOError;
+        }
+        
+        // Cloned only once the flag is cleared, so that the cached copy doesn't carry it
+        if (PrjFS_Result_Success == result)
+        {
+            AddToContentCache(command.fileHandle);
+        }
+        
+        if (close(command.fileHandle->fd))
+        {
+            // TODO: under what conditions can close fail? How do we recover?
+            result = PrjFS_Result_EIOError;
+        }
+        
+        delete command.fileHandle;
+    }
+    else if (PrjFS_Result_Success == result)
+    {
+        const MessageHeader* request = static_cast<const MessageHeader*>(command.messageMemory);
+        int directoryFd = OpenRequestTarget(command.instance, request, command.relativePath, O_RDONLY | O_DIRECTORY);
+        if (directoryFd < 0)
+        {
+            result = PrjFS_Result_EIOError;
+        }
+        else
+        {
+            if (!UpdateFileFlags(directoryFd, 0, FileFlags_IsEmpty))
+            {
+                result = PrjFS_Result_EIOError;
+            }
+            
+            close(directoryFd);
+        }
+    }
+    
+    MessageType responseType =
+        PrjFS_Result_Success == result
+        ? MessageType_Response_Success
+        : MessageType_Response_Fail;
+    
+    PendingMessageIdList messageIDs(0);
+    
+    {
+        PendingRequestShard& shard = GetPendingRequestShard(command.instance, command.relativePath);
+        mutex_lock lock(shard.mutex);
+        PendingRequestMessageMap::iterator fileMessageIDsFound = shard.messageIDs.find(command.relativePath);
+        assert(fileMessageIDsFound != shard.messageIDs.end());
+        messageIDs = std::move(fileMessageIDsFound->second);
+        shard.messageIDs.erase(fileMessageIDsFound);
+    }
+    
+    // Nothing refers to the request's path any more
+    FreeMessageBuffer(command.messageMemory);
+    
+    const uint64_t* kernelMessageIDs = messageIDs.Data();
+    size_t kernelMessageIDCount = messageIDs.Size();
+    if (ReplayedMessageId == kernelMessageIDs[0])
+    {
+        kernelMessageIDs++;
+        kernelMessageIDCount--;
+    }
+    
+    // After the connection is closed, the kernel has already failed the requests
+    if (0 != kernelMessageIDCount && !command.instance->isConnectionClosed)
+    {
+        kdebug_signpost_start(PrjFSSignpost_SendResponses, kernelMessageIDs[0], kernelMessageIDCount, 0, 0);
+        SendKernelMessageResponses(command.instance, kernelMessageIDs, kernelMessageIDCount, responseType);
+        kdebug_signpost_end(PrjFSSignpost_SendResponses, kernelMessageIDs[0], kernelMessageIDCount, 0, 0);
+    }
+    
+    return result;
+}
+
+static void BeginInstanceWork(PrjFS_Instance* instance)
+{
+    mutex_lock lock(instance->outstandingWorkMutex);
+    instance->outstandingWorkCount++;
+}
+
+static void EndInstanceWork(PrjFS_Instance* instance)
+{
+    bool deleteInstance = false;
+    {
+        mutex_lock lock(instance->outstandingWorkMutex);
+        assert(instance->outstandingWorkCount > 0);
+        if (0 == --instance->outstandingWorkCount)
+        {
+            instance->outstandingWorkDone.notify_all();
+            deleteInstance = instance->deleteWhenIdle;
+        }
+    }
+    
+    // The instance has been stopped, nothing else refers to it
+    if (deleteInstance)
+    {
+        close(instance->tempDirectoryFd);
+        close(instance->rootFd);
+        delete instance;
+    }
+}
+
+// Answers all messages left in a stopped instance's queues with a single response
+static void FailUndeliveredMessages(PrjFS_Instance* instance)
+{
+    std::vector<uint64_t> messageIds;
+    std::vector<char> messageMemory;
+    for (uint32_t i = 0; i < instance->messageQueueCount; ++i)
+    {
+        IODataQueueMemory* queueMemory = instance->messageQueues[i].resources.queueMemory;
+        bool dequeuedAny = false;
+        while (IODataQueueEntry* entry = IODataQueuePeek(queueMemory))
+        {
+            dequeuedAny = true;
+            
+            uint32_t messageSize = entry->size;
+            if (messageSize < sizeof(MessageHeader))
+            {
+                IODataQueueDequeue(queueMemory, nullptr, nullptr);
+                continue;
+            }
+            
+            messageMemory.resize(messageSize);
+            if (kIOReturnSuccess != IODataQueueDequeue(queueMemory, messageMemory.data(), &messageSize))
+            {
+                break;
+            }
+            
+            const MessageHeader* header = reinterpret_cast<const MessageHeader*>(messageMemory.data());
+            if (MessageExpectsResponse(static_cast<MessageType>(header->messageType)))
+            {
+                messageIds.push_back(header->messageId);
+            }
+        }
+        
+        if (dequeuedAny)
+        {
+            SignalKernelMessageQueueDrained(instance->kernelServiceConnection, i);
+        }
+    }
+    
+    if (!messageIds.empty())
+    {
+        SendKernelMessageResponses(instance, messageIds.data(), messageIds.size(), MessageType_Response_Fail);
+    }
+}
+
+// Fails the commands of a stopping instance that the provider has not completed.
+// Commands whose callback is still running fail when the callback returns.
+static void FailPendingCommands(PrjFS_Instance* instance)
+{
+    std::vector<PendingCommand> abandonedCommands;
+    {
+        mutex_lock lock(s_PendingCommandMutex);
+        instance->abandonPendingCommands = true;
+        
+        unordered_map<uint64_t, PendingCommand>::iterator commandIter = s_PendingCommands.begin();
+        while (commandIter != s_PendingCommands.end())
+        {
+            if (commandIter->second.instance == instance && commandIter->second.callbackReturned)
+            {
+                abandonedCommands.push_back(std::move(commandIter->second));
+                commandIter = s_PendingCommands.erase(commandIter);
+            }
+            else
+            {
+                ++commandIter;
+            }
+        }
+    }
+    
+    for (const PendingCommand& command : abandonedCommands)
+    {
+        FinishCommand(command, PrjFS_Result_EInvalidOperation);
+        EndInstanceWork(instance);
+    }
+}
+
+// Notifications are handled synchronously and never coalesced. Only the ones
+// the kernel waits for are answered.
+static void HandleKernelNotification(PrjFS_Instance* instance, Message notification, void* messageMemory)
+{
+    const MessageHeader* header = notification.messageHeader;
+    MessageType messageType = static_cast<MessageType>(header->messageType);
+    
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandleKernelNotification: message type " << messageType << std::endl;
+#endif
+    
+    bool isDirectory = false;
+    bool expectsResponse = false;
+    PrjFS_NotificationType notificationType = PrjFS_NotificationType_Invalid;
+    switch (messageType)
+    {
+        case MessageType_KtoU_NotifyDirectoryPreDelete:
+            isDirectory = true;
+            // Fall through
+        case MessageType_KtoU_NotifyFilePreDelete:
+            notificationType = PrjFS_NotificationType_PreDelete;
+            expectsResponse = true;
+            break;
+            
+        case MessageType_KtoU_NotifyFileCreated:
+            notificationType = PrjFS_NotificationType_NewFileCreated;
+            break;
+            
+        case MessageType_KtoU_NotifyFileModified:
+            notificationType = PrjFS_NotificationType_FileModified;
+            break;
+            
+        case MessageType_KtoU_NotifyFileDeleted:
+            notificationType = PrjFS_NotificationType_FileDeleted;
+            break;
+            
+        case MessageType_KtoU_NotifyDirectoryRenamed:
+            isDirectory = true;
+            // Fall through
+        case MessageType_KtoU_NotifyFileRenamed:
+            notificationType = PrjFS_NotificationType_FileRenamed;
+            break;
+            
+        default:
+            assert(false);
+            break;
+    }
+    
+    PrjFSFileXAttrData xattrData = {};
+    if (MessageType_KtoU_NotifyFileCreated == messageType)
+    {
+        // From now on the kernel treats the file as part of the root, so it is
+        // reported as modified, renamed etc. rather than as created again
+        int fd = OpenRequestTarget(instance, header, notification.path, O_RDONLY);
+        if (fd < 0 || !UpdateFileFlags(fd, FileFlags_IsInVirtualizationRoot, 0))
+        {
+            cerr << "Failed to mark new file as part of the virtualization root: " << notification.path << endl;
+        }
+        
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    else if (!isDirectory && MessageType_KtoU_NotifyFileDeleted != messageType)
+    {
+        // Files the user created have no placeholder IDs; they stay zero
+        int fd = OpenInRoot(instance, notification.path, O_RDONLY | O_NOFOLLOW);
+        if (fd >= 0)
+        {
+            ReadFileXAttr(fd, &xattrData);
+            close(fd);
+        }
+    }
+    
+    // Renames carry the new path as the message path and the old one as fromPath
+    const char* relativePath = notification.path;
+    const char* destinationRelativePath = nullptr;
+    if (nullptr != notification.fromPath)
+    {
+        relativePath = notification.fromPath;
+        destinationRelativePath = notification.path;
+    }
+    
+    PrjFS_Result result = PrjFS_Result_EInvalidOperation;
+    if (!instance->isStopping)
+    {
+        kdebug_signpost_start(PrjFSSignpost_Callback, header->messageId, messageType, 0, 0);
+        result = instance->callbacks.NotifyOperation(
+            s_nextCommandId++,
+            relativePath,
+            xattrData.providerId,
+            xattrData.contentId,
+            header->pid,
+            header->procname,
+            isDirectory,
+            notificationType,
+            destinationRelativePath);
+        kdebug_signpost_end(PrjFSSignpost_Callback, header->messageId, result, 0, 0);
+    }
+    
+    if (expectsResponse && !instance->isConnectionClosed)
+    {
+        kdebug_signpost_start(PrjFSSignpost_SendResponses, header->messageId, 1, 0, 0);
+        SendKernelMessageResponse(
+            instance,
+            header->messageId,
+            PrjFS_Result_Success == result ? MessageType_Response_Success : MessageType_Response_Fail);
+        kdebug_signpost_end(PrjFSSignpost_SendResponses, header->messageId, 1, 0, 0);
+    }
+    
+    FreeMessageBuffer(messageMemory);
+}
+
+static void HandlePrefetchHint(PrjFS_Instance* instance, Message hint, void* messageMemory)
+{
+    const MessageHeader* header = hint.messageHeader;
+    
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandlePrefetchHint: " << hint.path << std::endl;
+#endif
+    
+    // No response is expected
+    if (!instance->isStopping)
+    {
+        instance->callbacks.PrefetchHint(hint.path, header->pid, header->procname);
+    }
+    
+    FreeMessageBuffer(messageMemory);
+}
+
+// Cancellations carry no path, so every shard is searched for the message; only
+// requests that are still being handled are in them.
+static void HandleCancelMessage(PrjFS_Instance* instance, uint64_t messageId)
+{
+    uint64_t cancelledCommandId = 0;
+    bool found = false;
+    for (PendingRequestShard& shard : instance->pendingRequestShards)
+    {
+        mutex_lock lock(shard.mutex);
+        for (PendingRequestMessageMap::value_type& pathMessageIDs : shard.messageIDs)
+        {
+            PendingMessageIdList& messageIDs = pathMessageIDs.second;
+            if (messageIDs.Cancel(messageId))
+            {
+                if (messageIDs.IsCancelled())
+                {
+                    instance->statistics.cancelledRequestCount.fetch_add(1, std::memory_order_relaxed);
+                    cancelledCommandId = messageIDs.CommandId();
+                }
+                
+                found = true;
+                break;
+            }
+        }
+        
+        if (found)
+        {
+            break;
+        }
+    }
+    
+#ifdef DEBUG
+    std::cout << "PrjFSLib.HandleCancelMessage: message " << messageId << (found ? "" : " already answered") << ", command " << cancelledCommandId << std::endl;
+#endif
+    
+    // Requests that haven't reached their callback yet are dropped by StartPendingRequest
+    if (0 != cancelledCommandId && nullptr != instance->callbacks.CancelCommand && !instance->isStopping)
+    {
+        instance->callbacks.CancelCommand(cancelledCommandId);
+    }
+}
+
+// Associates the command with the kernel messages waiting on its path. Returns
+// false if the kernel has cancelled all of them meanwhile.
+static bool StartPendingRequest(PrjFS_Instance* instance, const char* path, uint64_t commandId)
+{
+    PendingRequestShard& shard = GetPendingRequestShard(instance, path);
+    mutex_lock lock(shard.mutex);
+    PendingRequestMessageMap::iterator fileMessageIDsFound = shard.messageIDs.find(path);
+    assert(fileMessageIDsFound != shard.messageIDs.end());
+    fileMessageIDsFound->second.SetCommandId(commandId);
+    return !fileMessageIDsFound->second.IsCancelled();
+}
+
+static void RecordAccess(PrjFS_Instance* instance, MessageType messageType, const char* relativePath)
+{
+    size_t pathLength = strlen(relativePath);
+    
+    mutex_lock lock(instance->accessRecorderMutex);
+    if (instance->accessRecorder.fd < 0)
+    {
+        // Recording was stopped after the caller checked
+        return;
+    }
+    
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t microseconds =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - instance->accessRecorder.previousRecordTime).count();
+    instance->accessRecorder.previousRecordTime = now;
+    
+    AccessProfileRecord record =
+    {
+        static_cast<uint32_t>(std::min<uint64_t>(microseconds, UINT32_MAX)),
+        static_cast<uint16_t>(pathLength),
+        static_cast<uint8_t>(messageType),
+        0,
+    };
+    
+    std::vector<char>& buffer = instance->accessRecorder.buffer;
+    const char* recordBytes = reinterpret_cast<const char*>(&record);
+    buffer.insert(buffer.end(), recordBytes, recordBytes + sizeof(record));
+    buffer.insert(buffer.end(), relativePath, relativePath + pathLength);
+    
+    if (buffer.size() >= AccessRecorderFlushSize && !FlushAccessRecorder(instance->accessRecorder))
+    {
+        // Keep recording into the buffer; the failure is reported when recording stops
+        instance->accessRecorder.writeFailed = true;
+    }
+}
+
+// Must be called with the owning instance's accessRecorderMutex held
+static bool FlushAccessRecorder(AccessRecorder& recorder)
+{
+    bool succeeded = WriteAll(recorder.fd, recorder.buffer.data(), recorder.buffer.size());
+    recorder.buffer.clear();
+    return succeeded;
+}
+
+// Builds a request like the kernel's for a path from an access profile and registers it
+// in the pending request map. Returns false, and builds nothing, if a request for the
+// path is already being handled.
+static bool StartReplayedRequest(PrjFS_Instance* instance, MessageType messageType, const char* relativePath, const char* processName, Message* outRequest, void** outMessageMemory)
+{
+    size_t pathSizeBytes = strlen(relativePath) + 1;
+    uint32_t messageSize = static_cast<uint32_t>(sizeof(MessageHeader) + pathSizeBytes);
+    void* messageMemory = AllocateMessageBuffer(messageSize);
+    
+    MessageHeader* header = static_cast<MessageHeader*>(messageMemory);
+    *header = MessageHeader {};
+    header->messageId = ReplayedMessageId;
+    header->messageType = messageType;
+    header->pid = getpid();
+    strlcpy(header->procname, processName, sizeof(header->procname));
+    header->pathSizeBytes = static_cast<uint16_t>(pathSizeBytes);
+    memcpy(static_cast<char*>(messageMemory) + sizeof(*header), relativePath, pathSizeBytes);
+    
+    Message request = ParseMessageMemory(messageMemory, messageSize);
+    
+    {
+        PendingRequestShard& shard = GetPendingRequestShard(instance, request.path);
+        mutex_lock lock(shard.mutex);
+        if (!shard.messageIDs.insert(std::make_pair(request.path, PendingMessageIdList(ReplayedMessageId))).second)
+        {
+            FreeMessageBuffer(messageMemory);
+            return false;
+        }
+    }
+    
+    *outRequest = request;
+    *outMessageMemory = messageMemory;
+    return true;
+}
+
+// Hands a request from StartReplayedRequest to the worker pool at low priority.
+// Bounds how many replayed hydrations (and their message buffers) wait in the
+// worker pool at once, so that kernel requests don't queue up behind all of them.
+static void EnqueueReplayedHydration(PrjFS_Instance* instance, Message request, void* messageMemory, ReplayedHydrations* hydrations)
+{
+    BeginInstanceWork(instance);
+    
+    {
+        std::unique_lock<mutex> lock(hydrations->mutex);
+        hydrations->done.wait(lock, [&] { return hydrations->queuedCount < MaxQueuedReplayedHydrations; });
+        hydrations->queuedCount++;
+    }
+    
+    RequestWorkerPool_Enqueue(
+        RequestLane_Hydration,
+        RequestPriority_Low,
+        [instance, request, messageMemory, hydrations]
+        {
+            HandleKernelRequest(instance, request, messageMemory);
+            EndInstanceWork(instance);
+            
+            mutex_lock lock(hydrations->mutex);
+            hydrations->queuedCount--;
+            hydrations->done.notify_one();
+        });
+}
+
+// The work items refer to the hydrations, which usually live on the caller's stack
+static void WaitForReplayedHydrations(ReplayedHydrations* hydrations)
+{
+    std::unique_lock<mutex> lock(hydrations->mutex);
+    hydrations->done.wait(lock, [&] { return 0 == hydrations->queuedCount; });
+}
+
+// Enumerates the empty placeholder directories below a directory that was just
+// enumerated, on the calling thread, so that a process with
+// PrjFS_ProcessPolicy_EnumerateRecursively finds the whole subtree ready instead of
+// waiting on one request per directory. Only descends into directories enumerated
+// here; any others were expanded before and are left alone.
+static void EnumerateSubtree(PrjFS_Instance* instance, const char* relativePath, const char* processName)
+{
+    std::vector<string> directories(1, relativePath);
+    std::vector<string> emptyDirectories;
+    while (!directories.empty() && !instance->isStopping)
+    {
+        string directoryRelativePath = std::move(directories.back());
+        directories.pop_back();
+        
+        int directoryFd = OpenInRoot(instance, directoryRelativePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directoryFd < 0)
+        {
+            continue;
+        }
+        
+        DIR* directory = fdopendir(directoryFd);
+        if (nullptr == directory)
+        {
+            close(directoryFd);
+            continue;
+        }
+        
+        string childRelativePath = directoryRelativePath;
+        if (!childRelativePath.empty())
+        {
+            childRelativePath += '/';
+        }
+        
+        size_t childNameOffset = childRelativePath.size();
+        emptyDirectories.clear();
+        
+        // Placeholder files need no stat, d_type is enough to skip them
+        while (dirent* entry = readdir(directory))
+        {
+            if (DT_DIR != entry->d_type || 0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+            {
+                continue;
+            }
+            
+            struct stat entryAttributes;
+            if (fstatat(dirfd(directory), entry->d_name, &entryAttributes, AT_SYMLINK_NOFOLLOW) ||
+                !(entryAttributes.st_flags & FileFlags_IsEmpty))
+            {
+                continue;
+            }
+            
+            childRelativePath.resize(childNameOffset);
+            childRelativePath += entry->d_name;
+            emptyDirectories.push_back(childRelativePath);
+        }
+        
+        closedir(directory);
+        
+        for (const string& emptyDirectory : emptyDirectories)
+        {
+            Message request;
+            void* messageMemory;
+            if (instance->isStopping ||
+                !StartReplayedRequest(instance, MessageType_KtoU_EnumerateDirectory, emptyDirectory.c_str(), processName, &request, &messageMemory))
+            {
+                // Someone else is enumerating it and will see to its own children
+                continue;
+            }
+            
+            BeginInstanceWork(instance);
+            HandleKernelRequest(instance, request, messageMemory);
+            EndInstanceWork(instance);
+            
+            // Still empty if the enumeration failed or the provider finishes it later
+            struct stat directoryAttributes;
+            if (0 == fstatat(instance->rootFd, emptyDirectory.c_str(), &directoryAttributes, AT_SYMLINK_NOFOLLOW) &&
+                !(directoryAttributes.st_flags & FileFlags_IsEmpty))
+            {
+                directories.push_back(emptyDirectory);
+            }
+        }
+    }
+}
+
+// Enumerates the directory if it is an empty placeholder, then queues the
+// hydration of its empty placeholder files that pass the filter and appends its
+// subdirectories. This process is exempt from the kext's checks, so neither
+// listing the directory nor writing the files goes through the kernel.
+static PrjFS_Result HydrateDirectoryEntries(
+    PrjFS_Instance* instance,
+    const string& directoryRelativePath,
+    PrjFS_FileFilterCallback* filter,
+    void* filterContext,
+    std::vector<string>* subdirectories,
+    ReplayedHydrations* hydrations)
+{
+    int directoryFd = OpenInRoot(instance, directoryRelativePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    struct stat directoryAttributes;
+    if (fstat(directoryFd, &directoryAttributes))
+    {
+        close(directoryFd);
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (directoryAttributes.st_flags & FileFlags_IsEmpty)
+    {
+        Message request;
+        void* messageMemory;
+        if (StartReplayedRequest(instance, MessageType_KtoU_EnumerateDirectory, directoryRelativePath.c_str(), HydrateTreeProcessName, &request, &messageMemory))
+        {
+            BeginInstanceWork(instance);
+            HandleKernelRequest(instance, request, messageMemory);
+            EndInstanceWork(instance);
+        }
+        
+        // Otherwise the kernel is having it enumerated right now, and the entries
+        // that already exist are all there is to hydrate
+    }
+    
+    DIR* directory = fdopendir(directoryFd);
+    if (nullptr == directory)
+    {
+        close(directoryFd);
+        return PrjFS_Result_EIOError;
+    }
+    
+    string childRelativePath = directoryRelativePath;
+    if (!childRelativePath.empty())
+    {
+        childRelativePath += '/';
+    }
+    
+    size_t childNameOffset = childRelativePath.size();
+    std::vector<string> filesToHydrate;
+    
+    // d_type is not enough, the flags of each entry are needed anyway
+    while (dirent* entry = readdir(directory))
+    {
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+        {
+            continue;
+        }
+        
+        struct stat entryAttributes;
+        if (fstatat(dirfd(directory), entry->d_name, &entryAttributes, AT_SYMLINK_NOFOLLOW))
+        {
+            continue;
+        }
+        
+        childRelativePath.resize(childNameOffset);
+        childRelativePath += entry->d_name;
+        
+        if (S_ISDIR(entryAttributes.st_mode))
+        {
+            subdirectories->push_back(childRelativePath);
+        }
+        else if (S_ISREG(entryAttributes.st_mode) &&
+                 (entryAttributes.st_flags & FileFlags_IsEmpty) &&
+                 (nullptr == filter || filter(childRelativePath.c_str(), filterContext)))
+        {
+            filesToHydrate.push_back(childRelativePath);
+        }
+    }
+    
+    closedir(directory);
+    
+    if (filesToHydrate.empty())
+    {
+        return PrjFS_Result_Success;
+    }
+    
+    // Lets the provider fetch the directory's contents in one go before the
+    // individual GetFileStream calls
+    if (nullptr != instance->callbacks.PrefetchHint)
+    {
+        instance->callbacks.PrefetchHint(directoryRelativePath.c_str(), getpid(), HydrateTreeProcessName);
+    }
+    
+    for (const string& fileRelativePath : filesToHydrate)
+    {
+        Message request;
+        void* messageMemory;
+        if (StartReplayedRequest(instance, MessageType_KtoU_HydrateFile, fileRelativePath.c_str(), HydrateTreeProcessName, &request, &messageMemory))
+        {
+            EnqueueReplayedHydration(instance, request, messageMemory, hydrations);
+        }
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+static void BeginCallback(PrjFS_Instance* instance, PendingCommand* command)
+{
+    command->callbackStartTime = std::chrono::steady_clock::now();
+    instance->statistics.inFlightCallbackCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Commands finished without invoking a callback, e.g. while stopping, are not counted
+static void EndCallback(const PendingCommand& command)
+{
+    if (std::chrono::steady_clock::time_point() == command.callbackStartTime)
+    {
+        return;
+    }
+    
+    InstanceStatistics& statistics = command.instance->statistics;
+    statistics.inFlightCallbackCount.fetch_sub(1, std::memory_order_relaxed);
+    
+    uint64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - command.callbackStartTime).count();
+    RecordLatency(
+        MessageType_KtoU_EnumerateDirectory == command.messageType ||
+        MessageType_KtoU_EnumerateDirectoryRecursively == command.messageType
+        ? statistics.enumerateDirectoryLatency
+        : statistics.getFileStreamLatency,
+        microseconds);
+}
+
+static void RecordLatency(LatencyHistogram& histogram, uint64_t microseconds)
+{
+    // Bucket i holds latencies in [2^(i-1), 2^i) microseconds
+    size_t bucket = 0 == microseconds ? 0 : 64 - __builtin_clzll(microseconds);
+    if (bucket >= PrjFS_LatencyHistogramBucketCount)
+    {
+        bucket = PrjFS_LatencyHistogramBucketCount - 1;
+    }
+    
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.totalMicroseconds.fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+static void ReadLatencyHistogram(const LatencyHistogram& histogram, _Out_ PrjFS_LatencyHistogram* result)
+{
+    result->Count = 0;
+    for (size_t i = 0; i < PrjFS_LatencyHistogramBucketCount; ++i)
+    {
+        result->Buckets[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        result->Count += result->Buckets[i];
+    }
+    
+    result->TotalMicroseconds = histogram.totalMicroseconds.load(std::memory_order_relaxed);
+}
+
+static bool IsNotificationMessageType(MessageType messageType)
+{
+    switch (messageType)
+    {
+        case MessageType_KtoU_NotifyFilePreDelete:
+        case MessageType_KtoU_NotifyDirectoryPreDelete:
+        case MessageType_KtoU_NotifyFileCreated:
+        case MessageType_KtoU_NotifyFileModified:
+        case MessageType_KtoU_NotifyFileDeleted:
+        case MessageType_KtoU_NotifyFileRenamed:
+        case MessageType_KtoU_NotifyDirectoryRenamed:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the kernel waits for a response to the message
+static bool MessageExpectsResponse(MessageType messageType)
+{
+    switch (messageType)
+    {
+        case MessageType_KtoU_EnumerateDirectory:
+        case MessageType_KtoU_EnumerateDirectoryRecursively:
+        case MessageType_KtoU_HydrateFile:
+        case MessageType_KtoU_ConvertFileToFull:
+        case MessageType_KtoU_NotifyFilePreDelete:
+        case MessageType_KtoU_NotifyDirectoryPreDelete:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Types the kernel can't report (yet) are dropped
+static uint32_t GetKernelNotificationFlags(PrjFS_NotificationType notificationMask)
+{
+    uint32_t flags = ProviderNotification_None;
+    if (notificationMask & PrjFS_NotificationType_NewFileCreated)
+    {
+        flags |= ProviderNotification_NewFileCreated;
+    }
+    
+    if (notificationMask & PrjFS_NotificationType_PreDelete)
+    {
+        flags |= ProviderNotification_PreDelete;
+    }
+    
+    if (notificationMask & PrjFS_NotificationType_FileRenamed)
+    {
+        flags |= ProviderNotification_FileRenamed;
+    }
+    
+    if (notificationMask & PrjFS_NotificationType_FileModified)
+    {
+        flags |= ProviderNotification_FileModified;
+    }
+    
+    if (notificationMask & PrjFS_NotificationType_FileDeleted)
+    {
+        flags |= ProviderNotification_FileDeleted;
+    }
+    
+    if (notificationMask & PrjFS_NotificationType_RecordModifiedFiles)
+    {
+        flags |= ProviderNotification_RecordModifiedFile;
+    }
+    
+    return flags;
+}
+
+// Equivalent of PrjFS_WritePlaceholderFile/Directory for an entry of an already open
+// directory. Everything after creation goes through the entry's fd, so its path is
+// only resolved once.
+//
+// The entry is created and initialized in the temp directory and then moved into
+// place, so a crash can't leave a partially initialized placeholder in the root.
+// Without a temp directory it is initialized in place.
+static PrjFS_Result WritePlaceholderEntryAt(int tempDirectoryFd, int directoryFd, const PrjFS_PlaceholderEntry& entry)
+{
+    if (nullptr == entry.Name || '\0' == entry.Name[0] ||
+        (!entry.IsDirectory && (nullptr == entry.ProviderId || nullptr == entry.ContentId)))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    // Newly created files and directories have no flags set, so the placeholder flags can
+    // be applied without reading the current flags first
+    const uint32_t placeholderFlags = FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty;
+    
+    char tempName[32];
+    int createDirectoryFd;
+    const char* createName = GetEntryCreationName(tempDirectoryFd, directoryFd, entry.Name, tempName, &createDirectoryFd);
+    
+    int fd;
+    bool initialized;
+    if (entry.IsDirectory)
+    {
+        if (mkdirat(createDirectoryFd, createName, 0777))
+        {
+            return PrjFS_Result_EIOError;
+        }
+        
+        fd = openat(createDirectoryFd, createName, O_RDONLY | O_DIRECTORY);
+        initialized = fd >= 0 && SetFileFlags(fd, placeholderFlags);
+        
+        // Only directories written with ids get the xattr, the others are identified by their flags alone
+        if (initialized && (!IsZeroId(entry.ProviderId) || !IsZeroId(entry.ContentId)))
+        {
+            static const unsigned char zeroId[PrjFS_PlaceholderIdLength] = {};
+            initialized = WriteFileXAttr(
+                fd,
+                nullptr != entry.ProviderId ? entry.ProviderId : zeroId,
+                nullptr != entry.ContentId ? entry.ContentId : zeroId);
+        }
+    }
+    else
+    {
+        // O_EXCL has the same effect as mode "wbx" in PrjFS_WritePlaceholderFile
+        fd = openat(createDirectoryFd, createName, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0)
+        {
+            return PrjFS_Result_EIOError;
+        }
+        
+        initialized =
+            0 == ftruncate(fd, entry.FileSize) &&
+            SetFileFlags(fd, placeholderFlags) &&
+            WriteFileXAttr(fd, entry.ProviderId, entry.ContentId) &&
+            0 == fchmod(fd, entry.FileMode);
+    }
+    
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    
+    return MoveCreatedEntryIntoPlace(tempDirectoryFd, directoryFd, createDirectoryFd, tempName, entry.Name, entry.IsDirectory, initialized);
+}
+
+// Writes a small file with its entire contents instead of as an empty placeholder. The
+// file ends up exactly like a hydrated placeholder: it keeps its ids, is marked as
+// unmodified since hydration, and has FileFlags_IsInVirtualizationRoot but not
+// FileFlags_IsEmpty, so accessing it never involves the provider.
+static PrjFS_Result WriteFullFileEntryAt(int tempDirectoryFd, int directoryFd, const PrjFS_FullFileEntry& entry)
+{
+    if (nullptr == entry.Name || '\0' == entry.Name[0] ||
+        nullptr == entry.ProviderId ||
+        nullptr == entry.ContentId ||
+        (nullptr == entry.Contents && entry.ContentsSize > 0))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    char tempName[32];
+    int createDirectoryFd;
+    const char* createName = GetEntryCreationName(tempDirectoryFd, directoryFd, entry.Name, tempName, &createDirectoryFd);
+    
+    int fd = openat(createDirectoryFd, createName, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    // The hydrated file xattr records the modification time, so it is written after the contents
+    bool initialized =
+        WriteAll(fd, entry.Contents, entry.ContentsSize) &&
+        WriteFileXAttr(fd, entry.ProviderId, entry.ContentId) &&
+        0 == fchmod(fd, entry.FileMode);
+    if (initialized)
+    {
+        WriteHydratedFileXAttr(fd);
+        initialized = SetFileFlags(fd, FileFlags_IsInVirtualizationRoot);
+    }
+    
+    close(fd);
+    return MoveCreatedEntryIntoPlace(tempDirectoryFd, directoryFd, createDirectoryFd, tempName, entry.Name, false, initialized);
+}
+
+// Entries are created under a unique name in the temp directory if there is one,
+// and under their own name in their directory otherwise
+static const char* GetEntryCreationName(int tempDirectoryFd, int directoryFd, const char* name, char (&tempName)[32], _Out_ int* createDirectoryFd)
+{
+    if (tempDirectoryFd < 0)
+    {
+        *createDirectoryFd = directoryFd;
+        return name;
+    }
+    
+    snprintf(tempName, sizeof(tempName), "%llu", static_cast<unsigned long long>(s_nextTempEntryId++));
+    *createDirectoryFd = tempDirectoryFd;
+    return tempName;
+}
+
+static PrjFS_Result MoveCreatedEntryIntoPlace(
+    int tempDirectoryFd,
+    int directoryFd,
+    int createDirectoryFd,
+    const char* tempName,
+    const char* name,
+    bool isDirectory,
+    bool initialized)
+{
+    if (createDirectoryFd == directoryFd)
+    {
+        // PrjFS_FindIncompletePlaceholders finds the entry if it wasn't fully initialized
+        return initialized ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+    }
+    
+    // RENAME_EXCL fails like O_EXCL would have if the name was taken in the meantime
+    if (initialized && 0 == renameatx_np(tempDirectoryFd, tempName, directoryFd, name, RENAME_EXCL))
+    {
+        return PrjFS_Result_Success;
+    }
+    
+    unlinkat(tempDirectoryFd, tempName, isDirectory ? AT_REMOVEDIR : 0);
+    return PrjFS_Result_EIOError;
+}
+
+// Returns the directory relativePath is in, and its last component in name
+static int OpenParentDirectory(PrjFS_Instance* instance, const char* relativePath, _Out_ const char** name)
+{
+    const char* lastSeparator = strrchr(relativePath, '/');
+    if (nullptr == lastSeparator)
+    {
+        *name = relativePath;
+        return dup(instance->rootFd);
+    }
+    
+    char parentRelativePath[PrjFSMaxPath];
+    size_t parentLength = std::min(static_cast<size_t>(lastSeparator - relativePath), sizeof(parentRelativePath) - 1);
+    memcpy(parentRelativePath, relativePath, parentLength);
+    parentRelativePath[parentLength] = '\0';
+    
+    *name = lastSeparator + 1;
+    return OpenInRoot(instance, parentRelativePath, O_RDONLY | O_DIRECTORY);
+}
+
+// Creates the root's temp directory if needed. Anything a previous provider left in
+// it never made it into the root, and is removed.
+static int OpenTempDirectory(int rootFd)
+{
+    if (mkdirat(rootFd, PrjFS_TempDirectoryName, 0700) && EEXIST != errno)
+    {
+        return -1;
+    }
+    
+    int tempDirectoryFd = openat(rootFd, PrjFS_TempDirectoryName, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (tempDirectoryFd < 0)
+    {
+        return -1;
+    }
+    
+    // fdopendir takes ownership of the fd it is given
+    int scanFd = dup(tempDirectoryFd);
+    DIR* directory = scanFd < 0 ? nullptr : fdopendir(scanFd);
+    if (nullptr == directory)
+    {
+        if (scanFd >= 0)
+        {
+            close(scanFd);
+        }
+        
+        close(tempDirectoryFd);
+        return -1;
+    }
+    
+    // Directories are moved into place before anything is created in them, so they
+    // are always empty here
+    while (dirent* entry = readdir(directory))
+    {
+        if (0 != strcmp(entry->d_name, ".") && 0 != strcmp(entry->d_name, ".."))
+        {
+            unlinkat(tempDirectoryFd, entry->d_name, DT_DIR == entry->d_type ? AT_REMOVEDIR : 0);
+        }
+    }
+    
+    closedir(directory);
+    return tempDirectoryFd;
+}
+
+static bool WriteAll(int fd, const void* bytes, size_t byteCount)
+{
+    const char* remaining = static_cast<const char*>(bytes);
+    while (byteCount > 0)
+    {
+        ssize_t bytesWritten = write(fd, remaining, byteCount);
+        if (bytesWritten < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            
+            return false;
+        }
+        
+        remaining += bytesWritten;
+        byteCount -= bytesWritten;
+    }
+    
+    return true;
+}
+
+static bool WriteAllVector(int fd, struct iovec* buffers, int bufferCount)
+{
+    while (true)
+    {
+        // Skip buffers that have been written completely
+        while (bufferCount > 0 && 0 == buffers->iov_len)
+        {
+            ++buffers;
+            --bufferCount;
+        }
+        
+        if (0 == bufferCount)
+        {
+            return true;
+        }
+        
+        ssize_t bytesWritten = writev(fd, buffers, std::min(bufferCount, IOV_MAX));
+        if (bytesWritten < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            
+            return false;
+        }
+        
+        if (0 == bytesWritten)
+        {
+            return false;
+        }
+        
+        while (bytesWritten > 0)
+        {
+            size_t bufferBytesWritten = std::min(static_cast<size_t>(bytesWritten), buffers->iov_len);
+            buffers->iov_base = static_cast<char*>(buffers->iov_base) + bufferBytesWritten;
+            buffers->iov_len -= bufferBytesWritten;
+            bytesWritten -= bufferBytesWritten;
+            if (0 == buffers->iov_len)
+            {
+                ++buffers;
+                --bufferCount;
+            }
+        }
+    }
+}
+
+// Sends the kernel an interim response every HydrationProgressReportBytes written,
+// which restarts the hydration request's timeout. Writes of several threads may
+// race here; only one of them reports each interval.
+static void ReportHydrationProgressIfDue(const PrjFS_FileHandle* fileHandle)
+{
+    uint64_t bytesWritten = fileHandle->bytesWritten;
+    uint64_t bytesReported = fileHandle->bytesReportedToKernel;
+    if (ReplayedMessageId == fileHandle->messageId ||
+        !(fileHandle->instance->kernelCapabilities & ProviderCapability_ResponseProgress) ||
+        bytesWritten - bytesReported < HydrationProgressReportBytes ||
+        !fileHandle->bytesReportedToKernel.compare_exchange_strong(bytesReported, bytesWritten))
+    {
+        return;
+    }
+    
+    SendKernelMessageResponse(fileHandle->instance, fileHandle->messageId, MessageType_Response_Progress);
+}
+
+static void UnmapFileContents(const PrjFS_FileHandle* fileHandle)
+{
+    if (nullptr != fileHandle->mappedPages)
+    {
+        munmap(fileHandle->mappedPages, fileHandle->mappedPagesLength);
+        fileHandle->mappedPages = nullptr;
+        fileHandle->mappedPagesLength = 0;
+        fileHandle->mappedByteCount = 0;
+    }
+}
+
+// Applies the hydration options to a placeholder that is about to be hydrated.
+// Failures are not fatal, the options only affect performance.
+static void PrepareFileForHydration(int fd, off_t fileSize)
+{
+    unsigned int options = s_hydrationOptions;
+    if (PrjFS_HydrationOptions_None == options)
+    {
+        return;
+    }
+    
+    // Placeholders are created with their final size
+    if ((options & PrjFS_HydrationOptions_Preallocate) && fileSize > 0)
+    {
+        fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, fileSize, 0 };
+        if (-1 == fcntl(fd, F_PREALLOCATE, &store))
+        {
+            // Fall back to a non-contiguous allocation
+            store.fst_flags = F_ALLOCATEALL;
+            fcntl(fd, F_PREALLOCATE, &store);
+        }
+    }
+    
+    if ((options & PrjFS_HydrationOptions_NoCacheForLargeFiles) &&
+        static_cast<uint64_t>(fileSize) >= s_noCacheMinimumFileSize)
+    {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+}
+
+// Fewer bytes than the placeholder's size leave stale padding at the end of the file.
+// More bytes look truncated to any tool that already sized its buffers from the
+// placeholder.
+static bool IsHydratedSizeValid(const PrjFS_FileHandle* fileHandle, const char* relativePath)
+{
+    struct stat fileAttributes;
+    if (fstat(fileHandle->fd, &fileAttributes))
+    {
+        return false;
+    }
+    
+    uint64_t bytesWritten = fileHandle->bytesWritten;
+    if (bytesWritten != static_cast<uint64_t>(fileHandle->placeholderSize) ||
+        fileAttributes.st_size != fileHandle->placeholderSize)
+    {
+        cerr << "Hydration of " << relativePath << " wrote " << bytesWritten << " bytes, file size is " << fileAttributes.st_size
+            << ", expected " << fileHandle->placeholderSize << endl;
+        return false;
+    }
+    
+    return true;
+}
+
+static bool IsContentDeduplicationCandidate(const PrjFS_FileHandle* fileHandle)
+{
+    return (s_hydrationOptions & PrjFS_HydrationOptions_DeduplicateContent) && HasContentId(fileHandle);
+}
+
+static bool HasContentId(const PrjFS_FileHandle* fileHandle)
+{
+    if (0 == fileHandle->placeholderSize)
+    {
+        return false;
+    }
+    
+    // Providers that don't identify contents leave the contentId zeroed
+    for (size_t i = 0; i < PrjFS_PlaceholderIdLength; ++i)
+    {
+        if (0 != fileHandle->contentId[i])
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// A source must still hold exactly the contents it was hydrated with: it may have been
+// written to, dehydrated, updated to other contents or replaced since it was indexed.
+static bool IsUnmodifiedDuplicate(int sourceFd, const PrjFS_FileHandle* fileHandle)
+{
+    struct stat sourceAttributes;
+    PrjFSFileXAttrData sourceXattr;
+    return
+        0 == fstat(sourceFd, &sourceAttributes) &&
+        S_ISREG(sourceAttributes.st_mode) &&
+        !(sourceAttributes.st_flags & FileFlags_IsEmpty) &&
+        sourceAttributes.st_size == fileHandle->placeholderSize &&
+        ReadFileXAttr(sourceFd, &sourceXattr) &&
+        0 == memcmp(sourceXattr.contentId, fileHandle->contentId, PrjFS_PlaceholderIdLength) &&
+        IsUnmodifiedSinceHydration(sourceFd, sourceAttributes);
+}
+
+// Copies the contents of a file hydrated earlier with the same contentId, so that the
+// provider doesn't have to fetch them again. Returns false, leaving the placeholder
+// untouched, if there is no usable source; an unusable source is dropped from the index.
+static bool HydrateFromDuplicateContent(PrjFS_Instance* instance, PrjFS_FileHandle* fileHandle, const char* relativePath)
+{
+    if (!IsContentDeduplicationCandidate(fileHandle))
+    {
+        return false;
+    }
+    
+    ContentDeduplicationIndex& index = instance->contentDeduplicationIndex;
+    string contentId(reinterpret_cast<const char*>(fileHandle->contentId), PrjFS_PlaceholderIdLength);
+    string sourceRelativePath;
+    {
+        mutex_lock lock(index.mutex);
+        unordered_map<string, string>::const_iterator found = index.relativePathsByContentId.find(contentId);
+        if (found == index.relativePathsByContentId.end())
+        {
+            return false;
+        }
+        
+        sourceRelativePath = found->second;
+    }
+    
+    if (sourceRelativePath == relativePath)
+    {
+        // The indexed copy itself has been dehydrated
+        mutex_lock lock(index.mutex);
+        index.relativePathsByContentId.erase(contentId);
+        return false;
+    }
+    
+    // As with PrjFS_WriteFileContentsFromFile, the contents are copied rather than cloned
+    // because the kernel holds the placeholder's vnode. The source is checked again once
+    // copied, in case it was written to meanwhile.
+    int sourceFd = OpenInRoot(instance, sourceRelativePath.c_str(), O_RDONLY | O_NOFOLLOW);
+    bool copied =
+        sourceFd >= 0 &&
+        IsUnmodifiedDuplicate(sourceFd, fileHandle) &&
+        0 == fcopyfile(sourceFd, fileHandle->fd, nullptr, COPYFILE_DATA) &&
+        IsUnmodifiedDuplicate(sourceFd, fileHandle);
+    
+    if (sourceFd >= 0)
+    {
+        close(sourceFd);
+    }
+    
+    if (copied)
+    {
+        fileHandle->bytesWritten = fileHandle->placeholderSize;
+        return true;
+    }
+    
+    // The provider writes from the start of the file, over anything partially copied
+    lseek(fileHandle->fd, 0, SEEK_SET);
+    ftruncate(fileHandle->fd, fileHandle->placeholderSize);
+    
+    mutex_lock lock(index.mutex);
+    unordered_map<string, string>::iterator found = index.relativePathsByContentId.find(contentId);
+    if (found != index.relativePathsByContentId.end() && found->second == sourceRelativePath)
+    {
+        index.relativePathsByContentId.erase(found);
+    }
+    
+    return false;
+}
+
+// Only the first file hydrated with each content is indexed, later ones would be copies of it
+static void AddToContentDeduplicationIndex(PrjFS_Instance* instance, const PrjFS_FileHandle* fileHandle, const char* relativePath)
+{
+    if (!IsContentDeduplicationCandidate(fileHandle))
+    {
+        return;
+    }
+    
+    ContentDeduplicationIndex& index = instance->contentDeduplicationIndex;
+    string contentId(reinterpret_cast<const char*>(fileHandle->contentId), PrjFS_PlaceholderIdLength);
+    
+    mutex_lock lock(index.mutex);
+    index.relativePathsByContentId.emplace(contentId, relativePath);
+}
+
+static std::shared_ptr<ContentCache> GetContentCache()
+{
+    mutex_lock lock(s_contentCacheMutex);
+    return s_contentCache;
+}
+
+// Contents are stored as <first byte>/<remaining bytes> of their contentId in hex, like
+// git's loose objects, which keeps directories small and names within NAME_MAX. Trailing
+// zero bytes are trimmed as in the xattr, but the name keeps at least one byte.
+static void GetContentCacheEntryPath(
+    const PrjFS_FileHandle* fileHandle,
+    _Out_ char (&subdirectoryName)[3],
+    _Out_ char (&entryName)[2 * PrjFS_PlaceholderIdLength])
+{
+    size_t contentIdLength = PrjFS_PlaceholderIdLength;
+    while (contentIdLength > 2 && 0 == fileHandle->contentId[contentIdLength - 1])
+    {
+        contentIdLength--;
+    }
+    
+    snprintf(subdirectoryName, sizeof(subdirectoryName), "%02x", fileHandle->contentId[0]);
+    for (size_t i = 1; i < contentIdLength; ++i)
+    {
+        snprintf(entryName + 2 * (i - 1), 3, "%02x", fileHandle->contentId[i]);
+    }
+}
+
+// Copies cached contents into the placeholder, see HydrateFromDuplicateContent. Cached
+// files are only ever replaced as a whole, so one of the right size is complete. Returns
+// false, leaving the placeholder untouched, if the contents are not cached.
+static bool HydrateFromContentCache(PrjFS_FileHandle* fileHandle)
+{
+    std::shared_ptr<ContentCache> cache = GetContentCache();
+    if (nullptr == cache || !HasContentId(fileHandle))
+    {
+        return false;
+    }
+    
+    char subdirectoryName[3];
+    char entryName[2 * PrjFS_PlaceholderIdLength];
+    GetContentCacheEntryPath(fileHandle, subdirectoryName, entryName);
+    string entryPath = string(subdirectoryName) + "/" + entryName;
+    
+    int cachedFd = openat(cache->directoryFd, entryPath.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (cachedFd < 0)
+    {
+        return false;
+    }
+    
+    struct stat cachedAttributes;
+    bool isUsable =
+        0 == fstat(cachedFd, &cachedAttributes) &&
+        S_ISREG(cachedAttributes.st_mode) &&
+        cachedAttributes.st_size == fileHandle->placeholderSize;
+    bool copied = isUsable && 0 == fcopyfile(cachedFd, fileHandle->fd, nullptr, COPYFILE_DATA);
+    
+    if (copied)
+    {
+        // Eviction goes by access time, which volumes mounted noatime don't update
+        struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+        futimens(cachedFd, times);
+        close(cachedFd);
+        
+        fileHandle->bytesWritten = fileHandle->placeholderSize;
+        return true;
+    }
+    
+    close(cachedFd);
+    
+    // E.g. a provider reused the contentId for contents of another size
+    if (!isUsable)
+    {
+        unlinkat(cache->directoryFd, entryPath.c_str(), 0);
+    }
+    
+    // The provider writes from the start of the file, over anything partially copied
+    lseek(fileHandle->fd, 0, SEEK_SET);
+    ftruncate(fileHandle->fd, fileHandle->placeholderSize);
+    return false;
+}
+
+// Clones a freshly hydrated file into the cache under a temporary name and then renames
+// it into place, so that other processes never see partial contents. Failures only
+// mean the contents aren't cached.
+static void AddToContentCache(const PrjFS_FileHandle* fileHandle)
+{
+    std::shared_ptr<ContentCache> cache = GetContentCache();
+    if (nullptr == cache || !HasContentId(fileHandle))
+    {
+        return;
+    }
+    
+    char subdirectoryName[3];
+    char entryName[2 * PrjFS_PlaceholderIdLength];
+    GetContentCacheEntryPath(fileHandle, subdirectoryName, entryName);
+    string entryPath = string(subdirectoryName) + "/" + entryName;
+    
+    // Another hydration, possibly in another process, cached the contents already
+    if (0 == faccessat(cache->directoryFd, entryPath.c_str(), F_OK, AT_SYMLINK_NOFOLLOW))
+    {
+        return;
+    }
+    
+    char tempName[64];
+    snprintf(
+        tempName,
+        sizeof(tempName),
+        "%s%d-%llu",
+        ContentCacheTempNamePrefix,
+        getpid(),
+        static_cast<unsigned long long>(s_nextTempEntryId++));
+    
+    if (fclonefileat(fileHandle->fd, cache->directoryFd, tempName, CLONE_NOFOLLOW))
+    {
+        return;
+    }
+    
+    // The clone carries the placeholder's xattrs along, which mean nothing in the cache
+    int tempFd = openat(cache->directoryFd, tempName, O_RDONLY | O_NOFOLLOW);
+    if (tempFd >= 0)
+    {
+        fremovexattr(tempFd, PrjFSFileXAttrName, 0);
+        fremovexattr(tempFd, PrjFSHydratedFileXAttrName, 0);
+        close(tempFd);
+    }
+    
+    if (0 != mkdirat(cache->directoryFd, subdirectoryName, 0755) && EEXIST != errno)
+    {
+        unlinkat(cache->directoryFd, tempName, 0);
+        return;
+    }
+    
+    if (renameat(cache->directoryFd, tempName, cache->directoryFd, entryPath.c_str()))
+    {
+        unlinkat(cache->directoryFd, tempName, 0);
+        return;
+    }
+    
+    uint64_t sizeBytes = cache->sizeBytes += static_cast<uint64_t>(fileHandle->placeholderSize);
+    if (sizeBytes > cache->maxSizeBytes)
+    {
+        EvictFromContentCache(cache.get());
+    }
+}
+
+// Lists the cached files and returns their total size. Temporary files that were
+// abandoned are removed along the way.
+static uint64_t ScanContentCache(int directoryFd, _Out_ std::vector<ContentCacheEntry>* entries)
+{
+    uint64_t totalSizeBytes = 0;
+    time_t staleSince = time(nullptr) - ContentCacheStaleTempFileSeconds;
+    
+    // Reopened rather than duplicated, so that the stream doesn't share directoryFd's offset
+    int scanFd = openat(directoryFd, ".", O_RDONLY | O_DIRECTORY);
+    DIR* directory = scanFd < 0 ? nullptr : fdopendir(scanFd);
+    if (nullptr == directory)
+    {
+        if (scanFd >= 0)
+        {
+            close(scanFd);
+        }
+        
+        return 0;
+    }
+    
+    struct dirent* subdirectoryEntry;
+    while (nullptr != (subdirectoryEntry = readdir(directory)))
+    {
+        struct stat attributes;
+        if (0 == strncmp(subdirectoryEntry->d_name, ContentCacheTempNamePrefix, sizeof(ContentCacheTempNamePrefix) - 1))
+        {
+            if (0 == fstatat(directoryFd, subdirectoryEntry->d_name, &attributes, AT_SYMLINK_NOFOLLOW) &&
+                attributes.st_mtimespec.tv_sec < staleSince)
+            {
+                unlinkat(directoryFd, subdirectoryEntry->d_name, 0);
+            }
+            
+            continue;
+        }
+        
+        if (DT_DIR != subdirectoryEntry->d_type || '.' == subdirectoryEntry->d_name[0])
+        {
+            continue;
+        }
+        
+        int subdirectoryFd = openat(directoryFd, subdirectoryEntry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        DIR* subdirectory = subdirectoryFd < 0 ? nullptr : fdopendir(subdirectoryFd);
+        if (nullptr == subdirectory)
+        {
+            if (subdirectoryFd >= 0)
+            {
+                close(subdirectoryFd);
+            }
+            
+            continue;
+        }
+        
+        struct dirent* entry;
+        while (nullptr != (entry = readdir(subdirectory)))
+        {
+            if (DT_REG != entry->d_type ||
+                0 != fstatat(subdirectoryFd, entry->d_name, &attributes, AT_SYMLINK_NOFOLLOW))
+            {
+                continue;
+            }
+            
+            totalSizeBytes += static_cast<uint64_t>(attributes.st_size);
+            entries->push_back(ContentCacheEntry { string(subdirectoryEntry->d_name) + "/" + entry->d_name, attributes.st_atimespec, attributes.st_size });
+        }
+        
+        closedir(subdirectory);
+    }
+    
+    closedir(directory);
+    return totalSizeBytes;
+}
+
+// Removes the least recently used contents until the cache is below its target size.
+// Processes sharing the cache may evict at the same time; removing a file that is being
+// copied from doesn't affect the copy, and one that was already removed is skipped.
+static void EvictFromContentCache(ContentCache* cache)
+{
+    // A hydration that finds eviction already running leaves it to that one
+    std::unique_lock<mutex> lock(cache->evictionMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return;
+    }
+    
+    std::vector<ContentCacheEntry> entries;
+    uint64_t sizeBytes = ScanContentCache(cache->directoryFd, &entries);
+    uint64_t targetSizeBytes = cache->maxSizeBytes / 100 * ContentCacheEvictionTargetPercent;
+    if (sizeBytes > targetSizeBytes)
+    {
+        std::sort(
+            entries.begin(),
+            entries.end(),
+            [](const ContentCacheEntry& left, const ContentCacheEntry& right)
+            {
+                return
+                    left.lastAccessTime.tv_sec != right.lastAccessTime.tv_sec ?
+                    left.lastAccessTime.tv_sec < right.lastAccessTime.tv_sec :
+                    left.lastAccessTime.tv_nsec < right.lastAccessTime.tv_nsec;
+            });
+        
+        for (const ContentCacheEntry& entry : entries)
+        {
+            if (sizeBytes <= targetSizeBytes)
+            {
+                break;
+            }
+            
+            if (0 == unlinkat(cache->directoryFd, entry.relativePath.c_str(), 0) || ENOENT == errno)
+            {
+                sizeBytes -= static_cast<uint64_t>(entry.size);
+            }
+        }
+    }
+    
+    cache->sizeBytes = sizeBytes;
+}
+
+// Reads the state of an open file with one fstat and one fgetxattr and checks that it is
+// a placeholder that may be updated or deleted with the given flags
+static PrjFS_Result CheckPlaceholderIsUpdatable(
+    int fd,
+    PrjFS_UpdateType updateFlags,
+    _Out_ struct stat* fileAttributes,
+    _Out_ PrjFSFileXAttrData* xattrData,
+    _Out_ bool* isFullFile,
+    _Out_ PrjFS_UpdateFailureCause* failureCause)
+{
+    *isFullFile = false;
+    
+    if (fstat(fd, fileAttributes))
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    if (!S_ISREG(fileAttributes->st_mode))
+    {
+        return PrjFS_Result_EInvalidArgs;
+    }
+    
+    if (!(fileAttributes->st_flags & FileFlags_IsInVirtualizationRoot) ||
+        !ReadFileXAttr(fd, xattrData))
+    {
+        // Files without placeholder metadata were created or fully written by the user
+        if (!(updateFlags & PrjFS_UpdateType_AllowDirtyData))
+        {
+            *failureCause = PrjFS_UpdateFailureCause_FullFile;
+            return PrjFS_Result_EInvalidOperation;
+        }
+        
+        *isFullFile = true;
+        memset(xattrData, 0, sizeof(*xattrData));
+    }
+    
+    if (IsReadOnly(*fileAttributes) && !(updateFlags & PrjFS_UpdateType_AllowReadOnly))
+    {
+        *failureCause = PrjFS_UpdateFailureCause_ReadOnly;
+        return PrjFS_Result_EAccessDenied;
+    }
+    
+    return PrjFS_Result_Success;
+}
+
+static bool IsReadOnly(const struct stat& fileAttributes)
+{
+    return 0 == (fileAttributes.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+}
+
+// Truncates an open placeholder or full file (fd, at path relative to directoryFd) to
+// an empty placeholder of the given size and ids. Writing requires a writable descriptor,
+// which a read-only file may only be opened for after temporarily granting the owner
+// write access.
+static bool ResetToEmptyPlaceholder(
+    int directoryFd,
+    const char* path,
+    int fd,
+    const struct stat& fileAttributes,
+    off_t fileSize,
+    const unsigned char* providerId,
+    const unsigned char* contentId)
+{
+    bool isEmpty = fileAttributes.st_flags & FileFlags_IsEmpty;
+    bool isReadOnly = IsReadOnly(fileAttributes);
+    int writeFd = -1;
+    if (isReadOnly && fchmod(fd, fileAttributes.st_mode | S_IWUSR))
+    {
+        goto CleanupAndFail;
+    }
+    
+    writeFd = openat(directoryFd, path, O_WRONLY | O_NOFOLLOW);
+    if (writeFd < 0)
+    {
+        goto CleanupAndFail;
+    }
+    
+    // A hydrated placeholder or full file is emptied first, so that no stale contents remain
+    // in the part of the file below the new size
+    if ((!isEmpty && ftruncate(writeFd, 0)) ||
+        ftruncate(writeFd, fileSize) ||
+        !UpdateFileFlags(writeFd, FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty, 0) ||
+        !WriteFileXAttr(writeFd, providerId, contentId))
+    {
+        goto CleanupAndFail;
+    }
+    
+    // A leftover stamp would be stale once the file is hydrated and written again
+    fremovexattr(writeFd, PrjFSHydratedFileXAttrName, 0);
+    
+    if (isReadOnly && fchmod(fd, fileAttributes.st_mode))
+    {
+        isReadOnly = false;
+        goto CleanupAndFail;
+    }
+    
+    close(writeFd);
+    return true;
+    
+CleanupAndFail:
+    if (isReadOnly)
+    {
+        fchmod(fd, fileAttributes.st_mode);
+    }
+    
+    if (writeFd >= 0)
+    {
+        close(writeFd);
+    }
+    
+    return false;
+}
+
+// Not fatal if it fails, the file then just can't be dehydrated. Neither the
+// xattr nor the flags change the modification time.
+static void WriteHydratedFileXAttr(int fd)
+{
+    struct stat fileAttributes;
+    if (fstat(fd, &fileAttributes))
+    {
+        return;
+    }
+    
+    PrjFSHydratedFileXAttrData xattr = {};
+    xattr.header.magicNumber = PlaceholderMagicNumber;
+    xattr.header.formatVersion = PlaceholderFormatVersion;
+    xattr.modificationTimeSeconds = fileAttributes.st_mtimespec.tv_sec;
+    xattr.modificationTimeNanoseconds = fileAttributes.st_mtimespec.tv_nsec;
+    xattr.fileSize = fileAttributes.st_size;
+    if (fsetxattr(fd, PrjFSHydratedFileXAttrName, &xattr, sizeof(xattr), 0, 0))
+    {
+        s_xattrErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static bool IsUnmodifiedSinceHydration(int fd, const struct stat& fileAttributes)
+{
+    PrjFSHydratedFileXAttrData xattr;
+    return
+        sizeof(xattr) == fgetxattr(fd, PrjFSHydratedFileXAttrName, &xattr, sizeof(xattr), 0, 0) &&
+        IsXAttrHeaderValid(xattr.header) &&
+        xattr.modificationTimeSeconds == fileAttributes.st_mtimespec.tv_sec &&
+        xattr.modificationTimeNanoseconds == fileAttributes.st_mtimespec.tv_nsec &&
+        xattr.fileSize == fileAttributes.st_size;
+}
+
+// *reclaimedBytes is set to the disk space the contents took
+static PrjFS_Result DehydrateFile(PrjFS_Instance* instance, const char* relativePath, _Out_ PrjFS_UpdateFailureCause* failureCause, _Out_ off_t* reclaimedBytes)
+{
+    *failureCause = PrjFS_UpdateFailureCause_Invalid;
+    *reclaimedBytes = 0;
+    
+    int fd = OpenInRoot(instance, relativePath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EFileNotFound : PrjFS_Result_EIOError;
+    }
+    
+    // The contents can be fetched again however the file's mode is set
+    struct stat fileAttributes;
+    PrjFSFileXAttrData xattrData;
+    bool isFullFile;
+    PrjFS_Result result = CheckPlaceholderIsUpdatable(fd, PrjFS_UpdateType_AllowReadOnly, &fileAttributes, &xattrData, &isFullFile, failureCause);
+    if (PrjFS_Result_Success != result || (fileAttributes.st_flags & FileFlags_IsEmpty))
+    {
+        close(fd);
+        return result;
+    }
+    
+    if (!IsUnmodifiedSinceHydration(fd, fileAttributes))
+    {
+        close(fd);
+        *failureCause = PrjFS_UpdateFailureCause_FullFile;
+        return PrjFS_Result_EInvalidOperation;
+    }
+    
+    result =
+        ResetToEmptyPlaceholder(instance->rootFd, relativePath, fd, fileAttributes, fileAttributes.st_size, xattrData.providerId, xattrData.contentId)
+        ? PrjFS_Result_Success
+        : PrjFS_Result_EIOError;
+    SignalKernelFileFlagsChanged(instance, fd);
+    if (PrjFS_Result_Success == result)
+    {
+        *reclaimedBytes = fileAttributes.st_blocks * S_BLKSIZE;
+    }
+    
+    close(fd);
+    return result;
+}
+
+// Appends the directory's hydrated placeholder files that pass the filter and
+// were last read before idleSince, and its subdirectories other than empty
+// placeholders, which contain no hydrated files. Whether a file was modified
+// after hydration is only checked when it is dehydrated.
+static PrjFS_Result FindDehydrationCandidates(
+    PrjFS_Instance* instance,
+    const string& directoryRelativePath,
+    PrjFS_FileFilterCallback* filter,
+    void* filterContext,
+    time_t idleSince,
+    std::vector<string>* subdirectories,
+    std::vector<DehydrationCandidate>* candidates)
+{
+    int directoryFd = OpenInRoot(instance, directoryRelativePath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    DIR* directory = fdopendir(directoryFd);
+    if (nullptr == directory)
+    {
+        close(directoryFd);
+        return PrjFS_Result_EIOError;
+    }
+    
+    string childRelativePath = directoryRelativePath;
+    if (!childRelativePath.empty())
+    {
+        childRelativePath += '/';
+    }
+    
+    size_t childNameOffset = childRelativePath.size();
+    while (dirent* entry = readdir(directory))
+    {
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+        {
+            continue;
+        }
+        
+        struct stat entryAttributes;
+        if (fstatat(dirfd(directory), entry->d_name, &entryAttributes, AT_SYMLINK_NOFOLLOW) ||
+            !(entryAttributes.st_flags & FileFlags_IsInVirtualizationRoot) ||
+            (entryAttributes.st_flags & FileFlags_IsEmpty))
+        {
+            continue;
+        }
+        
+        childRelativePath.resize(childNameOffset);
+        childRelativePath += entry->d_name;
+        
+        if (S_ISDIR(entryAttributes.st_mode))
+        {
+            subdirectories->push_back(childRelativePath);
+        }
+        else if (S_ISREG(entryAttributes.st_mode) &&
+                 entryAttributes.st_atimespec.tv_sec < idleSince &&
+                 (nullptr == filter || filter(childRelativePath.c_str(), filterContext)))
+        {
+            candidates->push_back(DehydrationCandidate { childRelativePath, entryAttributes.st_atimespec.tv_sec });
+        }
+    }
+    
+    closedir(directory);
+    return PrjFS_Result_Success;
+}
+
+static bool InitializeEmptyPlaceholder(int fd)
+{
+    return UpdateFileFlags(fd, FileFlags_IsInVirtualizationRoot | FileFlags_IsEmpty, 0);
+}
+
+template<typename TPlaceholder>
+static bool InitializeEmptyPlaceholder(int fd, TPlaceholder* data, const char* xattrName)
+{
+    if (InitializeEmptyPlaceholder(fd))
+    {
+        data->header.magicNumber = PlaceholderMagicNumber;
+        data->header.formatVersion = PlaceholderFormatVersion;
+        
+        static_assert(std::is_pod<TPlaceholder>(), "TPlaceholder must be a POD struct");
+        if (0 == fsetxattr(fd, xattrName, data, sizeof(TPlaceholder), 0, 0))
+        {
+            return true;
+        }
+        
+        s_xattrErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    return false;
+}
+
+template<typename TPlaceholder>
+static bool InitializeEmptyPlaceholder(const char* fullPath, TPlaceholder* data, const char* xattrName)
+{
+    int fd = open(fullPath, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    
+    bool succeeded = InitializeEmptyPlaceholder(fd, data, xattrName);
+    close(fd);
+    return succeeded;
+}
+
+// Checks the directory and each of its ancestors
+static bool IsInsideVirtualizationRoot(const char* fullPath)
+{
+    char path[PrjFSMaxPath];
+    strlcpy(path, fullPath, sizeof(path));
+    while (true)
+    {
+        if (IsBitSetInFileFlags(AT_FDCWD, path, FileFlags_IsInVirtualizationRoot) || IsVirtualizationRoot(path))
+        {
+            return true;
+        }
+        
+        char* lastSlash = strrchr(path, '/');
+        if (nullptr == lastSlash || (lastSlash == path && '\0' == path[1]))
+        {
+            return false;
+        }
+        
+        // Keep the slash of the file system root
+        lastSlash[lastSlash == path ? 1 : 0] = '\0';
+    }
+}
+
+// Everything already in a new root becomes part of it as full files and directories,
+// which need neither hydration nor enumeration
+static PrjFS_Result ConvertDirectoryContents(const char* rootFullPath)
+{
+    int rootFd = open(rootFullPath, O_RDONLY | O_DIRECTORY);
+    if (rootFd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    bool clearedEmptyFlag = UpdateFileFlags(rootFd, 0, FileFlags_IsEmpty);
+    close(rootFd);
+    if (!clearedEmptyFlag)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    return WalkTreeInParallel(
+        rootFullPath,
+        "",
+        [](int directoryFd, const string& directoryRelativePath, const std::vector<BulkDirectoryEntry>& entries)
+        {
+            for (const BulkDirectoryEntry& entry : entries)
+            {
+                if (!SetFileFlagsAt(directoryFd, entry.name, entry.flags | FileFlags_IsInVirtualizationRoot))
+                {
+                    return PrjFS_Result_EIOError;
+                }
+            }
+            
+            return PrjFS_Result_Success;
+        });
+}
+
+// Entries already in the root are left alone: empty placeholders still need the
+// provider, and the others are part of the root already. The flags are set last, so
+// an entry whose conversion fails is left as it was but for its xattrs.
+static PrjFS_Result ConvertEntryToPlaceholderAt(
+    int directoryFd,
+    const BulkDirectoryEntry& entry,
+    const string& relativePath,
+    PrjFS_ConvertEntryCallback* callback,
+    void* callbackContext)
+{
+    if (entry.flags & FileFlags_IsInVirtualizationRoot)
+    {
+        return PrjFS_Result_Success;
+    }
+    
+    const uint32_t flags = entry.flags | FileFlags_IsInVirtualizationRoot;
+    bool isDirectory = VDIR == entry.objectType;
+    if (nullptr == callback || (!isDirectory && VREG != entry.objectType))
+    {
+        return SetFileFlagsAt(directoryFd, entry.name, flags) ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+    }
+    
+    unsigned char providerId[PrjFS_PlaceholderIdLength] = {};
+    unsigned char contentId[PrjFS_PlaceholderIdLength] = {};
+    PrjFS_Result result = callback(relativePath.c_str(), isDirectory, providerId, contentId, callbackContext);
+    if (PrjFS_Result_Success != result)
+    {
+        return result;
+    }
+    
+    if (IsZeroId(providerId) && IsZeroId(contentId))
+    {
+        return SetFileFlagsAt(directoryFd, entry.name, flags) ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+    }
+    
+    int fd = openat(directoryFd, entry.name, (isDirectory ? O_DIRECTORY : 0) | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return PrjFS_Result_EIOError;
+    }
+    
+    // Like a file written by WriteFullFileEntryAt, a file with ids is a hydrated placeholder
+    // that is unmodified since its hydration
+    bool converted = WriteFileXAttr(fd, providerId, contentId);
+    if (converted && !isDirectory)
+    {
+        WriteHydratedFileXAttr(fd);
+    }
+    
+    converted = converted && SetFileFlags(fd, flags);
+    close(fd);
+    return converted ? PrjFS_Result_Success : PrjFS_Result_EIOError;
+}
+
+// Reads the directory tree below startRelativePath (not following symlinks) with up
+// to MaxTreeWalkThreadCount threads, including the calling one. Paths passed to the
+// visitor are relative to rootFullPath. Returns the first failure of the visitor or
+// of reading a directory.
+static PrjFS_Result WalkTreeInParallel(const char* rootFullPath, const char* startRelativePath, const TreeWalkVisitor& visitor)
+{
+    ParallelTreeWalk walk;
+    walk.rootFd = open(rootFullPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk.rootFd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    walk.visitor = &visitor;
+    walk.pendingDirectories.push_back(startRelativePath);
+    
+    unsigned int threadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), MaxTreeWalkThreadCount));
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(RunTreeWalkThread, &walk);
+    }
+    
+    RunTreeWalkThread(&walk);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    
+    close(walk.rootFd);
+    return walk.result;
+}
+
+static void RunTreeWalkThread(ParallelTreeWalk* walk)
+{
+    std::vector<char> buffer(TreeWalkBufferSize);
+    std::vector<BulkDirectoryEntry> entries;
+    std::vector<string> subdirectories;
+    
+    std::unique_lock<mutex> lock(walk->mutex);
+    while (true)
+    {
+        walk->stateChanged.wait(
+            lock,
+            [walk]
+            {
+                return !walk->pendingDirectories.empty() || 0 == walk->busyThreadCount;
+            });
+        
+        if (walk->pendingDirectories.empty())
+        {
+            // Nothing left, and nobody still reading a directory could add more
+            break;
+        }
+        
+        string relativePath = std::move(walk->pendingDirectories.back());
+        walk->pendingDirectories.pop_back();
+        walk->busyThreadCount++;
+        lock.unlock();
+        
+        subdirectories.clear();
+        PrjFS_Result result = VisitDirectoryEntries(walk, relativePath, buffer, entries, &subdirectories);
+        
+        lock.lock();
+        walk->busyThreadCount--;
+        if (PrjFS_Result_Success != result)
+        {
+            if (PrjFS_Result_Success == walk->result)
+            {
+                walk->result = result;
+            }
+            
+            walk->pendingDirectories.clear();
+        }
+        else if (PrjFS_Result_Success == walk->result)
+        {
+            walk->pendingDirectories.insert(
+                walk->pendingDirectories.end(),
+                std::make_move_iterator(subdirectories.begin()),
+                std::make_move_iterator(subdirectories.end()));
+        }
+        
+        walk->stateChanged.notify_all();
+    }
+}
+
+// Calls the walk's visitor for each batch of entries of one directory and collects its subdirectories
+static PrjFS_Result VisitDirectoryEntries(
+    ParallelTreeWalk* walk,
+    const string& directoryRelativePath,
+    std::vector<char>& buffer,
+    std::vector<BulkDirectoryEntry>& entries,
+    std::vector<string>* subdirectories)
+{
+    // Opening each directory relative to its parent would save more lookups, but the
+    // parent has long been closed by the time another thread gets to it
+    const char* openPath = directoryRelativePath.empty() ? "." : directoryRelativePath.c_str();
+    int directoryFd = openat(walk->rootFd, openPath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (directoryFd < 0)
+    {
+        return ENOENT == errno ? PrjFS_Result_EPathNotFound : PrjFS_Result_EIOError;
+    }
+    
+    // Attributes are packed in the order of their bits, ATTR_CMN_RETURNED_ATTRS and
+    // ATTR_CMN_ERROR first and file attributes after all common ones
+    struct attrlist attributes = {};
+    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attributes.commonattr =
+        ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_ERROR | ATTR_CMN_NAME | ATTR_CMN_OBJTYPE | ATTR_CMN_MODTIME | ATTR_CMN_FLAGS;
+    attributes.fileattr = ATTR_FILE_DATALENGTH;
+    
+    string childRelativePath = directoryRelativePath;
+    if (!childRelativePath.empty())
+    {
+        childRelativePath += '/';
+    }
+    
+    size_t childNameOffset = childRelativePath.size();
+    PrjFS_Result result = PrjFS_Result_Success;
+    int entryCount;
+    while (PrjFS_Result_Success == result &&
+           (entryCount = getattrlistbulk(directoryFd, &attributes, buffer.data(), buffer.size(), 0)) > 0)
+    {
+        entries.clear();
+        const char* entryStart = buffer.data();
+        for (int i = 0; i < entryCount; ++i)
+        {
+            const char* field = entryStart;
+            uint32_t entryLength = ReadAttributeField<uint32_t>(&field);
+            entryStart += entryLength;
+            
+            attribute_set_t returnedAttributes = ReadAttributeField<attribute_set_t>(&field);
+            if ((returnedAttributes.commonattr & ATTR_CMN_ERROR) && 0 != ReadAttributeField<uint32_t>(&field))
+            {
+                result = PrjFS_Result_EIOError;
+                break;
+            }
+            
+            // The name's offset is relative to its attrreference_t
+            const char* nameField = field;
+            attrreference_t nameReference = ReadAttributeField<attrreference_t>(&field);
+            
+            BulkDirectoryEntry entry = {};
+            entry.name = nameField + nameReference.attr_dataoffset;
+            entry.objectType = VNON;
+            if (returnedAttributes.commonattr & ATTR_CMN_OBJTYPE)
+            {
+                entry.objectType = ReadAttributeField<fsobj_type_t>(&field);
+            }
+            
+            if (returnedAttributes.commonattr & ATTR_CMN_MODTIME)
+            {
+                entry.modificationTime = ReadAttributeField<struct timespec>(&field);
+            }
+            
+            if (!(returnedAttributes.commonattr & ATTR_CMN_FLAGS))
+            {
+                result = PrjFS_Result_EIOError;
+                break;
+            }
+            
+            entry.flags = ReadAttributeField<uint32_t>(&field);
+            if (returnedAttributes.fileattr & ATTR_FILE_DATALENGTH)
+            {
+                entry.fileSize = ReadAttributeField<off_t>(&field);
+            }
+            
+            // Only ever holds entries on their way into the root
+            if (directoryRelativePath.empty() && 0 == strcmp(entry.name, PrjFS_TempDirectoryName))
+            {
+                continue;
+            }
+            
+            entries.push_back(entry);
+        }
+        
+        if (PrjFS_Result_Success == result)
+        {
+            result = (*walk->visitor)(directoryFd, directoryRelativePath, entries);
+        }
+        
+        if (PrjFS_Result_Success == result)
+        {
+            for (const BulkDirectoryEntry& entry : entries)
+            {
+                if (VDIR == entry.objectType)
+                {
+                    childRelativePath.resize(childNameOffset);
+                    childRelativePath += entry.name;
+                    subdirectories->push_back(childRelativePath);
+                }
+            }
+        }
+    }
+    
+    if (PrjFS_Result_Success == result && entryCount < 0)
+    {
+        result = PrjFS_Result_EIOError;
+    }
+    
+    close(directoryFd);
+    return result;
+}
+
+// Only empty files need their xattr read, which keeps the check cheap in trees that
+// are mostly hydrated
+static PrjFS_PlaceholderDefect GetPlaceholderDefect(int directoryFd, const BulkDirectoryEntry& entry)
+{
+    if (!(entry.flags & FileFlags_IsInVirtualizationRoot))
+    {
+        return PrjFS_PlaceholderDefect_MissingFlags;
+    }
+    
+    if (VREG != entry.objectType || !(entry.flags & FileFlags_IsEmpty))
+    {
+        return PrjFS_PlaceholderDefect_None;
+    }
+    
+    int fd = openat(directoryFd, entry.name, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        // Gone since the directory was read
+        return PrjFS_PlaceholderDefect_None;
+    }
+    
+    PrjFSFileXAttrData xattrData;
+    bool hasFileXAttr = ReadFileXAttr(fd, &xattrData);
+    close(fd);
+    return hasFileXAttr ? PrjFS_PlaceholderDefect_None : PrjFS_PlaceholderDefect_MissingFileXAttr;
+}
+
+// Returns PrjFS_FileState_Invalid for files whose state depends on their placeholder
+// xattr: hydrated placeholders keep it, files created in the root never had one.
+static PrjFS_FileState GetFileStateFromFlags(bool isDirectory, uint32_t fileFlags)
+{
+    if (!(fileFlags & FileFlags_IsInVirtualizationRoot))
+    {
+        return PrjFS_FileState_Full;
+    }
+    
+    if (fileFlags & FileFlags_IsEmpty)
+    {
+        return PrjFS_FileState_Placeholder;
+    }
+    
+    return isDirectory ? PrjFS_FileState_HydratedPlaceholder : PrjFS_FileState_Invalid;
+}
+
+// There is no getxattrat, so the file is opened relative to its directory instead of
+// having its whole path looked up again. Symlinks never have the xattr.
+static bool HasPlaceholderFileXAttr(int directoryFd, const char* path)
+{
+    int fd = openat(directoryFd, path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        return false;
+    }
+    
+    // Only the xattr's size is read
+    bool hasFileXAttr = fgetxattr(fd, PrjFSFileXAttrName, nullptr, 0, 0, 0) > 0;
+    close(fd);
+    return hasFileXAttr;
+}
+
+// Attributes in a getattrlistbulk buffer are only aligned to 4 bytes
+template<typename T>
+static T ReadAttributeField(const char** field)
+{
+    T value;
+    memcpy(&value, *field, sizeof(value));
+    *field += sizeof(value);
+    return value;
+}
+
+static bool IsVirtualizationRoot(const char* path)
+{
+    PrjFSVirtualizationRootXAttrData data;
+    return ReadRootXAttr(path, &data);
+}
+
+// Roots converted before tokens existed have a header-only xattr; their token reads as 0
+static bool ReadRootXAttr(const char* path, _Out_ PrjFSVirtualizationRootXAttrData* data)
+{
+    memset(data, 0, sizeof(*data));
+    ssize_t xattrSize = getxattr(path, PrjFSVirtualizationRootXAttrName, data, sizeof(*data), 0, 0);
+    if (xattrSize < static_cast<ssize_t>(sizeof(data->header)) || !IsXAttrHeaderValid(data->header))
+    {
+        return false;
+    }
+    
+    if (xattrSize < static_cast<ssize_t>(sizeof(*data)))
+    {
+        data->rootToken = 0;
+    }
+    
+    return true;
+}
+
+static uint64_t GenerateRootToken()
+{
+    uint64_t rootToken;
+    do
+    {
+        arc4random_buf(&rootToken, sizeof(rootToken));
+    } while (0 == rootToken);
+    
+    return rootToken;
+}
+
+// Opens the file or directory a kernel request refers to by its fsid and file id
+// where possible, and by its path relative to the virtualization root otherwise.
+static int OpenRequestTarget(PrjFS_Instance* instance, const MessageHeader* request, const char* relativePath, int flags)
+{
+    if (0 != request->fileId && !s_openByIdUnavailable)
+    {
+        fsid_t fsid = request->fsid;
+        fsobj_id_t objectId =
+        {
+            static_cast<u_int32_t>(request->fileId),       // fid_objno
+            static_cast<u_int32_t>(request->fileId >> 32), // fid_generation
+        };
+        
+        int fd = openbyid_np(&fsid, &objectId, flags);
+        if (fd >= 0)
+        {
+            return fd;
+        }
+        
+        if (EPERM == errno || ENOTSUP == errno)
+        {
+            s_openByIdUnavailable = true;
+        }
+    }
+    
+    return OpenInRoot(instance, relativePath, flags);
+}
+
+static int OpenInRoot(PrjFS_Instance* instance, const char* relativePath, int flags)
+{
+    // openat doesn't accept an empty path for the directory itself
+    return openat(instance->rootFd, '\0' == relativePath[0] ? "." : relativePath, flags);
+}
+
+static bool SetFileFlags(int fd, uint32_t flags)
+{
+    if (fchflags(fd, flags))
+    {
+        s_fileFlagsErrorCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    return true;
+}
+
+// Sets the flags of a directory entry without opening it, or following it if it is a symlink
+static bool SetFileFlagsAt(int directoryFd, const char* name, uint32_t flags)
+{
+    struct attrlist attributes = {};
+    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attributes.commonattr = ATTR_CMN_FLAGS;
+    if (setattrlistat(directoryFd, name, &attributes, &flags, sizeof(flags), FSOPT_NOFOLLOW))
+    {
+        s_fileFlagsErrorCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    return true;
+}
+
+// Applies all flag changes with a single fchflags
+static bool UpdateFileFlags(int fd, uint32_t bitsToSet, uint32_t bitsToClear)
+{
+    struct stat fileAttributes;
+    if (fstat(fd, &fileAttributes))
+    {
+        s_fileFlagsErrorCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    uint32_t newValue = (fileAttributes.st_flags | bitsToSet) & ~bitsToClear;
+    return newValue == fileAttributes.st_flags || SetFileFlags(fd, newValue);
+}
+
+static bool IsBitSetInFileFlags(int directoryFd, const char* path, uint32_t bit)
+{
+    struct stat fileAttributes;
+    if (fstatat(directoryFd, path, &fileAttributes, 0))
+    {
+        return false;
+    }
+
+    return fileAttributes.st_flags & bit;
+}
+
+static bool GetXAttr(const char* path, const char* name, size_t size, _Out_ void* value)
+{
+    // Xattrs with an unknown magic number or format version are treated like missing ones
+    return
+        getxattr(path, name, value, size, 0, 0) == size &&
+        IsXAttrHeaderValid(*static_cast<const PrjFSXattrHeader*>(value));
+}
+
+static bool IsXAttrHeaderValid(const PrjFSXattrHeader& header)
+{
+    return
+        PlaceholderMagicNumber == header.magicNumber &&
+        header.formatVersion >= PlaceholderFormatVersion_FixedLengthIds &&
+        header.formatVersion <= PlaceholderFormatVersion;
+}
+
+// Reads a file's placeholder ids in either format with a single fgetxattr
+static bool ReadFileXAttr(int fd, _Out_ PrjFSFileXAttrData* data)
+{
+    static_assert(sizeof(PrjFSFileXAttrCompactData) >= sizeof(PrjFSFileXAttrData), "Buffer must fit either format");
+    
+    PrjFSFileXAttrCompactData xattr;
+    ssize_t xattrSize = fgetxattr(fd, PrjFSFileXAttrName, &xattr, sizeof(xattr), 0, 0);
+    if (xattrSize < 0 && ENOATTR != errno)
+    {
+        s_xattrErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    return DecodeFileXAttr(xattr, xattrSize, data);
+}
+
+static bool ReadFileXAttr(const char* path, _Out_ PrjFSFileXAttrData* data)
+{
+    PrjFSFileXAttrCompactData xattr;
+    ssize_t xattrSize = getxattr(path, PrjFSFileXAttrName, &xattr, sizeof(xattr), 0, 0);
+    if (xattrSize < 0 && ENOATTR != errno)
+    {
+        s_xattrErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    return DecodeFileXAttr(xattr, xattrSize, data);
+}
+
+static bool DecodeFileXAttr(const PrjFSFileXAttrCompactData& xattr, ssize_t xattrSize, _Out_ PrjFSFileXAttrData* data)
+{
+    const ssize_t idsOffset = offsetof(PrjFSFileXAttrCompactData, ids);
+    if (xattrSize < static_cast<ssize_t>(sizeof(PrjFSXattrHeader)) || !IsXAttrHeaderValid(xattr.header))
+    {
+        return false;
+    }
+    
+    if (PlaceholderFormatVersion_FixedLengthIds == xattr.header.formatVersion)
+    {
+        if (sizeof(*data) != xattrSize)
+        {
+            return false;
+        }
+        
+        memcpy(data, &xattr, sizeof(*data));
+        return true;
+    }
+    
+    if (xattrSize < idsOffset ||
+        xattr.providerIdLength > PrjFS_PlaceholderIdLength ||
+        xattr.contentIdLength > PrjFS_PlaceholderIdLength ||
+        idsOffset + xattr.providerIdLength + xattr.contentIdLength != xattrSize)
+    {
+        return false;
+    }
+    
+    *data = PrjFSFileXAttrData {};
+    data->header = xattr.header;
+    memcpy(data->providerId, xattr.ids, xattr.providerIdLength);
+    memcpy(data->contentId, xattr.ids + xattr.providerIdLength, xattr.contentIdLength);
+    return true;
+}
+
+static bool IsZeroId(const unsigned char* id)
+{
+    if (nullptr == id)
+    {
+        return true;
+    }
+    
+    for (size_t i = 0; i < PrjFS_PlaceholderIdLength; ++i)
+    {
+        if (0 != id[i])
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Ids of the directory an EnumerateDirectory request is for, all zero if it was written
+// without any. directoryFd is used if the xattr has to be read and may be -1.
+static void ReadDirectoryIds(PrjFS_Instance* instance, const MessageHeader* request, const char* path, int directoryFd, _Out_ PrjFSFileXAttrData* data)
+{
+    *data = PrjFSFileXAttrData {};
+    
+    // The kernel reads the xattr of every directory it sends, so it is only read here for
+    // requests the kernel didn't send or whose xattr didn't fit the message. Should the
+    // kernel have failed to read it, the provider enumerates by path as it would anyway.
+    bool xattrInMessage = 0 != request->fileXattrSizeBytes && request->fileXattrSizeBytes <= sizeof(PrjFSFileXAttrCompactData);
+    if (!xattrInMessage && MessageFileType_Directory == request->fileType && 0 == request->fileXattrSizeBytes)
+    {
+        return;
+    }
+    
+    int fd = directoryFd;
+    if (!xattrInMessage && fd < 0)
+    {
+        fd = OpenRequestTarget(instance, request, path, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+        {
+            return;
+        }
+    }
+    
+    if (!ReadRequestFileXAttr(request, fd, data))
+    {
+        *data = PrjFSFileXAttrData {};
+    }
     
-    // Mode "wbx" means
-    //  - Create an empty file if none exists
-    //  - Fail if a file already exists at this path
-    FILE* file = fopen(fullPath, "wbx");
-    if (nullptr == file)
+    if (fd != directoryFd)
     {
-        goto CleanupAndFail;
+        close(fd);
     }
-    
-    // Expand the file to the desired size
-    if (ftruncate(fileno(file), fileSize))
+}
+
+// Uses the xattr the kernel sent with the request, unless it had none to send
+static bool ReadRequestFileXAttr(const MessageHeader* request, int fd, _Out_ PrjFSFileXAttrData* data)
+{
+    if (0 == request->fileXattrSizeBytes || request->fileXattrSizeBytes > sizeof(PrjFSFileXAttrCompactData))
     {
-        goto CleanupAndFail;
+        return ReadFileXAttr(fd, data);
     }
     
-    fclose(file);
-    file = nullptr;
-    
-    memcpy(fileXattrData.providerId, providerId, PrjFS_PlaceholderIdLength);
-    memcpy(fileXattrData.contentId, contentId, PrjFS_PlaceholderIdLength);
+    // Copied out, as it follows the paths without any alignment
+    PrjFSFileXAttrCompactData xattr;
+    const char* xattrInMessage = reinterpret_cast<const char*>(request + 1) + request->pathSizeBytes + request->fromPathSizeBytes;
+    memcpy(&xattr, xattrInMessage, request->fileXattrSizeBytes);
+    return DecodeFileXAttr(xattr, request->fileXattrSizeBytes, data);
+}
+
+// Writes the ids in the current, compact format
+static bool WriteFileXAttr(int fd, const unsigned char* providerId, const unsigned char* contentId)
+{
+    PrjFSFileXAttrCompactData xattr;
+    xattr.header.magicNumber = PlaceholderMagicNumber;
+    xattr.header.formatVersion = PlaceholderFormatVersion;
     
-    if (!InitializeEmptyPlaceholder(
-            fullPath,
-            &fileXattrData,
-            PrjFSFileXAttrName))
+    uint8_t providerIdLength = PrjFS_PlaceholderIdLength;
+    while (providerIdLength > 0 && 0 == providerId[providerIdLength - 1])
     {
-        goto CleanupAndFail;
+        providerIdLength--;
     }
     
-    if (chmod(fullPath, fileMode))
+    uint8_t contentIdLength = PrjFS_PlaceholderIdLength;
+    while (contentIdLength > 0 && 0 == contentId[contentIdLength - 1])
     {
-        goto CleanupAndFail;
+        contentIdLength--;
     }
-
-    return PrjFS_Result_Success;
     
-CleanupAndFail:
-    if (nullptr != file)
+    xattr.providerIdLength = providerIdLength;
+    xattr.contentIdLength = contentIdLength;
+    memcpy(xattr.ids, providerId, providerIdLength);
+    memcpy(xattr.ids + providerIdLength, contentId, contentIdLength);
+    
+    size_t xattrSize = offsetof(PrjFSFileXAttrCompactData, ids) + providerIdLength + contentIdLength;
+    if (fsetxattr(fd, PrjFSFileXAttrName, &xattr, xattrSize, 0, 0))
     {
-        // TODO: we now have a partially created placeholder file. Should we delete it?
-        // A better pattern would likely be to create the file in a tmp location, fully initialize its state, then move it into the requested path
-        
-        fclose(file);
-        file = nullptr;
+        s_xattrErrorCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
     
-    return PrjFS_Result_EIOError;
+    return true;
 }
 
-PrjFS_Result PrjFS_WriteFileContents(
-    _In_    const PrjFS_FileHandle*                 fileHandle,
-    _In_    const void*                             bytes,
-    _In_    unsigned int                            byteCount)
+// Not fatal if it fails, responses then take a call into the kernel each
+static void MapResponseRing(PrjFS_Instance* instance)
 {
-#ifdef DEBUG
-    std::cout
-        << "PrjFS_WriteFile("
-        << fileHandle->file << ", "
-        << (int)((char*)bytes)[0] << ", "
-        << (int)((char*)bytes)[1] << ", "
-        << (int)((char*)bytes)[2] << ", "
-        << byteCount << ")" << std::endl;
-#endif
-    
-    if (nullptr == fileHandle->file ||
-        nullptr == bytes)
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+    IOReturn result = IOConnectMapMemory64(
+        instance->kernelServiceConnection,
+        ProviderMemoryType_ResponseRing,
+        mach_task_self(),
+        &address,
+        &size,
+        kIOMapAnywhere);
+    if (kIOReturnSuccess != result || 0 == address)
     {
-        return PrjFS_Result_EInvalidArgs;
+        cerr << "Mapping the response ring failed: 0x" << std::hex << result << std::dec << endl;
+        return;
     }
     
-    if (byteCount != fwrite(bytes, 1, byteCount, fileHandle->file))
+    instance->responseRingAddress = address;
+    if (size < sizeof(ResponseRing))
     {
-        return PrjFS_Result_EIOError;
+        cerr << "Response ring is too small: " << size << " bytes, expected " << sizeof(ResponseRing) << ". Kernel/user version mismatch?\n";
+        UnmapResponseRing(instance);
+        return;
     }
     
-    return PrjFS_Result_Success;
+    instance->responseRing = reinterpret_cast<ResponseRing*>(address);
 }
 
-// Private functions
-
-
-static Message ParseMessageMemory(const void* messageMemory, uint32_t size)
+// Responders that are still running see a null ring and fall back to calls
+// into the kernel, which fail harmlessly once the connection is closed.
+static void UnmapResponseRing(PrjFS_Instance* instance)
 {
-    const MessageHeader* header = static_cast<const MessageHeader*>(messageMemory);
-    if (header->pathSizeBytes + sizeof(*header) != size)
-    {
-        fprintf(stderr, "ParseMessageMemory: invariant failed, bad message? PathSizeBytes = %u, message size = %u, expecting %zu\n",
-            header->pathSizeBytes, size, header->pathSizeBytes + sizeof(*header));
-        abort();
-    }
-            
-    const char* path = nullptr;
-    if (header->pathSizeBytes > 0)
+    mutex_lock lock(instance->responseRingMutex);
+    instance->responseRing = nullptr;
+    if (0 != instance->responseRingAddress)
     {
-        path = static_cast<const char*>(messageMemory) + sizeof(*header);
-        
-        // Path string should fit exactly in reserved memory, with nul terminator in end position
-        assert(strnlen(path, header->pathSizeBytes) == header->pathSizeBytes - 1);
+        IOConnectUnmapMemory64(instance->kernelServiceConnection, ProviderMemoryType_ResponseRing, mach_task_self(), instance->responseRingAddress);
+        instance->responseRingAddress = 0;
     }
-    return Message { header, path };
 }
 
-static void HandleKernelRequest(Message request, void* messageMemory)
+// Appends as many of the responses to the response ring as there is room for and
+// returns how many that was. The doorbell is only rung if it is armed; otherwise
+// the kernel is draining the ring already and will pick these up too.
+static size_t QueueKernelMessageResponses(PrjFS_Instance* instance, const uint64_t* messageIds, size_t messageIdCount, MessageType responseType)
 {
-    PrjFS_Result result = PrjFS_Result_EIOError;
-    
-    const MessageHeader* requestHeader = request.messageHeader;
-    switch (requestHeader->messageType)
+    size_t queuedCount = 0;
+    bool ringDoorbell = false;
     {
-        case MessageType_KtoU_EnumerateDirectory:
+        mutex_lock lock(instance->responseRingMutex);
+        ResponseRing* ring = instance->responseRing;
+        if (nullptr == ring)
         {
-            result = HandleEnumerateDirectoryRequest(requestHeader, request.path);
-            break;
+            return 0;
         }
-            
-        case MessageType_KtoU_HydrateFile:
+        
+        // Only we write the tail; the kernel only ever moves the head towards it
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t freeCount = ResponseRingCapacity - (tail - head);
+        queuedCount = std::min<size_t>(freeCount, messageIdCount);
+        for (size_t i = 0; i < queuedCount; ++i)
         {
-            result = HandleHydrateFileRequest(requestHeader, request.path);
-            break;
+            ring->entries[(tail + i) % ResponseRingCapacity] = KernelMessageResponse { messageIds[i], responseType, 0 };
+        }
+        
+        if (0 != queuedCount)
+        {
+            // Must be ordered before the doorbell check, see ResponseRing
+            __atomic_store_n(&ring->tail, tail + static_cast<uint32_t>(queuedCount), __ATOMIC_SEQ_CST);
+            ringDoorbell = (1 == __atomic_exchange_n(&ring->doorbellArmed, 0, __ATOMIC_SEQ_CST));
         }
     }
     
-    // async callbacks are not yet implemented
-    assert(PrjFS_Result_Pending != result);
-    
-    if (PrjFS_Result_Pending != result)
+    if (ringDoorbell)
     {
-        MessageType responseType =
-            PrjFS_Result_Success == result
-            ? MessageType_Response_Success
-            : MessageType_Response_Fail;
-
-        std::set<uint64_t> messageIDs;
-
-        {
-            mutex_lock lock(s_PendingRequestMessageMutex);
-            unordered_map<string, set<uint64_t>>::iterator fileMessageIDsFound = s_PendingRequestMessageIDs.find(request.path);
-            assert(fileMessageIDsFound != s_PendingRequestMessageIDs.end());
-            messageIDs = std::move(fileMessageIDsFound->second);
-            s_PendingRequestMessageIDs.erase(fileMessageIDsFound);
-        }
-
-        for (uint64_t messageID : messageIDs)
-        {
-            SendKernelMessageResponse(messageID, responseType);
-        }
+        IOConnectCallScalarMethod(
+            instance->kernelServiceConnection,
+            ProviderSelector_ResponseRingDoorbell,
+            nullptr, 0,        // no inputs
+            nullptr, nullptr); // no outputs
     }
     
-    free(messageMemory);
+    return queuedCount;
 }
 
-static PrjFS_Result HandleEnumerateDirectoryRequest(const MessageHeader* request, const char* path)
+static errno_t SendKernelMessageResponse(PrjFS_Instance* instance, uint64_t messageId, MessageType responseType)
 {
-#ifdef DEBUG
-    std::cout << "PrjFSLib.HandleKernelRequest: MessageType_KtoU_EnumerateDirectory" << std::endl;
-#endif
-    
-    PrjFS_Result callbackResult = s_callbacks.EnumerateDirectory(0, path, request->pid, request->procname);
-    
-    if (PrjFS_Result_Success == callbackResult)
+    if (1 == QueueKernelMessageResponses(instance, &messageId, 1, responseType))
     {
-        char fullPath[PrjFSMaxPath];
-        CombinePaths(s_virtualizationRootFullPath.c_str(), path, fullPath);
-        
-        if (!SetBitInFileFlags(fullPath, FileFlags_IsEmpty, false))
-        {
-            // TODO: how should we handle this scenario where the provider thinks it succeeded, but we were unable to
-            // update placeholder metadata?
-            return PrjFS_Result_EIOError;
-        }
+        return 0;
     }
     
-    return callbackResult;
+    const uint64_t inputs[] = { messageId, responseType };
+    IOReturn callResult = IOConnectCallScalarMethod(
+        instance->kernelServiceConnection,
+        ProviderSelector_KernelMessageResponse,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        nullptr, nullptr);                            // no outputs
+    return callResult == kIOReturnSuccess ? 0 : EBADMSG;
 }
 
-static PrjFS_Result HandleHydrateFileRequest(const MessageHeader* request, const char* path)
+// Responds to all messages in as few calls into the kernel as possible
+static errno_t SendKernelMessageResponses(PrjFS_Instance* instance, const uint64_t* messageIds, size_t messageIdCount, MessageType responseType)
 {
-#ifdef DEBUG
-    std::cout << "PrjFSLib.HandleKernelRequest: MessageType_KtoU_HydrateFile" << std::endl;
-#endif
-    
-    char fullPath[PrjFSMaxPath];
-    CombinePaths(s_virtualizationRootFullPath.c_str(), path, fullPath);
-    
-    PrjFSFileXAttrData xattrData = {};
-    if (!GetXAttr(fullPath, PrjFSFileXAttrName, sizeof(PrjFSFileXAttrData), &xattrData))
-    {
-        return PrjFS_Result_EIOError;
-    }
-    
-    PrjFS_FileHandle fileHandle;
-    
-    // Mode "rb+" means:
-    //  - The file must already exist
-    //  - The handle is opened for reading and writing
-    //  - We are allowed to seek to somewhere other than end of stream for writing
-    fileHandle.file = fopen(fullPath, "rb+");
-    if (nullptr == fileHandle.file)
-    {
-        return PrjFS_Result_EIOError;
-    }
-    
-    // Seek back to the beginning so the provider can overwrite the empty contents
-    if (fseek(fileHandle.file, 0, 0))
+    size_t queuedCount = QueueKernelMessageResponses(instance, messageIds, messageIdCount, responseType);
+    messageIds += queuedCount;
+    messageIdCount -= queuedCount;
+    if (messageIdCount == 0)
     {
-        fclose(fileHandle.file);
-        return PrjFS_Result_EIOError;
+        return 0;
     }
-    
-    PrjFS_Result callbackResult = s_callbacks.GetFileStream(0, path, xattrData.providerId, xattrData.contentId, request->pid, request->procname, &fileHandle);
-    
-    // TODO: once we support async callbacks, we'll need to save off the fileHandle if the result is Pending
-    
-    if (fclose(fileHandle.file))
+    else if (messageIdCount == 1 || !(instance->kernelCapabilities & ProviderCapability_KernelMessageResponseBatch))
     {
-        // TODO: under what conditions can fclose fail? How do we recover?
-        return PrjFS_Result_EIOError;
+        errno_t result = 0;
+        for (size_t i = 0; i < messageIdCount; ++i)
+        {
+            errno_t error = SendKernelMessageResponse(instance, messageIds[i], responseType);
+            if (0 != error)
+            {
+                result = error;
+            }
+        }
+        
+        return result;
     }
     
-    if (PrjFS_Result_Success == callbackResult)
+    errno_t result = 0;
+    KernelMessageResponse responses[MaxKernelMessageResponsesPerBatch];
+    size_t responseCount = 0;
+    for (size_t i = 0; i < messageIdCount; ++i)
     {
-        // TODO: validate that the total bytes written match the size that was reported on the placeholder in the first place
-        // Potential bugs if we don't:
-        //  * The provider writes fewer bytes than expected. The hydrated is left with extra padding up to the original reported size.
-        //  * The provider writes more bytes than expected. The write succeeds, but whatever tool originally opened the file may have already
-        //    allocated the originally reported size, and now the contents appear truncated.
+        responses[responseCount++] = KernelMessageResponse { messageIds[i], responseType, 0 };
         
-        if (!SetBitInFileFlags(fullPath, FileFlags_IsEmpty, false))
+        if (responseCount == MaxKernelMessageResponsesPerBatch || i + 1 == messageIdCount)
         {
-            // TODO: how should we handle this scenario where the provider thinks it succeeded, but we were unable to
-            // update placeholder metadata?
-            return PrjFS_Result_EIOError;
+            IOReturn callResult = IOConnectCallStructMethod(
+                instance->kernelServiceConnection,
+                ProviderSelector_KernelMessageResponseBatch,
+                responses, responseCount * sizeof(responses[0]),
+                nullptr, nullptr);
+            if (callResult != kIOReturnSuccess)
+            {
+                result = EBADMSG;
+            }
+            
+            responseCount = 0;
         }
     }
     
-    return callbackResult;
+    return result;
 }
 
-static bool InitializeEmptyPlaceholder(const char* fullPath)
+// Asks for every capability this library knows. A kernel that predates negotiation
+// rejects the selector and gets by with the basic protocol.
+static uint64_t NegotiateKernelCapabilities(io_connect_t connection)
 {
-    return
-        SetBitInFileFlags(fullPath, FileFlags_IsInVirtualizationRoot, true) &&
-        SetBitInFileFlags(fullPath, FileFlags_IsEmpty, true);
+    const uint64_t inputs[] = { ProviderCapability_All };
+    uint64_t capabilities = ProviderCapability_None;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_NegotiateCapabilities,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &capabilities, &output_count);                // scalar output
+    return callResult == kIOReturnSuccess ? capabilities : ProviderCapability_None;
 }
 
-template<typename TPlaceholder>
-static bool InitializeEmptyPlaceholder(const char* fullPath, TPlaceholder* data, const char* xattrName)
+// Reattaching by token spares the kernel the path lookup. It only works if the kernel
+// has seen the root since it was loaded, otherwise the root is registered by path.
+static errno_t AttachToVirtualizationRoot(io_connect_t connection, uint64_t kernelCapabilities, const char* path, uint64_t rootToken, uint32_t rootFlags)
 {
-    if (InitializeEmptyPlaceholder(fullPath))
+    struct stat rootAttributes;
+    struct statfs rootFileSystem;
+    if (0 != rootToken &&
+        (kernelCapabilities & ProviderCapability_ReattachVirtualizationRoot) &&
+        0 == stat(path, &rootAttributes) &&
+        0 == statfs(path, &rootFileSystem))
     {
-        data->header.magicNumber = PlaceholderMagicNumber;
-        data->header.formatVersion = PlaceholderFormatVersion;
-        
-        static_assert(std::is_pod<TPlaceholder>(), "TPlaceholder must be a POD struct");
-        if (AddXAttr(fullPath, xattrName, data, sizeof(TPlaceholder)))
+        VirtualizationRootIdentity identity = { rootFileSystem.f_fsid, rootAttributes.st_ino, rootToken };
+        errno_t error = ReattachVirtualizationRoot(connection, identity, rootFlags);
+        if (ENOENT != error && ESTALE != error)
         {
-            return true;
+            return error;
         }
     }
     
-    return false;
+    return RegisterVirtualizationRootPath(connection, path, rootFlags);
 }
 
-static bool IsVirtualizationRoot(const char* path)
+static errno_t RegisterVirtualizationRootPath(io_connect_t connection, const char* path, uint32_t rootFlags)
 {
-    PrjFSVirtualizationRootXAttrData data = {};
-    if (GetXAttr(path, PrjFSVirtualizationRootXAttrName, sizeof(PrjFSVirtualizationRootXAttrData), &data))
-    {
-        return true;
-    }
+    const uint64_t flagsInput = rootFlags;
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    size_t pathSize = strlen(path) + 1;
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_RegisterVirtualizationRootPath,
+        &flagsInput, 1, // scalar input: ProviderRootFlags
+        path, pathSize, // struct input
+        &error, &output_count, // scalar output
+        nullptr, nullptr); // no struct output
+    assert(callResult == kIOReturnSuccess);
+    return static_cast<errno_t>(error);
+}
 
-    return false;
+static errno_t ReattachVirtualizationRoot(io_connect_t connection, const VirtualizationRootIdentity& identity, uint32_t rootFlags)
+{
+    const uint64_t flagsInput = rootFlags;
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_ReattachVirtualizationRoot,
+        &flagsInput, 1, // scalar input: ProviderRootFlags
+        &identity, sizeof(identity), // struct input
+        &error, &output_count, // scalar output
+        nullptr, nullptr); // no struct output
+    assert(callResult == kIOReturnSuccess);
+    return static_cast<errno_t>(error);
 }
 
-static void CombinePaths(const char* root, const char* relative, char (&combined)[PrjFSMaxPath])
+static errno_t SetKernelRequestTimeout(io_connect_t connection, MessageType messageType, uint32_t timeoutMilliseconds)
 {
-    snprintf(combined, PrjFSMaxPath, "%s/%s", root, relative);
+    const uint64_t inputs[] = { messageType, timeoutMilliseconds };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetRequestTimeout,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
 }
 
-static bool SetBitInFileFlags(const char* path, uint32_t bit, bool value)
+static errno_t SetKernelMessageQueueCapacity(io_connect_t connection, uint32_t capacityBytes)
 {
-    struct stat fileAttributes;
-    if (stat(path, &fileAttributes))
-    {
-        return false;
-    }
-    
-    uint32_t newValue;
-    if (value)
-    {
-        newValue = fileAttributes.st_flags | bit;
-    }
-    else
-    {
-        newValue = fileAttributes.st_flags & ~bit;
-    }
-    
-    if (chflags(path, newValue))
-    {
-        return false;
-    }
-    
-    return true;
+    const uint64_t inputs[] = { capacityBytes };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetMessageQueueCapacity,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
 }
 
-static bool IsBitSetInFileFlags(const char* path, uint32_t bit)
+static errno_t SetKernelMessageQueueCount(io_connect_t connection, uint32_t queueCount)
 {
-    struct stat fileAttributes;
-    if (stat(path, &fileAttributes))
-    {
-        return false;
-    }
+    const uint64_t inputs[] = { queueCount };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetMessageQueueCount,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
+}
 
-    return fileAttributes.st_flags & bit;
+static errno_t SetKernelProcessPolicies(io_connect_t connection, const ProcessPolicyEntry* entries, uint32_t entryCount)
+{
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_SetProcessPolicies,
+        nullptr, 0,                                 // no scalar inputs
+        entries, entryCount * sizeof(entries[0]),   // structure input
+        &error, &output_count,                      // scalar output
+        nullptr, nullptr);                          // no structure output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
 }
 
-static bool AddXAttr(const char* path, const char* name, const void* value, size_t size)
+static errno_t SetKernelHelperProcesses(io_connect_t connection, const int32_t* pids, uint32_t pidCount, int32_t processGroupId)
 {
-    if (setxattr(path, name, value, size, 0, 0))
-    {
-        return false;
-    }
-    
-    return true;
+    uint64_t input = static_cast<uint32_t>(processGroupId);
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_SetHelperProcesses,
+        &input, 1,                                  // scalar input: process group id
+        pids, pidCount * sizeof(int32_t),           // structure input
+        &error, &output_count,                      // scalar output
+        nullptr, nullptr);                          // no structure output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
 }
 
-static bool GetXAttr(const char* path, const char* name, size_t size, _Out_ void* value)
+static errno_t SetKernelNotificationMappings(io_connect_t connection, const void* mappings, uint32_t mappingsSize)
 {
-    if (getxattr(path, name, value, size, 0, 0) == size)
-    {
-        // TODO: also validate the magic number and format version.
-        // It's easy to check their expected values, but we will need to decide what to do if they are incorrect.
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_SetNotificationMappings,
+        nullptr, 0,                                 // no scalar inputs
+        mappings, mappingsSize,                     // structure input
+        &error, &output_count,                      // scalar output
+        nullptr, nullptr);                          // no structure output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
+}
 
-        return true;
+static errno_t SetKernelPrefetchHintInterval(io_connect_t connection, uint32_t intervalMilliseconds)
+{
+    const uint64_t inputs[] = { intervalMilliseconds };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetPrefetchHintInterval,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
+}
+
+static errno_t SetKernelRequestRateLimit(io_connect_t connection, uint32_t requestsPerSecond, uint32_t burst, uint32_t maxDelayMilliseconds)
+{
+    const uint64_t inputs[] = { requestsPerSecond, burst, maxDelayMilliseconds };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetRequestRateLimit,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
+}
+
+static errno_t SetKernelMemoryBudget(io_connect_t connection, uint32_t subsystem, uint64_t budgetBytes)
+{
+    const uint64_t inputs[] = { subsystem, budgetBytes };
+    uint64_t error = EBADMSG;
+    uint32_t output_count = 1;
+    IOReturn callResult = IOConnectCallScalarMethod(
+        connection,
+        ProviderSelector_SetMemoryBudget,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    return callResult == kIOReturnSuccess ? static_cast<errno_t>(error) : EBADMSG;
+}
+
+// On input, *entryCount is the capacity of entries; on output, the number drained
+static errno_t DrainKernelModifiedFiles(io_connect_t connection, ModifiedFileEntry* entries, uint32_t* entryCount, uint64_t* remainingCount, bool* overflowed)
+{
+    uint64_t outputs[] = { EBADMSG, 0, 0 }; // error, entries remaining, overflowed
+    uint32_t output_count = std::extent<decltype(outputs)>::value;
+    size_t entriesSize = *entryCount * sizeof(entries[0]);
+    IOReturn callResult = IOConnectCallMethod(
+        connection,
+        ProviderSelector_DrainModifiedFiles,
+        nullptr, 0,                                 // no scalar inputs
+        nullptr, 0,                                 // no structure input
+        outputs, &output_count,                     // scalar outputs
+        entries, &entriesSize);                     // structure output
+    if (kIOReturnSuccess != callResult)
+    {
+        return EBADMSG;
     }
     
-    return false;
+    *entryCount = static_cast<uint32_t>(entriesSize / sizeof(entries[0]));
+    *remainingCount = outputs[1];
+    *overflowed = 0 != outputs[2];
+    return static_cast<errno_t>(outputs[0]);
 }
 
-static errno_t SendKernelMessageResponse(uint64_t messageId, MessageType responseType)
+static void SignalKernelMessageQueueDrained(io_connect_t connection, uint32_t queueIndex)
 {
-    const uint64_t inputs[] = { messageId, responseType };
+    const uint64_t inputs[] = { queueIndex };
     IOReturn callResult = IOConnectCallScalarMethod(
-        s_kernelServiceConnection,
-        ProviderSelector_KernelMessageResponse,
+        connection,
+        ProviderSelector_MessageQueueDrained,
         inputs, std::extent<decltype(inputs)>::value, // scalar inputs
         nullptr, nullptr);                            // no outputs
-    return callResult == kIOReturnSuccess ? 0 : EBADMSG;
+    if (kIOReturnSuccess != callResult)
+    {
+        cerr << "Failed to signal drained message queue: 0x" << std::hex << callResult << std::endl;
+    }
 }
 
-static errno_t RegisterVirtualizationRootPath(const char* path)
+// The kernel caches the flags of files in roots, and stale ones could let a process
+// read a placeholder that has been emptied without hydrating it again
+static void SignalKernelFileFlagsChanged(PrjFS_Instance* instance, int fd)
 {
+    if (!(instance->kernelCapabilities & ProviderCapability_FileFlagsChanged))
+    {
+        return;
+    }
+    
+    const uint64_t inputs[] = { static_cast<uint64_t>(fd) };
     uint64_t error = EBADMSG;
     uint32_t output_count = 1;
-    size_t pathSize = strlen(path) + 1;
-    IOReturn callResult = IOConnectCallMethod(
-        s_kernelServiceConnection,
-        ProviderSelector_RegisterVirtualizationRootPath,
-        nullptr, 0, // no scalar inputs
-        path, pathSize, // struct input
-        &error, &output_count, // scalar output
-        nullptr, nullptr); // no struct output
-    assert(callResult == kIOReturnSuccess);
-    return static_cast<errno_t>(error);
+    IOReturn callResult = IOConnectCallScalarMethod(
+        instance->kernelServiceConnection,
+        ProviderSelector_FileFlagsChanged,
+        inputs, std::extent<decltype(inputs)>::value, // scalar inputs
+        &error, &output_count);                       // scalar output
+    if (kIOReturnSuccess != callResult || 0 != error)
+    {
+        cerr << "Failed to signal changed file flags: 0x" << std::hex << callResult << std::dec << ", " << error << std::endl;
+    }
 }
 
 static void ClearMachNotification(mach_port_t port)
@@ -3,6 +3,8 @@
 
 #include "../PrjFSKext/public/PrjFSXattrs.h"
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define _In_
 #define _Out_
@@ -11,6 +13,8 @@ typedef struct _PrjFS_FileHandle PrjFS_FileHandle;
 
 typedef struct _PrjFS_Callbacks PrjFS_Callbacks;
 
+typedef struct _PrjFS_Instance PrjFS_Instance;
+
 typedef enum
 {
     PrjFS_Result_Invalid                            = 0x00000000,
@@ -33,6 +37,7 @@ typedef enum
     PrjFS_Result_EIOError                           = 0x20000040,
     PrjFS_Result_ENotAVirtualizationRoot            = 0x20000080,
     PrjFS_Result_EVirtualizationRootAlreadyExists   = 0x20000100,
+    PrjFS_Result_EFileSizeMismatch                  = 0x20000200,
     
     PrjFS_Result_ENotYetImplemented                 = 0xFFFFFFFF,
     
@@ -48,9 +53,13 @@ typedef enum
     PrjFS_NotificationType_FileRenamed              = 0x00000080,
     PrjFS_NotificationType_PreConvertToFull         = 0x00001000,
     
-    PrjFS_NotificationType_PreModify                = 0x10000001,
-    PrjFS_NotificationType_FileModified             = 0x10000002,
-    PrjFS_NotificationType_FileDeleted              = 0x10000004,
+    PrjFS_NotificationType_FileModified             = 0x00000400,
+    PrjFS_NotificationType_FileDeleted              = 0x00000800,
+    PrjFS_NotificationType_PreModify                = 0x10000000,
+    
+    // Only valid in notification mappings: files that are written are added to
+    // the set reported by PrjFS_DrainModifiedFiles instead of calling NotifyOperation
+    PrjFS_NotificationType_RecordModifiedFiles      = 0x20000000,
 
 } PrjFS_NotificationType;
 
@@ -61,33 +70,433 @@ typedef struct
 
 } PrjFS_NotificationMapping;
 
+typedef enum
+{
+    PrjFS_InstanceFlags_None                        = 0x00000000,
+    
+    // Processes other than the provider may only read the root: the kernel denies
+    // writes, creations, renames and deletions itself, so files are never turned
+    // into full files and no notifications are sent. Placeholders are projected and
+    // hydrated as usual. For trees that are only read, e.g. by CI jobs; the root's
+    // xattr is not updated either, so it may be on a read-only snapshot mount as
+    // long as the provider can still write placeholders.
+    PrjFS_InstanceFlags_ReadOnly                    = 0x00000001,
+    
+    // Reading an empty placeholder directory's attributes (e.g. stat, ls -ld)
+    // doesn't enumerate it; listing it or looking up anything in it still does.
+    // Its link count may then not reflect its subdirectories until it is
+    // enumerated, which matters only to tools that count subdirectories that way.
+    PrjFS_InstanceFlags_AttributeOnlyDirectoryReads = 0x00000002,
+    
+    // Once the provider has not answered any request for 10 seconds while one was
+    // waiting, the kernel treats the root as offline (see PrjFS_InstanceFlags_ReadOnly
+    // for what that allows) until the provider responds again. Without this flag,
+    // accesses that would need the provider fail with ETIMEDOUT meanwhile, apart
+    // from about one per second that is still sent to check whether it has recovered.
+    PrjFS_InstanceFlags_OfflineWhenUnresponsive     = 0x00000004,
+    
+    // Opening a 0 byte placeholder file for writing only doesn't wait for it to be
+    // hydrated. Once the open has happened it becomes a full, empty file without
+    // GetFileStream being called, and NotifyOperation (if set) is called with
+    // PrjFS_NotificationType_PreConvertToFull regardless of the notification
+    // mappings. Placeholders with contents are hydrated before the open as usual,
+    // since the kernel can't tell whether the open truncates them. Ignored by
+    // kernels that don't support it, which hydrate as usual.
+    PrjFS_InstanceFlags_SkipOverwriteHydration      = 0x00000008,
+    
+} PrjFS_InstanceFlags;
+
+// Starts serving a virtualization root; a process may serve any number of roots,
+// each through the instance returned here. All instances share one worker pool,
+// which is started with the poolThreadCount of the first. Callbacks are not passed
+// the instance, so a provider serving several roots registers separate callbacks
+// for each, as the managed wrapper does with each instance's delegates.
 extern "C" PrjFS_Result PrjFS_StartVirtualizationInstance(
     _In_    const char*                             virtualizationRootFullPath,
     _In_    PrjFS_Callbacks                         callbacks,
-    _In_    unsigned int                            poolThreadCount);
+    _In_    unsigned int                            poolThreadCount,
+    _In_    PrjFS_InstanceFlags                     flags,
+    _Out_   PrjFS_Instance**                        instance);
+
+// Stops handling kernel requests for the instance's root and unregisters it.
+// Requests that have not reached a callback yet are failed. Callbacks that are
+// running, and commands awaiting PrjFS_CompleteCommand, get until the drain
+// timeout to finish; whatever is left then is failed. Callbacks still running at
+// that point may return, but their results are discarded. The instance and any
+// file handles of failed commands are invalid once this returns.
+extern "C" PrjFS_Result PrjFS_StopVirtualizationInstance(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            drainTimeoutMilliseconds);
+
+// Limits how long the kernel waits for the EnumerateDirectory and GetFileStream
+// callbacks to complete before failing the triggering I/O. 0 means no limit,
+// which is the default. Only valid after PrjFS_StartVirtualizationInstance.
+extern "C" PrjFS_Result PrjFS_SetRequestTimeouts(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            enumerateDirectoryTimeoutMilliseconds,
+    _In_    unsigned int                            getFileStreamTimeoutMilliseconds);
+
+// A directory gets at most one PrefetchHint per interval, and the kernel sends
+// at most 100 per second overall. The default is 30 seconds; 0 turns hints off.
+// Only valid after PrjFS_StartVirtualizationInstance with a PrefetchHint callback.
+// Fails with PrjFS_Result_ENotSupported if the kernel extension is too old.
+extern "C" PrjFS_Result PrjFS_SetPrefetchHintInterval(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            intervalMilliseconds);
+
+// Limits the EnumerateDirectory and GetFileStream requests each process can
+// cause to requestsPerSecond, with bursts of up to burst requests. A process over
+// its limit is held back for up to maxDelayMilliseconds until it may make another
+// request, after which its access fails with EAGAIN instead (immediately, if 0).
+// maxDelayMilliseconds may be at most 10000. A process that is killed while held
+// back fails with EINTR straight away. requestsPerSecond 0, the default, turns
+// the limit off.
+// Only valid after PrjFS_StartVirtualizationInstance. Fails with
+// PrjFS_Result_ENotSupported if the kernel extension is too old.
+extern "C" PrjFS_Result PrjFS_SetRequestRateLimit(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    unsigned int                            requestsPerSecond,
+    _In_    unsigned int                            burst,
+    _In_    unsigned int                            maxDelayMilliseconds);
+
+// What the kernel extension's wired memory is used for
+typedef enum
+{
+    // Virtualization roots, their notification mappings and modified file sets
+    PrjFS_KernelMemory_VirtualizationRoots,
+    PrjFS_KernelMemory_ProcessPolicies,
+    // Log messages and the queue of the kernel's log client
+    PrjFS_KernelMemory_Logging,
+    // Buffers for requests in flight
+    PrjFS_KernelMemory_Zones,
+    // Every provider's message queues and response ring
+    PrjFS_KernelMemory_MessageQueues,
+    
+} PrjFS_KernelMemory;
+
+// Limits the kernel extension's wired memory of one kind to budgetBytes, for all
+// virtualization roots; allocations that would exceed it fail instead, e.g.
+// PrjFS_StartVirtualizationInstance fails with PrjFS_Result_EOutOfMemory if its
+// message queues don't fit. 0 removes the limit. By default message queues are limited to 256 MB and logging
+// to 96 MB. As a budget applies to all roots, only one instance can set each kind's
+// at a time: until it stops, when the default is restored, other instances fail
+// with PrjFS_Result_EInvalidOperation. Each kind's usage, peak and budget are in
+// the kernel service's io.gvfs.PrjFSKext.MemoryStatistics registry property.
+// Only valid after PrjFS_StartVirtualizationInstance. Fails with
+// PrjFS_Result_ENotSupported if the kernel extension is too old.
+extern "C" PrjFS_Result PrjFS_SetKernelMemoryBudget(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    PrjFS_KernelMemory                      kind,
+    _In_    unsigned long long                      budgetBytes);
+
+#define PrjFS_MaxHelperProcessCount 64
+
+// Exempts other processes doing the provider's work, e.g. writing hydrated
+// contents, from the kernel's interception just like the provider itself; their
+// access to empty placeholders would otherwise wait on the provider. Members of
+// processGroupId are exempt as well, unless it is 0. Replaces the previous set.
+// Only valid after PrjFS_StartVirtualizationInstance. Fails with
+// PrjFS_Result_ENotSupported if the kernel extension is too old.
+extern "C" PrjFS_Result PrjFS_SetHelperProcesses(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const pid_t*                            pids,
+    _In_    unsigned int                            pidCount,
+    _In_    pid_t                                   processGroupId);
+
+// Sets the size of the kernel -> provider message queue of instances started
+// from now on. 0 selects the kernel's default size.
+extern "C" PrjFS_Result PrjFS_SetMessageQueueCapacity(
+    _In_    unsigned int                            capacityBytes);
+
+// Sets the number of kernel -> provider message queues of instances started from
+// now on, at most 8. Messages are spread over the queues by the file they are
+// about, and each queue is drained on its own thread, so more queues let busy
+// instances take in requests from several cores at once. The capacity set with
+// PrjFS_SetMessageQueueCapacity applies to each queue. 0 selects the default of
+// a single queue, as does a kernel extension too old to support more.
+extern "C" PrjFS_Result PrjFS_SetMessageQueueCount(
+    _In_    unsigned int                            queueCount);
+
+typedef enum
+{
+    PrjFS_RequestPriority_Invalid                   = 0x00000000,
+    
+    PrjFS_RequestPriority_High                      = 0x00000001,
+    PrjFS_RequestPriority_Normal                    = 0x00000002,
+    PrjFS_RequestPriority_Low                       = 0x00000003,
+    
+} PrjFS_RequestPriority;
+
+// Schedules callbacks for requests triggered by processes with the given name
+// ahead of or behind other requests. Names are matched against the kernel's
+// process name, which is truncated to MAXCOMLEN characters. Requests from
+// processes without an entry are scheduled by the QoS of the thread that
+// triggered them: user-interactive and user-initiated threads get
+// PrjFS_RequestPriority_High, utility and background threads
+// PrjFS_RequestPriority_Low and all others (or threads of other users'
+// processes, whose QoS can't be read) PrjFS_RequestPriority_Normal. Callbacks
+// run at the QoS class of their priority: user-initiated, default or utility.
+extern "C" PrjFS_Result PrjFS_SetProcessRequestPriority(
+    _In_    const char*                             processName,
+    _In_    PrjFS_RequestPriority                   priority);
+
+// Waiting requests are promoted one priority class for each agingMilliseconds
+// they have been queued, so that low priority requests cannot be starved.
+// 0 makes priorities strict. The default is 50 ms.
+extern "C" PrjFS_Result PrjFS_SetRequestPriorityAging(
+    _In_    unsigned int                            agingMilliseconds);
+
+typedef enum
+{
+    PrjFS_ProcessPolicy_None                        = 0x00000000,
+    
+    // Access to empty placeholders fails instead of hydrating or enumerating
+    // them, for processes such as indexers, backup agents and virus scanners
+    PrjFS_ProcessPolicy_DenyHydration               = 0x00000001,
+    
+    // Enumerating an empty directory also enumerates every empty directory below
+    // it before the process continues, for processes that walk whole trees (find,
+    // grep -r, build systems), so that they wait on one request rather than one per
+    // directory. Only takes effect with a synchronous EnumerateDirectory(Bulk)
+    // callback; kernels that predate it enumerate directory by directory.
+    PrjFS_ProcessPolicy_EnumerateRecursively        = 0x00000002,
+    
+} PrjFS_ProcessPolicyFlags;
+
+typedef struct
+{
+    const char*                     ProcessName;
+    PrjFS_ProcessPolicyFlags        Flags;
+} PrjFS_ProcessPolicy;
+
+// Replaces the kernel's list of per-process policies, which applies to all
+// virtualization roots. The kernel's built-in list of file system crawlers
+// (Spotlight etc.) still applies to processes not listed here; list them with
+// PrjFS_ProcessPolicy_None to exempt them. Names are matched against the
+// kernel's process name, truncated to MAXCOMLEN characters. Only valid after
+// PrjFS_StartVirtualizationInstance. As the list is shared by all roots, only one
+// instance can have a non-empty list at a time: until it passes an empty list or
+// stops, other instances fail with PrjFS_Result_EInvalidOperation.
+extern "C" PrjFS_Result PrjFS_SetProcessPolicies(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const PrjFS_ProcessPolicy*              policies,
+    _In_    unsigned int                            policyCount);
+
+// Replaces the set of operations the NotifyOperation callback is told about;
+// without any mappings it is never called. A path gets the notification types of
+// the longest NotificationRelativeRoot that contains it ("" for the whole root),
+// so a mapping to PrjFS_NotificationType_None excludes a subtree. The kernel
+// applies the mappings, so operations nobody asked about never reach user space.
+// NewFileCreated, PreDelete, FileRenamed, FileModified and FileDeleted are
+// delivered; other types are ignored for now. Only valid after
+// PrjFS_StartVirtualizationInstance with a NotifyOperation callback. Read-only
+// instances accept mappings but are never notified.
+extern "C" PrjFS_Result PrjFS_SetNotificationMappings(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const PrjFS_NotificationMapping*        mappings,
+    _In_    unsigned int                            mappingCount);
+
+typedef void (PrjFS_ModifiedFileCallback)(
+    _In_    const char*                             relativePath,
+    _In_    void*                                   context);
 
-PrjFS_Result PrjFS_StopVirtualizationInstance();
+// Calls the callback for each file written (and closed) below a mapping with
+// PrjFS_NotificationType_RecordModifiedFiles since the previous drain, then
+// forgets them. The kernel keeps one entry per file however often it is written,
+// in a set of bounded size; *overflowed is set if files were lost because it was
+// full, in which case any file may have been modified. Files that were deleted
+// or moved out of the root since are skipped. Only valid after
+// PrjFS_SetNotificationMappings with such a mapping. Read-only instances never
+// have any modified files.
+extern "C" PrjFS_Result PrjFS_DrainModifiedFiles(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    PrjFS_ModifiedFileCallback*             callback,
+    _In_    void*                                   context,
+    _Out_   bool*                                   overflowed);
+
+// Writes every EnumerateDirectory and GetFileStream request, in the order they
+// are handled and with the time between them, to a new access profile file
+// until PrjFS_StopAccessRecording. Requests coalesced onto one already being
+// handled for the same path are not recorded again. Only valid after
+// PrjFS_StartVirtualizationInstance.
+extern "C" PrjFS_Result PrjFS_StartAccessRecording(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             profileFullPath);
+
+extern "C" PrjFS_Result PrjFS_StopAccessRecording(
+    _In_    PrjFS_Instance*                         instance);
+
+// Invokes the callbacks for the requests in an access profile, e.g. one recorded
+// during the previous build, as if the kernel had sent them, so that their
+// contents are fetched before anything asks for them. Directories and files
+// that are no longer empty placeholders are skipped. Directories are enumerated
+// in recorded order on the calling thread, so that the placeholders later
+// entries refer to exist; files are hydrated in recorded order by the worker
+// pool at low priority. Kernel requests for a path that is being replayed wait
+// for the replayed request rather than invoking the callback again. Returns once
+// the callbacks of all replayed requests have returned.
+extern "C" PrjFS_Result PrjFS_ReplayAccessProfile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             profileFullPath);
+
+// Returns whether PrjFS_HydrateTree or PrjFS_DehydrateTree should include the file
+typedef bool (PrjFS_FileFilterCallback)(
+    _In_    const char*                             relativePath,
+    _In_    void*                                   context);
 
+// Hydrates all empty placeholder files below a directory ("" for the whole
+// root) that pass the filter, or all of them if it is null, enumerating empty
+// placeholder directories on the way. Much cheaper than having a tool read the
+// files one by one: the tree is walked and the files are written by this
+// process, which the kernel lets through without sending it requests.
+// Directories are enumerated on the calling thread; the files of each directory
+// are hydrated by the worker pool at low priority, after the PrefetchHint
+// callback (if any) has been called for the directory so that the provider can
+// fetch their contents together. Kernel requests for a file that is being
+// hydrated wait for that hydration. Returns once the callbacks of all queued
+// hydrations have returned; files whose hydration failed stay empty placeholders.
+extern "C" PrjFS_Result PrjFS_HydrateTree(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileFilterCallback*               filter,
+    _In_    void*                                   filterContext);
+
+// Fails with PrjFS_Result_EVirtualizationRootAlreadyExists if the directory, one
+// of its ancestors or anything below it is part of a virtualization root
 extern "C" PrjFS_Result PrjFS_ConvertDirectoryToVirtualizationRoot(
     _In_    const char*                             virtualizationRootFullPath);
 
-PrjFS_Result PrjFS_ConvertDirectoryToPlaceholder(
-    _In_    const char*                             relativePath);
+typedef enum
+{
+    PrjFS_ConvertOptions_None                       = 0x00000000,
+    
+    // Everything already in the directory becomes part of the root as full files
+    // and directories, and the root needs no enumeration. Without it the new root
+    // is enumerated through the provider, so the directory should be empty.
+    PrjFS_ConvertOptions_KeepExistingContents       = 0x00000001,
+    
+} PrjFS_ConvertOptions;
+
+// The directory tree is read (and converted) with several threads. If converting
+// existing contents fails, the directory is left a partially converted root.
+extern "C" PrjFS_Result PrjFS_ConvertDirectoryToVirtualizationRootWithOptions(
+    _In_    const char*                             virtualizationRootFullPath,
+    _In_    unsigned int                            options);
+
+// Called by PrjFS_ConvertDirectoryToPlaceholder for each directory and regular
+// file it converts, from several threads at once. The ids start out all zero;
+// a file whose ids are filled in becomes a hydrated placeholder, otherwise it
+// becomes a full file, and a directory's ids are passed to EnumerateDirectory as
+// for PrjFS_WritePlaceholderDirectoryWithIds. Any result other than
+// PrjFS_Result_Success stops the conversion.
+typedef PrjFS_Result (PrjFS_ConvertEntryCallback)(
+    _In_    const char*                             relativePath,
+    _In_    bool                                    isDirectory,
+    _Out_   unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _Out_   unsigned char                           contentId[PrjFS_PlaceholderIdLength],
+    _In_    void*                                   context);
+
+// Makes an existing, populated directory in the root ("" for the root itself),
+// e.g. a restored build cache, part of the virtualized content in place rather
+// than having it deleted and written again through placeholders. Everything
+// below it gets FileFlags_IsInVirtualizationRoot, with ids from the callback if
+// it is not null, and the directory itself is marked as enumerated. Entries that
+// are placeholders already are left as they are. The tree is walked and converted
+// with several threads, relative to each directory's fd; the directory itself is
+// marked last, so if the conversion fails it is left partially converted but
+// not marked.
+extern "C" PrjFS_Result PrjFS_ConvertDirectoryToPlaceholder(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    PrjFS_ConvertEntryCallback*             callback,
+    _In_    void*                                   callbackContext);
+
+// Placeholders are created and initialized in this directory at the top of the root
+// and then moved into place, so that they appear fully initialized or not at all.
+// Providers should hide it from their users; it is skipped by the tree scans below.
+#define PrjFS_TempDirectoryName                     ".prjfs-tmp"
 
 extern "C" PrjFS_Result PrjFS_WritePlaceholderDirectory(
+    _In_    PrjFS_Instance*                         instance,
     _In_    const char*                             relativePath);
 
+// Like PrjFS_WritePlaceholderDirectory, but also stores ids in the directory's
+// placeholder xattr (e.g. the id of its git tree), which are then passed to the
+// EnumerateDirectory(Bulk) callback. The ids are not updated when the provider's
+// content changes, so the provider must check them and fall back to the path if
+// they are stale. A null id is stored as all zero.
+extern "C" PrjFS_Result PrjFS_WritePlaceholderDirectoryWithIds(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength]);
+
 extern "C" PrjFS_Result PrjFS_WritePlaceholderFile(
+    _In_    PrjFS_Instance*                         instance,
     _In_    const char*                             relativePath,
     _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
     _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
     _In_    unsigned long                           fileSize,
     _In_    uint16_t                                fileMode);
 
+typedef struct
+{
+    // Path of the entry relative to the batch's directory
+    _In_    const char*                             Name;
+    _In_    bool                                    IsDirectory;
+    
+    // Optional for directories, see PrjFS_WritePlaceholderDirectoryWithIds;
+    // stored only if either is non-null
+    _In_    unsigned char*                          ProviderId;
+    _In_    unsigned char*                          ContentId;
+    
+    // Ignored for directories
+    _In_    unsigned long                           FileSize;
+    _In_    uint16_t                                FileMode;
+    
+} PrjFS_PlaceholderEntry;
+
+// Creates placeholders for several entries of one directory. The directory is
+// opened once and all entries are created relative to it, which is considerably
+// cheaper than calling PrjFS_WritePlaceholderFile/Directory for each entry.
+// Returns PrjFS_Result_Success only if every entry was created; the outcome
+// of each entry is stored in entryResults if it is not null.
+extern "C" PrjFS_Result PrjFS_WritePlaceholderBatch(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    const PrjFS_PlaceholderEntry*           entries,
+    _In_    unsigned int                            entryCount,
+    _Out_   PrjFS_Result*                           entryResults);
+
+typedef struct
+{
+    // Path of the file relative to the batch's directory
+    _In_    const char*                             Name;
+    _In_    unsigned char*                          ProviderId;
+    _In_    unsigned char*                          ContentId;
+    _In_    const void*                             Contents;
+    _In_    unsigned long                           ContentsSize;
+    _In_    uint16_t                                FileMode;
+    
+} PrjFS_FullFileEntry;
+
+// Like PrjFS_WritePlaceholderBatch, but writes each file with its entire contents, as
+// if it had been created as a placeholder and then hydrated. Meant for small files
+// (a few KB), for which an empty placeholder and its later hydration cost far more
+// than writing the contents up front; providers typically choose between the two
+// batches per entry by file size when enumerating a directory.
+extern "C" PrjFS_Result PrjFS_WriteFullFileBatch(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    const PrjFS_FullFileEntry*              entries,
+    _In_    unsigned int                            entryCount,
+    _Out_   PrjFS_Result*                           entryResults);
+
 typedef enum
 {
     PrjFS_UpdateType_Invalid                        = 0x00000000,
     
+    PrjFS_UpdateType_AllowDirtyData                 = 0x00000002,
     PrjFS_UpdateType_AllowReadOnly                  = 0x00000020,
     
 } PrjFS_UpdateType;
@@ -101,7 +510,12 @@ typedef enum
     
 } PrjFS_UpdateFailureCause;
 
-PrjFS_Result PrjFS_UpdatePlaceholderFileIfNeeded(
+// Updates a placeholder file to new contents. Nothing is written if the
+// placeholder already has the given content id and size. Hydrated placeholders
+// are reverted to empty placeholders. Full files are only converted back to
+// placeholders with PrjFS_UpdateType_AllowDirtyData.
+extern "C" PrjFS_Result PrjFS_UpdatePlaceholderFileIfNeeded(
+    _In_    PrjFS_Instance*                         instance,
     _In_    const char*                             relativePath,
     _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
     _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
@@ -109,16 +523,158 @@ PrjFS_Result PrjFS_UpdatePlaceholderFileIfNeeded(
     _In_    PrjFS_UpdateType                        updateFlags,
     _Out_   PrjFS_UpdateFailureCause*               failureCause);
 
-PrjFS_Result PrjFS_DeleteFile(
+// Deletes a placeholder file or directory. Full files are only deleted with
+// PrjFS_UpdateType_AllowDirtyData.
+extern "C" PrjFS_Result PrjFS_DeleteFile(
+    _In_    PrjFS_Instance*                         instance,
     _In_    const char*                             relativePath,
     _In_    PrjFS_UpdateType                        updateFlags,
     _Out_   PrjFS_UpdateFailureCause*               failureCause);
 
+// Reverts a hydrated placeholder to an empty placeholder of the same size and
+// ids, freeing the disk space its contents took; they are fetched again on the
+// next access. Files that have been written since they were hydrated, and full
+// files, are left alone with PrjFS_UpdateFailureCause_FullFile. Empty
+// placeholders are left as they are. Like the other updates, this must not race
+// with writes to the file by other processes.
+extern "C" PrjFS_Result PrjFS_DehydrateFile(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             relativePath,
+    _Out_   PrjFS_UpdateFailureCause*               failureCause);
+
+// Dehydrates the hydrated placeholders below a directory ("" for the whole root)
+// that pass the filter, or all of them if it is null, and that have not been
+// read for at least minimumIdleSeconds. Files are dehydrated least recently
+// read first, until bytesToReclaim bytes have been freed (0 dehydrates all of
+// them), so a background task can keep the root's disk usage within a budget.
+// Last access times are only as accurate as the volume keeps them. Files that
+// can't be dehydrated are skipped. *reclaimedBytes is set to the disk space freed.
+extern "C" PrjFS_Result PrjFS_DehydrateTree(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileFilterCallback*               filter,
+    _In_    void*                                   filterContext,
+    _In_    unsigned long                           minimumIdleSeconds,
+    _In_    unsigned long                           bytesToReclaim,
+    _Out_   unsigned long*                          reclaimedBytes);
+
 extern "C" PrjFS_Result PrjFS_WriteFileContents(
     _In_    const PrjFS_FileHandle*                 fileHandle,
     _In_    const void*                             bytes,
     _In_    unsigned int                            byteCount);
 
+// Writes the buffers in order, as if PrjFS_WriteFileContents had been called for each,
+// without requiring the provider to copy them into one contiguous buffer.
+extern "C" PrjFS_Result PrjFS_WriteFileContentsV(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    const struct iovec*                     buffers,
+    _In_    unsigned int                            bufferCount);
+
+// Hydrates the file with the entire contents of another file, e.g. from the
+// provider's local object cache, without passing the data through the
+// provider's memory. Must be the only write to the file handle.
+extern "C" PrjFS_Result PrjFS_WriteFileContentsFromFile(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    int                                     sourceFd);
+
+extern "C" PrjFS_Result PrjFS_WriteFileContentsFromPath(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    const char*                             sourceFullPath);
+
+// Maps byteCount bytes of the file at offset into memory, so that the provider
+// can produce the contents there directly, e.g. decompress into it, instead of
+// passing them to PrjFS_WriteFileContents. The region must lie within the file's
+// size; a handle has at most one region mapped at a time. The contents count as
+// written once PrjFS_CommitMappedFileContents unmaps the region. Mapped regions
+// and writes must not overlap and must cover the whole file between them.
+extern "C" PrjFS_Result PrjFS_MapFileContents(
+    _In_    const PrjFS_FileHandle*                 fileHandle,
+    _In_    unsigned long long                      offset,
+    _In_    unsigned int                            byteCount,
+    _Out_   void**                                  buffer);
+
+extern "C" PrjFS_Result PrjFS_CommitMappedFileContents(
+    _In_    const PrjFS_FileHandle*                 fileHandle);
+
+typedef enum
+{
+    PrjFS_HydrationOptions_None                     = 0x00000000,
+    
+    // Reserve disk space for the full file size before GetFileStream is called
+    PrjFS_HydrationOptions_Preallocate              = 0x00000001,
+    
+    // Bypass the buffer cache (F_NOCACHE) when hydrating files of at least
+    // noCacheMinimumFileSize bytes
+    PrjFS_HydrationOptions_NoCacheForLargeFiles     = 0x00000002,
+    
+    // Hydrate a file whose contentId matches a file already hydrated in the same
+    // virtualization root by copying that file instead of calling GetFileStream.
+    // A source file that has been modified since its hydration is not used.
+    PrjFS_HydrationOptions_DeduplicateContent       = 0x00000004,
+    
+} PrjFS_HydrationOptions;
+
+extern "C" PrjFS_Result PrjFS_SetHydrationOptions(
+    _In_    unsigned int                            options,
+    _In_    unsigned long                           noCacheMinimumFileSize);
+
+// Keeps the contents of hydrated files in cacheDirectoryFullPath, named after
+// their contentId, and hydrates placeholders with a cached contentId from there
+// instead of calling GetFileStream. Any number of processes may share a cache
+// directory. Contents are added by cloning the hydrated file, so the directory
+// must be on the same APFS volume as the virtualization roots to be filled.
+// Once the cached contents exceed maxSizeBytes, the least recently used ones
+// are removed. A null path turns the cache off, which is the default.
+extern "C" PrjFS_Result PrjFS_SetContentCache(
+    _In_    const char*                             cacheDirectoryFullPath,
+    _In_    unsigned long long                      maxSizeBytes);
+
+#define PrjFS_LatencyHistogramBucketCount 24
+
+// Bucket 0 counts callbacks that completed in under a microsecond, bucket i > 0
+// those that took from 2^(i-1) up to 2^i microseconds, and the last bucket also
+// all slower ones. A callback that returns PrjFS_Result_Pending takes until
+// PrjFS_CompleteCommand.
+typedef struct
+{
+    unsigned long long                              Buckets[PrjFS_LatencyHistogramBucketCount];
+    unsigned long long                              Count;
+    unsigned long long                              TotalMicroseconds;
+} PrjFS_LatencyHistogram;
+
+typedef struct
+{
+    // Counted since the instance started; sample twice for rates
+    unsigned long long                              DequeuedMessageCount;
+    
+    // Requests for a path that already had one being handled, which are answered
+    // along with it
+    unsigned long long                              CoalescedRequestCount;
+    
+    // Requests the kernel gave up on (every thread waiting for them was
+    // interrupted or timed out) before they were answered
+    unsigned long long                              CancelledRequestCount;
+    
+    // Paths with a request being handled
+    unsigned int                                    PendingRequestPathCount;
+    
+    // EnumerateDirectory(Bulk) and GetFileStream callbacks not yet completed
+    unsigned int                                    InFlightCallbackCount;
+    
+    PrjFS_LatencyHistogram                          EnumerateDirectoryLatency;
+    PrjFS_LatencyHistogram                          GetFileStreamLatency;
+    
+    // Failed flag and xattr syscalls on placeholders by any instance in this process
+    unsigned long long                              FileFlagsErrorCount;
+    unsigned long long                              XAttrErrorCount;
+} PrjFS_Statistics;
+
+// Reads the library's counters for an instance, without a consistent snapshot
+// across them. Only valid after PrjFS_StartVirtualizationInstance.
+extern "C" PrjFS_Result PrjFS_GetStatistics(
+    _In_    PrjFS_Instance*                         instance,
+    _Out_   PrjFS_Statistics*                       statistics);
+
 typedef enum
 {
     PrjFS_FileState_Invalid                         = 0x00000000,
@@ -129,16 +685,118 @@ typedef enum
     
 } PrjFS_FileState;
 
-PrjFS_Result PrjFS_GetOnDiskFileState(
+// Directories are placeholders until they have been enumerated and hydrated
+// placeholders after. Files and directories that aren't part of a virtualization
+// root count as full, as do files created in one. Hydrated files stay hydrated
+// placeholders when they are modified.
+extern "C" PrjFS_Result PrjFS_GetOnDiskFileState(
     _In_    const char*                             fullPath,
     _Out_   unsigned int*                           fileState);
 
+typedef struct
+{
+    // Relative to the virtualization root
+    const char*                                     RelativePath;
+    PrjFS_FileState                                 State;
+    bool                                            IsDirectory;
+    
+    // 0 for anything but regular files
+    unsigned long                                   FileSize;
+    struct timespec                                 ModificationTime;
+} PrjFS_FileStateRecord;
+
+// Called with the records of a batch of entries of one directory, which are only
+// valid during the call. May be called from several threads at once.
+typedef void (PrjFS_FileStateCallback)(
+    _In_    const PrjFS_FileStateRecord*            records,
+    _In_    unsigned int                            recordCount,
+    _In_    void*                                   context);
+
+// Reports the state, as PrjFS_GetOnDiskFileState would, of everything below a
+// directory of the root. Directories are read in parallel with getattrlistbulk,
+// which returns every attribute but the placeholder xattr; that is only read for
+// files whose flags don't decide their state, i.e. hydrated and full files.
+extern "C" PrjFS_Result PrjFS_ScanTreeState(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_FileStateCallback*                callback,
+    _In_    void*                                   callbackContext);
+
+typedef enum
+{
+    PrjFS_PlaceholderDefect_None                    = 0x00000000,
+    
+    // Also reported for anything created in the root while no provider was running
+    PrjFS_PlaceholderDefect_MissingFlags            = 0x00000001,
+    
+    // An empty placeholder file without a valid placeholder xattr can't be hydrated
+    PrjFS_PlaceholderDefect_MissingFileXAttr        = 0x00000002,
+} PrjFS_PlaceholderDefect;
+
+// May be called from several threads at once. relativePath is only valid during the call.
+typedef void (PrjFS_IncompletePlaceholderCallback)(
+    _In_    const char*                             relativePath,
+    _In_    PrjFS_PlaceholderDefect                 defect,
+    _In_    void*                                   context);
+
+// Reports the entries below a directory of the root that a crashed provider left
+// partially initialized, reading the tree the way PrjFS_ScanTreeState does. Only
+// needed for roots written to by versions that initialized placeholders in place,
+// or if the temp directory can't be used.
+extern "C" PrjFS_Result PrjFS_FindIncompletePlaceholders(
+    _In_    PrjFS_Instance*                         instance,
+    _In_    const char*                             directoryRelativePath,
+    _In_    PrjFS_IncompletePlaceholderCallback*    callback,
+    _In_    void*                                   callbackContext);
+
+// providerId and contentId are the ids the directory's placeholder was written
+// with, all zero if it has none (see PrjFS_WritePlaceholderDirectoryWithIds).
 typedef PrjFS_Result (PrjFS_EnumerateDirectoryCallback)(
     _In_    unsigned long                           commandId,
     _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
     _In_    int                                     triggeringProcessId,
     _In_    const char*                             triggeringProcessName);
 
+#define PrjFS_MaxDirectoryEntryNameLength 255
+
+// One entry of a directory, as filled in by PrjFS_EnumerateDirectoryBulkCallback
+typedef struct
+{
+    _In_    char                                    Name[PrjFS_MaxDirectoryEntryNameLength + 1];
+    
+    // Optional for directories: the library hands out entries with all zero ids,
+    // and a directory's ids are stored only if they aren't all zero
+    _In_    unsigned char                           ProviderId[PrjFS_PlaceholderIdLength];
+    _In_    unsigned char                           ContentId[PrjFS_PlaceholderIdLength];
+    
+    // Ignored for directories
+    _In_    unsigned long                           FileSize;
+    _In_    uint16_t                                FileMode;
+    
+    _In_    bool                                    IsDirectory;
+    
+} PrjFS_DirectoryEntry;
+
+// Alternative to EnumerateDirectory: instead of creating the placeholders itself,
+// the provider stores up to entryCapacity of the directory's entries in the
+// library's buffer and sets *entryCount, and PrjFSLib creates them. While it
+// fills the whole buffer the callback is called again, with the same commandId,
+// for the following entries. Must complete synchronously. providerId and contentId
+// are the directory's ids, as for PrjFS_EnumerateDirectoryCallback.
+typedef PrjFS_Result (PrjFS_EnumerateDirectoryBulkCallback)(
+    _In_    unsigned long                           commandId,
+    _In_    const char*                             relativePath,
+    _In_    unsigned char                           providerId[PrjFS_PlaceholderIdLength],
+    _In_    unsigned char                           contentId[PrjFS_PlaceholderIdLength],
+    _In_    int                                     triggeringProcessId,
+    _In_    const char*                             triggeringProcessName,
+    
+    _Out_   PrjFS_DirectoryEntry*                   entries,
+    _In_    unsigned int                            entryCapacity,
+    _Out_   unsigned int*                           entryCount);
+
 typedef PrjFS_Result (PrjFS_GetFileStreamCallback)(
     _In_    unsigned long                           commandId,
     _In_    const char*                             relativePath,
@@ -149,6 +807,10 @@ typedef PrjFS_Result (PrjFS_GetFileStreamCallback)(
                                                    
     _In_    const PrjFS_FileHandle*                 fileHandle);
 
+// Must complete synchronously; any result other than PrjFS_Result_Success to a
+// PreDelete notification prevents the deletion. For renames, relativePath is the
+// previous path ("" if the item was moved in from outside the root) and
+// destinationRelativePath the new one; it is nullptr for all other types.
 typedef PrjFS_Result (PrjFS_NotifyOperationCallback)(
     _In_    unsigned long                           commandId,
     _In_    const char*                             relativePath,
@@ -161,15 +823,46 @@ typedef PrjFS_Result (PrjFS_NotifyOperationCallback)(
     _In_    PrjFS_NotificationType                  notificationType,
     _In_    const char*                             destinationRelativePath);
 
+// Called, at low priority, when a file in the directory is about to be
+// hydrated for the first time in a while; its siblings are likely to be read
+// soon, so the provider may want to fetch them all at once. Purely advisory:
+// the hydration requests are sent regardless.
+typedef void (PrjFS_PrefetchHintCallback)(
+    _In_    const char*                             directoryRelativePath,
+    _In_    int                                     triggeringProcessId,
+    _In_    const char*                             triggeringProcessName);
+
+// Called when the kernel no longer waits for the result of an EnumerateDirectory(Bulk)
+// or GetFileStream command, e.g. because the process that triggered it was killed;
+// the provider may stop working on it and complete it with any result. Called on
+// the thread that dispatches kernel messages, so it must return quickly. It may
+// race with the command completing, so commandId may already be unknown to the
+// provider. Commands that have not reached their callback yet are dropped without
+// one.
+typedef void (PrjFS_CancelCommandCallback)(
+    _In_    unsigned long                           commandId);
+
 typedef struct _PrjFS_Callbacks
 {
     _In_    PrjFS_EnumerateDirectoryCallback*       EnumerateDirectory;
     _In_    PrjFS_GetFileStreamCallback*            GetFileStream;
     _In_    PrjFS_NotifyOperationCallback*          NotifyOperation;
+    _In_    PrjFS_PrefetchHintCallback*             PrefetchHint;
+    
+    // Used instead of EnumerateDirectory if set
+    _In_    PrjFS_EnumerateDirectoryBulkCallback*   EnumerateDirectoryBulk;
+    
+    // Optional
+    _In_    PrjFS_CancelCommandCallback*            CancelCommand;
     
 } PrjFS_Callbacks;
 
-PrjFS_Result PrjFS_CompleteCommand(
+// Completes a command for which a callback returned PrjFS_Result_Pending. For
+// GetFileStream, the file handle passed to the callback remains valid until then.
+// Returns PrjFS_Result_EFileSizeMismatch if a hydration reported as successful
+// did not write exactly the placeholder's size; the file is left as an empty
+// placeholder, so only that file needs to be fetched again.
+extern "C" PrjFS_Result PrjFS_CompleteCommand(
     _In_    unsigned long                           commandId,
     _In_    PrjFS_Result                            result);
 
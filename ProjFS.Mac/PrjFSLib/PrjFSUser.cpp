@@ -2,9 +2,24 @@
 #include <CoreFoundation/CFDictionary.h>
 #include <IOKit/IOKitLib.h>
 #include <iostream>
+#include <string.h>
 #include <mach/mach_port.h>
 
 
+// Kexts of the same major version share the basic protocol; what else they
+// support is negotiated once connected
+static bool IsCompatibleKextVersion(CFStringRef kextVersionString)
+{
+    char kextVersion[32];
+    if (!CFStringGetCString(kextVersionString, kextVersion, sizeof(kextVersion), kCFStringEncodingUTF8))
+    {
+        return false;
+    }
+    
+    size_t majorLength = strcspn(PrjFSKextVersion, ".");
+    return 0 == strncmp(kextVersion, PrjFSKextVersion, majorLength) && ('.' == kextVersion[majorLength] || '\0' == kextVersion[majorLength]);
+}
+
 io_connect_t PrjFSService_ConnectToDriver(enum PrjFSServiceUserClientType clientType)
 {
     CFDictionaryRef matchDict = IOServiceMatching(PrjFSServiceClass);
@@ -28,7 +43,7 @@ io_connect_t PrjFSService_ConnectToDriver(enum PrjFSServiceUserClientType client
     }
     
     kextVersionString = static_cast<CFStringRef>(kextVersionObj);
-    if (kCFCompareEqualTo != CFStringCompare(kextVersionString, CFSTR(PrjFSKextVersion), 0 /* options: case sensitive */))
+    if (!IsCompatibleKextVersion(kextVersionString))
     {
         const char* kextVersion = CFStringGetCStringPtr(kextVersionString, kCFStringEncodingUTF8) ?: "???";
         std::cerr << "PrjFS kernel service interface version mismatch. Kernel: " << kextVersion << ", this library expects: " << PrjFSKextVersion << std::endl;
@@ -38,7 +53,7 @@ io_connect_t PrjFSService_ConnectToDriver(enum PrjFSServiceUserClientType client
     {
         CFRelease(kextVersionString);
         
-        // Version matches, connect to kernel service
+        // Major version matches, connect to kernel service
         kern_return_t result = IOServiceOpen(prjfsService, mach_task_self(), clientType, &connection);
         IOObjectRelease(prjfsService);
         if (kIOReturnSuccess != result || IO_OBJECT_NULL == connection)
@@ -122,3 +137,26 @@ CleanupAndFail:
     return false;
 }
 
+void PrjFSService_DataQueueCleanup(
+    DataQueueResources* queue,
+    io_connect_t connection,
+    uint32_t clientMemoryType)
+{
+    if (nullptr != queue->dispatchSource)
+    {
+        dispatch_release(queue->dispatchSource);
+    }
+    
+    if (0 != queue->queueMemoryAddress)
+    {
+        IOConnectUnmapMemory64(connection, clientMemoryType, mach_task_self(), queue->queueMemoryAddress);
+    }
+    
+    if (MACH_PORT_NULL != queue->notificationPort)
+    {
+        // IODataQueueAllocateNotificationPort returns a receive right
+        mach_port_mod_refs(mach_task_self(), queue->notificationPort, MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+    
+    memset(queue, 0, sizeof(*queue));
+}
@@ -23,3 +23,10 @@ bool PrjFSService_DataQueueInit(
     uint32_t clientPortType,
     uint32_t clientMemoryType,
     dispatch_queue_t eventHandlingQueue);
+
+// The dispatch source must already have been cancelled, and its event handler
+// must no longer be running.
+void PrjFSService_DataQueueCleanup(
+    DataQueueResources* queue,
+    io_connect_t connection,
+    uint32_t clientMemoryType);
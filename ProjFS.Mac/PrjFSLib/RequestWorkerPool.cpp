@@ -0,0 +1,195 @@
+#include "RequestWorkerPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <system_error>
+#include <thread>
+
+using std::deque; using std::mutex;
+
+typedef std::unique_lock<mutex> mutex_unique_lock;
+typedef std::lock_guard<mutex> mutex_lock;
+typedef std::chrono::steady_clock clock_type;
+
+// Structs
+struct QueuedWorkItem
+{
+    RequestWorkItem workItem;
+    clock_type::time_point enqueueTime;
+};
+
+// Utility rather than background for low priority work: a hydration that a
+// foreground request was coalesced onto may be running at this class.
+static const qos_class_t PriorityQosClasses[RequestPriority_Count] =
+{
+    QOS_CLASS_USER_INITIATED,   // RequestPriority_High
+    QOS_CLASS_DEFAULT,          // RequestPriority_Normal
+    QOS_CLASS_UTILITY,          // RequestPriority_Low
+};
+
+// Function prototypes
+static void WorkerMain(RequestLane preferredLane);
+static bool TryDequeue_Locked(RequestLane preferredLane, RequestWorkItem* outWorkItem, RequestPriority* outPriority);
+static bool IsLaneEmpty_Locked(RequestLane lane);
+
+// State
+static mutex s_workQueueMutex;
+static deque<QueuedWorkItem> s_workQueues[RequestLane_Count][RequestPriority_Count];
+static clock_type::duration s_agingInterval = std::chrono::milliseconds(50);
+
+// Workers wait on the condition variable of the lane they prefer
+static std::condition_variable s_workAvailable[RequestLane_Count];
+static bool s_started = false;
+
+bool RequestWorkerPool_Start(unsigned int threadCount)
+{
+    if (threadCount < RequestLane_Count)
+    {
+        threadCount = RequestLane_Count;
+    }
+    
+    // Enumeration is comparatively cheap and latency sensitive (it blocks directory
+    // listings), a quarter of the pool is enough to keep it moving.
+    unsigned int enumerationThreadCount = std::max(1u, threadCount / 4);
+    
+    {
+        mutex_lock lock(s_workQueueMutex);
+        if (s_started)
+        {
+            return false;
+        }
+        
+        s_started = true;
+    }
+    
+    try
+    {
+        for (unsigned int i = 0; i < threadCount; ++i)
+        {
+            RequestLane lane = i < enumerationThreadCount ? RequestLane_Enumeration : RequestLane_Hydration;
+            std::thread(WorkerMain, lane).detach();
+        }
+    }
+    catch (const std::system_error& error)
+    {
+        // Any threads that did start keep serving requests
+        std::cerr << "RequestWorkerPool_Start: failed to create worker thread: " << error.what() << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+void RequestWorkerPool_Enqueue(RequestLane lane, RequestPriority priority, RequestWorkItem workItem)
+{
+    {
+        mutex_lock lock(s_workQueueMutex);
+        s_workQueues[lane][priority].push_back(QueuedWorkItem { std::move(workItem), clock_type::now() });
+    }
+    
+    s_workAvailable[lane].notify_one();
+    if (RequestLane_Enumeration == lane)
+    {
+        // Idle hydration workers help with enumeration
+        s_workAvailable[RequestLane_Hydration].notify_one();
+    }
+}
+
+void RequestWorkerPool_SetAgingInterval(unsigned int agingMilliseconds)
+{
+    mutex_lock lock(s_workQueueMutex);
+    s_agingInterval = std::chrono::milliseconds(agingMilliseconds);
+}
+
+static void WorkerMain(RequestLane preferredLane)
+{
+    qos_class_t currentQosClass = QOS_CLASS_UNSPECIFIED;
+    while (true)
+    {
+        RequestWorkItem workItem;
+        RequestPriority priority;
+        
+        {
+            mutex_unique_lock lock(s_workQueueMutex);
+            s_workAvailable[preferredLane].wait(
+                lock,
+                [preferredLane, &workItem, &priority]
+                {
+                    return TryDequeue_Locked(preferredLane, &workItem, &priority);
+                });
+        }
+        
+        // Only switch when it changes, a run of work of one priority costs no system calls
+        if (PriorityQosClasses[priority] != currentQosClass &&
+            0 == pthread_set_qos_class_self_np(PriorityQosClasses[priority], 0))
+        {
+            currentQosClass = PriorityQosClasses[priority];
+        }
+        
+        workItem();
+    }
+}
+
+static bool TryDequeue_Locked(RequestLane preferredLane, RequestWorkItem* outWorkItem, RequestPriority* outPriority)
+{
+    RequestLane lane = preferredLane;
+    if (IsLaneEmpty_Locked(lane) && RequestLane_Hydration == preferredLane)
+    {
+        lane = RequestLane_Enumeration;
+    }
+    
+    if (IsLaneEmpty_Locked(lane))
+    {
+        return false;
+    }
+    
+    // Pick the class whose oldest item has the best priority after aging. Ties go to
+    // the higher class.
+    clock_type::time_point now = clock_type::now();
+    deque<QueuedWorkItem>* bestQueue = nullptr;
+    int bestPriority = 0;
+    int64_t bestEffectivePriority = 0;
+    for (int priority = 0; priority < RequestPriority_Count; ++priority)
+    {
+        deque<QueuedWorkItem>* queue = &s_workQueues[lane][priority];
+        if (queue->empty())
+        {
+            continue;
+        }
+        
+        int64_t effectivePriority = priority;
+        if (s_agingInterval.count() > 0)
+        {
+            effectivePriority -= (now - queue->front().enqueueTime) / s_agingInterval;
+        }
+        
+        if (nullptr == bestQueue || effectivePriority < bestEffectivePriority)
+        {
+            bestQueue = queue;
+            bestPriority = priority;
+            bestEffectivePriority = effectivePriority;
+        }
+    }
+    
+    *outWorkItem = std::move(bestQueue->front().workItem);
+    *outPriority = static_cast<RequestPriority>(bestPriority);
+    bestQueue->pop_front();
+    return true;
+}
+
+static bool IsLaneEmpty_Locked(RequestLane lane)
+{
+    for (int priority = 0; priority < RequestPriority_Count; ++priority)
+    {
+        if (!s_workQueues[lane][priority].empty())
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+
+// Fixed-size pool of threads that run kernel request handlers. Work is queued
+// on separate lanes so that a flood of requests of one kind cannot starve the
+// other: enumeration workers only ever take enumeration work, while hydration
+// workers prefer hydration work and help with enumeration when idle.
+//
+// Within a lane, work is taken in priority order. Waiting work ages: for every
+// aging interval it has been queued it competes as if it were one priority
+// class higher, so low priority work is delayed but never starved. Workers run
+// each item at the QoS class of its priority, so that the system also favours
+// high priority work over other processes' when the machine is loaded.
+enum RequestLane
+{
+    RequestLane_Enumeration,
+    RequestLane_Hydration,
+    
+    RequestLane_Count
+};
+
+enum RequestPriority
+{
+    RequestPriority_High,
+    RequestPriority_Normal,
+    RequestPriority_Low,
+    
+    RequestPriority_Count
+};
+
+typedef std::function<void()> RequestWorkItem;
+
+// Starts threadCount workers, at least one of which serves each lane.
+bool RequestWorkerPool_Start(unsigned int threadCount);
+void RequestWorkerPool_Enqueue(RequestLane lane, RequestPriority priority, RequestWorkItem workItem);
+
+// 0 disables aging, making priorities strict.
+void RequestWorkerPool_SetAgingInterval(unsigned int agingMilliseconds);
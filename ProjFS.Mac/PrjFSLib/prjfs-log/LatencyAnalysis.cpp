@@ -0,0 +1,271 @@
+#include "LatencyAnalysis.hpp"
+#include <libproc.h>
+#include "../../PrjFSKext/public/Message.h"
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+struct InFlightRequest
+{
+    uint64_t timestampNanoseconds;
+    MessageType messageType;
+    int32_t rootIndex;
+    int32_t pid;
+    string path;
+};
+
+struct CompletedRequest
+{
+    uint64_t latencyNanoseconds;
+    MessageType messageType;
+    int32_t rootIndex;
+    int32_t pid;
+    KextLog_TraceRequestOutcome outcome;
+    string path;
+};
+
+// Requests are grouped by (message type, root index or pid)
+typedef std::pair<MessageType, int32_t> LatencyGroupKey;
+
+static const size_t SlowestRequestCount = 10;
+// Requests whose completion never arrives (e.g. log messages were dropped)
+// are forgotten after this long.
+static const uint64_t InFlightRequestExpiryNanoseconds = 10ull * 60 * 1000 * 1000 * 1000;
+
+static const char* MessageTypeAsString(MessageType messageType);
+static const char* OutcomeAsString(KextLog_TraceRequestOutcome outcome);
+static const string& GetProcessName(int32_t pid);
+static void PrintGroupLatencies(FILE* output, const char* groupKind, const map<LatencyGroupKey, vector<uint64_t>>& groups);
+static double PercentileMilliseconds(const vector<uint64_t>& sortedLatencies, double percentile);
+static void RecordSlowRequest(CompletedRequest&& request);
+
+static unordered_map<uint64_t, InFlightRequest> s_inFlightRequests;
+static map<LatencyGroupKey, vector<uint64_t>> s_intervalLatenciesByRoot;
+static map<LatencyGroupKey, vector<uint64_t>> s_intervalLatenciesByProcess;
+// Min-heap by latency, so the fastest of the slowest is the one to evict
+static vector<CompletedRequest> s_slowestRequests;
+static unordered_map<int32_t, string> s_processNames;
+static uint64_t s_latestTimestampNanoseconds;
+static uint64_t s_unmatchedCompletionCount;
+
+void LatencyAnalysis_HandleTraceEvent(uint64_t timestampNanoseconds, const KextLog_TraceEvent& event, const char* eventString, int stringLength, bool stringTruncated)
+{
+    s_latestTimestampNanoseconds = timestampNanoseconds;
+
+    uint64_t messageId = event.args[0];
+    switch (event.eventId)
+    {
+    case KextLog_TraceEvent_RequestSent:
+    {
+        InFlightRequest& request = s_inFlightRequests[messageId];
+        request.timestampNanoseconds = timestampNanoseconds;
+        request.messageType = static_cast<MessageType>(event.args[1]);
+        request.rootIndex = static_cast<int32_t>(event.args[2]);
+        request.pid = static_cast<int32_t>(event.args[3]);
+        request.path.assign(stringTruncated ? "..." : "");
+        request.path.append(eventString, stringLength);
+
+        // Resolve the name while the process is most likely still around
+        GetProcessName(request.pid);
+        break;
+    }
+    case KextLog_TraceEvent_RequestCompleted:
+    {
+        auto found = s_inFlightRequests.find(messageId);
+        if (found == s_inFlightRequests.end())
+        {
+            s_unmatchedCompletionCount++;
+            break;
+        }
+
+        InFlightRequest& request = found->second;
+        uint64_t latencyNanoseconds =
+            timestampNanoseconds > request.timestampNanoseconds ? timestampNanoseconds - request.timestampNanoseconds : 0;
+
+        s_intervalLatenciesByRoot[LatencyGroupKey(request.messageType, request.rootIndex)].push_back(latencyNanoseconds);
+        s_intervalLatenciesByProcess[LatencyGroupKey(request.messageType, request.pid)].push_back(latencyNanoseconds);
+
+        RecordSlowRequest(
+            CompletedRequest
+            {
+                latencyNanoseconds,
+                request.messageType,
+                request.rootIndex,
+                request.pid,
+                static_cast<KextLog_TraceRequestOutcome>(event.args[3]),
+                std::move(request.path)
+            });
+
+        s_inFlightRequests.erase(found);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void LatencyAnalysis_PrintReport(FILE* output)
+{
+    fprintf(output, "=== Request latencies (ms) ===\n");
+    PrintGroupLatencies(output, "root", s_intervalLatenciesByRoot);
+    PrintGroupLatencies(output, "pid", s_intervalLatenciesByProcess);
+    s_intervalLatenciesByRoot.clear();
+    s_intervalLatenciesByProcess.clear();
+
+    vector<CompletedRequest> slowest = s_slowestRequests;
+    std::sort(
+        slowest.begin(),
+        slowest.end(),
+        [](const CompletedRequest& a, const CompletedRequest& b) { return a.latencyNanoseconds > b.latencyNanoseconds; });
+
+    fprintf(output, "--- Slowest requests since start ---\n");
+    for (const CompletedRequest& request : slowest)
+    {
+        fprintf(
+            output,
+            "%10.3f  %-11s %-8s root %d  pid %d (%s)  %s\n",
+            request.latencyNanoseconds / 1000000.0,
+            MessageTypeAsString(request.messageType),
+            OutcomeAsString(request.outcome),
+            request.rootIndex,
+            request.pid,
+            GetProcessName(request.pid).c_str(),
+            request.path.c_str());
+    }
+
+    // Drop requests that will never be matched so they don't accumulate
+    uint64_t expiredCount = 0;
+    for (auto i = s_inFlightRequests.begin(); i != s_inFlightRequests.end(); )
+    {
+        if (s_latestTimestampNanoseconds - i->second.timestampNanoseconds > InFlightRequestExpiryNanoseconds)
+        {
+            i = s_inFlightRequests.erase(i);
+            expiredCount++;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    fprintf(
+        output,
+        "%zu in flight, %llu expired, %llu completions without a matching send\n\n",
+        s_inFlightRequests.size(),
+        expiredCount,
+        s_unmatchedCompletionCount);
+    fflush(output);
+}
+
+static void PrintGroupLatencies(FILE* output, const char* groupKind, const map<LatencyGroupKey, vector<uint64_t>>& groups)
+{
+    for (const auto& group : groups)
+    {
+        vector<uint64_t> latencies = group.second;
+        std::sort(latencies.begin(), latencies.end());
+
+        MessageType messageType = group.first.first;
+        int32_t groupId = group.first.second;
+        string groupName = std::to_string(groupId);
+        if (0 == strcmp(groupKind, "pid"))
+        {
+            groupName += " (" + GetProcessName(groupId) + ")";
+        }
+
+        fprintf(
+            output,
+            "%-11s %s %-24s n=%-7zu p50=%9.3f p95=%9.3f p99=%9.3f max=%9.3f\n",
+            MessageTypeAsString(messageType),
+            groupKind,
+            groupName.c_str(),
+            latencies.size(),
+            PercentileMilliseconds(latencies, 0.50),
+            PercentileMilliseconds(latencies, 0.95),
+            PercentileMilliseconds(latencies, 0.99),
+            latencies.back() / 1000000.0);
+    }
+}
+
+// Nearest-rank percentile
+static double PercentileMilliseconds(const vector<uint64_t>& sortedLatencies, double percentile)
+{
+    size_t rank = static_cast<size_t>(percentile * sortedLatencies.size() + 0.5);
+    size_t index = rank == 0 ? 0 : std::min(rank - 1, sortedLatencies.size() - 1);
+    return sortedLatencies[index] / 1000000.0;
+}
+
+static void RecordSlowRequest(CompletedRequest&& request)
+{
+    auto fasterThan = [](const CompletedRequest& a, const CompletedRequest& b) { return a.latencyNanoseconds > b.latencyNanoseconds; };
+
+    if (s_slowestRequests.size() < SlowestRequestCount)
+    {
+        s_slowestRequests.push_back(std::move(request));
+        std::push_heap(s_slowestRequests.begin(), s_slowestRequests.end(), fasterThan);
+    }
+    else if (request.latencyNanoseconds > s_slowestRequests.front().latencyNanoseconds)
+    {
+        std::pop_heap(s_slowestRequests.begin(), s_slowestRequests.end(), fasterThan);
+        s_slowestRequests.back() = std::move(request);
+        std::push_heap(s_slowestRequests.begin(), s_slowestRequests.end(), fasterThan);
+    }
+}
+
+static const string& GetProcessName(int32_t pid)
+{
+    auto found = s_processNames.find(pid);
+    if (found != s_processNames.end())
+    {
+        return found->second;
+    }
+
+    char name[2 * MAXCOMLEN + 1] = "";
+    if (proc_name(pid, name, sizeof(name)) <= 0)
+    {
+        strlcpy(name, "?", sizeof(name));
+    }
+
+    return s_processNames.emplace(pid, name).first->second;
+}
+
+static const char* MessageTypeAsString(MessageType messageType)
+{
+    switch (messageType)
+    {
+    case MessageType_KtoU_EnumerateDirectory:
+        return "Enumeration";
+    case MessageType_KtoU_EnumerateDirectoryRecursively:
+        return "RecursiveEnumeration";
+    case MessageType_KtoU_HydrateFile:
+        return "Hydration";
+    default:
+        return "Other";
+    }
+}
+
+static const char* OutcomeAsString(KextLog_TraceRequestOutcome outcome)
+{
+    switch (outcome)
+    {
+    case TraceRequestOutcome_Success:
+        return "Success";
+    case TraceRequestOutcome_Fail:
+        return "Fail";
+    case TraceRequestOutcome_TimedOut:
+        return "TimedOut";
+    case TraceRequestOutcome_ProviderDisconnected:
+        return "Aborted";
+    case TraceRequestOutcome_Interrupted:
+        return "Interrupted";
+    default:
+        return "Unknown";
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "../../PrjFSKext/public/PrjFSLogClientShared.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Pairs RequestSent/RequestCompleted trace events by message id and keeps
+// latency statistics for hydration and enumeration requests.
+
+void LatencyAnalysis_HandleTraceEvent(uint64_t timestampNanoseconds, const KextLog_TraceEvent& event, const char* eventString, int stringLength, bool stringTruncated);
+
+// Prints percentiles for the requests completed since the previous report,
+// per root and per triggering process, followed by the slowest requests seen
+// since startup.
+void LatencyAnalysis_PrintReport(FILE* output);
@@ -0,0 +1,361 @@
+#include "LogCapture.hpp"
+#include <compression.h>
+#include <dirent.h>
+#include <errno.h>
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+using std::vector;
+
+// A capture file is a CaptureFileHeader followed by blocks, each a CaptureBlockHeader
+// followed by its compressed contents. Uncompressed, a block holds messages, each
+// preceded by its size as a uint32_t.
+static const char CaptureFileMagic[4] = { 'P', 'J', 'L', 'C' };
+static const uint32_t CaptureFileVersion = 1;
+
+struct CaptureFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t timebaseNumer;
+    uint32_t timebaseDenom;
+};
+
+struct CaptureBlockHeader
+{
+    // Equal to uncompressedSize if the block is stored uncompressed because it
+    // didn't get any smaller
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+};
+
+// Blocks are handed to the writer once they reach this size, or when flushed
+static const size_t CaptureBlockBytes = 1024 * 1024;
+static const char CaptureFileNameFormat[] = "prjfs-log-%08u.capture";
+
+// Only used on the appending queue
+static vector<uint8_t>* s_pendingBlock = nullptr;
+
+// Only used on the writer queue
+static dispatch_queue_t s_writerQueue = nullptr;
+static int s_directoryFd = -1;
+static int s_fileFd = -1;
+static uint32_t s_fileIndex = 0;
+static uint64_t s_fileBytes = 0;
+static uint64_t s_maxFileBytes = 0;
+static uint32_t s_maxFileCount = 0;
+static mach_timebase_info_data_t s_timebase;
+static vector<uint8_t> s_compressedBlock;
+static vector<uint8_t> s_compressionScratch;
+static bool s_reportedWriteFailure = false;
+
+static uint32_t FindNextFileIndex(int directoryFd);
+static bool OpenNextFile();
+static void WriteBlock(const vector<uint8_t>& block);
+static bool WriteAll(int fd, const void* bytes, size_t byteCount);
+static bool ReadAll(int fd, void* bytes, size_t byteCount);
+
+bool LogCapture_Start(const char* directoryPath, uint64_t maxFileBytes, uint32_t maxFileCount, const mach_timebase_info_data_t& timebase)
+{
+    s_directoryFd = open(directoryPath, O_RDONLY | O_DIRECTORY);
+    if (s_directoryFd < 0)
+    {
+        fprintf(stderr, "Failed to open capture directory %s: %s\n", directoryPath, strerror(errno));
+        return false;
+    }
+
+    s_maxFileBytes = maxFileBytes;
+    s_maxFileCount = maxFileCount;
+    s_timebase = timebase;
+
+    // Compressed blocks are never larger than stored ones
+    s_compressedBlock.resize(CaptureBlockBytes);
+    s_compressionScratch.resize(compression_encode_scratch_buffer_size(COMPRESSION_LZ4));
+
+    // Captures from earlier runs in the same directory are kept
+    s_fileIndex = FindNextFileIndex(s_directoryFd);
+    if (!OpenNextFile())
+    {
+        return false;
+    }
+
+    s_writerQueue = dispatch_queue_create("prjfs-log.capture-writer", DISPATCH_QUEUE_SERIAL);
+    s_pendingBlock = new vector<uint8_t>();
+    s_pendingBlock->reserve(CaptureBlockBytes);
+    return true;
+}
+
+void LogCapture_AppendMessage(const void* message, uint32_t messageSize)
+{
+    if (s_pendingBlock->size() + sizeof(messageSize) + messageSize > CaptureBlockBytes)
+    {
+        LogCapture_Flush();
+    }
+
+    const uint8_t* sizeBytes = reinterpret_cast<const uint8_t*>(&messageSize);
+    s_pendingBlock->insert(s_pendingBlock->end(), sizeBytes, sizeBytes + sizeof(messageSize));
+    s_pendingBlock->insert(s_pendingBlock->end(), static_cast<const uint8_t*>(message), static_cast<const uint8_t*>(message) + messageSize);
+}
+
+void LogCapture_Flush()
+{
+    if (!s_pendingBlock->empty())
+    {
+        vector<uint8_t>* block = s_pendingBlock;
+        dispatch_async(s_writerQueue, ^{
+            WriteBlock(*block);
+            delete block;
+        });
+
+        s_pendingBlock = new vector<uint8_t>();
+        s_pendingBlock->reserve(CaptureBlockBytes);
+    }
+}
+
+void LogCapture_Stop()
+{
+    LogCapture_Flush();
+    dispatch_sync(s_writerQueue, ^{
+        if (s_fileFd >= 0)
+        {
+            close(s_fileFd);
+            s_fileFd = -1;
+        }
+    });
+}
+
+bool LogCapture_Decode(const char* filePath, mach_timebase_info_data_t* timebase, LogCapture_MessageHandler handler)
+{
+    int fd = open(filePath, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", filePath, strerror(errno));
+        return false;
+    }
+
+    CaptureFileHeader fileHeader;
+    if (!ReadAll(fd, &fileHeader, sizeof(fileHeader)) ||
+        0 != memcmp(fileHeader.magic, CaptureFileMagic, sizeof(CaptureFileMagic)) ||
+        CaptureFileVersion != fileHeader.version ||
+        0 == fileHeader.timebaseDenom)
+    {
+        fprintf(stderr, "%s is not a prjfs-log capture file\n", filePath);
+        close(fd);
+        return false;
+    }
+
+    timebase->numer = fileHeader.timebaseNumer;
+    timebase->denom = fileHeader.timebaseDenom;
+
+    vector<uint8_t> compressedBlock;
+    vector<uint8_t> block;
+    CaptureBlockHeader blockHeader;
+    while (ReadAll(fd, &blockHeader, sizeof(blockHeader)))
+    {
+        if (blockHeader.compressedSize > blockHeader.uncompressedSize || blockHeader.uncompressedSize > CaptureBlockBytes)
+        {
+            fprintf(stderr, "%s: corrupt block, stopping\n", filePath);
+            break;
+        }
+
+        compressedBlock.resize(blockHeader.compressedSize);
+        if (!ReadAll(fd, compressedBlock.data(), compressedBlock.size()))
+        {
+            // The capture was stopped while writing its last block
+            fprintf(stderr, "%s: truncated block, stopping\n", filePath);
+            break;
+        }
+
+        if (blockHeader.compressedSize == blockHeader.uncompressedSize)
+        {
+            block.swap(compressedBlock);
+        }
+        else
+        {
+            block.resize(blockHeader.uncompressedSize);
+            size_t decodedSize = compression_decode_buffer(
+                block.data(), block.size(),
+                compressedBlock.data(), compressedBlock.size(),
+                nullptr,
+                COMPRESSION_LZ4);
+            if (decodedSize != blockHeader.uncompressedSize)
+            {
+                fprintf(stderr, "%s: block failed to decompress, stopping\n", filePath);
+                break;
+            }
+        }
+
+        size_t offset = 0;
+        while (offset + sizeof(uint32_t) <= block.size())
+        {
+            uint32_t messageSize;
+            memcpy(&messageSize, &block[offset], sizeof(messageSize));
+            offset += sizeof(messageSize);
+            if (messageSize > block.size() - offset)
+            {
+                fprintf(stderr, "%s: corrupt message, skipping rest of block\n", filePath);
+                break;
+            }
+
+            handler(&block[offset], messageSize);
+            offset += messageSize;
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+static uint32_t FindNextFileIndex(int directoryFd)
+{
+    uint32_t nextIndex = 0;
+    DIR* directory = fdopendir(dup(directoryFd));
+    if (nullptr == directory)
+    {
+        return nextIndex;
+    }
+
+    struct dirent* entry;
+    while (nullptr != (entry = readdir(directory)))
+    {
+        unsigned int index;
+        if (1 == sscanf(entry->d_name, CaptureFileNameFormat, &index) && index >= nextIndex)
+        {
+            nextIndex = index + 1;
+        }
+    }
+
+    closedir(directory);
+    return nextIndex;
+}
+
+static bool OpenNextFile()
+{
+    if (s_fileFd >= 0)
+    {
+        close(s_fileFd);
+        s_fileFd = -1;
+    }
+
+    char fileName[64];
+    if (0 != s_maxFileCount && s_fileIndex >= s_maxFileCount)
+    {
+        snprintf(fileName, sizeof(fileName), CaptureFileNameFormat, s_fileIndex - s_maxFileCount);
+        unlinkat(s_directoryFd, fileName, 0);
+    }
+
+    snprintf(fileName, sizeof(fileName), CaptureFileNameFormat, s_fileIndex);
+    s_fileIndex++;
+
+    s_fileFd = openat(s_directoryFd, fileName, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (s_fileFd < 0)
+    {
+        fprintf(stderr, "Failed to create capture file %s: %s\n", fileName, strerror(errno));
+        return false;
+    }
+
+    CaptureFileHeader header = {};
+    memcpy(header.magic, CaptureFileMagic, sizeof(CaptureFileMagic));
+    header.version = CaptureFileVersion;
+    header.timebaseNumer = s_timebase.numer;
+    header.timebaseDenom = s_timebase.denom;
+    if (!WriteAll(s_fileFd, &header, sizeof(header)))
+    {
+        close(s_fileFd);
+        s_fileFd = -1;
+        return false;
+    }
+
+    s_fileBytes = sizeof(header);
+    return true;
+}
+
+// Runs on the writer queue. Failures drop the block, with a single warning, so
+// that a full disk doesn't stop the capture from resuming once there is space.
+static void WriteBlock(const vector<uint8_t>& block)
+{
+    if (s_fileFd < 0 || (s_fileBytes >= s_maxFileBytes && sizeof(CaptureFileHeader) != s_fileBytes))
+    {
+        if (!OpenNextFile())
+        {
+            return;
+        }
+    }
+
+    size_t compressedSize = compression_encode_buffer(
+        s_compressedBlock.data(), s_compressedBlock.size(),
+        block.data(), block.size(),
+        s_compressionScratch.data(),
+        COMPRESSION_LZ4);
+
+    bool isCompressed = 0 != compressedSize && compressedSize < block.size();
+    CaptureBlockHeader header = {};
+    header.uncompressedSize = static_cast<uint32_t>(block.size());
+    header.compressedSize = isCompressed ? static_cast<uint32_t>(compressedSize) : header.uncompressedSize;
+
+    if (!WriteAll(s_fileFd, &header, sizeof(header)) ||
+        !WriteAll(s_fileFd, isCompressed ? s_compressedBlock.data() : block.data(), header.compressedSize))
+    {
+        if (!s_reportedWriteFailure)
+        {
+            fprintf(stderr, "Warning: writing capture file failed: %s; dropping log messages until it succeeds\n", strerror(errno));
+            s_reportedWriteFailure = true;
+        }
+
+        // A partial block would make the rest of the file unreadable
+        OpenNextFile();
+        return;
+    }
+
+    s_reportedWriteFailure = false;
+    s_fileBytes += sizeof(header) + header.compressedSize;
+}
+
+static bool WriteAll(int fd, const void* bytes, size_t byteCount)
+{
+    const char* remaining = static_cast<const char*>(bytes);
+    while (byteCount > 0)
+    {
+        ssize_t written = write(fd, remaining, byteCount);
+        if (written < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        remaining += written;
+        byteCount -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+static bool ReadAll(int fd, void* bytes, size_t byteCount)
+{
+    char* remaining = static_cast<char*>(bytes);
+    while (byteCount > 0)
+    {
+        ssize_t bytesRead = read(fd, remaining, byteCount);
+        if (bytesRead < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        else if (bytesRead <= 0)
+        {
+            return false;
+        }
+
+        remaining += bytesRead;
+        byteCount -= static_cast<size_t>(bytesRead);
+    }
+
+    return true;
+}
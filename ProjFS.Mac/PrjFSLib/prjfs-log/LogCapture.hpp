@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <mach/mach_time.h>
+
+// Writes the raw kext log messages (KextLog_MessageHeader followed by its data)
+// to LZ4-compressed capture files, rotating to a new file once one reaches its
+// size limit and removing the oldest beyond the file count limit (0 for none).
+// Messages are collected into blocks on the caller's queue; blocks are
+// compressed and written on a queue of their own, so that the log queue keeps
+// being drained while the disk is busy.
+
+bool LogCapture_Start(const char* directoryPath, uint64_t maxFileBytes, uint32_t maxFileCount, const mach_timebase_info_data_t& timebase);
+
+// Must always be called on the same serial queue
+void LogCapture_AppendMessage(const void* message, uint32_t messageSize);
+
+// Hands everything appended so far to the writer without waiting for it; call
+// on the queue that appends
+void LogCapture_Flush();
+
+// Flushes and waits until everything has been written
+void LogCapture_Stop();
+
+typedef void (*LogCapture_MessageHandler)(const void* message, uint32_t messageSize);
+
+// Passes each message in a capture file to the handler, in order. The timebase
+// the capture's timestamps are in is set before the first message.
+bool LogCapture_Decode(const char* filePath, mach_timebase_info_data_t* timebase, LogCapture_MessageHandler handler);
@@ -1,16 +1,104 @@
 #include "../PrjFSUser.hpp"
+#include "LatencyAnalysis.hpp"
+#include "LogCapture.hpp"
 #include "../../PrjFSKext/public/PrjFSLogClientShared.h"
 #include <iostream>
+#include <algorithm>
 #include <dispatch/queue.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
 #include <mach/mach_time.h>
+#include <signal.h>
 
 
 static const char* KextLogLevelAsString(KextLog_Level level);
+static const char* TraceEventIdAsString(KextLog_TraceEventId eventId);
+static void PrintTraceEvent(const KextLog_MessageHeader& header, const char* eventData, int eventDataSize);
+static uint64_t MachAbsoluteTimeToNanoseconds(uint64_t machTime);
+static int PrintLockProfiles(io_connect_t connection);
+static int PrintProcessAttributions(io_connect_t connection);
+static void PrintProcessAttribution(const char* name, const KextLog_ProcessAttribution& attribution);
+static void HandleLogMessage(const void* messageBytes, uint32_t messageSize);
+static int DecodeCaptures(int fileCount, const char* const* filePaths);
+static void StartLatencyReports(dispatch_queue_t queue);
+
+static const uint64_t LatencyReportIntervalSeconds = 5;
+// Captures hand what they have to the writer at least this often, so that little
+// is lost if prjfs-log is killed
+static const uint64_t CaptureFlushIntervalSeconds = 1;
+static const uint64_t DefaultCaptureFileMegabytes = 64;
+
+static mach_timebase_info_data_t s_machTimebase;
+static bool s_analyzeLatency = false;
 
 int main(int argc, const char * argv[])
 {
+    bool enableTrace = false;
+    bool printLockProfiles = false;
+    bool printProcessAttributions = false;
+    uint64_t queueCapacityMegabytes = 0;
+    const char* captureDirectory = nullptr;
+    uint64_t captureFileMegabytes = DefaultCaptureFileMegabytes;
+    uint32_t captureFileCount = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--trace"))
+        {
+            enableTrace = true;
+        }
+        else if (0 == strcmp(argv[i], "--latency"))
+        {
+            s_analyzeLatency = true;
+        }
+        else if (0 == strcmp(argv[i], "--locks"))
+        {
+            printLockProfiles = true;
+        }
+        else if (0 == strcmp(argv[i], "--processes"))
+        {
+            printProcessAttributions = true;
+        }
+        else if (0 == strcmp(argv[i], "--queue-size-mb") && i + 1 < argc)
+        {
+            queueCapacityMegabytes = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argv[i], "--capture") && i + 1 < argc)
+        {
+            captureDirectory = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--capture-file-mb") && i + 1 < argc)
+        {
+            captureFileMegabytes = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argv[i], "--capture-files") && i + 1 < argc)
+        {
+            captureFileCount = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argv[i], "--decode") && i + 1 < argc)
+        {
+            // The remaining arguments are capture files
+            return DecodeCaptures(argc - i - 1, argv + i + 1);
+        }
+        else
+        {
+            std::cerr << "Usage: prjfs-log [--trace | --latency] [--queue-size-mb <megabytes>]\n"
+                         "       prjfs-log [--trace] [--queue-size-mb <megabytes>] --capture <directory>\n"
+                         "                 [--capture-file-mb <megabytes>] [--capture-files <count>]\n"
+                         "       prjfs-log [--latency] --decode <capture file>...\n"
+                         "       prjfs-log --locks\n"
+                         "       prjfs-log --processes\n";
+            return 1;
+        }
+    }
+    
+    if (nullptr != captureDirectory && s_analyzeLatency)
+    {
+        std::cerr << "Latency analysis is done when decoding captures, pass --latency to --decode instead.\n";
+        return 1;
+    }
+    
+    mach_timebase_info(&s_machTimebase);
+    
     io_connect_t connection = PrjFSService_ConnectToDriver(UserClientType_Log);
     if (connection == IO_OBJECT_NULL)
     {
@@ -18,13 +106,67 @@ int main(int argc, const char * argv[])
         return 1;
     }
     
+    if (printLockProfiles)
+    {
+        return PrintLockProfiles(connection);
+    }
+    
+    if (printProcessAttributions)
+    {
+        return PrintProcessAttributions(connection);
+    }
+    
+    if (enableTrace || s_analyzeLatency)
+    {
+        // Latency reports replace the per-event output, so only errors are
+        // still printed as they happen.
+        uint64_t levelMask =
+            s_analyzeLatency ?
+            KextLog_LevelMaskBit(KEXTLOG_ERROR) | KextLog_LevelMaskBit(KEXTLOG_TRACE) :
+            KextLog_DefaultLevelMask | KextLog_LevelMaskBit(KEXTLOG_TRACE);
+        kern_return_t result = IOConnectCallScalarMethod(connection, LogSelector_SetLevelMask, &levelMask, 1, nullptr, nullptr);
+        if (kIOReturnSuccess != result)
+        {
+            std::cerr << "Failed to enable trace events: 0x" << std::hex << result << std::dec << "\n";
+            return 1;
+        }
+    }
+    
+    if (0 != queueCapacityMegabytes)
+    {
+        // Must happen before the queue is mapped
+        uint64_t capacityBytes = queueCapacityMegabytes * 1024 * 1024;
+        uint64_t error = 0;
+        uint32_t outputCount = 1;
+        kern_return_t result = IOConnectCallScalarMethod(connection, LogSelector_SetMessageQueueCapacity, &capacityBytes, 1, &error, &outputCount);
+        if (kIOReturnSuccess != result || 0 != error)
+        {
+            std::cerr << "Failed to set log queue size to " << queueCapacityMegabytes << " MB: 0x" << std::hex << result << std::dec << ", error " << error << "\n";
+            return 1;
+        }
+    }
+    
+    // Captures drain the log queue on a queue of their own, so that nothing waits
+    // on the main queue or the terminal
+    dispatch_queue_t eventQueue =
+        nullptr == captureDirectory ?
+        dispatch_get_main_queue() :
+        dispatch_queue_create("prjfs-log.capture", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0));
+    
+    if (nullptr != captureDirectory &&
+        !LogCapture_Start(captureDirectory, captureFileMegabytes * 1024 * 1024, captureFileCount, s_machTimebase))
+    {
+        return 1;
+    }
+    
     DataQueueResources dataQueue = {};
-    if (!PrjFSService_DataQueueInit(&dataQueue, connection, LogPortType_MessageQueue, LogMemoryType_MessageQueue, dispatch_get_main_queue()))
+    if (!PrjFSService_DataQueueInit(&dataQueue, connection, LogPortType_MessageQueue, LogMemoryType_MessageQueue, eventQueue))
     {
         std::cerr << "Failed to set up shared data queue.\n";
         return 1;
     }
 
+    bool isCapturing = nullptr != captureDirectory;
     dispatch_source_set_event_handler(dataQueue.dispatchSource, ^{
         struct {
             mach_msg_header_t	msgHdr;
@@ -39,24 +181,146 @@ int main(int argc, const char * argv[])
             {
                 break;
             }
-            int messageSize = entry->size;
-            if (messageSize >= sizeof(KextLog_MessageHeader) + 2)
+            
+            if (isCapturing)
+            {
+                LogCapture_AppendMessage(entry->data, entry->size);
+            }
+            else
             {
-                struct KextLog_MessageHeader message = {};
-                memcpy(&message, entry->data, sizeof(KextLog_MessageHeader));
-                const char* messageType = KextLogLevelAsString(message.level);
-                int logStringLength = messageSize - sizeof(KextLog_MessageHeader) - 1;
-                printf("%s: %.*s\n", messageType, logStringLength, entry->data + sizeof(KextLog_MessageHeader));
+                HandleLogMessage(entry->data, entry->size);
             }
+            
             IODataQueueDequeue(dataQueue.queueMemory, nullptr, nullptr);
         }
     });
     dispatch_resume(dataQueue.dispatchSource);
+    
+    if (isCapturing)
+    {
+        dispatch_source_t flushTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, eventQueue);
+        dispatch_source_set_timer(
+            flushTimer,
+            dispatch_time(DISPATCH_TIME_NOW, CaptureFlushIntervalSeconds * NSEC_PER_SEC),
+            CaptureFlushIntervalSeconds * NSEC_PER_SEC,
+            NSEC_PER_SEC / 10);
+        dispatch_source_set_event_handler(flushTimer, ^{
+            LogCapture_Flush();
+        });
+        dispatch_resume(flushTimer);
+        
+        // Write out the last messages when stopped with Ctrl-C or kill
+        const int stopSignals[] = { SIGINT, SIGTERM };
+        for (int stopSignal : stopSignals)
+        {
+            signal(stopSignal, SIG_IGN);
+            dispatch_source_t signalSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, stopSignal, 0, eventQueue);
+            dispatch_source_set_event_handler(signalSource, ^{
+                LogCapture_Stop();
+                exit(0);
+            });
+            dispatch_resume(signalSource);
+        }
+    }
+    
+    if (s_analyzeLatency)
+    {
+        StartLatencyReports(dispatch_get_main_queue());
+    }
+    
     CFRunLoopRun();
     
     return 0;
 }
 
+// Prints a message as it came from the kext, or feeds it to the latency analysis
+static void HandleLogMessage(const void* messageBytes, uint32_t messageSize)
+{
+    if (messageSize < sizeof(KextLog_MessageHeader) + 2)
+    {
+        return;
+    }
+    
+    struct KextLog_MessageHeader message = {};
+    memcpy(&message, messageBytes, sizeof(KextLog_MessageHeader));
+    if (message.flags & LogMessageFlag_LogMessagesDropped)
+    {
+        fprintf(
+            stderr,
+            "Warning: %u log messages (%llu bytes) were dropped because the queue was full\n",
+            message.droppedMessageCount,
+            message.droppedByteCount);
+    }
+    
+    const char* messageData = static_cast<const char*>(messageBytes) + sizeof(KextLog_MessageHeader);
+    int messageDataSize = static_cast<int>(messageSize - sizeof(KextLog_MessageHeader));
+    if (KEXTLOG_TRACE == message.level && s_analyzeLatency)
+    {
+        if (messageDataSize >= static_cast<int>(sizeof(KextLog_TraceEvent)) + 1)
+        {
+            KextLog_TraceEvent event = {};
+            memcpy(&event, messageData, sizeof(event));
+            LatencyAnalysis_HandleTraceEvent(
+                MachAbsoluteTimeToNanoseconds(message.machAbsoluteTimestamp),
+                event,
+                messageData + sizeof(KextLog_TraceEvent),
+                messageDataSize - static_cast<int>(sizeof(KextLog_TraceEvent)) - 1,
+                message.flags & LogMessageFlag_LogMessageTruncated);
+        }
+    }
+    else if (KEXTLOG_TRACE == message.level)
+    {
+        PrintTraceEvent(message, messageData, messageDataSize);
+    }
+    else
+    {
+        const char* messageType = KextLogLevelAsString(message.level);
+        printf("%s: %.*s\n", messageType, messageDataSize - 1, messageData);
+    }
+}
+
+// Replays captures as if their messages had just come from the kext. With
+// --latency, a single report over all of them is printed at the end.
+static int DecodeCaptures(int fileCount, const char* const* filePaths)
+{
+    if (0 == fileCount)
+    {
+        std::cerr << "No capture files given.\n";
+        return 1;
+    }
+    
+    int result = 0;
+    for (int i = 0; i < fileCount; ++i)
+    {
+        if (!LogCapture_Decode(filePaths[i], &s_machTimebase, HandleLogMessage))
+        {
+            result = 1;
+        }
+    }
+    
+    if (s_analyzeLatency)
+    {
+        LatencyAnalysis_PrintReport(stdout);
+    }
+    
+    return result;
+}
+
+static void StartLatencyReports(dispatch_queue_t queue)
+{
+    // Same queue as the event handler, so the analysis state needs no locking
+    dispatch_source_t reportTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_timer(
+        reportTimer,
+        dispatch_time(DISPATCH_TIME_NOW, LatencyReportIntervalSeconds * NSEC_PER_SEC),
+        LatencyReportIntervalSeconds * NSEC_PER_SEC,
+        NSEC_PER_SEC / 10);
+    dispatch_source_set_event_handler(reportTimer, ^{
+        LatencyAnalysis_PrintReport(stdout);
+    });
+    dispatch_resume(reportTimer);
+}
+
 static const char* KextLogLevelAsString(KextLog_Level level)
 {
     switch (level)
@@ -67,7 +331,145 @@ static const char* KextLogLevelAsString(KextLog_Level level)
         return "Info";
     case KEXTLOG_NOTE:
         return "Note";
+    case KEXTLOG_TRACE:
+        return "Trace";
     default:
         return "Unknown";
     }
 }
+
+static const char* TraceEventIdAsString(KextLog_TraceEventId eventId)
+{
+    switch (eventId)
+    {
+    case KextLog_TraceEvent_RequestSent:
+        return "RequestSent";
+    case KextLog_TraceEvent_RequestCompleted:
+        return "RequestCompleted";
+    default:
+        return "Unknown";
+    }
+}
+
+static void PrintTraceEvent(const KextLog_MessageHeader& header, const char* eventData, int eventDataSize)
+{
+    if (eventDataSize < static_cast<int>(sizeof(KextLog_TraceEvent)) + 1)
+    {
+        printf("Trace: (malformed event, %d bytes)\n", eventDataSize);
+        return;
+    }
+    
+    KextLog_TraceEvent event = {};
+    memcpy(&event, eventData, sizeof(event));
+    int stringLength = eventDataSize - static_cast<int>(sizeof(KextLog_TraceEvent)) - 1;
+    
+    printf(
+        "Trace: %llu ns %s [0x%llx, %llu, %llu, %llu]%s%s%.*s\n",
+        MachAbsoluteTimeToNanoseconds(header.machAbsoluteTimestamp),
+        TraceEventIdAsString(event.eventId),
+        event.args[0],
+        event.args[1],
+        event.args[2],
+        event.args[3],
+        stringLength > 0 ? " " : "",
+        (header.flags & LogMessageFlag_LogMessageTruncated) ? "..." : "",
+        stringLength,
+        eventData + sizeof(KextLog_TraceEvent));
+}
+
+static uint64_t MachAbsoluteTimeToNanoseconds(uint64_t machTime)
+{
+    return machTime * s_machTimebase.numer / s_machTimebase.denom;
+}
+
+static int PrintLockProfiles(io_connect_t connection)
+{
+    KextLog_LockProfiles profiles = {};
+    size_t profilesSize = sizeof(profiles);
+    kern_return_t result = IOConnectCallStructMethod(connection, LogSelector_GetLockProfiles, nullptr, 0, &profiles, &profilesSize);
+    if (kIOReturnUnsupported == result)
+    {
+        std::cerr << "The kext was built without lock profiling (PRJFS_LOCK_PROFILING).\n";
+        return 1;
+    }
+    else if (kIOReturnSuccess != result)
+    {
+        std::cerr << "Failed to read lock profiles: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+    
+    printf("%-24s %12s %12s %14s %14s %14s\n", "Lock", "Acquires", "Contended", "Wait total ms", "Wait max ms", "Hold total ms");
+    for (uint32_t i = 0; i < profiles.profileCount && i < KextLog_MaxLockProfiles; ++i)
+    {
+        const KextLog_LockProfile& profile = profiles.profiles[i];
+        printf(
+            "%-24.*s %12llu %12llu %14.3f %14.3f %14.3f\n",
+            static_cast<int>(sizeof(profile.name)),
+            profile.name,
+            profile.acquireCount,
+            profile.contendedCount,
+            profile.totalWaitNanoseconds / 1000000.0,
+            profile.maxWaitNanoseconds / 1000000.0,
+            profile.totalHoldNanoseconds / 1000000.0);
+    }
+    
+    return 0;
+}
+
+static int PrintProcessAttributions(io_connect_t connection)
+{
+    KextLog_ProcessAttributions attributions = {};
+    size_t attributionsSize = sizeof(attributions);
+    kern_return_t result = IOConnectCallStructMethod(connection, LogSelector_GetProcessAttributions, nullptr, 0, &attributions, &attributionsSize);
+    if (kIOReturnSuccess != result)
+    {
+        std::cerr << "Failed to read process attributions: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+    
+    uint32_t entryCount = std::min(attributions.entryCount, KextLog_MaxProcessAttributions);
+    std::sort(
+        attributions.entries,
+        attributions.entries + entryCount,
+        [](const KextLog_ProcessAttribution& left, const KextLog_ProcessAttribution& right)
+        {
+            return left.hydratedBytes > right.hydratedBytes;
+        });
+    
+    printf("%-24s %6s %12s %12s %14s %12s %14s\n", "Process", "Root", "Hydrations", "Enumerations", "Hydrated MB", "Waits", "Wait total ms");
+    for (uint32_t i = 0; i < entryCount; ++i)
+    {
+        const KextLog_ProcessAttribution& attribution = attributions.entries[i];
+        char name[sizeof(attribution.procname) + 1] = {};
+        memcpy(name, attribution.procname, sizeof(attribution.procname));
+        PrintProcessAttribution(name, attribution);
+    }
+    
+    if (0 != attributions.evictedCount)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "(%llu evicted)", attributions.evictedCount);
+        PrintProcessAttribution(name, attributions.evicted);
+    }
+    
+    return 0;
+}
+
+static void PrintProcessAttribution(const char* name, const KextLog_ProcessAttribution& attribution)
+{
+    char root[16] = "-";
+    if (attribution.rootIndex >= 0)
+    {
+        snprintf(root, sizeof(root), "%d", attribution.rootIndex);
+    }
+    
+    printf(
+        "%-24s %6s %12llu %12llu %14.1f %12llu %14.3f\n",
+        name,
+        root,
+        attribution.hydrationCount,
+        attribution.enumerationCount,
+        attribution.hydratedBytes / (1024.0 * 1024.0),
+        attribution.waitCount,
+        attribution.totalWaitNanoseconds / 1000000.0);
+}
@@ -0,0 +1,677 @@
+#include "../PrjFSLib.h"
+#include "../../PrjFSKext/public/PrjFSCommon.h"
+#include <IOKit/IOKitLib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+// prjfs-overhead measures what the kext costs I/O that has nothing to do with
+// virtualization. The kext's kauth listener sees every vnode operation on the
+// machine, so opening, stat-ing and reading a file anywhere goes through it; its
+// early-outs are meant to keep that close to native speed no matter how many
+// roots are registered.
+//
+// The tool creates <files> files of <file size> bytes, <depth> directories below
+// the scratch directory, which must be outside any virtualization root and
+// ideally on APFS. It then measures lstat, open + close and pread of each file
+// with no roots registered and, when the kext is loaded, with one and with
+// --many-roots empty roots, each served by a provider in this process. As with
+// prjfs-stress, the measuring is done by a child process, because the kext
+// treats I/O from a provider's own process differently. One untimed pass warms
+// the vnode and buffer caches before the timed passes.
+//
+// Running it once with the kext loaded and once after unloading it
+// ("sudo kextunload -b io.gvfs.PrjFSKext") gives the native baseline to compare
+// against; the results record which it was.
+
+enum OperationType
+{
+    Operation_Stat,
+    Operation_Open,
+    Operation_Read,
+
+    Operation_Count
+};
+
+struct Options
+{
+    const char* scratchPath;
+    unsigned int fileCount;
+    unsigned long fileSize;
+    unsigned int depth;
+    unsigned int passCount;
+    unsigned int manyRootCount;
+    const char* resultsPath;
+    bool isKextLoaded;
+    // Only for the workload process
+    bool isWorkload;
+    unsigned int rootCount;
+};
+
+static bool ParseOptions(int argc, char* argv[], Options& options);
+static bool IsKextLoaded();
+static bool CreateFiles(const Options& options, vector<string>& filePaths);
+static int RunConfiguration(const Options& options, unsigned int rootCount, char* argv[]);
+static bool StartRoots(const Options& options, unsigned int rootCount, vector<string>& rootPaths, vector<PrjFS_Instance*>& instances);
+static void StopRoots(const vector<string>& rootPaths, const vector<PrjFS_Instance*>& instances);
+static int RunWorkload(const Options& options);
+static bool TimeOperation(OperationType type, const string& path, int fd, vector<char>& buffer, uint64_t* nanoseconds);
+
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName);
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle);
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath);
+
+static void PrintLatencies(const char* name, vector<uint64_t>& latencies);
+static void WriteResult(FILE* resultsFile, const Options& options, const char* benchmark, vector<uint64_t>& latencies);
+static FILE* OpenResultsFile(const char* resultsPath);
+static double PercentileMicroseconds(const vector<uint64_t>& sortedLatencies, double percentile);
+static uint64_t NowNanoseconds();
+
+static const char* OperationNames[Operation_Count] = { "stat", "open", "read" };
+static const unsigned int StopDrainTimeoutMilliseconds = 1000;
+
+static char s_scratchFullPath[PATH_MAX];
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        std::cerr <<
+            "Usage: prjfs-overhead <scratch directory> [--files <count>] [--file-size <bytes>] [--depth <directories>]\n"
+            "                      [--passes <count>] [--many-roots <count>] [--results <path>]\n";
+        return 1;
+    }
+
+    // The library needs full paths for the roots
+    if (nullptr == realpath(options.scratchPath, s_scratchFullPath))
+    {
+        std::cerr << "Failed to resolve " << options.scratchPath << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    options.scratchPath = s_scratchFullPath;
+    if (options.isWorkload)
+    {
+        return RunWorkload(options);
+    }
+
+    struct statfs fileSystem;
+    if (0 == statfs(options.scratchPath, &fileSystem) && 0 != strcmp(fileSystem.f_fstypename, "apfs"))
+    {
+        std::cerr << "Warning: " << options.scratchPath << " is on " << fileSystem.f_fstypename << ", not APFS\n";
+    }
+
+    vector<string> filePaths;
+    if (!CreateFiles(options, filePaths))
+    {
+        return 1;
+    }
+
+    options.isKextLoaded = IsKextLoaded();
+    printf(
+        "Measuring %u files of %lu bytes, %u directories deep, with the kext %s\n",
+        options.fileCount,
+        options.fileSize,
+        options.depth,
+        options.isKextLoaded ? "loaded" : "unloaded");
+    fflush(stdout);
+
+    // Roots can only be registered with the kext loaded
+    vector<unsigned int> rootCounts = { 0 };
+    if (options.isKextLoaded)
+    {
+        rootCounts.push_back(1);
+        if (options.manyRootCount > 1)
+        {
+            rootCounts.push_back(options.manyRootCount);
+        }
+    }
+
+    int exitCode = 0;
+    for (unsigned int rootCount : rootCounts)
+    {
+        exitCode = std::max(exitCode, RunConfiguration(options, rootCount, argv));
+    }
+
+    return exitCode;
+}
+
+static bool ParseOptions(int argc, char* argv[], Options& options)
+{
+    options = Options
+    {
+        nullptr,                        // scratchPath
+        1000,                           // fileCount
+        4096,                           // fileSize
+        4,                              // depth
+        5,                              // passCount
+        64,                             // manyRootCount
+        nullptr,                        // resultsPath
+        false,                          // isKextLoaded
+        false,                          // isWorkload
+        0,                              // rootCount
+    };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (0 == strcmp(argument, "--workload"))
+        {
+            options.isWorkload = true;
+        }
+        else if (0 == strcmp(argument, "--roots") && hasValue)
+        {
+            options.rootCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--kext-loaded"))
+        {
+            options.isKextLoaded = true;
+        }
+        else if (0 == strcmp(argument, "--files") && hasValue)
+        {
+            options.fileCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--file-size") && hasValue)
+        {
+            options.fileSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argument, "--depth") && hasValue)
+        {
+            options.depth = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--passes") && hasValue)
+        {
+            options.passCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--many-roots") && hasValue)
+        {
+            options.manyRootCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--results") && hasValue)
+        {
+            options.resultsPath = argv[++i];
+        }
+        else if (argument[0] != '-' && nullptr == options.scratchPath)
+        {
+            options.scratchPath = argument;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return
+        nullptr != options.scratchPath &&
+        options.fileCount > 0 &&
+        options.fileSize > 0 &&
+        options.passCount > 0;
+}
+
+static bool IsKextLoaded()
+{
+    io_service_t prjfsService = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(PrjFSServiceClass)); // matching dictionary consumed
+    if (IO_OBJECT_NULL == prjfsService)
+    {
+        return false;
+    }
+
+    IOObjectRelease(prjfsService);
+    return true;
+}
+
+// Files left by an earlier run with the same options are reused
+static bool CreateFiles(const Options& options, vector<string>& filePaths)
+{
+    string directoryPath = string(options.scratchPath) + "/files";
+    for (unsigned int level = 0; level <= options.depth; ++level)
+    {
+        if (level > 0)
+        {
+            directoryPath += "/d" + std::to_string(level);
+        }
+
+        if (mkdir(directoryPath.c_str(), 0777) && EEXIST != errno)
+        {
+            std::cerr << "Failed to create " << directoryPath << ": " << strerror(errno) << "\n";
+            return false;
+        }
+    }
+
+    vector<char> contents(options.fileSize, 'x');
+    for (unsigned int i = 0; i < options.fileCount; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/file%05u", i);
+        string path = directoryPath + name;
+
+        struct stat attributes;
+        if (0 == stat(path.c_str(), &attributes) && static_cast<unsigned long>(attributes.st_size) == options.fileSize)
+        {
+            filePaths.push_back(path);
+            continue;
+        }
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = fd >= 0 && static_cast<ssize_t>(contents.size()) == write(fd, contents.data(), contents.size());
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        if (!written)
+        {
+            std::cerr << "Failed to write " << path << ": " << strerror(errno) << "\n";
+            return false;
+        }
+
+        filePaths.push_back(path);
+    }
+
+    return true;
+}
+
+static int RunConfiguration(const Options& options, unsigned int rootCount, char* argv[])
+{
+    vector<string> rootPaths;
+    vector<PrjFS_Instance*> instances;
+    if (!StartRoots(options, rootCount, rootPaths, instances))
+    {
+        StopRoots(rootPaths, instances);
+        return 1;
+    }
+
+    vector<char*> workloadArguments;
+    for (char** argument = argv; nullptr != *argument; ++argument)
+    {
+        workloadArguments.push_back(*argument);
+    }
+
+    char workloadFlag[] = "--workload";
+    char rootsFlag[] = "--roots";
+    char kextLoadedFlag[] = "--kext-loaded";
+    string rootCountString = std::to_string(rootCount);
+    workloadArguments.push_back(workloadFlag);
+    workloadArguments.push_back(rootsFlag);
+    workloadArguments.push_back(&rootCountString[0]);
+    if (options.isKextLoaded)
+    {
+        workloadArguments.push_back(kextLoadedFlag);
+    }
+
+    workloadArguments.push_back(nullptr);
+
+    pid_t workloadPid;
+    int workloadStatus = 1;
+    int error = posix_spawnp(&workloadPid, argv[0], nullptr, nullptr, workloadArguments.data(), environ);
+    if (0 != error)
+    {
+        std::cerr << "Failed to start the workload process: " << strerror(error) << "\n";
+    }
+    else
+    {
+        while (-1 == waitpid(workloadPid, &workloadStatus, 0) && EINTR == errno)
+        {
+        }
+    }
+
+    StopRoots(rootPaths, instances);
+    if (0 != error || !WIFEXITED(workloadStatus))
+    {
+        return 1;
+    }
+
+    return WEXITSTATUS(workloadStatus);
+}
+
+// The roots are empty and nothing accesses them; they only have to be registered
+// with the kext for it to consider them when it looks up the root of a vnode
+static bool StartRoots(const Options& options, unsigned int rootCount, vector<string>& rootPaths, vector<PrjFS_Instance*>& instances)
+{
+    if (0 == rootCount)
+    {
+        return true;
+    }
+
+    string rootsPath = string(options.scratchPath) + "/roots.XXXXXX";
+    if (nullptr == mkdtemp(&rootsPath[0]))
+    {
+        std::cerr << "Failed to create a directory for the roots: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    rootPaths.push_back(rootsPath);
+
+    PrjFS_Callbacks callbacks = { EnumerateDirectoryCallback, GetFileStreamCallback, NotifyOperationCallback };
+    for (unsigned int i = 0; i < rootCount; ++i)
+    {
+        string rootPath = rootsPath + "/root" + std::to_string(i);
+        if (mkdir(rootPath.c_str(), 0777))
+        {
+            std::cerr << "Failed to create " << rootPath << ": " << strerror(errno) << "\n";
+            return false;
+        }
+
+        rootPaths.push_back(rootPath);
+
+        PrjFS_Instance* instance;
+        PrjFS_Result result = PrjFS_ConvertDirectoryToVirtualizationRoot(rootPath.c_str());
+        if (PrjFS_Result_Success == result)
+        {
+            result = PrjFS_StartVirtualizationInstance(rootPath.c_str(), callbacks, 1, PrjFS_InstanceFlags_None, &instance);
+        }
+
+        if (PrjFS_Result_Success != result)
+        {
+            std::cerr << "Failed to start a virtualization instance for " << rootPath << ": 0x" << std::hex << result << std::dec << "\n";
+            return false;
+        }
+
+        instances.push_back(instance);
+    }
+
+    return true;
+}
+
+// Removes the roots, and the directory they are in, after the instances are stopped
+static void StopRoots(const vector<string>& rootPaths, const vector<PrjFS_Instance*>& instances)
+{
+    for (PrjFS_Instance* instance : instances)
+    {
+        PrjFS_StopVirtualizationInstance(instance, StopDrainTimeoutMilliseconds);
+    }
+
+    for (vector<string>::const_reverse_iterator rootPath = rootPaths.rbegin(); rootPath != rootPaths.rend(); ++rootPath)
+    {
+        rmdir((*rootPath + "/" PrjFS_TempDirectoryName).c_str());
+        rmdir(rootPath->c_str());
+    }
+}
+
+static int RunWorkload(const Options& options)
+{
+    vector<string> filePaths;
+    if (!CreateFiles(options, filePaths))
+    {
+        return 1;
+    }
+
+    // read is measured on a descriptor opened outside the timing, so that it covers only
+    // the read itself
+    vector<int> fds;
+    for (const string& path : filePaths)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << "\n";
+            for (int openFd : fds)
+            {
+                close(openFd);
+            }
+
+            return 1;
+        }
+
+        fds.push_back(fd);
+    }
+
+    vector<char> buffer(options.fileSize);
+    vector<uint64_t> latencies[Operation_Count];
+    uint64_t failedOperationCount = 0;
+    for (unsigned int pass = 0; pass <= options.passCount; ++pass)
+    {
+        // Pass 0 only warms up the caches
+        for (size_t i = 0; i < filePaths.size(); ++i)
+        {
+            for (int type = 0; type < Operation_Count; ++type)
+            {
+                uint64_t nanoseconds;
+                if (!TimeOperation(static_cast<OperationType>(type), filePaths[i], fds[i], buffer, &nanoseconds))
+                {
+                    failedOperationCount++;
+                }
+                else if (pass > 0)
+                {
+                    latencies[type].push_back(nanoseconds);
+                }
+            }
+        }
+    }
+
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+
+    printf(
+        "=== %u root%s (%u passes, %llu failed operations) ===\n",
+        options.rootCount,
+        1 == options.rootCount ? "" : "s",
+        options.passCount,
+        failedOperationCount);
+    for (int type = 0; type < Operation_Count; ++type)
+    {
+        PrintLatencies(OperationNames[type], latencies[type]);
+    }
+
+    FILE* resultsFile = OpenResultsFile(options.resultsPath);
+    if (nullptr != resultsFile)
+    {
+        for (int type = 0; type < Operation_Count; ++type)
+        {
+            WriteResult(resultsFile, options, OperationNames[type], latencies[type]);
+        }
+
+        fclose(resultsFile);
+    }
+
+    return 0 == failedOperationCount ? 0 : 1;
+}
+
+static bool TimeOperation(OperationType type, const string& path, int fd, vector<char>& buffer, uint64_t* nanoseconds)
+{
+    bool succeeded = false;
+    uint64_t startNanoseconds = NowNanoseconds();
+    switch (type)
+    {
+        case Operation_Stat:
+        {
+            struct stat attributes;
+            succeeded = 0 == lstat(path.c_str(), &attributes);
+            break;
+        }
+
+        case Operation_Open:
+        {
+            int openedFd = open(path.c_str(), O_RDONLY);
+            if (openedFd >= 0)
+            {
+                close(openedFd);
+                succeeded = true;
+            }
+
+            break;
+        }
+
+        case Operation_Read:
+            succeeded = static_cast<ssize_t>(buffer.size()) == pread(fd, buffer.data(), buffer.size(), 0);
+            break;
+
+        default:
+            break;
+    }
+
+    *nanoseconds = NowNanoseconds() - startNanoseconds;
+    return succeeded;
+}
+
+// Nothing ever accesses the roots, so the callbacks have nothing to do
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName)
+{
+    return PrjFS_Result_Success;
+}
+
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle)
+{
+    return PrjFS_Result_Success;
+}
+
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath)
+{
+    return PrjFS_Result_Success;
+}
+
+// Sorts latencies
+static void PrintLatencies(const char* name, vector<uint64_t>& latencies)
+{
+    if (latencies.empty())
+    {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t nanoseconds : latencies)
+    {
+        totalNanoseconds += nanoseconds;
+    }
+
+    printf(
+        "%-6s n=%-9zu mean=%9.3f p50=%9.3f p95=%9.3f p99=%9.3f max=%9.3f us\n",
+        name,
+        latencies.size(),
+        totalNanoseconds / 1e3 / latencies.size(),
+        PercentileMicroseconds(latencies, 0.50),
+        PercentileMicroseconds(latencies, 0.95),
+        PercentileMicroseconds(latencies, 0.99),
+        latencies.back() / 1e3);
+    fflush(stdout);
+}
+
+// Appends one JSON result, in the form the GVFS functional tests' BenchmarkRegressionGate
+// compares against a baseline. Sorts latencies.
+static void WriteResult(FILE* resultsFile, const Options& options, const char* benchmark, vector<uint64_t>& latencies)
+{
+    if (latencies.empty())
+    {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t nanoseconds : latencies)
+    {
+        totalNanoseconds += nanoseconds;
+    }
+
+    fprintf(
+        resultsFile,
+        "{\"suite\":\"PrjFSOverhead\",\"benchmark\":\"%s\",\"kext\":\"%s\",\"roots\":%u,\"files\":%u,\"fileSize\":%lu,\"depth\":%u,"
+        "\"operations\":%zu,\"wallMs\":%.3f,\"meanUs\":%.3f,\"p50Us\":%.3f,\"p95Us\":%.3f,\"p99Us\":%.3f,\"maxUs\":%.3f}\n",
+        benchmark,
+        options.isKextLoaded ? "loaded" : "unloaded",
+        options.rootCount,
+        options.fileCount,
+        options.fileSize,
+        options.depth,
+        latencies.size(),
+        totalNanoseconds / 1e6,
+        totalNanoseconds / 1e3 / latencies.size(),
+        PercentileMicroseconds(latencies, 0.50),
+        PercentileMicroseconds(latencies, 0.95),
+        PercentileMicroseconds(latencies, 0.99),
+        latencies.back() / 1e3);
+}
+
+static FILE* OpenResultsFile(const char* resultsPath)
+{
+    if (nullptr == resultsPath)
+    {
+        return nullptr;
+    }
+
+    FILE* resultsFile = fopen(resultsPath, "a");
+    if (nullptr == resultsFile)
+    {
+        std::cerr << "Failed to open " << resultsPath << ": " << strerror(errno) << "\n";
+    }
+
+    return resultsFile;
+}
+
+// Nearest-rank percentile
+static double PercentileMicroseconds(const vector<uint64_t>& sortedLatencies, double percentile)
+{
+    size_t rank = static_cast<size_t>(percentile * sortedLatencies.size() + 0.5);
+    size_t index = rank == 0 ? 0 : std::min(rank - 1, sortedLatencies.size() - 1);
+    return sortedLatencies[index] / 1000.0;
+}
+
+static uint64_t NowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
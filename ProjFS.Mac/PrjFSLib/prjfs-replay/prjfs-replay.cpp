@@ -0,0 +1,900 @@
+#include "../PrjFSLib.h"
+#include "../../PrjFSKext/public/Message.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+// prjfs-replay registers itself as the provider for an empty directory and
+// replays a recorded file access trace against it, so that changes to the kext
+// and the library can be compared on a realistic, reproducible workload. The
+// trace is either:
+//
+// access profile -> Written by PrjFS_StartAccessRecording, e.g. during a build
+//                   in an enlistment
+// fs_usage       -> Text captured with "fs_usage -w -f filesys <process>" during
+//                   e.g. xcodebuild or git status; --fs-usage gives the path the
+//                   captured enlistment was at, accesses outside it are ignored
+//
+// The provider projects the smallest tree that contains every path in the trace:
+// a path is a directory if the trace enumerates it or anything below it,
+// otherwise a file of --file-size bytes. As with prjfs-stress, the accesses are
+// made by a child process, because the kext never calls back into the provider
+// for I/O issued by the provider's own process. The child replays them in trace
+// order on one thread, as fast as it can or with the recorded gaps (--realtime),
+// and reports the wall time and how it splits between enumerating directories,
+// opening (and so hydrating) files and looking them up. The provider reports the
+// time its enumeration and hydration callbacks took.
+
+enum TraceFormat
+{
+    TraceFormat_AccessProfile,
+    TraceFormat_FsUsage,
+};
+
+enum AccessType
+{
+    Access_Enumerate,
+    Access_Read,
+    Access_Stat,
+
+    Access_Count
+};
+
+struct TraceAccess
+{
+    AccessType type;
+    uint32_t microsecondsSincePreviousAccess;
+    string relativePath;
+};
+
+struct Options
+{
+    const char* rootPath;
+    const char* tracePath;
+    TraceFormat traceFormat;
+    // Only for TraceFormat_FsUsage
+    const char* capturedRootPath;
+    unsigned long fileSize;
+    unsigned int poolThreadCount;
+    unsigned int providerDelayMicroseconds;
+    const char* resultsPath;
+    bool isRealtime;
+    bool isWorkload;
+};
+
+// Layout of the access profiles PrjFS_StartAccessRecording writes, see PrjFSLib.cpp
+struct AccessProfileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct AccessProfileRecord
+{
+    uint32_t microsecondsSincePreviousRecord;
+    uint16_t pathLength;
+    uint8_t  messageType;
+    uint8_t  reserved;
+};
+
+// Entries of each projected directory, by name, and whether they are directories
+typedef std::map<string, std::map<string, bool>> ProjectedTree;
+
+struct Latencies
+{
+    std::mutex mutex;
+    vector<uint64_t> nanoseconds;
+};
+
+static bool ParseOptions(int argc, char* argv[], Options& options);
+static bool ReadAccessProfile(const char* profilePath, vector<TraceAccess>& accesses);
+static bool ReadFsUsageCapture(const char* capturePath, const char* capturedRootPath, vector<TraceAccess>& accesses);
+static bool ParseFsUsageTimestamp(const string& token, uint64_t* microseconds);
+static void BuildProjectedTree(vector<TraceAccess>& accesses, ProjectedTree& tree);
+static int RunProvider(const Options& options, char* argv[]);
+static int RunWorkload(const Options& options, const vector<TraceAccess>& accesses);
+
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName);
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle);
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath);
+
+static void RecordLatency(Latencies& latencies, uint64_t nanoseconds);
+static void PrintLatencies(const char* name, vector<uint64_t>& latencies, uint64_t wallNanoseconds);
+static void WriteResult(FILE* resultsFile, const char* benchmark, vector<uint64_t>& latencies, uint64_t wallNanoseconds);
+static FILE* OpenResultsFile(const char* resultsPath);
+static double PercentileMicroseconds(const vector<uint64_t>& sortedLatencies, double percentile);
+static uint64_t NowNanoseconds();
+
+static const char* AccessNames[Access_Count] = { "readdir", "open", "stat" };
+static const uint32_t AccessProfileMagic = 0x50414650; // "PFAP"
+static const uint32_t AccessProfileVersion = 1;
+static const unsigned int StopDrainTimeoutMilliseconds = 1000;
+
+static Options s_options;
+static char s_rootFullPath[PATH_MAX];
+static vector<TraceAccess> s_accesses;
+static ProjectedTree s_tree;
+static PrjFS_Instance* s_instance = nullptr;
+
+// Provider side measurements, updated from the library's worker threads
+static Latencies s_enumerationLatencies;
+static Latencies s_hydrationLatencies;
+static std::atomic<uint64_t> s_placeholderCount(0);
+static std::atomic<uint64_t> s_failedCallbackCount(0);
+
+int main(int argc, char* argv[])
+{
+    if (!ParseOptions(argc, argv, s_options))
+    {
+        std::cerr <<
+            "Usage: prjfs-replay <empty directory> <trace> [--fs-usage <captured root path>] [--file-size <bytes>]\n"
+            "                    [--pool-threads <count>] [--provider-delay-us <microseconds>] [--realtime]\n"
+            "                    [--results <path>]\n";
+        return 1;
+    }
+
+    // The library needs the full path of the root
+    if (nullptr == realpath(s_options.rootPath, s_rootFullPath))
+    {
+        std::cerr << "Failed to resolve " << s_options.rootPath << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    s_options.rootPath = s_rootFullPath;
+
+    // Both processes read the trace, the provider to know the tree and the workload to replay it
+    bool traceRead =
+        TraceFormat_AccessProfile == s_options.traceFormat ?
+        ReadAccessProfile(s_options.tracePath, s_accesses) :
+        ReadFsUsageCapture(s_options.tracePath, s_options.capturedRootPath, s_accesses);
+    if (!traceRead)
+    {
+        std::cerr << "Failed to read the trace " << s_options.tracePath << "\n";
+        return 1;
+    }
+
+    BuildProjectedTree(s_accesses, s_tree);
+    return s_options.isWorkload ? RunWorkload(s_options, s_accesses) : RunProvider(s_options, argv);
+}
+
+static bool ParseOptions(int argc, char* argv[], Options& options)
+{
+    options = Options
+    {
+        nullptr,                        // rootPath
+        nullptr,                        // tracePath
+        TraceFormat_AccessProfile,      // traceFormat
+        nullptr,                        // capturedRootPath
+        4096,                           // fileSize
+        8,                              // poolThreadCount
+        0,                              // providerDelayMicroseconds
+        nullptr,                        // resultsPath
+        false,                          // isRealtime
+        false,                          // isWorkload
+    };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (0 == strcmp(argument, "--workload"))
+        {
+            options.isWorkload = true;
+        }
+        else if (0 == strcmp(argument, "--fs-usage") && hasValue)
+        {
+            options.traceFormat = TraceFormat_FsUsage;
+            options.capturedRootPath = argv[++i];
+        }
+        else if (0 == strcmp(argument, "--file-size") && hasValue)
+        {
+            options.fileSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argument, "--pool-threads") && hasValue)
+        {
+            options.poolThreadCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--provider-delay-us") && hasValue)
+        {
+            options.providerDelayMicroseconds = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--results") && hasValue)
+        {
+            options.resultsPath = argv[++i];
+        }
+        else if (0 == strcmp(argument, "--realtime"))
+        {
+            options.isRealtime = true;
+        }
+        else if (argument[0] != '-' && nullptr == options.rootPath)
+        {
+            options.rootPath = argument;
+        }
+        else if (argument[0] != '-' && nullptr == options.tracePath)
+        {
+            options.tracePath = argument;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return
+        nullptr != options.rootPath &&
+        nullptr != options.tracePath &&
+        options.poolThreadCount > 0;
+}
+
+static bool ReadAccessProfile(const char* profilePath, vector<TraceAccess>& accesses)
+{
+    std::ifstream profile(profilePath, std::ios::binary);
+    AccessProfileHeader header;
+    if (!profile.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        AccessProfileMagic != header.magic ||
+        AccessProfileVersion != header.version)
+    {
+        return false;
+    }
+
+    AccessProfileRecord record;
+    while (profile.read(reinterpret_cast<char*>(&record), sizeof(record)))
+    {
+        string relativePath(record.pathLength, '\0');
+        if (!profile.read(&relativePath[0], record.pathLength))
+        {
+            return false;
+        }
+
+        if (MessageType_KtoU_EnumerateDirectory != record.messageType && MessageType_KtoU_HydrateFile != record.messageType)
+        {
+            continue;
+        }
+
+        accesses.push_back(TraceAccess
+        {
+            MessageType_KtoU_EnumerateDirectory == record.messageType ? Access_Enumerate : Access_Read,
+            record.microsecondsSincePreviousRecord,
+            relativePath,
+        });
+    }
+
+    // A partial record at the end means the profile was cut short
+    return profile.eof() && 0 == profile.gcount();
+}
+
+// fs_usage -w prints one line per call: the time, the call, its arguments (file
+// descriptors, flags), the path if it has one, the time it took and the process.
+// Paths are followed by at least two spaces, failed calls have their errno in
+// brackets before the path. Calls on file descriptors alone,
+// such as getdirentries64, have no path, so directories are enumerated where the
+// capture opened them.
+static bool ReadFsUsageCapture(const char* capturePath, const char* capturedRootPath, vector<TraceAccess>& accesses)
+{
+    std::ifstream capture(capturePath);
+    if (!capture)
+    {
+        return false;
+    }
+
+    static const char* const OpenCalls[] = { "open", "open_nocancel", "openat", "openat_nocancel", "open_dprotected_np" };
+    static const char* const StatCalls[] = { "stat", "stat64", "lstat", "lstat64", "fstatat", "fstatat64", "getattrlist", "access" };
+
+    string capturedRoot(capturedRootPath);
+    while (!capturedRoot.empty() && '/' == capturedRoot.back())
+    {
+        capturedRoot.pop_back();
+    }
+
+    bool hasPreviousTimestamp = false;
+    uint64_t previousMicroseconds = 0;
+    string line;
+    while (std::getline(capture, line))
+    {
+        size_t tokenStart = line.find_first_not_of(' ');
+        size_t tokenEnd = line.find(' ', tokenStart);
+        if (string::npos == tokenStart || string::npos == tokenEnd)
+        {
+            continue;
+        }
+
+        string call = line.substr(tokenStart, tokenEnd - tokenStart);
+        uint64_t microseconds = 0;
+        bool hasTimestamp = ParseFsUsageTimestamp(call, &microseconds);
+        if (hasTimestamp)
+        {
+            tokenStart = line.find_first_not_of(' ', tokenEnd);
+            tokenEnd = line.find(' ', tokenStart);
+            if (string::npos == tokenStart || string::npos == tokenEnd)
+            {
+                continue;
+            }
+
+            call = line.substr(tokenStart, tokenEnd - tokenStart);
+        }
+
+        AccessType type;
+        if (std::find(std::begin(OpenCalls), std::end(OpenCalls), call) != std::end(OpenCalls))
+        {
+            type = Access_Read;
+        }
+        else if (std::find(std::begin(StatCalls), std::end(StatCalls), call) != std::end(StatCalls))
+        {
+            type = Access_Stat;
+        }
+        else
+        {
+            continue;
+        }
+
+        size_t pathStart = line.find(capturedRoot, tokenEnd);
+        if (string::npos == pathStart)
+        {
+            continue;
+        }
+
+        // Failed calls show their errno in brackets before the path. Lookups of paths
+        // that don't exist would otherwise be projected as files.
+        if (string::npos != line.find('[', tokenEnd) && line.find('[', tokenEnd) < pathStart)
+        {
+            continue;
+        }
+
+        size_t pathEnd = line.find("  ", pathStart);
+        string path = line.substr(pathStart, string::npos == pathEnd ? string::npos : pathEnd - pathStart);
+        while (!path.empty() && ' ' == path.back())
+        {
+            path.pop_back();
+        }
+
+        string relativePath;
+        if (path.size() > capturedRoot.size())
+        {
+            if ('/' != path[capturedRoot.size()])
+            {
+                // A sibling of the root whose name starts with the root's
+                continue;
+            }
+
+            relativePath = path.substr(capturedRoot.size() + 1);
+        }
+
+        // Midnight in the middle of the capture only costs one gap
+        uint32_t gapMicroseconds = 0;
+        if (hasTimestamp)
+        {
+            if (hasPreviousTimestamp && microseconds >= previousMicroseconds)
+            {
+                gapMicroseconds = static_cast<uint32_t>(std::min<uint64_t>(microseconds - previousMicroseconds, UINT32_MAX));
+            }
+
+            hasPreviousTimestamp = true;
+            previousMicroseconds = microseconds;
+        }
+
+        accesses.push_back(TraceAccess { type, gapMicroseconds, relativePath });
+    }
+
+    return true;
+}
+
+// HH:MM:SS or HH:MM:SS.ffffff
+static bool ParseFsUsageTimestamp(const string& token, uint64_t* microseconds)
+{
+    unsigned int hours;
+    unsigned int minutes;
+    unsigned int seconds;
+    int fractionStart = 0;
+    int fractionEnd = 0;
+    if (3 != sscanf(token.c_str(), "%2u:%2u:%2u%n.%*u%n", &hours, &minutes, &seconds, &fractionStart, &fractionEnd))
+    {
+        return false;
+    }
+
+    uint64_t fraction = 0;
+    int fractionDigits = fractionEnd > fractionStart ? fractionEnd - fractionStart - 1 : 0;
+    for (int i = 0; i < 6; ++i)
+    {
+        char digit = i < fractionDigits ? token[fractionStart + 1 + i] : '0';
+        fraction = fraction * 10 + (digit - '0');
+    }
+
+    *microseconds = ((hours * 60 + minutes) * 60 + seconds) * 1000000ULL + fraction;
+    return true;
+}
+
+// Also turns the opens of paths that turned out to be directories into enumerations
+static void BuildProjectedTree(vector<TraceAccess>& accesses, ProjectedTree& tree)
+{
+    tree[""];
+    for (const TraceAccess& access : accesses)
+    {
+        string path = access.relativePath;
+        bool isDirectory = Access_Enumerate == access.type;
+        while (!path.empty())
+        {
+            size_t separator = path.rfind('/');
+            string parent = string::npos == separator ? "" : path.substr(0, separator);
+            string name = string::npos == separator ? path : path.substr(separator + 1);
+
+            bool& entryIsDirectory = tree[parent][name];
+            entryIsDirectory = entryIsDirectory || isDirectory;
+            if (isDirectory)
+            {
+                tree[path];
+            }
+
+            path = parent;
+            isDirectory = true;
+        }
+    }
+
+    for (TraceAccess& access : accesses)
+    {
+        if (Access_Read == access.type && tree.end() != tree.find(access.relativePath))
+        {
+            access.type = Access_Enumerate;
+        }
+    }
+}
+
+static int RunProvider(const Options& options, char* argv[])
+{
+    PrjFS_Result result = PrjFS_ConvertDirectoryToVirtualizationRoot(options.rootPath);
+    if (PrjFS_Result_Success != result)
+    {
+        std::cerr << "Failed to convert " << options.rootPath << " to a virtualization root: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+
+    PrjFS_Callbacks callbacks = { EnumerateDirectoryCallback, GetFileStreamCallback, NotifyOperationCallback };
+    result = PrjFS_StartVirtualizationInstance(
+        options.rootPath,
+        callbacks,
+        options.poolThreadCount,
+        PrjFS_InstanceFlags_None,
+        &s_instance);
+    if (PrjFS_Result_Success != result)
+    {
+        std::cerr << "Failed to start virtualization instance: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+
+    size_t fileCount = 0;
+    for (const ProjectedTree::value_type& directory : s_tree)
+    {
+        for (const std::map<string, bool>::value_type& entry : directory.second)
+        {
+            fileCount += entry.second ? 0 : 1;
+        }
+    }
+
+    printf("Replaying %zu accesses against %zu directories and %zu files\n", s_accesses.size(), s_tree.size(), fileCount);
+    fflush(stdout);
+
+    // The child gets the same arguments, so that both sides read the same trace
+    vector<char*> workloadArguments;
+    for (char** argument = argv; nullptr != *argument; ++argument)
+    {
+        workloadArguments.push_back(*argument);
+    }
+
+    char workloadFlag[] = "--workload";
+    workloadArguments.push_back(workloadFlag);
+    workloadArguments.push_back(nullptr);
+
+    uint64_t startNanoseconds = NowNanoseconds();
+    pid_t workloadPid;
+    int workloadStatus = 1;
+    int error = posix_spawnp(&workloadPid, argv[0], nullptr, nullptr, workloadArguments.data(), environ);
+    if (0 != error)
+    {
+        std::cerr << "Failed to start the workload process: " << strerror(error) << "\n";
+    }
+    else
+    {
+        while (-1 == waitpid(workloadPid, &workloadStatus, 0) && EINTR == errno)
+        {
+        }
+    }
+
+    uint64_t elapsedNanoseconds = NowNanoseconds() - startNanoseconds;
+    PrjFS_StopVirtualizationInstance(s_instance, StopDrainTimeoutMilliseconds);
+
+    // The workload has exited, so the callbacks are done with the latencies
+    printf("=== Provider (%.3f s) ===\n", elapsedNanoseconds / 1e9);
+    printf(
+        "placeholders written %llu, failed callbacks %llu\n",
+        s_placeholderCount.load(),
+        s_failedCallbackCount.load());
+    PrintLatencies("enumerate", s_enumerationLatencies.nanoseconds, elapsedNanoseconds);
+    PrintLatencies("hydrate", s_hydrationLatencies.nanoseconds, elapsedNanoseconds);
+
+    FILE* resultsFile = OpenResultsFile(options.resultsPath);
+    if (nullptr != resultsFile)
+    {
+        WriteResult(resultsFile, "enumerate_callback", s_enumerationLatencies.nanoseconds, 0);
+        WriteResult(resultsFile, "hydrate_callback", s_hydrationLatencies.nanoseconds, 0);
+        fclose(resultsFile);
+    }
+
+    if (0 != error || !WIFEXITED(workloadStatus))
+    {
+        return 1;
+    }
+
+    return WEXITSTATUS(workloadStatus);
+}
+
+static int RunWorkload(const Options& options, const vector<TraceAccess>& accesses)
+{
+    vector<uint64_t> latencies[Access_Count];
+    uint64_t failedAccessCount = 0;
+    string rootPath(options.rootPath);
+
+    uint64_t startNanoseconds = NowNanoseconds();
+    for (const TraceAccess& access : accesses)
+    {
+        if (options.isRealtime && access.microsecondsSincePreviousAccess > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(access.microsecondsSincePreviousAccess));
+        }
+
+        string path = access.relativePath.empty() ? rootPath : rootPath + "/" + access.relativePath;
+        bool succeeded = false;
+        uint64_t accessStartNanoseconds = NowNanoseconds();
+        switch (access.type)
+        {
+            case Access_Enumerate:
+            {
+                DIR* directory = opendir(path.c_str());
+                if (nullptr != directory)
+                {
+                    while (nullptr != readdir(directory))
+                    {
+                    }
+
+                    closedir(directory);
+                    succeeded = true;
+                }
+
+                break;
+            }
+
+            case Access_Read:
+            {
+                // Reading a byte makes sure the whole open -> hydrate path is measured
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd >= 0)
+                {
+                    char byte;
+                    succeeded = read(fd, &byte, 1) >= 0;
+                    close(fd);
+                }
+
+                break;
+            }
+
+            case Access_Stat:
+            {
+                struct stat attributes;
+                succeeded = 0 == lstat(path.c_str(), &attributes);
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        latencies[access.type].push_back(NowNanoseconds() - accessStartNanoseconds);
+        if (!succeeded)
+        {
+            failedAccessCount++;
+        }
+    }
+
+    uint64_t wallNanoseconds = NowNanoseconds() - startNanoseconds;
+
+    printf(
+        "=== Replay (%.3f s, %zu accesses%s, %llu failed) ===\n",
+        wallNanoseconds / 1e9,
+        accesses.size(),
+        options.isRealtime ? ", with recorded gaps" : "",
+        failedAccessCount);
+    for (int type = 0; type < Access_Count; ++type)
+    {
+        PrintLatencies(AccessNames[type], latencies[type], wallNanoseconds);
+    }
+
+    FILE* resultsFile = OpenResultsFile(options.resultsPath);
+    if (nullptr != resultsFile)
+    {
+        vector<uint64_t> noLatencies;
+        WriteResult(resultsFile, "replay", noLatencies, wallNanoseconds);
+        for (int type = 0; type < Access_Count; ++type)
+        {
+            WriteResult(resultsFile, AccessNames[type], latencies[type], 0);
+        }
+
+        fclose(resultsFile);
+    }
+
+    return 0;
+}
+
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName)
+{
+    uint64_t startNanoseconds = NowNanoseconds();
+
+    bool isRoot = '\0' == relativePath[0] || 0 == strcmp(relativePath, ".");
+    ProjectedTree::const_iterator directory = s_tree.find(isRoot ? "" : relativePath);
+    if (s_tree.end() == directory)
+    {
+        // Not in the trace, so nothing will look inside it
+        RecordLatency(s_enumerationLatencies, NowNanoseconds() - startNanoseconds);
+        return PrjFS_Result_Success;
+    }
+
+    unsigned char fileProviderId[PrjFS_PlaceholderIdLength] = {};
+    unsigned char fileContentId[PrjFS_PlaceholderIdLength] = {};
+    vector<PrjFS_PlaceholderEntry> entries;
+    entries.reserve(directory->second.size());
+    for (const std::map<string, bool>::value_type& entry : directory->second)
+    {
+        entries.push_back(PrjFS_PlaceholderEntry
+        {
+            entry.first.c_str(),
+            entry.second,
+            fileProviderId,
+            fileContentId,
+            s_options.fileSize,
+            0644,
+        });
+    }
+
+    PrjFS_Result result = PrjFS_Result_Success;
+    if (!entries.empty())
+    {
+        result = PrjFS_WritePlaceholderBatch(
+            s_instance,
+            isRoot ? "" : relativePath,
+            entries.data(),
+            static_cast<unsigned int>(entries.size()),
+            nullptr);
+    }
+
+    RecordLatency(s_enumerationLatencies, NowNanoseconds() - startNanoseconds);
+    if (PrjFS_Result_Success != result)
+    {
+        s_failedCallbackCount++;
+        return result;
+    }
+
+    s_placeholderCount += entries.size();
+    return PrjFS_Result_Success;
+}
+
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle)
+{
+    uint64_t startNanoseconds = NowNanoseconds();
+    if (s_options.providerDelayMicroseconds > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(s_options.providerDelayMicroseconds));
+    }
+
+    static const unsigned int ChunkSize = 64 * 1024;
+    static const vector<char> chunk(ChunkSize, 'x');
+
+    PrjFS_Result result = PrjFS_Result_Success;
+    for (unsigned long remaining = s_options.fileSize; remaining > 0 && PrjFS_Result_Success == result; )
+    {
+        unsigned int byteCount = static_cast<unsigned int>(std::min<unsigned long>(remaining, ChunkSize));
+        result = PrjFS_WriteFileContents(fileHandle, chunk.data(), byteCount);
+        remaining -= byteCount;
+    }
+
+    RecordLatency(s_hydrationLatencies, NowNanoseconds() - startNanoseconds);
+    if (PrjFS_Result_Success != result)
+    {
+        s_failedCallbackCount++;
+    }
+
+    return result;
+}
+
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath)
+{
+    return PrjFS_Result_Success;
+}
+
+static void RecordLatency(Latencies& latencies, uint64_t nanoseconds)
+{
+    std::lock_guard<std::mutex> lock(latencies.mutex);
+    latencies.nanoseconds.push_back(nanoseconds);
+}
+
+// Sorts latencies
+static void PrintLatencies(const char* name, vector<uint64_t>& latencies, uint64_t wallNanoseconds)
+{
+    if (latencies.empty())
+    {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t nanoseconds : latencies)
+    {
+        totalNanoseconds += nanoseconds;
+    }
+
+    printf(
+        "%-10s n=%-9zu total=%10.3f ms (%5.1f%% of wall) p50=%9.3f p95=%9.3f p99=%9.3f max=%9.3f ms\n",
+        name,
+        latencies.size(),
+        totalNanoseconds / 1e6,
+        wallNanoseconds > 0 ? totalNanoseconds * 100.0 / wallNanoseconds : 0.0,
+        PercentileMicroseconds(latencies, 0.50) / 1000,
+        PercentileMicroseconds(latencies, 0.95) / 1000,
+        PercentileMicroseconds(latencies, 0.99) / 1000,
+        latencies.back() / 1e6);
+    fflush(stdout);
+}
+
+// Appends one JSON result, in the form the GVFS functional tests' BenchmarkRegressionGate
+// compares against a baseline. With latencies, wallMs is their sum; without, it is
+// wallNanoseconds for the whole trace and the result has no latency members.
+static void WriteResult(FILE* resultsFile, const char* benchmark, vector<uint64_t>& latencies, uint64_t wallNanoseconds)
+{
+    const char* traceName = strrchr(s_options.tracePath, '/');
+    traceName = nullptr == traceName ? s_options.tracePath : traceName + 1;
+
+    string parameters = "\"trace\":\"";
+    for (const char* c = traceName; '\0' != *c; ++c)
+    {
+        if ('"' == *c || '\\' == *c)
+        {
+            parameters += '\\';
+        }
+
+        parameters += *c;
+    }
+
+    char numericParameters[128];
+    snprintf(
+        numericParameters,
+        sizeof(numericParameters),
+        "\",\"fileSize\":%lu,\"providerDelayUs\":%u,\"realtime\":%s",
+        s_options.fileSize,
+        s_options.providerDelayMicroseconds,
+        s_options.isRealtime ? "true" : "false");
+    parameters += numericParameters;
+
+    if (latencies.empty())
+    {
+        fprintf(
+            resultsFile,
+            "{\"suite\":\"PrjFSReplay\",\"benchmark\":\"%s\",%s,\"operations\":%zu,\"wallMs\":%.3f}\n",
+            benchmark,
+            parameters.c_str(),
+            s_accesses.size(),
+            wallNanoseconds / 1e6);
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t totalNanoseconds = 0;
+    for (uint64_t nanoseconds : latencies)
+    {
+        totalNanoseconds += nanoseconds;
+    }
+
+    fprintf(
+        resultsFile,
+        "{\"suite\":\"PrjFSReplay\",\"benchmark\":\"%s\",%s,\"operations\":%zu,\"wallMs\":%.3f,"
+        "\"meanUs\":%.3f,\"p50Us\":%.3f,\"p95Us\":%.3f,\"p99Us\":%.3f,\"maxUs\":%.3f}\n",
+        benchmark,
+        parameters.c_str(),
+        latencies.size(),
+        totalNanoseconds / 1e6,
+        totalNanoseconds / 1e3 / latencies.size(),
+        PercentileMicroseconds(latencies, 0.50),
+        PercentileMicroseconds(latencies, 0.95),
+        PercentileMicroseconds(latencies, 0.99),
+        latencies.back() / 1e3);
+}
+
+static FILE* OpenResultsFile(const char* resultsPath)
+{
+    if (nullptr == resultsPath)
+    {
+        return nullptr;
+    }
+
+    FILE* resultsFile = fopen(resultsPath, "a");
+    if (nullptr == resultsFile)
+    {
+        std::cerr << "Failed to open " << resultsPath << ": " << strerror(errno) << "\n";
+    }
+
+    return resultsFile;
+}
+
+// Nearest-rank percentile
+static double PercentileMicroseconds(const vector<uint64_t>& sortedLatencies, double percentile)
+{
+    size_t rank = static_cast<size_t>(percentile * sortedLatencies.size() + 0.5);
+    size_t index = rank == 0 ? 0 : std::min(rank - 1, sortedLatencies.size() - 1);
+    return sortedLatencies[index] / 1000.0;
+}
+
+static uint64_t NowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,693 @@
+#include "../PrjFSLib.h"
+#include "../../PrjFSKext/public/PrjFSCommon.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+extern char** environ;
+
+// prjfs-stress registers itself as the provider for an empty directory and
+// projects a synthetic tree of <dirs> directories with <files> files each.
+// Because the kext never calls back into the provider for I/O issued by the
+// provider's own process, the workload runs in a child process that walks the
+// tree from many threads:
+//
+// cold pass -> Every thread reads each directory and stats/opens each file of
+//              the tree in its own random order, so first accesses race and
+//              trigger enumerations and hydrations
+// warm pass -> The same walk once everything is hydrated, which measures the
+//              cost of the kauth and vnode checks alone
+//
+// The provider samples the kext's request statistics while the workload runs
+// to report how many hydrations are waiting on it.
+
+struct Options
+{
+    const char* rootPath;
+    unsigned int directoryCount;
+    unsigned int filesPerDirectory;
+    unsigned long fileSize;
+    unsigned int workloadThreadCount;
+    unsigned int warmPassCount;
+    unsigned int poolThreadCount;
+    unsigned int providerDelayMicroseconds;
+    // 0 uses the library's default
+    unsigned int messageQueueCount;
+    // The workload only reads, so it runs the same against a read-only root
+    bool isReadOnly;
+    bool isWorkload;
+};
+
+enum OperationType
+{
+    Operation_Readdir,
+    Operation_Stat,
+    Operation_Open,
+
+    Operation_Count
+};
+
+struct OperationLatencies
+{
+    vector<uint64_t> nanoseconds[Operation_Count];
+};
+
+struct KextStatistics
+{
+    uint64_t kauthCallbackCount;
+    uint64_t enumerationsSentCount;
+    uint64_t hydrationsSentCount;
+    uint64_t coalescedWaitCount;
+    uint64_t timeoutCount;
+    uint64_t queueFullCount;
+    uint64_t totalWaitNanoseconds;
+    uint64_t maxWaitNanoseconds;
+};
+
+static bool ParseOptions(int argc, char* argv[], Options& options);
+static int RunProvider(const Options& options, char* argv[]);
+static int RunWorkload(const Options& options);
+
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName);
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle);
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath);
+
+static void SampleHydrationQueue(std::atomic<bool>* stopSampling);
+static bool ReadKextStatistics(KextStatistics& stats);
+static bool GetNumberFromDictionary(CFDictionaryRef dictionary, const char* key, uint64_t* value);
+
+static void WalkTree(const Options& options, unsigned int seed, OperationLatencies* latencies);
+static void PrintLatencies(const char* passName, const vector<OperationLatencies>& threadLatencies);
+static double PercentileMilliseconds(const vector<uint64_t>& sortedLatencies, double percentile);
+static uint64_t NowNanoseconds();
+static string DirectoryName(unsigned int directoryIndex);
+static string FileName(unsigned int directoryIndex, unsigned int fileIndex);
+
+static const char* OperationNames[Operation_Count] = { "readdir", "stat", "open" };
+static const uint64_t QueueSampleIntervalMilliseconds = 50;
+static const unsigned int StopDrainTimeoutMilliseconds = 1000;
+
+static Options s_options;
+static char s_rootFullPath[PATH_MAX];
+static PrjFS_Instance* s_instance = nullptr;
+
+// Provider side counters, updated from the library's worker threads
+static std::atomic<uint64_t> s_enumerationCount(0);
+static std::atomic<uint64_t> s_placeholderCount(0);
+static std::atomic<uint64_t> s_placeholderWriteNanoseconds(0);
+static std::atomic<uint64_t> s_hydrationCount(0);
+static std::atomic<uint64_t> s_hydrationNanoseconds(0);
+static std::atomic<uint64_t> s_failedCallbackCount(0);
+
+// Hydrations the kext has sent that the provider has not yet completed,
+// sampled every QueueSampleIntervalMilliseconds
+static uint64_t s_queueSampleCount;
+static uint64_t s_queueLengthSum;
+static uint64_t s_maxQueueLength;
+
+int main(int argc, char* argv[])
+{
+    if (!ParseOptions(argc, argv, s_options))
+    {
+        std::cerr <<
+            "Usage: prjfs-stress <empty directory> [--dirs <count>] [--files <count per dir>] [--file-size <bytes>]\n"
+            "                    [--threads <count>] [--warm-passes <count>] [--pool-threads <count>]\n"
+            "                    [--provider-delay-us <microseconds>] [--message-queues <count>] [--read-only]\n";
+        return 1;
+    }
+
+    // The library needs the full path of the root
+    if (nullptr == realpath(s_options.rootPath, s_rootFullPath))
+    {
+        std::cerr << "Failed to resolve " << s_options.rootPath << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    s_options.rootPath = s_rootFullPath;
+    return s_options.isWorkload ? RunWorkload(s_options) : RunProvider(s_options, argv);
+}
+
+static bool ParseOptions(int argc, char* argv[], Options& options)
+{
+    options = Options
+    {
+        nullptr,    // rootPath
+        100,        // directoryCount
+        100,        // filesPerDirectory
+        4096,       // fileSize
+        8,          // workloadThreadCount
+        1,          // warmPassCount
+        8,          // poolThreadCount
+        0,          // providerDelayMicroseconds
+        0,          // messageQueueCount
+        false,      // isReadOnly
+        false,      // isWorkload
+    };
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (0 == strcmp(argument, "--workload"))
+        {
+            options.isWorkload = true;
+        }
+        else if (0 == strcmp(argument, "--dirs") && hasValue)
+        {
+            options.directoryCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--files") && hasValue)
+        {
+            options.filesPerDirectory = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--file-size") && hasValue)
+        {
+            options.fileSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(argument, "--threads") && hasValue)
+        {
+            options.workloadThreadCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--warm-passes") && hasValue)
+        {
+            options.warmPassCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--pool-threads") && hasValue)
+        {
+            options.poolThreadCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--provider-delay-us") && hasValue)
+        {
+            options.providerDelayMicroseconds = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--message-queues") && hasValue)
+        {
+            options.messageQueueCount = static_cast<unsigned int>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(argument, "--read-only"))
+        {
+            options.isReadOnly = true;
+        }
+        else if (argument[0] != '-' && nullptr == options.rootPath)
+        {
+            options.rootPath = argument;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return
+        nullptr != options.rootPath &&
+        options.directoryCount > 0 &&
+        options.workloadThreadCount > 0 &&
+        options.poolThreadCount > 0;
+}
+
+static int RunProvider(const Options& options, char* argv[])
+{
+    PrjFS_Result result = PrjFS_ConvertDirectoryToVirtualizationRoot(options.rootPath);
+    if (PrjFS_Result_Success != result)
+    {
+        std::cerr << "Failed to convert " << options.rootPath << " to a virtualization root: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+
+    result = PrjFS_SetMessageQueueCount(options.messageQueueCount);
+    if (PrjFS_Result_Success != result)
+    {
+        std::cerr << "Invalid message queue count " << options.messageQueueCount << "\n";
+        return 1;
+    }
+
+    PrjFS_Callbacks callbacks = { EnumerateDirectoryCallback, GetFileStreamCallback, NotifyOperationCallback };
+    result = PrjFS_StartVirtualizationInstance(
+        options.rootPath,
+        callbacks,
+        options.poolThreadCount,
+        options.isReadOnly ? PrjFS_InstanceFlags_ReadOnly : PrjFS_InstanceFlags_None,
+        &s_instance);
+    if (PrjFS_Result_Success != result)
+    {
+        std::cerr << "Failed to start virtualization instance: 0x" << std::hex << result << std::dec << "\n";
+        return 1;
+    }
+
+    // The child gets the same arguments, so that both sides agree on the shape of the tree
+    vector<char*> workloadArguments;
+    for (char** argument = argv; nullptr != *argument; ++argument)
+    {
+        workloadArguments.push_back(*argument);
+    }
+
+    char workloadFlag[] = "--workload";
+    workloadArguments.push_back(workloadFlag);
+    workloadArguments.push_back(nullptr);
+
+    std::atomic<bool> stopSampling(false);
+    std::thread sampler(SampleHydrationQueue, &stopSampling);
+
+    uint64_t startNanoseconds = NowNanoseconds();
+    pid_t workloadPid;
+    int workloadStatus = 1;
+    int error = posix_spawnp(&workloadPid, argv[0], nullptr, nullptr, workloadArguments.data(), environ);
+    if (0 != error)
+    {
+        std::cerr << "Failed to start the workload process: " << strerror(error) << "\n";
+    }
+    else
+    {
+        while (-1 == waitpid(workloadPid, &workloadStatus, 0) && EINTR == errno)
+        {
+        }
+    }
+
+    uint64_t elapsedNanoseconds = NowNanoseconds() - startNanoseconds;
+    stopSampling = true;
+    sampler.join();
+
+    uint64_t enumerationCount = s_enumerationCount;
+    uint64_t placeholderCount = s_placeholderCount;
+    uint64_t hydrationCount = s_hydrationCount;
+    printf("=== Provider (%.3f s) ===\n", elapsedNanoseconds / 1e9);
+    printf(
+        "enumerations %llu, placeholders written %llu (%.3f us each), hydrations %llu (%.3f us each), failed callbacks %llu\n",
+        enumerationCount,
+        placeholderCount,
+        placeholderCount > 0 ? s_placeholderWriteNanoseconds / 1000.0 / placeholderCount : 0.0,
+        hydrationCount,
+        hydrationCount > 0 ? s_hydrationNanoseconds / 1000.0 / hydrationCount : 0.0,
+        s_failedCallbackCount.load());
+    printf(
+        "hydration queue length: mean %.2f, max %llu over %llu samples\n",
+        s_queueSampleCount > 0 ? static_cast<double>(s_queueLengthSum) / s_queueSampleCount : 0.0,
+        s_maxQueueLength,
+        s_queueSampleCount);
+
+    KextStatistics stats;
+    if (ReadKextStatistics(stats))
+    {
+        uint64_t waitCount = stats.enumerationsSentCount + stats.hydrationsSentCount + stats.coalescedWaitCount;
+        printf("=== Kext ===\n");
+        printf(
+            "kauth callbacks %llu, enumerations sent %llu, hydrations sent %llu, coalesced waits %llu, timeouts %llu, queue full events %llu\n",
+            stats.kauthCallbackCount,
+            stats.enumerationsSentCount,
+            stats.hydrationsSentCount,
+            stats.coalescedWaitCount,
+            stats.timeoutCount,
+            stats.queueFullCount);
+        printf(
+            "provider wait: mean %.3f ms, max %.3f ms\n",
+            waitCount > 0 ? stats.totalWaitNanoseconds / 1e6 / waitCount : 0.0,
+            stats.maxWaitNanoseconds / 1e6);
+    }
+    else
+    {
+        printf("Kext statistics are not available\n");
+    }
+
+    PrjFS_StopVirtualizationInstance(s_instance, StopDrainTimeoutMilliseconds);
+
+    if (0 != error || !WIFEXITED(workloadStatus))
+    {
+        return 1;
+    }
+
+    return WEXITSTATUS(workloadStatus);
+}
+
+static int RunWorkload(const Options& options)
+{
+    std::random_device randomDevice;
+    unsigned int baseSeed = randomDevice();
+
+    for (unsigned int pass = 0; pass <= options.warmPassCount; ++pass)
+    {
+        vector<OperationLatencies> threadLatencies(options.workloadThreadCount);
+        vector<std::thread> threads;
+        uint64_t startNanoseconds = NowNanoseconds();
+        for (unsigned int i = 0; i < options.workloadThreadCount; ++i)
+        {
+            threads.emplace_back(WalkTree, std::cref(options), baseSeed + pass * options.workloadThreadCount + i, &threadLatencies[i]);
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        char passName[32];
+        snprintf(passName, sizeof(passName), pass == 0 ? "cold" : "warm %u", pass);
+        printf("=== Workload %s pass (%.3f s, %u threads) ===\n", passName, (NowNanoseconds() - startNanoseconds) / 1e9, options.workloadThreadCount);
+        PrintLatencies(passName, threadLatencies);
+    }
+
+    return 0;
+}
+
+static PrjFS_Result EnumerateDirectoryCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName)
+{
+    s_enumerationCount++;
+
+    // The root lists the directories, each directory lists its files
+    bool isRoot = '\0' == relativePath[0] || 0 == strcmp(relativePath, ".");
+    unsigned int directoryIndex = 0;
+    if (!isRoot && 1 != sscanf(relativePath, "dir%u", &directoryIndex))
+    {
+        return PrjFS_Result_Success;
+    }
+
+    unsigned char providerId[PrjFS_PlaceholderIdLength] = {};
+    unsigned char contentId[PrjFS_PlaceholderIdLength] = {};
+    unsigned int entryCount = isRoot ? s_options.directoryCount : s_options.filesPerDirectory;
+    for (unsigned int i = 0; i < entryCount; ++i)
+    {
+        string path = isRoot ? DirectoryName(i) : FileName(directoryIndex, i);
+        uint64_t startNanoseconds = NowNanoseconds();
+        PrjFS_Result result =
+            isRoot ?
+            PrjFS_WritePlaceholderDirectory(s_instance, path.c_str()) :
+            PrjFS_WritePlaceholderFile(s_instance, path.c_str(), providerId, contentId, s_options.fileSize, 0644);
+        s_placeholderWriteNanoseconds += NowNanoseconds() - startNanoseconds;
+
+        if (PrjFS_Result_Success != result)
+        {
+            s_failedCallbackCount++;
+            return result;
+        }
+
+        s_placeholderCount++;
+    }
+
+    return PrjFS_Result_Success;
+}
+
+static PrjFS_Result GetFileStreamCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    const PrjFS_FileHandle* fileHandle)
+{
+    uint64_t startNanoseconds = NowNanoseconds();
+    if (s_options.providerDelayMicroseconds > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(s_options.providerDelayMicroseconds));
+    }
+
+    static const unsigned int ChunkSize = 64 * 1024;
+    static const vector<char> chunk(ChunkSize, 'x');
+
+    PrjFS_Result result = PrjFS_Result_Success;
+    for (unsigned long remaining = s_options.fileSize; remaining > 0 && PrjFS_Result_Success == result; )
+    {
+        unsigned int byteCount = static_cast<unsigned int>(std::min<unsigned long>(remaining, ChunkSize));
+        result = PrjFS_WriteFileContents(fileHandle, chunk.data(), byteCount);
+        remaining -= byteCount;
+    }
+
+    s_hydrationNanoseconds += NowNanoseconds() - startNanoseconds;
+    s_hydrationCount++;
+    if (PrjFS_Result_Success != result)
+    {
+        s_failedCallbackCount++;
+    }
+
+    return result;
+}
+
+static PrjFS_Result NotifyOperationCallback(
+    unsigned long commandId,
+    const char* relativePath,
+    unsigned char providerId[PrjFS_PlaceholderIdLength],
+    unsigned char contentId[PrjFS_PlaceholderIdLength],
+    int triggeringProcessId,
+    const char* triggeringProcessName,
+    bool isDirectory,
+    PrjFS_NotificationType notificationType,
+    const char* destinationRelativePath)
+{
+    return PrjFS_Result_Success;
+}
+
+static void SampleHydrationQueue(std::atomic<bool>* stopSampling)
+{
+    while (!*stopSampling)
+    {
+        KextStatistics stats;
+        if (ReadKextStatistics(stats))
+        {
+            // Both counters only grow, but they are read at slightly different times
+            uint64_t completed = s_hydrationCount;
+            uint64_t queueLength = stats.hydrationsSentCount > completed ? stats.hydrationsSentCount - completed : 0;
+
+            s_queueSampleCount++;
+            s_queueLengthSum += queueLength;
+            s_maxQueueLength = std::max(s_maxQueueLength, queueLength);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(QueueSampleIntervalMilliseconds));
+    }
+}
+
+// The kext publishes statistics on each provider user client; ours is the one
+// whose creator is this process.
+static bool ReadKextStatistics(KextStatistics& stats)
+{
+    io_service_t prjfsService = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(PrjFSServiceClass)); // matching dictionary consumed
+    if (IO_OBJECT_NULL == prjfsService)
+    {
+        return false;
+    }
+
+    io_iterator_t clients = IO_OBJECT_NULL;
+    kern_return_t result = IORegistryEntryGetChildIterator(prjfsService, kIOServicePlane, &clients);
+    IOObjectRelease(prjfsService);
+    if (KERN_SUCCESS != result)
+    {
+        return false;
+    }
+
+    char expectedCreator[32];
+    snprintf(expectedCreator, sizeof(expectedCreator), "pid %d,", getpid());
+
+    bool found = false;
+    io_registry_entry_t client;
+    while (!found && IO_OBJECT_NULL != (client = IOIteratorNext(clients)))
+    {
+        // Fetching all properties, rather than just the statistics key, makes the kext refresh them
+        CFMutableDictionaryRef properties = nullptr;
+        if (KERN_SUCCESS == IORegistryEntryCreateCFProperties(client, &properties, kCFAllocatorDefault, 0))
+        {
+            CFTypeRef creator = CFDictionaryGetValue(properties, CFSTR("IOUserClientCreator"));
+            CFTypeRef statistics = CFDictionaryGetValue(properties, CFSTR(PrjFSProviderStatisticsKey));
+            char creatorString[64];
+            if (nullptr != creator &&
+                CFStringGetTypeID() == CFGetTypeID(creator) &&
+                CFStringGetCString(static_cast<CFStringRef>(creator), creatorString, sizeof(creatorString), kCFStringEncodingUTF8) &&
+                0 == strncmp(creatorString, expectedCreator, strlen(expectedCreator)) &&
+                nullptr != statistics &&
+                CFDictionaryGetTypeID() == CFGetTypeID(statistics))
+            {
+                CFDictionaryRef statisticsDictionary = static_cast<CFDictionaryRef>(statistics);
+                found =
+                    GetNumberFromDictionary(statisticsDictionary, "KauthCallbacks", &stats.kauthCallbackCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "EnumerationsSent", &stats.enumerationsSentCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "HydrationsSent", &stats.hydrationsSentCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "CoalescedWaits", &stats.coalescedWaitCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "Timeouts", &stats.timeoutCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "QueueFullEvents", &stats.queueFullCount) &&
+                    GetNumberFromDictionary(statisticsDictionary, "TotalWaitNanoseconds", &stats.totalWaitNanoseconds) &&
+                    GetNumberFromDictionary(statisticsDictionary, "MaxWaitNanoseconds", &stats.maxWaitNanoseconds);
+            }
+
+            CFRelease(properties);
+        }
+
+        IOObjectRelease(client);
+    }
+
+    IOObjectRelease(clients);
+    return found;
+}
+
+static bool GetNumberFromDictionary(CFDictionaryRef dictionary, const char* key, uint64_t* value)
+{
+    CFStringRef keyString = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingUTF8);
+    CFTypeRef number = CFDictionaryGetValue(dictionary, keyString);
+    CFRelease(keyString);
+
+    return
+        nullptr != number &&
+        CFNumberGetTypeID() == CFGetTypeID(number) &&
+        CFNumberGetValue(static_cast<CFNumberRef>(number), kCFNumberSInt64Type, value);
+}
+
+static void WalkTree(const Options& options, unsigned int seed, OperationLatencies* latencies)
+{
+    std::mt19937 random(seed);
+    vector<unsigned int> directoryOrder(options.directoryCount);
+    vector<unsigned int> fileOrder(options.filesPerDirectory);
+    for (unsigned int i = 0; i < options.directoryCount; ++i)
+    {
+        directoryOrder[i] = i;
+    }
+
+    for (unsigned int i = 0; i < options.filesPerDirectory; ++i)
+    {
+        fileOrder[i] = i;
+    }
+
+    std::shuffle(directoryOrder.begin(), directoryOrder.end(), random);
+
+    string rootPath(options.rootPath);
+    for (unsigned int directoryIndex : directoryOrder)
+    {
+        string directoryPath = rootPath + "/" + DirectoryName(directoryIndex);
+
+        uint64_t startNanoseconds = NowNanoseconds();
+        DIR* directory = opendir(directoryPath.c_str());
+        if (nullptr != directory)
+        {
+            while (nullptr != readdir(directory))
+            {
+            }
+
+            closedir(directory);
+        }
+
+        latencies->nanoseconds[Operation_Readdir].push_back(NowNanoseconds() - startNanoseconds);
+
+        std::shuffle(fileOrder.begin(), fileOrder.end(), random);
+
+        for (unsigned int fileIndex : fileOrder)
+        {
+            string filePath = rootPath + "/" + FileName(directoryIndex, fileIndex);
+
+            struct stat fileAttributes;
+            startNanoseconds = NowNanoseconds();
+            lstat(filePath.c_str(), &fileAttributes);
+            latencies->nanoseconds[Operation_Stat].push_back(NowNanoseconds() - startNanoseconds);
+
+            // Reading a byte makes sure the whole open -> hydrate path is measured
+            startNanoseconds = NowNanoseconds();
+            int fd = open(filePath.c_str(), O_RDONLY);
+            if (fd >= 0)
+            {
+                char byte;
+                read(fd, &byte, 1);
+                close(fd);
+            }
+
+            latencies->nanoseconds[Operation_Open].push_back(NowNanoseconds() - startNanoseconds);
+        }
+    }
+}
+
+static void PrintLatencies(const char* passName, const vector<OperationLatencies>& threadLatencies)
+{
+    for (int operation = 0; operation < Operation_Count; ++operation)
+    {
+        vector<uint64_t> latencies;
+        for (const OperationLatencies& thread : threadLatencies)
+        {
+            latencies.insert(latencies.end(), thread.nanoseconds[operation].begin(), thread.nanoseconds[operation].end());
+        }
+
+        if (latencies.empty())
+        {
+            continue;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        printf(
+            "%-8s %-7s n=%-9zu p50=%9.3f p95=%9.3f p99=%9.3f max=%9.3f ms\n",
+            passName,
+            OperationNames[operation],
+            latencies.size(),
+            PercentileMilliseconds(latencies, 0.50),
+            PercentileMilliseconds(latencies, 0.95),
+            PercentileMilliseconds(latencies, 0.99),
+            latencies.back() / 1000000.0);
+    }
+
+    fflush(stdout);
+}
+
+// Nearest-rank percentile
+static double PercentileMilliseconds(const vector<uint64_t>& sortedLatencies, double percentile)
+{
+    size_t rank = static_cast<size_t>(percentile * sortedLatencies.size() + 0.5);
+    size_t index = rank == 0 ? 0 : std::min(rank - 1, sortedLatencies.size() - 1);
+    return sortedLatencies[index] / 1000000.0;
+}
+
+static uint64_t NowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static string DirectoryName(unsigned int directoryIndex)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "dir%06u", directoryIndex);
+    return name;
+}
+
+static string FileName(unsigned int directoryIndex, unsigned int fileIndex)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "dir%06u/file%07u", directoryIndex, fileIndex);
+    return name;
+}
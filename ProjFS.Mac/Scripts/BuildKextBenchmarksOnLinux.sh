@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Builds the PrjFSKextBenchmarks tool without Xcode, for profiling the kext's
+# hot paths on Linux. Any arguments are passed on to the benchmarks, which are
+# run once the build succeeds.
+
+SCRIPTDIR=$(dirname ${BASH_SOURCE[0]})
+SRCDIR=$SCRIPTDIR/../..
+ROOTDIR=$SRCDIR/..
+
+KEXTDIR=$SRCDIR/ProjFS.Mac/PrjFSKext
+BENCHMARKSDIR=$KEXTDIR/PrjFSKextBenchmarks
+OUTDIR=$ROOTDIR/BuildOutput/ProjFS.Mac/KextBenchmarks
+
+CXX=${CXX:-c++}
+
+# Same sources as the Xcode target. C++2b is only for <stdatomic.h>, which
+# libstdc++ supports from C++23 on. -Wno-unknown-pragmas is for the clang
+# pragmas in the kernel header wrappers.
+SOURCES="
+  $KEXTDIR/PrjFSKext/KauthHandler.cpp
+  $KEXTDIR/PrjFSKext/VirtualizationRoots.cpp
+  $KEXTDIR/PrjFSKext/VnodeCache.cpp
+  $KEXTDIR/PrjFSKext/ProcessPolicy.cpp
+  $KEXTDIR/PrjFSKext/ProcessAttribution.cpp
+  $KEXTDIR/PrjFSKext/Message_Kernel.cpp
+  $KEXTDIR/PrjFSKext/VnodeUtilities.cpp
+  $BENCHMARKSDIR/MockKernel.cpp
+  $BENCHMARKSDIR/MockKextSupport.cpp
+  $BENCHMARKSDIR/PrjFSKextBenchmarks.cpp"
+
+mkdir -p $OUTDIR || exit 1
+
+$CXX -std=gnu++2b -O2 -Wall -Wno-unknown-pragmas -Wno-volatile \
+  -DMACH_ASSERT=1 -DKEXT_UNIT_TESTING=1 \
+  -I$BENCHMARKSDIR/MockKernelHeaders \
+  -I$BENCHMARKSDIR/LinuxHeaders \
+  -I$KEXTDIR/PrjFSKext \
+  -I$KEXTDIR/public \
+  -include $BENCHMARKSDIR/LinuxHeaders/DarwinCompat.h \
+  $SOURCES \
+  -o $OUTDIR/PrjFSKextBenchmarks \
+  -lpthread || exit 1
+
+$OUTDIR/PrjFSKextBenchmarks "$@"